@@ -23,6 +23,8 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
 #endif
 #include <math.h>
 #include <stdio.h>
@@ -539,6 +541,7 @@ int WDL_ConvolutionEngine::Avail(int want)
         if (allow_mono_input_mode && 
           ch < m_proc_nch-1 && 
           srcc<m_impulse_nch-1 && 
+          m_samplesin[ch+1].Available() == m_samplesin[ch].Available() + in_needed*(int)sizeof(WDL_FFT_REAL) && // ch+1 is at the same block
           !CompareQueueToBuf(&m_samplesin[ch+1],optr+sz,sz*sizeof(WDL_FFT_REAL))
           )
         {
@@ -588,6 +591,8 @@ int WDL_ConvolutionEngine::Avail(int want)
         if (++m_hist_pos[ch+1] >= nblocks) m_hist_pos[ch+1]=0;
         WDL_FFT_REAL *optr2 = m_samplehist[ch+1].Get()+m_hist_pos[ch+1]*m_fft_size*2;   
         memcpy(optr2,optr,m_fft_size*2*sizeof(WDL_FFT_REAL));
+        if (useSilentList && m_samplehist_zflag[ch+1].GetSize()==nblocks)
+          m_samplehist_zflag[ch+1].Get()[m_hist_pos[ch+1]]=useSilentList[histpos]; // otherwise a stale flag could include this block
       }
 
       int applycnt=0;
@@ -705,17 +710,286 @@ void WDL_ConvolutionEngine::Advance(int len)
 **  low latency version
 */
 
+// runs one tail partition of WDL_ConvolutionEngine_Div on its own thread. the caller queues input
+// and collects output, the engine itself is only touched by whoever holds m_busy (normally the worker,
+// or the caller if it needs a block that the worker hasn't started on yet).
+class WDL_ConvolutionEngine_Div::TailWorker
+{
+public:
+  TailWorker(WDL_ConvolutionEngine *eng, int delay)
+  {
+    m_eng=eng;
+    m_delay=delay;
+    m_blocksize=eng->GetLatency();
+    m_in_nch=0;
+    m_in_pos=0;
+    m_owed=0;
+    m_busy=false;
+    m_quit=false;
+#ifdef _WIN32
+    InitializeCriticalSection(&m_mx);
+    m_ev_work=CreateEvent(NULL,FALSE,FALSE,NULL);
+    m_ev_done=CreateEvent(NULL,FALSE,FALSE,NULL);
+    DWORD tid;
+    m_thread=CreateThread(NULL,0,ThreadProc,this,0,&tid);
+#else
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+#ifdef __linux__
+    pthread_mutexattr_setprotocol(&attr,PTHREAD_PRIO_INHERIT); // the caller may be a realtime thread
+#endif
+    pthread_mutex_init(&m_mx,&attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_cond_init(&m_cond_work,NULL);
+    pthread_cond_init(&m_cond_done,NULL);
+    m_has_thread=!pthread_create(&m_thread,NULL,ThreadProc,this);
+#endif
+  }
+  ~TailWorker()
+  {
+    Lock();
+    m_quit=true;
+    SignalWork();
+    Unlock();
+#ifdef _WIN32
+    if (m_thread)
+    {
+      WaitForSingleObject(m_thread,INFINITE);
+      CloseHandle(m_thread);
+    }
+    CloseHandle(m_ev_work);
+    CloseHandle(m_ev_done);
+    DeleteCriticalSection(&m_mx);
+#else
+    if (m_has_thread) pthread_join(m_thread,NULL);
+    pthread_cond_destroy(&m_cond_done);
+    pthread_cond_destroy(&m_cond_work);
+    pthread_mutex_destroy(&m_mx);
+#endif
+    delete m_eng;
+  }
+
+  int GetDelay() { return m_delay; }
+
+  void Reset()
+  {
+    Lock();
+    while (m_busy) WaitDone();
+    m_eng->Reset();
+    int x;
+    for (x = 0; x < WDL_CONVO_MAX_PROC_NCH; x ++)
+    {
+      m_in[x].Clear();
+      m_done[x].Clear();
+      m_out[x].Clear();
+    }
+    Unlock();
+    m_in_pos=0;
+    m_owed=0;
+  }
+
+  void Add(WDL_FFT_REAL **bufs, int len, int nch)
+  {
+    int x;
+    Lock();
+    if (nch != m_in_nch)
+    {
+      // the engine sees each block with the channel count it was queued with
+      while (m_in[0].Available()) if (!RunPending()) WaitDone();
+      for (x = nch; x < WDL_CONVO_MAX_PROC_NCH; x ++) m_in[x].Clear();
+      m_in_nch=nch;
+    }
+    for (x = 0; x < nch; x ++)
+    {
+      if (bufs && bufs[x]) m_in[x].Add(bufs[x],len*sizeof(WDL_FFT_REAL));
+      else memset(m_in[x].Add(NULL,len*sizeof(WDL_FFT_REAL)),0,len*sizeof(WDL_FFT_REAL));
+    }
+
+    m_in_pos+=len;
+    const int full=(m_in_pos/m_blocksize)*m_blocksize;
+    if (full>0)
+    {
+      m_in_pos-=full;
+      m_owed+=full;
+      SignalWork();
+    }
+    Unlock();
+  }
+
+  void AddSilenceToOutput(int len, int nch)
+  {
+    int x;
+    for (x = 0; x < nch; x ++)
+      memset(m_out[x].Add(NULL,len*sizeof(WDL_FFT_REAL)),0,len*sizeof(WDL_FFT_REAL));
+  }
+
+  int Avail(int want)
+  {
+    int have=(int) (m_out[0].Available()/sizeof(WDL_FFT_REAL));
+    if (want > have+m_owed) want=have+m_owed; // output past this needs input we don't have yet
+
+    if (have < want)
+    {
+      Lock();
+      for (;;)
+      {
+        have+=CollectDone();
+        if (have >= want) break;
+
+        // deadline: finish the block here if the worker hasn't picked it up, otherwise wait for it
+        if (!RunPending())
+        {
+          if (!m_busy) break;
+          WaitDone();
+        }
+      }
+      Unlock();
+    }
+    return have;
+  }
+
+  WDL_FFT_REAL **Get()
+  {
+    int x;
+    for (x = 0; x < WDL_CONVO_MAX_PROC_NCH; x ++) m_get_tmpptrs[x]=(WDL_FFT_REAL *)m_out[x].Get();
+    return m_get_tmpptrs;
+  }
+
+  void Advance(int len)
+  {
+    int x;
+    for (x = 0; x < WDL_CONVO_MAX_PROC_NCH; x ++)
+    {
+      if (m_out[x].Available()) m_out[x].Advance(len*sizeof(WDL_FFT_REAL));
+      m_out[x].Compact();
+    }
+  }
+
+private:
+  // m_mx must be held. returns false if the engine is busy or there is no input to process
+  bool RunPending()
+  {
+    if (m_busy) return false;
+    const int nch=m_in_nch;
+    const int len=(int) (m_in[0].Available()/sizeof(WDL_FFT_REAL));
+    if (len<1) return false;
+
+    WDL_FFT_REAL *bufs[WDL_CONVO_MAX_PROC_NCH];
+    int x;
+    for (x = 0; x < nch; x ++)
+    {
+      bufs[x]=m_work[x].Resize(len,false);
+      memcpy(bufs[x],m_in[x].Get(),len*sizeof(WDL_FFT_REAL));
+      m_in[x].Clear();
+    }
+    m_busy=true;
+    Unlock();
+
+    m_eng->Add(bufs,len,nch);
+    const int a=m_eng->Avail(len+m_blocksize); // at most this many complete blocks
+    WDL_FFT_REAL **p=m_eng->Get();
+
+    Lock();
+    if (a>0)
+    {
+      for (x = 0; x < nch; x ++) m_done[x].Add(p[x],a*sizeof(WDL_FFT_REAL));
+      m_eng->Advance(a);
+    }
+    m_busy=false;
+    SignalDone();
+    return true;
+  }
+
+  // m_mx must be held. moves finished output to m_out, returns the number of samples moved
+  int CollectDone()
+  {
+    const int a=(int) (m_done[0].Available()/sizeof(WDL_FFT_REAL));
+    if (a<1) return 0;
+    const int len0=(int) m_out[0].Available() + a*(int)sizeof(WDL_FFT_REAL);
+    int x;
+    for (x = 0; x < WDL_CONVO_MAX_PROC_NCH; x ++)
+    {
+      const int n=(int) m_done[x].Available();
+      const int pad=len0 - (int) m_out[x].Available() - n; // channel added since the last reset
+      if (x && x < m_in_nch && pad>0) memset(m_out[x].Add(NULL,pad),0,pad);
+      if (n) m_out[x].Add(m_done[x].Get(),n);
+      m_done[x].Clear();
+    }
+    m_owed-=a;
+    return a;
+  }
+
+#ifdef _WIN32
+  void Lock() { EnterCriticalSection(&m_mx); }
+  void Unlock() { LeaveCriticalSection(&m_mx); }
+  void SignalWork() { SetEvent(m_ev_work); }
+  void SignalDone() { SetEvent(m_ev_done); }
+  void WaitDone() { Unlock(); WaitForSingleObject(m_ev_done,INFINITE); Lock(); }
+  void WaitWork() { Unlock(); WaitForSingleObject(m_ev_work,INFINITE); Lock(); }
+
+  static DWORD WINAPI ThreadProc(LPVOID p)
+#else
+  void Lock() { pthread_mutex_lock(&m_mx); }
+  void Unlock() { pthread_mutex_unlock(&m_mx); }
+  void SignalWork() { pthread_cond_signal(&m_cond_work); }
+  void SignalDone() { pthread_cond_broadcast(&m_cond_done); }
+  void WaitDone() { pthread_cond_wait(&m_cond_done,&m_mx); }
+  void WaitWork() { pthread_cond_wait(&m_cond_work,&m_mx); }
+
+  static void *ThreadProc(void *p)
+#endif
+  {
+    TailWorker *_this=(TailWorker *)p;
+    _this->Lock();
+    while (!_this->m_quit)
+    {
+      if (!_this->RunPending()) _this->WaitWork();
+    }
+    _this->Unlock();
+    return 0;
+  }
+
+  WDL_ConvolutionEngine *m_eng;
+  int m_delay, m_blocksize;
+
+  // caller only
+  WDL_Queue m_out[WDL_CONVO_MAX_PROC_NCH];
+  WDL_FFT_REAL *m_get_tmpptrs[WDL_CONVO_MAX_PROC_NCH];
+  int m_in_pos; // samples into the current block
+  int m_owed; // samples of output due from complete blocks but not yet in m_out
+
+  // protected by m_mx
+  WDL_Queue m_in[WDL_CONVO_MAX_PROC_NCH], m_done[WDL_CONVO_MAX_PROC_NCH];
+  int m_in_nch;
+  bool m_busy, m_quit;
+
+  // whoever holds m_busy
+  WDL_TypedBuf<WDL_FFT_REAL> m_work[WDL_CONVO_MAX_PROC_NCH];
+
+#ifdef _WIN32
+  CRITICAL_SECTION m_mx;
+  HANDLE m_ev_work, m_ev_done, m_thread;
+#else
+  pthread_mutex_t m_mx;
+  pthread_cond_t m_cond_work, m_cond_done;
+  pthread_t m_thread;
+  bool m_has_thread;
+#endif
+};
+
 WDL_ConvolutionEngine_Div::WDL_ConvolutionEngine_Div()
 {
   timingInit();
   m_proc_nch=2;
   m_need_feedsilence=true;
+  m_threaded_tail=false;
 }
 
 int WDL_ConvolutionEngine_Div::SetImpulse(WDL_ImpulseBuffer *impulse, int maxfft_size, int known_blocksize, int max_imp_size, int impulse_offset, int latency_allowed)
 {
   m_need_feedsilence=true;
 
+  m_tailworkers.Empty(true);
   m_engines.Empty(true);
   if (maxfft_size<0)maxfft_size=-maxfft_size;
   maxfft_size*=2;
@@ -740,6 +1014,12 @@ int WDL_ConvolutionEngine_Div::SetImpulse(WDL_ImpulseBuffer *impulse, int maxfft
     fftsize=impulsechunksize=x;
   }
 
+  // threaded partitions use fftsize=offs rather than offs*2, so a block is not needed until one block after it completes.
+  // blocks must be at least the host block size for that to span a whole Add()/Avail() call.
+  int tail_minblock=known_blocksize>0 ? known_blocksize : 1024;
+  if (tail_minblock<256) tail_minblock=256;
+  bool tail=false;
+
   int offs=0;
   int samplesleft=impulse->impulses[0].GetSize()-impulse_offset;
   if (max_imp_size>0 && samplesleft>max_imp_size) samplesleft=max_imp_size;
@@ -755,7 +1035,8 @@ int WDL_ConvolutionEngine_Div::SetImpulse(WDL_ImpulseBuffer *impulse, int maxfft
     eng->SetImpulse(impulse,fftsize,offs+impulse_offset,impulsechunksize, wantBrute);
     eng->m_zl_delaypos = offs;
     eng->m_zl_dumpage=0;
-    m_engines.Add(eng);
+    if (tail) m_tailworkers.Add(new TailWorker(eng,offs));
+    else m_engines.Add(eng);
 
 #ifdef WDLCONVO_ZL_ACCOUNTING
     char buf[512];
@@ -769,6 +1050,11 @@ int WDL_ConvolutionEngine_Div::SetImpulse(WDL_ImpulseBuffer *impulse, int maxfft
 #if 1 // this seems about 10% faster (maybe due to better cache use from less sized ffts used?)
     impulsechunksize=offs*3;
     fftsize=offs*2;
+    if (m_threaded_tail && offs >= tail_minblock*2)
+    {
+      fftsize=offs;
+      tail=true;
+    }
 #else
     impulsechunksize=fftsize;
 
@@ -794,6 +1080,10 @@ void WDL_ConvolutionEngine_Div::Reset()
     WDL_ConvolutionEngine *eng=m_engines.Get(x);
     eng->Reset();
   }
+  for (x = 0; x < m_tailworkers.GetSize(); x ++)
+  {
+    m_tailworkers.Get(x)->Reset();
+  }
   for (x = 0; x < WDL_CONVO_MAX_PROC_NCH; x ++)
   {
     m_samplesout[x].Clear();
@@ -805,6 +1095,7 @@ void WDL_ConvolutionEngine_Div::Reset()
 WDL_ConvolutionEngine_Div::~WDL_ConvolutionEngine_Div()
 {
   timingPrint();
+  m_tailworkers.Empty(true);
   m_engines.Empty(true);
 }
 
@@ -832,6 +1123,12 @@ void WDL_ConvolutionEngine_Div::Add(WDL_FFT_REAL **bufs, int len, int nch)
     if (ns) eng->AddSilenceToOutput(eng->m_zl_delaypos,nch); // add silence to output (to delay output to its correct time)
 
   }
+  for (x = 0; x < m_tailworkers.GetSize(); x ++)
+  {
+    TailWorker *w=m_tailworkers.Get(x);
+    w->Add(bufs,len,nch);
+    if (ns) w->AddSilenceToOutput(w->GetDelay(),nch);
+  }
 }
 WDL_FFT_REAL **WDL_ConvolutionEngine_Div::Get() 
 {
@@ -887,6 +1184,11 @@ int WDL_ConvolutionEngine_Div::Avail(int wantSamples)
 #endif
     if (a < wantSamples) wantSamples=a;
   }
+  for (x = 0; x < m_tailworkers.GetSize(); x ++)
+  {
+    int a=m_tailworkers.Get(x)->Avail(wso);
+    if (a < wantSamples) wantSamples=a;
+  }
 
 #ifdef WDLCONVO_ZL_ACCOUNTING
   static DWORD lastt=0;
@@ -927,6 +1229,20 @@ int WDL_ConvolutionEngine_Div::Avail(int wantSamples)
       }
       eng->Advance(wantSamples);
     }
+    for (x = 0; x < m_tailworkers.GetSize(); x ++)
+    {
+      TailWorker *w=m_tailworkers.Get(x);
+      WDL_FFT_REAL **p=w->Get();
+      int i;
+      for (i =0; i < m_proc_nch; i ++)
+      {
+        WDL_FFT_REAL *o=tp[i];
+        WDL_FFT_REAL *in=p[i];
+        int j=wantSamples;
+        while (j-->0) *o++ += *in++;
+      }
+      w->Advance(wantSamples);
+    }
   }
   timingLeave(1);
 
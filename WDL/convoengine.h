@@ -135,6 +135,11 @@ public:
   WDL_ConvolutionEngine_Div();
   ~WDL_ConvolutionEngine_Div();
 
+  // call before SetImpulse(). when enabled, partitions with blocks of at least known_blocksize (1024 if unknown)
+  // samples are laid out with a block of slack and computed on worker threads (one per partition), so Add()/Avail()
+  // only run the head partitions. if a worker misses its deadline the caller finishes that block itself.
+  void SetThreadedTail(bool enable) { m_threaded_tail=enable; }
+
   int SetImpulse(WDL_ImpulseBuffer *impulse, int maxfft_size=0, int known_blocksize=0, int max_imp_size=0, int impulse_offset=0, int latency_allowed=0);
 
   int GetLatency();
@@ -147,13 +152,17 @@ public:
   void Advance(int len);
 
 private:
+  class TailWorker;
+
   WDL_PtrList<WDL_ConvolutionEngine> m_engines;
+  WDL_PtrList<TailWorker> m_tailworkers; // partitions after m_engines, when m_threaded_tail
 
   WDL_Queue m_samplesout[WDL_CONVO_MAX_PROC_NCH];
   WDL_FFT_REAL *m_get_tmpptrs[WDL_CONVO_MAX_PROC_NCH];
 
   int m_proc_nch;
   bool m_need_feedsilence;
+  bool m_threaded_tail;
 
 } WDL_FIXALIGN;
 
@@ -0,0 +1,182 @@
+/*
+  convoengine_test.cpp
+  checks WDL_ConvolutionEngine output against a direct convolution, and
+  WDL_ConvolutionEngine_Div with threaded tail partitions against the synchronous engine
+
+  gcc -O2 -c fft.c && g++ -O2 -o convoengine_test convoengine_test.cpp convoengine.cpp fft.o -lpthread
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "convoengine.h"
+
+#define MAX_LEN 40000
+
+static unsigned int g_rs=1;
+static double rnd() { g_rs=g_rs*1103515245+12345; return ((g_rs>>8)&0xffff)/32768.0-1.0; }
+
+static WDL_FFT_REAL g_in[2][MAX_LEN], g_out[2][MAX_LEN];
+
+static void make_impulse(WDL_ImpulseBuffer *imp, int nch, int len)
+{
+  imp->SetNumChannels(nch);
+  for (int c=0;c<nch;c++)
+  {
+    WDL_FFT_REAL *p=imp->impulses[c].Resize(len);
+    for (int i=0;i<len;i++) p[i]=(WDL_FFT_REAL) (rnd()*exp(-3.0*i/len));
+  }
+}
+
+// largest difference between out[c][0..len) and the direct convolution of in[c] with the impulse,
+// relative to the largest output sample
+static double check_output(WDL_ImpulseBuffer *imp, int nch, int len, int ioffs, int ilen)
+{
+  double maxd=0.0, peak=1e-9;
+  for (int c=0;c<nch;c++)
+  {
+    const WDL_FFT_REAL *ir=imp->impulses[imp->GetNumChannels()>c?c:0].Get()+ioffs;
+    for (int i=0;i<len;i++)
+    {
+      double s=0.0;
+      for (int k=0;k<ilen && k<=i;k++) s+=ir[k]*g_in[c][i-k];
+      const double d=fabs(s-g_out[c][i]);
+      if (d>maxd) maxd=d;
+      if (fabs(s)>peak) peak=fabs(s);
+    }
+  }
+  return maxd/peak;
+}
+
+static int g_fails;
+
+// stereo input that is identical in both channels for [s0,s1) (here, silent), with a stereo impulse,
+// so that WDL_ConvolutionEngine::Avail() switches to mono input mode and back
+static void test_mono_input(int ilen, int bs, int maxfft, int s0, int s1, int ioffs=0, int iuse=0)
+{
+  WDL_ImpulseBuffer imp;
+  make_impulse(&imp,2,ilen);
+  if (!iuse) iuse=ilen-ioffs;
+
+  WDL_ConvolutionEngine e;
+  e.SetImpulse(&imp,maxfft,ioffs,iuse);
+
+  const int total=s1+ilen+4096 < MAX_LEN ? s1+ilen+4096 : MAX_LEN;
+  for (int c=0;c<2;c++) for (int i=0;i<total;i++) g_in[c][i]=(WDL_FFT_REAL) (i>=s0 && i<s1 ? 0.0 : rnd());
+
+  int o=0;
+  for (int pos=0;pos+bs<=total;pos+=bs)
+  {
+    WDL_FFT_REAL *b[2]={g_in[0]+pos,g_in[1]+pos};
+    e.Add(b,bs,2);
+    int a=e.Avail(bs);
+    if (a>bs) a=bs;
+    for (int c=0;c<2;c++) memcpy(g_out[c]+o,e.Get()[c],a*sizeof(WDL_FFT_REAL));
+    e.Advance(a);
+    o+=a;
+  }
+
+  const double err=check_output(&imp,2,o,ioffs,iuse);
+  const int ok=err < 1e-4;
+  if (!ok) g_fails++;
+  printf("%s mono input: impulse %d (offs %d len %d) block %d fft %d identical %d..%d: error %g\n",
+    ok?"ok  ":"FAIL",ilen,ioffs,iuse,bs,maxfft,s0,s1,err);
+}
+
+// feeds in[][0..total) through e in blocks of bs (or random sizes up to bs), optionally calling Reset() at resetat
+static void run_div(WDL_ConvolutionEngine_Div *e, WDL_FFT_REAL **in, WDL_FFT_REAL **out, int total, int nch, int bs, bool varbs, int resetat)
+{
+  unsigned int r=7;
+  int pos=0, opos=0;
+  while (pos<total)
+  {
+    int n=bs;
+    if (varbs) { r=r*1103515245+12345; n=1+(r>>8)%bs; }
+    if (n>total-pos) n=total-pos;
+    if (resetat && pos>=resetat && pos-n<resetat) e->Reset();
+
+    WDL_FFT_REAL *b[2]={in[0]+pos,nch>1?in[1]+pos:NULL};
+    e->Add(b,n,nch);
+    int a=e->Avail(n);
+    if (a>n) a=n;
+    for (int c=0;c<nch;c++) memcpy(out[c]+opos,e->Get()[c],a*sizeof(WDL_FFT_REAL));
+    e->Advance(a);
+    opos+=a;
+    pos+=n;
+  }
+  for (int c=0;c<nch;c++) memset(out[c]+opos,0,(total-opos)*sizeof(WDL_FFT_REAL));
+}
+
+// SetThreadedTail(true) must produce the same output as the default engine
+static void test_threaded_tail(int ilen, int bs, int known_bs, int nch, int imp_nch, bool varbs, bool reset)
+{
+  WDL_ImpulseBuffer imp;
+  make_impulse(&imp,imp_nch,ilen);
+
+  const int total=ilen*2+bs*8+20000;
+  WDL_FFT_REAL *in[2], *o1[2], *o2[2];
+  for (int c=0;c<2;c++)
+  {
+    in[c]=new WDL_FFT_REAL[total];
+    o1[c]=new WDL_FFT_REAL[total];
+    o2[c]=new WDL_FFT_REAL[total];
+    for (int i=0;i<total;i++) in[c][i]=(WDL_FFT_REAL) (i>total/3 && i<total/3+3000 ? 0.0 : rnd());
+  }
+
+  WDL_ConvolutionEngine_Div e1, e2;
+  e1.SetImpulse(&imp,0,known_bs);
+  e2.SetThreadedTail(true);
+  e2.SetImpulse(&imp,0,known_bs);
+  const int resetat=reset ? total/2 : 0;
+  run_div(&e1,in,o1,total,nch,bs,varbs,resetat);
+  run_div(&e2,in,o2,total,nch,bs,varbs,resetat);
+
+  double maxd=0.0, peak=1e-9;
+  for (int c=0;c<nch;c++) for (int i=0;i<total;i++)
+  {
+    const double d=fabs(o1[c][i]-o2[c][i]);
+    if (d>maxd) maxd=d;
+    if (fabs(o1[c][i])>peak) peak=fabs(o1[c][i]);
+  }
+
+  // spot check the threaded output of the first channel against a direct convolution
+  double maxdd=0.0;
+  if (!reset && ilen<=9000)
+  {
+    const int lat=e2.GetLatency();
+    const WDL_FFT_REAL *ir=imp.impulses[0].Get();
+    for (int i=lat;i<total;i+=7)
+    {
+      const int j=i-lat;
+      double s=0.0;
+      for (int k=0;k<ilen && k<=j;k++) s+=ir[k]*in[0][j-k];
+      const double d=fabs(s-o2[0][i]);
+      if (d>maxdd) maxdd=d;
+    }
+  }
+
+  const int ok=maxd < peak*1e-5 && maxdd < peak*1e-5;
+  if (!ok) g_fails++;
+  printf("%s threaded tail: impulse %d (%dch) block %d%s known %d, %dch%s: difference %g, direct %g\n",
+    ok?"ok  ":"FAIL",ilen,imp_nch,bs,varbs?" (random)":"",known_bs,nch,reset?", reset":"",maxd/peak,maxdd/peak);
+
+  for (int c=0;c<2;c++) { delete [] in[c]; delete [] o1[c]; delete [] o2[c]; }
+}
+
+int main(int argc, char **argv)
+{
+  test_mono_input(2000,256,512,3000,6000);
+  test_mono_input(9000,512,512,4666,7666,0,768);
+  test_mono_input(5000,64,1024,1000,9000);
+  test_mono_input(3000,1000,256,2500,2600);
+  test_mono_input(12000,128,0,500,20000);
+
+  static const int lens[]={50,300,2000,9000,40000,150000};
+  static const int bss[]={64,128,256,512,1024,2048,4096};
+  for (int li=0;li<6;li++) for (int bi=0;bi<7;bi++) for (int mode=0;mode<4;mode++)
+    test_threaded_tail(lens[li],bss[bi],(bi&1) ? bss[bi] : 0,(mode&1) ? 2 : 1,(mode&2) ? 2 : 1,((li+bi)&1)!=0,(li&1)!=0);
+
+  printf("%s (%d failures)\n",g_fails?"FAIL":"OK",g_fails);
+  return g_fails ? 1 : 0;
+}
@@ -0,0 +1,347 @@
+/*
+  codecache_test.c
+  checks the EEL2 compiled-code cache (NSEEL_VM_SetCodeCache()): code loaded from the cache, in another VM or
+  from disk, must leave every variable and the first RAM slots bit-identical to a VM compiling without the cache.
+  files that are truncated, have any byte changed, or have a valid checksum but out of range fields must be
+  rejected. the cache is PORTABLE-only, so this builds nseel-compiler.c with EEL_TARGET_PORTABLE itself.
+
+  D="-DEEL_TARGET_PORTABLE -DWDL_FFT_REALSIZE=8 -DNSEEL_LOOPFUNC_SUPPORT_MAXLEN=0"
+  gcc -O $D -o codecache_test codecache_test.c nseel-caltab.c nseel-eval.c nseel-lextab.c nseel-ram.c \
+    nseel-yylex.c nseel-cfunc.c -lm
+  ./codecache_test [tmpdir]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+// static functions and the cache structs are used directly to forge damaged files
+#include "nseel-compiler.c"
+
+void NSEEL_HOSTSTUB_EnterMutex() { }
+void NSEEL_HOSTSTUB_LeaveMutex() { }
+
+static const char *g_scripts[]={
+  // functions, locals, loops
+  "function f(x) local(a) ( a = x*2; a+1 ); y = 0.5; loop(100, y += f(y)*0.001; ); z = sin(y) + cos(y*3);",
+  // local memory, while
+  "buf = 1000; i = 0; while (i < 200 ? (buf[i] = i*i*0.25; i += 1;)); s = 0; j = 0; loop(200, s += buf[j]; j += 1;); r = buf[150];",
+  // stack
+  "stack_push(3); stack_push(4.5); a = stack_pop(); b = stack_pop(); c = a*10 + b; stack_push(c); d = stack_peek(0);",
+  // _global. and regNN
+  "_global.g = 7; g2 = _global.g * 3; reg05 = 2.5; r5 = reg05 * 2 + g2;",
+  // this. and namespaces
+  "function inst() ( this.v = this.v + 1; this.w = this.v * 2; ); o.inst(); o.inst(); p.inst(); w = o.v*10 + p.w;",
+  // gmem (read back into variables)
+  "gmem[5] = 9; gg = gmem[5] + 1; gmem[70000] = gg*2; gh = gmem[70000];",
+  // enough code for more than one block
+  "q = 0; loop(50, q = q*0.99 + 1; q < 30 ? q += 0.5 : q -= 0.25; q = abs(q - 100) > 3 ? q : 7; );"
+  "function g(a,b) ( a*b + (a-b)*(a+b) ); t = g(q,2) + g(3,q) + g(q,q); u = min(t,max(q,4)); v = floor(u*10)/10;",
+};
+#define NUM_SCRIPTS (int)(sizeof(g_scripts)/sizeof(g_scripts[0]))
+
+#define NUM_RAM 2048
+
+typedef struct
+{
+  int nvars;
+  char names[64][64];
+  EEL_F vals[64];
+  EEL_F ram[NUM_RAM];
+} result;
+
+static int g_fails;
+
+static void fail(const char *what, int si)
+{
+  printf("FAIL script %d: %s\n",si,what);
+  g_fails++;
+}
+
+static int enumvar(const char *name, EEL_F *val, void *ctx)
+{
+  result *r = (result *)ctx;
+  if (r->nvars < 64)
+  {
+    snprintf(r->names[r->nvars],sizeof(r->names[0]),"%s",name);
+    r->vals[r->nvars++] = *val;
+  }
+  return 1;
+}
+
+static int cmpname(const void *a, const void *b)
+{
+  return strcmp((const char *)a,(const char *)b);
+}
+
+// compiles script si in a new VM (with cache, if set), runs it, and collects its state
+static int run(int si, NSEEL_CODECACHE cache, result *out)
+{
+  static void *gram;
+  NSEEL_VMCTX vm = NSEEL_VM_alloc();
+  NSEEL_CODEHANDLE ch;
+  int i, n;
+
+  memset(out,0,sizeof(*out));
+  NSEEL_VM_FreeGRAM(&gram);
+  NSEEL_VM_SetGRAM(vm,&gram);
+  NSEEL_VM_SetCodeCache(vm,cache);
+  ch = NSEEL_code_compile_ex(vm,g_scripts[si],0,0);
+  if (!ch)
+  {
+    printf("script %d: %s\n",si,NSEEL_code_getcodeerror(vm) ? NSEEL_code_getcodeerror(vm) : "compile failed");
+    NSEEL_VM_free(vm);
+    return 0;
+  }
+  NSEEL_code_execute(ch);
+
+  NSEEL_VM_enumallvars(vm,enumvar,out);
+  // sort names and values together
+  {
+    struct { char name[64]; EEL_F v; } tmp[64];
+    for (i = 0; i < out->nvars; i ++) { memcpy(tmp[i].name,out->names[i],64); tmp[i].v = out->vals[i]; }
+    qsort(tmp,out->nvars,sizeof(tmp[0]),cmpname);
+    for (i = 0; i < out->nvars; i ++) { memcpy(out->names[i],tmp[i].name,64); out->vals[i] = tmp[i].v; }
+  }
+  for (i = 0; i < NUM_RAM; i += n)
+  {
+    EEL_F *p = NSEEL_VM_getramptr_noalloc(vm,i,&n);
+    if (!p || n < 1) { n = 1; continue; }
+    if (n > NUM_RAM - i) n = NUM_RAM - i;
+    memcpy(out->ram + i,p,n*sizeof(EEL_F));
+  }
+
+  NSEEL_code_free(ch);
+  NSEEL_VM_free(vm);
+  return 1;
+}
+
+static int same(const result *a, const result *b)
+{
+  int i;
+  if (a->nvars != b->nvars) return 0;
+  for (i = 0; i < a->nvars; i ++)
+    if (strcmp(a->names[i],b->names[i]) || memcmp(&a->vals[i],&b->vals[i],sizeof(EEL_F))) return 0;
+  return !memcmp(a->ram,b->ram,sizeof(a->ram));
+}
+
+static WDL_UINT64 script_hash(int si)
+{
+  const int flags = 0;
+  const WDL_UINT64 commonsig = 0;
+  WDL_UINT64 h = codecache_hash(EEL_CC_HASH_INIT,g_scripts[si],strlen(g_scripts[si]));
+  h = codecache_hash(h,&flags,sizeof(flags));
+  return codecache_hash(h,&commonsig,sizeof(commonsig));
+}
+
+static unsigned char *readall(const char *fn, int *len)
+{
+  FILE *fp = fopen(fn,"rb");
+  unsigned char *buf;
+  if (!fp) return NULL;
+  fseek(fp,0,SEEK_END);
+  *len = (int)ftell(fp);
+  fseek(fp,0,SEEK_SET);
+  buf = (unsigned char *)malloc(*len);
+  if (buf && fread(buf,1,*len,fp) != (size_t)*len) { free(buf); buf = NULL; }
+  fclose(fp);
+  return buf;
+}
+
+static void writeall(const char *fn, const unsigned char *buf, int len)
+{
+  FILE *fp = fopen(fn,"wb");
+  if (fp)
+  {
+    fwrite(buf,1,len,fp);
+    fclose(fp);
+  }
+}
+
+// returns nonzero if the file loads
+static int tryload(const char *fn, unsigned int host_sig, int si)
+{
+  NSEEL_VMCTX vm = NSEEL_VM_alloc();
+  eelCodeCacheEnt *e = codecache_readfile((compileContext *)vm,fn,host_sig,g_scripts[si],(int)strlen(g_scripts[si]),0,script_hash(si));
+  NSEEL_VM_free(vm);
+  if (!e) return 0;
+  codecache_entfree(e);
+  return 1;
+}
+
+// rewrites the file with f applied to its entry and a valid checksum, and expects it to be rejected
+typedef void (*forgefunc)(eelCodeCacheDesc *d, unsigned char *blob, int idx);
+
+static void forge(const char *fn, const unsigned char *good, int len, unsigned int host_sig, int si, forgefunc f, int idx, const char *what)
+{
+  unsigned char *buf = (unsigned char *)malloc(len);
+  eelCodeCacheFileHdr *hdr = (eelCodeCacheFileHdr *)buf;
+  memcpy(buf,good,len);
+  f(&hdr->d,buf + sizeof(*hdr),idx);
+  hdr->sum = codecache_filesum(&hdr->d,buf + sizeof(*hdr));
+  writeall(fn,buf,len);
+  if (tryload(fn,host_sig,si))
+  {
+    char tmp[128];
+    snprintf(tmp,sizeof(tmp),"forged file loaded: %s %d",what,idx);
+    fail(tmp,si);
+  }
+  free(buf);
+}
+
+static eelCachedReloc *relocs(eelCodeCacheDesc *d, unsigned char *blob) { return (eelCachedReloc *)(blob + EEL_CC_RELOCS_OFFS(d)); }
+static eelCachedVar *vars(eelCodeCacheDesc *d, unsigned char *blob) { return (eelCachedVar *)(blob + EEL_CC_VARS_OFFS(d)); }
+
+static void f_reloc_offs(eelCodeCacheDesc *d, unsigned char *b, int i) { eelCachedReloc *r = relocs(d,b)+i; r->offs = (r->in_data ? d->data_len : d->code_len) - (int)sizeof(INT_PTR) + 1; }
+static void f_reloc_negoffs(eelCodeCacheDesc *d, unsigned char *b, int i) { relocs(d,b)[i].offs = -8; }
+static void f_reloc_indata(eelCodeCacheDesc *d, unsigned char *b, int i) { relocs(d,b)[i].in_data = 2; }
+static void f_reloc_cls(eelCodeCacheDesc *d, unsigned char *b, int i) { relocs(d,b)[i].cls = EEL_CC_STATIC+1; }
+static void f_reloc_arg(eelCodeCacheDesc *d, unsigned char *b, int i)
+{
+  eelCachedReloc *r = relocs(d,b)+i;
+  switch (r->cls)
+  {
+    case EEL_CC_CODE: r->arg = d->code_len+1; break;
+    case EEL_CC_DATA: r->arg = d->data_len+1; break;
+    case EEL_CC_CTX: r->arg = (int)sizeof(compileContext); break;
+    case EEL_CC_VAR: r->arg = d->nvars; break;
+    case EEL_CC_STATIC: r->sym = d->strings_len; break;
+    default: r->arg = -1; r->cls = EEL_CC_VAR; break;
+  }
+}
+static void f_var_name(eelCodeCacheDesc *d, unsigned char *b, int i) { vars(d,b)[i].name = d->strings_len; }
+static void f_strings(eelCodeCacheDesc *d, unsigned char *b, int i) { b[EEL_CC_STRINGS_OFFS(d) + d->strings_len - 1] = 'x'; }
+static void f_desc(eelCodeCacheDesc *d, unsigned char *b, int i)
+{
+  switch (i)
+  {
+    case 0: d->code_offs = d->code_len; break;
+    case 1: d->worktable_offs = d->data_len; break;
+    case 2: d->stack_offs = d->stack_offs >= 0 ? d->stack_offs + 8 : 0; break;
+    case 3: d->handle_offs = d->data_len - (int)sizeof(codeHandleType) + 8; break;
+    case 4: d->handle_offs = 4; break;
+    case 5: d->data_align = 32; break;
+    case 6: d->nrelocs = 0x7fffffff; break;
+    case 7: d->code_len = -1; break;
+  }
+}
+
+static void test_disk(int si, const char *dir, const result *ref)
+{
+  const unsigned int host_sig = 0x1234;
+  NSEEL_CODECACHE c1 = NSEEL_codecache_create(0), c2 = NSEEL_codecache_create(0);
+  char fn[2048];
+  unsigned char *good, *buf;
+  int len, i, k;
+  result res;
+  eelCodeCacheFileHdr *hdr;
+
+  NSEEL_codecache_setpath(c1,dir,host_sig);
+  NSEEL_codecache_setpath(c2,dir,host_sig);
+  codecache_filename(fn,sizeof(fn),(eelCodeCache *)c1,script_hash(si));
+  remove(fn);
+
+  if (!run(si,c1,&res) || NSEEL_codecache_getstats(c1)[5] != 1) fail("file not written",si);
+  if (!run(si,c2,&res) || NSEEL_codecache_getstats(c2)[4] != 1) fail("no disk hit",si);
+  else if (!same(&res,ref)) fail("code loaded from disk gives different results",si);
+
+  good = readall(fn,&len);
+  if (!good || len <= (int)sizeof(eelCodeCacheFileHdr)) { fail("cannot read file",si); goto done; }
+  if (!tryload(fn,host_sig,si)) fail("good file rejected",si);
+  if (tryload(fn,host_sig+1,si)) fail("file loaded with another host_sig",si);
+  hdr = (eelCodeCacheFileHdr *)good;
+  buf = (unsigned char *)malloc(len);
+
+  // truncated
+  for (i = 0; i < len; i += i < 64 || len-i < 64 ? 1 : 17)
+  {
+    writeall(fn,good,i);
+    if (tryload(fn,host_sig,si)) { fail("truncated file loaded",si); break; }
+  }
+
+  // any changed byte, except the padding after host_sig
+  for (i = 0; i < len; i ++)
+  {
+    if (i >= (int)(offsetof(eelCodeCacheFileHdr,host_sig)+sizeof(hdr->host_sig)) && i < (int)offsetof(eelCodeCacheFileHdr,d)) continue;
+    memcpy(buf,good,len);
+    buf[i] ^= 1 << (i&7);
+    writeall(fn,buf,len);
+    if (tryload(fn,host_sig,si))
+    {
+      printf("  byte %d of %d\n",i,len);
+      fail("file with a changed byte loaded",si);
+      break;
+    }
+  }
+
+  // a valid checksum over fields that are out of range
+  {
+    eelCodeCacheDesc *d = &hdr->d;
+    for (k = 0; k < d->nrelocs; k ++)
+    {
+      forge(fn,good,len,host_sig,si,f_reloc_offs,k,"reloc offs past end");
+      forge(fn,good,len,host_sig,si,f_reloc_negoffs,k,"negative reloc offs");
+      forge(fn,good,len,host_sig,si,f_reloc_indata,k,"reloc in_data");
+      forge(fn,good,len,host_sig,si,f_reloc_cls,k,"reloc cls");
+      forge(fn,good,len,host_sig,si,f_reloc_arg,k,"reloc arg");
+    }
+    for (k = 0; k < d->nvars; k ++) forge(fn,good,len,host_sig,si,f_var_name,k,"var name");
+    if (d->strings_len) forge(fn,good,len,host_sig,si,f_strings,0,"unterminated strings");
+    for (k = 0; k < 8; k ++) forge(fn,good,len,host_sig,si,f_desc,k,"header field");
+  }
+
+  // a damaged file is ignored: the code is compiled normally and still runs correctly
+  memcpy(buf,good,len);
+  buf[len-1] ^= 0x55;
+  writeall(fn,buf,len);
+  {
+    NSEEL_CODECACHE c3 = NSEEL_codecache_create(0);
+    NSEEL_codecache_setpath(c3,dir,host_sig);
+    if (!run(si,c3,&res) || NSEEL_codecache_getstats(c3)[4] != 0) fail("damaged file used",si);
+    else if (!same(&res,ref)) fail("results differ after ignoring a damaged file",si);
+    NSEEL_codecache_free(c3);
+  }
+
+  free(buf);
+done:
+  free(good);
+  remove(fn);
+  NSEEL_codecache_free(c1);
+  NSEEL_codecache_free(c2);
+}
+
+int main(int argc, char **argv)
+{
+  const char *dir = argc > 1 ? argv[1] : ".";
+  int si;
+
+  NSEEL_init();
+  for (si = 0; si < NUM_SCRIPTS; si ++)
+  {
+    const int fails = g_fails;
+    NSEEL_CODECACHE cache = NSEEL_codecache_create(0);
+    result ref, res;
+    int *st;
+    if (!cache) { printf("NSEEL_codecache_create() failed\n"); return 1; }
+    st = NSEEL_codecache_getstats(cache);
+
+    if (!run(si,NULL,&ref)) { fail("does not compile",si); continue; }
+
+    if (!run(si,cache,&res) || st[1] != 1 || st[2] != 1) fail("not stored on first compile",si);
+    else if (!same(&res,&ref)) fail("storing changes results",si);
+
+    if (!run(si,cache,&res) || st[0] != 1) fail("no cache hit in a second VM",si);
+    else if (!same(&res,&ref)) fail("cached code gives different results",si);
+
+    if (!run(si,cache,&res) || st[0] != 2 || !same(&res,&ref)) fail("third VM",si);
+
+    test_disk(si,dir,&ref);
+
+    NSEEL_codecache_free(cache);
+    printf("%s script %d\n",g_fails == fails ? "ok  " : "FAIL",si);
+  }
+
+  printf("%s (%d failures)\n",g_fails?"FAIL":"OK",g_fails);
+  return g_fails ? 1 : 0;
+}
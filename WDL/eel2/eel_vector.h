@@ -0,0 +1,506 @@
+#ifndef _EEL_VECTOR_H_
+#define _EEL_VECTOR_H_
+
+#include "ns-eel-int.h"
+#include <math.h>
+#include "../denormal.h"
+
+// block processing functions that operate on runs of local memory (see eel_vector_function_reference).
+// buffers may span RAM blocks, each function processes the largest runs that stay within one block.
+// define EEL_VECTOR_NO_SIMD to use plain C loops only.
+
+#if EEL_F_SIZE == 8 && !defined(EEL_VECTOR_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define EEL_VECTOR_SSE2
+#include <emmintrin.h>
+#endif
+
+#define EEL_VECTOR_MEMSIZE (NSEEL_RAM_BLOCKS*NSEEL_RAM_ITEMSPERBLOCK)
+#define EEL_VECTOR_MAXCH 64
+
+static int eel_vector_getint(const EEL_F *v)
+{
+  const EEL_F f = *v + 0.0001;
+  if (f >= EEL_VECTOR_MEMSIZE) return EEL_VECTOR_MEMSIZE;
+  if (f <= -EEL_VECTOR_MEMSIZE) return -EEL_VECTOR_MEMSIZE;
+  return f < 0.0 ? (int) floor(f) : (int) f;
+}
+
+// returns item offs of local memory, and reduces *len to the number of items that follow it in the same block
+static EEL_F *eel_vector_ptr(EEL_F **blocks, int offs, int *len)
+{
+  const int avail = NSEEL_RAM_ITEMSPERBLOCK - (offs&(NSEEL_RAM_ITEMSPERBLOCK-1));
+  EEL_F *p;
+  if (offs < 0 || offs >= EEL_VECTOR_MEMSIZE) return NULL;
+  p = __NSEEL_RAMAlloc(blocks,(unsigned int)offs);
+  if (!p || p == &nseel_ramalloc_onfail) return NULL;
+  if (*len > avail) *len = avail;
+  return p;
+}
+
+// skips the items for which any of the n buffers would be at a negative offset. the first buffer
+// advances step0 items per item of the others (for interleaved data)
+static int eel_vector_trim(int *offs, int n, int len, int step0)
+{
+  int x, skip = 0;
+  for (x = 0; x < n; x ++)
+  {
+    const int step = x ? 1 : step0;
+    if (offs[x] < -skip*step) skip = (-offs[x] + step-1) / step;
+  }
+  if (skip >= len) return 0;
+  offs[0] += skip*step0;
+  for (x = 1; x < n; x ++) offs[x] += skip;
+  return len - skip;
+}
+
+
+// kernels
+#ifdef EEL_VECTOR_SSE2
+  #define EEL_VECTOR_ABSMASK _mm_castsi128_pd(_mm_set_epi32(0x7fffffff,-1,0x7fffffff,-1))
+#endif
+
+// adds to s in item order (only the products and absolute values are computed two at a time), so that
+// the result is the same with and without SIMD
+static EEL_F eel_vector_k_sum(const EEL_F *a, int n, int mode, const EEL_F *b, EEL_F s) // mode: 0=a, 1=a*b, 2=a*a, 3=|a|
+{
+  int i = 0;
+#ifdef EEL_VECTOR_SSE2
+  if (mode)
+  {
+    const __m128d am = EEL_VECTOR_ABSMASK;
+    EEL_F t[4];
+    for (; i + 4 <= n; i += 4)
+    {
+      const __m128d v0 = _mm_loadu_pd(a+i), v1 = _mm_loadu_pd(a+i+2);
+      switch (mode)
+      {
+        case 1:
+          _mm_storeu_pd(t,_mm_mul_pd(v0,_mm_loadu_pd(b+i)));
+          _mm_storeu_pd(t+2,_mm_mul_pd(v1,_mm_loadu_pd(b+i+2)));
+        break;
+        case 2:
+          _mm_storeu_pd(t,_mm_mul_pd(v0,v0));
+          _mm_storeu_pd(t+2,_mm_mul_pd(v1,v1));
+        break;
+        default:
+          _mm_storeu_pd(t,_mm_and_pd(v0,am));
+          _mm_storeu_pd(t+2,_mm_and_pd(v1,am));
+        break;
+      }
+      s += t[0];
+      s += t[1];
+      s += t[2];
+      s += t[3];
+    }
+  }
+#endif
+  switch (mode)
+  {
+    case 0: for (; i < n; i ++) s += a[i]; break;
+    case 1: for (; i < n; i ++) s += a[i]*b[i]; break;
+    case 2: for (; i < n; i ++) s += a[i]*a[i]; break;
+    default: for (; i < n; i ++) s += fabs(a[i]); break;
+  }
+  return s;
+}
+
+static EEL_F eel_vector_k_minmax(const EEL_F *a, int n, int mode, EEL_F m) // mode: 0=min, 1=max, 2=max(|a|)
+{
+  int i = 0;
+#ifdef EEL_VECTOR_SSE2
+  if (n >= 4)
+  {
+    __m128d m0 = _mm_set1_pd(m), m1 = m0;
+    const __m128d am = EEL_VECTOR_ABSMASK;
+    EEL_F t[4];
+    switch (mode)
+    {
+      case 0:
+        for (; i + 4 <= n; i += 4)
+        {
+          m0 = _mm_min_pd(_mm_loadu_pd(a+i),m0);
+          m1 = _mm_min_pd(_mm_loadu_pd(a+i+2),m1);
+        }
+      break;
+      case 1:
+        for (; i + 4 <= n; i += 4)
+        {
+          m0 = _mm_max_pd(_mm_loadu_pd(a+i),m0);
+          m1 = _mm_max_pd(_mm_loadu_pd(a+i+2),m1);
+        }
+      break;
+      default:
+        for (; i + 4 <= n; i += 4)
+        {
+          m0 = _mm_max_pd(_mm_and_pd(_mm_loadu_pd(a+i),am),m0);
+          m1 = _mm_max_pd(_mm_and_pd(_mm_loadu_pd(a+i+2),am),m1);
+        }
+      break;
+    }
+    _mm_storeu_pd(t,m0);
+    _mm_storeu_pd(t+2,m1);
+    if (mode == 0) { m = t[0] < m ? t[0] : m; m = t[1] < m ? t[1] : m; m = t[2] < m ? t[2] : m; m = t[3] < m ? t[3] : m; }
+    else { m = t[0] > m ? t[0] : m; m = t[1] > m ? t[1] : m; m = t[2] > m ? t[2] : m; m = t[3] > m ? t[3] : m; }
+  }
+#endif
+  switch (mode)
+  {
+    case 0: for (; i < n; i ++) m = a[i] < m ? a[i] : m; break;
+    case 1: for (; i < n; i ++) m = a[i] > m ? a[i] : m; break;
+    default: for (; i < n; i ++) { const EEL_F v = fabs(a[i]); m = v > m ? v : m; } break;
+  }
+  return m;
+}
+
+static void eel_vector_k_scale(EEL_F *a, int n, EEL_F sc, EEL_F add)
+{
+  int i = 0;
+#ifdef EEL_VECTOR_SSE2
+  const __m128d vs = _mm_set1_pd(sc), va = _mm_set1_pd(add);
+  for (; i + 4 <= n; i += 4)
+  {
+    _mm_storeu_pd(a+i,_mm_add_pd(_mm_mul_pd(_mm_loadu_pd(a+i),vs),va));
+    _mm_storeu_pd(a+i+2,_mm_add_pd(_mm_mul_pd(_mm_loadu_pd(a+i+2),vs),va));
+  }
+#endif
+  for (; i < n; i ++) a[i] = a[i]*sc + add;
+}
+
+static void eel_vector_k_madd(EEL_F *d, const EEL_F *s, int n, EEL_F g, int mul) // mul ? d*=s : d+=s*g
+{
+  int i = 0;
+#ifdef EEL_VECTOR_SSE2
+  if (mul)
+  {
+    for (; i + 4 <= n; i += 4)
+    {
+      const __m128d s0 = _mm_loadu_pd(s+i), s1 = _mm_loadu_pd(s+i+2);
+      _mm_storeu_pd(d+i,_mm_mul_pd(_mm_loadu_pd(d+i),s0));
+      _mm_storeu_pd(d+i+2,_mm_mul_pd(_mm_loadu_pd(d+i+2),s1));
+    }
+  }
+  else
+  {
+    const __m128d vg = _mm_set1_pd(g);
+    for (; i + 4 <= n; i += 4)
+    {
+      const __m128d s0 = _mm_loadu_pd(s+i), s1 = _mm_loadu_pd(s+i+2);
+      _mm_storeu_pd(d+i,_mm_add_pd(_mm_loadu_pd(d+i),_mm_mul_pd(s0,vg)));
+      _mm_storeu_pd(d+i+2,_mm_add_pd(_mm_loadu_pd(d+i+2),_mm_mul_pd(s1,vg)));
+    }
+  }
+#endif
+  if (mul) for (; i < n; i ++) d[i] *= s[i];
+  else for (; i < n; i ++) d[i] += s[i]*g;
+}
+
+static void eel_vector_k_interleave(EEL_F *il, EEL_F **ch, int nch, int n, int deinterleave)
+{
+  int i = 0, c;
+  if (nch == 2)
+  {
+    EEL_F *a = ch[0], *b = ch[1];
+    if (deinterleave)
+    {
+#ifdef EEL_VECTOR_SSE2
+      for (; i + 2 <= n; i += 2)
+      {
+        const __m128d f0 = _mm_loadu_pd(il+i*2), f1 = _mm_loadu_pd(il+i*2+2);
+        _mm_storeu_pd(a+i,_mm_unpacklo_pd(f0,f1));
+        _mm_storeu_pd(b+i,_mm_unpackhi_pd(f0,f1));
+      }
+#endif
+      for (; i < n; i ++) { a[i] = il[i*2]; b[i] = il[i*2+1]; }
+    }
+    else
+    {
+#ifdef EEL_VECTOR_SSE2
+      for (; i + 2 <= n; i += 2)
+      {
+        const __m128d a0 = _mm_loadu_pd(a+i), b0 = _mm_loadu_pd(b+i);
+        _mm_storeu_pd(il+i*2,_mm_unpacklo_pd(a0,b0));
+        _mm_storeu_pd(il+i*2+2,_mm_unpackhi_pd(a0,b0));
+      }
+#endif
+      for (; i < n; i ++) { il[i*2] = a[i]; il[i*2+1] = b[i]; }
+    }
+    return;
+  }
+
+  for (c = 0; c < nch; c ++)
+  {
+    EEL_F *p = ch[c], *ip = il + c;
+    if (deinterleave) for (i = 0; i < n; i ++) { p[i] = *ip; ip += nch; }
+    else for (i = 0; i < n; i ++) { *ip = p[i]; ip += nch; }
+  }
+}
+
+
+// script functions
+static EEL_F eel_vector_reduce(EEL_F **blocks, EEL_F **parms, int mode)
+{
+  int offs[2], len;
+  EEL_F acc;
+  const int two = mode == 1;
+  offs[0] = eel_vector_getint(parms[0]);
+  offs[1] = two ? eel_vector_getint(parms[1]) : 0;
+  len = eel_vector_trim(offs,1+two,eel_vector_getint(parms[1+two]),1);
+
+  acc = 0.0;
+  while (len > 0)
+  {
+    int n = len;
+    const EEL_F *a = eel_vector_ptr(blocks,offs[0],&n), *b = NULL;
+    if (!a || (two && !(b = eel_vector_ptr(blocks,offs[1],&n)))) break;
+    acc = eel_vector_k_sum(a,n,mode,b,acc);
+    offs[0] += n;
+    offs[1] += n;
+    len -= n;
+  }
+  return acc;
+}
+
+static EEL_F NSEEL_CGEN_CALL _eel_mem_sum(void *blocks, INT_PTR np, EEL_F **parms)
+{
+  return eel_vector_reduce((EEL_F **)blocks,parms,0);
+}
+
+static EEL_F NSEEL_CGEN_CALL _eel_mem_multiply_sum(void *blocks, INT_PTR np, EEL_F **parms)
+{
+  // same special values for buf2 as REAPER's JSFX
+  if (*parms[1] == -1.0 || *parms[1] == -2.0)
+  {
+    EEL_F *p[2];
+    p[0] = parms[0];
+    p[1] = parms[2];
+    return eel_vector_reduce((EEL_F **)blocks,p,*parms[1] == -1.0 ? 2 : 3);
+  }
+  return eel_vector_reduce((EEL_F **)blocks,parms,1);
+}
+
+static EEL_F eel_vector_minmax(EEL_F **blocks, EEL_F **parms, int mode)
+{
+  int offs = eel_vector_getint(parms[0]), len;
+  EEL_F m = 0.0;
+  int first = 1;
+  len = eel_vector_trim(&offs,1,eel_vector_getint(parms[1]),1);
+  while (len > 0)
+  {
+    int n = len;
+    const EEL_F *a = eel_vector_ptr(blocks,offs,&n);
+    if (!a) break;
+    if (first) m = mode == 2 ? fabs(a[0]) : a[0];
+    first = 0;
+    m = eel_vector_k_minmax(a,n,mode,m);
+    offs += n;
+    len -= n;
+  }
+  return m;
+}
+
+static EEL_F NSEEL_CGEN_CALL _eel_mem_min(void *blocks, INT_PTR np, EEL_F **parms)
+{
+  return eel_vector_minmax((EEL_F **)blocks,parms,0);
+}
+
+static EEL_F NSEEL_CGEN_CALL _eel_mem_max(void *blocks, INT_PTR np, EEL_F **parms)
+{
+  return eel_vector_minmax((EEL_F **)blocks,parms,1);
+}
+
+static EEL_F NSEEL_CGEN_CALL _eel_mem_peak(void *blocks, INT_PTR np, EEL_F **parms)
+{
+  return eel_vector_minmax((EEL_F **)blocks,parms,2);
+}
+
+static EEL_F NSEEL_CGEN_CALL _eel_mem_scale(void *blocks, INT_PTR np, EEL_F **parms)
+{
+  const EEL_F sc = *parms[2], add = np > 3 ? *parms[3] : 0.0;
+  int offs = eel_vector_getint(parms[0]), len;
+  len = eel_vector_trim(&offs,1,eel_vector_getint(parms[1]),1);
+  while (len > 0)
+  {
+    int n = len;
+    EEL_F *a = eel_vector_ptr((EEL_F **)blocks,offs,&n);
+    if (!a) break;
+    eel_vector_k_scale(a,n,sc,add);
+    offs += n;
+    len -= n;
+  }
+  return *parms[0];
+}
+
+static EEL_F eel_vector_madd(EEL_F **blocks, EEL_F **parms, EEL_F g, int mul)
+{
+  int offs[2], len;
+  offs[0] = eel_vector_getint(parms[0]);
+  offs[1] = eel_vector_getint(parms[1]);
+  len = eel_vector_trim(offs,2,eel_vector_getint(parms[2]),1);
+  while (len > 0)
+  {
+    int n = len;
+    EEL_F *d = eel_vector_ptr(blocks,offs[0],&n), *s;
+    if (!d || !(s = eel_vector_ptr(blocks,offs[1],&n))) break;
+    eel_vector_k_madd(d,s,n,g,mul);
+    offs[0] += n;
+    offs[1] += n;
+    len -= n;
+  }
+  return *parms[0];
+}
+
+static EEL_F NSEEL_CGEN_CALL _eel_mem_multiply_add(void *blocks, INT_PTR np, EEL_F **parms)
+{
+  return eel_vector_madd((EEL_F **)blocks,parms,np > 3 ? *parms[3] : 1.0,0);
+}
+
+static EEL_F NSEEL_CGEN_CALL _eel_mem_multiply(void *blocks, INT_PTR np, EEL_F **parms)
+{
+  return eel_vector_madd((EEL_F **)blocks,parms,1.0,1);
+}
+
+// coefficients and state may themselves straddle a block boundary, so access them one item at a time
+static EEL_F *eel_vector_item(EEL_F **blocks, int offs)
+{
+  int n = 1;
+  return eel_vector_ptr(blocks,offs,&n);
+}
+
+static EEL_F NSEEL_CGEN_CALL _eel_mem_biquad(void *_blocks, INT_PTR np, EEL_F **parms)
+{
+  EEL_F **blocks = (EEL_F **)_blocks;
+  const int coefs = eel_vector_getint(parms[2]), state = eel_vector_getint(parms[3]);
+  EEL_F c[5], *z[2];
+  EEL_F z1, z2;
+  int offs = eel_vector_getint(parms[0]), len, x;
+
+  for (x = 0; x < 5; x ++)
+  {
+    const EEL_F *p = eel_vector_item(blocks,coefs+x);
+    if (!p) return *parms[0];
+    c[x] = *p;
+  }
+  if (!(z[0] = eel_vector_item(blocks,state)) || !(z[1] = eel_vector_item(blocks,state+1))) return *parms[0];
+  z1 = *z[0];
+  z2 = *z[1];
+
+  len = eel_vector_trim(&offs,1,eel_vector_getint(parms[1]),1);
+  while (len > 0)
+  {
+    int n = len, i;
+    EEL_F *a = eel_vector_ptr(blocks,offs,&n);
+    if (!a) break;
+    for (i = 0; i < n; i ++)
+    {
+      // transposed direct form II
+      const EEL_F in = a[i], out = c[0]*in + z1;
+      z1 = c[1]*in - c[3]*out + z2;
+      z2 = c[2]*in - c[4]*out;
+      a[i] = out;
+    }
+    offs += n;
+    len -= n;
+  }
+#if EEL_F_SIZE == 8
+  *z[0] = denormal_filter_double2(z1);
+  *z[1] = denormal_filter_double2(z2);
+#else
+  *z[0] = denormal_filter_float2(z1);
+  *z[1] = denormal_filter_float2(z2);
+#endif
+  return *parms[0];
+}
+
+static EEL_F eel_vector_interleave(EEL_F **blocks, INT_PTR np, EEL_F **parms, int deinterleave)
+{
+  int offs[1+EEL_VECTOR_MAXCH], nch = eel_vector_getint(parms[1]), len, c;
+  EEL_F *ch[EEL_VECTOR_MAXCH];
+  if (nch > (int)np - 3) nch = (int)np - 3;
+  if (nch < 1 || nch > EEL_VECTOR_MAXCH) return *parms[0];
+
+  offs[0] = eel_vector_getint(parms[0]);
+  for (c = 0; c < nch; c ++) offs[1+c] = eel_vector_getint(parms[3+c]);
+
+  // interleaved buffer advances nch items per frame
+  len = eel_vector_trim(offs,1+nch,eel_vector_getint(parms[2]),nch);
+  if (offs[0] + len*(double)nch > EEL_VECTOR_MEMSIZE) len = (EEL_VECTOR_MEMSIZE - offs[0]) / nch;
+
+  while (len > 0)
+  {
+    int n = len*nch;
+    EEL_F *il = eel_vector_ptr(blocks,offs[0],&n);
+    if (!il) break;
+    n /= nch;
+    if (!n)
+    {
+      // frame straddles a block boundary
+      for (c = 0; c < nch; c ++)
+      {
+        EEL_F *ip = eel_vector_item(blocks,offs[0]+c), *p = eel_vector_item(blocks,offs[1+c]);
+        if (!ip || !p) return *parms[0];
+        if (deinterleave) *p = *ip;
+        else *ip = *p;
+      }
+      n = 1;
+    }
+    else
+    {
+      for (c = 0; c < nch; c ++) if (!(ch[c] = eel_vector_ptr(blocks,offs[1+c],&n))) return *parms[0];
+      eel_vector_k_interleave(il,ch,nch,n,deinterleave);
+    }
+    offs[0] += n*nch;
+    for (c = 0; c < nch; c ++) offs[1+c] += n;
+    len -= n;
+  }
+  return *parms[0];
+}
+
+static EEL_F NSEEL_CGEN_CALL _eel_mem_interleave(void *blocks, INT_PTR np, EEL_F **parms)
+{
+  return eel_vector_interleave((EEL_F **)blocks,np,parms,0);
+}
+
+static EEL_F NSEEL_CGEN_CALL _eel_mem_deinterleave(void *blocks, INT_PTR np, EEL_F **parms)
+{
+  return eel_vector_interleave((EEL_F **)blocks,np,parms,1);
+}
+
+void EEL_vector_register_ex(eel_function_table *destination)
+{
+  NSEEL_addfunc_varparm_ex("mem_sum",2,1,NSEEL_PProc_RAM,&_eel_mem_sum,destination);
+  NSEEL_addfunc_varparm_ex("mem_multiply_sum",3,1,NSEEL_PProc_RAM,&_eel_mem_multiply_sum,destination);
+  NSEEL_addfunc_varparm_ex("mem_min",2,1,NSEEL_PProc_RAM,&_eel_mem_min,destination);
+  NSEEL_addfunc_varparm_ex("mem_max",2,1,NSEEL_PProc_RAM,&_eel_mem_max,destination);
+  NSEEL_addfunc_varparm_ex("mem_peak",2,1,NSEEL_PProc_RAM,&_eel_mem_peak,destination);
+  NSEEL_addfunc_varparm_ex("mem_scale",3,0,NSEEL_PProc_RAM,&_eel_mem_scale,destination);
+  NSEEL_addfunc_varparm_ex("mem_multiply_add",3,0,NSEEL_PProc_RAM,&_eel_mem_multiply_add,destination);
+  NSEEL_addfunc_varparm_ex("mem_multiply",3,1,NSEEL_PProc_RAM,&_eel_mem_multiply,destination);
+  NSEEL_addfunc_varparm_ex("mem_biquad",4,1,NSEEL_PProc_RAM,&_eel_mem_biquad,destination);
+  NSEEL_addfunc_varparm_ex("mem_interleave",4,0,NSEEL_PProc_RAM,&_eel_mem_interleave,destination);
+  NSEEL_addfunc_varparm_ex("mem_deinterleave",4,0,NSEEL_PProc_RAM,&_eel_mem_deinterleave,destination);
+}
+
+void EEL_vector_register()
+{
+  EEL_vector_register_ex(NSEEL_ADDFUNC_DESTINATION);
+}
+
+#ifdef EEL_WANT_DOCUMENTATION
+static const char *eel_vector_function_reference =
+"mem_sum\tbuf,length\tReturns the sum of length items of local memory starting at buf.\0"
+"mem_multiply_sum\tbuf1,buf2,length\tReturns the sum of the products of length items of buf1 and buf2. If buf2 is exactly -1, returns the sum of the squares of the items in buf1. "
+  "If buf2 is exactly -2, returns the sum of the absolute values of the items in buf1.\0"
+"mem_min\tbuf,length\tReturns the smallest of length items starting at buf.\0"
+"mem_max\tbuf,length\tReturns the largest of length items starting at buf.\0"
+"mem_peak\tbuf,length\tReturns the largest absolute value of length items starting at buf.\0"
+"mem_scale\tbuf,length,scale[,offset]\tMultiplies length items starting at buf by scale, and adds offset (if specified). Returns buf.\0"
+"mem_multiply_add\tdest,src,length[,gain]\tAdds length items of src (multiplied by gain, if specified) to dest. dest and src should either be the same or not overlap. Returns dest.\0"
+"mem_multiply\tdest,src,length\tMultiplies length items of dest by the items of src. dest and src should either be the same or not overlap. Returns dest.\0"
+"mem_biquad\tbuf,length,coefs,state\tFilters length items starting at buf in place with a biquad filter. coefs specifies the location of 5 values in local memory: "
+  "b0, b1, b2, a1, a2 (normalized so that a0 is 1). state specifies the location of 2 values of filter state, which should be set to 0 before first use and preserved between calls. Returns buf.\0"
+"mem_interleave\tdest,nch,length,src1,...\tInterleaves length items of each of nch source buffers (nch additional parameters) into dest, which receives length*nch items. Returns dest.\0"
+"mem_deinterleave\tsrc,nch,length,dest1,...\tDeinterleaves length*nch items of src into nch buffers (nch additional parameters) of length items each. Returns src.\0"
+;
+#endif
+
+#endif
@@ -191,6 +191,10 @@ class eelScriptInst {
   #include "eel_mdct.h"
 #endif
 
+#ifndef EELSCRIPT_NO_VECTOR
+  #include "eel_vector.h"
+#endif
+
 #ifndef EELSCRIPT_NO_NET
   #define EEL_NET_GET_CONTEXT(opaque) (((eelScriptInst *)opaque)->m_net_state)
   #include "eel_net.h"
@@ -630,6 +634,9 @@ int eelScriptInst::init()
 #endif
 #ifndef EELSCRIPT_NO_MDCT
   EEL_mdct_register();
+#endif
+#ifndef EELSCRIPT_NO_VECTOR
+  EEL_vector_register();
 #endif
   EEL_misc_register();
 #ifndef EELSCRIPT_NO_EVAL
@@ -756,6 +763,10 @@ void EELScript_GenerateFunctionList(WDL_PtrList<const char> *fs)
   p = eel_mdct_function_reference;
   while (*p) { fs->Add(p); p += strlen(p) + 1; }
 #endif
+#ifndef EELSCRIPT_NO_VECTOR
+  p = eel_vector_function_reference;
+  while (*p) { fs->Add(p); p += strlen(p) + 1; }
+#endif
 #ifndef EELSCRIPT_NO_LICE
   p = eel_lice_function_reference;
   while (*p) { fs->Add(p); p += strlen(p) + 1; }
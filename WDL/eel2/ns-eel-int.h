@@ -247,6 +247,10 @@ typedef struct _compileContext
   void *gram_blocks;
 
   void *caller_this;
+
+  struct eelCodeCache *codecache; // optional shared compiled-code cache, see NSEEL_VM_SetCodeCache()
+  struct eelCodeCacheRecorder *codecache_rec; // set while compiling code that may be stored to codecache
+  WDL_UINT64 codecache_commonsig; // hash of the code that defined the current common functions
 }
 compileContext;
 
@@ -188,6 +188,27 @@ void NSEEL_code_free(NSEEL_CODEHANDLE code);
 int *NSEEL_code_getstats(NSEEL_CODEHANDLE code); // 4 ints...source bytes, static code bytes, call code bytes, data bytes
   
 
+// compiled code cache, can be shared by any number of VMs. when a VM has a cache set, code compiled with the same
+// source, flags, function table and common functions as a previous compile (in any VM using the cache) is relocated
+// to the new VM (variables are resolved by name) rather than being recompiled. code that uses strings, custom pprocs,
+// or defines common functions (NSEEL_CODE_COMPILE_FLAG_COMMONFUNCS) is always compiled normally.
+// the cache is PORTABLE-only: it is compiled only with EEL_TARGET_PORTABLE. relocating native code (x86, x86-64,
+// arm, aarch64, ppc) is not supported, and in those builds NSEEL_codecache_create() returns NULL.
+typedef void *NSEEL_CODECACHE;
+NSEEL_CODECACHE NSEEL_codecache_create(int max_bytes); // max_bytes=0 for default (16MB). returns NULL if unsupported
+void NSEEL_codecache_free(NSEEL_CODECACHE cache); // any VMs using the cache must be freed (or NSEEL_VM_SetCodeCache(vm,NULL)) first
+void NSEEL_codecache_flush(NSEEL_CODECACHE cache); // call if function tables are modified after code has been cached
+
+// optionally persist compiled code to a directory (NULL to disable). files are only loaded if they were written by the same
+// EEL2 code generator version, compiler and builtin function table, and with the same host_sig -- hosts should change
+// host_sig whenever their function tables change. files are checksummed and checked before use, damaged ones are ignored.
+void NSEEL_codecache_setpath(NSEEL_CODECACHE cache, const char *path, unsigned int host_sig);
+
+int *NSEEL_codecache_getstats(NSEEL_CODECACHE cache); // 8 ints: hits, misses, stores, uncacheable, disk hits, disk writes, entries, bytes
+
+void NSEEL_VM_SetCodeCache(NSEEL_VMCTX ctx, NSEEL_CODECACHE cache); // NULL to disable
+
+
 // global memory control/view
 extern unsigned int NSEEL_RAM_limitmem; // if nonzero, memory limit for user data, in bytes
 extern unsigned int NSEEL_RAM_memused;
@@ -117,6 +117,9 @@ FILE *g_eel_dump_fp, *g_eel_dump_fp2;
 #define EEL_DOESNT_NEED_EXEC_PERMS
 #include "glue_port.h"
 
+#define EEL_CODECACHE_SUPPORTED
+#define EEL_GLUE_IMMEDIATE_SITE(ret) ((unsigned char *)(ret) + sizeof(EEL_BC_TYPE) - sizeof(INT_PTR))
+
 #elif defined(__ppc__)
 
 #include "glue_ppc.h"
@@ -139,6 +142,10 @@ FILE *g_eel_dump_fp, *g_eel_dump_fp2;
 
 #endif
 
+#ifndef EEL_GLUE_IMMEDIATE_SITE
+#define EEL_GLUE_IMMEDIATE_SITE(ret) ((unsigned char *)(ret))
+#endif
+
 #ifndef GLUE_INVSQRT_NEEDREPL
 #define GLUE_INVSQRT_NEEDREPL 0
 #endif
@@ -150,6 +157,9 @@ FILE *g_eel_dump_fp, *g_eel_dump_fp2;
 #define OPTFLAG_NO_INLINEFUNC 4
 #define OPTFLAG_FULL_DENORMAL_CHECKS 8 // if set, denormals/NaN are always filtered on assign
 #define OPTFLAG_NO_DENORMAL_CHECKS 16 // if set and FULL not set, denormals/NaN are never filtered on assign
+#define OPTFLAG_NO_CONSTCHAIN 32 // if set, x*c1*c2 (and related mul/div chains) are not reduced to x*c
+#define OPTFLAG_NO_CSE 64 // if set, identical pure subexpressions (e*e, e+e) are evaluated twice
+#define OPTFLAG_NO_DEADSTORE 128 // if set, v=a; v=b; keeps the first store
 
 
 #define DENORMAL_CLEARING_THRESHOLD 1.0e-50 // when adding/subtracting a constant, assume if it's greater than this, it will clear denormal (the actual value is probably 10^-290...)
@@ -243,9 +253,12 @@ static void *__newBlock_align(compileContext *ctx, int size, int align, int isFo
                              isForCode < 0 ? (isForCode == -2 ? &ctx->pblocks : &ctx->tmpblocks_head) : 
                              isForCode > 0 ? &ctx->blocks_head : 
                              &ctx->blocks_head_data) ,size+a1, isForCode>0);
+  // code that is going to be cached gets scanned for stray pointers, so don't leave old heap contents in the padding
+  if (p && isForCode >= 0 && ctx->codecache_rec) memset(p,0,size+a1);
   return p+((align-(((INT_PTR)p)&a1))&a1);
 }
 
+
 static opcodeRec *newOpCode(compileContext *ctx, const char *str, int opType)
 {
   const size_t strszfull = str ? strlen(str) : 0;
@@ -314,6 +327,119 @@ static int __growbuf_resize(eel_growbuf *buf, int newsize)
 }
 
 
+// compiled code cache support: while compiling code that might be stored in ctx->codecache, every
+// pointer written to the generated code is recorded, so that the code can later be relocated to another VM.
+enum {
+  EEL_RELOC_LITERAL=0, // not a pointer, ignored
+  EEL_RELOC_AUTO, // classified when stored (code, data, variable or context pointer)
+  EEL_RELOC_THIS,
+  EEL_RELOC_GRAM,
+  EEL_RELOC_STATIC, // replptrs[slot] of a builtin or registered function
+};
+
+typedef struct
+{
+  unsigned char *site;
+  INT_PTR value;
+  int kind;
+  int fntype, slot; // EEL_RELOC_STATIC: where value came from
+  const functionType *ft; // EEL_RELOC_STATIC, if fntype == FUNCTYPE_FUNCTIONTYPEREC
+} eelRelocRec;
+
+typedef struct
+{
+  EEL_F *ptr;
+  int name; // offset in eelCodeCacheRecorder::names
+  int isglobal; // from get_global_var() rather than nseel_int_register_var()
+} eelRelocVarRec;
+
+typedef struct eelCodeCacheRecorder
+{
+  EEL_GROWBUF(eelRelocRec) relocs;
+  EEL_GROWBUF(eelRelocVarRec) vars;
+  EEL_GROWBUF(char) names;
+  int failed;
+} eelCodeCacheRecorder;
+
+#define CODECACHE_FAIL(ctx) do { if ((ctx)->codecache_rec) (ctx)->codecache_rec->failed=1; } while (0)
+
+static void codecache_addreloc(compileContext *ctx, unsigned char *site, INT_PTR v, int kind, int fntype, const functionType *ft, int slot)
+{
+  eelCodeCacheRecorder *rec = ctx->codecache_rec;
+  eelRelocRec *r;
+  int sz;
+  if (!rec || kind == EEL_RELOC_LITERAL) return;
+
+  sz = EEL_GROWBUF_GET_SIZE(&rec->relocs);
+  if (EEL_GROWBUF_RESIZE(&rec->relocs,sz+1)) { rec->failed=1; return; }
+  r = EEL_GROWBUF_GET(&rec->relocs) + sz;
+  r->site = site;
+  r->value = v;
+  r->kind = kind;
+  r->fntype = fntype;
+  r->slot = slot;
+  r->ft = ft;
+}
+
+// records pointer v, which was just written somewhere in the len bytes of generated code at p
+static void codecache_addreloc_insn(compileContext *ctx, unsigned char *p, int len, INT_PTR v)
+{
+  unsigned char *site = NULL;
+  int x;
+  if (!ctx->codecache_rec || !p) return;
+  for (x = 0; x + (int)sizeof(INT_PTR) <= len; x ++)
+  {
+    if (!memcmp(p+x,&v,sizeof(v)))
+    {
+      if (site) { ctx->codecache_rec->failed=1; return; } // ambiguous
+      site = p+x;
+    }
+  }
+  if (!site) ctx->codecache_rec->failed=1;
+  else codecache_addreloc(ctx,site,v,EEL_RELOC_AUTO,0,NULL,0);
+}
+
+// code generated at src was copied to dest
+static void codecache_copyrelocs(compileContext *ctx, unsigned char *dest, const unsigned char *src, int len)
+{
+  eelCodeCacheRecorder *rec = ctx->codecache_rec;
+  int x, n;
+  if (!rec || len < (int)sizeof(INT_PTR)) return;
+  n = EEL_GROWBUF_GET_SIZE(&rec->relocs);
+  for (x = 0; x < n; x ++)
+  {
+    const eelRelocRec r = EEL_GROWBUF_GET(&rec->relocs)[x];
+    if (r.site >= src && r.site + sizeof(INT_PTR) <= src + len)
+      codecache_addreloc(ctx,dest + (r.site - src),r.value,r.kind,r.fntype,r.ft,r.slot);
+  }
+}
+
+static void codecache_notevar(compileContext *ctx, const char *name, int isglobal, EEL_F *ptr)
+{
+  eelCodeCacheRecorder *rec = ctx->codecache_rec;
+  eelRelocVarRec *v;
+  const int namelen = (int)strlen(name)+1;
+  int sz, nsz;
+  if (!rec || !ptr) return;
+
+  sz = EEL_GROWBUF_GET_SIZE(&rec->vars);
+  nsz = EEL_GROWBUF_GET_SIZE(&rec->names);
+  if (EEL_GROWBUF_RESIZE(&rec->vars,sz+1) || EEL_GROWBUF_RESIZE(&rec->names,nsz+namelen)) { rec->failed=1; return; }
+  memcpy(EEL_GROWBUF_GET(&rec->names) + nsz, name, namelen);
+  v = EEL_GROWBUF_GET(&rec->vars) + sz;
+  v->ptr = ptr;
+  v->name = nsz;
+  v->isglobal = isglobal;
+}
+
+static unsigned char *nseel_set_immediate(compileContext *ctx, void *p, INT_PTR newv, int kind)
+{
+  unsigned char *ret = EEL_GLUE_set_immediate(p,newv);
+  if (ctx->codecache_rec) codecache_addreloc(ctx,EEL_GLUE_IMMEDIATE_SITE(ret),newv,kind,0,NULL,0);
+  return ret;
+}
+
+
 #ifndef DECL_ASMFUNC
 #define DECL_ASMFUNC(x)         \
   void nseel_asm_##x(void);        \
@@ -411,7 +537,7 @@ void _asm_gmegabuf_end(void);
 
 static void *NSEEL_PProc_GRAM(void *data, int data_size, compileContext *ctx)
 {
-  if (data_size>0) data=EEL_GLUE_set_immediate(data, (INT_PTR)ctx->gram_blocks);
+  if (data_size>0) data=nseel_set_immediate(ctx, data, (INT_PTR)ctx->gram_blocks, EEL_RELOC_GRAM);
   return data;
 }
 
@@ -427,9 +553,9 @@ static void *NSEEL_PProc_Stack(void *data, int data_size, compileContext *ctx)
     ch->want_stack=1;
     if (!ch->stack) ch->stack = newDataBlock(NSEEL_STACK_SIZE*sizeof(EEL_F),NSEEL_STACK_SIZE*sizeof(EEL_F));
 
-    data=EEL_GLUE_set_immediate(data, stackptr);
-    data=EEL_GLUE_set_immediate(data, m1); // and
-    data=EEL_GLUE_set_immediate(data, ((UINT_PTR)ch->stack&~m1)); //or
+    data=nseel_set_immediate(ctx, data, stackptr, EEL_RELOC_AUTO);
+    data=nseel_set_immediate(ctx, data, m1, EEL_RELOC_LITERAL); // and
+    data=nseel_set_immediate(ctx, data, ((UINT_PTR)ch->stack&~m1), EEL_RELOC_AUTO); //or
   }
   return data;
 }
@@ -446,10 +572,10 @@ static void *NSEEL_PProc_Stack_PeekInt(void *data, int data_size, compileContext
     ch->want_stack=1;
     if (!ch->stack) ch->stack = newDataBlock(NSEEL_STACK_SIZE*sizeof(EEL_F),NSEEL_STACK_SIZE*sizeof(EEL_F));
 
-    data=EEL_GLUE_set_immediate(data, stackptr);
-    data=EEL_GLUE_set_immediate(data, offs);
-    data=EEL_GLUE_set_immediate(data, m1); // and
-    data=EEL_GLUE_set_immediate(data, ((UINT_PTR)ch->stack&~m1)); //or
+    data=nseel_set_immediate(ctx, data, stackptr, EEL_RELOC_AUTO);
+    data=nseel_set_immediate(ctx, data, offs, EEL_RELOC_LITERAL);
+    data=nseel_set_immediate(ctx, data, m1, EEL_RELOC_LITERAL); // and
+    data=nseel_set_immediate(ctx, data, ((UINT_PTR)ch->stack&~m1), EEL_RELOC_AUTO); //or
   }
   return data;
 }
@@ -464,7 +590,7 @@ static void *NSEEL_PProc_Stack_PeekTop(void *data, int data_size, compileContext
     ch->want_stack=1;
     if (!ch->stack) ch->stack = newDataBlock(NSEEL_STACK_SIZE*sizeof(EEL_F),NSEEL_STACK_SIZE*sizeof(EEL_F));
 
-    data=EEL_GLUE_set_immediate(data, stackptr);
+    data=nseel_set_immediate(ctx, data, stackptr, EEL_RELOC_AUTO);
   }
   return data;
 }
@@ -936,6 +1062,7 @@ opcodeRec *nseel_resolve_named_symbol(compileContext *ctx, opcodeRec *rec, int p
     EEL_F *a=get_global_var(ctx,sname,1);
     if (a) 
     {
+      codecache_notevar(ctx,sname,1,a);
       rec->parms.dv.valuePtr = a;
       sname[0]=0; // for dump_ops compat really, but this shouldn't be needed anyway
     }
@@ -1390,6 +1517,7 @@ opcodeRec *nseel_eelMakeOpcodeFromStringSegments(compileContext *ctx, struct eel
 {
   if (ctx && ctx->onString)
   {
+    CODECACHE_FAIL(ctx); // string values are specific to the VM
     return nseel_createCompiledValue(ctx, ctx->onString(ctx->caller_this,rec));
   }
 
@@ -1902,7 +2030,7 @@ static void *nseel_getEELFunctionAddress(compileContext *ctx,
         if (fn->startptr)
         {
           memcpy(fn->startptr,f,sz);
-          EEL_GLUE_set_immediate(fn->startptr,(INT_PTR)codeCall);
+          nseel_set_immediate(ctx,fn->startptr,(INT_PTR)codeCall,EEL_RELOC_AUTO);
           fn->startptr_size = sz;
         }
       }
@@ -1928,6 +2056,160 @@ static void *nseel_getEELFunctionAddress(compileContext *ctx,
 
 
 
+// true if v is an exact power of two, i.e. scaling by it (or its reciprocal) never rounds
+static int optimizeOpcodes_isPow2(double v)
+{
+  const WDL_DenormalDoubleAccess *p = (const WDL_DenormalDoubleAccess*)&v;
+  const unsigned int e = (p->w.hw >> 20) & 0x7ff;
+  return !p->w.lw && !(p->w.hw & 0xfffff) && e && e != 0x7ff;
+}
+
+// if op is (x*c), (c*x) or (x/c) with c constant, returns x and sets *c and *isdiv
+static opcodeRec *optimizeOpcodes_getScaleTerm(opcodeRec *op, double *c, int *isdiv)
+{
+  if (op->opcodeType != OPCODETYPE_FUNC2) return NULL;
+  if (op->fntype != FN_MULTIPLY && op->fntype != FN_DIVIDE) return NULL;
+
+  *isdiv = op->fntype == FN_DIVIDE;
+  if (op->parms.parms[1]->opcodeType == OPCODETYPE_DIRECTVALUE)
+  {
+    if (op->parms.parms[0]->opcodeType == OPCODETYPE_DIRECTVALUE) return NULL;
+    *c = op->parms.parms[1]->parms.dv.directValue;
+    return op->parms.parms[0];
+  }
+  if (!*isdiv && op->parms.parms[0]->opcodeType == OPCODETYPE_DIRECTVALUE)
+  {
+    *c = op->parms.parms[0]->parms.dv.directValue;
+    return op->parms.parms[1];
+  }
+  return NULL;
+}
+
+// true if a and b refer to the same variable
+static int optimizeOpcodes_isSameVar(const opcodeRec *a, const opcodeRec *b)
+{
+  if (a->opcodeType != b->opcodeType) return 0;
+  switch (a->opcodeType)
+  {
+    case OPCODETYPE_VALUE_FROM_NAMESPACENAME:
+      if (a->namespaceidx != b->namespaceidx) return 0;
+      // fall through
+    case OPCODETYPE_VARPTR:
+      if (a->relname && b->relname && a->relname[0]) return !stricmp(a->relname,b->relname);
+      return a->parms.dv.valuePtr && a->parms.dv.valuePtr == b->parms.dv.valuePtr;
+    case OPCODETYPE_VARPTRPTR:
+      return a->parms.dv.valuePtr && a->parms.dv.valuePtr == b->parms.dv.valuePtr;
+  }
+  return 0;
+}
+
+// true if op has no side effects: constants, variable and memory reads, and const functions thereof
+static int optimizeOpcodes_isPure(const opcodeRec *op)
+{
+  int x, np;
+  switch (op->opcodeType)
+  {
+    case OPCODETYPE_DIRECTVALUE:
+    case OPCODETYPE_VALUE_FROM_NAMESPACENAME:
+    case OPCODETYPE_VARPTR:
+    case OPCODETYPE_VARPTRPTR:
+    return 1;
+    case OPCODETYPE_FUNC1: np=1; break;
+    case OPCODETYPE_FUNC2: np=2; break;
+    case OPCODETYPE_FUNC3: np=3; break;
+    default: return 0; // tempstrings, FUNCX
+  }
+
+  if (op->fntype == FUNCTYPE_FUNCTIONTYPEREC)
+  {
+    const functionType *pfn = (const functionType *)op->fn;
+    if (!pfn || !(pfn->nParams&NSEEL_NPARAMS_FLAG_CONST)) return 0;
+  }
+  else if (op->fntype < 0 || op->fntype >= FN_NONCONST_BEGIN) return 0;
+
+  for (x=0;x<np;x++) if (!optimizeOpcodes_isPure(op->parms.parms[x])) return 0;
+  return 1;
+}
+
+// true if a and b are the same pure expression (so evaluate to the same value, when evaluated back to back)
+static int optimizeOpcodes_isSameExpr(const opcodeRec *a, const opcodeRec *b)
+{
+  int x, np;
+  if (a->opcodeType != b->opcodeType) return 0;
+  switch (a->opcodeType)
+  {
+    case OPCODETYPE_DIRECTVALUE:
+    return a->parms.dv.directValue == b->parms.dv.directValue;
+    case OPCODETYPE_VALUE_FROM_NAMESPACENAME:
+    case OPCODETYPE_VARPTR:
+    case OPCODETYPE_VARPTRPTR:
+    return optimizeOpcodes_isSameVar(a,b);
+    case OPCODETYPE_FUNC1: np=1; break;
+    case OPCODETYPE_FUNC2: np=2; break;
+    case OPCODETYPE_FUNC3: np=3; break;
+    default: return 0;
+  }
+  if (a->fntype != b->fntype) return 0;
+  if (a->fntype == FUNCTYPE_FUNCTIONTYPEREC)
+  {
+    const functionType *pfn = (const functionType *)a->fn;
+    if (a->fn != b->fn || !pfn || !(pfn->nParams&NSEEL_NPARAMS_FLAG_CONST)) return 0;
+  }
+  else if (a->fntype < 0 || a->fntype >= FN_NONCONST_BEGIN) return 0;
+
+  for (x=0;x<np;x++) if (!optimizeOpcodes_isSameExpr(a->parms.parms[x],b->parms.parms[x])) return 0;
+  return 1;
+}
+
+// true if evaluating op could not observe var (a named global OPCODETYPE_VARPTR, or a local OPCODETYPE_VARPTRPTR)
+static int optimizeOpcodes_cannotReadVar(const opcodeRec *op, const opcodeRec *var)
+{
+  int x, np;
+  switch (op->opcodeType)
+  {
+    case OPCODETYPE_DIRECTVALUE: return 1;
+    case OPCODETYPE_VARPTR:
+      if (var->opcodeType != OPCODETYPE_VARPTR) return 1; // locals have their own storage
+      // reg00 etc have an empty relname, anything we can't compare by name might alias
+      return op->relname && op->relname[0] && stricmp(op->relname,var->relname);
+    case OPCODETYPE_VARPTRPTR:
+      return !optimizeOpcodes_isSameVar(op,var);
+    case OPCODETYPE_VALUE_FROM_NAMESPACENAME:
+      return var->opcodeType == OPCODETYPE_VARPTRPTR; // instance variables might alias globals, but not locals
+    case OPCODETYPE_FUNC1: np=1; break;
+    case OPCODETYPE_FUNC2: np=2; break;
+    case OPCODETYPE_FUNC3: np=3; break;
+    default: return 0;
+  }
+  if (!optimizeOpcodes_isPure(op)) return 0; // function calls might read anything
+
+  for (x=0;x<np;x++) if (!optimizeOpcodes_cannotReadVar(op->parms.parms[x],var)) return 0;
+  return 1;
+}
+
+// if stmt is "v=a" and next is "v=b" where b can't see v, returns a (the first store is dead)
+static opcodeRec *optimizeOpcodes_deadStoreValue(opcodeRec *stmt, opcodeRec *next)
+{
+  opcodeRec *var;
+  if (next->opcodeType == OPCODETYPE_FUNC2 && next->fntype == FN_JOIN_STATEMENTS) next = next->parms.parms[0];
+
+  if (stmt->opcodeType != OPCODETYPE_FUNC2 || stmt->fntype != FN_ASSIGN) return NULL;
+  if (next->opcodeType != OPCODETYPE_FUNC2 || next->fntype != FN_ASSIGN) return NULL;
+
+  var = stmt->parms.parms[0];
+  // only named globals and locals: strings (#x) have copy semantics, instance variables can alias
+  if (var->opcodeType == OPCODETYPE_VARPTR)
+  {
+    if (!var->relname || !var->relname[0] || var->relname[0] == '#') return NULL;
+  }
+  else if (var->opcodeType != OPCODETYPE_VARPTRPTR) return NULL;
+
+  if (!optimizeOpcodes_isSameVar(var,next->parms.parms[0])) return NULL;
+  if (!optimizeOpcodes_cannotReadVar(next->parms.parms[1],var)) return NULL;
+
+  return stmt->parms.parms[1];
+}
+
 // returns true if does something (other than calculating and throwing away a value)
 static char optimizeOpcodes(compileContext *ctx, opcodeRec *op, int needsResult)
 {
@@ -1935,6 +2217,13 @@ static char optimizeOpcodes(compileContext *ctx, opcodeRec *op, int needsResult)
   char retv, retv_parm[3], joined_retv=0;
   while (op && op->opcodeType == OPCODETYPE_FUNC2 && op->fntype == FN_JOIN_STATEMENTS)
   {
+    if (!(ctx->optimizeDisableFlags&OPTFLAG_NO_DEADSTORE))
+    {
+      // v=a; v=b; -- only the side effects of a are needed
+      opcodeRec *dv = optimizeOpcodes_deadStoreValue(op->parms.parms[0],op->parms.parms[1]);
+      if (dv) op->parms.parms[0] = dv;
+    }
+
     if (!optimizeOpcodes(ctx,op->parms.parms[0], 0) || OPCODE_IS_TRIVIAL(op->parms.parms[0]))
     {
       // direct value, can skip ourselves
@@ -2001,6 +2290,25 @@ start_over: // when an opcode changed substantially in optimization, goto here t
             case FN_UMINUS: RESTART_DIRECTVALUE(- op->parms.parms[0]->parms.dv.directValue);
           }
         }
+        else if (op->fntype == FN_UMINUS && !(ctx->optimizeDisableFlags&OPTFLAG_NO_CONSTCHAIN))
+        {
+          // -(x*c) and -(x/c) become x*-c and x/-c, which is exact
+          double c;
+          int isdiv;
+          opcodeRec *term = optimizeOpcodes_getScaleTerm(op->parms.parms[0],&c,&isdiv);
+          if (term)
+          {
+            opcodeRec *cv = nseel_createCompiledValue(ctx,-c);
+            if (cv)
+            {
+              op->opcodeType = OPCODETYPE_FUNC2;
+              op->fntype = isdiv ? FN_DIVIDE : FN_MULTIPLY;
+              op->parms.parms[0] = term;
+              op->parms.parms[1] = cv;
+              goto start_over;
+            }
+          }
+        }
         else if (op->fntype == FN_NOT || op->fntype == FN_NOTNOT)
         {
           if (op->parms.parms[0]->opcodeType == OPCODETYPE_FUNC1)
@@ -2420,6 +2728,11 @@ start_over: // when an opcode changed substantially in optimization, goto here t
                 break;
 
               }
+              if (second_parm && !(ctx->optimizeDisableFlags&OPTFLAG_NO_CSE) && 
+                  first_parm->opcodeType >= OPCODETYPE_FUNC1 &&
+                  optimizeOpcodes_isPure(first_parm) &&
+                  optimizeOpcodes_isSameExpr(first_parm,op->parms.parms[1])) second_parm=NULL; // (expr)*(expr)
+
               if (!second_parm) // switch from x*x to sqr(x)
               {
                 static functionType sqrcpy={ "sqr",    nseel_asm_sqr,nseel_asm_sqr_end,   1|NSEEL_NPARAMS_FLAG_CONST|BIF_RETURNSONSTACK|BIF_LASTPARMONSTACK|BIF_FPSTACKUSE(1) };
@@ -2430,6 +2743,51 @@ start_over: // when an opcode changed substantially in optimization, goto here t
               }
             }
           }
+          // fall through
+          case FN_DIVIDE:
+            if (!(ctx->optimizeDisableFlags&OPTFLAG_NO_CONSTCHAIN) && (dv1 || (dv0 && op->fntype == FN_MULTIPLY)))
+            {
+              // (x op1 c1) op2 c2 -> x*c, only when each step multiplies by a power of two of magnitude >= 1
+              // (c, or 1/c if dividing). those steps are exact unless they overflow, and if x*m1 overflows,
+              // x*(m1*m2) does too, so the result is bit-identical. scaling down is never folded, since
+              // rounding into the subnormal range twice can differ from rounding once
+              const double c2 = op->parms.parms[dv1 ? 1 : 0]->parms.dv.directValue;
+              double c1;
+              int isdiv1;
+              opcodeRec *term = optimizeOpcodes_getScaleTerm(op->parms.parms[dv1 ? 0 : 1],&c1,&isdiv1);
+              if (term && optimizeOpcodes_isPow2(c1) && optimizeOpcodes_isPow2(c2))
+              {
+                const double m1 = isdiv1 ? 1.0/c1 : c1, m2 = op->fntype == FN_DIVIDE ? 1.0/c2 : c2, c = m1*m2;
+                // c is below 2^100, which is exact in floats, too
+                if (fabs(m1) >= 1.0 && fabs(m2) >= 1.0 && fabs(c) <= 1.0e30)
+                {
+                  opcodeRec *cv = nseel_createCompiledValue(ctx,c);
+                  if (cv)
+                  {
+                    op->fntype = FN_MULTIPLY;
+                    op->parms.parms[0] = term;
+                    op->parms.parms[1] = cv;
+                    goto start_over;
+                  }
+                }
+              }
+            }
+          break;
+          case FN_ADD:
+            if (!(ctx->optimizeDisableFlags&OPTFLAG_NO_CSE) &&
+                op->parms.parms[0]->opcodeType >= OPCODETYPE_VALUE_FROM_NAMESPACENAME &&
+                optimizeOpcodes_isPure(op->parms.parms[0]) &&
+                optimizeOpcodes_isSameExpr(op->parms.parms[0],op->parms.parms[1]))
+            {
+              // (expr)+(expr) = (expr)*2, exactly
+              opcodeRec *cv = nseel_createCompiledValue(ctx,2.0);
+              if (cv)
+              {
+                op->fntype = FN_MULTIPLY;
+                op->parms.parms[1] = cv;
+                goto start_over;
+              }
+            }
           break;
           case FN_POW:
             {
@@ -2509,9 +2867,6 @@ start_over: // when an opcode changed substantially in optimization, goto here t
       max
 
 
-      also, optimize should (recursively or maybe iteratively?) search transitive functions (mul/div) for more constant reduction possibilities
-
-
       */
 
 
@@ -2646,6 +3001,7 @@ static int generateValueToReg(compileContext *ctx, opcodeRec *op, unsigned char
       if (!b) RET_MINUS1_FAIL("error creating storage for str")
 
       if (!ctx->onNamedString) return -1; // should never happen, will not generate OPCODETYPE_VALUE_FROM_NAMESPACENAME with # prefix if !onNamedString
+      CODECACHE_FAIL(ctx);
 
       *b = ctx->onNamedString(ctx->caller_this,nm);
     }
@@ -2653,6 +3009,7 @@ static int generateValueToReg(compileContext *ctx, opcodeRec *op, unsigned char
     {
       b = nseel_int_register_var(ctx,nm,0,NULL);
       if (!b) RET_MINUS1_FAIL("error registering var")
+      codecache_notevar(ctx,nm,0,b);
     }
   }
   else
@@ -2661,6 +3018,7 @@ static int generateValueToReg(compileContext *ctx, opcodeRec *op, unsigned char
 
     if (op->opcodeType==OPCODETYPE_DIRECTVALUE_TEMPSTRING && ctx->onNamedString)
     {
+      CODECACHE_FAIL(ctx);
       op->parms.dv.directValue = ctx->onNamedString(ctx->caller_this,"");
       op->parms.dv.valuePtr = NULL;
     }
@@ -2669,6 +3027,7 @@ static int generateValueToReg(compileContext *ctx, opcodeRec *op, unsigned char
     if (!b && op->opcodeType == OPCODETYPE_VARPTR && op->relname && op->relname[0]) 
     {
       op->parms.dv.valuePtr = b = nseel_int_register_var(ctx,op->relname,0,NULL);
+      codecache_notevar(ctx,op->relname,0,b);
     }
 
     if (b && op->opcodeType == OPCODETYPE_VARPTRPTR) b = *(EEL_F **)b;
@@ -2708,6 +3067,7 @@ static int generateValueToReg(compileContext *ctx, opcodeRec *op, unsigned char
   }
 
   GLUE_MOV_PX_DIRECTVALUE_GEN(bufOut,(INT_PTR)b,whichReg);
+  codecache_addreloc_insn(ctx,bufOut,GLUE_MOV_PX_DIRECTVALUE_SIZE,(INT_PTR)b);
   return GLUE_MOV_PX_DIRECTVALUE_SIZE;
 }
 
@@ -3272,13 +3632,22 @@ static int compileNativeFunctionCall(compileContext *ctx, opcodeRec *op, unsigne
   {
     unsigned char *p=bufOut + parm_size;
     memcpy(p, func, func_size);
-    if (preProc) p=preProc(p,func_size,ctx);
+    if (preProc) 
+    {
+      // custom preprocessors may write pointers that can't be relocated
+      if (preProc != NSEEL_PProc_RAM && preProc != NSEEL_PProc_THIS && preProc != NSEEL_PProc_GRAM &&
+          preProc != NSEEL_PProc_Stack && preProc != NSEEL_PProc_Stack_PeekTop) CODECACHE_FAIL(ctx);
+      p=preProc(p,func_size,ctx);
+    }
     if (repl)
     {
-      if (repl[0]) p=EEL_GLUE_set_immediate(p,(INT_PTR)repl[0]);
-      if (repl[1]) p=EEL_GLUE_set_immediate(p,(INT_PTR)repl[1]);
-      if (repl[2]) p=EEL_GLUE_set_immediate(p,(INT_PTR)repl[2]);
-      if (repl[3]) p=EEL_GLUE_set_immediate(p,(INT_PTR)repl[3]);
+      int x;
+      for (x = 0; x < 4; x ++) if (repl[x])
+      {
+        p=EEL_GLUE_set_immediate(p,(INT_PTR)repl[x]);
+        codecache_addreloc(ctx,EEL_GLUE_IMMEDIATE_SITE(p),(INT_PTR)repl[x],EEL_RELOC_STATIC,op->fntype,
+          op->fntype == FUNCTYPE_FUNCTIONTYPEREC ? (const functionType *)op->fn : NULL,x);
+      }
     }
   }
 
@@ -3434,7 +3803,11 @@ static int compileEelFunctionCall(compileContext *ctx, opcodeRec *op, unsigned c
           const int cpsize = GLUE_POP_FPSTACK_TO_PTR(NULL,NULL);
           if (bufOut_len < parm_size + cpsize) RET_MINUS1_FAIL("eelfunc size popfpstacktoptr")
 
-          if (bufOut) GLUE_POP_FPSTACK_TO_PTR((unsigned char *)bufOut + parm_size,cfp_ptrs[pn]);
+          if (bufOut) 
+          {
+            GLUE_POP_FPSTACK_TO_PTR((unsigned char *)bufOut + parm_size,cfp_ptrs[pn]);
+            codecache_addreloc_insn(ctx,(unsigned char *)bufOut + parm_size,cpsize,(INT_PTR)cfp_ptrs[pn]);
+          }
           parm_size += cpsize;
         }
         else
@@ -3443,7 +3816,11 @@ static int compileEelFunctionCall(compileContext *ctx, opcodeRec *op, unsigned c
           const int cpsize = GLUE_COPY_VALUE_AT_P1_TO_PTR(NULL,NULL);
           if (bufOut_len < parm_size + cpsize) RET_MINUS1_FAIL("eelfunc size copyvalueatp1toptr")
 
-          if (bufOut) GLUE_COPY_VALUE_AT_P1_TO_PTR((unsigned char *)bufOut + parm_size,cfp_ptrs[pn]);
+          if (bufOut) 
+          {
+            GLUE_COPY_VALUE_AT_P1_TO_PTR((unsigned char *)bufOut + parm_size,cfp_ptrs[pn]);
+            codecache_addreloc_insn(ctx,(unsigned char *)bufOut + parm_size,cpsize,(INT_PTR)cfp_ptrs[pn]);
+          }
           parm_size += cpsize;
         }
       }
@@ -3452,7 +3829,11 @@ static int compileEelFunctionCall(compileContext *ctx, opcodeRec *op, unsigned c
         const int popsize =  GLUE_POP_VALUE_TO_ADDR(NULL,NULL);
         if (bufOut_len < parm_size + popsize) RET_MINUS1_FAIL("eelfunc size pop value to addr")
 
-        if (bufOut) GLUE_POP_VALUE_TO_ADDR((unsigned char *)bufOut + parm_size,cfp_ptrs[pn]);
+        if (bufOut) 
+        {
+          GLUE_POP_VALUE_TO_ADDR((unsigned char *)bufOut + parm_size,cfp_ptrs[pn]);
+          codecache_addreloc_insn(ctx,(unsigned char *)bufOut + parm_size,popsize,(INT_PTR)cfp_ptrs[pn]);
+        }
         parm_size+=popsize;
 
       }
@@ -3473,6 +3854,7 @@ static int compileEelFunctionCall(compileContext *ctx, opcodeRec *op, unsigned c
       {
         if (generateValueToReg(ctx,parmptrs[pn],bufOut + parm_size,0,namespacePathToThis, 1)<0) RET_MINUS1_FAIL("eelfunc gvr fail")
         GLUE_COPY_VALUE_AT_P1_TO_PTR(bufOut + parm_size + GLUE_MOV_PX_DIRECTVALUE_SIZE,cfp_ptrs[pn]);
+        codecache_addreloc_insn(ctx,bufOut + parm_size + GLUE_MOV_PX_DIRECTVALUE_SIZE,cpsize - GLUE_MOV_PX_DIRECTVALUE_SIZE,(INT_PTR)cfp_ptrs[pn]);
       }
       parm_size += cpsize;
 
@@ -3481,7 +3863,11 @@ static int compileEelFunctionCall(compileContext *ctx, opcodeRec *op, unsigned c
 
   if (bufOut_len < parm_size + func_size) RET_MINUS1_FAIL("eelfunc size combined")
   
-  if (bufOut) memcpy(bufOut + parm_size, func, func_size);
+  if (bufOut) 
+  {
+    memcpy(bufOut + parm_size, func, func_size);
+    codecache_copyrelocs(ctx,bufOut + parm_size,(const unsigned char *)func,func_size);
+  }
 
   return parm_size + func_size;
   // end of EEL function generation
@@ -3799,7 +4185,7 @@ doNonInlinedAndOr_:
         p = bufOut + parm_size;
         memcpy(p, stub, stubsize);
     
-        p=EEL_GLUE_set_immediate(p,(INT_PTR)newblock2);
+        p=nseel_set_immediate(ctx,p,(INT_PTR)newblock2,EEL_RELOC_AUTO);
       }
       return rv_offset + parm_size + stubsize;
     }
@@ -3893,8 +4279,8 @@ doNonInlineIf_:
         ptr = bufOut + parm_size;
         memcpy(ptr, stub, stubsize);
          
-        ptr=EEL_GLUE_set_immediate(ptr,(INT_PTR)newblock2);
-        EEL_GLUE_set_immediate(ptr,(INT_PTR)newblock3);
+        ptr=nseel_set_immediate(ctx,ptr,(INT_PTR)newblock2,EEL_RELOC_AUTO);
+        nseel_set_immediate(ctx,ptr,(INT_PTR)newblock3,EEL_RELOC_AUTO);
       }
       return rv_offset + parm_size + stubsize;
     }
@@ -3922,7 +4308,7 @@ doNonInlineIf_:
           if (!newblock2) RET_MINUS1_FAIL("repeatwhile ccbwr fail")
       
           memcpy(pwr,stubfunc,stubsz);
-          pwr=EEL_GLUE_set_immediate(pwr,(INT_PTR)newblock2); 
+          pwr=nseel_set_immediate(ctx,pwr,(INT_PTR)newblock2,EEL_RELOC_AUTO); 
         }
       
         return rv_offset+stubsz;
@@ -3995,7 +4381,7 @@ doNonInlineIf_:
           p = bufOut + parm_size;
           memcpy(p, stub, stubsize);
       
-          p=EEL_GLUE_set_immediate(p,(INT_PTR)newblock2);
+          p=nseel_set_immediate(ctx,p,(INT_PTR)newblock2,EEL_RELOC_AUTO);
         }
         return rv_offset + parm_size + stubsize;
       }
@@ -4413,6 +4799,862 @@ typedef struct topLevelCodeSegmentRec {
 } topLevelCodeSegmentRec;
 
 
+//------------------------------------------------------------------------------
+// compiled code cache
+
+enum { // eelCachedReloc::cls
+  EEL_CC_CODE=0, // arg = offset in code image
+  EEL_CC_DATA, // arg = offset in data image
+  EEL_CC_CTX, // arg = offset in compileContext
+  EEL_CC_THIS,
+  EEL_CC_GRAM,
+  EEL_CC_VAR, // arg = index in vars
+  EEL_CC_STATIC, // arg = fntype, sym = function name (or -1 for builtin fntype), np = nParams
+};
+
+typedef struct
+{
+  int offs; // location of the pointer in the code image (or data image, if in_data)
+  unsigned char in_data, cls, slot, pad;
+  int arg, sym, np;
+  INT_PTR value; // EEL_CC_STATIC, once resolved
+} eelCachedReloc;
+
+typedef struct
+{
+  int name; // offset in strings
+  int isglobal;
+} eelCachedVar;
+
+// everything that is persisted to disk, blob is:
+// code image, data image, eelCachedReloc[nrelocs], eelCachedVar[nvars], strings, source
+typedef struct
+{
+  WDL_UINT64 commonsig;
+  int flags, src_len;
+  int code_len, data_len, data_align;
+  int handle_offs, code_offs, worktable_offs, stack_offs;
+  int nrelocs, nvars, strings_len;
+  int blob_len;
+} eelCodeCacheDesc;
+
+#define EEL_CC_RELOCS_OFFS(d) (((d)->code_len + (d)->data_len + 15)&~15)
+#define EEL_CC_VARS_OFFS(d) (EEL_CC_RELOCS_OFFS(d) + (d)->nrelocs * (int)sizeof(eelCachedReloc))
+#define EEL_CC_STRINGS_OFFS(d) (EEL_CC_VARS_OFFS(d) + (d)->nvars * (int)sizeof(eelCachedVar))
+#define EEL_CC_SRC_OFFS(d) (EEL_CC_STRINGS_OFFS(d) + (d)->strings_len)
+#define EEL_CC_BLOB_LEN(d) (EEL_CC_SRC_OFFS(d) + (d)->src_len)
+
+typedef struct eelCodeCacheEnt
+{
+  struct eelCodeCacheEnt *next;
+  int refcnt; // 1 while in the cache list, plus one for each user (instantiation or file write) in progress
+  int resolved; // EEL_CC_STATIC values are valid for functab
+  eel_function_table *functab;
+  void *func_check, *func_check_user;
+  WDL_UINT64 hash;
+  eelCodeCacheDesc d;
+  unsigned char *blob;
+} eelCodeCacheEnt;
+
+typedef struct eelCodeCache
+{
+  eelCodeCacheEnt *list; // most recently used first
+  int max_bytes;
+  int stats[8]; // hits, misses, stores, uncacheable, disk hits, disk writes, entries, bytes
+  char *path;
+  unsigned int host_sig;
+} eelCodeCache;
+
+typedef struct
+{
+  char magic[8];
+  WDL_UINT64 build_sig;
+  unsigned int cpu_sig[4];
+  unsigned int host_sig;
+  eelCodeCacheDesc d;
+  WDL_UINT64 sum; // codecache_filesum()
+} eelCodeCacheFileHdr;
+
+#define EEL_CC_MAX_LEN (1<<26) // per section, keeps the blob layout from overflowing on a damaged header
+
+static WDL_UINT64 codecache_hash(WDL_UINT64 h, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  while (len--)
+  {
+    h ^= *p++;
+    h *= WDL_UINT64_CONST(0x100000001b3);
+  }
+  return h;
+}
+#define EEL_CC_HASH_INIT WDL_UINT64_CONST(0xcbf29ce484222325)
+
+static void codecache_entfree(eelCodeCacheEnt *e)
+{
+  free(e->blob);
+  free(e);
+}
+
+static void codecache_release(eelCodeCacheEnt *e) // call with mutex held
+{
+  if (--e->refcnt == 0) codecache_entfree(e);
+}
+
+static int codecache_samekey(const eelCodeCacheEnt *a, const eelCodeCacheEnt *b)
+{
+  return a->hash == b->hash && a->d.src_len == b->d.src_len && a->d.flags == b->d.flags && a->d.commonsig == b->d.commonsig &&
+         a->functab == b->functab && a->func_check == b->func_check && a->func_check_user == b->func_check_user &&
+         !memcmp(a->blob + EEL_CC_SRC_OFFS(&a->d),b->blob + EEL_CC_SRC_OFFS(&b->d),a->d.src_len);
+}
+
+// call with mutex held
+static void codecache_insert(eelCodeCache *cache, eelCodeCacheEnt *e)
+{
+  eelCodeCacheEnt **pp;
+  int bytes=0, cnt=0;
+  e->next = cache->list;
+  cache->list = e;
+  e->refcnt++;
+
+  // evict least recently used entries (or e itself, if it is too large to ever fit), and any
+  // older copy of e that another thread compiled at the same time
+  pp = &cache->list;
+  while (*pp)
+  {
+    eelCodeCacheEnt *t = *pp;
+    const int tsz = t->d.blob_len + (int)sizeof(eelCodeCacheEnt);
+    if (bytes + tsz > cache->max_bytes || (t != e && codecache_samekey(t,e)))
+    {
+      *pp = t->next;
+      codecache_release(t);
+      continue;
+    }
+    bytes += tsz;
+    cnt++;
+    pp = &t->next;
+  }
+  cache->stats[6] = cnt;
+  cache->stats[7] = bytes;
+}
+
+#ifdef EEL_CODECACHE_SUPPORTED
+
+#define EEL_CC_STR2(x) #x
+#define EEL_CC_STR(x) EEL_CC_STR2(x)
+#if defined(__VERSION__)
+  #define EEL_CC_COMPILER __VERSION__
+#elif defined(_MSC_FULL_VER)
+  #define EEL_CC_COMPILER "msvc " EEL_CC_STR(_MSC_FULL_VER)
+#else
+  #define EEL_CC_COMPILER ""
+#endif
+
+// increase whenever code generation or the cached format changes
+#define EEL_CODECACHE_VERSION 2
+
+// persisted code is only valid for the same code generator, compiler, layout and builtin function table
+static WDL_UINT64 codecache_buildsig()
+{
+  static const char str[] = EEL_CC_COMPILER;
+  const int hdr[5] = { EEL_CODECACHE_VERSION, (int)sizeof(compileContext), (int)sizeof(codeHandleType), (int)sizeof(INT_PTR), (int)sizeof(EEL_F) };
+  const int fn1size = (int) (sizeof(fnTable1)/sizeof(fnTable1[0]));
+  WDL_UINT64 h = codecache_hash(codecache_hash(EEL_CC_HASH_INIT,hdr,sizeof(hdr)),str,sizeof(str)), fnsum = 0;
+  int x;
+  // fnTable1 may be sorted in place at any time, so combine the entries in an order-independent way
+  for (x = 0; x < fn1size; x ++)
+  {
+    WDL_UINT64 fh = codecache_hash(EEL_CC_HASH_INIT,fnTable1[x].name,strlen(fnTable1[x].name));
+    fnsum += codecache_hash(fh,&fnTable1[x].nParams,sizeof(fnTable1[x].nParams));
+  }
+  return codecache_hash(h,&fnsum,sizeof(fnsum));
+}
+
+// checksum of the layout in the header and of everything after it
+static WDL_UINT64 codecache_filesum(const eelCodeCacheDesc *d, const unsigned char *blob)
+{
+  return codecache_hash(codecache_hash(EEL_CC_HASH_INIT,d,sizeof(*d)),blob,d->blob_len);
+}
+
+static void codecache_cpusig(unsigned int sig[4])
+{
+  memset(sig,0,4*sizeof(unsigned int)); // bytecode does not depend on CPU features, reserved for native targets
+}
+
+static int codecache_resolve(compileContext *ctx, eelCodeCacheEnt *e)
+{
+  eelCachedReloc *r = (eelCachedReloc *)(e->blob + EEL_CC_RELOCS_OFFS(&e->d));
+  const char *strings = (const char *)e->blob + EEL_CC_STRINGS_OFFS(&e->d);
+  int x;
+  for (x = 0; x < e->d.nrelocs; x ++, r++) if (r->cls == EEL_CC_STATIC)
+  {
+    void *v = NULL;
+    if (r->slot >= 4) return 0;
+    if (r->sym >= 0)
+    {
+      int mchk = 0;
+      const char *name = strings + r->sym;
+      functionType *f = nseel_getFunctionByName(ctx,name,&mchk);
+      while (f)
+      {
+        if (f->nParams == r->np && f->replptrs[r->slot]) { v = f->replptrs[r->slot]; break; }
+        if (mchk-- <= 0 || stricmp(f[1].name,name)) break;
+        f++;
+      }
+    }
+    else
+    {
+      NSEEL_PPPROC pproc = NULL;
+      void **repl = NULL;
+      void *func_e = NULL;
+      int abiinfo = 0;
+      if (nseel_getBuiltinFunctionAddress(ctx,r->arg,NULL,&pproc,&repl,&func_e,&abiinfo,0,NULL,NULL) && repl) v = repl[r->slot];
+    }
+    if (!v) return 0;
+    r->value = (INT_PTR)v;
+  }
+  e->functab = ctx->registered_func_tab;
+  e->func_check = (void *)ctx->func_check;
+  e->func_check_user = ctx->func_check_user;
+  e->resolved = 1;
+  return 1;
+}
+
+static void codecache_filename(char *buf, int bufsz, eelCodeCache *cache, WDL_UINT64 hash)
+{
+  hash = codecache_hash(hash,&cache->host_sig,sizeof(cache->host_sig));
+  snprintf(buf,bufsz,"%s%c%08x%08x.eelc",cache->path,WDL_DIRCHAR,(unsigned int)(hash>>32),(unsigned int)hash);
+}
+
+// checks that every offset and index in an entry read from disk stays inside the entry and the VM,
+// so that a truncated or damaged file can never make codecache_instantiate() write out of bounds
+static int codecache_validate(const eelCodeCacheEnt *e)
+{
+  const eelCodeCacheDesc *d = &e->d;
+  const eelCachedReloc *r = (const eelCachedReloc *)(e->blob + EEL_CC_RELOCS_OFFS(d));
+  const eelCachedVar *cv = (const eelCachedVar *)(e->blob + EEL_CC_VARS_OFFS(d));
+  const char *strings = (const char *)e->blob + EEL_CC_STRINGS_OFFS(d);
+  codeHandleType h;
+  int x;
+
+  if (d->strings_len > 0 && strings[d->strings_len-1]) return 0; // every string offset below then ends in range
+
+  memcpy(&h,e->blob + d->code_len + d->handle_offs,sizeof(h));
+  if (d->code_offs < 0 || d->code_offs >= d->code_len) return 0;
+  if (h.workTable_size < 0 || h.workTable_size > d->data_len / (int)sizeof(EEL_F) ||
+      d->worktable_offs < 0 || (d->worktable_offs & (sizeof(EEL_F)-1)) ||
+      d->worktable_offs > d->data_len - (h.workTable_size + MIN_COMPUTABLE_SIZE + COMPUTABLE_EXTRA_SPACE) * (int)sizeof(EEL_F)) return 0;
+  if (d->stack_offs >= 0 ?
+        (d->data_align != NSEEL_STACK_SIZE*(int)sizeof(EEL_F) || (d->stack_offs & (d->data_align-1)) ||
+         d->stack_offs > d->data_len - d->data_align) :
+        (d->stack_offs != -1 || h.want_stack)) return 0;
+
+  for (x = 0; x < d->nvars; x ++)
+    if (cv[x].name < 0 || cv[x].name >= d->strings_len) return 0;
+
+  for (x = 0; x < d->nrelocs; x ++, r++)
+  {
+    const int img_len = r->in_data ? d->data_len : d->code_len;
+    if (r->in_data > 1 || r->offs < 0 || r->offs > img_len - (int)sizeof(INT_PTR)) return 0;
+    switch (r->cls)
+    {
+      case EEL_CC_CODE: if (r->arg < 0 || r->arg > d->code_len) return 0; break;
+      case EEL_CC_DATA: if (r->arg < 0 || r->arg > d->data_len) return 0; break;
+      case EEL_CC_CTX: if (r->arg < 0 || r->arg >= (int)sizeof(compileContext)) return 0; break;
+      case EEL_CC_THIS: case EEL_CC_GRAM: break;
+      case EEL_CC_VAR: if (r->arg < 0 || r->arg >= d->nvars) return 0; break;
+      case EEL_CC_STATIC: if (r->slot >= 4 || r->sym < -1 || r->sym >= d->strings_len) return 0; break;
+      default: return 0;
+    }
+  }
+  return 1;
+}
+
+static eelCodeCacheEnt *codecache_readfile(compileContext *ctx, const char *fn, unsigned int host_sig, const char *src, int src_len, int flags, WDL_UINT64 hash)
+{
+  eelCodeCacheFileHdr hdr;
+  eelCodeCacheEnt *e;
+  unsigned int cpu_sig[4];
+  FILE *fp = fopen(fn,"rb");
+  if (!fp) return NULL;
+
+  codecache_cpusig(cpu_sig);
+  if (fread(&hdr,1,sizeof(hdr),fp) != sizeof(hdr) ||
+      memcmp(hdr.magic,"EELCODE2",8) ||
+      hdr.build_sig != codecache_buildsig() ||
+      memcmp(hdr.cpu_sig,cpu_sig,sizeof(cpu_sig)) ||
+      hdr.host_sig != host_sig ||
+      hdr.d.flags != flags ||
+      hdr.d.commonsig != ctx->codecache_commonsig ||
+      hdr.d.src_len != src_len ||
+      hdr.d.code_len < 0 || hdr.d.code_len > EEL_CC_MAX_LEN || hdr.d.data_len < 0 || hdr.d.data_len > EEL_CC_MAX_LEN ||
+      hdr.d.nrelocs < 0 || hdr.d.nrelocs > EEL_CC_MAX_LEN / (int)sizeof(eelCachedReloc) ||
+      hdr.d.nvars < 0 || hdr.d.nvars > EEL_CC_MAX_LEN / (int)sizeof(eelCachedVar) ||
+      hdr.d.strings_len < 0 || hdr.d.strings_len > EEL_CC_MAX_LEN ||
+      hdr.d.blob_len != EEL_CC_BLOB_LEN(&hdr.d) ||
+      hdr.d.handle_offs < 0 || (hdr.d.handle_offs & (sizeof(INT_PTR)-1)) ||
+      hdr.d.handle_offs > hdr.d.data_len - (int)sizeof(codeHandleType) ||
+      (hdr.d.data_align != 64 && hdr.d.data_align != NSEEL_STACK_SIZE*(int)sizeof(EEL_F)))
+  {
+    fclose(fp);
+    return NULL;
+  }
+
+  e = (eelCodeCacheEnt *)calloc(1,sizeof(eelCodeCacheEnt));
+  if (e) e->blob = (unsigned char *)malloc(hdr.d.blob_len);
+  if (e) e->d = hdr.d;
+  if (!e || !e->blob || fread(e->blob,1,hdr.d.blob_len,fp) != (size_t)hdr.d.blob_len ||
+      codecache_filesum(&hdr.d,e->blob) != hdr.sum ||
+      memcmp(e->blob + EEL_CC_SRC_OFFS(&hdr.d),src,src_len) ||
+      !codecache_validate(e))
+  {
+    fclose(fp);
+    if (e) codecache_entfree(e);
+    return NULL;
+  }
+  fclose(fp);
+
+  e->hash = hash;
+  e->refcnt = 1;
+  if (!codecache_resolve(ctx,e))
+  {
+    codecache_entfree(e);
+    return NULL;
+  }
+  return e;
+}
+
+static void codecache_writefile(eelCodeCache *cache, const char *fn, const eelCodeCacheEnt *e)
+{
+  eelCodeCacheFileHdr hdr;
+  char tmp[2048];
+  FILE *fp;
+  int ok;
+
+  memset(&hdr,0,sizeof(hdr));
+  memcpy(hdr.magic,"EELCODE2",8);
+  hdr.build_sig = codecache_buildsig();
+  codecache_cpusig(hdr.cpu_sig);
+  hdr.host_sig = cache->host_sig;
+  hdr.d = e->d;
+  hdr.sum = codecache_filesum(&e->d,e->blob);
+
+  // write to a temporary file first, so other processes never see a partial file
+  snprintf(tmp,sizeof(tmp),"%s.%p.tmp",fn,(const void *)e);
+  fp = fopen(tmp,"wb");
+  if (!fp) return;
+  ok = fwrite(&hdr,1,sizeof(hdr),fp) == sizeof(hdr) &&
+       fwrite(e->blob,1,e->d.blob_len,fp) == (size_t)e->d.blob_len;
+  if (fclose(fp)) ok=0;
+  if (ok)
+  {
+#ifdef _WIN32
+    DeleteFile(fn);
+    ok = MoveFile(tmp,fn);
+#else
+    ok = !rename(tmp,fn);
+#endif
+  }
+  if (!ok) remove(tmp);
+}
+
+static int codecache_imageoffs(llBlock **blocks, const int *offs, int nblocks, const unsigned char *p, int sz)
+{
+  int x;
+  for (x = 0; x < nblocks; x ++)
+  {
+    const unsigned char *b = (const unsigned char *)blocks[x]->block;
+    if (p >= b && p + sz <= b + blocks[x]->sizeused) return offs[x] + (int)(p - b);
+  }
+  return -1;
+}
+
+static int codecache_ptrcmp(const void *a, const void *b)
+{
+  const eelRelocVarRec *va = (const eelRelocVarRec *)a, *vb = (const eelRelocVarRec *)b;
+  return va->ptr < vb->ptr ? -1 : va->ptr > vb->ptr ? 1 : va->name - vb->name;
+}
+
+static int codecache_varptrcmp(const void *a, const void *b)
+{
+  const EEL_F *va = *(EEL_F * const *)a, *vb = *(EEL_F * const *)b;
+  return va < vb ? -1 : va > vb ? 1 : 0;
+}
+
+// returns a sorted list of every variable the VM can currently resolve by name: its own variables and the
+// _global. ones. pointers returned by a getVariable callback (NSEEL_VM_set_var_resolver) can't be listed
+static EEL_F **codecache_listvars(compileContext *ctx, int *cnt)
+{
+  const int nv = EEL_GROWBUF_GET_SIZE(&ctx->varNameList);
+  varNameRec **vl = EEL_GROWBUF_GET(&ctx->varNameList);
+  nseel_globalVarItem *gp;
+  EEL_F **list;
+  int n = nv, x;
+
+  *cnt = 0;
+  NSEEL_HOSTSTUB_EnterMutex();
+  for (gp = nseel_globalreg_list; gp; gp = gp->_next) n++;
+  list = (EEL_F **)malloc((n ? n : 1) * sizeof(EEL_F *));
+  if (list)
+  {
+    for (x = 0; x < nv; x ++) list[x] = vl[x]->value;
+    for (gp = nseel_globalreg_list; gp && x < n; gp = gp->_next) list[x++] = &gp->data;
+    *cnt = x;
+  }
+  NSEEL_HOSTSTUB_LeaveMutex();
+  if (*cnt > 1) qsort(list,*cnt,sizeof(*list),codecache_varptrcmp);
+  return list;
+}
+
+// returns nonzero if p points into memory that belongs to the VM or the code handle (the context,
+// the code and data blocks, the VM's persistent blocks) or at any variable in vartab
+static int codecache_isvmptr(compileContext *ctx, llBlock **blocks, int nblocks, EEL_F **vartab, int nvartab, const unsigned char *p)
+{
+  const llBlock *b;
+  int x, lo = 0, hi = nvartab;
+  if (p >= (const unsigned char *)ctx && p < (const unsigned char *)(ctx+1)) return 1;
+  for (x = 0; x < nblocks; x ++)
+    if (p >= (const unsigned char *)blocks[x]->block && p <= (const unsigned char *)blocks[x]->block + blocks[x]->sizeused) return 1;
+  for (b = ctx->pblocks; b; b = b->next)
+    if (p >= (const unsigned char *)b->block && p <= (const unsigned char *)b->block + b->sizeused) return 1;
+  while (lo < hi)
+  {
+    const int mid = (lo+hi)/2;
+    if ((const unsigned char *)vartab[mid] < p) lo = mid+1;
+    else hi = mid;
+  }
+  return lo < nvartab && (const unsigned char *)vartab[lo] == p;
+}
+
+// classifies the pointers recorded while compiling h, and if they can all be relocated, adds h to the cache
+static void codecache_store(compileContext *ctx, codeHandleType *h, const char *src, int src_len, int flags, WDL_UINT64 hash)
+{
+  eelCodeCache *cache = ctx->codecache;
+  eelCodeCacheRecorder *rec = ctx->codecache_rec;
+  eelRelocRec *rr = EEL_GROWBUF_GET(&rec->relocs);
+  const int nrr = EEL_GROWBUF_GET_SIZE(&rec->relocs);
+  eelRelocVarRec *vars = EEL_GROWBUF_GET(&rec->vars);
+  int nvars = EEL_GROWBUF_GET_SIZE(&rec->vars);
+  EEL_GROWBUF(eelCachedReloc) relocs;
+  EEL_GROWBUF(char) strings;
+  llBlock **blocks = NULL;
+  int *offs = NULL;
+  unsigned char *sitemap = NULL;
+  EEL_F **vartab = NULL;
+  eelCodeCacheEnt *e = NULL;
+  eelCodeCacheDesc d;
+  int ncode=0, nblocks=0, nvartab=0, x, ok=0;
+  llBlock *b;
+
+  memset(&relocs,0,sizeof(relocs));
+  memset(&strings,0,sizeof(strings));
+  memset(&d,0,sizeof(d));
+  if (rec->failed) goto finish;
+
+  for (b = h->blocks; b; b = b->next) ncode++;
+  nblocks = ncode;
+  for (b = h->blocks_data; b; b = b->next) nblocks++;
+  blocks = (llBlock **)malloc(nblocks * (sizeof(llBlock *) + sizeof(int)));
+  if (!blocks) goto finish;
+  offs = (int *)(blocks + nblocks);
+
+  // lay out code and data images, preserving the alignment of each block's contents
+  d.data_align = h->want_stack ? NSEEL_STACK_SIZE*(int)sizeof(EEL_F) : 64;
+  x = 0;
+  for (b = h->blocks; b; b = b->next, x++)
+  {
+    blocks[x] = b;
+    offs[x] = d.code_len + (int) (((INT_PTR)b->block - d.code_len) & 63);
+    d.code_len = offs[x] + b->sizeused;
+  }
+  for (b = h->blocks_data; b; b = b->next, x++)
+  {
+    blocks[x] = b;
+    offs[x] = d.data_len + (int) (((INT_PTR)b->block - d.data_len) & (d.data_align-1));
+    d.data_len = offs[x] + b->sizeused;
+  }
+
+  d.handle_offs = codecache_imageoffs(blocks+ncode,offs+ncode,nblocks-ncode,(unsigned char *)h,sizeof(*h));
+  d.code_offs = codecache_imageoffs(blocks,offs,ncode,(unsigned char *)h->code,1);
+  d.worktable_offs = codecache_imageoffs(blocks+ncode,offs+ncode,nblocks-ncode,(unsigned char *)h->workTable,1);
+  d.stack_offs = h->stack ? codecache_imageoffs(blocks+ncode,offs+ncode,nblocks-ncode,(unsigned char *)h->stack,1) : -1;
+  if (d.handle_offs < 0 || d.code_offs < 0 || d.worktable_offs < 0 || (h->stack && d.stack_offs < 0)) goto finish;
+
+  // variables, sorted by address with duplicates removed
+  if (nvars > 1) qsort(vars,nvars,sizeof(*vars),codecache_ptrcmp);
+  for (x = 1; x < nvars; x ++)
+  {
+    if (vars[x].ptr == vars[d.nvars].ptr) continue;
+    vars[++d.nvars] = vars[x];
+  }
+  if (nvars) d.nvars++;
+  nvars = d.nvars;
+  for (x = 0; x < nvars; x ++)
+  {
+    const char *nm = EEL_GROWBUF_GET(&rec->names) + vars[x].name;
+    const int len = (int)strlen(nm)+1, pos = EEL_GROWBUF_GET_SIZE(&strings);
+    if (EEL_GROWBUF_RESIZE(&strings,pos+len)) goto finish;
+    memcpy(EEL_GROWBUF_GET(&strings)+pos,nm,len);
+    vars[x].name = pos;
+  }
+
+  sitemap = (unsigned char *)calloc(d.code_len + d.data_len,1);
+  if (!sitemap) goto finish;
+
+  // newest first: code is sometimes regenerated in place, in which case older records at the same location are stale
+  for (x = nrr-1; x >= 0; x --)
+  {
+    const eelRelocRec *r = rr + x;
+    eelCachedReloc cr;
+    int p;
+    memset(&cr,0,sizeof(cr));
+
+    p = codecache_imageoffs(blocks,offs,ncode,r->site,sizeof(INT_PTR));
+    if (p < 0)
+    {
+      p = codecache_imageoffs(blocks+ncode,offs+ncode,nblocks-ncode,r->site,sizeof(INT_PTR));
+      if (p < 0) continue; // code that was discarded or copied elsewhere
+      cr.in_data = 1;
+    }
+    cr.offs = p;
+    if (cr.in_data) p += d.code_len;
+
+    if (memcmp(r->site,&r->value,sizeof(INT_PTR))) continue; // overwritten since recorded
+    if (memchr(sitemap+p,1,sizeof(INT_PTR))) continue; // duplicate, or overlaps a newer record
+    memset(sitemap+p,1,sizeof(INT_PTR));
+
+    switch (r->kind)
+    {
+      case EEL_RELOC_THIS: cr.cls = EEL_CC_THIS; break;
+      case EEL_RELOC_GRAM: cr.cls = EEL_CC_GRAM; break;
+      case EEL_RELOC_STATIC:
+        cr.cls = EEL_CC_STATIC;
+        cr.arg = r->fntype;
+        cr.slot = (unsigned char)r->slot;
+        cr.value = r->value;
+        cr.sym = -1;
+        if (r->ft)
+        {
+          const int len = (int)strlen(r->ft->name)+1, pos = EEL_GROWBUF_GET_SIZE(&strings);
+          if (EEL_GROWBUF_RESIZE(&strings,pos+len)) goto finish;
+          memcpy(EEL_GROWBUF_GET(&strings)+pos,r->ft->name,len);
+          cr.sym = pos;
+          cr.np = r->ft->nParams;
+        }
+      break;
+      default:
+        {
+          const unsigned char *v = (const unsigned char *)r->value;
+          if ((cr.arg = codecache_imageoffs(blocks,offs,ncode,v,0)) >= 0) cr.cls = EEL_CC_CODE;
+          else if ((cr.arg = codecache_imageoffs(blocks+ncode,offs+ncode,nblocks-ncode,v,0)) >= 0) cr.cls = EEL_CC_DATA;
+          else if (v >= (const unsigned char *)ctx && v < (const unsigned char *)(ctx+1))
+          {
+            cr.cls = EEL_CC_CTX;
+            cr.arg = (int) (v - (const unsigned char *)ctx);
+          }
+          else
+          {
+            int lo = 0, hi = nvars;
+            while (lo < hi)
+            {
+              const int mid = (lo+hi)/2;
+              if ((const unsigned char *)vars[mid].ptr < v) lo = mid+1;
+              else hi = mid;
+            }
+            if (lo >= nvars || (const unsigned char *)vars[lo].ptr != v) goto finish; // unknown pointer
+            cr.cls = EEL_CC_VAR;
+            cr.arg = lo;
+          }
+        }
+      break;
+    }
+
+    {
+      const int sz = EEL_GROWBUF_GET_SIZE(&relocs);
+      if (EEL_GROWBUF_RESIZE(&relocs,sz+1)) goto finish;
+      EEL_GROWBUF_GET(&relocs)[sz] = cr;
+    }
+  }
+
+  // make sure no pointers into the VM, its variables, or this code were written without being recorded
+  vartab = codecache_listvars(ctx,&nvartab);
+  if (!vartab) goto finish;
+  for (x = 0; x < nblocks; x ++)
+  {
+    const unsigned char *bp = (const unsigned char *)blocks[x]->block;
+    const int base = offs[x] + (x >= ncode ? d.code_len : 0);
+    int i;
+    for (i = 0; i + (int)sizeof(INT_PTR) <= blocks[x]->sizeused; i ++)
+    {
+      const unsigned char *v;
+      if (sitemap[base+i]) continue;
+      if (bp+i+sizeof(INT_PTR) > (const unsigned char *)h && bp+i < (const unsigned char *)(h+1)) continue; // fixed up separately
+      memcpy(&v,bp+i,sizeof(v));
+      if (codecache_isvmptr(ctx,blocks,nblocks,vartab,nvartab,v)) goto finish;
+    }
+  }
+
+  d.commonsig = ctx->codecache_commonsig;
+  d.flags = flags;
+  d.src_len = src_len;
+  d.nrelocs = EEL_GROWBUF_GET_SIZE(&relocs);
+  d.strings_len = EEL_GROWBUF_GET_SIZE(&strings);
+  d.blob_len = EEL_CC_BLOB_LEN(&d);
+
+  e = (eelCodeCacheEnt *)calloc(1,sizeof(eelCodeCacheEnt));
+  if (e) e->blob = (unsigned char *)calloc(d.blob_len,1);
+  if (!e || !e->blob) goto finish;
+
+  e->d = d;
+  e->hash = hash;
+  e->refcnt = 1;
+  e->resolved = 1;
+  e->functab = ctx->registered_func_tab;
+  e->func_check = (void *)ctx->func_check;
+  e->func_check_user = ctx->func_check_user;
+  for (x = 0; x < nblocks; x ++)
+    memcpy(e->blob + offs[x] + (x >= ncode ? d.code_len : 0), blocks[x]->block, blocks[x]->sizeused);
+  if (d.nrelocs) memcpy(e->blob + EEL_CC_RELOCS_OFFS(&d),EEL_GROWBUF_GET(&relocs),d.nrelocs*sizeof(eelCachedReloc));
+  for (x = 0; x < d.nvars; x ++)
+  {
+    eelCachedVar *cv = (eelCachedVar *)(e->blob + EEL_CC_VARS_OFFS(&d)) + x;
+    cv->name = vars[x].name;
+    cv->isglobal = vars[x].isglobal;
+  }
+  if (d.strings_len) memcpy(e->blob + EEL_CC_STRINGS_OFFS(&d),EEL_GROWBUF_GET(&strings),d.strings_len);
+  memcpy(e->blob + EEL_CC_SRC_OFFS(&d),src,src_len);
+  ok = 1;
+
+finish:
+  free(vartab);
+  free(sitemap);
+  free(blocks);
+  EEL_GROWBUF_RESIZE(&relocs,-1);
+  EEL_GROWBUF_RESIZE(&strings,-1);
+
+  if (!ok)
+  {
+    if (e) codecache_entfree(e);
+    NSEEL_HOSTSTUB_EnterMutex();
+    cache->stats[3]++;
+    NSEEL_HOSTSTUB_LeaveMutex();
+    return;
+  }
+
+  {
+    char fn[2048];
+    int want_write;
+    NSEEL_HOSTSTUB_EnterMutex();
+    cache->stats[2]++;
+    want_write = cache->path && !ctx->func_check;
+    if (want_write) codecache_filename(fn,sizeof(fn),cache,hash);
+    codecache_insert(cache,e);
+    if (!want_write) codecache_release(e);
+    NSEEL_HOSTSTUB_LeaveMutex();
+
+    if (want_write)
+    {
+      codecache_writefile(cache,fn,e);
+      NSEEL_HOSTSTUB_EnterMutex();
+      cache->stats[5]++;
+      codecache_release(e);
+      NSEEL_HOSTSTUB_LeaveMutex();
+    }
+  }
+}
+
+// creates a new code handle in ctx from a cache entry
+static codeHandleType *codecache_instantiate(compileContext *ctx, const eelCodeCacheEnt *e)
+{
+  const eelCodeCacheDesc *d = &e->d;
+  const eelCachedReloc *r = (const eelCachedReloc *)(e->blob + EEL_CC_RELOCS_OFFS(d));
+  const eelCachedVar *cv = (const eelCachedVar *)(e->blob + EEL_CC_VARS_OFFS(d));
+  const char *strings = (const char *)e->blob + EEL_CC_STRINGS_OFFS(d);
+  llBlock *codeblocks = NULL, *datablocks = NULL;
+  EEL_F *varbuf[256], **varptrs = d->nvars <= 256 ? varbuf : (EEL_F **)malloc(d->nvars * sizeof(EEL_F *));
+  unsigned char *cb, *db;
+  codeHandleType *h;
+  int x;
+
+  if (!varptrs) return NULL;
+  for (x = 0; x < d->nvars; x ++)
+  {
+    const char *nm = strings + cv[x].name;
+    varptrs[x] = cv[x].isglobal ? get_global_var(ctx,nm,1) : nseel_int_register_var(ctx,nm,0,NULL);
+    if (!varptrs[x]) goto fail;
+  }
+
+  cb = (unsigned char *)__newBlock(&codeblocks,d->code_len + 64, 1);
+  db = (unsigned char *)__newBlock(&datablocks,d->data_len + d->data_align, 0);
+  if (!cb || !db) goto fail;
+  cb += (64 - ((INT_PTR)cb & 63)) & 63;
+  db += (d->data_align - ((INT_PTR)db & (d->data_align-1))) & (d->data_align-1);
+  memcpy(cb,e->blob,d->code_len);
+  memcpy(db,e->blob + d->code_len,d->data_len);
+
+  for (x = 0; x < d->nrelocs; x ++, r++)
+  {
+    INT_PTR v = 0;
+    switch (r->cls)
+    {
+      case EEL_CC_CODE: v = (INT_PTR) (cb + r->arg); break;
+      case EEL_CC_DATA: v = (INT_PTR) (db + r->arg); break;
+      case EEL_CC_CTX: v = (INT_PTR) ((unsigned char *)ctx + r->arg); break;
+      case EEL_CC_THIS: v = (INT_PTR) ctx->caller_this; break;
+      case EEL_CC_GRAM: v = (INT_PTR) ctx->gram_blocks; break;
+      case EEL_CC_VAR: v = (INT_PTR) varptrs[r->arg]; break;
+      case EEL_CC_STATIC: v = r->value; break;
+    }
+    memcpy((r->in_data ? db : cb) + r->offs,&v,sizeof(v));
+  }
+#if defined(__arm__) || defined(__aarch64__)
+  __clear_cache(cb,cb + d->code_len);
+#endif
+
+  h = (codeHandleType *)(db + d->handle_offs);
+  h->blocks = codeblocks;
+  h->blocks_data = datablocks;
+  h->code = cb + d->code_offs;
+  h->workTable = db + d->worktable_offs;
+  h->stack = d->stack_offs >= 0 ? db + d->stack_offs : NULL;
+  h->ramPtr = ctx->ram_state.blocks;
+
+  if (varptrs != varbuf) free(varptrs);
+  return h;
+
+fail:
+  freeBlocks(&codeblocks);
+  freeBlocks(&datablocks);
+  if (varptrs != varbuf) free(varptrs);
+  return NULL;
+}
+
+static codeHandleType *codecache_load(compileContext *ctx, const char *src, int src_len, int flags, WDL_UINT64 hash)
+{
+  eelCodeCache *cache = ctx->codecache;
+  eelCodeCacheEnt *e, **pp;
+  codeHandleType *h = NULL;
+  char fn[2048];
+  unsigned int host_sig = 0;
+  int try_disk;
+
+  NSEEL_HOSTSTUB_EnterMutex();
+  for (pp = &cache->list; (e = *pp); pp = &e->next)
+  {
+    if (e->hash == hash && e->resolved && e->d.src_len == src_len && e->d.flags == flags &&
+        e->d.commonsig == ctx->codecache_commonsig && e->functab == ctx->registered_func_tab &&
+        e->func_check == (void *)ctx->func_check && e->func_check_user == ctx->func_check_user &&
+        !memcmp(e->blob + EEL_CC_SRC_OFFS(&e->d),src,src_len))
+    {
+      // move to front
+      *pp = e->next;
+      e->next = cache->list;
+      cache->list = e;
+      e->refcnt++;
+      break;
+    }
+  }
+  try_disk = !e && cache->path && !ctx->func_check;
+  if (try_disk)
+  {
+    codecache_filename(fn,sizeof(fn),cache,hash);
+    host_sig = cache->host_sig;
+  }
+  NSEEL_HOSTSTUB_LeaveMutex();
+
+  if (try_disk)
+  {
+    e = codecache_readfile(ctx,fn,host_sig,src,src_len,flags,hash);
+    if (e)
+    {
+      NSEEL_HOSTSTUB_EnterMutex();
+      cache->stats[4]++;
+      codecache_insert(cache,e);
+      NSEEL_HOSTSTUB_LeaveMutex();
+    }
+  }
+
+  if (e) h = codecache_instantiate(ctx,e);
+
+  NSEEL_HOSTSTUB_EnterMutex();
+  cache->stats[h ? 0 : 1]++;
+  if (e) codecache_release(e);
+  NSEEL_HOSTSTUB_LeaveMutex();
+
+  if (h)
+  {
+    nseel_evallib_stats[0]+=h->code_stats[0];
+    nseel_evallib_stats[1]+=h->code_stats[1];
+    nseel_evallib_stats[2]+=h->code_stats[2];
+    nseel_evallib_stats[3]+=h->code_stats[3];
+    nseel_evallib_stats[4]++;
+  }
+  return h;
+}
+
+#endif // EEL_CODECACHE_SUPPORTED
+
+NSEEL_CODECACHE NSEEL_codecache_create(int max_bytes)
+{
+#ifdef EEL_CODECACHE_SUPPORTED
+  eelCodeCache *cache = (eelCodeCache *)calloc(1,sizeof(eelCodeCache));
+  if (cache) cache->max_bytes = max_bytes > 0 ? max_bytes : 16<<20;
+  return cache;
+#else
+  return NULL;
+#endif
+}
+
+void NSEEL_codecache_flush(NSEEL_CODECACHE _cache)
+{
+  eelCodeCache *cache = (eelCodeCache *)_cache;
+  eelCodeCacheEnt *e;
+  if (!cache) return;
+  NSEEL_HOSTSTUB_EnterMutex();
+  while ((e = cache->list))
+  {
+    cache->list = e->next;
+    codecache_release(e);
+  }
+  cache->stats[6] = cache->stats[7] = 0;
+  NSEEL_HOSTSTUB_LeaveMutex();
+}
+
+void NSEEL_codecache_free(NSEEL_CODECACHE _cache)
+{
+  eelCodeCache *cache = (eelCodeCache *)_cache;
+  if (!cache) return;
+  NSEEL_codecache_flush(cache);
+  free(cache->path);
+  free(cache);
+}
+
+void NSEEL_codecache_setpath(NSEEL_CODECACHE _cache, const char *path, unsigned int host_sig)
+{
+  eelCodeCache *cache = (eelCodeCache *)_cache;
+  char *p = path && *path ? strdup(path) : NULL, *op;
+  if (!cache) { free(p); return; }
+  NSEEL_HOSTSTUB_EnterMutex();
+  op = cache->path;
+  cache->path = p;
+  cache->host_sig = host_sig;
+  NSEEL_HOSTSTUB_LeaveMutex();
+  free(op);
+}
+
+int *NSEEL_codecache_getstats(NSEEL_CODECACHE _cache)
+{
+  eelCodeCache *cache = (eelCodeCache *)_cache;
+  return cache ? cache->stats : NULL;
+}
+
+void NSEEL_VM_SetCodeCache(NSEEL_VMCTX _ctx, NSEEL_CODECACHE cache)
+{
+#ifdef EEL_CODECACHE_SUPPORTED
+  compileContext *ctx = (compileContext *)_ctx;
+  if (ctx) ctx->codecache = (eelCodeCache *)cache;
+#endif
+}
+
 NSEEL_CODEHANDLE NSEEL_code_compile_ex(NSEEL_VMCTX _ctx, const char *_expression, int lineoffs, int compile_flags)
 {
   compileContext *ctx = (compileContext *)_ctx;
@@ -4425,6 +5667,10 @@ NSEEL_CODEHANDLE NSEEL_code_compile_ex(NSEEL_VMCTX _ctx, const char *_expression
   int curtabptr_sz=0;
   void *curtabptr=NULL;
   int had_err=0;
+#ifdef EEL_CODECACHE_SUPPORTED
+  eelCodeCacheRecorder cc_rec;
+  WDL_UINT64 cc_hash=0;
+#endif
 
   if (!ctx) return 0;
 
@@ -4436,6 +5682,7 @@ NSEEL_CODEHANDLE NSEEL_code_compile_ex(NSEEL_VMCTX _ctx, const char *_expression
   if (compile_flags & NSEEL_CODE_COMPILE_FLAG_COMMONFUNCS_RESET)
   {
     ctx->functions_common=NULL; // reset common function list
+    ctx->codecache_commonsig=0;
   }
   else
   {
@@ -4472,6 +5719,19 @@ NSEEL_CODEHANDLE NSEEL_code_compile_ex(NSEEL_VMCTX _ctx, const char *_expression
 
   _expression_end = _expression + strlen(_expression);
 
+#ifdef EEL_CODECACHE_SUPPORTED
+  ctx->codecache_rec = NULL;
+  if (ctx->codecache && !(compile_flags & NSEEL_CODE_COMPILE_FLAG_COMMONFUNCS))
+  {
+    codeHandleType *h;
+    cc_hash = codecache_hash(EEL_CC_HASH_INIT,_expression,_expression_end - _expression);
+    cc_hash = codecache_hash(cc_hash,&compile_flags,sizeof(compile_flags));
+    cc_hash = codecache_hash(cc_hash,&ctx->codecache_commonsig,sizeof(ctx->codecache_commonsig));
+    h = codecache_load(ctx,_expression,(int)(_expression_end - _expression),compile_flags,cc_hash);
+    if (h) return (NSEEL_CODEHANDLE)h;
+  }
+#endif
+
   oldCommonFunctionList = ctx->functions_common;
 
   ctx->isGeneratingCommonFunction=0;
@@ -4493,6 +5753,14 @@ NSEEL_CODEHANDLE NSEEL_code_compile_ex(NSEEL_VMCTX _ctx, const char *_expression
   
   memset(handle,0,sizeof(codeHandleType));
 
+#ifdef EEL_CODECACHE_SUPPORTED
+  if (cc_hash)
+  {
+    memset(&cc_rec,0,sizeof(cc_rec));
+    ctx->codecache_rec = &cc_rec;
+  }
+#endif
+
   ctx->l_stats[0] += (int)(_expression_end - _expression);
   ctx->tmpCodeHandle = handle;
   endptr=_expression;
@@ -5003,10 +6271,13 @@ had_error:
       {
         if (wtpos <= 0)
         {
+          const int wtpsz = GLUE_RESET_WTP(writeptr,curtabptr);
           wtpos=MIN_COMPUTABLE_SIZE;
-          writeptr+=GLUE_RESET_WTP(writeptr,curtabptr);
+          codecache_addreloc_insn(ctx,writeptr,wtpsz,(INT_PTR)curtabptr);
+          writeptr+=wtpsz;
         }
         memcpy(writeptr,(char*)p->code,p->codesz);
+        codecache_copyrelocs(ctx,writeptr,(const unsigned char *)p->code,p->codesz);
         writeptr += p->codesz;
         wtpos -= p->tmptable_use;
       
@@ -5056,6 +6327,14 @@ had_error:
     nseel_evallib_stats[2]+=ctx->l_stats[2];
     nseel_evallib_stats[3]+=ctx->l_stats[3];
     nseel_evallib_stats[4]++;
+
+    if (compile_flags & NSEEL_CODE_COMPILE_FLAG_COMMONFUNCS)
+    {
+      // code compiled later depends on these functions, so cached code must be keyed on them
+      WDL_UINT64 sig = codecache_hash(EEL_CC_HASH_INIT,&ctx->codecache_commonsig,sizeof(ctx->codecache_commonsig));
+      sig = codecache_hash(sig,&compile_flags,sizeof(compile_flags));
+      ctx->codecache_commonsig = codecache_hash(sig,_expression,_expression_end - _expression);
+    }
   }
   else
   {
@@ -5070,6 +6349,17 @@ had_error:
   }
   memset(ctx->l_stats,0,sizeof(ctx->l_stats));
 
+#ifdef EEL_CODECACHE_SUPPORTED
+  if (ctx->codecache_rec)
+  {
+    if (handle) codecache_store(ctx,handle,_expression,(int)(_expression_end - _expression),compile_flags,cc_hash);
+    EEL_GROWBUF_RESIZE(&cc_rec.relocs,-1);
+    EEL_GROWBUF_RESIZE(&cc_rec.vars,-1);
+    EEL_GROWBUF_RESIZE(&cc_rec.names,-1);
+    ctx->codecache_rec = NULL;
+  }
+#endif
+
   return (NSEEL_CODEHANDLE)handle;
 }
 
@@ -5319,13 +6609,13 @@ void NSEEL_VM_SetCustomFuncThis(NSEEL_VMCTX ctx, void *thisptr)
 
 void *NSEEL_PProc_RAM(void *data, int data_size, compileContext *ctx)
 {
-  if (data_size>0) data=EEL_GLUE_set_immediate(data, (INT_PTR)ctx->ram_state.blocks); 
+  if (data_size>0) data=nseel_set_immediate(ctx, data, (INT_PTR)ctx->ram_state.blocks, EEL_RELOC_AUTO); 
   return data;
 }
 
 void *NSEEL_PProc_THIS(void *data, int data_size, compileContext *ctx)
 {
-  if (data_size>0) data=EEL_GLUE_set_immediate(data, (INT_PTR)ctx->caller_this);
+  if (data_size>0) data=nseel_set_immediate(ctx, data, (INT_PTR)ctx->caller_this, EEL_RELOC_THIS);
   return data;
 }
 
@@ -5662,6 +6952,7 @@ opcodeRec *nseel_translate(compileContext *ctx, const char *tmp, size_t tmplen)
     buf[tmplen]=0;
     if (ctx->onNamedString) 
     {
+      CODECACHE_FAIL(ctx);
       if (tmplen>0 && buf[1]&&ctx->function_curName)
       {
         int err=0;
@@ -267,6 +267,168 @@ static WDL_FFT_COMPLEX d32768[4095];
   a1.im = t4; \
   }
 
+/*
+  SIMD versions of the cpass/upass inner loops. each vector holds WDL_FFT_VN complex values, and
+  processes WDL_FFT_VN consecutive butterflies. the operations are the same as TRANSFORM/UNTRANSFORM
+  (same products and sums, just arranged differently), so results match the scalar code.
+
+  define WDL_FFT_NO_SIMD to disable.
+*/
+#ifndef WDL_FFT_NO_SIMD
+  #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #ifdef __AVX__
+      #include <immintrin.h>
+      #if WDL_FFT_REALSIZE == 8
+        #define WDL_FFT_SIMD __m256d
+        #define WDL_FFT_VN 2
+        #define VLD(p) _mm256_loadu_pd((const double *)(p))
+        #define VST(p,v) _mm256_storeu_pd((double *)(p),(v))
+        #define VADD _mm256_add_pd
+        #define VSUB _mm256_sub_pd
+        #define VMUL _mm256_mul_pd
+        #define VSET(a,b) _mm256_setr_pd(a,b,a,b)
+        #define VSWAP(v) _mm256_permute_pd(v,5)
+        #define VDUPRE(v) _mm256_movedup_pd(v)
+        #define VDUPIM(v) _mm256_permute_pd(v,15)
+        #define VREV(v) _mm256_permute_pd(_mm256_permute2f128_pd(v,v,1),5)
+      #else
+        #define WDL_FFT_SIMD __m256
+        #define WDL_FFT_VN 4
+        #define VLD(p) _mm256_loadu_ps((const float *)(p))
+        #define VST(p,v) _mm256_storeu_ps((float *)(p),(v))
+        #define VADD _mm256_add_ps
+        #define VSUB _mm256_sub_ps
+        #define VMUL _mm256_mul_ps
+        #define VSET(a,b) _mm256_setr_ps(a,b,a,b,a,b,a,b)
+        #define VSWAP(v) _mm256_permute_ps(v,0xb1)
+        #define VDUPRE(v) _mm256_moveldup_ps(v)
+        #define VDUPIM(v) _mm256_movehdup_ps(v)
+        #define VREV(v) _mm256_permute_ps(_mm256_permute2f128_ps(v,v,1),0x1b)
+      #endif
+    #else
+      #include <emmintrin.h>
+      #if WDL_FFT_REALSIZE == 8
+        #define WDL_FFT_SIMD __m128d
+        #define WDL_FFT_VN 1
+        #define VLD(p) _mm_loadu_pd((const double *)(p))
+        #define VST(p,v) _mm_storeu_pd((double *)(p),(v))
+        #define VADD _mm_add_pd
+        #define VSUB _mm_sub_pd
+        #define VMUL _mm_mul_pd
+        #define VSET(a,b) _mm_setr_pd(a,b)
+        #define VSWAP(v) _mm_shuffle_pd(v,v,1)
+        #define VDUPRE(v) _mm_unpacklo_pd(v,v)
+        #define VDUPIM(v) _mm_unpackhi_pd(v,v)
+        #define VREV(v) VSWAP(v)
+      #else
+        #define WDL_FFT_SIMD __m128
+        #define WDL_FFT_VN 2
+        #define VLD(p) _mm_loadu_ps((const float *)(p))
+        #define VST(p,v) _mm_storeu_ps((float *)(p),(v))
+        #define VADD _mm_add_ps
+        #define VSUB _mm_sub_ps
+        #define VMUL _mm_mul_ps
+        #define VSET(a,b) _mm_setr_ps(a,b,a,b)
+        #define VSWAP(v) _mm_shuffle_ps(v,v,_MM_SHUFFLE(2,3,0,1))
+        #define VDUPRE(v) _mm_shuffle_ps(v,v,_MM_SHUFFLE(2,2,0,0))
+        #define VDUPIM(v) _mm_shuffle_ps(v,v,_MM_SHUFFLE(3,3,1,1))
+        #define VREV(v) _mm_shuffle_ps(v,v,_MM_SHUFFLE(0,1,2,3))
+      #endif
+    #endif
+  #elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #include <arm_neon.h>
+    #if WDL_FFT_REALSIZE == 4
+      #define WDL_FFT_SIMD float32x4_t
+      #define WDL_FFT_VN 2
+      #define VLD(p) vld1q_f32((const float *)(p))
+      #define VST(p,v) vst1q_f32((float *)(p),(v))
+      #define VADD vaddq_f32
+      #define VSUB vsubq_f32
+      #define VMUL vmulq_f32
+      #define VSET(a,b) vcombine_f32(vset_lane_f32(b,vdup_n_f32(a),1),vset_lane_f32(b,vdup_n_f32(a),1))
+      #define VSWAP(v) vrev64q_f32(v)
+      #define VDUPRE(v) (vtrnq_f32(v,v).val[0])
+      #define VDUPIM(v) (vtrnq_f32(v,v).val[1])
+      #define VREV(v) vcombine_f32(vget_high_f32(vrev64q_f32(v)),vget_low_f32(vrev64q_f32(v)))
+    #elif defined(__aarch64__)
+      #define WDL_FFT_SIMD float64x2_t
+      #define WDL_FFT_VN 1
+      #define VLD(p) vld1q_f64((const double *)(p))
+      #define VST(p,v) vst1q_f64((double *)(p),(v))
+      #define VADD vaddq_f64
+      #define VSUB vsubq_f64
+      #define VMUL vmulq_f64
+      #define VSET(a,b) vsetq_lane_f64(b,vdupq_n_f64(a),1)
+      #define VSWAP(v) vextq_f64(v,v,1)
+      #define VDUPRE(v) vdupq_laneq_f64(v,0)
+      #define VDUPIM(v) vdupq_laneq_f64(v,1)
+      #define VREV(v) VSWAP(v)
+    #endif
+  #endif
+#endif
+
+#ifdef WDL_FFT_SIMD
+
+// twiddle for butterfly i is w[i], or if wrev, w[-i] with re/im swapped
+#define VLOADW(w,i,wrev) ((wrev) ? VREV(VLD((w) - (i) - (WDL_FFT_VN-1))) : VLD((w) + (i)))
+
+/* TRANSFORM() for a[0..n-1] etc */
+static void cspan(WDL_FFT_COMPLEX *a, WDL_FFT_COMPLEX *a1, WDL_FFT_COMPLEX *a2, WDL_FFT_COMPLEX *a3,
+                  const WDL_FFT_COMPLEX *w, unsigned int n, int wrev)
+{
+  register WDL_FFT_REAL t1, t2, t3, t4, t5, t6, t7, t8;
+  const WDL_FFT_SIMD sgn = VSET(-1.0f,1.0f);
+  unsigned int i;
+  for (i = 0; i + WDL_FFT_VN <= n; i += WDL_FFT_VN)
+  {
+    const WDL_FFT_SIMD tw = VLOADW(w,i,wrev);
+    const WDL_FFT_SIMD wre = VDUPRE(tw), wim = VMUL(VDUPIM(tw),sgn); // wim is (-im, im)
+    const WDL_FFT_SIMD x0 = VLD(a+i), x1 = VLD(a1+i), x2 = VLD(a2+i), x3 = VLD(a3+i);
+    const WDL_FFT_SIMD d02 = VSUB(x0,x2), id13 = VMUL(VSWAP(VSUB(x1,x3)),sgn); // i*(x1-x3)
+    const WDL_FFT_SIMD u = VADD(d02,id13), v = VSUB(d02,id13);
+
+    VST(a+i,VADD(x0,x2));
+    VST(a1+i,VADD(x1,x3));
+    VST(a2+i,VADD(VMUL(u,wre),VMUL(VSWAP(u),wim))); // u*w
+    VST(a3+i,VSUB(VMUL(v,wre),VMUL(VSWAP(v),wim))); // v*conj(w)
+  }
+  for (; i < n; i ++)
+  {
+    if (wrev) { TRANSFORM(a[i],a1[i],a2[i],a3[i],w[-(int)i].im,w[-(int)i].re); }
+    else { TRANSFORM(a[i],a1[i],a2[i],a3[i],w[i].re,w[i].im); }
+  }
+}
+
+/* UNTRANSFORM() for a[0..n-1] etc */
+static void uspan(WDL_FFT_COMPLEX *a, WDL_FFT_COMPLEX *a1, WDL_FFT_COMPLEX *a2, WDL_FFT_COMPLEX *a3,
+                  const WDL_FFT_COMPLEX *w, unsigned int n, int wrev)
+{
+  register WDL_FFT_REAL t1, t2, t3, t4, t5, t6, t7, t8;
+  const WDL_FFT_SIMD sgn = VSET(-1.0f,1.0f);
+  unsigned int i;
+  for (i = 0; i + WDL_FFT_VN <= n; i += WDL_FFT_VN)
+  {
+    const WDL_FFT_SIMD tw = VLOADW(w,i,wrev);
+    const WDL_FFT_SIMD wre = VDUPRE(tw), wim = VMUL(VDUPIM(tw),sgn);
+    const WDL_FFT_SIMD x0 = VLD(a+i), x1 = VLD(a1+i), x2 = VLD(a2+i), x3 = VLD(a3+i);
+    const WDL_FFT_SIMD p = VSUB(VMUL(x2,wre),VMUL(VSWAP(x2),wim)); // x2*conj(w)
+    const WDL_FFT_SIMD q = VADD(VMUL(x3,wre),VMUL(VSWAP(x3),wim)); // x3*w
+    const WDL_FFT_SIMD s = VADD(q,p), d = VMUL(VSWAP(VSUB(q,p)),sgn); // i*(q-p)
+
+    VST(a+i,VADD(x0,s));
+    VST(a2+i,VSUB(x0,s));
+    VST(a1+i,VADD(x1,d));
+    VST(a3+i,VSUB(x1,d));
+  }
+  for (; i < n; i ++)
+  {
+    if (wrev) { UNTRANSFORM(a[i],a1[i],a2[i],a3[i],w[-(int)i].im,w[-(int)i].re); }
+    else { UNTRANSFORM(a[i],a1[i],a2[i],a3[i],w[i].re,w[i].im); }
+  }
+}
+
+#endif
+
 static void c2(register WDL_FFT_COMPLEX *a)
 {
   register WDL_FFT_REAL t1;
@@ -422,6 +584,9 @@ static void cpass(register WDL_FFT_COMPLEX *a,register const WDL_FFT_COMPLEX *w,
   --n;
 
   TRANSFORMZERO(a[0],a1[0],a2[0],a3[0]);
+#ifdef WDL_FFT_SIMD
+  cspan(a+1,a1+1,a2+1,a3+1,w,2*n+1,0);
+#else
   TRANSFORM(a[1],a1[1],a2[1],a3[1],w[0].re,w[0].im);
 
   for (;;) {
@@ -434,6 +599,7 @@ static void cpass(register WDL_FFT_COMPLEX *a,register const WDL_FFT_COMPLEX *w,
     a3 += 2;
     w += 2;
   }
+#endif
 }
 
 static void c32(register WDL_FFT_COMPLEX *a)
@@ -483,14 +649,21 @@ static void cpassbig(register WDL_FFT_COMPLEX *a,register const WDL_FFT_COMPLEX
   register WDL_FFT_COMPLEX *a1;
   register WDL_FFT_COMPLEX *a2;
   register WDL_FFT_COMPLEX *a3;
+#ifndef WDL_FFT_SIMD
   register unsigned int k;
+#endif
 
   a2 = a + 4 * n;
   a1 = a + 2 * n;
   a3 = a2 + 2 * n;
-  k = n - 2;
 
   TRANSFORMZERO(a[0],a1[0],a2[0],a3[0]);
+#ifdef WDL_FFT_SIMD
+  cspan(a+1,a1+1,a2+1,a3+1,w,n-1,0);
+  TRANSFORMHALF(a[n],a1[n],a2[n],a3[n]);
+  cspan(a+n+1,a1+n+1,a2+n+1,a3+n+1,w+n-2,n-1,1);
+#else
+  k = n - 2;
   TRANSFORM(a[1],a1[1],a2[1],a3[1],w[0].re,w[0].im);
   a += 2;
   a1 += 2;
@@ -524,6 +697,7 @@ static void cpassbig(register WDL_FFT_COMPLEX *a,register const WDL_FFT_COMPLEX
     a3 += 2;
     w -= 2;
   } while (k -= 2);
+#endif
 }
 
 
@@ -582,6 +756,25 @@ void WDL_fft_complexmul(WDL_FFT_COMPLEX *a,WDL_FFT_COMPLEX *b,int n)
   register WDL_FFT_REAL t1, t2, t3, t4, t5, t6, t7, t8;
   if (n<2 || (n&1)) return;
 
+#ifdef WDL_FFT_SIMD
+  {
+    const WDL_FFT_SIMD sgn = VSET(-1.0f,1.0f);
+    while (n >= WDL_FFT_VN)
+    {
+      const WDL_FFT_SIMD x = VLD(a), y = VLD(b);
+      const WDL_FFT_SIMD r = VADD(VMUL(x,VDUPRE(y)),VMUL(VSWAP(x),VMUL(VDUPIM(y),sgn)));
+      VST(a,r);
+      a += WDL_FFT_VN;
+      b += WDL_FFT_VN;
+      n -= WDL_FFT_VN;
+    }
+#if WDL_FFT_VN > 2
+    if (!n)
+#endif
+      return;
+  }
+#endif
+
   do {
     t1 = a[0].re * b[0].re;
     t2 = a[0].im * b[0].im;
@@ -609,6 +802,26 @@ void WDL_fft_complexmul2(WDL_FFT_COMPLEX *c, WDL_FFT_COMPLEX *a, WDL_FFT_COMPLEX
   register WDL_FFT_REAL t1, t2, t3, t4, t5, t6, t7, t8;
   if (n<2 || (n&1)) return;
 
+#ifdef WDL_FFT_SIMD
+  {
+    const WDL_FFT_SIMD sgn = VSET(-1.0f,1.0f);
+    while (n >= WDL_FFT_VN)
+    {
+      const WDL_FFT_SIMD x = VLD(a), y = VLD(b);
+      const WDL_FFT_SIMD r = VADD(VMUL(x,VDUPRE(y)),VMUL(VSWAP(x),VMUL(VDUPIM(y),sgn)));
+      VST(c,r);
+      a += WDL_FFT_VN;
+      b += WDL_FFT_VN;
+      c += WDL_FFT_VN;
+      n -= WDL_FFT_VN;
+    }
+#if WDL_FFT_VN > 2
+    if (!n)
+#endif
+      return;
+  }
+#endif
+
   do {
     t1 = a[0].re * b[0].re;
     t2 = a[0].im * b[0].im;
@@ -636,6 +849,26 @@ void WDL_fft_complexmul3(WDL_FFT_COMPLEX *c, WDL_FFT_COMPLEX *a, WDL_FFT_COMPLEX
   register WDL_FFT_REAL t1, t2, t3, t4, t5, t6, t7, t8;
   if (n<2 || (n&1)) return;
 
+#ifdef WDL_FFT_SIMD
+  {
+    const WDL_FFT_SIMD sgn = VSET(-1.0f,1.0f);
+    while (n >= WDL_FFT_VN)
+    {
+      const WDL_FFT_SIMD x = VLD(a), y = VLD(b);
+      const WDL_FFT_SIMD r = VADD(VMUL(x,VDUPRE(y)),VMUL(VSWAP(x),VMUL(VDUPIM(y),sgn)));
+      VST(c,VADD(VLD(c),r));
+      a += WDL_FFT_VN;
+      b += WDL_FFT_VN;
+      c += WDL_FFT_VN;
+      n -= WDL_FFT_VN;
+    }
+#if WDL_FFT_VN > 2
+    if (!n)
+#endif
+      return;
+  }
+#endif
+
   do {
     t1 = a[0].re * b[0].re;
     t2 = a[0].im * b[0].im;
@@ -806,6 +1039,9 @@ static void upass(register WDL_FFT_COMPLEX *a,register const WDL_FFT_COMPLEX *w,
   n -= 1;
 
   UNTRANSFORMZERO(a[0],a1[0],a2[0],a3[0]);
+#ifdef WDL_FFT_SIMD
+  uspan(a+1,a1+1,a2+1,a3+1,w,2*n+1,0);
+#else
   UNTRANSFORM(a[1],a1[1],a2[1],a3[1],w[0].re,w[0].im);
 
   for (;;) {
@@ -818,6 +1054,7 @@ static void upass(register WDL_FFT_COMPLEX *a,register const WDL_FFT_COMPLEX *w,
     a3 += 2;
     w += 2;
   }
+#endif
 }
 
 static void u32(register WDL_FFT_COMPLEX *a)
@@ -868,14 +1105,21 @@ static void upassbig(register WDL_FFT_COMPLEX *a,register const WDL_FFT_COMPLEX
   register WDL_FFT_COMPLEX *a1;
   register WDL_FFT_COMPLEX *a2;
   register WDL_FFT_COMPLEX *a3;
+#ifndef WDL_FFT_SIMD
   register unsigned int k;
+#endif
 
   a2 = a + 4 * n;
   a1 = a + 2 * n;
   a3 = a2 + 2 * n;
-  k = n - 2;
 
   UNTRANSFORMZERO(a[0],a1[0],a2[0],a3[0]);
+#ifdef WDL_FFT_SIMD
+  uspan(a+1,a1+1,a2+1,a3+1,w,n-1,0);
+  UNTRANSFORMHALF(a[n],a1[n],a2[n],a3[n]);
+  uspan(a+n+1,a1+n+1,a2+n+1,a3+n+1,w+n-2,n-1,1);
+#else
+  k = n - 2;
   UNTRANSFORM(a[1],a1[1],a2[1],a3[1],w[0].re,w[0].im);
   a += 2;
   a1 += 2;
@@ -909,6 +1153,7 @@ static void upassbig(register WDL_FFT_COMPLEX *a,register const WDL_FFT_COMPLEX
     a3 += 2;
     w -= 2;
   } while (k -= 2);
+#endif
 }
 
 
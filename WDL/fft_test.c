@@ -0,0 +1,152 @@
+/*
+  fft_test.c
+  checks WDL_fft, WDL_real_fft and WDL_fft_complexmul* against the scalar (WDL_FFT_NO_SIMD) code,
+  and WDL_fft against a naive DFT, for every size 2..32768
+
+  gcc -O2 -c fft.c && gcc -O2 -o fft_test fft_test.c fft.o -lm
+  (add -DWDL_FFT_REALSIZE=8 to both for double)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "fft.h"
+
+// a second, scalar copy of fft.c under other names, so both can be compared in one process
+#define WDL_FFT_NO_SIMD
+#define WDL_fft_init scalar_fft_init
+#define WDL_fft_complexmul scalar_fft_complexmul
+#define WDL_fft_complexmul2 scalar_fft_complexmul2
+#define WDL_fft_complexmul3 scalar_fft_complexmul3
+#define WDL_fft scalar_fft
+#define WDL_real_fft scalar_real_fft
+#define WDL_fft_permute scalar_fft_permute
+#define WDL_fft_permute_tab scalar_fft_permute_tab
+void scalar_fft_init();
+void scalar_fft_complexmul(WDL_FFT_COMPLEX *dest, WDL_FFT_COMPLEX *src, int len);
+void scalar_fft_complexmul2(WDL_FFT_COMPLEX *dest, WDL_FFT_COMPLEX *src, WDL_FFT_COMPLEX *src2, int len);
+void scalar_fft_complexmul3(WDL_FFT_COMPLEX *destAdd, WDL_FFT_COMPLEX *src, WDL_FFT_COMPLEX *src2, int len);
+void scalar_fft(WDL_FFT_COMPLEX *, int len, int isInverse);
+void scalar_real_fft(WDL_FFT_REAL *, int len, int isInverse);
+int scalar_fft_permute(int fftsize, int idx);
+int *scalar_fft_permute_tab(int fftsize);
+#include "fft.c"
+#undef WDL_fft_init
+#undef WDL_fft_complexmul
+#undef WDL_fft_complexmul2
+#undef WDL_fft_complexmul3
+#undef WDL_fft
+#undef WDL_real_fft
+#undef WDL_fft_permute
+#undef WDL_fft_permute_tab
+
+#if WDL_FFT_REALSIZE == 8
+#define DFT_TOL 1e-13
+#else
+#define DFT_TOL 1e-5
+#endif
+
+static unsigned int g_rs=1;
+static double rnd() { g_rs=g_rs*1664525+1013904223; return (g_rs>>8)/(double)(1<<24)-0.5; }
+
+static int g_fails;
+
+static void check_same(const char *what, int len, const void *a, const void *b, int bytes)
+{
+  if (memcmp(a,b,bytes))
+  {
+    printf("FAIL %d: %s differs from the scalar code\n",len,what);
+    g_fails++;
+  }
+}
+
+static void test_size(int len)
+{
+  WDL_FFT_COMPLEX *in=(WDL_FFT_COMPLEX*)malloc(len*sizeof(WDL_FFT_COMPLEX));
+  WDL_FFT_COMPLEX *a=(WDL_FFT_COMPLEX*)malloc(len*sizeof(WDL_FFT_COMPLEX));
+  WDL_FFT_COMPLEX *b=(WDL_FFT_COMPLEX*)malloc(len*sizeof(WDL_FFT_COMPLEX));
+  WDL_FFT_COMPLEX *fa=(WDL_FFT_COMPLEX*)malloc(len*sizeof(WDL_FFT_COMPLEX));
+  double *tcos=(double*)malloc(len*sizeof(double)), *tsin=(double*)malloc(len*sizeof(double));
+  double maxerr=0.0, peak=1e-30;
+  int i,k;
+
+  for (i=0;i<len;i++) { in[i].re=(WDL_FFT_REAL)rnd(); in[i].im=(WDL_FFT_REAL)rnd(); }
+
+  // complex forward and inverse
+  memcpy(a,in,len*sizeof(*a));
+  memcpy(b,in,len*sizeof(*b));
+  WDL_fft(a,len,0);
+  scalar_fft(b,len,0);
+  check_same("WDL_fft forward",len,a,b,len*sizeof(*a));
+  memcpy(fa,a,len*sizeof(*a));
+
+  WDL_fft(a,len,1);
+  scalar_fft(b,len,1);
+  check_same("WDL_fft inverse",len,a,b,len*sizeof(*a));
+
+  // naive DFT, WDL_fft forward uses exp(+i)
+  for (i=0;i<len;i++) { tcos[i]=cos(2.0*M_PI*i/len); tsin[i]=sin(2.0*M_PI*i/len); }
+  for (k=0;k<len;k++)
+  {
+    const WDL_FFT_COMPLEX *o=fa+WDL_fft_permute(len,k);
+    double sr=0.0, si=0.0, e;
+    int idx=0;
+    for (i=0;i<len;i++)
+    {
+      sr+=in[i].re*tcos[idx]+in[i].im*tsin[idx];
+      si+=in[i].im*tcos[idx]-in[i].re*tsin[idx];
+      if ((idx+=k) >= len) idx-=len;
+    }
+    e=hypot(o->re-sr,o->im-si);
+    if (e>maxerr) maxerr=e;
+    if (hypot(sr,si)>peak) peak=hypot(sr,si);
+  }
+  if (maxerr > peak*DFT_TOL)
+  {
+    printf("FAIL %d: WDL_fft differs from a naive DFT by %g (peak %g)\n",len,maxerr,peak);
+    g_fails++;
+  }
+
+  // real forward and inverse
+  if (len >= 4)
+  {
+    WDL_FFT_REAL *ra=(WDL_FFT_REAL*)a, *rb=(WDL_FFT_REAL*)b;
+    memcpy(ra,in,len*sizeof(WDL_FFT_REAL));
+    memcpy(rb,in,len*sizeof(WDL_FFT_REAL));
+    WDL_real_fft(ra,len,0);
+    scalar_real_fft(rb,len,0);
+    check_same("WDL_real_fft forward",len,ra,rb,len*sizeof(WDL_FFT_REAL));
+    WDL_real_fft(ra,len,1);
+    scalar_real_fft(rb,len,1);
+    check_same("WDL_real_fft inverse",len,ra,rb,len*sizeof(WDL_FFT_REAL));
+  }
+
+  // complexmul variants take an even length
+  memcpy(a,in,len*sizeof(*a));
+  memcpy(b,in,len*sizeof(*b));
+  WDL_fft_complexmul(a,fa,len&~1);
+  scalar_fft_complexmul(b,fa,len&~1);
+  check_same("WDL_fft_complexmul",len,a,b,len*sizeof(*a));
+  WDL_fft_complexmul3(a,fa,in,len&~1);
+  scalar_fft_complexmul3(b,fa,in,len&~1);
+  check_same("WDL_fft_complexmul3",len,a,b,len*sizeof(*a));
+  WDL_fft_complexmul2(a,in,fa,len&~1);
+  scalar_fft_complexmul2(b,in,fa,len&~1);
+  check_same("WDL_fft_complexmul2",len,a,b,len*sizeof(*a));
+
+  printf("%6d: DFT error %g (relative to peak)\n",len,maxerr/peak);
+
+  free(in); free(a); free(b); free(fa); free(tcos); free(tsin);
+}
+
+int main(int argc, char **argv)
+{
+  int len;
+  WDL_fft_init();
+  scalar_fft_init();
+  for (len=2;len<=32768;len*=2) test_size(len);
+
+  printf("%s (%d failures)\n",g_fails?"FAIL":"OK",g_fails);
+  return g_fails ? 1 : 0;
+}
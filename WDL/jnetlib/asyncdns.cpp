@@ -58,50 +58,56 @@ unsigned int JNL_AsyncDNS::_threadfunc(void *_d)
   int x;
   for (x = 0; x < _this->m_cache_size && !_this->m_thread_kill; x ++)
   {
-    if (_this->m_cache[x].last_used && !_this->m_cache[x].resolved)
+    cache_entry *ent=_this->m_cache+x;
+    if (ent->last_used && !ent->resolved)
     {
       if (!nowinsock) 
       {
-        if (_this->m_cache[x].mode==0)
+        if (ent->mode==0)
         {
-          struct hostent *hostentry;
-          hostentry=::gethostbyname(_this->m_cache[x].hostname);
-          if (hostentry)
+          struct addrinfo hints, *res=NULL;
+          memset(&hints,0,sizeof(hints));
+          hints.ai_family=ent->family;
+          hints.ai_socktype=SOCK_STREAM;
+#ifdef AI_ADDRCONFIG
+          if (ent->family == AF_UNSPEC) hints.ai_flags=AI_ADDRCONFIG; // only return families we have configured
+#endif
+          int n=0;
+          if (!::getaddrinfo(ent->hostname,NULL,&hints,&res) && res)
           {
-            _this->m_cache[x].addr=*((int*)hostentry->h_addr);
+            struct addrinfo *ai;
+            for (ai = res; ai && n < JNL_ASYNCDNS_MAX_ADDRS; ai = ai->ai_next)
+            {
+              if (!ai->ai_addr || ai->ai_addrlen < 1 || ai->ai_addrlen > sizeof(ent->addr[0])) continue;
+              memset(&ent->addr[n],0,sizeof(ent->addr[n]));
+              memcpy(&ent->addr[n],ai->ai_addr,ai->ai_addrlen);
+              ent->addrlen[n++]=(socklen_t)ai->ai_addrlen;
+            }
+            ::freeaddrinfo(res);
           }
-          else
-            _this->m_cache[x].addr=INADDR_NONE;
+          ent->naddrs=n;
         }
-        else if (_this->m_cache[x].mode==1)
+        else if (ent->mode==1)
         {
-          struct hostent *ent;
-          ent=::gethostbyaddr((const char *)&_this->m_cache[x].addr,4,AF_INET);
-          if (ent)
+          char buf[256];
+          if (ent->naddrs && !::getnameinfo((struct sockaddr *)&ent->addr[0],ent->addrlen[0],buf,sizeof(buf),NULL,0,NI_NAMEREQD))
           {
-            strncpy(_this->m_cache[x].hostname,ent->h_name,255);
-            _this->m_cache[x].hostname[255]=0;
+            strncpy(ent->hostname,buf,255);
+            ent->hostname[255]=0;
           }
           else
           {
-            _this->m_cache[x].hostname[0]=0;
+            ent->hostname[0]=0;
           }
         }
-        _this->m_cache[x].resolved=1;
       }
       else
       {
-        if (_this->m_cache[x].mode==0)
-        {
-          _this->m_cache[x].addr=INADDR_NONE;
-          _this->m_cache[x].resolved=1;
-        }
-        else if (_this->m_cache[x].mode==1)
-        {
-          _this->m_cache[x].hostname[0]=0;
-          _this->m_cache[x].resolved=1;
-        }
+        if (ent->mode==0) ent->naddrs=0;
+        else if (ent->mode==1) ent->hostname[0]=0;
       }
+      ent->resolved_time=time(NULL);
+      ent->resolved=1;
     }
   }
   if (!nowinsock) JNL::close_socketlib();
@@ -111,36 +117,20 @@ unsigned int JNL_AsyncDNS::_threadfunc(void *_d)
   return 0;
 }
 
-int JNL_AsyncDNS::resolve(const char *hostname, unsigned int *addr)
+int JNL_AsyncDNS::find_or_add(const char *hostname, int mode, int family, const struct sockaddr_storage *addr, socklen_t addrlen)
 {
-  // return 0 on success, 1 on wait, -1 on unresolvable
   int x;
-  unsigned int ip=inet_addr(hostname);
-  if (ip != INADDR_NONE) 
-  {
-    *addr=ip;
-    return 0;
-  }
-#ifndef NO_DNS_SUPPORT
-
   for (x = 0; x < m_cache_size; x ++)
   {
-    if (!stricmp(m_cache[x].hostname,hostname) && m_cache[x].mode==0)
+    cache_entry *ent=m_cache+x;
+    if (!ent->last_used || ent->mode != mode) continue;
+    if (mode == 0 ? (ent->family == family && !stricmp(ent->hostname,hostname)) :
+                    (ent->naddrs && ent->addrlen[0] == addrlen && !memcmp(&ent->addr[0],addr,addrlen)))
     {
-      m_cache[x].last_used=time(NULL);
-      if (m_cache[x].resolved)
-      {
-        if (m_cache[x].addr == INADDR_NONE)
-        {
-          return -1;
-        }
-        *addr=m_cache[x].addr;
-        return 0;
-      }
-      makesurethreadisrunning();
-      return 1;
+      return x;
     }
   }
+
   // add to resolve list
   int oi=-1;
   for (x = 0; x < m_cache_size; x ++)
@@ -159,14 +149,91 @@ int JNL_AsyncDNS::resolve(const char *hostname, unsigned int *addr)
   {
     return -1;
   }
-  strcpy(m_cache[oi].hostname,hostname);
-  m_cache[oi].mode=0;
-  m_cache[oi].addr=INADDR_NONE;
-  m_cache[oi].resolved=0;
-  m_cache[oi].last_used=time(NULL);
 
-  makesurethreadisrunning();
-  return 1;
+  cache_entry *ent=m_cache+oi;
+  ent->resolved=0;
+  ent->mode=(char)mode;
+  ent->family=family;
+  if (mode == 0)
+  {
+    strncpy(ent->hostname,hostname,255);
+    ent->hostname[255]=0;
+    ent->naddrs=0;
+  }
+  else
+  {
+    ent->hostname[0]=0;
+    memset(&ent->addr[0],0,sizeof(ent->addr[0]));
+    memcpy(&ent->addr[0],addr,addrlen);
+    ent->addrlen[0]=addrlen;
+    ent->naddrs=1;
+  }
+  ent->resolved_time=0;
+  ent->last_used=time(NULL);
+  return oi;
+}
+
+int JNL_AsyncDNS::resolve(const char *hostname, unsigned int *addr)
+{
+  // return 0 on success, 1 on wait, -1 on unresolvable
+  unsigned int ip=inet_addr(hostname);
+  if (ip != INADDR_NONE) 
+  {
+    *addr=ip;
+    return 0;
+  }
+
+  struct sockaddr_storage sa;
+  socklen_t salen=0;
+  int ret=resolve_addr(hostname,&sa,&salen,AF_INET);
+  if (!ret)
+  {
+    if (sa.ss_family != AF_INET) return -1;
+    *addr=((struct sockaddr_in *)&sa)->sin_addr.s_addr;
+  }
+  return ret;
+}
+
+int JNL_AsyncDNS::resolve_addr(const char *hostname, struct sockaddr_storage *addr, socklen_t *addrlen, int family, int idx)
+{
+  // return 0 on success, 1 on wait, -1 on unresolvable
+  if (idx < 0) return -1;
+  socklen_t l=JNL::ipstr_to_sockaddr(hostname,addr);
+  if (l)
+  {
+    if (idx > 0 || (family != AF_UNSPEC && family != addr->ss_family)) return -1;
+    *addrlen=l;
+    return 0;
+  }
+#ifndef NO_DNS_SUPPORT
+  if (strlen(hostname) > 255) return -1;
+
+  int x=find_or_add(hostname,0,family,NULL,0);
+  if (x<0) return -1;
+
+  cache_entry *ent=m_cache+x;
+  time_t now=time(NULL);
+  ent->last_used=now;
+  if (!ent->resolved)
+  {
+    makesurethreadisrunning();
+    return 1;
+  }
+
+  const int ok = ent->naddrs > 0;
+  if (idx < ent->naddrs)
+  {
+    memcpy(addr,&ent->addr[idx],ent->addrlen[idx]);
+    *addrlen=ent->addrlen[idx];
+  }
+
+  if (!ok || now > ent->resolved_time + JNL_ASYNCDNS_CACHE_TTL)
+  {
+    // stale (or failed) entry: hand back what we have, and have the next lookup
+    // re-query. failures are retried after a short delay rather than the full TTL.
+    if (ok || now > ent->resolved_time + 10) ent->resolved=0;
+  }
+  return idx < ent->naddrs ? 0 : -1;
 #else
   return -1;
 #endif
@@ -175,57 +242,34 @@ int JNL_AsyncDNS::resolve(const char *hostname, unsigned int *addr)
 int JNL_AsyncDNS::reverse(unsigned int addr, char *hostname)
 {
   // return 0 on success, 1 on wait, -1 on unresolvable
-  int x;
   if (addr == INADDR_NONE) 
   {
     return -1;
   }
 #ifndef NO_DNS_SUPPORT
-  for (x = 0; x < m_cache_size; x ++)
-  {
-    if (m_cache[x].addr==addr && m_cache[x].mode==1)
-    {
-      m_cache[x].last_used=time(NULL);
-      if (m_cache[x].resolved)
-      {
-        if (!m_cache[x].hostname[0])
-        {
-          return -1;
-        }
-        strncpy(hostname,m_cache[x].hostname,255);
-        hostname[255]=0;
-        return 0;
-      }
-      makesurethreadisrunning();
-      return 1;
-    }
-  }
-  // add to resolve list
-  int oi=-1;
-  for (x = 0; x < m_cache_size; x ++)
+  struct sockaddr_storage sa;
+  memset(&sa,0,sizeof(sa));
+  struct sockaddr_in *sin=(struct sockaddr_in *)&sa;
+  sin->sin_family=AF_INET;
+  sin->sin_addr.s_addr=addr;
+
+  int x=find_or_add(NULL,1,AF_INET,&sa,sizeof(struct sockaddr_in));
+  if (x<0) return -1;
+
+  cache_entry *ent=m_cache+x;
+  ent->last_used=time(NULL);
+  if (!ent->resolved)
   {
-    if (!m_cache[x].last_used)
-    {
-      oi=x;
-      break;
-    }
-    if ((oi==-1 || m_cache[x].last_used < m_cache[oi].last_used) && m_cache[x].resolved)
-    {
-      oi=x;
-    }
+    makesurethreadisrunning();
+    return 1;
   }
-  if (oi == -1)
+  if (!ent->hostname[0])
   {
     return -1;
   }
-  m_cache[oi].addr=addr;
-  m_cache[oi].hostname[0]=0;
-  m_cache[oi].resolved=0;
-  m_cache[oi].mode=1;
-  m_cache[oi].last_used=time(NULL);
-
-  makesurethreadisrunning();
-  return 1;
+  strncpy(hostname,ent->hostname,255);
+  hostname[255]=0;
+  return 0;
 #else
   return -1;
 #endif
@@ -12,8 +12,16 @@
 **      resolve is 0 on success (host successfully resolved), 1 on wait (meaning
 **      try calling resolve() with the same hostname in a few hundred milliseconds 
 **      or so), or -1 on error (i.e. the host can't resolve).
-**   3. call reverse() to do reverse dns (ala resolve()).
-**   4. enjoy.
+**   3. call resolve_addr() to resolve a hostname into a sockaddr of any family
+**      (AF_INET6 or AF_INET, or pass a specific family to restrict it). Same
+**      return values as resolve(). The port of the returned address is 0.
+**      A host can have several addresses (up to JNL_ASYNCDNS_MAX_ADDRS, in
+**      getaddrinfo() order), idx selects one, -1 is returned past the last.
+**   4. call reverse() to do reverse dns (ala resolve()).
+**   5. enjoy.
+**
+**   Resolved entries are cached for JNL_ASYNCDNS_CACHE_TTL seconds. After that the
+**   cached address is returned one last time, and the next call looks it up again.
 */
 
 #ifndef _ASYNCDNS_H_
@@ -21,12 +29,21 @@
 
 #include <time.h>
 
+#ifndef JNL_ASYNCDNS_CACHE_TTL
+#define JNL_ASYNCDNS_CACHE_TTL 600
+#endif
+
+#ifndef JNL_ASYNCDNS_MAX_ADDRS
+#define JNL_ASYNCDNS_MAX_ADDRS 4
+#endif
+
 #ifndef JNL_NO_DEFINE_INTERFACES
 class JNL_IAsyncDNS
 {
 public:
   virtual ~JNL_IAsyncDNS() { }
   virtual int resolve(const char *hostname, unsigned int *addr)=0; // return 0 on success, 1 on wait, -1 on unresolvable
+  virtual int resolve_addr(const char *hostname, struct sockaddr_storage *addr, socklen_t *addrlen, int family=AF_UNSPEC, int idx=0)=0; // return 0 on success, 1 on wait, -1 on unresolvable (or no address idx)
   virtual int reverse(unsigned int addr, char *hostname)=0; // return 0 on success, 1 on wait, -1 on unresolvable. hostname must be at least 256 bytes.
 };
 #define JNL_AsyncDNS_PARENTDEF : public JNL_IAsyncDNS
@@ -45,19 +62,26 @@ public:
   ~JNL_AsyncDNS();
 
   int resolve(const char *hostname, unsigned int *addr); // return 0 on success, 1 on wait, -1 on unresolvable
+  int resolve_addr(const char *hostname, struct sockaddr_storage *addr, socklen_t *addrlen, int family=AF_UNSPEC, int idx=0); // return 0 on success, 1 on wait, -1 on unresolvable (or no address idx)
   int reverse(unsigned int addr, char *hostname); // return 0 on success, 1 on wait, -1 on unresolvable. hostname must be at least 256 bytes.
 
 private:
   typedef struct 
   {
     time_t last_used; // timestamp.
+    time_t resolved_time;
     char resolved;
     char mode; // 1=reverse
     char hostname[256];
-    unsigned int addr;
+    int family; // AF_UNSPEC, AF_INET or AF_INET6 (forward lookups)
+    int naddrs; // 0 if unresolvable, reverse lookups use addr[0]
+    socklen_t addrlen[JNL_ASYNCDNS_MAX_ADDRS];
+    struct sockaddr_storage addr[JNL_ASYNCDNS_MAX_ADDRS];
   } 
   cache_entry;
 
+  int find_or_add(const char *hostname, int mode, int family, const struct sockaddr_storage *addr, socklen_t addrlen); // returns cache index or -1
+
   cache_entry *m_cache;
   int m_cache_size;
   volatile int m_thread_kill;
@@ -34,18 +34,26 @@ JNL_Connection::JNL_Connection(JNL_IAsyncDNS *dns, int sendbufsize, int recvbufs
   m_recv_len=m_recv_pos=0;
   m_send_len=m_send_pos=0;
   m_host[0]=0;
-  m_saddr = new struct sockaddr_in;
-  memset(m_saddr,0,sizeof(struct sockaddr_in));
+  m_saddr = new struct sockaddr_storage;
+  memset(m_saddr,0,sizeof(struct sockaddr_storage));
+  m_saddr_len=0;
+  m_saddr_idx=-1;
+  m_connect_time=0;
 }
 
-void JNL_Connection::connect(SOCKET s, struct sockaddr_in *loc)
+void JNL_Connection::connect(SOCKET s, const struct sockaddr *loc, socklen_t loclen)
 {
   close(1);
   m_socket=s;
   m_remote_port=0;
   m_dns=NULL;
-  if (loc) *m_saddr=*loc;
-  else memset(m_saddr,0,sizeof(struct sockaddr_in));
+  memset(m_saddr,0,sizeof(struct sockaddr_storage));
+  m_saddr_len=0;
+  if (loc && loclen > 0 && loclen <= (socklen_t)sizeof(struct sockaddr_storage))
+  {
+    memcpy(m_saddr,loc,loclen);
+    m_saddr_len=loclen;
+  }
   if (m_socket != INVALID_SOCKET)
   {
     SET_SOCK_BLOCK(m_socket,0);
@@ -62,38 +70,69 @@ void JNL_Connection::connect(const char *hostname, int port)
 {
   close(1);
   m_remote_port=(short)port;
-  m_socket=::socket(AF_INET,SOCK_STREAM,0);
+  strncpy(m_host,hostname,sizeof(m_host)-1);
+  m_host[sizeof(m_host)-1]=0;
+  memset(m_saddr,0,sizeof(struct sockaddr_storage));
+  m_saddr_len=0;
+  if (!m_host[0])
+  {
+    m_errorstr="empty hostname";
+    m_state=STATE_ERROR;
+  }
+  else
+  {
+    // the socket is created once the address (and thus its family) is known
+    m_state=STATE_RESOLVING;
+    m_saddr_len=JNL::ipstr_to_sockaddr(m_host,m_saddr);
+    m_saddr_idx=m_saddr_len ? -1 : 0;
+  }
+}
+
+void JNL_Connection::connect_next(const char *err)
+{
+  if (m_socket != INVALID_SOCKET)
+  {
+    ::closesocket(m_socket);
+    m_socket=INVALID_SOCKET;
+  }
+  if (m_saddr_idx >= 0 && m_dns)
+  {
+    // resolve_addr() fails once there are no more addresses
+    m_saddr_idx++;
+    memset(m_saddr,0,sizeof(struct sockaddr_storage));
+    m_saddr_len=0;
+    m_state=STATE_RESOLVING;
+  }
+  else
+  {
+    m_errorstr=err;
+    m_state=STATE_ERROR;
+  }
+}
+
+int JNL_Connection::open_socket()
+{
+  if (m_saddr->ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)m_saddr)->sin6_port=htons((unsigned short)m_remote_port);
+  else
+    ((struct sockaddr_in *)m_saddr)->sin_port=htons((unsigned short)m_remote_port);
+
+  m_socket=::socket(m_saddr->ss_family,SOCK_STREAM,0);
   if (m_socket==INVALID_SOCKET)
   {
     m_errorstr="creating socket";
     m_state=STATE_ERROR;
+    return -1;
   }
-  else
+  if (m_localinterfacereq != INADDR_ANY && m_saddr->ss_family == AF_INET)
   {
-    if (m_localinterfacereq != INADDR_ANY)
-    {
-      sockaddr_in sa={0,};
-      sa.sin_family=AF_INET;
-      sa.sin_addr.s_addr=m_localinterfacereq;
-      bind(m_socket,(struct sockaddr *)&sa,16);
-    }
-    SET_SOCK_BLOCK(m_socket,0);
-    strncpy(m_host,hostname,sizeof(m_host)-1);
-    m_host[sizeof(m_host)-1]=0;
-    memset(m_saddr,0,sizeof(struct sockaddr_in));
-    if (!m_host[0])
-    {
-      m_errorstr="empty hostname";
-      m_state=STATE_ERROR;
-    }
-    else
-    {
-      m_state=STATE_RESOLVING;
-      m_saddr->sin_family=AF_INET;
-      m_saddr->sin_port=htons((unsigned short)port);
-      m_saddr->sin_addr.s_addr=inet_addr(hostname);
-    }
+    sockaddr_in sa={0,};
+    sa.sin_family=AF_INET;
+    sa.sin_addr.s_addr=m_localinterfacereq;
+    bind(m_socket,(struct sockaddr *)&sa,sizeof(sa));
   }
+  SET_SOCK_BLOCK(m_socket,0);
+  return 0;
 }
 
 JNL_Connection::~JNL_Connection()
@@ -122,9 +161,9 @@ void JNL_Connection::run(int max_send_bytes, int max_recv_bytes, int *bytes_sent
   switch (m_state)
   {
     case STATE_RESOLVING:
-      if (m_saddr->sin_addr.s_addr == INADDR_NONE)
+      if (!m_saddr_len)
       {
-        int a=m_dns?m_dns->resolve(m_host,(unsigned int *)&m_saddr->sin_addr.s_addr):-1;
+        int a=m_dns?m_dns->resolve_addr(m_host,m_saddr,&m_saddr_len,AF_UNSPEC,m_saddr_idx):-1;
         if (!a) { m_state=STATE_CONNECTING; }
         else if (a == 1)
         {
@@ -133,19 +172,20 @@ void JNL_Connection::run(int max_send_bytes, int max_recv_bytes, int *bytes_sent
         }
         else
         {
-          m_errorstr="resolving hostname"; 
+          m_errorstr=m_saddr_idx > 0 ? "connecting to host" : "resolving hostname"; 
           m_state=STATE_ERROR; 
           return;
         }
       }
-      if (!::connect(m_socket,(struct sockaddr *)m_saddr,16)) 
+      if (open_socket()) return;
+      m_connect_time=time(NULL);
+      if (!::connect(m_socket,(struct sockaddr *)m_saddr,m_saddr_len)) 
       {
         m_state=STATE_CONNECTED;
       }
       else if (JNL_ERRNO!=JNL_EINPROGRESS)
       {
-        m_errorstr="connecting to host";
-        m_state=STATE_ERROR;
+        connect_next("connecting to host");
       }
       else { m_state=STATE_CONNECTING; }
     break;
@@ -171,14 +211,27 @@ void JNL_Connection::run(int max_send_bytes, int max_recv_bytes, int *bytes_sent
           m_errorstr="connecting to host (calling select())";
           m_state=STATE_ERROR;
         }
+        else if (FD_ISSET(m_socket,&f[2]))
+        {
+          connect_next("connecting to host");
+        }
         else if (FD_ISSET(m_socket,&f[1])) 
         {
-          m_state=STATE_CONNECTED;
+          // a failed non-blocking connect also selects writable, with the error in SO_ERROR
+          int err=0;
+          socklen_t errlen=sizeof(err);
+          if (!::getsockopt(m_socket,SOL_SOCKET,SO_ERROR,(char *)&err,&errlen) && err)
+            connect_next("connecting to host");
+          else
+            m_state=STATE_CONNECTED;
         }
-        else if (FD_ISSET(m_socket,&f[2]))
+        else if (m_saddr_idx >= 0 && time(NULL) >= m_connect_time + JNL_CONNECTION_ADDR_TIMEOUT)
         {
-          m_errorstr="connecting to host";
-          m_state=STATE_ERROR;
+          // no answer yet: move on if the host has another address, otherwise keep waiting
+          struct sockaddr_storage sa;
+          socklen_t salen=0;
+          if (m_dns && !m_dns->resolve_addr(m_host,&sa,&salen,AF_UNSPEC,m_saddr_idx+1))
+            connect_next("connecting to host");
         }
       }
     break;
@@ -299,7 +352,9 @@ void JNL_Connection::close(int quick)
     m_recv_len=m_recv_pos=0;
     m_send_len=m_send_pos=0;
     m_host[0]=0;
-    memset(m_saddr,0,sizeof(struct sockaddr_in));
+    memset(m_saddr,0,sizeof(struct sockaddr_storage));
+    m_saddr_len=0;
+    m_saddr_idx=-1;
   }
   else
   {
@@ -477,16 +532,37 @@ void JNL_Connection::set_interface(int useInterface) // call before connect if n
 unsigned int JNL_Connection::get_interface(void)
 {
   if (m_socket==INVALID_SOCKET) return 0;
-  struct sockaddr_in sin;
-  memset(&sin,0,sizeof(sin));
-  socklen_t len=16;
-  if (::getsockname(m_socket,(struct sockaddr *)&sin,&len)) return 0;
-  return (unsigned int) sin.sin_addr.s_addr;
+  struct sockaddr_storage sa;
+  memset(&sa,0,sizeof(sa));
+  socklen_t len=sizeof(sa);
+  if (::getsockname(m_socket,(struct sockaddr *)&sa,&len)) return 0;
+  if (sa.ss_family == AF_INET6)
+  {
+    const struct sockaddr_in6 *sin6=(const struct sockaddr_in6 *)&sa;
+    unsigned int a=0;
+    if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) memcpy(&a,sin6->sin6_addr.s6_addr+12,4);
+    return a;
+  }
+  return (unsigned int) ((struct sockaddr_in *)&sa)->sin_addr.s_addr;
 }
 
 unsigned int JNL_Connection::get_remote()
 {
-  return m_saddr->sin_addr.s_addr;
+  if (m_saddr->ss_family == AF_INET6)
+  {
+    // IPv4 clients of a dual-stack listener show up as ::ffff:a.b.c.d
+    const struct sockaddr_in6 *sin6=(const struct sockaddr_in6 *)m_saddr;
+    unsigned int a=0;
+    if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) memcpy(&a,sin6->sin6_addr.s6_addr+12,4);
+    return a;
+  }
+  return ((const struct sockaddr_in *)m_saddr)->sin_addr.s_addr;
+}
+
+int JNL_Connection::get_remote_addr(struct sockaddr_storage *addr)
+{
+  if (m_saddr_len) memcpy(addr,m_saddr,m_saddr_len);
+  return m_saddr_len;
 }
 
 short JNL_Connection::get_remote_port()
@@ -11,7 +11,10 @@
 **      object to use (or NULL for none, or JNL_CONNECTION_AUTODNS for auto),
 **      and the send and receive buffer sizes.
 **   2. Call connect() to have it connect to a host/port (the hostname will be 
-**      resolved if possible).
+**      resolved if possible). IPv4 and IPv6 hosts are supported, and numeric
+**      IPv6 addresses may be given with or without []. If a hostname resolves
+**      to several addresses, each is tried in turn until one connects (moving
+**      on after JNL_CONNECTION_ADDR_TIMEOUT seconds if another is left).
 **   3. call run() with the maximum send/recv amounts, and optionally parameters
 **      so you can tell how much has been send/received. You want to do this a lot, while:
 **   4. check get_state() to check the state of the connection. The states are:
@@ -62,7 +65,12 @@
 
 #define JNL_CONNECTION_AUTODNS ((JNL_IAsyncDNS*)-1)
 
-struct sockaddr_in;
+#ifndef JNL_CONNECTION_ADDR_TIMEOUT
+#define JNL_CONNECTION_ADDR_TIMEOUT 5
+#endif
+
+struct sockaddr;
+struct sockaddr_storage;
 
 #ifndef JNL_NO_DEFINE_INTERFACES
 class JNL_IConnection
@@ -70,7 +78,7 @@ class JNL_IConnection
   public:
     virtual ~JNL_IConnection() { }
     virtual void connect(const char *hostname, int port)=0;
-    virtual void connect(SOCKET sock, struct sockaddr_in *loc=NULL)=0; // used by the listen object, usually not needed by users.
+    virtual void connect(SOCKET sock, const struct sockaddr *loc=NULL, socklen_t loclen=0)=0; // used by the listen object, usually not needed by users.
 
     virtual void run(int max_send_bytes=-1, int max_recv_bytes=-1, int *bytes_sent=NULL, int *bytes_rcvd=NULL)=0;
     virtual int  get_state()=0;
@@ -96,10 +104,12 @@ class JNL_IConnection
     virtual int peek_bytes(void *data, int maxlength)=0; // returns bytes peeked
 
     virtual unsigned int get_interface(void)=0;        // this returns the interface the connection is on
-    virtual unsigned int get_remote(void)=0; // remote host ip.
+    virtual unsigned int get_remote(void)=0; // remote host IPv4 address (0 if the remote host is IPv6)
+    virtual int get_remote_addr(struct sockaddr_storage *addr)=0; // remote host address of any family, returns its length (0 if unknown)
     virtual short get_remote_port(void)=0; // this returns the remote port of connection
 
     virtual void set_interface(int useInterface)=0; // call before connect if needed
+    virtual SOCKET get_socket(void)=0; // for waiting on it (select/poll/epoll), INVALID_SOCKET if none. run() still does all the I/O
   };
 
   #define JNL_Connection_PARENTDEF : public JNL_IConnection
@@ -128,7 +138,7 @@ class JNL_Connection JNL_Connection_PARENTDEF
     ~JNL_Connection();
 
     void connect(const char *hostname, int port);
-    void connect(SOCKET sock, struct sockaddr_in *loc=NULL); // used by the listen object, usually not needed by users.
+    void connect(SOCKET sock, const struct sockaddr *loc=NULL, socklen_t loclen=0); // used by the listen object, usually not needed by users.
 
     void run(int max_send_bytes=-1, int max_recv_bytes=-1, int *bytes_sent=NULL, int *bytes_rcvd=NULL);
     int  get_state() { return m_state; }
@@ -155,10 +165,12 @@ class JNL_Connection JNL_Connection_PARENTDEF
     int peek_bytes(void *data, int maxlength); // returns bytes peeked
 
     unsigned int get_interface(void);        // this returns the interface the connection is on
-    unsigned int get_remote(void); // remote host ip.
+    unsigned int get_remote(void); // remote host IPv4 address (0 if the remote host is IPv6)
+    int get_remote_addr(struct sockaddr_storage *addr); // remote host address of any family, returns its length (0 if unknown)
     short get_remote_port(void); // this returns the remote port of connection
   
     void set_interface(int useInterface); // call before connect if needed
+    SOCKET get_socket(void) { return m_socket; } // for waiting on it (select/poll/epoll), INVALID_SOCKET if none. run() still does all the I/O
 
   protected:
     SOCKET m_socket;
@@ -172,7 +184,10 @@ class JNL_Connection JNL_Connection_PARENTDEF
     int  m_send_len;
 
     int m_localinterfacereq;
-    struct sockaddr_in *m_saddr;
+    struct sockaddr_storage *m_saddr;
+    socklen_t m_saddr_len; // 0 until the remote address is known
+    int m_saddr_idx; // which of the host's addresses m_saddr is, -1 if m_host is numeric
+    time_t m_connect_time; // when connecting to m_saddr started
     char m_host[256];
 
     JNL_IAsyncDNS *m_dns;
@@ -182,6 +197,8 @@ class JNL_Connection JNL_Connection_PARENTDEF
     const char *m_errorstr;
 
     int getbfromrecv(int pos, int remove); // used by recv_line*
+    int open_socket(); // creates m_socket for the family of m_saddr, returns 0 on success
+    void connect_next(const char *err); // closes m_socket and moves on to the host's next address, or sets err
 
 };
 
@@ -11,24 +11,40 @@
 #include "util.h"
 #include "listen.h"
 
-JNL_Listen::JNL_Listen(short port, unsigned int which_interface)
+JNL_Listen::JNL_Listen(short port, unsigned int which_interface, int af)
 {
   m_port=port;
-  m_socket = ::socket(AF_INET,SOCK_STREAM,0);
+  m_socket = ::socket(af,SOCK_STREAM,0);
   if (m_socket == INVALID_SOCKET) 
   {
   }
   else
   {
-    struct sockaddr_in sin;
+    struct sockaddr_storage sa;
+    socklen_t salen;
     SET_SOCK_BLOCK(m_socket,0);
     int bflag = 1;
     setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, (char*)&bflag, sizeof(bflag));
-    memset((char *) &sin, 0,sizeof(sin));
-    sin.sin_family = AF_INET;
-    sin.sin_port = htons( (short) port );
-    sin.sin_addr.s_addr = which_interface?which_interface:INADDR_ANY;
-    if (::bind(m_socket,(struct sockaddr *)&sin,sizeof(sin))) 
+    memset((char *) &sa, 0,sizeof(sa));
+    if (af == AF_INET6)
+    {
+      int v6only = 0; // accept IPv4 connections as ::ffff:a.b.c.d too
+      setsockopt(m_socket, IPPROTO_IPV6, IPV6_V6ONLY, (char*)&v6only, sizeof(v6only));
+      struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&sa;
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons( (short) port );
+      sin6->sin6_addr = in6addr_any;
+      salen = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+      struct sockaddr_in *sin = (struct sockaddr_in *)&sa;
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons( (short) port );
+      sin->sin_addr.s_addr = which_interface?which_interface:INADDR_ANY;
+      salen = sizeof(struct sockaddr_in);
+    }
+    if (::bind(m_socket,(struct sockaddr *)&sa,salen)) 
     {
       shutdown(m_socket, SHUT_RDWR);
       closesocket(m_socket);
@@ -61,13 +77,13 @@ JNL_IConnection *JNL_Listen::get_connect(int sendbufsize, int recvbufsize)
   {
     return NULL;
   }
-  struct sockaddr_in saddr;
-  socklen_t length = sizeof(struct sockaddr_in);
+  struct sockaddr_storage saddr;
+  socklen_t length = sizeof(saddr);
   SOCKET s = accept(m_socket, (struct sockaddr *) &saddr, &length);
   if (s != INVALID_SOCKET)
   {
     JNL_IConnection *c=new JNL_Connection(NULL,sendbufsize, recvbufsize);
-    c->connect(s,&saddr);
+    c->connect(s,(struct sockaddr *)&saddr,length);
     return c;
   }
   return NULL;
@@ -8,7 +8,8 @@
 **
 ** Usage:
 **   1. create a JNL_Listen object with the port and (optionally) the interface
-**      to listen on.
+**      to listen on. Pass AF_INET6 as the address family to listen dual-stack
+**      (IPv6 plus IPv4-mapped, on all interfaces).
 **   2. call get_connect() to get any new connections (optionally specifying what
 **      buffer sizes the connection should be created with)
 **   3. check is_error() to see if an error has occured
@@ -45,7 +46,7 @@
 class JNL_Listen JNL_Listen_PARENTDEF
 {
   public:
-    JNL_Listen(short port, unsigned int which_interface=0);
+    JNL_Listen(short port, unsigned int which_interface=0, int af=AF_INET);
     ~JNL_Listen();
 
     JNL_IConnection *get_connect(int sendbufsize=8192, int recvbufsize=8192);
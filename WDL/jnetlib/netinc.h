@@ -11,6 +11,8 @@
 
 #ifdef _WIN32
 
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #include <stdio.h>
 #include <time.h>
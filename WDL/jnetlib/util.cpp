@@ -14,7 +14,7 @@ int JNL::open_socketlib()
 {
 #ifdef _WIN32
   WSADATA wsaData;
-  if (WSAStartup(MAKEWORD(1, 1), &wsaData)) return 1;
+  if (WSAStartup(MAKEWORD(2, 2), &wsaData)) return 1;
 #endif
   return 0;
 }
@@ -34,3 +34,60 @@ void JNL::addr_to_ipstr(unsigned int addr, char *host, int maxhostlen)
   struct in_addr a; a.s_addr=addr;
   char *p=::inet_ntoa(a); strncpy(host,p?p:"",maxhostlen);
 }
+
+int JNL::ipstr_to_sockaddr(const char *cp, struct sockaddr_storage *addr)
+{
+  char buf[128];
+  if (!cp || !*cp) return 0;
+  if (*cp == '[')
+  {
+    const char *e=strchr(++cp,']');
+    if (!e || e[1] || e-cp >= (int)sizeof(buf)) return 0;
+    memcpy(buf,cp,e-cp);
+    buf[e-cp]=0;
+    cp=buf;
+  }
+
+  struct addrinfo hints, *res=NULL;
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_flags=AI_NUMERICHOST;
+  if (::getaddrinfo(cp,NULL,&hints,&res) || !res) return 0;
+
+  int l=0;
+  if (res->ai_addr && res->ai_addrlen > 0 && res->ai_addrlen <= sizeof(*addr))
+  {
+    memset(addr,0,sizeof(*addr));
+    memcpy(addr,res->ai_addr,res->ai_addrlen);
+    l=(int)res->ai_addrlen;
+  }
+  ::freeaddrinfo(res);
+  return l;
+}
+
+void JNL::sockaddr_to_ipstr(const struct sockaddr *addr, char *host, int maxhostlen)
+{
+  if (maxhostlen < 1) return;
+  host[0]=0;
+  if (!addr) return;
+
+  if (addr->sa_family == AF_INET6)
+  {
+    const struct sockaddr_in6 *sin6=(const struct sockaddr_in6 *)addr;
+    if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+    {
+      unsigned int a;
+      memcpy(&a,sin6->sin6_addr.s6_addr+12,4);
+      addr_to_ipstr(a,host,maxhostlen);
+      host[maxhostlen-1]=0;
+      return;
+    }
+    if (::getnameinfo(addr,sizeof(struct sockaddr_in6),host,maxhostlen,NULL,0,NI_NUMERICHOST)) host[0]=0;
+  }
+  else if (addr->sa_family == AF_INET)
+  {
+    addr_to_ipstr(((const struct sockaddr_in *)addr)->sin_addr.s_addr,host,maxhostlen);
+    host[maxhostlen-1]=0;
+  }
+}
@@ -22,11 +22,22 @@
 **  JNL::addr_to_ipstr(unsigned int addr, char *host, int maxhostlen);
 **    gives you the dotted decimal notation of an integer ip address.
 **
+**  int JNL::ipstr_to_sockaddr(const char *cp, struct sockaddr_storage *addr);
+**    parses a numeric IPv4 or IPv6 address (IPv6 optionally in []) into addr, with
+**    port 0. returns the length of the address, or 0 if cp is not a numeric address.
+**
+**  JNL::sockaddr_to_ipstr(const struct sockaddr *addr, char *host, int maxhostlen);
+**    gives you the numeric representation of an IPv4 or IPv6 address. IPv4-mapped
+**    IPv6 addresses (::ffff:a.b.c.d) are given in dotted decimal form.
+**
 */
 
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+struct sockaddr;
+struct sockaddr_storage;
+
 class JNL
 {
   public:
@@ -34,6 +45,8 @@ class JNL
     static void close_socketlib();
     static unsigned int ipstr_to_addr(const char *cp);
     static void addr_to_ipstr(unsigned int addr, char *host, int maxhostlen);
+    static int ipstr_to_sockaddr(const char *cp, struct sockaddr_storage *addr);
+    static void sockaddr_to_ipstr(const struct sockaddr *addr, char *host, int maxhostlen);
 };
 
 #endif //_UTIL_H_
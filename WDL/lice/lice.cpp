@@ -14,11 +14,15 @@
 #include <stdio.h> // only included in case we need to debug with sprintf etc
 
 #include "lice_combine.h"
+#include "lice_combine_span.h"
 #include "lice_extended.h"
 
 #ifndef _WIN32
 #include "../swell/swell.h"
+#include <pthread.h>
+#include <unistd.h>
 #endif
+#include "../wdlatomic.h"
 
 _LICE_ImageLoader_rec *LICE_ImageLoader_list;
 
@@ -52,6 +56,254 @@ void LICE_CombinePixels2Clamp(LICE_pixel *destptr, int r, int g, int b, int a, i
 }
 
 
+// worker threads for LICE_RunRowBands(). a job is split into bands that the workers and the
+// calling thread take in turn, the call returns when all of them are done. only one job runs
+// at a time, LICE_RunRowBands() from a worker or from a second thread runs serially.
+class _LICE_RenderPool
+{
+public:
+  enum { MAX_THREADS=64 };
+
+  _LICE_RenderPool()
+  {
+    m_nthreads=0;
+    m_minpix=128*1024;
+    m_busy=0;
+    m_nworkers=0;
+    m_quit=false;
+    m_func=NULL;
+    m_ctx=NULL;
+    m_h=m_band_h=m_nbands=0;
+    m_next_band=0;
+    m_running=0;
+#ifdef _WIN32
+    m_sem=CreateSemaphore(NULL,0,MAX_THREADS,NULL);
+    m_ev_done=CreateEvent(NULL,FALSE,FALSE,NULL);
+#else
+    m_gen=m_start_gen=0;
+    pthread_mutex_init(&m_mx,NULL);
+    pthread_cond_init(&m_cond_start,NULL);
+    pthread_cond_init(&m_cond_done,NULL);
+#endif
+  }
+  ~_LICE_RenderPool()
+  {
+    StopWorkers();
+#ifdef _WIN32
+    CloseHandle(m_sem);
+    CloseHandle(m_ev_done);
+#else
+    pthread_cond_destroy(&m_cond_done);
+    pthread_cond_destroy(&m_cond_start);
+    pthread_mutex_destroy(&m_mx);
+#endif
+  }
+
+  bool Lock(bool wait)
+  {
+    while (wdl_atomic_incr(&m_busy) != 1)
+    {
+      wdl_atomic_decr(&m_busy);
+      if (!wait) return false;
+#ifdef _WIN32
+      Sleep(1);
+#else
+      usleep(1000);
+#endif
+    }
+    return true;
+  }
+  void Unlock() { wdl_atomic_decr(&m_busy); }
+
+  // Lock() must be held for these
+  void StopWorkers()
+  {
+    if (!m_nworkers) return;
+    m_quit=true;
+#ifdef _WIN32
+    ReleaseSemaphore(m_sem,m_nworkers,NULL);
+    for (int x = 0; x < m_nworkers; x ++)
+    {
+      WaitForSingleObject(m_threads[x],INFINITE);
+      CloseHandle(m_threads[x]);
+    }
+#else
+    pthread_mutex_lock(&m_mx);
+    pthread_cond_broadcast(&m_cond_start);
+    pthread_mutex_unlock(&m_mx);
+    for (int x = 0; x < m_nworkers; x ++) pthread_join(m_threads[x],NULL);
+#endif
+    m_nworkers=0;
+    m_quit=false;
+  }
+
+  void Run(int h, void (*func)(void *ctx, int y, int n), void *ctx)
+  {
+#ifndef _WIN32
+    if (m_nworkers < m_nthreads-1)
+    {
+      // new threads may not get to run until after m_gen++ below
+      pthread_mutex_lock(&m_mx);
+      m_start_gen=m_gen;
+      pthread_mutex_unlock(&m_mx);
+    }
+#endif
+    while (m_nworkers < m_nthreads-1)
+    {
+#ifdef _WIN32
+      DWORD tid;
+      HANDLE t=CreateThread(NULL,0,ThreadProc,this,0,&tid);
+      if (!t) break;
+      m_threads[m_nworkers++]=t;
+#else
+      if (pthread_create(&m_threads[m_nworkers],NULL,ThreadProc,this)) break;
+      m_nworkers++;
+#endif
+    }
+
+    m_func=func;
+    m_ctx=ctx;
+    m_h=h;
+    m_nbands=lice_min(h,(m_nworkers+1)*4);
+    m_band_h=(h+m_nbands-1)/m_nbands;
+    m_nbands=(h+m_band_h-1)/m_band_h;
+    m_next_band=0;
+
+    if (!m_nworkers)
+    {
+      func(ctx,0,h);
+      return;
+    }
+
+    m_running=m_nworkers;
+#ifdef _WIN32
+    ReleaseSemaphore(m_sem,m_nworkers,NULL);
+    DoBands();
+    WaitForSingleObject(m_ev_done,INFINITE);
+#else
+    pthread_mutex_lock(&m_mx);
+    m_gen++;
+    pthread_cond_broadcast(&m_cond_start);
+    pthread_mutex_unlock(&m_mx);
+
+    DoBands();
+
+    pthread_mutex_lock(&m_mx);
+    while (m_running) pthread_cond_wait(&m_cond_done,&m_mx);
+    pthread_mutex_unlock(&m_mx);
+#endif
+  }
+
+  int m_nthreads, m_minpix;
+
+private:
+  void DoBands()
+  {
+    for (;;)
+    {
+      const int b=wdl_atomic_incr(&m_next_band)-1;
+      if (b >= m_nbands) break;
+      const int y=b*m_band_h;
+      m_func(m_ctx,y,lice_min(m_band_h,m_h-y));
+    }
+  }
+
+#ifdef _WIN32
+  static DWORD WINAPI ThreadProc(LPVOID p)
+  {
+    _LICE_RenderPool *_this=(_LICE_RenderPool *)p;
+    for (;;)
+    {
+      WaitForSingleObject(_this->m_sem,INFINITE);
+      if (_this->m_quit) break;
+      _this->DoBands();
+      if (!wdl_atomic_decr(&_this->m_running)) SetEvent(_this->m_ev_done);
+    }
+    return 0;
+  }
+#else
+  static void *ThreadProc(void *p)
+  {
+    _LICE_RenderPool *_this=(_LICE_RenderPool *)p;
+    pthread_mutex_lock(&_this->m_mx);
+    int gen=_this->m_start_gen;
+    for (;;)
+    {
+      while (!_this->m_quit && _this->m_gen == gen) pthread_cond_wait(&_this->m_cond_start,&_this->m_mx);
+      if (_this->m_quit) break;
+      gen=_this->m_gen;
+      pthread_mutex_unlock(&_this->m_mx);
+
+      _this->DoBands();
+
+      pthread_mutex_lock(&_this->m_mx);
+      if (!--_this->m_running) pthread_cond_signal(&_this->m_cond_done);
+    }
+    pthread_mutex_unlock(&_this->m_mx);
+    return NULL;
+  }
+#endif
+
+  volatile int m_busy;
+  int m_nworkers;
+  volatile bool m_quit;
+
+  void (*m_func)(void *ctx, int y, int n);
+  void *m_ctx;
+  int m_h, m_band_h, m_nbands;
+  volatile int m_next_band;
+  volatile int m_running;
+
+#ifdef _WIN32
+  HANDLE m_threads[MAX_THREADS];
+  HANDLE m_sem, m_ev_done;
+#else
+  pthread_t m_threads[MAX_THREADS];
+  pthread_mutex_t m_mx;
+  pthread_cond_t m_cond_start, m_cond_done;
+  int m_gen, m_start_gen;
+#endif
+};
+
+static _LICE_RenderPool s_renderpool;
+
+// true if dest and src may share memory (blits from a bitmap to itself or to a LICE_SubBitmap of it)
+static bool _LICE_BitsOverlap(LICE_IBitmap *dest, LICE_IBitmap *src)
+{
+  const LICE_pixel *d=dest->getBits(), *s=src->getBits();
+  if (!d || !s) return true;
+  return d < s+src->getRowSpan()*src->getHeight() && s < d+dest->getRowSpan()*dest->getHeight();
+}
+
+void LICE_SetRenderThreads(int nthreads, int min_pixels)
+{
+  if (nthreads > _LICE_RenderPool::MAX_THREADS) nthreads=_LICE_RenderPool::MAX_THREADS;
+  s_renderpool.Lock(true);
+  if (nthreads < s_renderpool.m_nthreads) s_renderpool.StopWorkers(); // restarted as needed by the next job
+  s_renderpool.m_nthreads=nthreads > 1 ? nthreads : 0;
+  s_renderpool.m_minpix=min_pixels;
+  s_renderpool.Unlock();
+}
+
+int LICE_GetRenderThreads()
+{
+  return lice_max(s_renderpool.m_nthreads,1);
+}
+
+void LICE_RunRowBands(int h, int npix, void (*func)(void *ctx, int y, int n), void *ctx)
+{
+  if (h<1) return;
+  if (h<2 || s_renderpool.m_nthreads<2 || npix < s_renderpool.m_minpix || !s_renderpool.Lock(false))
+  {
+    func(ctx,0,h);
+    return;
+  }
+  if (s_renderpool.m_nthreads<2) func(ctx,0,h); // disabled while we were getting the lock
+  else s_renderpool.Run(h,func,ctx);
+  s_renderpool.Unlock();
+}
+
+
 LICE_MemBitmap::LICE_MemBitmap(int w, int h, unsigned int linealign)
 {
   m_allocsize=0;
@@ -1010,6 +1262,18 @@ void LICE_Blit(LICE_IBitmap *dest, LICE_IBitmap *src, int dstx, int dsty, const
   else 
   {
     int ia=(int)(alpha*256.0);
+    LICE_COMBINESPANFUNC spanfunc=_LICE_GetCombineSpan(mode,ia);
+    if (spanfunc && !_LICE_BitsOverlap(dest,src))
+    {
+      while (i-->0)
+      {
+        spanfunc((LICE_pixel *)pdest,(const LICE_pixel *)psrc,cpsize,ia);
+        pdest+=dest_span;
+        psrc += src_span;
+      }
+      return;
+    }
+
     #ifdef LICE_FAVOR_SIZE
         LICE_COMBINEFUNC blitfunc=NULL;      
         #define __LICE__ACTION(comb) blitfunc=comb::doPix;
@@ -1031,71 +1295,32 @@ void LICE_Blit(LICE_IBitmap *dest, LICE_IBitmap *src, int dstx, int dsty, const
 
 #ifndef LICE_NO_BLUR_SUPPORT
 
-void LICE_Blur(LICE_IBitmap *dest, LICE_IBitmap *src, int dstx, int dsty, int srcx, int srcy, int srcw, int srch) // src and dest can overlap, however it may look fudgy if they do
+struct _LICE_BlurBands
 {
-  if (!dest || !src) return;
-
-  RECT sr={srcx,srcy,srcx+srcw,srcy+srch};
-  if (sr.left < 0) sr.left=0;
-  if (sr.top < 0) sr.top=0;
-  if (sr.right > src->getWidth()) sr.right=src->getWidth();
-  if (sr.bottom > src->getHeight()) sr.bottom = src->getHeight();
-
-  // clip to output
-  if (dstx < 0) { sr.left -= dstx; dstx=0; }
-  if (dsty < 0) { sr.top -= dsty; dsty=0; }
-
-  const int destbm_w = dest->getWidth(), destbm_h = dest->getHeight();
-  if (sr.right <= sr.left || sr.bottom <= sr.top || dstx >= destbm_w || dsty >= destbm_h) return;
-
-  if (sr.right > sr.left + (destbm_w-dstx)) sr.right = sr.left + (destbm_w-dstx);
-  if (sr.bottom > sr.top + (destbm_h-dsty)) sr.bottom = sr.top + (destbm_h-dsty);
-
-  // ignore blits that are smaller than 2x2
-  if (sr.right <= sr.left+1 || sr.bottom <= sr.top+1) return;
-
-  int dest_span=dest->getRowSpan();
-  int src_span=src->getRowSpan();
-  const LICE_pixel *psrc = (LICE_pixel *)src->getBits();
-  LICE_pixel *pdest = (LICE_pixel *)dest->getBits();
-  if (!psrc || !pdest) return;
-
-  if (src->isFlipped())
-  {
-    psrc += (src->getHeight()-sr.top - 1)*src_span;
-    src_span=-src_span;
-  }
-  else psrc += sr.top*src_span;
-  psrc += sr.left;
-
-  if (dest->isFlipped())
-  {
-    pdest += (destbm_h-dsty - 1)*dest_span;
-    dest_span=-dest_span;
-  }
-  else pdest += dsty*dest_span;
-  pdest+=dstx;
-
-  LICE_pixel *tmpbuf=NULL;
-  int w=sr.right-sr.left;  
+  LICE_pixel *pdest;
+  const LICE_pixel *psrc;
+  int w, h, dest_span, src_span;
+  LICE_pixel *tmpbuf; // only used when blurring a bitmap to itself, which is done in one go
+};
 
-  // buffer to save the last unprocessed lines for the cases where blurring from a bitmap to itself
-  LICE_pixel turdbuf[2048];
-  if (src==dest)
-  {
-    if (w <= (int) (sizeof(turdbuf)/sizeof(turdbuf[0])/2)) tmpbuf=turdbuf;
-    else tmpbuf=(LICE_pixel*)malloc(w*2*sizeof(LICE_pixel));
-  }
+// LICE_Blur() rows [y,y+n)
+static void _LICE_BlurRows(void *ctx, int y, int n)
+{
+  const _LICE_BlurBands *p = (const _LICE_BlurBands *)ctx;
+  const int w=p->w, h=p->h, dest_span=p->dest_span, src_span=p->src_span;
+  LICE_pixel *pdest = p->pdest + y*dest_span;
+  const LICE_pixel *psrc = p->psrc + y*src_span;
+  LICE_pixel *tmpbuf = p->tmpbuf;
 
   int i;
-  for (i = sr.top; i < sr.bottom; i ++)
+  for (i = y; i < y+n; i ++)
   {
     if (tmpbuf)
       memcpy(tmpbuf+((i&1)?w:0),psrc,w*sizeof(LICE_pixel));
 
-    if (i==sr.top || i==sr.bottom-1)
+    if (i==0 || i==h-1)
     {
-      const LICE_pixel *psrc2=psrc+(i==sr.top ? src_span : -src_span);
+      const LICE_pixel *psrc2=psrc+(i==0 ? src_span : -src_span);
 
       LICE_pixel lp;
 
@@ -1147,13 +1372,193 @@ void LICE_Blur(LICE_IBitmap *dest, LICE_IBitmap *src, int dstx, int dsty, int sr
     pdest+=dest_span;
     psrc += src_span;
   }
-  if (tmpbuf && tmpbuf != turdbuf)
-    free(tmpbuf);
+}
+
+void LICE_Blur(LICE_IBitmap *dest, LICE_IBitmap *src, int dstx, int dsty, int srcx, int srcy, int srcw, int srch) // src and dest can overlap, however it may look fudgy if they do
+{
+  if (!dest || !src) return;
+
+  RECT sr={srcx,srcy,srcx+srcw,srcy+srch};
+  if (sr.left < 0) sr.left=0;
+  if (sr.top < 0) sr.top=0;
+  if (sr.right > src->getWidth()) sr.right=src->getWidth();
+  if (sr.bottom > src->getHeight()) sr.bottom = src->getHeight();
+
+  // clip to output
+  if (dstx < 0) { sr.left -= dstx; dstx=0; }
+  if (dsty < 0) { sr.top -= dsty; dsty=0; }
+
+  const int destbm_w = dest->getWidth(), destbm_h = dest->getHeight();
+  if (sr.right <= sr.left || sr.bottom <= sr.top || dstx >= destbm_w || dsty >= destbm_h) return;
+
+  if (sr.right > sr.left + (destbm_w-dstx)) sr.right = sr.left + (destbm_w-dstx);
+  if (sr.bottom > sr.top + (destbm_h-dsty)) sr.bottom = sr.top + (destbm_h-dsty);
+
+  // ignore blits that are smaller than 2x2
+  if (sr.right <= sr.left+1 || sr.bottom <= sr.top+1) return;
+
+  int dest_span=dest->getRowSpan();
+  int src_span=src->getRowSpan();
+  const LICE_pixel *psrc = (LICE_pixel *)src->getBits();
+  LICE_pixel *pdest = (LICE_pixel *)dest->getBits();
+  if (!psrc || !pdest) return;
+
+  if (src->isFlipped())
+  {
+    psrc += (src->getHeight()-sr.top - 1)*src_span;
+    src_span=-src_span;
+  }
+  else psrc += sr.top*src_span;
+  psrc += sr.left;
+
+  if (dest->isFlipped())
+  {
+    pdest += (destbm_h-dsty - 1)*dest_span;
+    dest_span=-dest_span;
+  }
+  else pdest += dsty*dest_span;
+  pdest+=dstx;
+
+  _LICE_BlurBands p;
+  p.pdest=pdest;
+  p.psrc=psrc;
+  p.w=sr.right-sr.left;
+  p.h=sr.bottom-sr.top;
+  p.dest_span=dest_span;
+  p.src_span=src_span;
+  p.tmpbuf=NULL;
+
+  // buffer to save the last unprocessed lines for the cases where blurring from a bitmap to itself
+  LICE_pixel turdbuf[2048];
+  if (src==dest)
+  {
+    if (p.w <= (int) (sizeof(turdbuf)/sizeof(turdbuf[0])/2)) p.tmpbuf=turdbuf;
+    else p.tmpbuf=(LICE_pixel*)malloc(p.w*2*sizeof(LICE_pixel));
+  }
+
+  if (_LICE_BitsOverlap(dest,src)) _LICE_BlurRows(&p,0,p.h);
+  else LICE_RunRowBands(p.h,p.w*p.h,_LICE_BlurRows,&p);
+
+  if (p.tmpbuf && p.tmpbuf != turdbuf)
+    free(p.tmpbuf);
 }
 
 #endif
 
 #ifndef LICE_NO_BLIT_SUPPORT
+// non-filtered scaled blit: runs of source pixels are gathered and then combined by a span function
+static void _LICE_ScaleBlitSpan(LICE_pixel_chan *dest, const LICE_pixel_chan *src, int w, int h,
+                                int icurx, int icury, int idx, int idy, unsigned int clipright, unsigned int clipbottom,
+                                int src_span, int dest_span, int ia, LICE_COMBINESPANFUNC spanfunc)
+{
+  LICE_pixel tmp[256];
+  while (h--)
+  {
+    const unsigned int cury = icury >> 16;
+    if (cury < clipbottom)
+    {
+      int curx=icurx;
+      const LICE_pixel *inptr=(const LICE_pixel *)(src + cury * src_span);
+      LICE_pixel *pout=(LICE_pixel *)dest;
+      int x=0;
+      while (x < w)
+      {
+        int n=0;
+        while (x+n < w && n < (int) (sizeof(tmp)/sizeof(tmp[0])))
+        {
+          const unsigned int offs=curx >> 16;
+          if (offs>=clipright) break;
+          tmp[n++]=inptr[offs];
+          curx+=idx;
+        }
+        if (n)
+        {
+          spanfunc(pout+x,tmp,n,ia);
+          x+=n;
+        }
+        else
+        {
+          x++;
+          curx+=idx;
+        }
+      }
+    }
+    dest+=dest_span;
+    icury+=idy;
+  }
+}
+
+struct _LICE_ScaledBlitBands
+{
+  LICE_pixel_chan *pdest;
+  const LICE_pixel_chan *psrc;
+  int dstw, icurx, icury, idx, idy, clip_r, clip_b, src_span, dest_span, ia, mode;
+  LICE_COMBINESPANFUNC spanfunc;
+  int filter[25], filt_start, filtsz; // filtsz is set if filtering down
+};
+
+// LICE_ScaledBlit() rows [y,y+dsth)
+static void _LICE_ScaledBlitRows(void *ctx, int y, int dsth)
+{
+  const _LICE_ScaledBlitBands *p = (const _LICE_ScaledBlitBands *)ctx;
+  LICE_pixel_chan *pdest = p->pdest + y*p->dest_span;
+  const LICE_pixel_chan *psrc = p->psrc;
+  const int dstw=p->dstw, icurx=p->icurx, idx=p->idx, idy=p->idy, clip_r=p->clip_r, clip_b=p->clip_b;
+  const int src_span=p->src_span, dest_span=p->dest_span, ia=p->ia, mode=p->mode;
+  const int icury = (int) ((unsigned int)p->icury + (unsigned int)y*(unsigned int)idy); // same as stepping y rows
+
+  if ((mode&(LICE_BLIT_FILTER_MASK|LICE_BLIT_MODE_MASK|LICE_BLIT_USE_ALPHA))==LICE_BLIT_MODE_COPY && (ia==128 || ia==256))
+  {
+    if (ia==128)
+    {
+      _LICE_Template_Blit0<_LICE_CombinePixelsHalfMixFAST>::scaleBlitFAST(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span);
+    }
+    else
+    {
+      _LICE_Template_Blit0<_LICE_CombinePixelsClobberFAST>::scaleBlitFAST(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span);
+    }
+  }
+  else
+  {
+    if (p->filtsz)
+    {
+      const int *filter=p->filter, filt_start=p->filt_start, filtsz=p->filtsz;
+
+      #ifdef LICE_FAVOR_SIZE
+        LICE_COMBINEFUNC blitfunc=NULL;      
+        #define __LICE__ACTION(comb) blitfunc=comb::doPix;
+      #else
+        #define __LICE__ACTION(comb) _LICE_Template_Blit2<comb>::scaleBlitFilterDown(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,filter,filt_start,filtsz)
+      #endif
+          __LICE_ACTION_SRCALPHA(mode,ia,false);
+      #undef __LICE__ACTION
+
+      #ifdef LICE_FAVOR_SIZE
+        if (blitfunc) _LICE_Template_Blit2::scaleBlitFilterDown(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,filter,filt_start,filtsz,blitfunc);
+      #endif
+
+    }
+    else if (p->spanfunc)
+    {
+      _LICE_ScaleBlitSpan(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,p->spanfunc);
+    }
+    else
+    {
+      #ifdef LICE_FAVOR_SIZE
+        LICE_COMBINEFUNC blitfunc=NULL;      
+        #define __LICE__ACTION(comb) blitfunc=comb::doPix;
+      #else
+        #define __LICE__ACTION(comb) _LICE_Template_Blit2<comb>::scaleBlit(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK)
+      #endif
+          __LICE_ACTION_SRCALPHA(mode,ia,false);
+      #undef __LICE__ACTION
+      #ifdef LICE_FAVOR_SIZE
+        if (blitfunc) _LICE_Template_Blit2::scaleBlit(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK,blitfunc);
+      #endif
+    }
+  }
+}
+
 void LICE_ScaledBlit(LICE_IBitmap *dest, LICE_IBitmap *src, 
                      int dstx, int dsty, int dstw, int dsth, 
                      float srcx, float srcy, float srcw, float srch, 
@@ -1299,85 +1704,73 @@ void LICE_ScaledBlit(LICE_IBitmap *dest, LICE_IBitmap *src,
 
   if (clip_r<1||clip_b<1) return;
 
-  int ia=(int)(alpha*256.0);
+  _LICE_ScaledBlitBands p;
+  p.pdest=pdest;
+  p.psrc=psrc;
+  p.dstw=dstw;
+  p.icurx=icurx;
+  p.icury=icury;
+  p.idx=idx;
+  p.idy=idy;
+  p.clip_r=clip_r;
+  p.clip_b=clip_b;
+  p.src_span=src_span;
+  p.dest_span=dest_span;
+  p.ia=(int)(alpha*256.0);
+  p.mode=mode;
+  p.filtsz=0;
+  p.spanfunc=NULL;
 
-  if ((mode&(LICE_BLIT_FILTER_MASK|LICE_BLIT_MODE_MASK|LICE_BLIT_USE_ALPHA))==LICE_BLIT_MODE_COPY && (ia==128 || ia==256))
+  const bool overlap = _LICE_BitsOverlap(dest,src);
+
+  if ((mode&(LICE_BLIT_FILTER_MASK|LICE_BLIT_MODE_MASK|LICE_BLIT_USE_ALPHA))==LICE_BLIT_MODE_COPY && (p.ia==128 || p.ia==256))
   {
-    if (ia==128)
-    {
-      _LICE_Template_Blit0<_LICE_CombinePixelsHalfMixFAST>::scaleBlitFAST(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span);
-    }
-    else
-    {
-      _LICE_Template_Blit0<_LICE_CombinePixelsClobberFAST>::scaleBlitFAST(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span);
-    }
+    // scaleBlitFAST()
   }
-  else
+  else if (xadvance>=1.7 && yadvance >=1.7 && (mode&LICE_BLIT_FILTER_MASK)==LICE_BLIT_FILTER_BILINEAR)
   {
-    if (xadvance>=1.7 && yadvance >=1.7 && (mode&LICE_BLIT_FILTER_MASK)==LICE_BLIT_FILTER_BILINEAR)
-    {
-      int msc = lice_max(idx,idy);
-      const int filtsz=msc>(3<<16) ? 5 : 3;
-      const int filt_start = - (filtsz/2);
+    int msc = lice_max(idx,idy);
+    const int filtsz=msc>(3<<16) ? 5 : 3;
+    const int filt_start = - (filtsz/2);
 
-      int filter[25]; // 5x5 max
+    // 5x5 max
+    {
+      int y;
+    //  char buf[4096];
+  //    sprintf(buf,"filter, msc=%f: ",msc);
+      int *fp=p.filter;
+      for(y=0;y<filtsz;y++)
       {
-        int y;
-      //  char buf[4096];
-    //    sprintf(buf,"filter, msc=%f: ",msc);
-        int *p=filter;
-        for(y=0;y<filtsz;y++)
+        int x;
+        for(x=0;x<filtsz;x++)
         {
-          int x;
-          for(x=0;x<filtsz;x++)
+          if (x==y && x==filtsz/2) *fp++ = 65536; // src pix is always valued at 1.
+          else
           {
-            if (x==y && x==filtsz/2) *p++ = 65536; // src pix is always valued at 1.
-            else
-            {
-              double dx=x+filt_start;
-              double dy=y+filt_start;
-              double v = (msc-1.0) / sqrt(dx*dx+dy*dy); // this needs serious tweaking...
+            double dx=x+filt_start;
+            double dy=y+filt_start;
+            double v = (msc-1.0) / sqrt(dx*dx+dy*dy); // this needs serious tweaking...
 
-  //            sprintf(buf+strlen(buf),"%f,",v);
+//            sprintf(buf+strlen(buf),"%f,",v);
 
-              if(v<0.0) *p++=0;
-              else if (v>1.0) *p++=65536;
-              else *p++=(int)(v*65536.0);
-            }
+            if(v<0.0) *fp++=0;
+            else if (v>1.0) *fp++=65536;
+            else *fp++=(int)(v*65536.0);
           }
         }
-//        OutputDebugString(buf);
       }
-
-      #ifdef LICE_FAVOR_SIZE
-        LICE_COMBINEFUNC blitfunc=NULL;      
-        #define __LICE__ACTION(comb) blitfunc=comb::doPix;
-      #else
-        #define __LICE__ACTION(comb) _LICE_Template_Blit2<comb>::scaleBlitFilterDown(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,filter,filt_start,filtsz)
-      #endif
-          __LICE_ACTION_SRCALPHA(mode,ia,false);
-      #undef __LICE__ACTION
-
-      #ifdef LICE_FAVOR_SIZE
-        if (blitfunc) _LICE_Template_Blit2::scaleBlitFilterDown(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,filter,filt_start,filtsz,blitfunc);
-      #endif
-
-    }
-    else
-    {
-      #ifdef LICE_FAVOR_SIZE
-        LICE_COMBINEFUNC blitfunc=NULL;      
-        #define __LICE__ACTION(comb) blitfunc=comb::doPix;
-      #else
-        #define __LICE__ACTION(comb) _LICE_Template_Blit2<comb>::scaleBlit(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK)
-      #endif
-          __LICE_ACTION_SRCALPHA(mode,ia,false);
-      #undef __LICE__ACTION
-      #ifdef LICE_FAVOR_SIZE
-        if (blitfunc) _LICE_Template_Blit2::scaleBlit(pdest,psrc,dstw,dsth,icurx,icury,idx,idy,clip_r,clip_b,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK,blitfunc);
-      #endif
+//        OutputDebugString(buf);
     }
+    p.filtsz=filtsz;
+    p.filt_start=filt_start;
   }
+  else if (!(mode&LICE_BLIT_FILTER_MASK) && !overlap)
+  {
+    p.spanfunc=_LICE_GetCombineSpan(mode,p.ia);
+  }
+
+  if (overlap) _LICE_ScaledBlitRows(&p,0,dsth); // rows may depend on rows done before them
+  else LICE_RunRowBands(dsth,dstw*dsth,_LICE_ScaledBlitRows,&p);
 }
 
 void LICE_DeltaBlit(LICE_IBitmap *dest, LICE_IBitmap *src, 
@@ -1620,6 +2013,40 @@ void LICE_DeltaBlitAlpha(LICE_IBitmap *dest, LICE_IBitmap *src,
                       
 
 
+struct _LICE_RotatedBlitBands
+{
+  LICE_pixel_chan *pdest;
+  const LICE_pixel_chan *psrc;
+  int dstw, sr, sb, src_span, dest_span, ia, mode;
+  int isrcx, isrcy, idsdx, idtdx, idsdy, idtdy;
+};
+
+// LICE_RotatedBlit() rows [y,y+dsth)
+static void _LICE_RotatedBlitRows(void *ctx, int y, int dsth)
+{
+  const _LICE_RotatedBlitBands *p = (const _LICE_RotatedBlitBands *)ctx;
+  LICE_pixel_chan *pdest = p->pdest + y*p->dest_span;
+  const LICE_pixel_chan *psrc = p->psrc;
+  const int dstw=p->dstw, sr=p->sr, sb=p->sb, src_span=p->src_span, dest_span=p->dest_span, ia=p->ia, mode=p->mode;
+  const int idsdx=p->idsdx, idtdx=p->idtdx, idsdy=p->idsdy, idtdy=p->idtdy;
+  // same as stepping y rows
+  const int isrcx=(int) ((unsigned int)p->isrcx + (unsigned int)y*(unsigned int)idsdy);
+  const int isrcy=(int) ((unsigned int)p->isrcy + (unsigned int)y*(unsigned int)idtdy);
+
+#ifndef LICE_FAVOR_SPEED
+  LICE_COMBINEFUNC blitfunc=NULL;
+  #define __LICE__ACTION(comb) blitfunc = comb::doPix;
+#else
+  #define __LICE__ACTION(comb) _LICE_Template_Blit3<comb>::deltaBlit(pdest,psrc,dstw,dsth,isrcx,isrcy,idsdx,idtdx,idsdy,idtdy,0,0,sr,sb,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK)
+#endif
+      __LICE_ACTION_SRCALPHA(mode,ia,false);
+  #undef __LICE__ACTION
+
+#ifndef LICE_FAVOR_SPEED
+  if (blitfunc) _LICE_Template_Blit3::deltaBlit(pdest,psrc,dstw,dsth,isrcx,isrcy,idsdx,idtdx,idsdy,idtdy,0,0,sr,sb,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK,blitfunc);
+#endif
+}
+
 void LICE_RotatedBlit(LICE_IBitmap *dest, LICE_IBitmap *src, 
                       int dstx, int dsty, int dstw, int dsth, 
                       float srcx, float srcy, float srcw, float srch, 
@@ -1723,26 +2150,25 @@ void LICE_RotatedBlit(LICE_IBitmap *dest, LICE_IBitmap *src,
 
   psrc += src_span * st + sl * sizeof(LICE_pixel);
 
-  int ia=(int)(alpha*256.0);
-  int isrcx=(int)(srcx*65536.0);
-  int isrcy=(int)(srcy*65536.0);
-  int idsdx=(int)(dsdx*65536.0);
-  int idtdx=(int)(dtdx*65536.0);
-  int idsdy=(int)(dsdy*65536.0);
-  int idtdy=(int)(dtdy*65536.0);
-
-#ifndef LICE_FAVOR_SPEED
-  LICE_COMBINEFUNC blitfunc=NULL;
-  #define __LICE__ACTION(comb) blitfunc = comb::doPix;
-#else
-  #define __LICE__ACTION(comb) _LICE_Template_Blit3<comb>::deltaBlit(pdest,psrc,dstw,dsth,isrcx,isrcy,idsdx,idtdx,idsdy,idtdy,0,0,sr,sb,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK)
-#endif
-      __LICE_ACTION_SRCALPHA(mode,ia,false);
-  #undef __LICE__ACTION
-
-#ifndef LICE_FAVOR_SPEED
-  if (blitfunc) _LICE_Template_Blit3::deltaBlit(pdest,psrc,dstw,dsth,isrcx,isrcy,idsdx,idtdx,idsdy,idtdy,0,0,sr,sb,src_span,dest_span,ia,mode&LICE_BLIT_FILTER_MASK,blitfunc);
-#endif
+  _LICE_RotatedBlitBands p;
+  p.pdest=pdest;
+  p.psrc=psrc;
+  p.dstw=dstw;
+  p.sr=sr;
+  p.sb=sb;
+  p.src_span=src_span;
+  p.dest_span=dest_span;
+  p.ia=(int)(alpha*256.0);
+  p.mode=mode;
+  p.isrcx=(int)(srcx*65536.0);
+  p.isrcy=(int)(srcy*65536.0);
+  p.idsdx=(int)(dsdx*65536.0);
+  p.idtdx=(int)(dtdx*65536.0);
+  p.idsdy=(int)(dsdy*65536.0);
+  p.idtdy=(int)(dtdy*65536.0);
+
+  if (_LICE_BitsOverlap(dest,src)) _LICE_RotatedBlitRows(&p,0,dsth);
+  else LICE_RunRowBands(dsth,dstw*dsth,_LICE_RotatedBlitRows,&p);
 }
 
 #endif
@@ -2052,6 +2478,13 @@ void LICE_PutPixel(LICE_IBitmap *bm, int x, int y, LICE_pixel color, float alpha
 template<class T> class LICE_TransformBlit_class
 {
   public:
+  LICE_IBitmap *dest, *src;
+  int dstx, dsty, dstw, dsth;
+  const T *srcpoints;
+  int div_w, div_h;
+  float alpha;
+  int mode;
+
   static void blit(LICE_IBitmap *dest, LICE_IBitmap *src,  
                     int dstx, int dsty, int dstw, int dsth,
                     const T *srcpoints, int div_w, int div_h, // srcpoints coords should be div_w*div_h*2 long, and be in source image coordinates
@@ -2059,20 +2492,46 @@ template<class T> class LICE_TransformBlit_class
 {
   if (!dest || !src || dstw<1 || dsth<1 || div_w<2 || div_h<2) return;
 
+  LICE_TransformBlit_class p;
+  p.dest=dest;
+  p.src=src;
+  p.dstx=dstx;
+  p.dsty=dsty;
+  p.dstw=dstw;
+  p.dsth=dsth;
+  p.srcpoints=srcpoints;
+  p.div_w=div_w;
+  p.div_h=div_h;
+  p.alpha=alpha;
+  p.mode=mode;
+
+  // bands of grid rows, each grid row draws to its own dest rows
+  if (_LICE_BitsOverlap(dest,src)) blitRows(&p,0,div_h-1);
+  else LICE_RunRowBands(div_h-1,dstw*dsth,blitRows,&p);
+}
+
+  // grid rows [y0,y0+n)
+  static void blitRows(void *ctx, int y0, int n)
+{
+  const LICE_TransformBlit_class *p = (const LICE_TransformBlit_class *)ctx;
+  LICE_IBitmap *dest=p->dest, *src=p->src;
+  const int dstx=p->dstx, dsty=p->dsty, dstw=p->dstw, dsth=p->dsth, div_w=p->div_w, div_h=p->div_h, mode=p->mode;
+  const float alpha=p->alpha;
+
   int cypos=dsty;
   double ypos=dsty;
   double dxpos=dstw/(float)(div_w-1);
   double dypos=dsth/(float)(div_h-1);
   int y;
-  const T *curpoints=srcpoints;
-  for (y = 0; y < div_h-1; y ++)
+  const T *curpoints=p->srcpoints;
+  for (y = 0; y < y0+n; y ++)
   {
     int nypos=(int)((ypos+=dypos) + 0.5);
     int x;
     double xpos=dstx;
     int cxpos=dstx;
 
-    if (nypos != cypos)
+    if (nypos != cypos && y >= y0) // earlier rows are only stepped through, so ypos adds up the same
     {
       double iy=1.0/(double)(nypos-cypos);
       for (x = 0; x < div_w-1; x ++)
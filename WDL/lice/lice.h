@@ -449,6 +449,18 @@ void LICE_TexGen_Noise(LICE_IBitmap *dest, const RECT *rect, float rv, float gv,
 void LICE_TexGen_CircNoise(LICE_IBitmap *dest, const RECT *rect, float rv, float gv, float bv, float nrings, float power, int size);
 
 
+// multithreaded rendering (off by default). when enabled, LICE_ScaledBlit(), LICE_RotatedBlit(), LICE_TransformBlit/2(),
+// LICE_Blur() and LICE_TexGen_*() split destinations of min_pixels or more into row bands, which are rendered by
+// nthreads-1 shared worker threads and the calling thread. the output is identical to rendering serially.
+// nthreads<=1 disables (and stops the worker threads)
+void LICE_SetRenderThreads(int nthreads, int min_pixels=128*1024);
+int LICE_GetRenderThreads();
+
+// calls func(ctx,y,n) for bands of rows [y,y+n) covering [0,h), on the render threads if npix>=min_pixels
+// (otherwise it is a single call on this thread). bands must not depend on each other.
+void LICE_RunRowBands(int h, int npix, void (*func)(void *ctx, int y, int n), void *ctx);
+
+
 // bitmapped text drawing:
 void LICE_DrawChar(LICE_IBitmap *bm, int x, int y, char c, 
                    LICE_pixel color, float alpha, int mode);
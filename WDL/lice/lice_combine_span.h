@@ -0,0 +1,306 @@
+#ifndef _LICE_COMBINE_SPAN_H_
+#define _LICE_COMBINE_SPAN_H_
+
+/*
+  span versions of the common blend modes, used by LICE_Blit() and LICE_ScaledBlit().
+  a span function combines n source pixels into n dest pixels exactly like calling the
+  doPix() of the matching _LICE_CombinePixels* class (see lice_combine.h) for each of them
+  would: same integer math, same rounding (divisions of negative values truncate toward
+  zero, etc). the SSE2 (and if compiled for it, AVX2) versions do 4 (8) pixels at a time,
+  leftover pixels go through doPix().
+
+  _LICE_GetCombineSpan() returns NULL for modes/alphas it does not do, and always without
+  SSE2 (or with LICE_NO_SIMD_COMBINE defined), in which case callers use the templates.
+  spans read a block of source pixels before writing any, so dest must not overlap src.
+*/
+
+typedef void (*LICE_COMBINESPANFUNC)(LICE_pixel *dest, const LICE_pixel *src, int n, int alpha);
+
+#if !defined(LICE_NO_SIMD_COMBINE) && LICE_PIXEL_A == 3 && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LICE_COMBINE_SPAN_SIMD
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// the kernels work on 16-bit lanes, a pixel's 4 channels in 4 consecutive lanes
+struct _LICE_SpanSSE2
+{
+  typedef __m128i V;
+  enum { NPIX=4 };
+
+  static V load(const LICE_pixel *p) { return _mm_loadu_si128((const __m128i *)p); }
+  static void store(LICE_pixel *p, V v) { _mm_storeu_si128((__m128i *)p,v); }
+  static V zero() { return _mm_setzero_si128(); }
+  static V set(int v) { return _mm_set1_epi16((short)v); }
+  static V alphamask() { return _mm_set_epi16(-1,0,0,0,-1,0,0,0); }
+  static V lo8(V v) { return _mm_unpacklo_epi8(v,_mm_setzero_si128()); }
+  static V hi8(V v) { return _mm_unpackhi_epi8(v,_mm_setzero_si128()); }
+  static V pack8(V a, V b) { return _mm_packus_epi16(a,b); }
+  static V bcastalpha(V v) { return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v,0xff),0xff); }
+
+  static V add(V a, V b) { return _mm_add_epi16(a,b); }
+  static V sub(V a, V b) { return _mm_sub_epi16(a,b); }
+  static V mullo(V a, V b) { return _mm_mullo_epi16(a,b); }
+  static V mulhi_u(V a, V b) { return _mm_mulhi_epu16(a,b); }
+  static V shr8(V a) { return _mm_srli_epi16(a,8); }
+  static V shl7(V a) { return _mm_slli_epi16(a,7); }
+  static V shl8(V a) { return _mm_slli_epi16(a,8); }
+  static V min16(V a, V b) { return _mm_min_epi16(a,b); }
+  static V cmpeq(V a, V b) { return _mm_cmpeq_epi16(a,b); }
+  static V cmplt(V a, V b) { return _mm_cmplt_epi16(a,b); }
+  static V xor_(V a, V b) { return _mm_xor_si128(a,b); }
+  static V select(V m, V a, V b) { return _mm_or_si128(_mm_and_si128(m,a),_mm_andnot_si128(m,b)); } // m ? a : b
+
+  // 32-bit lanes
+  static V lo16(V a, V b) { return _mm_unpacklo_epi16(a,b); }
+  static V hi16(V a, V b) { return _mm_unpackhi_epi16(a,b); }
+  static V pack16(V a, V b) { return _mm_packs_epi32(a,b); }
+  static V add32(V a, V b) { return _mm_add_epi32(a,b); }
+  static V sub32(V a, V b) { return _mm_sub_epi32(a,b); }
+  static V shl15_32(V a) { return _mm_slli_epi32(a,15); }
+  static V shl16_32(V a) { return _mm_slli_epi32(a,16); }
+  static V sar8_32(V a) { return _mm_srai_epi32(a,8); }
+  static V sar16_32(V a) { return _mm_srai_epi32(a,16); }
+  static V sar31_32(V a) { return _mm_srai_epi32(a,31); }
+  static V shr15_32(V a) { return _mm_srli_epi32(a,15); }
+  static V and_(V a, V b) { return _mm_and_si128(a,b); }
+  static V set32(int v) { return _mm_set1_epi32(v); }
+};
+
+#ifdef __AVX2__
+// unpacks and packs work within 128-bit halves, which is fine since they are always paired
+struct _LICE_SpanAVX2
+{
+  typedef __m256i V;
+  enum { NPIX=8 };
+
+  static V load(const LICE_pixel *p) { return _mm256_loadu_si256((const __m256i *)p); }
+  static void store(LICE_pixel *p, V v) { _mm256_storeu_si256((__m256i *)p,v); }
+  static V zero() { return _mm256_setzero_si256(); }
+  static V set(int v) { return _mm256_set1_epi16((short)v); }
+  static V alphamask() { return _mm256_set_epi16(-1,0,0,0,-1,0,0,0,-1,0,0,0,-1,0,0,0); }
+  static V lo8(V v) { return _mm256_unpacklo_epi8(v,_mm256_setzero_si256()); }
+  static V hi8(V v) { return _mm256_unpackhi_epi8(v,_mm256_setzero_si256()); }
+  static V pack8(V a, V b) { return _mm256_packus_epi16(a,b); }
+  static V bcastalpha(V v) { return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v,0xff),0xff); }
+
+  static V add(V a, V b) { return _mm256_add_epi16(a,b); }
+  static V sub(V a, V b) { return _mm256_sub_epi16(a,b); }
+  static V mullo(V a, V b) { return _mm256_mullo_epi16(a,b); }
+  static V mulhi_u(V a, V b) { return _mm256_mulhi_epu16(a,b); }
+  static V shr8(V a) { return _mm256_srli_epi16(a,8); }
+  static V shl7(V a) { return _mm256_slli_epi16(a,7); }
+  static V shl8(V a) { return _mm256_slli_epi16(a,8); }
+  static V min16(V a, V b) { return _mm256_min_epi16(a,b); }
+  static V cmpeq(V a, V b) { return _mm256_cmpeq_epi16(a,b); }
+  static V cmplt(V a, V b) { return _mm256_cmpgt_epi16(b,a); }
+  static V xor_(V a, V b) { return _mm256_xor_si256(a,b); }
+  static V select(V m, V a, V b) { return _mm256_blendv_epi8(b,a,m); }
+
+  static V lo16(V a, V b) { return _mm256_unpacklo_epi16(a,b); }
+  static V hi16(V a, V b) { return _mm256_unpackhi_epi16(a,b); }
+  static V pack16(V a, V b) { return _mm256_packs_epi32(a,b); }
+  static V add32(V a, V b) { return _mm256_add_epi32(a,b); }
+  static V sub32(V a, V b) { return _mm256_sub_epi32(a,b); }
+  static V shl15_32(V a) { return _mm256_slli_epi32(a,15); }
+  static V shl16_32(V a) { return _mm256_slli_epi32(a,16); }
+  static V sar8_32(V a) { return _mm256_srai_epi32(a,8); }
+  static V sar16_32(V a) { return _mm256_srai_epi32(a,16); }
+  static V sar31_32(V a) { return _mm256_srai_epi32(a,31); }
+  static V shr15_32(V a) { return _mm256_srli_epi32(a,15); }
+  static V and_(V a, V b) { return _mm256_and_si256(a,b); }
+  static V set32(int v) { return _mm256_set1_epi32(v); }
+};
+#endif
+
+enum
+{
+  _LICE_SPAN_COPY, // _LICE_CombinePixelsCopyNoClamp, 0 < alpha < 256
+  _LICE_SPAN_COPY_SRCALPHA, // _LICE_CombinePixelsCopySourceAlphaNoClamp, alpha < 256
+  _LICE_SPAN_COPY_SRCALPHA_FULL, // _LICE_CombinePixelsCopySourceAlphaIgnoreAlphaParmNoClamp, alpha == 256
+  _LICE_SPAN_ADD,
+  _LICE_SPAN_ADD_SRCALPHA,
+  _LICE_SPAN_MUL, // _LICE_CombinePixelsMulNoClamp
+  _LICE_SPAN_MUL_SRCALPHA, // _LICE_CombinePixelsMulSourceAlphaNoClamp
+  _LICE_SPAN_OVERLAY,
+  _LICE_SPAN_OVERLAY_SRCALPHA,
+};
+
+template<class O> class _LICE_SpanKernels
+{
+public:
+  typedef typename O::V V;
+
+  // s + ((d-s)*sc)/256, sc <= 256
+  static inline V lerp(V d, V s, V sc)
+  {
+    const V diff=O::sub(d,s);
+    const V neg=O::cmplt(diff,O::zero());
+    const V q=O::shr8(O::mullo(O::sub(O::xor_(diff,neg),neg),sc)); // |d-s|*sc fits in 16 bits
+    return O::add(s,O::sub(O::xor_(q,neg),neg));
+  }
+
+  // (alpha*(a+1))/256, 0..256
+  static inline V srcalpha(V a, int alpha)
+  {
+    if (alpha == 256) return O::add(a,O::set(1));
+    return O::shr8(O::mullo(O::add(a,O::set(1)),O::set(alpha)));
+  }
+
+  // _LICE_CombinePixelsOverlay with alpha (0..256) per lane. products need 32 bits
+  static inline V overlay(V d, V s, V al)
+  {
+    const V src=O::add(O::mullo(s,al),O::shl7(O::sub(O::set(256),al))); // s*al+(256-al)*128, 0..65280
+    const V plo=O::mullo(d,src), phi=O::mulhi_u(d,src);
+    V r[2];
+    int i;
+    for (i = 0; i < 2; i ++)
+    {
+      const V d32 = i ? O::hi16(d,O::zero()) : O::lo16(d,O::zero());
+      const V src32 = i ? O::hi16(src,O::zero()) : O::lo16(src,O::zero());
+      V p = O::sub32(O::shl15_32(d32), i ? O::hi16(plo,phi) : O::lo16(plo,phi)); // d*(32768-src)
+      p = O::sar8_32(O::add32(p,O::and_(O::sar31_32(p),O::set32(255)))); // /256
+      r[i] = O::sar16_32(O::shl16_32(O::add32(p,src32))); // 0..65280, as int16 so that it packs without saturating
+    }
+    const V w=O::pack16(r[0],r[1]);
+    const V qlo=O::mullo(d,w), qhi=O::mulhi_u(d,w);
+    return O::pack16(O::shr15_32(O::lo16(qlo,qhi)),O::shr15_32(O::hi16(qlo,qhi))); // 0..510, clamped by pack8()
+  }
+
+  template<int KIND> static inline V combine(V d, V s, int alpha)
+  {
+    switch (KIND)
+    {
+      case _LICE_SPAN_COPY:
+      return lerp(d,s,O::set(256-alpha));
+
+      case _LICE_SPAN_COPY_SRCALPHA:
+      case _LICE_SPAN_COPY_SRCALPHA_FULL:
+      {
+        const V a=O::bcastalpha(s);
+        const V k = KIND == _LICE_SPAN_COPY_SRCALPHA ? srcalpha(a,alpha) : a;
+        const V sc = KIND == _LICE_SPAN_COPY_SRCALPHA ? O::sub(O::set(256),k) : O::sub(O::set(255),a);
+        V r=O::select(O::alphamask(),O::min16(O::add(k,d),O::set(255)),lerp(d,s,sc));
+        return O::select(O::cmpeq(a,O::zero()),d,r);
+      }
+
+      case _LICE_SPAN_ADD:
+      return O::add(d,O::shr8(O::mullo(s,O::set(alpha))));
+
+      case _LICE_SPAN_ADD_SRCALPHA:
+      {
+        const V a=O::bcastalpha(s);
+        const V r=O::add(d,O::shr8(O::mullo(s,srcalpha(a,alpha))));
+        return O::select(O::cmpeq(a,O::zero()),d,r);
+      }
+
+      case _LICE_SPAN_MUL:
+      return O::mulhi_u(d,O::add(O::set((256-alpha)*256),O::mullo(s,O::set(alpha))));
+
+      case _LICE_SPAN_MUL_SRCALPHA:
+      {
+        const V a=O::bcastalpha(s);
+        const V k=srcalpha(a,alpha);
+        const V r=O::mulhi_u(d,O::add(O::shl8(O::sub(O::set(256),k)),O::mullo(s,k))); // k=0 overflows, but then d is kept
+        return O::select(O::cmpeq(alpha == 256 ? a : k,O::zero()),d,r); // below 256, a=0 has k=0 too
+      }
+
+      case _LICE_SPAN_OVERLAY:
+      return overlay(d,s,O::set(alpha));
+
+      case _LICE_SPAN_OVERLAY_SRCALPHA:
+      return overlay(d,s,srcalpha(O::bcastalpha(s),alpha));
+    }
+    return d;
+  }
+
+  // returns the number of pixels done
+  template<int KIND> static int span(LICE_pixel *dest, const LICE_pixel *src, int n, int alpha)
+  {
+    int i;
+    for (i = 0; i+O::NPIX <= n; i += O::NPIX)
+    {
+      const V s=O::load(src+i), d=O::load(dest+i);
+      O::store(dest+i,O::pack8(combine<KIND>(O::lo8(d),O::lo8(s),alpha),combine<KIND>(O::hi8(d),O::hi8(s),alpha)));
+    }
+    return i;
+  }
+};
+
+template<int KIND, class COMBFUNC> static void _LICE_CombineSpan(LICE_pixel *dest, const LICE_pixel *src, int n, int alpha)
+{
+#ifdef __AVX2__
+  int i=_LICE_SpanKernels<_LICE_SpanAVX2>::span<KIND>(dest,src,n,alpha);
+  i+=_LICE_SpanKernels<_LICE_SpanSSE2>::span<KIND>(dest+i,src+i,n-i,alpha);
+#else
+  int i=_LICE_SpanKernels<_LICE_SpanSSE2>::span<KIND>(dest,src,n,alpha);
+#endif
+  for (; i < n; i ++)
+  {
+    const LICE_pixel_chan *in=(const LICE_pixel_chan *)(src+i);
+    COMBFUNC::doPix((LICE_pixel_chan *)(dest+i),in[LICE_PIXEL_R],in[LICE_PIXEL_G],in[LICE_PIXEL_B],in[LICE_PIXEL_A],alpha);
+  }
+}
+
+// a row of an 8-bit glyph coverage mask drawn in col (alpha 255) with _LICE_CombinePixelsCopyNoClamp at full
+// alpha, as lice_textnew.cpp does: pixels with coverage v>0 get alpha v+1, v=0 leaves dest alone.
+// returns the number of pixels done
+static inline int _LICE_GlyphSpanCopy(LICE_pixel *dest, const unsigned char *cov, int n, LICE_pixel col)
+{
+  typedef _LICE_SpanSSE2 O;
+  const O::V s=O::lo8(_mm_set1_epi32((int)col)), zero=O::zero(), full=O::set(255);
+  int i;
+  for (i = 0; i+O::NPIX <= n; i += O::NPIX)
+  {
+    unsigned int v4;
+    memcpy(&v4,cov+i,4);
+    if (!v4) continue; // most of a glyph is empty
+
+    O::V v=_mm_cvtsi32_si128((int)v4);
+    v=_mm_unpacklo_epi8(v,v);
+    v=_mm_unpacklo_epi16(v,v); // coverage of each pixel in all 4 of its channels
+    const O::V vlo=O::lo8(v), vhi=O::hi8(v);
+
+    const O::V d=O::load(dest+i), dlo=O::lo8(d), dhi=O::hi8(d);
+    const O::V rlo=O::select(O::cmpeq(vlo,zero),dlo,_LICE_SpanKernels<O>::lerp(dlo,s,O::sub(full,vlo)));
+    const O::V rhi=O::select(O::cmpeq(vhi,zero),dhi,_LICE_SpanKernels<O>::lerp(dhi,s,O::sub(full,vhi)));
+    O::store(dest+i,O::pack8(rlo,rhi));
+  }
+  return i;
+}
+
+#endif // LICE_COMBINE_SPAN_SIMD
+
+
+// the modes of __LICE_ACTION_SRCALPHA(mode,alpha,false) that have a span version
+static inline LICE_COMBINESPANFUNC _LICE_GetCombineSpan(int mode, int alpha)
+{
+#ifdef LICE_COMBINE_SPAN_SIMD
+  if (alpha < 1 || alpha > 256) return NULL;
+  switch (mode&(LICE_BLIT_MODE_MASK|LICE_BLIT_USE_ALPHA))
+  {
+    case LICE_BLIT_MODE_COPY:
+      if (alpha < 256) return _LICE_CombineSpan<_LICE_SPAN_COPY,_LICE_CombinePixelsCopyNoClamp>;
+    break;
+    case LICE_BLIT_MODE_COPY|LICE_BLIT_USE_ALPHA:
+      if (alpha < 256) return _LICE_CombineSpan<_LICE_SPAN_COPY_SRCALPHA,_LICE_CombinePixelsCopySourceAlphaNoClamp>;
+    return _LICE_CombineSpan<_LICE_SPAN_COPY_SRCALPHA_FULL,_LICE_CombinePixelsCopySourceAlphaIgnoreAlphaParmNoClamp>;
+#ifndef LICE_DISABLE_BLEND_ADD
+    case LICE_BLIT_MODE_ADD: return _LICE_CombineSpan<_LICE_SPAN_ADD,_LICE_CombinePixelsAdd>;
+    case LICE_BLIT_MODE_ADD|LICE_BLIT_USE_ALPHA: return _LICE_CombineSpan<_LICE_SPAN_ADD_SRCALPHA,_LICE_CombinePixelsAddSourceAlpha>;
+#endif
+#ifndef LICE_DISABLE_BLEND_MUL
+    case LICE_BLIT_MODE_MUL: return _LICE_CombineSpan<_LICE_SPAN_MUL,_LICE_CombinePixelsMulNoClamp>;
+    case LICE_BLIT_MODE_MUL|LICE_BLIT_USE_ALPHA: return _LICE_CombineSpan<_LICE_SPAN_MUL_SRCALPHA,_LICE_CombinePixelsMulSourceAlphaNoClamp>;
+#endif
+#ifndef LICE_DISABLE_BLEND_OVERLAY
+    case LICE_BLIT_MODE_OVERLAY: return _LICE_CombineSpan<_LICE_SPAN_OVERLAY,_LICE_CombinePixelsOverlay>;
+    case LICE_BLIT_MODE_OVERLAY|LICE_BLIT_USE_ALPHA: return _LICE_CombineSpan<_LICE_SPAN_OVERLAY_SRCALPHA,_LICE_CombinePixelsOverlaySourceAlpha>;
+#endif
+  }
+#endif
+  return NULL;
+}
+
+#endif // _LICE_COMBINE_SPAN_H_
@@ -0,0 +1,145 @@
+/*
+  lice_combine_span_test.cpp
+  checks the SIMD span functions of lice_combine_span.h against the lice_combine.h templates that
+  LICE_Blit()/LICE_ScaledBlit() (and, for _LICE_GlyphSpanCopy(), lice_textnew.cpp) use without them,
+  pixel for pixel
+
+  g++ -O2 -o lice_combine_span_test lice_combine_span_test.cpp
+  (and again with -mavx2)
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "lice.h"
+#include "lice_combine.h"
+#include "lice_combine_span.h"
+
+#ifdef LICE_COMBINE_SPAN_SIMD
+
+static unsigned int g_rs=12345;
+static unsigned int rnd() { g_rs=g_rs*1664525+1013904223; return g_rs>>8; }
+
+// mostly random pixels, with plenty of the alpha values that the modes special case
+static LICE_pixel rnd_pixel()
+{
+  const unsigned int v=rnd()|(rnd()<<16);
+  const int k=rnd()%8;
+  const unsigned int a = k==0 ? 0 : k==1 ? 255 : k==2 ? 1 : (v>>24);
+  return (v&0xffffff)|(a<<24);
+}
+
+template<class COMBFUNC> static void ref_span(LICE_pixel *dest, const LICE_pixel *src, int n, int alpha)
+{
+  for (int i = 0; i < n; i ++)
+  {
+    const LICE_pixel_chan *in=(const LICE_pixel_chan *)(src+i);
+    COMBFUNC::doPix((LICE_pixel_chan *)(dest+i),in[LICE_PIXEL_R],in[LICE_PIXEL_G],in[LICE_PIXEL_B],in[LICE_PIXEL_A],alpha);
+  }
+}
+
+// what __LICE_ACTION_SRCALPHA(mode,ia,false) picks for the modes that have spans
+static void ref_blit(int mode, LICE_pixel *dest, const LICE_pixel *src, int n, int ia)
+{
+  switch (mode)
+  {
+    case LICE_BLIT_MODE_COPY: ref_span<_LICE_CombinePixelsCopyNoClamp>(dest,src,n,ia); break;
+    case LICE_BLIT_MODE_COPY|LICE_BLIT_USE_ALPHA:
+      if (ia==256) ref_span<_LICE_CombinePixelsCopySourceAlphaIgnoreAlphaParmNoClamp>(dest,src,n,ia);
+      else ref_span<_LICE_CombinePixelsCopySourceAlphaNoClamp>(dest,src,n,ia);
+    break;
+    case LICE_BLIT_MODE_ADD: ref_span<_LICE_CombinePixelsAdd>(dest,src,n,ia); break;
+    case LICE_BLIT_MODE_ADD|LICE_BLIT_USE_ALPHA: ref_span<_LICE_CombinePixelsAddSourceAlpha>(dest,src,n,ia); break;
+    case LICE_BLIT_MODE_MUL: ref_span<_LICE_CombinePixelsMulNoClamp>(dest,src,n,ia); break;
+    case LICE_BLIT_MODE_MUL|LICE_BLIT_USE_ALPHA: ref_span<_LICE_CombinePixelsMulSourceAlphaNoClamp>(dest,src,n,ia); break;
+    case LICE_BLIT_MODE_OVERLAY: ref_span<_LICE_CombinePixelsOverlay>(dest,src,n,ia); break;
+    case LICE_BLIT_MODE_OVERLAY|LICE_BLIT_USE_ALPHA: ref_span<_LICE_CombinePixelsOverlaySourceAlpha>(dest,src,n,ia); break;
+  }
+}
+
+#define MAX_N 40
+
+static int g_fails, g_cases;
+
+static void test_mode(int mode, const char *name)
+{
+  for (int ia = 1; ia <= 256; ia ++)
+  {
+    LICE_COMBINESPANFUNC spanfunc=_LICE_GetCombineSpan(mode,ia);
+    if (!spanfunc) continue;
+
+    for (int n = 0; n <= MAX_N; n ++)
+    {
+      LICE_pixel src[MAX_N], d1[MAX_N], d2[MAX_N];
+      for (int i = 0; i < n; i ++) { src[i]=rnd_pixel(); d1[i]=d2[i]=rnd_pixel(); }
+
+      spanfunc(d1,src,n,ia);
+      ref_blit(mode,d2,src,n,ia);
+
+      g_cases++;
+      for (int i = 0; i < n; i ++) if (d1[i] != d2[i])
+      {
+        printf("FAIL %s alpha %d n %d: pixel %d src %08x got %08x expected %08x\n",name,ia,n,i,src[i],d1[i],d2[i]);
+        g_fails++;
+        break;
+      }
+    }
+  }
+}
+
+// glyph coverage rows, as drawn by lice_textnew.cpp for COPY at alpha 1
+static void test_glyph_span()
+{
+  for (int rep = 0; rep < 2000; rep ++)
+  {
+    const int n=rnd()%(MAX_N+1);
+    const LICE_pixel col=rnd_pixel()|LICE_RGBA(0,0,0,255);
+    unsigned char cov[MAX_N];
+    LICE_pixel d1[MAX_N], d2[MAX_N];
+    for (int i = 0; i < n; i ++)
+    {
+      const int k=rnd()%4;
+      cov[i] = k==0 ? 0 : k==1 ? 255 : (unsigned char)rnd(); // glyphs are mostly empty or solid
+      d1[i]=d2[i]=rnd_pixel();
+    }
+    if (rep&1) memset(cov,0,n/2); // whole empty blocks are skipped
+
+    const int done=_LICE_GlyphSpanCopy(d1,cov,n,col);
+    for (int i = 0; i < done; i ++)
+      if (cov[i]) _LICE_CombinePixelsCopyNoClamp::doPix((LICE_pixel_chan *)(d2+i),LICE_GETR(col),LICE_GETG(col),LICE_GETB(col),255,cov[i]+1);
+
+    g_cases++;
+    if (done > n || n-done >= 4 || memcmp(d1,d2,n*sizeof(LICE_pixel)))
+    {
+      printf("FAIL glyph span n %d: did %d pixels\n",n,done);
+      g_fails++;
+    }
+  }
+}
+
+#endif // LICE_COMBINE_SPAN_SIMD
+
+int main(int argc, char **argv)
+{
+#ifndef LICE_COMBINE_SPAN_SIMD
+  printf("no SIMD spans in this build, nothing to test\n");
+  return 0;
+#else
+  static const struct { int mode; const char *name; } modes[]={
+    { LICE_BLIT_MODE_COPY, "copy" },
+    { LICE_BLIT_MODE_COPY|LICE_BLIT_USE_ALPHA, "copy srcalpha" },
+    { LICE_BLIT_MODE_ADD, "add" },
+    { LICE_BLIT_MODE_ADD|LICE_BLIT_USE_ALPHA, "add srcalpha" },
+    { LICE_BLIT_MODE_MUL, "mul" },
+    { LICE_BLIT_MODE_MUL|LICE_BLIT_USE_ALPHA, "mul srcalpha" },
+    { LICE_BLIT_MODE_OVERLAY, "overlay" },
+    { LICE_BLIT_MODE_OVERLAY|LICE_BLIT_USE_ALPHA, "overlay srcalpha" },
+  };
+  for (size_t x = 0; x < sizeof(modes)/sizeof(modes[0]); x ++)
+    for (int rep = 0; rep < 4; rep ++)
+      test_mode(modes[x].mode,modes[x].name);
+  test_glyph_span();
+
+  printf("%s (%d spans, %d failures)\n",g_fails?"FAIL":"OK",g_cases,g_fails);
+  return g_fails ? 1 : 0;
+#endif
+}
@@ -0,0 +1,117 @@
+/*
+  lice_renderthreads_test.cpp
+  checks that the operations LICE_SetRenderThreads() splits into row bands produce the same pixels
+  as when they run serially, for several thread counts, bitmap sizes and flipped/unflipped dests
+
+  g++ -O2 -include cmath -D_LICE_NO_SYSBITMAPS_ -o lice_renderthreads_test lice_renderthreads_test.cpp lice.cpp lice_texgen.cpp -lpthread
+  (-include cmath keeps libstdc++ ahead of swell's min/max macros)
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "lice.h"
+
+class FlippedBitmap : public LICE_MemBitmap
+{
+public:
+  FlippedBitmap(int w, int h, bool flip) : LICE_MemBitmap(w,h) { m_flip=flip; }
+  virtual bool isFlipped() { return m_flip; }
+  bool m_flip;
+};
+
+static unsigned int g_rs=12345;
+static unsigned int rnd() { g_rs=g_rs*1664525+1013904223; return g_rs>>8; }
+
+static void fill(LICE_IBitmap *bm)
+{
+  LICE_pixel *p=bm->getBits();
+  const int n=bm->getRowSpan()*bm->getHeight();
+  for (int i = 0; i < n; i ++) p[i]=rnd()|(rnd()<<16);
+}
+
+#define NUM_OPS 14
+static const char *g_opnames[NUM_OPS]={
+  "scaled copy", "scaled halfmix", "scaled bilinear srcalpha", "scaled filterdown add", "scaled overlay srcalpha",
+  "rotated bilinear", "rotated srcalpha", "transform2 bilinear", "transform", "blur", "blur in place",
+  "marble", "noise", "circnoise"
+};
+
+static void run_op(int k, LICE_IBitmap *dest, LICE_IBitmap *src, LICE_IBitmap *bigsrc)
+{
+  const int w=dest->getWidth(), h=dest->getHeight(), sw=src->getWidth(), sh=src->getHeight();
+  switch (k)
+  {
+    case 0: LICE_ScaledBlit(dest,src,-3,-2,w+7,h+5,0,0,sw,sh,1.0f,LICE_BLIT_MODE_COPY); break;
+    case 1: LICE_ScaledBlit(dest,src,0,0,w,h,0.5f,0.5f,sw-1,sh-1,0.5f,LICE_BLIT_MODE_COPY); break;
+    case 2: LICE_ScaledBlit(dest,src,0,0,w,h,0,0,sw,sh,1.0f,LICE_BLIT_MODE_COPY|LICE_BLIT_USE_ALPHA|LICE_BLIT_FILTER_BILINEAR); break;
+    case 3: LICE_ScaledBlit(dest,bigsrc,1,1,w-2,h-2,0,0,bigsrc->getWidth(),bigsrc->getHeight(),0.75f,LICE_BLIT_MODE_ADD|LICE_BLIT_FILTER_BILINEAR); break;
+    case 4: LICE_ScaledBlit(dest,src,0,h,w,-h,3,2,sw-5,sh-3,0.6f,LICE_BLIT_MODE_OVERLAY|LICE_BLIT_USE_ALPHA); break;
+    case 5: LICE_RotatedBlit(dest,src,0,0,w,h,0,0,sw,sh,0.3f,false,1.0f,LICE_BLIT_MODE_COPY|LICE_BLIT_FILTER_BILINEAR); break;
+    case 6: LICE_RotatedBlit(dest,src,-5,-5,w+10,h+10,0,0,sw,sh,-2.1f,true,0.7f,LICE_BLIT_MODE_COPY|LICE_BLIT_USE_ALPHA,3,-4); break;
+    case 7:
+      {
+        double pts[5*4*2];
+        for (int y = 0; y < 4; y ++) for (int x = 0; x < 5; x ++)
+        {
+          pts[(y*5+x)*2]=x*sw/4.0+(x%2 ? 3 : -2);
+          pts[(y*5+x)*2+1]=y*sh/3.0+(y%2 ? -4 : 1);
+        }
+        LICE_TransformBlit2(dest,src,2,3,w-4,h-6,pts,5,4,0.9f,LICE_BLIT_MODE_COPY|LICE_BLIT_FILTER_BILINEAR);
+      }
+    break;
+    case 8:
+      {
+        float pts[9*7*2];
+        for (int y = 0; y < 7; y ++) for (int x = 0; x < 9; x ++)
+        {
+          pts[(y*9+x)*2]=x*sw/8.0f+(y%2 ? 2 : -1);
+          pts[(y*9+x)*2+1]=y*sh/6.0f+(x%3);
+        }
+        LICE_TransformBlit(dest,src,-10,-10,w+20,h+20,pts,9,7,1.0f,LICE_BLIT_MODE_COPY);
+      }
+    break;
+    case 9: LICE_Blur(dest,src,0,0,0,0,sw,sh); break;
+    case 10: LICE_Blur(dest,dest,0,0,0,0,w,h); break; // stays serial
+    case 11: { RECT r={3,2,w-4,h-1}; LICE_TexGen_Marble(dest,&r,0.9f,0.8f,0.5f,0.7f); } break;
+    case 12: LICE_TexGen_Noise(dest,NULL,0.9f,0.8f,0.5f,0.6f,NOISE_MODE_WOOD,4); break;
+    case 13: LICE_TexGen_CircNoise(dest,NULL,0.9f,0.8f,0.5f,6.0f,0.3f,16); break;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  static const int sizes[][2]={ {1,1}, {3,2}, {17,5}, {200,133}, {641,480}, {1023,767} };
+  int fails=0, cnt=0;
+
+  for (int si = 0; si < 6; si ++) for (int flip = 0; flip < 2; flip ++) for (int k = 0; k < NUM_OPS; k ++)
+  {
+    const int w=sizes[si][0], h=sizes[si][1];
+    LICE_MemBitmap src(w+11,h+7), bigsrc(w*3+1,h*3+2);
+    FlippedBitmap serial(w,h,!!flip), banded(w,h,!!flip), orig(w,h,!!flip);
+    fill(&src);
+    fill(&bigsrc);
+    fill(&orig);
+    const int bytes=orig.getRowSpan()*h*(int)sizeof(LICE_pixel);
+
+    memcpy(serial.getBits(),orig.getBits(),bytes);
+    LICE_SetRenderThreads(1);
+    run_op(k,&serial,&src,&bigsrc);
+
+    for (int nt = 2; nt <= 8; nt += 3)
+    {
+      memcpy(banded.getBits(),orig.getBits(),bytes);
+      LICE_SetRenderThreads(nt,0); // band even the smallest bitmaps
+      run_op(k,&banded,&src,&bigsrc);
+      cnt++;
+      if (memcmp(banded.getBits(),serial.getBits(),bytes))
+      {
+        printf("FAIL %s: %dx%d%s, %d threads differ from serial\n",g_opnames[k],w,h,flip?" flipped":"",nt);
+        fails++;
+      }
+    }
+  }
+  LICE_SetRenderThreads(0);
+
+  printf("%s (%d comparisons, %d failures)\n",fails?"FAIL":"OK",cnt,fails);
+  return fails ? 1 : 0;
+}
@@ -9,6 +9,39 @@
 #include "lice.h"
 #include <math.h>
 
+// parameters for the row bands run by LICE_RunRowBands()
+struct _LICE_TexGenParms
+{
+  _LICE_TexGenParms(LICE_pixel *_startp, int _span, int _w, int _h, float _rv, float _gv, float _bv)
+    : startp(_startp), span(_span), w(_w), h(_h), rv(_rv), gv(_gv), bv(_bv) { }
+
+  LICE_pixel *startp;
+  int span, w, h;
+  float rv, gv, bv;
+
+  float sc; // marble
+  float intensity; int mode, smooth; // noise
+  float xyPeriod, turbPower, turbSize, iturbSize; // circnoise
+};
+
+static void MarbleRows(void *ctx, int first, int n)
+{
+  const _LICE_TexGenParms *parms = (const _LICE_TexGenParms *)ctx;
+  const int span = parms->span, w = parms->w;
+  const float sc = parms->sc, rv = parms->rv, gv = parms->gv, bv = parms->bv;
+  LICE_pixel *p = parms->startp + first*span;
+
+  for(int i=first;i<first+n;i++)
+  {
+    for(int j=0;j<w;j++)
+    {
+      float col = (float)fabs(p[j]*sc);
+      p[j] = LICE_RGBA((int)(col*rv),(int)(col*gv),(int)(col*bv),255);
+    }
+    p+=span;
+  }
+}
+
 void LICE_TexGen_Marble(LICE_IBitmap *dest, const RECT *rect, float rv, float gv, float bv, float intensity)
 {
   int span=dest->getRowSpan();
@@ -84,18 +117,9 @@ void LICE_TexGen_Marble(LICE_IBitmap *dest, const RECT *rect, float rv, float gv
 
   //normalize values and apply gamma
   {
-    LICE_pixel *p = startp;
-    float sc=255.0f/maxc;
-
-    for(int i=0;i<h;i++)
-    {
-      for(int j=0;j<w;j++)
-      {
-        float col = (float)fabs(p[j]*sc);
-        p[j] = LICE_RGBA((int)(col*rv),(int)(col*gv),(int)(col*bv),255);
-      }
-      p+=span;
-    }
+    _LICE_TexGenParms parms(startp,span,w,h,rv,gv,bv);
+    parms.sc=255.0f/maxc;
+    LICE_RunRowBands(h,w*h,MarbleRows,&parms);
   }
 }
 
@@ -214,6 +238,43 @@ float noise(float x, float y)
 }
 #endif
 
+static void NoiseRows(void *ctx, int first, int n)
+{
+  const _LICE_TexGenParms *parms = (const _LICE_TexGenParms *)ctx;
+  const int span = parms->span, w = parms->w, h = parms->h;
+  const float rv = parms->rv, gv = parms->gv, bv = parms->bv, intensity = parms->intensity;
+  const int mode = parms->mode, smooth = parms->smooth;
+
+  {
+    LICE_pixel *p = parms->startp + first*span;
+    for(int i=first;i<first+n;i++)
+    {
+      for(int j=0;j<w;j++)
+      {
+        float x = (float)j/w*16*intensity;
+        float y = (float)i/h*16*intensity;
+
+        float val = 0;
+        int size = smooth;
+        while(size>=1)
+        {
+          switch(mode)
+          {
+          case NOISE_MODE_NORMAL: val += noise(x/size, y/size)*size; break;
+          case NOISE_MODE_WOOD: val += (float)cos( x/size + noise(x/size,y/size) )*size/2; break;
+          }
+          size /= 2;
+        }
+        float col = (float)fabs(val/smooth)*255;
+        if(col>255) col=255;
+
+        p[j] = LICE_RGBA((int)(col*rv),(int)(col*gv),(int)(col*bv),255);
+      }
+      p+=span;
+    }
+  }
+}
+
 void LICE_TexGen_Noise(LICE_IBitmap *dest, const RECT *rect, float rv, float gv, float bv, float intensity, int mode, int smooth)
 {
   initNoise();
@@ -248,32 +309,11 @@ void LICE_TexGen_Noise(LICE_IBitmap *dest, const RECT *rect, float rv, float gv,
   else startp  += dx + dy*span;
 
   {
-    LICE_pixel *p = startp;
-    for(int i=0;i<h;i++)
-    {
-      for(int j=0;j<w;j++)
-      {
-        float x = (float)j/w*16*intensity;
-        float y = (float)i/h*16*intensity;
-
-        float val = 0;
-        int size = smooth;
-        while(size>=1)
-        {
-          switch(mode)
-          {
-          case NOISE_MODE_NORMAL: val += noise(x/size, y/size)*size; break;
-          case NOISE_MODE_WOOD: val += (float)cos( x/size + noise(x/size,y/size) )*size/2; break;
-          }
-          size /= 2;
-        }
-        float col = (float)fabs(val/smooth)*255;
-        if(col>255) col=255;
-
-        p[j] = LICE_RGBA((int)(col*rv),(int)(col*gv),(int)(col*bv),255);
-      }
-      p+=span;
-    }
+    _LICE_TexGenParms parms(startp,span,w,h,rv,gv,bv);
+    parms.intensity=intensity;
+    parms.mode=mode;
+    parms.smooth=smooth;
+    LICE_RunRowBands(h,w*h,NoiseRows,&parms);
   }
 }
 
@@ -290,6 +330,32 @@ static float turbulence(int x, int y, float size, float isize)
   return(128.0f * value * initialSize);
 }
 
+static void CircNoiseRows(void *ctx, int first, int n)
+{
+  const _LICE_TexGenParms *parms = (const _LICE_TexGenParms *)ctx;
+  const int span = parms->span, w = parms->w, h = parms->h;
+  const float rv = parms->rv, gv = parms->gv, bv = parms->bv;
+  const float xyPeriod = parms->xyPeriod, turbPower = parms->turbPower, turbSize = parms->turbSize, iturbSize = parms->iturbSize;
+
+  {
+    LICE_pixel *p = parms->startp + first*span;
+    for(int i=first;i<first+n;i++)
+    {
+      for(int j=0;j<w;j++)
+      {
+        float xValue = ((float)j - w / 2) / w;
+        float yValue = ((float)i - h / 2) / h;
+
+        float distValue = (float) (sqrt(xValue * xValue + yValue * yValue) + turbPower * turbulence(j, i, turbSize, iturbSize) / 256.0);
+        float col = (float)fabs(256.0 * sin(2 * xyPeriod * distValue * 3.14159));
+
+        p[j] = LICE_RGBA((int)(col*rv),(int)(col*bv),(int)(col*gv),255);
+      }
+      p+=span;
+   }
+  }
+}
+
 void LICE_TexGen_CircNoise(LICE_IBitmap *dest, const RECT *rect, float rv, float gv, float bv, float nrings, float power, int size)
 {
   initNoise();
@@ -323,26 +389,10 @@ void LICE_TexGen_CircNoise(LICE_IBitmap *dest, const RECT *rect, float rv, float
   }
   else startp  += x + y*span;
 
-  float xyPeriod = nrings;
-  float turbPower = power;
-  const float iturbSize = 1.0f/(float)size;
-  const float turbSize = (float)size;
-   
-  {
-    LICE_pixel *p = startp;
-    for(int i=0;i<h;i++)
-    {
-      for(int j=0;j<w;j++)
-      {
-        float xValue = ((float)j - w / 2) / w;
-        float yValue = ((float)i - h / 2) / h;
-
-        float distValue = (float) (sqrt(xValue * xValue + yValue * yValue) + turbPower * turbulence(j, i, turbSize, iturbSize) / 256.0);
-        float col = (float)fabs(256.0 * sin(2 * xyPeriod * distValue * 3.14159));
-
-        p[j] = LICE_RGBA((int)(col*rv),(int)(col*bv),(int)(col*gv),255);
-      }
-      p+=span;
-   }
-  }
+  _LICE_TexGenParms parms(startp,span,w,h,rv,gv,bv);
+  parms.xyPeriod = nrings;
+  parms.turbPower = power;
+  parms.iturbSize = 1.0f/(float)size;
+  parms.turbSize = (float)size;
+  LICE_RunRowBands(h,w*h,CircNoiseRows,&parms);
 }
@@ -1280,90 +1280,118 @@ static unsigned char LICE_deffont[127*LICE_FONT_HEIGHT] = {
 };
 
 
-void LICE_DrawChar(LICE_IBitmap *bm, int x, int y, char c, 
-                   LICE_pixel color, float alpha, int mode)
+// draws runs of characters from LICE_deffont, the combine mode is resolved once per call rather than per pixel
+template<class COMBFUNC> class _LICE_DefFontRenderer
 {
-  LICE_pixel *fb;
-  if (c<1 || !bm || !(fb=bm->getBits()))return;
-  unsigned char *font = LICE_deffont + ((c-1)*LICE_FONT_HEIGHT);
-  int len = LICE_FONT_HEIGHT;
-  int smask=128;
-  int xlen=8;
-
-  if (y < 0) 
+public:
+  static void DrawChar(LICE_pixel *fb, int rs, int bm_w, int bm_h, int x, int y, unsigned char c,
+                       int red, int green, int blue, int alp, int ialpha)
   {
-    font -= y;
-    len += y;
-    y = 0;
-  }
-  if (x<0)
-  {
-    smask >>= -x;
-    xlen+=x;
-    x=0;
-  }
+    const unsigned char *font = LICE_deffont + ((c-1)*LICE_FONT_HEIGHT);
+    int len = LICE_FONT_HEIGHT;
+    int smask=128;
+    int xlen=8;
 
-  const int bm_w = bm->getWidth(), bm_h = bm->getHeight();
-  if (xlen < 1 || len < 1 || x >= bm_w || y >= bm_h) return;
+    if (y < 0) 
+    {
+      font -= y;
+      len += y;
+      y = 0;
+    }
+    if (x<0)
+    {
+      smask >>= -x;
+      xlen+=x;
+      x=0;
+    }
+
+    if (xlen < 1 || len < 1 || x >= bm_w || y >= bm_h) return;
   
-  if (xlen > bm_w - x) xlen = bm_w - x;
-  if (len > bm_h - y)  len = bm_h - y;
+    if (xlen > bm_w - x) xlen = bm_w - x;
+    if (len > bm_h - y)  len = bm_h - y;
 
-  int rs=bm->getRowSpan();
-  if (bm->isFlipped())
-  {
-    fb += x+((bm->getHeight()-1-y)*rs);
-    rs=-rs;
-  }
-  else
     fb += x+(y*rs);
 
-  int red=LICE_GETR(color), green=LICE_GETG(color), blue=LICE_GETB(color), alp=LICE_GETA(color), ialpha=(int) (alpha * 256.0f);
+    while (len-->0)
+    {
+      LICE_pixel *outmem = fb;
+      fb+=rs;
+      const unsigned char ch = *font++;
+      int a=smask;
+      int xleft = xlen;
+      while (a && xleft--)
+      {
+        if (ch & a) COMBFUNC::doPix((LICE_pixel_chan *)outmem, red,green,blue,alp,ialpha);
+        outmem++;
+        a >>= 1;
+      }
+    }
+  }
 
-  while (len-->0)
+  static void DrawString(LICE_pixel *fb, int rs, int w, int h, int x, int y, const char *string,
+                         int red, int green, int blue, int alp, int ialpha)
   {
-    LICE_pixel *outmem = fb;
-    fb+=rs;
-    unsigned char ch = *font++;
-    int a=smask;
-    int xleft = xlen;
-    while (a && xleft--)
+    int xx = x;
+    while (*string) 
     {
-      if (ch & a) 
+      switch (*string) 
       {
-        #define __LICE__ACTION(comb) comb::doPix((LICE_pixel_chan *)outmem, red,green,blue,alp,ialpha)
-          __LICE_ACTION_NOSRCALPHA(mode,ialpha, false);
-        #undef __LICE__ACTION
+        case '\n': y += LICE_FONT_HEIGHT; xx = x; break;
+        case ' ': xx += 8; break;
+        case '\r': break;
+        case '\t': xx += 8*5; break;
+        default:
+          if (xx>=-8 && xx<w && y >= -LICE_FONT_HEIGHT && y < h && *string>0)
+            DrawChar(fb,rs,w,h,xx,y,(unsigned char)*string,red,green,blue,alp,ialpha);
+          xx += 8;
+        break;
       }
-      outmem++;
-      a >>= 1;
+      string++;
     }
   }
+};
+
+static LICE_pixel *_LICE_DefFontGetBits(LICE_IBitmap *bm, int *rs)
+{
+  LICE_pixel *fb = bm->getBits();
+  *rs = bm->getRowSpan();
+  if (fb && bm->isFlipped())
+  {
+    fb += (bm->getHeight()-1)*(*rs);
+    *rs = -*rs;
+  }
+  return fb;
+}
+
+void LICE_DrawChar(LICE_IBitmap *bm, int x, int y, char c, 
+                   LICE_pixel color, float alpha, int mode)
+{
+  LICE_pixel *fb;
+  int rs;
+  if (c<1 || !bm || !(fb=_LICE_DefFontGetBits(bm,&rs)))return;
+
+  const int bm_w = bm->getWidth(), bm_h = bm->getHeight();
+  int red=LICE_GETR(color), green=LICE_GETG(color), blue=LICE_GETB(color), alp=LICE_GETA(color), ialpha=(int) (alpha * 256.0f);
+
+  #define __LICE__ACTION(comb) _LICE_DefFontRenderer<comb>::DrawChar(fb,rs,bm_w,bm_h,x,y,(unsigned char)c,red,green,blue,alp,ialpha)
+    __LICE_ACTION_NOSRCALPHA(mode,ialpha, false);
+  #undef __LICE__ACTION
 }
 
 void LICE_DrawText(LICE_IBitmap *bm, int x, int y, const char *string, 
                    LICE_pixel color, float alpha, int mode)
 {
-  if (!bm) return;
-  int w=bm->getWidth();
-  int h=bm->getHeight();
-  int xx = x;
-  while (*string) 
-  {
-    switch (*string) 
-    {
-      case '\n': y += LICE_FONT_HEIGHT; xx = x; break;
-      case ' ': xx += 8; break;
-      case '\r': break;
-      case '\t': xx += 8*5; break;
-      default:
-        if (xx>=-8 && xx<w && y >= -LICE_FONT_HEIGHT && y < h)
-          LICE_DrawChar(bm,xx,y,*string, color,alpha,mode);
-        xx += 8;
-      break;
-    }
-    string++;
-  }
+  LICE_pixel *fb;
+  int rs;
+  if (!bm || !(fb=_LICE_DefFontGetBits(bm,&rs))) return;
+
+  const int w=bm->getWidth();
+  const int h=bm->getHeight();
+  int red=LICE_GETR(color), green=LICE_GETG(color), blue=LICE_GETB(color), alp=LICE_GETA(color), ialpha=(int) (alpha * 256.0f);
+
+  #define __LICE__ACTION(comb) _LICE_DefFontRenderer<comb>::DrawString(fb,rs,w,h,x,y,string,red,green,blue,alp,ialpha)
+    __LICE_ACTION_NOSRCALPHA(mode,ialpha, false);
+  #undef __LICE__ACTION
 }
 
 void LICE_MeasureText(const char *string, int *w, int *h)
@@ -86,6 +86,17 @@ class LICE_CachedFont : public LICE_IFont
 
     bool RenderGlyph(unsigned short idx);
 
+    struct glyphRunEnt
+    {
+      int base_offset; // same as charEnt
+      int width, height;
+      int xpos, ypos; // top left of glyph bitmap in bm
+    };
+    void DrawGlyphRun(LICE_IBitmap *bm, const glyphRunEnt *run, int nglyphs, const RECT *clipR); // glyphs are clipped to clipR, but must intersect it
+
+    bool GetCachedLayout(const char *str, int strcnt, UINT dtflags, int lsadj, RECT *sz, int *ret);
+    void SetCachedLayout(const char *str, int strcnt, UINT dtflags, int lsadj, const RECT *sz, int ret);
+
     LICE_pixel m_fg,m_bg,m_effectcol;
     int m_bgmode;
     int m_comb;
@@ -103,9 +114,10 @@ class LICE_CachedFont : public LICE_IFont
     };
     charEnt *findChar(unsigned short c);
 
-    charEnt m_lowchars[128]; // first 128 chars cached here
-    WDL_TypedBuf<charEnt> m_extracharlist;
-    WDL_TypedBuf<unsigned char> m_cachestore;
+    // glyphs and measured string extents, shared by all LICE_CachedFonts using the same HFONT/effect flags (see lice_textnew.cpp)
+    struct glyphCache;
+    glyphCache *m_cache;
+    void ReleaseCache();
     
     static int _charSortFunc(const void *a, const void *b);
 
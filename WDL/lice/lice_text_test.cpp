@@ -0,0 +1,218 @@
+/*
+  lice_text_test.cpp
+  checks LICE_CachedFont's shared glyph caches and layout cache: fonts that share a glyph cache must draw
+  and measure exactly like a font with its own (made from a second, identical HFONT), cached string extents
+  must match a fresh measurement, and aligned text must land where its measured extent says.
+
+  needs SWELL with FreeType and a font, default "DejaVu Sans". on Linux, with the headless SWELL:
+  S="swell swell-ini swell-miscdlg-generic swell-wnd-generic swell-menu-generic swell-kb-generic swell-dlg-generic
+     swell-gdi-generic swell-misc-generic swell-gdi-lice swell-generic-headless swell-appstub-generic swell-modstub-generic"
+  g++ -O2 -include cmath -DSWELL_LICE_GDI -DSWELL_FREETYPE -I/usr/include/freetype2 -o lice_text_test lice_text_test.cpp \
+    lice.cpp lice_arc.cpp lice_line.cpp lice_text.cpp lice_textnew.cpp lice_bmp.cpp lice_ico.cpp lice_colorspace.cpp \
+    $(for f in $S; do echo ../swell/$f.cpp; done) -lfreetype -ldl -lpthread
+  ./lice_text_test ["font name"]
+*/
+
+#include "../swell/swell.h"
+#include "lice.h"
+#include "lice_text.h"
+#include <stdio.h>
+#include <string.h>
+
+static int g_fails;
+
+static void check(bool ok, const char *what, const char *str)
+{
+  if (ok) return;
+  printf("FAIL %s: \"%.40s\"\n",what,str);
+  g_fails++;
+}
+
+static bool same_pixels(LICE_IBitmap *a, LICE_IBitmap *b)
+{
+  for (int y = 0; y < a->getHeight(); y ++)
+    if (memcmp(a->getBits()+y*a->getRowSpan(),b->getBits()+y*b->getRowSpan(),a->getWidth()*sizeof(LICE_pixel))) return false;
+  return true;
+}
+
+static const char *g_strs[]={
+  "Master", "Metronome", "bob@10.0.0.1 : bass", "-12.3 dB", "x", "",
+  "a\xc3\xa9z\xe2\x82\xac", "\xe4\xb8\xad\xe6\x96\x87 text", "line1\nline2\r\nline3",
+  "<carol> h\xc3\xa9llo \xe2\x82\xac everyone \xe2\x80\x94 ready when you are",
+  // longer than the layout cache keeps
+  "0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789 long",
+};
+#define NUM_STRS (int)(sizeof(g_strs)/sizeof(g_strs[0]))
+
+static void calcrect(LICE_CachedFont *f, const char *str, int strcnt, UINT flags, RECT *r, int *ret)
+{
+  r->left=5;
+  r->top=7;
+  r->right=r->bottom=0;
+  *ret=f->DrawText(NULL,str,strcnt,r,DT_CALCRECT|flags);
+}
+
+// fonts sharing a glyph cache, measuring and drawing in every order, against a font with its own cache
+static void test_shared(HFONT hf, HFONT hf_ref, int flags)
+{
+  static const int modes[]={ LICE_BLIT_MODE_COPY, LICE_BLIT_MODE_ADD, LICE_BLIT_MODE_MUL, LICE_BLIT_MODE_OVERLAY };
+  static const UINT dts[]={ 0, DT_CENTER|DT_VCENTER|DT_SINGLELINE, DT_RIGHT|DT_BOTTOM, DT_NOCLIP|DT_CENTER };
+
+  LICE_CachedFont *ref=new LICE_CachedFont, *a=new LICE_CachedFont, *b=new LICE_CachedFont;
+  ref->SetFromHFont(hf_ref,flags);
+  a->SetFromHFont(hf,flags);
+  b->SetFromHFont(hf,flags);
+
+  LICE_MemBitmap bm1(300,200), bm2(300,200);
+  for (int pass = 0; pass < 3; pass ++)
+  {
+    if (pass == 2)
+    {
+      // the remaining font keeps the cache alive, and a new font picks it up
+      delete a;
+      a=new LICE_CachedFont;
+      a->SetFromHFont(hf,flags);
+    }
+    for (int m = 0; m < 4; m ++) for (int d = 0; d < 4; d ++) for (int si = 0; si < NUM_STRS; si ++)
+    {
+      LICE_CachedFont *f = (si+pass)&1 ? a : b;
+      LICE_CachedFont *fl[2]={ ref, f };
+      LICE_MemBitmap *bl[2]={ &bm1, &bm2 };
+      int rets[2];
+      RECT crs[2];
+      for (int k = 0; k < 2; k ++)
+      {
+        LICE_Clear(bl[k],LICE_RGBA(40+m*20,90,130-d*10,200));
+        fl[k]->SetTextColor(LICE_RGBA(250,220,50,255));
+        fl[k]->SetBkMode((m+d)&1 ? OPAQUE : TRANSPARENT);
+        fl[k]->SetBkColor(LICE_RGBA(0,0,100,255));
+        fl[k]->SetCombineMode(modes[m],pass ? 0.6f : 1.0f);
+        RECT r={-4+si*3,-3+d*5,280-si,190-m*7};
+        rets[k]=fl[k]->DrawText(bl[k],g_strs[si],-1,&r,dts[d]);
+        int cret;
+        calcrect(fl[k],g_strs[si],si==6 ? 3 : -1,dts[d]&DT_SINGLELINE,&crs[k],&cret);
+        rets[k]+=cret*7;
+      }
+      check(same_pixels(&bm1,&bm2),"shared cache draws differently",g_strs[si]);
+      check(rets[0]==rets[1] && !memcmp(&crs[0],&crs[1],sizeof(RECT)),"shared cache measures differently",g_strs[si]);
+    }
+  }
+  delete a;
+  delete b;
+  delete ref;
+}
+
+// cached extents against a cold font, with strcnt, reused buffers, and more strings than the cache holds
+static void test_layout_cache(HFONT hf, const char *face, int flags)
+{
+  LICE_CachedFont f;
+  f.SetFromHFont(hf,flags);
+
+  RECT first[NUM_STRS][2];
+  int firstret[NUM_STRS][2];
+  for (int pass = 0; pass < 2; pass ++)
+  {
+    for (int si = 0; si < NUM_STRS; si ++) for (int sl = 0; sl < 2; sl ++)
+    {
+      RECT r;
+      int ret;
+      calcrect(&f,g_strs[si],-1,sl ? DT_SINGLELINE : 0,&r,&ret);
+      if (!pass) { first[si][sl]=r; firstret[si][sl]=ret; }
+      else check(!memcmp(&r,&first[si][sl],sizeof(RECT)) && ret==firstret[si][sl],"cached extent changed",g_strs[si]);
+    }
+
+    // fill the cache with other strings
+    char buf[64];
+    for (int i = 0; i < 300; i ++)
+    {
+      snprintf(buf,sizeof(buf),"label %d",i*7919);
+      RECT r;
+      int ret;
+      calcrect(&f,buf,-1,0,&r,&ret);
+    }
+  }
+
+  for (int si = 0; si < NUM_STRS; si ++)
+  {
+    const int len=(int)strlen(g_strs[si]);
+    for (int cnt = 0; cnt <= len && cnt < 12; cnt ++)
+    {
+      // the same text by length and as its own string, in a buffer that held something else before.
+      // these differ when cnt splits a UTF-8 sequence, so each is compared with a font that has never measured anything
+      char buf[16];
+      strcpy(buf,"WWWWWWWWWWWWWWW");
+      RECT r1, r2, c1, c2;
+      int ret1, ret2, cret1, cret2;
+      calcrect(&f,buf,-1,0,&r1,&ret1);
+      memcpy(buf,g_strs[si],cnt);
+      buf[cnt]=0;
+      calcrect(&f,g_strs[si],cnt,0,&r1,&ret1);
+      calcrect(&f,buf,-1,0,&r2,&ret2);
+
+      LICE_CachedFont cold;
+      cold.SetFromHFont(CreateFont(14,0,0,0,FW_NORMAL,0,0,0,0,0,0,0,0,face),flags|LICE_FONT_FLAG_OWNS_HFONT);
+      calcrect(&cold,g_strs[si],cnt,0,&c1,&cret1);
+      calcrect(&cold,buf,-1,0,&c2,&cret2);
+      check(!memcmp(&r1,&c1,sizeof(RECT)) && ret1==cret1,"extent by length differs from a cold font",g_strs[si]);
+      check(!memcmp(&r2,&c2,sizeof(RECT)) && ret2==cret2,"extent of reused buffer differs from a cold font",g_strs[si]);
+    }
+  }
+}
+
+// DT_RIGHT/DT_BOTTOM/DT_CENTER place the text where its (cached) measured extent says
+static void test_align(HFONT hf, int flags)
+{
+  LICE_CachedFont f;
+  f.SetFromHFont(hf,flags);
+  f.SetTextColor(LICE_RGBA(255,255,255,255));
+  f.SetBkMode(TRANSPARENT);
+  f.SetCombineMode(LICE_BLIT_MODE_COPY,1.0f);
+
+  LICE_MemBitmap bm1(400,100), bm2(400,100);
+  for (int si = 0; si < NUM_STRS; si ++) for (int rep = 0; rep < 2; rep ++)
+  {
+    RECT tr;
+    int ret;
+    calcrect(&f,g_strs[si],-1,DT_SINGLELINE,&tr,&ret);
+    const int w=tr.right-tr.left, h=tr.bottom-tr.top;
+
+    LICE_Clear(&bm1,0);
+    LICE_Clear(&bm2,0);
+    RECT r={10,5,390,95};
+    f.DrawText(&bm1,g_strs[si],-1,&r,DT_SINGLELINE|DT_NOCLIP|(rep ? DT_CENTER|DT_VCENTER : DT_RIGHT|DT_BOTTOM));
+    RECT r2;
+    r2.left = rep ? r.left+(r.right-r.left-w)/2 : r.right-w;
+    r2.top = rep ? r.top+(r.bottom-r.top-h)/2 : r.bottom-h;
+    r2.right=r2.left+w;
+    r2.bottom=r2.top+h;
+    f.DrawText(&bm2,g_strs[si],-1,&r2,DT_SINGLELINE|DT_NOCLIP);
+    check(same_pixels(&bm1,&bm2),rep ? "centered text misplaced" : "right/bottom aligned text misplaced",g_strs[si]);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *face = argc>1 ? argv[1] : "DejaVu Sans";
+  HFONT hf=CreateFont(14,0,0,0,FW_NORMAL,0,0,0,0,0,0,0,0,face);
+  HFONT hf_ref=CreateFont(14,0,0,0,FW_NORMAL,0,0,0,0,0,0,0,0,face);
+  if (!hf || !hf_ref) { printf("could not create font \"%s\"\n",face); return 1; }
+
+  static const int flagsets[]={
+    0, LICE_FONT_FLAG_FX_BLUR, LICE_FONT_FLAG_FX_INVERT, LICE_FONT_FLAG_FX_OUTLINE,
+    LICE_FONT_FLAG_VERTICAL, LICE_FONT_FLAG_FX_MONO|LICE_FONT_FLAG_VERTICAL|LICE_FONT_FLAG_VERTICAL_BOTTOMUP,
+    LICE_FONT_FLAG_FORCE_NATIVE,
+  };
+  for (int i = 0; i < (int)(sizeof(flagsets)/sizeof(flagsets[0])); i ++)
+  {
+    const int fails=g_fails;
+    test_shared(hf,hf_ref,flagsets[i]);
+    test_layout_cache(hf,face,flagsets[i]);
+    if (!(flagsets[i]&(LICE_FONT_FLAG_VERTICAL|LICE_FONT_FLAG_FORCE_NATIVE))) test_align(hf,flagsets[i]);
+    printf("%s flags %d\n",g_fails==fails ? "ok  " : "FAIL",flagsets[i]);
+  }
+  DeleteObject(hf);
+  DeleteObject(hf_ref);
+
+  printf("%s (%d failures)\n",g_fails?"FAIL":"OK",g_fails);
+  return g_fails ? 1 : 0;
+}
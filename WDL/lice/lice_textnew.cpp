@@ -8,7 +8,9 @@
 
 
 #include "lice_combine.h"
+#include "lice_combine_span.h"
 #include "lice_extended.h"
+#include "../ptrlist.h"
 
 #if defined(_WIN32) && defined(WDL_SUPPORT_WIN9X)
 static char __1ifNT2if98=0; // 2 for iswin98
@@ -23,6 +25,16 @@ static char __1ifNT2if98=0; // 2 for iswin98
 #define ABSOLUTELY_NO_GLYPHS_HIGHER_THAN 1024 
 #endif
 
+// measured extents of recently drawn strings are kept per glyph cache, so that labels drawn with DT_CENTER etc (and
+// native-rendered text, which SWELL would otherwise re-measure) don't need to be measured on every redraw
+#ifndef LICE_TEXT_LAYOUTCACHE_SIZE
+#define LICE_TEXT_LAYOUTCACHE_SIZE 64 // must be a power of two
+#endif
+#define LICE_TEXT_LAYOUTCACHE_WAYS 4 // entries a string may go in
+#define LICE_TEXT_LAYOUTCACHE_MAXLEN 96 // longer strings are not cached
+
+#define LICE_TEXT_GLYPHRUN_SIZE 64
+
 
 static int utf8makechar(char *ptrout, unsigned short charIn)
 {
@@ -84,6 +96,100 @@ static LICE_SysBitmap *s_nativerender_tempbitmap;
 static int s_tempbitmap_refcnt;
 
 
+struct LICE_CachedFont::glyphCache
+{
+  glyphCache() : cachestore(65536)
+  {
+    refcnt=1;
+    font=0;
+    flags=0;
+    memset(tm_sig,0,sizeof(tm_sig));
+    memset(lowchars,0,sizeof(lowchars));
+    memset(layouts,0,sizeof(layouts));
+    layout_cnt=0;
+  }
+
+  // returns a cache shared with other fonts using the same HFONT/effects, or a new private cache if font is NULL
+  static glyphCache *Get(HFONT font, int flags, const int *sig)
+  {
+    flags = LICE_FONT_FLAGS_HAS_FX(flags);
+    if (font) for (int x = 0; x < s_list.GetSize(); x ++)
+    {
+      glyphCache *c = s_list.Get(x);
+      if (c->font == font && c->flags == flags && !memcmp(c->tm_sig,sig,sizeof(c->tm_sig)))
+      {
+        c->refcnt++;
+        return c;
+      }
+    }
+    glyphCache *c = new glyphCache;
+    if (font)
+    {
+      c->font = font;
+      c->flags = flags;
+      memcpy(c->tm_sig,sig,sizeof(c->tm_sig));
+      s_list.Add(c);
+    }
+    return c;
+  }
+
+  void Release()
+  {
+    if (--refcnt) return;
+    if (font) s_list.DeletePtr(this);
+    delete this;
+  }
+
+  int refcnt;
+  HFONT font; // NULL if not shared
+  int flags; // effect flags, these change the rendered glyphs
+  int tm_sig[5]; // text metrics at the time of creation, in case an HFONT gets reused
+
+  charEnt lowchars[128]; // first 128 chars cached here
+  WDL_TypedBuf<charEnt> extracharlist;
+  WDL_TypedBuf<unsigned char> cachestore;
+
+  struct layoutEnt
+  {
+    unsigned int hash;
+    int len; // 0=unused
+    UINT dtflags;
+    int lsadj;
+    RECT sz;
+    int ret;
+    unsigned int lastuse;
+    char str[LICE_TEXT_LAYOUTCACHE_MAXLEN];
+  };
+  layoutEnt layouts[LICE_TEXT_LAYOUTCACHE_SIZE];
+  unsigned int layout_cnt;
+
+  static WDL_PtrList<glyphCache> s_list;
+};
+
+WDL_PtrList<LICE_CachedFont::glyphCache> LICE_CachedFont::glyphCache::s_list;
+
+// one glyph of a run, with clipping applied
+struct LICE_GlyphBlit
+{
+  const unsigned char *gsrc;
+  LICE_pixel *pout;
+  int src_span, width, height;
+  int xpos, ypos;
+};
+
+struct LICE_GlyphRunParms
+{
+  LICE_IBitmap *fill_bm; // set if OPAQUE, the background of each glyph is filled before drawing it
+  LICE_pixel fill_col;
+  float fill_alpha;
+  int fill_mode;
+
+  int dest_span;
+  int red, green, blue, alpha;
+  int r2, g2, b2; // FX_SHADOW/FX_OUTLINE color
+};
+
+
 int LICE_CachedFont::_charSortFunc(const void *a, const void *b)
 {
   charEnt *aa = (charEnt *)a;
@@ -91,7 +197,7 @@ int LICE_CachedFont::_charSortFunc(const void *a, const void *b)
   return aa->charid - bb->charid;
 }
 
-LICE_CachedFont::LICE_CachedFont() : m_cachestore(65536)
+LICE_CachedFont::LICE_CachedFont()
 {
   s_tempbitmap_refcnt++;
   m_fg=0;
@@ -103,11 +209,12 @@ LICE_CachedFont::LICE_CachedFont() : m_cachestore(65536)
   m_line_height=0;
   m_lsadj=0;
   m_font=0;
-  memset(m_lowchars,0,sizeof(m_lowchars));
+  m_cache=new glyphCache;
 }
 
 LICE_CachedFont::~LICE_CachedFont()
 {
+  ReleaseCache();
   if ((m_flags&LICE_FONT_FLAG_OWNS_HFONT) && m_font) {
     DeleteObject(m_font);
   }
@@ -120,8 +227,16 @@ LICE_CachedFont::~LICE_CachedFont()
   }
 }
 
+void LICE_CachedFont::ReleaseCache()
+{
+  if (m_cache) m_cache->Release();
+  m_cache=NULL;
+}
+
 void LICE_CachedFont::SetFromHFont(HFONT font, int flags)
 {
+  ReleaseCache(); // before the old font is deleted, so its glyphs can't be matched by a new font reusing the handle
+
   if ((m_flags&LICE_FONT_FLAG_OWNS_HFONT) && m_font && m_font != font)
   {
     DeleteObject(m_font);
@@ -129,6 +244,7 @@ void LICE_CachedFont::SetFromHFont(HFONT font, int flags)
 
   m_flags=flags;
   m_font=font;
+  int tm_sig[5]={0,};
   if (font)
   {
     if (!s_tempbitmap) s_tempbitmap=new LICE_SysBitmap;
@@ -148,11 +264,16 @@ void LICE_CachedFont::SetFromHFont(HFONT font, int flags)
     if (oldFont) SelectObject(s_tempbitmap->getDC(),oldFont);
 
     m_line_height = tm.tmHeight;
+    tm_sig[0] = tm.tmHeight;
+    tm_sig[1] = tm.tmAscent;
+    tm_sig[2] = tm.tmDescent;
+    tm_sig[3] = tm.tmInternalLeading;
+    tm_sig[4] = tm.tmAveCharWidth;
   }
 
-  memset(m_lowchars,0,sizeof(m_lowchars));
-  m_extracharlist.Resize(0,false);
-  m_cachestore.Resize(0);
+  // PRECALCALL fonts may have their HFONT deleted after this, so they get a cache of their own
+  m_cache = glyphCache::Get((flags&LICE_FONT_FLAG_PRECALCALL) ? NULL : font, flags, tm_sig);
+
   if (flags&LICE_FONT_FLAG_PRECALCALL)
   {
     int x;
@@ -179,15 +300,15 @@ bool LICE_CachedFont::RenderGlyph(unsigned short idx) // return TRUE if ok
     {
       if (m_flags & LICE_FONT_FLAG_PRECALCALL) return false;
 
-      int oldsz=m_extracharlist.GetSize();
-      ent = m_extracharlist.Resize(oldsz+1) + oldsz;
+      int oldsz=m_cache->extracharlist.GetSize();
+      ent = m_cache->extracharlist.Resize(oldsz+1) + oldsz;
       memset(ent,0,sizeof(*ent));
       ent->charid = idx;
 
       needSort=true;
     }
   }
-  else ent = m_lowchars+idx;
+  else ent = m_cache->lowchars+idx;
 
   const int bmsz=lice_max(m_line_height,1) * 2 + 8;
 
@@ -265,10 +386,10 @@ bool LICE_CachedFont::RenderGlyph(unsigned short idx) // return TRUE if ok
     LICE_pixel *srcbuf = s_tempbitmap->getBits();
     int span=s_tempbitmap->getRowSpan();
 
-    ent->base_offset=m_cachestore.GetSize()+1;
+    ent->base_offset=m_cache->cachestore.GetSize()+1;
     int newsz = ent->base_offset-1+r.right*r.bottom;
-    unsigned char *destbuf = m_cachestore.Resize(newsz) + ent->base_offset-1;
-    if (m_cachestore.GetSize() != newsz)
+    unsigned char *destbuf = m_cache->cachestore.Resize(newsz) + ent->base_offset-1;
+    if (m_cache->cachestore.GetSize() != newsz)
     {
       ent->base_offset=-1;
       ent->advance=ent->width=ent->height=0;
@@ -335,7 +456,7 @@ bool LICE_CachedFont::RenderGlyph(unsigned short idx) // return TRUE if ok
         }
         r.right = neww;
         newsz = ent->base_offset-1+r.right*r.bottom;
-        destbuf = m_cachestore.Resize(newsz,false) + ent->base_offset-1;
+        destbuf = m_cache->cachestore.Resize(newsz,false) + ent->base_offset-1;
       }
 
       if (flags&LICE_FONT_FLAG_VERTICAL)
@@ -439,7 +560,7 @@ bool LICE_CachedFont::RenderGlyph(unsigned short idx) // return TRUE if ok
       ent->height = r.bottom;
     }
   }
-  if (needSort&&m_extracharlist.GetSize()>1) qsort(m_extracharlist.Get(),m_extracharlist.GetSize(),sizeof(charEnt),_charSortFunc);
+  if (needSort&&m_cache->extracharlist.GetSize()>1) qsort(m_cache->extracharlist.Get(),m_cache->extracharlist.GetSize(),sizeof(charEnt),_charSortFunc);
 
   return true;
 }
@@ -521,15 +642,41 @@ public:
       pout += dest_span;
     }
   }
+
+  // runs of glyphs, so the combine mode is dispatched once per run rather than once per glyph
+  static void NormalRun(const LICE_GlyphBlit *g, int n, const LICE_GlyphRunParms *p)
+  {
+    for (; n > 0; n--, g++)
+    {
+      if (p->fill_bm) LICE_FillRect(p->fill_bm,g->xpos,g->ypos,g->width,g->height,p->fill_col,p->fill_alpha,p->fill_mode);
+      Normal((unsigned char *)g->gsrc,g->pout,g->src_span,p->dest_span,g->width,g->height,p->red,p->green,p->blue,p->alpha);
+    }
+  }
+  static void MonoRun(const LICE_GlyphBlit *g, int n, const LICE_GlyphRunParms *p)
+  {
+    for (; n > 0; n--, g++)
+    {
+      if (p->fill_bm) LICE_FillRect(p->fill_bm,g->xpos,g->ypos,g->width,g->height,p->fill_col,p->fill_alpha,p->fill_mode);
+      Mono((unsigned char *)g->gsrc,g->pout,g->src_span,p->dest_span,g->width,g->height,p->red,p->green,p->blue,p->alpha);
+    }
+  }
+  static void EffectRun(const LICE_GlyphBlit *g, int n, const LICE_GlyphRunParms *p)
+  {
+    for (; n > 0; n--, g++)
+    {
+      if (p->fill_bm) LICE_FillRect(p->fill_bm,g->xpos,g->ypos,g->width,g->height,p->fill_col,p->fill_alpha,p->fill_mode);
+      Effect((unsigned char *)g->gsrc,g->pout,g->src_span,p->dest_span,g->width,g->height,p->red,p->green,p->blue,p->alpha,p->r2,p->g2,p->b2);
+    }
+  }
 };
 
 LICE_CachedFont::charEnt *LICE_CachedFont::findChar(unsigned short c)
 {
-  if (c<128) return m_lowchars+c;
-  if (!m_extracharlist.GetSize()) return 0;
+  if (c<128) return m_cache->lowchars+c;
+  if (!m_cache->extracharlist.GetSize()) return 0;
   charEnt a={0,};
   a.charid=c;
-  return (charEnt *)bsearch(&a,m_extracharlist.Get(),m_extracharlist.GetSize(),sizeof(charEnt),_charSortFunc);
+  return (charEnt *)bsearch(&a,m_cache->extracharlist.Get(),m_cache->extracharlist.GetSize(),sizeof(charEnt),_charSortFunc);
 }
 
 bool LICE_CachedFont::DrawGlyph(LICE_IBitmap *bm, unsigned short c, 
@@ -537,7 +684,7 @@ bool LICE_CachedFont::DrawGlyph(LICE_IBitmap *bm, unsigned short c,
 {
   charEnt *ch = findChar(c);
 
-  if (!ch) return false;
+  if (!ch || ch->base_offset < 1) return false;
 
   if (m_flags&LICE_FONT_FLAG_VERTICAL) 
   {
@@ -556,122 +703,255 @@ bool LICE_CachedFont::DrawGlyph(LICE_IBitmap *bm, unsigned short c,
       xpos+ch->width <= clipR->left || 
       ypos+ch->height <= clipR->top) return false;
 
-  unsigned char *gsrc = m_cachestore.Get() + ch->base_offset-1;
-  int src_span = ch->width;
-  int width = ch->width;
-  int height = ch->height;
+  glyphRunEnt g = { ch->base_offset, ch->width, ch->height, xpos, ypos };
+  DrawGlyphRun(bm,&g,1,clipR);
+
+  return true; // drew glyph at all (for updating max extents)
+}
+
+void LICE_CachedFont::DrawGlyphRun(LICE_IBitmap *bm, const glyphRunEnt *run, int nglyphs, const RECT *clipR)
+{
+  if (nglyphs < 1) return;
 
 #ifndef DISABLE_LICE_EXTENSIONS
   if (bm->Extended(LICE_EXT_SUPPORTS_ID, (void*) LICE_EXT_DRAWGLYPH_ACCEL))
   {
-    LICE_Ext_DrawGlyph_acceldata data(xpos, ypos, m_fg, gsrc, width, height, m_alpha, m_comb);
-    if (bm->Extended(LICE_EXT_DRAWGLYPH_ACCEL, &data)) return true;
+    if (nglyphs > 1)
+    {
+      for (int x = 0; x < nglyphs; x ++) DrawGlyphRun(bm,run+x,1,clipR);
+      return;
+    }
+    LICE_Ext_DrawGlyph_acceldata data(run->xpos, run->ypos, m_fg, m_cache->cachestore.Get() + run->base_offset-1, run->width, run->height, m_alpha, m_comb);
+    if (bm->Extended(LICE_EXT_DRAWGLYPH_ACCEL, &data)) return;
   }
 #endif
 
-  if (xpos < clipR->left) 
-  { 
-    width += (xpos-clipR->left); 
-    gsrc += clipR->left-xpos; 
-    xpos=clipR->left; 
-  }
-  if (ypos < clipR->top) 
-  { 
-    gsrc += src_span*(clipR->top-ypos);
-    height += (ypos-clipR->top); 
-    ypos=clipR->top; 
-  }
-  int dest_span = bm->getRowSpan();
-  LICE_pixel *pout = bm->getBits();
+  LICE_pixel *bits = bm->getBits();
+  if (!bits) return;
 
+  LICE_GlyphRunParms p;
+  p.dest_span = bm->getRowSpan();
   if (bm->isFlipped())
   {
-    pout += (bm->getHeight()-1)*dest_span;
-    dest_span=-dest_span;
+    bits += (bm->getHeight()-1)*p.dest_span;
+    p.dest_span=-p.dest_span;
   }
-  
-  pout += xpos + ypos * dest_span;
 
-  if (width >= clipR->right-xpos) width = clipR->right-xpos;
-  if (height >= clipR->bottom-ypos) height = clipR->bottom-ypos;
+  const int mode=m_comb&~LICE_BLIT_USE_ALPHA;
+  const float alpha=m_alpha;
 
-  if (width < 1 || height < 1) return false; // this could be an assert, it is guaranteed by the xpos/ypos checks at the top of this function
+  p.fill_bm = m_bgmode==OPAQUE ? bm : NULL;
+  p.fill_col = m_bg;
+  p.fill_alpha = alpha;
+  p.fill_mode = mode;
+  p.red=LICE_GETR(m_fg);
+  p.green=LICE_GETG(m_fg);
+  p.blue=LICE_GETB(m_fg);
+  p.r2=LICE_GETR(m_effectcol);
+  p.g2=LICE_GETG(m_effectcol);
+  p.b2=LICE_GETB(m_effectcol);
 
-  int mode=m_comb&~LICE_BLIT_USE_ALPHA;
-  float alpha=m_alpha;
-  
-  if (m_bgmode==OPAQUE)
-    LICE_FillRect(bm,xpos,ypos,width,height,m_bg,alpha,mode);
+  const unsigned char *store = m_cache->cachestore.Get();
+  LICE_GlyphBlit blits[LICE_TEXT_GLYPHRUN_SIZE];
 
-  int red=LICE_GETR(m_fg);
-  int green=LICE_GETG(m_fg);
-  int blue=LICE_GETB(m_fg);
-
-  if (m_flags&LICE_FONT_FLAG_FX_MONO)
+  while (nglyphs > 0)
   {
-    if (alpha==1.0 && (mode&LICE_BLIT_MODE_MASK)==LICE_BLIT_MODE_COPY) // fast simple
+    int n = 0;
+    for (; n < LICE_TEXT_GLYPHRUN_SIZE && nglyphs > 0; nglyphs--, run++)
     {
-      LICE_pixel col=m_fg;
-      int y;
-      for(y=0;y<height;y++)
-      {
-        int x;
-        for(x=0;x<width;x++) if (gsrc[x]) pout[x]=col;
-        gsrc += src_span;
-        pout += dest_span;
+      LICE_GlyphBlit *g = blits + n;
+      g->gsrc = store + run->base_offset-1;
+      g->src_span = g->width = run->width;
+      g->height = run->height;
+      int xpos = run->xpos, ypos = run->ypos;
+
+      if (xpos < clipR->left) 
+      { 
+        g->width += (xpos-clipR->left); 
+        g->gsrc += clipR->left-xpos; 
+        xpos=clipR->left; 
+      }
+      if (ypos < clipR->top) 
+      { 
+        g->gsrc += g->src_span*(clipR->top-ypos);
+        g->height += (ypos-clipR->top); 
+        ypos=clipR->top; 
       }
+      if (g->width >= clipR->right-xpos) g->width = clipR->right-xpos;
+      if (g->height >= clipR->bottom-ypos) g->height = clipR->bottom-ypos;
+
+      if (g->width < 1 || g->height < 1) continue; // this could be an assert, callers only pass glyphs that intersect clipR
+
+      g->xpos = xpos;
+      g->ypos = ypos;
+      g->pout = bits + xpos + ypos * p.dest_span;
+      n++;
     }
-    else 
+
+    if (m_flags&LICE_FONT_FLAG_FX_MONO)
     {
-      int avalint = (int) (alpha*256.0);
-      if (avalint>256)avalint=256;
+      if (alpha==1.0 && (mode&LICE_BLIT_MODE_MASK)==LICE_BLIT_MODE_COPY) // fast simple
+      {
+        const LICE_pixel col=m_fg;
+        for (int i = 0; i < n; i ++)
+        {
+          const LICE_GlyphBlit *g = blits + i;
+          if (p.fill_bm) LICE_FillRect(bm,g->xpos,g->ypos,g->width,g->height,m_bg,alpha,mode);
 
-      #define __LICE__ACTION(comb) GlyphRenderer<comb>::Mono(gsrc,pout,src_span,dest_span,width,height,red,green,blue,avalint)
-      __LICE_ACTION_NOSRCALPHA(mode,avalint, false);
-      #undef __LICE__ACTION
+          const unsigned char *gsrc = g->gsrc;
+          LICE_pixel *pout = g->pout;
+          for(int y=0;y<g->height;y++)
+          {
+            for(int x=0;x<g->width;x++) if (gsrc[x]) pout[x]=col;
+            gsrc += g->src_span;
+            pout += p.dest_span;
+          }
+        }
+      }
+      else 
+      {
+        p.alpha = (int) (alpha*256.0);
+        if (p.alpha>256)p.alpha=256;
+
+        #define __LICE__ACTION(comb) GlyphRenderer<comb>::MonoRun(blits,n,&p)
+        __LICE_ACTION_NOSRCALPHA(mode,p.alpha, false);
+        #undef __LICE__ACTION
+      }
     }
-  }
-  else if (m_flags&(LICE_FONT_FLAG_FX_SHADOW|LICE_FONT_FLAG_FX_OUTLINE))
-  {
-    LICE_pixel col=m_fg;
-    LICE_pixel bkcol=m_effectcol;
+    else if (m_flags&(LICE_FONT_FLAG_FX_SHADOW|LICE_FONT_FLAG_FX_OUTLINE))
+    {
+      if (alpha==1.0 && (mode&LICE_BLIT_MODE_MASK)==LICE_BLIT_MODE_COPY)
+      {
+        const LICE_pixel col=m_fg;
+        const LICE_pixel bkcol=m_effectcol;
+        for (int i = 0; i < n; i ++)
+        {
+          const LICE_GlyphBlit *g = blits + i;
+          if (p.fill_bm) LICE_FillRect(bm,g->xpos,g->ypos,g->width,g->height,m_bg,alpha,mode);
 
-    if (alpha==1.0 && (mode&LICE_BLIT_MODE_MASK)==LICE_BLIT_MODE_COPY)
+          const unsigned char *gsrc = g->gsrc;
+          LICE_pixel *pout = g->pout;
+          for(int y=0;y<g->height;y++)
+          {
+            for(int x=0;x<g->width;x++) 
+            {
+              const unsigned char cv=gsrc[x];
+              if (cv) pout[x]=cv==255? col : bkcol;
+            }
+            gsrc += g->src_span;
+            pout += p.dest_span;
+          }
+        }
+      }
+      else 
+      {
+        p.alpha = (int) (alpha*256.0);
+        if (p.alpha>256)p.alpha=256;
+
+        #define __LICE__ACTION(comb) GlyphRenderer<comb>::EffectRun(blits,n,&p)
+        __LICE_ACTION_NOSRCALPHA(mode,p.alpha, false);
+        #undef __LICE__ACTION
+      }
+    }
+    else if (alpha==1.0 && (mode&LICE_BLIT_MODE_MASK)==LICE_BLIT_MODE_COPY)
     {
-      int y;
-      for(y=0;y<height;y++)
+      // fully covered pixels are written directly, this is what _LICE_CombinePixelsCopyNoClamp would produce for them
+      const LICE_pixel col=LICE_RGBA(p.red,p.green,p.blue,255);
+      for (int i = 0; i < n; i ++)
       {
-        int x;
-        for(x=0;x<width;x++) 
+        const LICE_GlyphBlit *g = blits + i;
+        if (p.fill_bm) LICE_FillRect(bm,g->xpos,g->ypos,g->width,g->height,m_bg,alpha,mode);
+
+        const unsigned char *gsrc = g->gsrc;
+        LICE_pixel *pout = g->pout;
+        for(int y=0;y<g->height;y++)
         {
-          unsigned char cv=gsrc[x];
-          if (cv) pout[x]=cv==255? col : bkcol;
+#ifdef LICE_COMBINE_SPAN_SIMD
+          int x=_LICE_GlyphSpanCopy(pout,gsrc,g->width,col);
+#else
+          int x=0;
+#endif
+          for(;x<g->width;x++) 
+          {
+            const unsigned char v=gsrc[x];
+            if (v==255) pout[x]=col;
+            else if (v) _LICE_CombinePixelsCopyNoClamp::doPix((LICE_pixel_chan *)(pout+x),p.red,p.green,p.blue,255,(int)v+1);
+          }
+          gsrc += g->src_span;
+          pout += p.dest_span;
         }
-        gsrc += src_span;
-        pout += dest_span;
       }
     }
-    else 
+    else
     {
-      int avalint = (int) (alpha*256.0);
-      if (avalint>256)avalint=256;
-      int r2=LICE_GETR(bkcol);
-      int g2=LICE_GETG(bkcol);
-      int b2=LICE_GETB(bkcol);
-      #define __LICE__ACTION(comb) GlyphRenderer<comb>::Effect(gsrc,pout,src_span,dest_span,width,height,red,green,blue,avalint,r2,g2,b2)
-      __LICE_ACTION_NOSRCALPHA(mode,avalint, false);
+      p.alpha = (int) (alpha*256.0);
+      #define __LICE__ACTION(comb) GlyphRenderer<comb>::NormalRun(blits,n,&p)
+      __LICE_ACTION_NOSRCALPHA(mode,p.alpha, false);
       #undef __LICE__ACTION
     }
   }
-  else
+}
+
+static unsigned int LICE_Text_LayoutHash(const char *str, int len, UINT dtflags, int lsadj)
+{
+  unsigned int h = 2166136261u ^ (unsigned int)dtflags ^ ((unsigned int)lsadj<<16);
+  while (len-- > 0) h = (h ^ (unsigned char)*str++) * 16777619u;
+  return h ^ (h>>15);
+}
+
+static int LICE_Text_LayoutLen(const char *str, int strcnt) // returns -1 if not cacheable
+{
+  int len = 0;
+  while (len < LICE_TEXT_LAYOUTCACHE_MAXLEN && len != strcnt && str[len]) len++;
+  if (len == strcnt)
   {
-    int avalint = (int) (alpha*256.0);
-    #define __LICE__ACTION(comb) GlyphRenderer<comb>::Normal(gsrc,pout,src_span,dest_span,width,height,red,green,blue,avalint)
-    __LICE_ACTION_NOSRCALPHA(mode,avalint, false);
-    #undef __LICE__ACTION
+    // a trailing partial UTF-8 sequence would be decoded using bytes past strcnt
+    if (len > 0 && (str[len-1]&0x80)) return -1;
   }
+  else if (str[len]) return -1;
+  return len;
+}
 
-  return true; // drew glyph at all (for updating max extents)
+bool LICE_CachedFont::GetCachedLayout(const char *str, int strcnt, UINT dtflags, int lsadj, RECT *sz, int *ret)
+{
+  const int len = LICE_Text_LayoutLen(str,strcnt);
+  if (len < 1) return false;
+
+  const unsigned int hash = LICE_Text_LayoutHash(str,len,dtflags,lsadj);
+  glyphCache::layoutEnt *ent = m_cache->layouts + (hash & (LICE_TEXT_LAYOUTCACHE_SIZE-1) & ~(LICE_TEXT_LAYOUTCACHE_WAYS-1));
+  for (int x = 0; x < LICE_TEXT_LAYOUTCACHE_WAYS; x ++, ent ++)
+  {
+    if (ent->hash == hash && ent->len == len && ent->dtflags == dtflags && ent->lsadj == lsadj && !memcmp(ent->str,str,len))
+    {
+      ent->lastuse = ++m_cache->layout_cnt;
+      *sz = ent->sz;
+      *ret = ent->ret;
+      return true;
+    }
+  }
+  return false;
+}
+
+void LICE_CachedFont::SetCachedLayout(const char *str, int strcnt, UINT dtflags, int lsadj, const RECT *sz, int ret)
+{
+  const int len = LICE_Text_LayoutLen(str,strcnt);
+  if (len < 1) return;
+
+  const unsigned int hash = LICE_Text_LayoutHash(str,len,dtflags,lsadj);
+  glyphCache::layoutEnt *set = m_cache->layouts + (hash & (LICE_TEXT_LAYOUTCACHE_SIZE-1) & ~(LICE_TEXT_LAYOUTCACHE_WAYS-1));
+  glyphCache::layoutEnt *ent = set;
+  for (int x = 1; x < LICE_TEXT_LAYOUTCACHE_WAYS && ent->len; x ++)
+  {
+    if (!set[x].len || (int)(set[x].lastuse - ent->lastuse) < 0) ent = set+x; // replace unused or least recently used
+  }
+  ent->hash = hash;
+  ent->len = len;
+  ent->dtflags = dtflags;
+  ent->lsadj = lsadj;
+  ent->sz = *sz;
+  ent->ret = ret;
+  ent->lastuse = ++m_cache->layout_cnt;
+  memcpy(ent->str,str,len);
 }
 
 
@@ -820,14 +1100,23 @@ int LICE_CachedFont::DrawTextImpl(LICE_IBitmap *bm, const char *str, int strcnt,
       hdc = s_nativerender_tempbitmap->getDC();
       if (!hdc) goto finish_up_native_render;
 
-      oldfont = SelectObject(hdc, m_font);
-  
+      // measuring is slow (especially with SWELL), so the size of recently drawn strings is kept
       RECT text_size = {0,0};
-      ret =
+      const UINT measureFlags = (dtFlags&~(DT_CENTER|DT_VCENTER|DT_TOP|DT_BOTTOM|DT_LEFT|DT_RIGHT))|DT_CALCRECT|DT_NOPREFIX;
+      const bool measured = GetCachedLayout(str,strcnt,measureFlags,0,&text_size,&ret);
+      if (measured && (dtFlags & DT_CALCRECT)) hdc = 0; // no need for the font
+
+      if (hdc) oldfont = SelectObject(hdc, m_font);
+  
+      if (!measured)
+      {
+        ret =
 #ifdef _WIN32
-        wtmp ? ::DrawTextW(hdc,wtmp,-1,&text_size,(dtFlags&~(DT_CENTER|DT_VCENTER|DT_TOP|DT_BOTTOM|DT_LEFT|DT_RIGHT))|DT_CALCRECT|DT_NOPREFIX) : 
+          wtmp ? ::DrawTextW(hdc,wtmp,-1,&text_size,measureFlags) : 
 #endif
-          ::DrawText(hdc,str,strcnt,&text_size,(dtFlags&~(DT_CENTER|DT_VCENTER|DT_TOP|DT_BOTTOM|DT_LEFT|DT_RIGHT))|DT_CALCRECT|DT_NOPREFIX);
+            ::DrawText(hdc,str,strcnt,&text_size,measureFlags);
+        SetCachedLayout(str,strcnt,measureFlags,0,&text_size,ret);
+      }
       if (dtFlags & DT_CALCRECT)
       {
         rect->right = rect->left + text_size.right - text_size.left;
@@ -959,6 +1248,18 @@ finish_up_native_render:
 
   if (dtFlags & DT_CALCRECT)
   {
+    const UINT layoutFlags = DT_CALCRECT|(dtFlags&DT_SINGLELINE);
+    RECT sz = { 0, 0 };
+    int sz_ret;
+    if (GetCachedLayout(str,strcnt,layoutFlags,m_lsadj,&sz,&sz_ret))
+    {
+      rect->right = rect->left+sz.right;
+      rect->bottom = rect->top+sz.bottom;
+      return sz_ret;
+    }
+    const char *str_in = str;
+    const int strcnt_in = strcnt;
+
     int xpos=0;
     int ypos=0;
     int max_xpos=0;
@@ -997,9 +1298,9 @@ finish_up_native_render:
       charEnt *ent = findChar(c);
       if (!ent) 
       {
-        const int os=m_extracharlist.GetSize();
+        const int os=m_cache->extracharlist.GetSize();
         RenderGlyph(c);
-        if (m_extracharlist.GetSize()!=os)
+        if (m_cache->extracharlist.GetSize()!=os)
           ent = findChar(c);
       }
 
@@ -1032,8 +1333,12 @@ finish_up_native_render:
     rect->right = rect->left+max_xpos;
     rect->bottom = rect->top+max_ypos;
 
+    sz.right = max_xpos;
+    sz.bottom = max_ypos;
+    sz_ret = (m_flags&LICE_FONT_FLAG_VERTICAL) ? max_xpos : max_ypos;
+    SetCachedLayout(str_in,strcnt_in,layoutFlags,m_lsadj,&sz,sz_ret);
 
-    return (m_flags&LICE_FONT_FLAG_VERTICAL) ? max_xpos : max_ypos;
+    return sz_ret;
   }
   float alphaSave  = m_alpha;
 
@@ -1118,6 +1423,9 @@ finish_up_native_render:
   // thought: calculate length of "...", then when pos+length+widthofnextchar >= right, switch
   // might need to precalc size to make sure it's needed, though
 
+  glyphRunEnt run[LICE_TEXT_GLYPHRUN_SIZE]; // glyphs are referenced by offset, so rendering new glyphs while queueing is safe
+  int nrun=0;
+
   while (*str && strcnt)
   {
     unsigned short c=' ';
@@ -1151,9 +1459,9 @@ finish_up_native_render:
     charEnt *ent = findChar(c);
     if (!ent) 
     {
-      const int os=m_extracharlist.GetSize();
+      const int os=m_cache->extracharlist.GetSize();
       RenderGlyph(c);
-      if (m_extracharlist.GetSize()!=os)
+      if (m_cache->extracharlist.GetSize()!=os)
         ent = findChar(c);
     }
 
@@ -1161,11 +1469,35 @@ finish_up_native_render:
     {
       if (ent->base_offset==0) RenderGlyph(c);
 
-      if (ent->base_offset > 0 && ent->base_offset < m_cachestore.GetSize())
+      if (ent->base_offset > 0 && ent->base_offset < m_cache->cachestore.GetSize())
       {
         if (isVertRev) ypos -= ent->height;
-       
-        bool drawn = DrawGlyph(bm,c,xpos,ypos,&use_rect);
+
+        // queue the glyph if it is visible, the queue is drawn in one pass when full or at the end of the string
+        int gx = xpos, gy = ypos;
+        if (m_flags&LICE_FONT_FLAG_VERTICAL) 
+        {
+          if (isVertRev) gy -= ent->left_extra;
+          else gy += ent->left_extra;
+        }
+        else gx -= ent->left_extra;
+
+        const bool drawn = gx < use_rect.right && gy < use_rect.bottom &&
+                           gx+ent->width > use_rect.left && gy+ent->height > use_rect.top;
+        if (drawn)
+        {
+          if (nrun == LICE_TEXT_GLYPHRUN_SIZE)
+          {
+            DrawGlyphRun(bm,run,nrun,&use_rect);
+            nrun=0;
+          }
+          glyphRunEnt *g = run + nrun++;
+          g->base_offset = ent->base_offset;
+          g->width = ent->width;
+          g->height = ent->height;
+          g->xpos = gx;
+          g->ypos = gy;
+        }
 
         if (m_flags&LICE_FONT_FLAG_VERTICAL) 
         {
@@ -1185,6 +1517,8 @@ finish_up_native_render:
     }
   }
 
+  DrawGlyphRun(bm,run,nrun,&use_rect);
+
   m_alpha=alphaSave;
   return (m_flags&LICE_FONT_FLAG_VERTICAL) ? max_xpos - start_x : max_ypos - start_y;
 }
@@ -25,6 +25,9 @@
   This file provides some simple functions for dealing with PCM audio.
   Specifically: 
     + convert between 16/24/32 bit integer samples and flaots (only really tested on little-endian (i.e. x86) systems)
+      (pcmToFloats()/floatsToPcm() use SSE2 where available, giving the same results as the scalar code.
+       define PCMFMTCVT_NO_SSE2 to use the scalar code only)
+    + convert floats to 16/24 bit with TPDF dither
     + mix (and optionally resample, using low quality linear interpolation) a block of floats to another.
  
 */
@@ -39,6 +42,11 @@
 #define PCMFMTCVT_DBL_TYPE double
 #endif
 
+#if !defined(PCMFMTCVT_NO_SSE2) && (defined(__SSE2__) || _M_IX86_FP >= 2 || defined(_WIN64))
+#define PCMFMTCVT_SSE2
+#include <emmintrin.h>
+#endif
+
 static inline int float2int(PCMFMTCVT_DBL_TYPE d)
 {
   return (int) d;
@@ -209,11 +217,60 @@ static inline void double_to_i24(PCMFMTCVT_DBL_TYPE *vv, unsigned char *i24)
   }
 }
 
+#ifdef PCMFMTCVT_SSE2
+
+// 4 samples at a time. these give exactly what the scalar functions above do:
+// the int->float scaling is by powers of two (exact, and the one rounding in
+// 32 bit conversion happens the same way), and float->int rounds half away
+// from zero using the exact fractional part of the scaled sample
+
+static inline __m128 pcmfmtcvt_load4f(const float *p, int sp)
+{
+  if (sp == 1) return _mm_loadu_ps(p);
+  return _mm_setr_ps(p[0],p[sp],p[2*sp],p[3*sp]);
+}
+
+static inline void pcmfmtcvt_store4f(float *p, int sp, __m128 v)
+{
+  if (sp == 1) { _mm_storeu_ps(p,v); return; }
+  float tmp[4];
+  _mm_storeu_ps(tmp,v);
+  p[0]=tmp[0]; p[sp]=tmp[1]; p[2*sp]=tmp[2]; p[3*sp]=tmp[3];
+}
+
+// v*scale rounded, v <= -1 gives -scale, v >= hi gives maxval
+static inline __m128i pcmfmtcvt_f2i(__m128 v, float scale, float hi, int maxval)
+{
+  const __m128 y=_mm_mul_ps(v,_mm_set1_ps(scale));
+  __m128i r=_mm_cvttps_epi32(y);
+  const __m128 frac=_mm_sub_ps(y,_mm_cvtepi32_ps(r));
+  r=_mm_sub_epi32(r,_mm_castps_si128(_mm_cmpge_ps(frac,_mm_set1_ps(0.5f)))); // masks are -1
+  r=_mm_add_epi32(r,_mm_castps_si128(_mm_cmple_ps(frac,_mm_set1_ps(-0.5f))));
+
+  const __m128i lo=_mm_castps_si128(_mm_cmple_ps(v,_mm_set1_ps(-1.0f)));
+  const __m128i hiv=_mm_castps_si128(_mm_cmpge_ps(v,_mm_set1_ps(hi)));
+  r=_mm_andnot_si128(_mm_or_si128(lo,hiv),r);
+  r=_mm_or_si128(r,_mm_and_si128(lo,_mm_set1_epi32(-maxval-1)));
+  return _mm_or_si128(r,_mm_and_si128(hiv,_mm_set1_epi32(maxval)));
+}
+
+#endif
+
 static void pcmToFloats(void *src, int items, int bps, int src_spacing, float *dest, int dest_spacing)
 {
   if (bps == 32)
   {
     int *i1=(int *)src;
+#ifdef PCMFMTCVT_SSE2
+    for (; items >= 4; items -= 4)
+    {
+      const __m128i v = src_spacing == 1 ? _mm_loadu_si128((const __m128i *)i1) :
+                          _mm_setr_epi32(i1[0],i1[src_spacing],i1[2*src_spacing],i1[3*src_spacing]);
+      pcmfmtcvt_store4f(dest,dest_spacing,_mm_mul_ps(_mm_cvtepi32_ps(v),_mm_set1_ps(1.0f/2147483648.0f)));
+      i1+=4*src_spacing;
+      dest+=4*dest_spacing;
+    }
+#endif
     while (items--)
     {          
       i32_to_float(*i1,dest);
@@ -225,6 +282,18 @@ static void pcmToFloats(void *src, int items, int bps, int src_spacing, float *d
   {
     unsigned char *i1=(unsigned char *)src;
     int adv=3*src_spacing;
+#ifdef PCMFMTCVT_SSE2
+    for (; items >= 4; items -= 4)
+    {
+      const unsigned char *a=i1, *b=a+adv, *c=b+adv, *d=c+adv;
+      __m128i v=_mm_setr_epi32(a[0]|(a[1]<<8)|(a[2]<<16), b[0]|(b[1]<<8)|(b[2]<<16),
+                               c[0]|(c[1]<<8)|(c[2]<<16), d[0]|(d[1]<<8)|(d[2]<<16));
+      v=_mm_srai_epi32(_mm_slli_epi32(v,8),8); // sign extend
+      pcmfmtcvt_store4f(dest,dest_spacing,_mm_mul_ps(_mm_cvtepi32_ps(v),_mm_set1_ps(1.0f/8388608.0f)));
+      i1+=4*adv;
+      dest+=4*dest_spacing;
+    }
+#endif
     while (items--)
     {          
       i24_to_float(i1,dest);
@@ -235,6 +304,17 @@ static void pcmToFloats(void *src, int items, int bps, int src_spacing, float *d
   else if (bps == 16)
   {
     short *i1=(short *)src;
+#ifdef PCMFMTCVT_SSE2
+    for (; items >= 4; items -= 4)
+    {
+      __m128i v;
+      if (src_spacing == 1) v=_mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(),_mm_loadl_epi64((const __m128i *)i1)),16);
+      else v=_mm_setr_epi32(i1[0],i1[src_spacing],i1[2*src_spacing],i1[3*src_spacing]);
+      pcmfmtcvt_store4f(dest,dest_spacing,_mm_mul_ps(_mm_cvtepi32_ps(v),_mm_set1_ps(1.0f/32768.0f)));
+      i1+=4*src_spacing;
+      dest+=4*dest_spacing;
+    }
+#endif
     while (items--)
     {          
       INT16_TO_float(*dest,*i1);
@@ -249,6 +329,21 @@ static void floatsToPcm(float *src, int src_spacing, int items, void *dest, int
   if (bps==32)
   {
     int *o1=(int*)dest;
+#ifdef PCMFMTCVT_SSE2
+    for (; items >= 4; items -= 4)
+    {
+      const __m128i r=pcmfmtcvt_f2i(pcmfmtcvt_load4f(src,src_spacing),2147483648.0f,2147483646.5f/2147483648.0f,0x7FFFFFFF);
+      if (dest_spacing == 1) _mm_storeu_si128((__m128i *)o1,r);
+      else
+      {
+        int tmp[4];
+        _mm_storeu_si128((__m128i *)tmp,r);
+        o1[0]=tmp[0]; o1[dest_spacing]=tmp[1]; o1[2*dest_spacing]=tmp[2]; o1[3*dest_spacing]=tmp[3];
+      }
+      src+=4*src_spacing;
+      o1+=4*dest_spacing;
+    }
+#endif
     while (items--)
     {
       float_to_i32(src,o1);
@@ -260,6 +355,21 @@ static void floatsToPcm(float *src, int src_spacing, int items, void *dest, int
   {
     unsigned char *o1=(unsigned char*)dest;
     int adv=dest_spacing*3;
+#ifdef PCMFMTCVT_SSE2
+    for (; items >= 4; items -= 4)
+    {
+      int tmp[4], x;
+      _mm_storeu_si128((__m128i *)tmp,pcmfmtcvt_f2i(pcmfmtcvt_load4f(src,src_spacing),8388608.0f,8388606.5f/8388608.0f,0x7FFFFF));
+      for (x = 0; x < 4; x ++)
+      {
+        o1[0]=tmp[x]&0xff;
+        o1[1]=(tmp[x]>>8)&0xff;
+        o1[2]=(tmp[x]>>16)&0xff;
+        o1+=adv;
+      }
+      src+=4*src_spacing;
+    }
+#endif
     while (items--)
     {
       float_to_i24(src,o1);
@@ -270,6 +380,21 @@ static void floatsToPcm(float *src, int src_spacing, int items, void *dest, int
   else if (bps==16)
   {
     short *o1=(short*)dest;
+#ifdef PCMFMTCVT_SSE2
+    for (; items >= 4; items -= 4)
+    {
+      const __m128i r=pcmfmtcvt_f2i(pcmfmtcvt_load4f(src,src_spacing),32768.0f,32766.5f/32768.0f,32767);
+      if (dest_spacing == 1) _mm_storel_epi64((__m128i *)o1,_mm_packs_epi32(r,r));
+      else
+      {
+        int tmp[4];
+        _mm_storeu_si128((__m128i *)tmp,r);
+        o1[0]=(short)tmp[0]; o1[dest_spacing]=(short)tmp[1]; o1[2*dest_spacing]=(short)tmp[2]; o1[3*dest_spacing]=(short)tmp[3];
+      }
+      src+=4*src_spacing;
+      o1+=4*dest_spacing;
+    }
+#endif
     while (items--)
     {
       float_TO_INT16(*o1,*src);
@@ -280,6 +405,39 @@ static void floatsToPcm(float *src, int src_spacing, int items, void *dest, int
 }
 
 
+// like floatsToPcm(), adding TPDF dither of +/-1 LSB first (32 bit is converted without).
+// *seed is the state of the noise generator, keep it from one call to the next
+static void floatsToPcmDither(float *src, int src_spacing, int items, void *dest, int bps, int dest_spacing, unsigned int *seed)
+{
+  if (bps != 16 && bps != 24)
+  {
+    floatsToPcm(src,src_spacing,items,dest,bps,dest_spacing);
+    return;
+  }
+
+  const float noisescale = (bps == 16 ? 1.0f/32768.0f : 1.0f/8388608.0f) / 16777216.0f;
+  unsigned char *o1=(unsigned char *)dest;
+  unsigned int state=*seed;
+  float tmp[256];
+  while (items > 0)
+  {
+    const int n = items < 256 ? items : 256;
+    int x;
+    for (x = 0; x < n; x ++)
+    {
+      state=state*1664525+1013904223;
+      const int r1=(int)(state>>8);
+      state=state*1664525+1013904223;
+      const int r2=(int)(state>>8);
+      tmp[x]=src[0] + (float)(r1-r2)*noisescale;
+      src+=src_spacing;
+    }
+    floatsToPcm(tmp,1,n,o1,bps,dest_spacing);
+    o1+=n*dest_spacing*(bps/8);
+    items-=n;
+  }
+  *seed=state;
+}
 static void pcmToDoubles(void *src, int items, int bps, int src_spacing, PCMFMTCVT_DBL_TYPE *dest, int dest_spacing, int byteadvancefor24=0)
 {
   if (bps == 32)
@@ -0,0 +1,217 @@
+/*
+  pcmfmtcvt_test.cpp
+  checks pcmToFloats()/floatsToPcm() (the SSE2 paths, where built) against the per-sample conversions, checks
+  floatsToPcmDither(), and checks that WaveWriter writes what the per-sample conversions give.
+
+  g++ -O2 -o pcmfmtcvt_test pcmfmtcvt_test.cpp
+  ./pcmfmtcvt_test [full]  (full: every float and 32 bit value rather than 1 in 61, slow)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "pcmfmtcvt.h"
+#include "wavwrite.h"
+
+static unsigned int g_rs=1;
+static unsigned int rnd() { g_rs=g_rs*1664525+1013904223; return g_rs>>8; }
+
+static int g_fails;
+
+static void fail(const char *fmt, int a, int b, int c)
+{
+  if (g_fails++ < 20)
+  {
+    printf("FAIL ");
+    printf(fmt,a,b,c);
+    printf("\n");
+  }
+}
+
+// the per-sample conversions that pcmToFloats()/floatsToPcm() finish with
+static void ref_floatsToPcm(float *src, int src_spacing, int items, void *dest, int bps, int dest_spacing)
+{
+  for (int i = 0; i < items; i ++, src += src_spacing)
+  {
+    if (bps == 32) float_to_i32(src,(int *)dest+i*dest_spacing);
+    else if (bps == 24) float_to_i24(src,(unsigned char *)dest+i*dest_spacing*3);
+    else float_TO_INT16(((short *)dest)[i*dest_spacing],*src);
+  }
+}
+
+static void ref_pcmToFloats(void *src, int items, int bps, int src_spacing, float *dest, int dest_spacing)
+{
+  for (int i = 0; i < items; i ++, dest += dest_spacing)
+  {
+    if (bps == 32) i32_to_float(((int *)src)[i*src_spacing],dest);
+    else if (bps == 24) i24_to_float((unsigned char *)src+i*src_spacing*3,dest);
+    else INT16_TO_float(*dest,((short *)src)[i*src_spacing]);
+  }
+}
+
+#define BLOCK 4096
+
+static void test_floats_to_pcm(unsigned int step)
+{
+  static float f[BLOCK];
+  static unsigned char a[BLOCK*4], b[BLOCK*4];
+  for (int bps = 16; bps <= 32; bps += 8)
+  {
+    const int fails=g_fails;
+    unsigned long long u=0;
+    while (u < (1ull<<32))
+    {
+      int n=0;
+      for (; n < BLOCK && u < (1ull<<32); u += step)
+      {
+        const unsigned int bits=(unsigned int)u;
+        float v;
+        memcpy(&v,&bits,4);
+        if (v == v) f[n++]=v;
+      }
+      floatsToPcm(f,1,n,a,bps,1);
+      ref_floatsToPcm(f,1,n,b,bps,1);
+      if (memcmp(a,b,n*(bps/8))) fail("floatsToPcm %d bit, floats below %08x",bps,(int)(unsigned int)u,0);
+    }
+    printf("%s floatsToPcm %d bit, 1 in %u floats\n",g_fails==fails?"ok  ":"FAIL",bps,step);
+  }
+}
+
+static void test_pcm_to_floats(unsigned int step32)
+{
+  static unsigned char a[BLOCK*4];
+  static float fa[BLOCK], fb[BLOCK];
+  for (int bps = 16; bps <= 32; bps += 8)
+  {
+    const int fails=g_fails;
+    const unsigned long long total = bps == 32 ? (1ull<<32) : (1ull<<bps);
+    const unsigned int step = bps == 32 ? step32 : 1;
+    for (unsigned long long base = 0; base < total; base += BLOCK*(unsigned long long)step)
+    {
+      int n=0;
+      for (; n < BLOCK && base+n*(unsigned long long)step < total; n ++)
+      {
+        const unsigned int v=(unsigned int)(base+n*(unsigned long long)step);
+        memcpy(a+n*(bps/8),&v,bps/8);
+      }
+      pcmToFloats(a,n,bps,1,fa,1);
+      ref_pcmToFloats(a,n,bps,1,fb,1);
+      if (memcmp(fa,fb,n*sizeof(float))) fail("pcmToFloats %d bit, samples from %08x",bps,(int)(unsigned int)base,0);
+    }
+    printf("%s pcmToFloats %d bit, 1 in %u values\n",g_fails==fails?"ok  ":"FAIL",bps,step);
+  }
+}
+
+// both directions with spacing on either side and lengths that leave a remainder
+static void test_spacing()
+{
+  static float f[BLOCK], fa[BLOCK], fb[BLOCK];
+  static unsigned char a[BLOCK*4], b[BLOCK*4];
+  const int fails=g_fails;
+  for (int t = 0; t < 100000; t ++)
+  {
+    const int bps=16+8*(rnd()%3), ss=1+rnd()%4, ds=1+rnd()%4, n=rnd()%200;
+    for (int i = 0; i < n*ss; i ++) f[i]=((int)(rnd()&0xffff)-32768)/32768.0f*1.2f;
+
+    memset(a,0x55,n*ds*(bps/8)+16);
+    memset(b,0x55,n*ds*(bps/8)+16);
+    floatsToPcm(f,ss,n,a,bps,ds);
+    ref_floatsToPcm(f,ss,n,b,bps,ds);
+    if (memcmp(a,b,n*ds*(bps/8)+16)) fail("floatsToPcm %d bit, spacing %d -> %d",bps,ss,ds);
+
+    for (int i = 0; i < n*ss*(bps/8); i ++) a[i]=(unsigned char)rnd();
+    for (int i = 0; i < n*ds+4; i ++) fa[i]=fb[i]=-99.0f;
+    pcmToFloats(a,n,bps,ss,fa,ds);
+    ref_pcmToFloats(a,n,bps,ss,fb,ds);
+    if (memcmp(fa,fb,(n*ds+4)*sizeof(float))) fail("pcmToFloats %d bit, spacing %d -> %d",bps,ss,ds);
+  }
+  printf("%s spacing and remainders\n",g_fails==fails?"ok  ":"FAIL");
+}
+
+// TPDF dither of +/-1 LSB: unbiased, never more than 1.5 LSB off, and not the same as plain rounding
+static void test_dither()
+{
+  static float f[BLOCK];
+  static unsigned char o[BLOCK*3], p[BLOCK*3];
+  for (int bps = 16; bps <= 24; bps += 8)
+  {
+    const int fails=g_fails;
+    const double scale = bps == 16 ? 32768.0 : 8388608.0;
+    unsigned int seed=1;
+    for (int k = 0; k < 3; k ++)
+    {
+      const float v = k==0 ? 0.123456f : k==1 ? -0.01f-0.3f/(float)scale : 0.0f; // small enough that floats resolve well below 1 LSB
+      for (int i = 0; i < BLOCK; i ++) f[i]=v;
+      floatsToPcmDither(f,1,BLOCK,o,bps,1,&seed);
+      floatsToPcm(f,1,BLOCK,p,bps,1);
+
+      double sum=0.0, maxerr=0.0;
+      for (int i = 0; i < BLOCK; i ++)
+      {
+        const int s = bps == 16 ? ((short *)o)[i] : ((o[i*3]|(o[i*3+1]<<8)|(o[i*3+2]<<16))<<8)>>8;
+        const double e=s-v*scale;
+        sum+=e;
+        if (fabs(e) > maxerr) maxerr=fabs(e);
+      }
+      if (fabs(sum/BLOCK) > 0.05 || maxerr > 1.5) fail("floatsToPcmDither %d bit, value %d: biased or too far off",bps,k,0);
+      if (!memcmp(o,p,BLOCK*(bps/8))) fail("floatsToPcmDither %d bit, value %d: no dither",bps,k,0);
+    }
+    printf("%s floatsToPcmDither %d bit\n",g_fails==fails?"ok  ":"FAIL",bps);
+  }
+}
+
+// data written by WriteFloats()/WriteFloatsNI(), against the per-sample conversions
+static void test_wavwrite()
+{
+  const int fails=g_fails;
+  static const char *fn="pcmfmtcvt_test.wav";
+  static float f[10000];
+  static unsigned char expect[10000*2*3], got[10000*2*3];
+  for (int i = 0; i < 10000; i ++) f[i]=sinf(i*0.01f)*1.1f;
+
+  for (int bps = 16; bps <= 24; bps += 8) for (int nch = 1; nch <= 2; nch ++) for (int nchsrc = 1; nchsrc <= 2; nchsrc ++)
+  {
+    const int len=4999, bytes=bps/8;
+    float *bufs[2]={ f, f+5000 };
+    {
+      WaveWriter w(fn,bps,nch,48000,0);
+      w.WriteFloatsNI(bufs,0,len,nchsrc);
+      w.WriteFloats(bufs[0],len);
+    }
+
+    int pos=0;
+    for (int i = 0; i < len; i ++) for (int ch = 0; ch < nch; ch ++, pos += bytes)
+      ref_floatsToPcm(bufs[ch && nchsrc > 1 ? 1 : 0]+i,1,1,expect+pos,bps,1);
+    ref_floatsToPcm(bufs[0],1,len,expect+pos,bps,1);
+    pos+=len*bytes;
+
+    FILE *fp=fopen(fn,"rb");
+    int rd=0;
+    if (fp)
+    {
+      fseek(fp,44,SEEK_SET);
+      rd=(int)fread(got,1,sizeof(got),fp);
+      fclose(fp);
+    }
+    remove(fn);
+    if (rd != pos || memcmp(got,expect,pos)) fail("WaveWriter %d bit, %d channels from %d",bps,nch,nchsrc);
+  }
+  printf("%s WaveWriter\n",g_fails==fails?"ok  ":"FAIL");
+}
+
+int main(int argc, char **argv)
+{
+  const bool full = argc>1 && !strcmp(argv[1],"full");
+#ifndef PCMFMTCVT_SSE2
+  printf("no SSE2 paths in this build, checking the scalar code against itself\n");
+#endif
+  test_floats_to_pcm(full ? 1 : 61);
+  test_pcm_to_floats(full ? 1 : 61);
+  test_spacing();
+  test_dither();
+  test_wavwrite();
+
+  printf("%s (%d failures)\n",g_fails?"FAIL":"OK",g_fails);
+  return g_fails ? 1 : 0;
+}
@@ -46,6 +46,8 @@ class WaveWriter
       m_bps=0;
       m_srate=0;
       m_nch=0;
+      m_dither=false;
+      m_dither_seed=0;
     }
 
     WaveWriter(const char *filename, int bps, int nch, int srate, int allow_append=1) 
@@ -54,6 +56,8 @@ class WaveWriter
       m_bps=0;
       m_srate=0;
       m_nch=0;
+      m_dither=false;
+      m_dither_seed=0;
       Open(filename,bps,nch,srate,allow_append);
 
     }
@@ -165,30 +169,16 @@ class WaveWriter
 
     void WriteFloats(float *samples, int nsamples)
     {
-      if (!m_fp) return;
+      if (!m_fp || (m_bps != 16 && m_bps != 24)) return;
 
-      if (m_bps == 16)
-      {
-        while (nsamples-->0)
-        {
-          short a;
-          float_TO_INT16(a,*samples);
-          unsigned char c=a&0xff;
-          fwrite(&c,1,1,m_fp);
-          c=a>>8;
-          fwrite(&c,1,1,m_fp);
-          samples++;
-        }
-      }
-      else if (m_bps == 24)
+      unsigned char buf[1024*3];
+      while (nsamples > 0)
       {
-        while (nsamples-->0)
-        {
-          unsigned char a[3];
-          float_to_i24(samples,a);
-          fwrite(a,1,3,m_fp);
-          samples++;
-        }
+        const int n = nsamples < 1024 ? nsamples : 1024;
+        convertFloats(samples,n,buf,1);
+        fwrite(buf,1,n*(m_bps/8),m_fp);
+        samples+=n;
+        nsamples-=n;
       }
     }
 
@@ -223,42 +213,25 @@ class WaveWriter
 
     void WriteFloatsNI(float **samples, int offs, int nsamples, int nchsrc=0)
     {
-      if (!m_fp) return;
+      if (!m_fp || (m_bps != 16 && m_bps != 24)) return;
 
       if (nchsrc < 1) nchsrc=m_nch;
 
       float *tmpptrs[2]={samples[0]+offs,m_nch>1?(nchsrc>1?samples[1]+offs:samples[0]+offs):NULL};
 
-      if (m_bps == 16)
+      const int bytes=m_bps/8;
+      unsigned char buf[1024*2*3];
+      while (nsamples > 0)
       {
-        while (nsamples-->0)
-        {          
-          int ch;
-          for (ch = 0; ch < m_nch; ch ++)
-          {
-            short a;
-            float_TO_INT16(a,tmpptrs[ch][0]);
-            unsigned char c=a&0xff;
-            fwrite(&c,1,1,m_fp);
-            c=a>>8;
-            fwrite(&c,1,1,m_fp);
-            tmpptrs[ch]++;
-          }
-        }
-      }
-      else if (m_bps == 24)
-      {
-        while (nsamples-->0)
+        const int n = nsamples < 1024 ? nsamples : 1024;
+        int ch;
+        for (ch = 0; ch < m_nch; ch ++)
         {
-          int ch;
-          for (ch = 0; ch < m_nch; ch ++)
-          {
-            unsigned char a[3];
-            float_to_i24(tmpptrs[ch],a);
-            fwrite(a,1,3,m_fp);
-            tmpptrs[ch]++;
-          }
+          convertFloats(tmpptrs[ch],n,buf+ch*bytes,m_nch);
+          tmpptrs[ch]+=n;
         }
+        fwrite(buf,1,n*bytes*m_nch,m_fp);
+        nsamples-=n;
       }
     }
 
@@ -308,10 +281,34 @@ class WaveWriter
     int get_srate() { return m_srate; }
     int get_bps() { return m_bps; }
 
+    // TPDF dither the samples given to WriteFloats()/WriteFloatsNI()
+    void SetDither(bool dither) { m_dither=dither; }
+
   private:
+    // converts to little endian m_bps samples, dest_spacing samples apart
+    void convertFloats(float *src, int items, unsigned char *dest, int dest_spacing)
+    {
+      if (m_dither) floatsToPcmDither(src,1,items,dest,m_bps,dest_spacing,&m_dither_seed);
+      else floatsToPcm(src,1,items,dest,m_bps,dest_spacing);
+#ifdef __ppc__
+      if (m_bps == 16)
+      {
+        while (items-- > 0)
+        {
+          const unsigned char c=dest[0];
+          dest[0]=dest[1];
+          dest[1]=c;
+          dest+=dest_spacing*2;
+        }
+      }
+#endif
+    }
+
     WDL_String m_fn;
     FILE *m_fp;
     int m_bps,m_nch,m_srate;
+    bool m_dither;
+    unsigned int m_dither_seed;
 };
 
 
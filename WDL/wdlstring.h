@@ -380,10 +380,11 @@ class WDL_String
         if (growamt > 0)
         {
           const char *oldb = (const char *)m_hb.Get();
+          // in case str overlaps with input, keep it valid (offset taken before oldb may be freed)
+          const INT_PTR stroffs = (str && str >= oldb && str < oldb+oldsz) ? (INT_PTR)(str - oldb) : -1;
           const char *newb = (const char *)m_hb.Resize(newsz,false); // resize up if necessary
 
-          // in case str overlaps with input, keep it valid
-          if (str && newb != oldb && str >= oldb && str < oldb+oldsz) str = newb + (str - oldb);
+          if (stroffs >= 0 && newb != oldb) str = newb + stroffs;
         }
 
         if (m_hb.GetSize() >= newsz)
@@ -372,8 +372,9 @@ static WDL_DLGRET LocalChannelItemProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, L
     return 0;
     case WM_LCUSER_VUUPDATE:
       {
-        int ival=(int) floor(VAL2DB(g_client->GetLocalChannelPeak(m_idx,0))*10.0);
-        int ival2=(int) floor(VAL2DB(g_client->GetLocalChannelPeak(m_idx,1))*10.0);
+        const NJClient_MeterChannel *mc=g_meters.FindChannel(-1,m_idx);
+        int ival=(int) floor(VAL2DB(mc ? mc->lvl.peak[0] : 0.0)*10.0);
+        int ival2=(int) floor(VAL2DB(mc ? mc->lvl.peak[1] : 0.0)*10.0);
         SendDlgItemMessage(hwndDlg,IDC_VU,WM_USER+1010,ival,ival2);
       }
     return 0;
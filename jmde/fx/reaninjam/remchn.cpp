@@ -91,9 +91,14 @@ static WDL_DLGRET RemoteUserItemProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPA
       //IDC_SESSIONINFO
       if (format_timestr_pos && !(lParam&31))
       {
-        time_t t;
-        double mp=-1.0;
-        double d=g_client->GetUserSessionPos(m_user,&t,&mp);
+        time_t t=0;
+        double mp=-1.0, d=-1.0;
+        if (m_user >= 0 && m_user < g_meters.num_users)
+        {
+          d=g_meters.users[m_user].session_pos;
+          t=g_meters.users[m_user].session_updtime;
+          mp=g_meters.users[m_user].session_maxlen;
+        }
         char buf[512];          
         if ((d>-0.5||mp>-0.5))
         {
@@ -222,8 +227,9 @@ static WDL_DLGRET RemoteChannelItemProc(HWND hwndDlg, UINT uMsg, WPARAM wParam,
     break;
     case WM_LCUSER_VUUPDATE:
       {
-        int ival=(int)floor(VAL2DB(g_client->GetUserChannelPeak(user,chan,0))*10.0);
-        int ival2=(int)floor(VAL2DB(g_client->GetUserChannelPeak(user,chan,1))*10.0);
+        const NJClient_MeterChannel *mc=g_meters.FindChannel(user,chan);
+        int ival=(int)floor(VAL2DB(mc ? mc->lvl.peak[0] : 0.0)*10.0);
+        int ival2=(int)floor(VAL2DB(mc ? mc->lvl.peak[1] : 0.0)*10.0);
         SendDlgItemMessage(hwndDlg,IDC_VU,WM_USER+1010,ival,ival2);
       }
     return 0;
@@ -73,11 +73,11 @@ static char g_inipath[1024];
 
 WDL_Mutex g_client_mutex;
 NJClient *g_client;
+NJClient_MeterSnapshot g_meters;
 int g_done;
 WDL_String g_topic;
 
 HWND g_hwnd;
-static HANDLE g_hThread;
 static HWND m_locwnd,m_remwnd;
 static int g_audio_enable=0;
 static WDL_String g_connect_user,g_connect_pass,g_connect_host;
@@ -663,20 +663,6 @@ static void updateMasterControlLabels(HWND hwndDlg)
 }
 
 
-static unsigned WINAPI ThreadFunc(LPVOID p)
-{
-  WDL_SetThreadName("reaper/ninjam");
-  while (!g_done)
-  {
-    g_client_mutex.Enter();
-    while (!g_client->Run());
-    g_client_mutex.Leave();
-    Sleep(1);
-  }
-  return 0;
-}
-
-
 int g_last_resize_pos;
 
 static void resizePanes(HWND hwndDlg, int y_pos, WDL_WndSizer &resize, int doresize)
@@ -1071,8 +1057,8 @@ static WDL_DLGRET MainProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam
         int rsp=GetPrivateProfileInt(CONFSEC,"wnd_div1",0,g_ini_file.Get());          
         if (rsp) resizePanes(hwndDlg,rsp,resize,1);
 
-        unsigned id;
-        g_hThread=(HANDLE)_beginthreadex(NULL,0,ThreadFunc,0,0,&id);
+        // runs g_client->Run() with g_client_mutex held, woken by the socket and the audio thread
+        g_client->StartNetThread(&g_client_mutex);
 
       }
     return 0;
@@ -1181,6 +1167,7 @@ static WDL_DLGRET MainProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam
               SendDlgItemMessage(hwndDlg,IDC_INTERVALPOS,PBM_SETPOS,intp,0);
             }
 
+            g_client->GetMeterSnapshot(&g_meters);
             SendMessage(m_locwnd,WM_LCUSER_VUUPDATE,0,0);
             SendMessage(m_remwnd,WM_LCUSER_VUUPDATE,0,0);
           }
@@ -1498,9 +1485,8 @@ static WDL_DLGRET MainProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam
 
       resize.init(NULL);
 
-      g_done=1;
-      WaitForSingleObject(g_hThread,INFINITE);
-      CloseHandle(g_hThread);
+      g_done=1; // let a license prompt waiting in Run() give up
+      g_client->StopNetThread();
 
       do_disconnect();
 
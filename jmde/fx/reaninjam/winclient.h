@@ -47,6 +47,7 @@ void mkpanstr(char *str, double pan);
 extern WDL_Mutex g_client_mutex;
 extern WDL_FastString g_ini_file;
 extern NJClient *g_client;
+extern NJClient_MeterSnapshot g_meters; // updated before each WM_LCUSER_VUUPDATE
 extern HINSTANCE g_hInst;
 extern int g_done;
 extern WDL_String g_topic;
@@ -46,8 +46,14 @@ class audioStreamer
 
     // call with idx of 0x80000000 to get (int) samples_latency -- if NULL (old driver), use 2 x blocksize.
     // call with idx of 0x80000001 to get (int) samples_latemcy of just output, if NULL, use blocksize
+    // call with idx of 0x80000002 to get (int) number of xruns (over/underruns) so far, if supported
     virtual const char *GetChannelName(int idx)=0; 
 
+    // backends that can add, remove and rename outputs while running (JACK) override this. call it
+    // from a non-audio thread. names (may be NULL, as may any entry) gives the name of each output.
+    // returns the number of outputs now available (also in m_outnch).
+    virtual int SetOutputChannels(int nch, const char * const *names) { return m_outnch; }
+
 		int m_srate, m_innch, m_outnch, m_bps;
 };
 
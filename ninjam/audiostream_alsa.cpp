@@ -23,17 +23,31 @@
   It only exposes the following functions:
 
     audioStreamer *create_audioStreamer_ALSA(char *cfg, SPLPROC proc);
-  
-    cfg is a string that has a list of parameter/value pairs (space delimited) 
+
+    cfg is a string that has a list of parameter/value pairs (space delimited)
     for the config:
       in     - input device i.e. hw:0,0
       out    - output device i.e. hw:0,0
       srate  - sample rate i.e. 48000
-      bps    - bits/sample i.e. 16
-      nch    - channels i.e. 2
-      bsize  - block size (bytes) i.e. 2048
-      nblock - number of blocks i.e. 16
-
+      bps    - sample format: 16, 24, 32 or float (falls back to what the device supports)
+      nch    - channels (input and output) i.e. 2
+      innch  - input channels (overrides nch)
+      outnch - output channels (overrides nch)
+      period - period (block) size in frames i.e. 256
+      bsize  - block size in bytes (older configs, converted to a period size)
+      nblock - number of periods in the playback buffer i.e. 2
+      mmap   - 1 to use mmap access when the device supports it (default), 0 for read/write
+      rt     - SCHED_FIFO priority of the audio thread, 0 to leave it alone (default)
+
+  Capture and playback run as one duplex stream: they are linked with
+  snd_pcm_link() when the devices allow it, so they start and stop together,
+  and a single thread waits on capture, processes each period and writes it
+  straight to playback. On an xrun both streams are stopped, playback is
+  refilled with silence and both are restarted.
+
+  GetChannelName(0x80000000) returns the round trip latency in frames, as
+  measured with snd_pcm_delay() while running, 0x80000001 the output part of
+  it, and 0x80000002 the number of xruns so far.
 
   (everything else in this file is used internally)
 
@@ -41,348 +55,491 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
-#include <signal.h>
 #include <unistd.h>
-#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include <alsa/asoundlib.h>
-#include <sys/ioctl.h>
-#include <sys/soundcard.h>
 
 #include "../WDL/pcmfmtcvt.h"
 
-#include "../WDL/ptrlist.h"
+#include "../WDL/heapbuf.h"
 #include "audiostream.h"
 
-static void audiostream_onunder() { }
-static void audiostream_onover() { }
 
+static const struct
+{
+  int bps; // audioStreamer::m_bps, 33 is 32 bit float
+  snd_pcm_format_t fmt;
+} s_alsa_formats[]=
+{
+  // in order of preference when the requested format is not available
+  { 33, SND_PCM_FORMAT_FLOAT_LE },
+  { 32, SND_PCM_FORMAT_S32_LE },
+  { 24, SND_PCM_FORMAT_S24_3LE },
+  { 16, SND_PCM_FORMAT_S16_LE },
+};
 
 
-class audioStreamer_int
+// one direction of the duplex stream
+class alsaPcm
 {
 	public:
-		audioStreamer_int() { m_srate=48000; m_nch=2; m_bps=16; }
-		virtual ~audioStreamer_int() { }
+		alsaPcm() { pcm=NULL; nch=0; bps=16; use_mmap=false; period=bufsize=0; }
+		~alsaPcm() { if (pcm) snd_pcm_close(pcm); }
 
-		virtual int Read(char *buf, int len)=0; // returns 0 if blocked, < 0 if error, > 0 if data
-		virtual int Write(char *buf, int len)=0; // returns 0 on success
-
-		int m_srate, m_nch, m_bps;
-};
+		int Open(const char *devname, bool is_write, unsigned int *srate, int nch, int bps, int period, int nperiods, bool usemmap);
 
+		// these transfer exactly frames frames, returning 0 or a negative error code
+		int ReadFloats(float **bufs, int frames);
+		int WriteFloats(float **bufs, int frames);
 
+		snd_pcm_t *pcm;
+		int nch;
+		int bps;
+		bool use_mmap;
+		snd_pcm_uframes_t period, bufsize;
 
-class audioStreamer_ALSA : public audioStreamer_int
-{
-	public:
-		audioStreamer_ALSA();
-		~audioStreamer_ALSA();
-		int Open(const char *devname, int is_write, int srate, int nch, int bps, int fragsize, int nfrags, int dosleep);
-
-		int Read(char *buf, int len); // returns 0 if blocked, < 0 if error, > 0 if data
-		int Write(char *buf, int len); // returns 0 on success
 	private:
-	snd_pcm_t *pcm_handle;
-	int m_sleep;
-	int m_bufsize;
-	int m_nfrags;
-	int m_started;
+		WDL_HeapBuf m_rwbuf; // interleaved buffer for read/write access
+		WDL_TypedBuf<snd_pcm_channel_area_t> m_rwareas;
 };
 
 
-
-//////////////// ALSA driver
-audioStreamer_ALSA::audioStreamer_ALSA() 
-{ 
-	m_started=0;
-	pcm_handle=NULL;
-	m_bufsize=1000000;
-}
-
-audioStreamer_ALSA::~audioStreamer_ALSA() 
+static void areaToFloats(const snd_pcm_channel_area_t *a, snd_pcm_uframes_t offs, int n, int bps, float *dest)
 {
-	if (pcm_handle)
-	{
-		snd_pcm_drop(pcm_handle);
-		snd_pcm_close(pcm_handle);
-	}
+  const int step=a->step/8;
+  const char *p=(const char *)a->addr + a->first/8 + offs*step;
+  if (bps == 33)
+  {
+    while (n-- > 0) { *dest++ = *(const float *)p; p+=step; }
+  }
+  else pcmToFloats((void *)p,n,bps,step/(bps/8),dest,1);
 }
 
-int audioStreamer_ALSA::Open(const char *devname, int is_write, int srate, int nch, int bps, int fragsize, int nfrags, int dosleep)
+static void floatsToArea(const float *src, int n, int bps, const snd_pcm_channel_area_t *a, snd_pcm_uframes_t offs)
 {
-	m_sleep=dosleep;
-
-        /* Playback stream */
-        snd_pcm_stream_t stream = is_write?SND_PCM_STREAM_PLAYBACK:SND_PCM_STREAM_CAPTURE;
-
-	/* This structure contains information about    */
-	/* the hardware and can be used to specify the  */      
-	/* configuration to be used for the PCM stream. */ 
-	snd_pcm_hw_params_t *hwparams;
-
-	/* Allocate the snd_pcm_hw_params_t structure on the stack. */
-	snd_pcm_hw_params_alloca(&hwparams);
-
-    	if (snd_pcm_open(&pcm_handle, devname, stream, 0) < 0) 
-	{
- 		fprintf(stderr, "Error opening PCM device %s\n", devname);
-	        return(-1);
-    	}
-
-        /* Init hwparams with full configuration space */
-        if (snd_pcm_hw_params_any(pcm_handle, hwparams) < 0) 
-	{
-		fprintf(stderr, "Can not configure this PCM device.\n");
-		return(-1);
-        }
-
-	if (snd_pcm_hw_params_set_access(pcm_handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED) < 0) 
-	{
-		fprintf(stderr, "Error setting access.\n");
-		return(-1);
-        }
-	  
-    	/* Set sample format */
-	m_bps=bps==32?32:bps==24?24:16;
-    	if (snd_pcm_hw_params_set_format(pcm_handle, hwparams, 
-				bps==32?SND_PCM_FORMAT_S32_LE:bps==24?SND_PCM_FORMAT_S24_3LE:SND_PCM_FORMAT_S16_LE) < 0) {
-		fprintf(stderr, "Error setting format.\n");
-		fprintf(stderr, "Try -bps 16, -bps 24, or -bps 32\n");
-		return(-1);
-	}
-
-  int dir=0;          /* exact_rate == rate --> dir = 0 */
-                          /* exact_rate < rate  --> dir = -1 */
-                          /* exact_rate > rate  --> dir = 1 */
-	unsigned int usrate=srate;
-
-        /* Set sample rate. If the exact rate is not supported */
-        /* by the hardware, use nearest possible rate.         */ 
-	m_srate=srate;
-  int exact_rate = snd_pcm_hw_params_set_rate_near(pcm_handle, hwparams, &usrate, &dir);
-	if (dir != 0) 
-	{
-		fprintf(stderr, "The rate %d Hz is not supported by your hardware. Using %d Hz instead.\n", srate, exact_rate);
-  		m_srate=exact_rate;
-      	}
-
-       	/* Set number of channels */
-        if (snd_pcm_hw_params_set_channels(pcm_handle, hwparams, nch) < 0) 
-	{
-		fprintf(stderr, "Error setting channels.\n");
-		fprintf(stderr, "Try -nch 1 or -nch 2\n");
-		return(-1);
-        }
-	m_nch=nch;
-	
-	int periods=m_nfrags=(is_write?nfrags:nfrags*3);
-	int periodsize=fragsize;
-
-	/* Set number of periods. Periods used to be called fragments. */ 
-	if (snd_pcm_hw_params_set_periods(pcm_handle, hwparams, periods, 0) < 0) 
-	{
-		fprintf(stderr, "Error setting periods.\n");
-		fprintf(stderr, "Try -nbufs 2 through -nbufs 16\n");
-		return(-1);
-	}
-
-    	/* Set buffer size (in frames). The resulting latency is given by */
-    	/* latency = periodsize * periods / (rate * bytes_per_frame)     */
-    	if (snd_pcm_hw_params_set_buffer_size(pcm_handle, hwparams, m_bufsize = (periodsize * periods)/(m_nch * m_bps/8)) < 0) 
-	{
-		fprintf(stderr, "Error setting buffersize.\n");
-		fprintf(stderr, "Try -bufsize 256 through -bufsize 2048\n");
-		return(-1);
-	}
-
-     	/* Apply HW parameter settings to */
-        /* PCM device and prepare device  */
-        if (snd_pcm_hw_params(pcm_handle, hwparams) < 0) 
-	{
-		fprintf(stderr, "Error setting HW params.\n");
-		return(-1);
-	}
-
-	return 0;
+  const int step=a->step/8;
+  char *p=(char *)a->addr + a->first/8 + offs*step;
+  if (bps == 33)
+  {
+    while (n-- > 0) { *(float *)p = *src++; p+=step; }
+  }
+  else floatsToPcm((float *)src,1,n,p,bps,step/(bps/8));
 }
 
 
-int audioStreamer_ALSA::Read(char *buf, int len) // returns 0 if blocked, < 0 if error, > 0 if data
+int alsaPcm::Open(const char *devname, bool is_write, unsigned int *srate, int _nch, int _bps, int _period, int nperiods, bool usemmap)
 {
-	int ret;
-	if (m_sleep >= 0)
-	{
-		struct pollfd pfds[32];
-		int cnt=snd_pcm_poll_descriptors(pcm_handle,pfds,32);
-		if (cnt>0) poll(pfds,cnt,m_sleep);
-	}
-
-	ret=snd_pcm_readi(pcm_handle, buf, len/(m_nch*(m_bps/8)));
-
-	if (ret < 0) 
-	{
-		if (ret != -EAGAIN) { snd_pcm_prepare(pcm_handle);  }
-		return 0;
-	}
-#if 0
-	snd_pcm_sframes_t del=0;
-	if (!snd_pcm_delay(pcm_handle,&del) && del > m_bufsize/2 /* JF>used to be /1 */)
-	{
-		audiostream_onover();
-		for (;;) if (snd_pcm_readi(pcm_handle, buf, len/(m_nch*(m_bps/8)))<0) break;
-		// we have too many samples, eat some
-	}
-#endif
-
-	return ret*m_nch*(m_bps/8);
-}
+  const char *dirname=is_write?"output":"input";
+  int err;
+  if ((err=snd_pcm_open(&pcm, devname, is_write?SND_PCM_STREAM_PLAYBACK:SND_PCM_STREAM_CAPTURE, 0)) < 0)
+  {
+    pcm=NULL;
+    fprintf(stderr,"Error opening %s device %s: %s\n",dirname,devname,snd_strerror(err));
+    return -1;
+  }
 
+  snd_pcm_hw_params_t *hwparams;
+  snd_pcm_hw_params_alloca(&hwparams);
+  if ((err=snd_pcm_hw_params_any(pcm, hwparams)) < 0)
+  {
+    fprintf(stderr,"Error configuring %s device %s: %s\n",dirname,devname,snd_strerror(err));
+    return -1;
+  }
 
-int audioStreamer_ALSA::Write(char *buf, int len) // returns 0 on success
-{
-	snd_pcm_sframes_t del=0;
-	if (!len) return 0;
-
-	int cnt=1;
-	if (!m_started || !snd_pcm_delay(pcm_handle,&del) && del<1)
-	{
-		if (m_started) audiostream_onunder();
-		else m_started=1;
-		cnt=m_nfrags;
-    memset(buf,0,len); // reduce noise
-
-	} 
-
-	while (cnt-->0)
-	{
-		int ret=snd_pcm_writei(pcm_handle, buf, len/(m_nch*(m_bps/8)));
-		if (ret < 0)
-		{
-			if (ret == -EPIPE) snd_pcm_prepare(pcm_handle);
-			return 0;
-		}
-	}
-
-	return 0;
-}
+  // mmap lets us convert straight to and from the device buffer, read/write needs an extra copy
+  use_mmap = usemmap &&
+    (snd_pcm_hw_params_set_access(pcm, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0 ||
+     snd_pcm_hw_params_set_access(pcm, hwparams, SND_PCM_ACCESS_MMAP_NONINTERLEAVED) >= 0);
+  if (!use_mmap && (err=snd_pcm_hw_params_set_access(pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+  {
+    fprintf(stderr,"Error setting access on %s device %s: %s\n",dirname,devname,snd_strerror(err));
+    return -1;
+  }
+
+  bps=0;
+  int x;
+  for (x = 0; x < (int)(sizeof(s_alsa_formats)/sizeof(s_alsa_formats[0])) && !bps; x ++)
+  {
+    if (s_alsa_formats[x].bps == _bps && snd_pcm_hw_params_set_format(pcm, hwparams, s_alsa_formats[x].fmt) >= 0)
+      bps=_bps;
+  }
+  for (x = 0; x < (int)(sizeof(s_alsa_formats)/sizeof(s_alsa_formats[0])) && !bps; x ++)
+  {
+    if (snd_pcm_hw_params_set_format(pcm, hwparams, s_alsa_formats[x].fmt) >= 0)
+      bps=s_alsa_formats[x].bps;
+  }
+  if (!bps)
+  {
+    fprintf(stderr,"Error: %s device %s supports none of float/32/24/16 bit samples\n",dirname,devname);
+    return -1;
+  }
 
+  unsigned int uv=_nch;
+  if (snd_pcm_hw_params_set_channels_near(pcm, hwparams, &uv) < 0)
+  {
+    fprintf(stderr,"Error setting %d channels on %s device %s\n",_nch,dirname,devname);
+    return -1;
+  }
+  nch=(int)uv;
 
+  uv=*srate;
+  if (snd_pcm_hw_params_set_rate_near(pcm, hwparams, &uv, 0) < 0)
+  {
+    fprintf(stderr,"Error setting samplerate %u on %s device %s\n",*srate,dirname,devname);
+    return -1;
+  }
+  *srate=uv;
 
+  snd_pcm_uframes_t fr=_period;
+  if (snd_pcm_hw_params_set_period_size_near(pcm, hwparams, &fr, 0) < 0)
+  {
+    fprintf(stderr,"Error setting period size %d on %s device %s\n",_period,dirname,devname);
+    return -1;
+  }
 
+  uv=nperiods;
+  if (snd_pcm_hw_params_set_periods_near(pcm, hwparams, &uv, 0) < 0)
+  {
+    fprintf(stderr,"Error setting %d periods on %s device %s\n",nperiods,dirname,devname);
+    return -1;
+  }
 
-//============== asio simulation shit
-//
-class audioStreamer_asiosim : public audioStreamer
+  if ((err=snd_pcm_hw_params(pcm, hwparams)) < 0)
+  {
+    fprintf(stderr,"Error setting hardware parameters on %s device %s: %s\n",dirname,devname,snd_strerror(err));
+    return -1;
+  }
+  snd_pcm_hw_params_get_period_size(hwparams, &period, 0);
+  snd_pcm_hw_params_get_buffer_size(hwparams, &bufsize);
+
+  // wake up for every period, and never start on our own (the duplex thread starts the streams)
+  snd_pcm_sw_params_t *swparams;
+  snd_pcm_sw_params_alloca(&swparams);
+  snd_pcm_uframes_t boundary=0;
+  if ((err=snd_pcm_sw_params_current(pcm, swparams)) < 0 ||
+      (err=snd_pcm_sw_params_get_boundary(swparams, &boundary)) < 0 ||
+      (err=snd_pcm_sw_params_set_avail_min(pcm, swparams, period)) < 0 ||
+      (err=snd_pcm_sw_params_set_start_threshold(pcm, swparams, boundary)) < 0 ||
+      (err=snd_pcm_sw_params_set_stop_threshold(pcm, swparams, bufsize)) < 0 ||
+      (err=snd_pcm_sw_params(pcm, swparams)) < 0)
+  {
+    fprintf(stderr,"Error setting software parameters on %s device %s: %s\n",dirname,devname,snd_strerror(err));
+    return -1;
+  }
+
+  if (!use_mmap)
+  {
+    // describe the interleaved buffer the same way mmap describes the device buffer
+    const int bytes = bps == 24 ? 3 : bps == 16 ? 2 : 4;
+    char *buf=(char *)m_rwbuf.Resize(period*nch*bytes,false);
+    snd_pcm_channel_area_t *areas=m_rwareas.Resize(nch,false);
+    if (!buf || !areas) return -1;
+    for (x = 0; x < nch; x ++)
+    {
+      areas[x].addr=buf;
+      areas[x].first=x*bytes*8;
+      areas[x].step=nch*bytes*8;
+    }
+  }
+
+  return 0;
+}
+
+int alsaPcm::ReadFloats(float **bufs, int frames)
 {
-	public:
-    audioStreamer_asiosim(audioStreamer_int *i, audioStreamer_int *o, int bufsize, int srate, int bps, SPLPROC proc)
+  int pos=0;
+  while (pos < frames)
+  {
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offs=0, n=frames-pos;
+    if (use_mmap)
     {
-      m_splproc=proc;
-      in=i;
-      out=o;
-      m_bps=bps;
-      m_innch=m_outnch=2;
-      m_bps=bps;
-      m_srate=srate;
-      m_done=0;
-      m_buf=(char *)malloc(bufsize);
-      m_bufsize=bufsize;
-
-      m_procbuf=(float *)malloc((bufsize*64)/bps);// allocated 2x, input and output
-
-      
-      // create thread
-      pthread_create(&hThread,NULL,threadProc,(void *)this);
+      int err=snd_pcm_mmap_begin(pcm, &areas, &offs, &n);
+      if (err < 0) return err;
+      if (!n) return -EAGAIN;
     }
-    ~audioStreamer_asiosim()
+    else
     {
-      m_done=1;
+      if (n > period) n=period;
+      snd_pcm_sframes_t r=snd_pcm_readi(pcm, m_rwbuf.Get(), n);
+      if (r < 0) return (int)r;
+      n=r;
+      areas=m_rwareas.Get();
+    }
 
-      // kill thread
-      pthread_join(hThread,NULL);
+    int ch;
+    for (ch = 0; ch < nch; ch ++) areaToFloats(areas+ch,offs,(int)n,bps,bufs[ch]+pos);
 
-      delete in;
-      delete out;
-      free(m_buf);
-      free(m_procbuf);
+    if (use_mmap)
+    {
+      snd_pcm_sframes_t r=snd_pcm_mmap_commit(pcm, offs, n);
+      if (r < 0) return (int)r;
+      if ((snd_pcm_uframes_t)r != n) return -EPIPE;
     }
+    pos+=(int)n;
+  }
+  return 0;
+}
 
-    const char *GetChannelName(int idx)
+int alsaPcm::WriteFloats(float **bufs, int frames)
+{
+  int pos=0;
+  while (pos < frames)
+  {
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offs=0, n=frames-pos;
+    if (use_mmap)
     {
-      if (idx == 0) return "Left";
-      if (idx == 1) return "Right";
-      return NULL;
+      int err=snd_pcm_mmap_begin(pcm, &areas, &offs, &n);
+      if (err < 0) return err;
+      if (!n) return -EAGAIN;
     }
-
-	private:
-    void tp();
-    static void *threadProc(void *p)
+    else
     {
-      audioStreamer_asiosim *t=(audioStreamer_asiosim*)p;
-      t->tp();
-      return 0;
+      if (n > period) n=period;
+      areas=m_rwareas.Get();
     }
-    audioStreamer_int *in, *out;
-    
-    pthread_t hThread;
-    int m_done,m_bufsize;
-    char *m_buf;
-    float *m_procbuf;
-
-    SPLPROC m_splproc;
+
+    int ch;
+    for (ch = 0; ch < nch; ch ++) floatsToArea(bufs[ch]+pos,(int)n,bps,areas+ch,offs);
+
+    snd_pcm_sframes_t r = use_mmap ? snd_pcm_mmap_commit(pcm, offs, n) : snd_pcm_writei(pcm, m_rwbuf.Get(), n);
+    if (r < 0) return (int)r;
+    if ((snd_pcm_uframes_t)r != n) return -EPIPE;
+    pos+=(int)n;
+  }
+  return 0;
+}
+
+
+class audioStreamer_ALSA : public audioStreamer
+{
+	public:
+		audioStreamer_ALSA(SPLPROC proc);
+		~audioStreamer_ALSA();
+
+		int Open(const char *indev, const char *outdev, int srate, int innch, int outnch, int bps, int period, int nperiods, bool usemmap, int rtprio);
+
+		const char *GetChannelName(int idx);
+
+	private:
+		static void *threadProc(void *p) { ((audioStreamer_ALSA *)p)->tp(); return 0; }
+		void tp();
+		int startStreams();
+
+		alsaPcm m_in, m_out;
+		bool m_linked;
+		int m_period, m_rtprio;
+
+		WDL_TypedBuf<float> m_procbuf;
+		WDL_TypedBuf<float *> m_procptrs; // m_innch input channels, then m_outnch output channels
+		WDL_TypedBuf<char> m_chnames;
+
+		SPLPROC m_splproc;
+		pthread_t m_thread;
+		bool m_thread_running;
+		volatile int m_done;
+		volatile int m_lat_total, m_lat_out, m_xruns;
 };
 
-void audioStreamer_asiosim::tp()
+
+audioStreamer_ALSA::audioStreamer_ALSA(SPLPROC proc)
+{
+  m_splproc=proc;
+  m_linked=false;
+  m_period=0;
+  m_rtprio=0;
+  m_thread_running=false;
+  m_done=0;
+  m_lat_total=m_lat_out=m_xruns=0;
+}
+
+audioStreamer_ALSA::~audioStreamer_ALSA()
 {
+  m_done=1;
+  if (m_thread_running) pthread_join(m_thread,NULL);
+  if (m_linked) snd_pcm_unlink(m_in.pcm);
+  if (m_in.pcm) snd_pcm_drop(m_in.pcm);
+  if (m_out.pcm) snd_pcm_drop(m_out.pcm);
+}
+
+int audioStreamer_ALSA::Open(const char *indev, const char *outdev, int srate, int innch, int outnch, int bps, int period, int nperiods, bool usemmap, int rtprio)
+{
+  unsigned int rate=srate;
+
+  // capture gets a few more periods than playback, it only ever holds what we haven't gotten to yet
+  if (m_in.Open(indev,false,&rate,innch,bps,period,nperiods < 4 ? 4 : nperiods,usemmap)) return -1;
+  if (rate != (unsigned int)srate)
+    fprintf(stderr,"Note: input device %s is running at %uHz instead of %dHz\n",indev,rate,srate);
+
+  unsigned int outrate=rate;
+  if (m_out.Open(outdev,true,&outrate,outnch,m_in.bps,(int)m_in.period,nperiods,usemmap)) return -1;
+  if (outrate != rate)
+  {
+    fprintf(stderr,"Error: output device %s can't run at the input samplerate (%uHz, got %uHz)\n",outdev,rate,outrate);
+    return -1;
+  }
+  if (m_out.period != m_in.period)
+  {
+    fprintf(stderr,"Error: input and output devices disagree on the period size (%d vs %d frames)\n",
+      (int)m_in.period,(int)m_out.period);
+    return -1;
+  }
+
+  m_srate=(int)rate;
+  m_innch=m_in.nch;
+  m_outnch=m_out.nch;
+  m_bps=m_in.bps;
+  m_period=(int)m_in.period;
+  m_rtprio=rtprio;
+
+  m_linked = snd_pcm_link(m_in.pcm, m_out.pcm) >= 0;
+  if (!m_linked)
+    fprintf(stderr,"Note: input and output devices could not be linked, starting them separately\n");
+
+  float *buf=m_procbuf.Resize(m_period*(m_innch+m_outnch),false);
+  float **ptrs=m_procptrs.Resize(m_innch+m_outnch,false);
+  char *names=m_chnames.Resize(m_innch*16,false);
+  if (!buf || !ptrs || !names) return -1;
+  int x;
+  for (x = 0; x < m_innch+m_outnch; x ++) ptrs[x]=buf+x*m_period;
+  for (x = 0; x < m_innch; x ++)
+  {
+    if (m_innch == 2) strcpy(names+x*16,x ? "Right" : "Left");
+    else snprintf(names+x*16,16,"Input %d",x+1);
+  }
+
+  printf("ALSA: %s/%s, %d frames x %d periods%s%s\n",
+    m_in.use_mmap ? "mmap" : "read",
+    m_out.use_mmap ? "mmap" : "write",
+    m_period,(int)(m_out.bufsize/m_out.period),
+    m_linked ? ", linked" : "",
+    m_rtprio > 0 ? ", realtime" : "");
+
+  if (pthread_create(&m_thread,NULL,threadProc,this))
+  {
+    fprintf(stderr,"Error creating audio thread\n");
+    return -1;
+  }
+  m_thread_running=true;
+  return 0;
+}
+
+const char *audioStreamer_ALSA::GetChannelName(int idx)
+{
+  if (idx == (int)0x80000000) return (const char *)(size_t)(m_lat_total > 0 ? m_lat_total : m_period + (int)m_out.bufsize);
+  if (idx == (int)0x80000001) return (const char *)(size_t)(m_lat_out > 0 ? m_lat_out : (int)m_out.bufsize);
+  if (idx == (int)0x80000002) return (const char *)(size_t)m_xruns;
+  if (idx < 0 || idx >= m_innch) return NULL;
+  return m_chnames.Get()+idx*16;
+}
+
+// prepares both streams, fills playback with silence and starts them
+int audioStreamer_ALSA::startStreams()
+{
+  int err;
+  if ((err=snd_pcm_prepare(m_in.pcm)) < 0) return err;
+  if ((err=snd_pcm_prepare(m_out.pcm)) < 0) return err;
+
+  float **outptrs=m_procptrs.Get()+m_innch;
+  int x;
+  for (x = 0; x < m_outnch; x ++) memset(outptrs[x],0,m_period*sizeof(float));
+  int fill=(int)m_out.bufsize;
+  while (fill > 0)
+  {
+    const int n = fill < m_period ? fill : m_period;
+    if ((err=m_out.WriteFloats(outptrs,n)) < 0) return err;
+    fill-=n;
+  }
+
+  if (!m_linked && (err=snd_pcm_start(m_out.pcm)) < 0) return err;
+  return snd_pcm_start(m_in.pcm); // starts playback too when linked
+}
+
+void audioStreamer_ALSA::tp()
+{
+  if (m_rtprio > 0)
+  {
+    struct sched_param sp;
+    memset(&sp,0,sizeof(sp));
+    sp.sched_priority=m_rtprio;
+    int err=pthread_setschedparam(pthread_self(),SCHED_FIFO,&sp);
+    if (err) fprintf(stderr,"Warning: could not set SCHED_FIFO priority %d on the audio thread: %s\n",m_rtprio,strerror(err));
+  }
+
+  float **inptrs=m_procptrs.Get(), **outptrs=inptrs+m_innch;
+
+  int err=startStreams();
   while (!m_done)
   {
-    int a=in->Read(m_buf,m_bufsize);
-    if (a>0)
+    if (err < 0)
     {
-      int spllen=a*4/(m_bps); // a*8/m_bps/nch
-      float *inptrs[2], *outptrs[2];
-      inptrs[0]=m_procbuf;
-      inptrs[1]=m_procbuf+spllen;
-      outptrs[0]=m_procbuf+spllen*2;
-      outptrs[1]=m_procbuf+spllen*3;
-
-      pcmToFloats(m_buf,spllen,m_bps,2,inptrs[0],1);
-      pcmToFloats(m_buf+(m_bps/8),spllen,m_bps,2,inptrs[1],1);
-
-      if (m_splproc) m_splproc(inptrs,2,outptrs,2,spllen,m_srate);
-
-      floatsToPcm(outptrs[0],1,spllen,m_buf,m_bps,2);
-      floatsToPcm(outptrs[1],1,spllen,m_buf+(m_bps/8),m_bps,2);
-  
-      out->Write(m_buf,a);
+      if (err == -EPIPE || err == -ESTRPIPE) m_xruns++;
+      else usleep(100000); // device trouble, don't spin
+
+      snd_pcm_drop(m_in.pcm);
+      if (!m_linked) snd_pcm_drop(m_out.pcm);
+      err=startStreams();
+      continue;
     }
-    else
+
+    err=snd_pcm_wait(m_in.pcm,100);
+    if (err <= 0) continue; // timeout or error
+
+    snd_pcm_sframes_t avail=snd_pcm_avail_update(m_in.pcm);
+    if (avail < 0) { err=(int)avail; continue; }
+
+    while (avail >= m_period && !m_done)
     {
-      struct timespec s={0,1000*1000}; // sleep 1ms;
-      nanosleep(&s,NULL);
+      snd_pcm_sframes_t indelay=0;
+      if (snd_pcm_delay(m_in.pcm,&indelay) < 0) indelay=0;
+
+      if ((err=m_in.ReadFloats(inptrs,m_period)) < 0) break;
+      avail-=m_period;
+
+      m_splproc(inptrs,m_innch,outptrs,m_outnch,m_period,m_srate);
+
+      snd_pcm_sframes_t outavail=snd_pcm_avail_update(m_out.pcm);
+      if (outavail < 0) { err=(int)outavail; break; }
+      if (outavail < m_period) continue; // output clock is behind the input's, drop this period
+
+      if ((err=m_out.WriteFloats(outptrs,m_period)) < 0) break;
+
+      // what we just read waited indelay frames in the capture buffer, and will
+      // wait outdelay (less the period just written) in the playback buffer
+      snd_pcm_sframes_t outdelay=0;
+      if (snd_pcm_delay(m_out.pcm,&outdelay) >= 0 && outdelay > 0)
+      {
+        m_lat_out=(int)outdelay;
+        m_lat_total=(int)(indelay + outdelay) - m_period;
+      }
     }
   }
 }
 
+
 audioStreamer *create_audioStreamer_ALSA(const char *_cfg, SPLPROC proc)
 {
-  // todo: parse from cfg
   const char *indev="hw:0,0";
   const char *outdev="hw:0,0";
   int srate=48000;
-  int nch=2;
-  int bps=16;
-  int fs=1024;
-  int nf=16;
+  int innch=2, outnch=2;
+  int bps=33;
+  int period=256;
+  int nperiods=2;
+  int usemmap=1;
+  int rtprio=0;
   char tmp[4096];
   strncpy(tmp,_cfg?_cfg:"",sizeof(tmp));
   tmp[sizeof(tmp)-1]=0;
   char *cfg=tmp;
 
+  int bsize=0;
   while (cfg && *cfg)
   {
     char *p=cfg;
@@ -399,11 +556,16 @@ audioStreamer *create_audioStreamer_ALSA(const char *_cfg, SPLPROC proc)
     if (!strcasecmp(cfg,"in")) indev=p;
     else if (!strcasecmp(cfg,"out")) outdev=p;
     else if (!strcasecmp(cfg,"srate")) srate=atoi(p);
-    else if (!strcasecmp(cfg,"nch")) nch=atoi(p);
-    else if (!strcasecmp(cfg,"bps")) bps=atoi(p);
-    else if (!strcasecmp(cfg,"bsize")) fs=atoi(p);
-    else if (!strcasecmp(cfg,"nblock")) nf=atoi(p);
-    else 
+    else if (!strcasecmp(cfg,"nch")) innch=outnch=atoi(p);
+    else if (!strcasecmp(cfg,"innch")) innch=atoi(p);
+    else if (!strcasecmp(cfg,"outnch")) outnch=atoi(p);
+    else if (!strcasecmp(cfg,"bps")) bps=!strncasecmp(p,"float",5) ? 33 : atoi(p);
+    else if (!strcasecmp(cfg,"period")) { period=atoi(p); bsize=0; }
+    else if (!strcasecmp(cfg,"bsize")) bsize=atoi(p);
+    else if (!strcasecmp(cfg,"nblock")) nperiods=atoi(p);
+    else if (!strcasecmp(cfg,"mmap")) usemmap=atoi(p);
+    else if (!strcasecmp(cfg,"rt")) rtprio=atoi(p);
+    else
     {
 	    printf("unknown config item '%s'\n",cfg);
 	    return 0;
@@ -416,19 +578,25 @@ audioStreamer *create_audioStreamer_ALSA(const char *_cfg, SPLPROC proc)
     cfg=p;
   }
 
-  audioStreamer_ALSA *in=new audioStreamer_ALSA();
-  if (in->Open(indev,0,srate,nch,bps,fs,nf,-1))
+  if (bps != 16 && bps != 24 && bps != 32 && bps != 33)
   {
-    delete in;
+    printf("unsupported bps %d (use 16, 24, 32 or float)\n",bps);
     return 0;
   }
-  audioStreamer_ALSA *out=new audioStreamer_ALSA();
-  if (out->Open(outdev,1,srate,nch,bps,fs,nf,-1))
+  if (bsize > 0) // older configs gave the block size in bytes
   {
-    delete in;
-    delete out;
-    return 0;
+    period=bsize / (innch * (bps == 33 ? 4 : bps/8));
   }
+  if (innch < 1) innch=1;
+  if (outnch < 1) outnch=1;
+  if (period < 16) period=16;
+  if (nperiods < 2) nperiods=2;
 
-  return new audioStreamer_asiosim(in,out,fs,srate,bps,proc);
+  audioStreamer_ALSA *audio=new audioStreamer_ALSA(proc);
+  if (audio->Open(indev,outdev,srate,innch,outnch,bps,period,nperiods,!!usemmap,rtprio))
+  {
+    delete audio;
+    return 0;
+  }
+  return audio;
 }
@@ -1,5 +1,5 @@
 /*
-    NINJAM - audiostream_alsa.cpp
+    NINJAM - audiostream_jack.cpp
     Copyright (C) 2004-2005 Cockos Incorporated
 
     NINJAM is free software; you can redistribute it and/or modify
@@ -19,21 +19,23 @@
 
 /*
 
-  This file implements a audioStreamer that uses ALSA.
+  This file implements a audioStreamer that uses JACK.
   It only exposes the following functions:
 
-    audioStreamer *create_audioStreamer_ALSA(char *cfg, SPLPROC proc);
-  
-    cfg is a string that has a list of parameter/value pairs (space delimited) 
-    for the config:
-      in     - input device i.e. hw:0,0
-      out    - output device i.e. hw:0,0
-      srate  - sample rate i.e. 48000
-      bps    - bits/sample i.e. 16
-      nch    - channels i.e. 2
-      bsize  - block size (bytes) i.e. 2048
-      nblock - number of blocks i.e. 16
+    audioStreamer *create_audioStreamer_JACK(char *cfg, SPLPROC proc);
 
+    cfg is a string that has a list of parameter/value pairs (space delimited)
+    for the config (all optional):
+      name   - JACK client name i.e. ninjam
+      innch  - number of input ports i.e. 2
+      outnch - number of output ports i.e. 2
+
+  Output ports can be added, removed and renamed while running with
+  SetOutputChannels(), i.e. to give every remote user their own pair. Ports
+  are (un)registered on the calling thread, never in the process callback:
+  new ports are registered before the callback is told about them, and ports
+  going away are hidden from the callback first, then unregistered once it
+  has run again.
 
   (everything else in this file is used internally)
 
@@ -51,93 +53,235 @@
 #include <jack/jack.h>
 #include <string.h>
 
-#include "../WDL/pcmfmtcvt.h"
-
-#include "../WDL/ptrlist.h"
+#include "../WDL/wdlstring.h"
 #include "audiostream.h"
 
-static void audiostream_onunder() { }
-static void audiostream_onover() { }
-
-
-
+#define JACK_MAX_PORTS 128
 
 
 class audioStreamer_JACK : public audioStreamer
 {
     public:
-	audioStreamer_JACK( const char *cfg, SPLPROC proc );
+	audioStreamer_JACK( SPLPROC proc );
 	~audioStreamer_JACK();
 
+	int Open( const char *clientname, int innch, int outnch );
+
 	int process( jack_nframes_t nframes );
-	const char *GetChannelName(int idx)
-	{
-	    if (idx == 0) return "Left";
-	    if (idx == 1) return "Right";
-	    return NULL;
-	}
+	const char *GetChannelName(int idx);
+	int SetOutputChannels(int nch, const char * const *names);
+
     private:
+	jack_port_t *registerPort( int idx, bool is_output, const char *name );
+	void setOutputPortName( int idx, const char *name );
+
 	jack_client_t *client;
-	jack_port_t *in1, *in2;
-	jack_port_t *out1, *out2;
+	jack_port_t *inports[JACK_MAX_PORTS];
+	jack_port_t *outports[JACK_MAX_PORTS];
+	WDL_String outnames[JACK_MAX_PORTS];
+	char innames[JACK_MAX_PORTS][16];
+
+	volatile int process_outnch; // output ports the process callback may touch
+	volatile int process_cycles;
 
 	SPLPROC splproc;
 };
 
 
-int
-process_cb( jack_nframes_t nframes, audioStreamer_JACK *as ) {
-    return as->process( nframes );
+static int
+process_cb( jack_nframes_t nframes, void *as ) {
+    return ((audioStreamer_JACK *)as)->process( nframes );
 }
 
 
-//////////////// ALSA driver
-audioStreamer_JACK::audioStreamer_JACK( const char *cfg, SPLPROC proc) 
-{ 
-
+audioStreamer_JACK::audioStreamer_JACK( SPLPROC proc )
+{
     splproc = proc;
+    client = NULL;
+    memset( inports, 0, sizeof(inports) );
+    memset( outports, 0, sizeof(outports) );
+    process_outnch = 0;
+    process_cycles = 0;
+    m_innch = m_outnch = 0;
+    m_bps = 33;
+}
 
-    if ((client = jack_client_new ("ninjam")) == 0) {
+int audioStreamer_JACK::Open( const char *clientname, int innch, int outnch )
+{
+    jack_status_t status;
+    if ((client = jack_client_open (clientname, JackNullOption, &status)) == 0) {
 	fprintf (stderr, "jack server not running?\n");
-	exit(20);
+	return -1;
     }
 
-    jack_set_process_callback (client, (JackProcessCallback) process_cb, this);
+    jack_set_process_callback (client, process_cb, this);
+    m_srate = jack_get_sample_rate( client );
 
+    int x;
+    for (x = 0; x < innch; x ++) {
+	snprintf( innames[x], sizeof(innames[x]), "in%d", x+1 );
+	if (!(inports[x] = registerPort( x, false, innames[x] ))) return -1;
+	m_innch = x+1;
+    }
+    for (x = 0; x < outnch; x ++) {
+	if (!(outports[x] = registerPort( x, true, NULL ))) return -1;
+	m_outnch = x+1;
+    }
+    process_outnch = m_outnch;
 
-    out1 = jack_port_register (client, "out1", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
-    out2 = jack_port_register (client, "out2", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+    if (jack_activate (client)) {
+	fprintf (stderr, "cannot activate client\n");
+	return -1;
+    }
+    return 0;
+}
 
-    in1 = jack_port_register (client, "in1", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
-    in2 = jack_port_register (client, "in2", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+audioStreamer_JACK::~audioStreamer_JACK()
+{
+    if (client) {
+	jack_deactivate( client );
+	jack_client_close( client );
+    }
+}
 
-    if (jack_activate (client)) {
-	fprintf (stderr, "cannot activate client");
-	exit(20);
+jack_port_t *audioStreamer_JACK::registerPort( int idx, bool is_output, const char *name )
+{
+    char defname[32];
+    snprintf( defname, sizeof(defname), is_output ? "out%d" : "in%d", idx+1 );
+
+    jack_port_t *port = NULL;
+    if (name && *name)
+	port = jack_port_register (client, name, JACK_DEFAULT_AUDIO_TYPE, is_output ? JackPortIsOutput : JackPortIsInput, 0);
+    if (!port) {
+	name = defname;
+	port = jack_port_register (client, name, JACK_DEFAULT_AUDIO_TYPE, is_output ? JackPortIsOutput : JackPortIsInput, 0);
+    }
+    if (!port) fprintf (stderr, "cannot register JACK port %s\n", defname);
+    else if (is_output) outnames[idx].Set( name );
+    return port;
+}
+
+void audioStreamer_JACK::setOutputPortName( int idx, const char *name )
+{
+    char defname[32];
+    if (!name || !*name) {
+	snprintf( defname, sizeof(defname), "out%d", idx+1 );
+	name = defname;
     }
+    if (!strcmp( outnames[idx].Get(), name )) return;
+
+    // names that are taken (or invalid) leave the port as it was
+    if (!jack_port_set_name( outports[idx], name )) outnames[idx].Set( name );
 }
 
-audioStreamer_JACK::~audioStreamer_JACK() 
+const char *audioStreamer_JACK::GetChannelName(int idx)
 {
-    jack_deactivate( client );
-    sleep(1);
+    if (idx == (int)0x80000000) return (const char *)(size_t)(client ? jack_get_buffer_size( client ) * 2 : 0);
+    if (idx == (int)0x80000001) return (const char *)(size_t)(client ? jack_get_buffer_size( client ) : 0);
+    if (idx < 0 || idx >= m_innch) return NULL;
+    if (m_innch == 2) return idx ? "Right" : "Left";
+    return innames[idx];
+}
+
+int audioStreamer_JACK::SetOutputChannels(int nch, const char * const *names)
+{
+    if (!client) return m_outnch;
+    if (nch < 1) nch = 1;
+    else if (nch > JACK_MAX_PORTS) nch = JACK_MAX_PORTS;
+
+    int x;
+    const int cur = m_outnch;
+    for (x = 0; x < nch && x < cur; x ++) setOutputPortName( x, names ? names[x] : NULL );
+
+    if (nch > cur) {
+	for (x = cur; x < nch; x ++) {
+	    if (!(outports[x] = registerPort( x, true, names ? names[x] : NULL ))) break;
+	}
+	__sync_synchronize(); // ports must be visible before the count that publishes them
+	m_outnch = process_outnch = x;
+    }
+    else if (nch < cur) {
+	process_outnch = nch;
+
+	// wait until the process callback has started a cycle with the new count
+	const int start = process_cycles;
+	for (x = 0; x < 500 && process_cycles - start < 2; x ++) usleep(1000);
+
+	for (x = nch; x < cur; x ++) {
+	    jack_port_unregister( client, outports[x] );
+	    outports[x] = NULL;
+	}
+	m_outnch = nch;
+    }
+    return m_outnch;
 }
 
 int
 audioStreamer_JACK::process( jack_nframes_t nframes ) {
-    float *inports[2];
-    float *outports[2];
+    float *inbufs[JACK_MAX_PORTS];
+    float *outbufs[JACK_MAX_PORTS];
+
+    const int innch = m_innch, outnch = process_outnch;
+    __sync_synchronize();
 
-    inports[0] = (float *) jack_port_get_buffer( in1, nframes );
-    inports[1] = (float *) jack_port_get_buffer( in2, nframes );
-    outports[0] = (float *) jack_port_get_buffer( out1, nframes );
-    outports[1] = (float *) jack_port_get_buffer( out2, nframes );
+    int x;
+    for (x = 0; x < innch; x ++) inbufs[x] = (float *) jack_port_get_buffer( inports[x], nframes );
+    for (x = 0; x < outnch; x ++) outbufs[x] = (float *) jack_port_get_buffer( outports[x], nframes );
 
-    splproc( inports, 2, outports, 2, nframes, jack_get_sample_rate( client ) );
+    splproc( inbufs, innch, outbufs, outnch, nframes, jack_get_sample_rate( client ) );
+
+    process_cycles++;
     return 0;
 }
 
-audioStreamer *create_audioStreamer_JACK(const char *cfg, SPLPROC proc)
+audioStreamer *create_audioStreamer_JACK(const char *_cfg, SPLPROC proc)
 {
-  return new audioStreamer_JACK( cfg, proc);
+  const char *clientname="ninjam";
+  int innch=2, outnch=2;
+  char tmp[4096];
+  strncpy(tmp,_cfg?_cfg:"",sizeof(tmp));
+  tmp[sizeof(tmp)-1]=0;
+  char *cfg=tmp;
+
+  while (cfg && *cfg)
+  {
+    char *p=cfg;
+    while (*p && *p != ' ') p++;
+    if (!*p) break;
+    *p++=0;
+    while (*p == ' ') p++;
+    if (!*p)
+    {
+	    printf("config item '%s' has no parameter\n",cfg);
+	    return 0;
+    }
+
+    if (!strcasecmp(cfg,"name")) clientname=p;
+    else if (!strcasecmp(cfg,"innch")) innch=atoi(p);
+    else if (!strcasecmp(cfg,"outnch")) outnch=atoi(p);
+    else
+    {
+	    printf("unknown config item '%s'\n",cfg);
+	    return 0;
+    }
+
+    while (*p && *p != ' ') p++;
+    if (!*p) break;
+    *p++=0;
+    while (*p == ' ') p++;
+    cfg=p;
+  }
+
+  if (innch < 1) innch=1;
+  else if (innch > JACK_MAX_PORTS) innch=JACK_MAX_PORTS;
+  if (outnch < 1) outnch=1;
+  else if (outnch > JACK_MAX_PORTS) outnch=JACK_MAX_PORTS;
+
+  audioStreamer_JACK *audio=new audioStreamer_JACK(proc);
+  if (audio->Open(clientname,innch,outnch))
+  {
+    delete audio;
+    return 0;
+  }
+  return audio;
 }
@@ -44,6 +44,7 @@
 
 #include "../audiostream.h"
 #include "../njclient.h"
+#include "../njtrace.h"
 #include "../../WDL/dirscan.h"
 #include "../../WDL/lineparse.h"
 
@@ -67,6 +68,8 @@ WDL_String jesusdir;
 #endif
 
 int g_chat_scroll=0;
+NJTraceRing *g_trace;
+FILE *g_tracefp;
 int curs_ypos,curs_xpos;
 int color_map[8];
 int g_ui_inchat=0;
@@ -198,6 +201,87 @@ void audiostream_onsamples(float **inbuf, int innch, float **outbuf, int outnch,
   g_client->AudioProc(inbuf,innch, outbuf, outnch, len,srate);
 }
 
+#if !defined(_WIN32) && !defined(__APPLE__)
+int g_jack_peruser;
+WDL_PtrList<char> g_jack_userslots; // name of the remote user on each output pair after the first, NULL if free
+
+// gives every remote user an output pair of their own, which stays theirs
+// for as long as they're connected. outputs 0/1 keep the metronome and
+// local monitoring
+static void jackRouteUsers()
+{
+  const int nu=g_client->GetNumUsers();
+  int x,u;
+  for (x = 0; x < g_jack_userslots.GetSize(); x ++)
+  {
+    char *name=g_jack_userslots.Get(x);
+    if (!name) continue;
+    for (u = 0; u < nu && strcmp(g_client->GetUserState(u),name); u ++);
+    if (u == nu)
+    {
+      free(name);
+      g_jack_userslots.Set(x,NULL);
+    }
+  }
+
+  WDL_TypedBuf<int> userslot;
+  int *slots=userslot.Resize(nu);
+  for (u = 0; u < nu; u ++)
+  {
+    const char *name=g_client->GetUserState(u);
+    int freeslot=-1;
+    for (x = 0; x < g_jack_userslots.GetSize(); x ++)
+    {
+      const char *sn=g_jack_userslots.Get(x);
+      if (sn && !strcmp(sn,name)) break;
+      if (!sn && freeslot<0) freeslot=x;
+    }
+    if (x == g_jack_userslots.GetSize())
+    {
+      if (freeslot >= 0) g_jack_userslots.Set(x=freeslot,strdup(name));
+      else g_jack_userslots.Add(strdup(name));
+    }
+    slots[u]=x;
+  }
+  while (g_jack_userslots.GetSize() && !g_jack_userslots.Get(g_jack_userslots.GetSize()-1))
+    g_jack_userslots.Delete(g_jack_userslots.GetSize()-1);
+
+  const int nch=2+2*g_jack_userslots.GetSize();
+  WDL_TypedBuf<char> namebuf;
+  WDL_TypedBuf<const char *> names;
+  char *nb=namebuf.Resize(nch*64);
+  const char **np=names.Resize(nch);
+  for (x = 0; x < nch; x ++)
+  {
+    const char *user=x>=2 ? g_jack_userslots.Get(x/2-1) : NULL;
+    np[x]=NULL;
+    if (!user) continue;
+    snprintf(nb+x*64,64,"%.58s_%c",user,(x&1)?'R':'L');
+    char *p=nb+x*64;
+    while (*p) { if (*p == ':') *p='_'; p++; } // not allowed in JACK port names
+    np[x]=nb+x*64;
+  }
+
+  // add ports before routing to them, route away from ports before removing them
+  if (nch > g_audio->m_outnch) g_audio->SetOutputChannels(nch,np);
+
+  for (u = 0; u < nu; u ++)
+  {
+    int i,ch;
+    for (i = 0; (ch=g_client->EnumUserChannels(u,i)) >= 0; i ++)
+    {
+      int outch=0;
+      g_client->GetUserChannelState(u,ch,NULL,NULL,NULL,NULL,NULL,&outch);
+      const int want=(2+2*slots[u]) | (outch&1024);
+      if (outch != want)
+        g_client->SetUserChannelState(u,ch,false,false,false,0.0f,false,0.0f,false,false,false,false,true,want);
+    }
+  }
+
+  if (nch <= g_audio->m_outnch) g_audio->SetOutputChannels(nch,np);
+}
+#endif
+
 
 int g_sel_x, g_sel_ypos,g_sel_ycat;
 
@@ -815,15 +899,23 @@ void usage(int noexit=0)
     "  -audiostr device_name[,output_device_name]\n"
 #else
     "  -jack (to use JACK)\n"
+    "  -jackconfig \"option value [option value ...]\"\n"
+    "     JACK audio options are:\n"
+    "       name ninjam  -- set client name\n"
+    "       innch 2      -- set number of input ports\n"
+    "       outnch 2     -- set number of output ports\n"
+    "  -jackperuser (JACK, with an output pair for each remote user)\n"
     "  -alsaconfig \"option value [option value ...]\"\n"
     "     ALSA audio options are:\n"
     "       in hw:0,0    -- set input device\n"
     "       out hw:0,0   -- set output device\n"
     "       srate 48000  -- set samplerate\n"
-    "       nch 2        -- set channels\n"
-    "       bps 16       -- set bits/sample\n"
-    "       bsize 2048   -- set blocksize (bytes)\n"
-    "       nblock 16    -- set number of blocks\n"
+    "       nch 2        -- set channels (innch/outnch set them separately)\n"
+    "       bps float    -- set sample format (16, 24, 32 or float)\n"
+    "       period 256   -- set period size (frames)\n"
+    "       nblock 2     -- set number of periods\n"
+    "       mmap 1       -- use mmap access (0 for read/write)\n"
+    "       rt 0         -- SCHED_FIFO priority of the audio thread (0 for none)\n"
 #endif
 #endif
 
@@ -832,7 +924,8 @@ void usage(int noexit=0)
     "  -nosavesourcefiles   -- don't save source files for remixing\n"
 
     "  -writewav            -- writes a .wav of the jam in the session directory\n"
-    "  -writeogg <bitrate>  -- writes a .ogg of the jam (bitrate 64-256)..\n");
+    "  -writeogg <bitrate>  -- writes a .ogg of the jam (bitrate 64-256)..\n"
+    "  -tracefile <file>    -- writes an audio thread trace (read it with njtrace)\n");
 
   if (!noexit) exit(1);
 }
@@ -966,6 +1059,7 @@ int main(int argc, char **argv)
 
   printf("NINJAM v0.01a ALPHA curses client, compiled " __DATE__ " at " __TIME__ "\nCopyright (C) 2004-2005 Cockos, Inc.\n\n");
   const char *audioconfigstr=NULL;
+  int use_jack=0;
   g_client=new NJClient;
   g_client->config_savelocalaudio=1;
   g_client->LicenseAgreementCallback=licensecallback;
@@ -1013,7 +1107,16 @@ int main(int argc, char **argv)
       {
         audioconfigstr="";
       }
-      else if (!stricmp(argv[p],"-jack")) audioconfigstr="JACK";
+      else if (!stricmp(argv[p],"-jack")) use_jack=1;
+      else if (!stricmp(argv[p],"-jackconfig"))
+      {
+        if (++p >= argc) usage();
+        audioconfigstr=argv[p];
+        use_jack=1;
+      }
+#if !defined(_WIN32) && !defined(__APPLE__)
+      else if (!stricmp(argv[p],"-jackperuser")) use_jack=g_jack_peruser=1;
+#endif
       else if (!stricmp(argv[p],"-alsaconfig"))
       {
         if (++p >= argc) usage();
@@ -1053,6 +1156,19 @@ int main(int argc, char **argv)
         jesusdir.Set(argv[p]);
       }
 #endif
+      else if (!stricmp(argv[p],"-tracefile"))
+      {
+        if (++p >= argc) usage();
+        g_tracefp=fopen(argv[p],"wb");
+        if (!g_tracefp)
+        {
+          printf("Error opening trace file %s\n",argv[p]);
+          return 1;
+        }
+        NJTraceRing::WriteFileHeader(g_tracefp);
+        g_trace=new NJTraceRing;
+        g_client->AudioTrace=g_trace;
+      }
       else if (!stricmp(argv[p],"-sessiondir"))
       {
         if (++p >= argc) usage();
@@ -1099,7 +1215,7 @@ int main(int argc, char **argv)
 #ifdef __APPLE__
     g_audio=create_audioStreamer_CoreAudio(&dev_name_in,48000,2,16,audiostream_onsamples);
 #else
-    if (dev_name_in && !strcmp(dev_name_in,"JACK"))
+    if (use_jack)
 	g_audio=create_audioStreamer_JACK(dev_name_in,audiostream_onsamples);
     else g_audio=create_audioStreamer_ALSA(dev_name_in,audiostream_onsamples);
 #endif
@@ -1434,6 +1550,7 @@ int main(int argc, char **argv)
   {
     if (g_client->Run()) 
     {
+      if (g_trace) g_trace->WriteToFile(g_tracefp);
 #ifdef _WIN32
       MSG msg;
       while (PeekMessage(&msg,NULL,0,0,PM_REMOVE))
@@ -1758,6 +1875,13 @@ int main(int argc, char **argv)
         }
       }
 
+#if !defined(_WIN32) && !defined(__APPLE__)
+      if (g_jack_peruser && g_client->HasUserInfoChanged())
+      {
+        jackRouteUsers();
+        g_need_disp_update=1;
+      }
+#endif
       if (g_ui_state < 2 && (g_need_disp_update||g_client->HasUserInfoChanged()||
 #ifdef _WIN32
 GetTickCount()>=nextupd 
@@ -1815,8 +1939,25 @@ time(NULL) >= nextupd
 
   printf("Shutting down\n");
 
+  {
+    const int lat=(int)(size_t)g_audio->GetChannelName(0x80000000);
+    const int xruns=(int)(size_t)g_audio->GetChannelName(0x80000002);
+    if (lat > 0 && g_audio->m_srate > 0)
+      printf("Audio round trip latency %.1fms, %d xruns\n",lat*1000.0/g_audio->m_srate,xruns);
+  }
+
   delete g_audio;
 
+  if (g_trace)
+  {
+    g_client->AudioTrace=NULL;
+    g_trace->WriteToFile(g_tracefp);
+    if (g_trace->GetDropped()) printf("Audio trace dropped %d events\n",g_trace->GetDropped());
+    fclose(g_tracefp);
+    delete g_trace;
+    g_trace=NULL;
+  }
+
 
   delete g_client->waveWrite;
   g_client->waveWrite=0;
@@ -0,0 +1,747 @@
+/*
+    NINJAM load generator - njloadgen.cpp
+    Copyright (C) 2005-2017 Cockos Incorporated
+
+    NINJAM is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    NINJAM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NINJAM; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  njloadgen connects a number of synthetic users to a server and measures
+  how well it keeps up. It talks the protocol directly through
+  Net_Connection/mpb (no audio, no codec), so hundreds of users can run from
+  one process.
+
+  Each user uploads an interval on every channel each interval, paced in
+  chunks over the interval like a real client. The payload is either a
+  pre-encoded file (-file, sent as-is each interval) or random bytes sized
+  from -bitrate. Users subscribe to all, none, or the next N users.
+
+  The transfer GUID carries the uploading user, channel, sequence number and
+  send time, so receivers can measure relay latency without any lookups:
+    begin latency: upload begin sent -> download begin received
+    end latency:   last upload write sent -> last download write received
+
+  The server's configuration must allow the users in: anonymous users (or
+  use -user/-pass with a matching account), enough MaxUsers and MaxChannels.
+
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#endif
+
+#include <stdio.h>
+#include <signal.h>
+
+#include "../netmsg.h"
+#include "../mpb.h"
+#include "../../WDL/sha.h"
+#include "../../WDL/wdlstring.h"
+#include "../../WDL/rng.h"
+#include "../../WDL/ptrlist.h"
+#include "../../WDL/wdlstring.h"
+#include "../../WDL/wdlcstring.h"
+
+
+#define LG_MAXCH 32
+#define LG_SEQ_HIST 64   // remembered uploads per channel, for end latency
+#define LG_WARMUP_SEQ 2  // first intervals are not counted (subscriptions settling)
+#define LG_MAX_WRITE 8192
+
+#ifndef MAKE_NJ_FOURCC
+#define MAKE_NJ_FOURCC(A,B,C,D) ((A) | ((B)<<8) | ((C)<<16) | ((D)<<24))
+#endif
+
+static double getTimeMs()
+{
+#ifdef _WIN32
+  return (double)GetTickCount();
+#else
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec*1000.0 + tv.tv_usec/1000.0;
+#endif
+}
+
+
+// configuration
+static int g_numusers=8, g_numch=1, g_bitrate=64, g_chunkms=100, g_duration=60, g_report=5;
+static int g_subscribe=-1; // -1=all, 0=none, N=next N users
+static int g_rampms=10;
+static int g_userinfo_delta=1; // use MESSAGE_SERVER_USERINFO_DELTA if the server has it
+static int g_serverpid;
+static const char *g_userpfx="anonymous:lg", *g_pass="";
+static WDL_String g_namepfx; // g_userpfx as the server shows it, see setNamePrefix()
+static WDL_HeapBuf g_filedata;
+
+// statistics
+static struct
+{
+  double bytes_up, bytes_down;
+  double bytes_userinfo, bytes_sub; // userinfo received, subscriptions sent
+  int userinfo_msgs;
+  int uploads, uploads_failed; // failed = local send queue full
+  int downloads_begun, downloads_done;
+  double expected; // downloads expected from uploads made after warmup
+  WDL_TypedBuf<float> lat_begin, lat_end;
+} g_stats;
+
+static double g_start_time;
+
+
+class LoadUser
+{
+public:
+  LoadUser(int idx) : m_idx(idx), m_state(0), m_bpm(120), m_bpi(8), m_seq(-1), m_done_seq(-1), m_interval_start(0.0), m_nextchunk(0.0)
+  {
+    memset(m_sent,0,sizeof(m_sent));
+    int *sm=m_submask.Resize(g_numusers);
+    if (sm) memset(sm,0,g_numusers*sizeof(int));
+    double *st=m_subtime.Resize(g_numusers);
+    for (int x = 0; st && x < g_numusers; x ++) st[x]=0.0;
+    memset(m_end_sent,0,sizeof(m_end_sent));
+  }
+  ~LoadUser() { }
+
+  int m_idx;
+  int m_state; // 0=connecting, 1=authed, 2=done uploading, -1=dead
+  WDL_String m_name;
+  Net_Connection m_con;
+
+  int m_bpm, m_bpi;
+  int m_seq; // sequence of the interval being uploaded, -1 if none
+  int m_done_seq; // last interval whose upload was finished
+  double m_interval_start, m_nextchunk;
+  unsigned char m_guid[LG_MAXCH][16];
+  int m_sent[LG_MAXCH];
+  double m_end_sent[LG_MAXCH][LG_SEQ_HIST];
+  WDL_TypedBuf<int> m_submask; // per user index, channels we subscribed to
+  WDL_TypedBuf<double> m_subtime; // per user index, when we first subscribed
+  WDL_TypedBuf<int> m_idmap; // MESSAGE_SERVER_USERINFO_DELTA id -> user index, -1 if none
+
+  void Send(Net_Message *msg, int len)
+  {
+    if (m_con.Send(msg)<0) g_stats.uploads_failed++;
+    else g_stats.bytes_up+=len;
+  }
+
+  void FinishInterval(double now);
+  void StartInterval(double now);
+  void RunUpload(double now);
+  void OnMessage(Net_Message *msg, double now);
+};
+
+static WDL_PtrList<LoadUser> g_users;
+
+static void makeGuid(unsigned char *guid, int useridx, int ch, int seq, double t)
+{
+  // user:4, ch:1, seq:4, time in ms since start:4, 3 random
+  memset(guid,0,16);
+  unsigned int ms=(unsigned int)(t-g_start_time);
+  guid[0]=(unsigned char)(useridx>>24); guid[1]=(unsigned char)(useridx>>16); guid[2]=(unsigned char)(useridx>>8); guid[3]=(unsigned char)useridx;
+  guid[4]=(unsigned char)ch;
+  guid[5]=(unsigned char)(seq>>24); guid[6]=(unsigned char)(seq>>16); guid[7]=(unsigned char)(seq>>8); guid[8]=(unsigned char)seq;
+  guid[9]=(unsigned char)(ms>>24); guid[10]=(unsigned char)(ms>>16); guid[11]=(unsigned char)(ms>>8); guid[12]=(unsigned char)ms;
+  WDL_RNG_bytes(guid+13,3);
+}
+
+static void parseGuid(const unsigned char *guid, int *useridx, int *ch, int *seq, double *t)
+{
+  *useridx=(guid[0]<<24)|(guid[1]<<16)|(guid[2]<<8)|guid[3];
+  *ch=guid[4];
+  *seq=(guid[5]<<24)|(guid[6]<<16)|(guid[7]<<8)|guid[8];
+  *t=g_start_time + (double)(unsigned int)((guid[9]<<24)|(guid[10]<<16)|(guid[11]<<8)|guid[12]);
+}
+
+static int payloadSize(int bpm, int bpi)
+{
+  if (g_filedata.GetSize()) return g_filedata.GetSize();
+  double secs=bpi*60.0/bpm;
+  return (int)(g_bitrate*1000.0/8.0*secs);
+}
+
+// the server drops a leading "room/" from the login name, and for anonymous
+// logins drops "anonymous:", changes '@' and '.' to '_' and appends @host
+static void setNamePrefix()
+{
+  const char *s=g_userpfx;
+  const char *sep=strchr(s,'/');
+  if (sep) s=sep+1;
+  if (!strncmp(s,"anonymous:",10))
+  {
+    g_namepfx.Set(s+10);
+    for (char *p=g_namepfx.Get(); *p; p ++) if (*p == '@' || *p == '.') *p='_';
+  }
+  else g_namepfx.Set(s);
+}
+
+// loadgen users are shown as <prefix><idx>[@host], idx is the digits that follow the prefix
+static int userIndexFromName(const char *un)
+{
+  const int pl=g_namepfx.GetLength();
+  if (!un || strncmp(un,g_namepfx.Get(),pl)) return -1;
+  const char *s=un+pl;
+  if (*s < '0' || *s > '9') return -1;
+  int idx=0;
+  for (; *s >= '0' && *s <= '9'; s ++)
+  {
+    idx=idx*10 + (*s-'0');
+    if (idx >= g_numusers) return -1;
+  }
+  return !*s || *s == '@' ? idx : -1;
+}
+
+static int wantsSubscribe(int fromidx, int toidx)
+{
+  if (fromidx == toidx || !g_subscribe) return 0;
+  if (g_subscribe < 0) return 1;
+  int d=toidx-fromidx;
+  if (d < 0) d+=g_numusers;
+  return d <= g_subscribe;
+}
+
+void LoadUser::StartInterval(double now)
+{
+  FinishInterval(now);
+  m_seq++;
+
+  const int sz=payloadSize(m_bpm,m_bpi);
+  const int counting = m_seq >= LG_WARMUP_SEQ;
+  int subscribers=0;
+  if (counting)
+  {
+    for (int x = 0; x < g_users.GetSize(); x ++)
+    {
+      LoadUser *u=g_users.Get(x);
+      // only count subscriptions the server has certainly seen by now
+      if (u->m_state == 1 && u->m_submask.Get()[m_idx] && now > u->m_subtime.Get()[m_idx]+1000.0) subscribers++;
+    }
+  }
+
+  for (int ch = 0; ch < g_numch; ch ++)
+  {
+    makeGuid(m_guid[ch],m_idx,ch,m_seq,now);
+    m_sent[ch]=0;
+
+    mpb_client_upload_interval_begin bh;
+    memcpy(bh.guid,m_guid[ch],16);
+    bh.fourcc=MAKE_NJ_FOURCC('O','G','G','v');
+    bh.estsize=sz;
+    bh.chidx=ch;
+    Send(bh.build(),0);
+    g_stats.uploads++;
+    if (counting) g_stats.expected+=subscribers;
+  }
+  m_interval_start=now;
+  m_nextchunk=now;
+}
+
+void LoadUser::FinishInterval(double now)
+{
+  if (m_seq <= m_done_seq) return; // no upload in progress
+  for (int ch = 0; ch < g_numch; ch ++)
+  {
+    mpb_client_upload_interval_write wh;
+    memcpy(wh.guid,m_guid[ch],16);
+    wh.flags=1;
+    Send(wh.build(),0);
+    m_end_sent[ch][m_seq%LG_SEQ_HIST]=now;
+  }
+  m_done_seq=m_seq;
+}
+
+void LoadUser::RunUpload(double now)
+{
+  if (m_state != 1) return;
+  const double ilen=m_bpi*60000.0/m_bpm;
+  if (m_seq < 0) StartInterval(now);
+  else if (now >= m_interval_start+ilen) StartInterval(m_interval_start+ilen);
+  if (now < m_nextchunk) return;
+  m_nextchunk=now+g_chunkms;
+
+  const int sz=payloadSize(m_bpm,m_bpi);
+  double frac=(now-m_interval_start)/ilen + g_chunkms/ilen;
+  if (frac > 1.0) frac=1.0;
+  const int want=(int)(sz*frac);
+
+  for (int ch = 0; ch < g_numch; ch ++)
+  {
+    while (m_sent[ch] < want)
+    {
+      int l=want-m_sent[ch];
+      if (l > LG_MAX_WRITE) l=LG_MAX_WRITE;
+
+      static WDL_HeapBuf rnd;
+      const void *data;
+      if (g_filedata.GetSize()) data=(char*)g_filedata.Get()+m_sent[ch];
+      else
+      {
+        if (rnd.GetSize() < LG_MAX_WRITE)
+        {
+          rnd.Resize(LG_MAX_WRITE);
+          WDL_RNG_bytes(rnd.Get(),rnd.GetSize());
+        }
+        data=rnd.Get();
+      }
+
+      mpb_client_upload_interval_write wh;
+      memcpy(wh.guid,m_guid[ch],16);
+      wh.flags=0;
+      wh.audio_data=data;
+      wh.audio_data_len=l;
+      Send(wh.build(),l);
+      m_sent[ch]+=l;
+    }
+  }
+}
+
+void LoadUser::OnMessage(Net_Message *msg, double now)
+{
+  g_stats.bytes_down+=msg->get_size();
+  switch (msg->get_type())
+  {
+    case MESSAGE_SERVER_AUTH_CHALLENGE:
+      {
+        mpb_server_auth_challenge cha;
+        if (cha.parse(msg)) break;
+
+        char user[512];
+        snprintf(user,sizeof(user),"%s%d",g_userpfx,m_idx);
+
+        mpb_client_auth_user repl;
+        repl.username=user;
+        repl.client_version=PROTO_VER_CUR;
+        if (cha.license_agreement) repl.client_caps|=1;
+        if (g_userinfo_delta && (cha.server_caps & SERVER_CAP_USERINFO_DELTA)) repl.client_caps|=CLIENT_CAP_USERINFO_DELTA;
+        m_con.SetKeepAlive((cha.server_caps>>8)&0xff);
+
+        WDL_SHA1 tmp;
+        tmp.add(user,strlen(user));
+        tmp.add(":",1);
+        tmp.add(g_pass,strlen(g_pass));
+        tmp.result(repl.passhash);
+        tmp.reset();
+        tmp.add(repl.passhash,sizeof(repl.passhash));
+        tmp.add(cha.challenge,sizeof(cha.challenge));
+        tmp.result(repl.passhash);
+        m_con.Send(repl.build());
+      }
+    break;
+    case MESSAGE_SERVER_AUTH_REPLY:
+      {
+        mpb_server_auth_reply ar;
+        if (ar.parse(msg)) break;
+        if (!(ar.flag&1))
+        {
+          printf("user %d: refused: %s\n",m_idx,ar.errmsg?ar.errmsg:"");
+          m_state=-1;
+          break;
+        }
+        if (ar.errmsg) m_name.Set(ar.errmsg);
+        if (ar.maxchan < g_numch) printf("user %d: server only allows %d channels\n",m_idx,ar.maxchan);
+
+        mpb_client_set_channel_info sci;
+        char buf[32];
+        for (int ch = 0; ch < g_numch && ch < ar.maxchan; ch ++)
+        {
+          snprintf(buf,sizeof(buf),"lg%d",ch);
+          sci.build_add_rec(buf,0,0,0);
+        }
+        m_con.Send(sci.build());
+        m_state=1;
+      }
+    break;
+    case MESSAGE_SERVER_CONFIG_CHANGE_NOTIFY:
+      {
+        mpb_server_config_change_notify ccn;
+        if (ccn.parse(msg)) break;
+        if (ccn.beats_minute > 0) m_bpm=ccn.beats_minute;
+        if (ccn.beats_interval > 0) m_bpi=ccn.beats_interval;
+      }
+    break;
+    case MESSAGE_SERVER_USERINFO_CHANGE_NOTIFY:
+      {
+        g_stats.bytes_userinfo+=msg->get_size();
+        g_stats.userinfo_msgs++;
+        mpb_server_userinfo_change_notify ucn;
+        if (ucn.parse(msg)) break;
+        mpb_client_set_usermask su;
+        int offs=0, cnt=0;
+        int a=0, cid=0, p=0, f=0;
+        short v=0;
+        const char *un=0, *chn=0;
+        while ((offs=ucn.parse_get_rec(offs,&a,&cid,&v,&p,&f,&un,&chn))>0)
+        {
+          const int idx=userIndexFromName(un);
+          if (idx < 0 || cid < 0 || cid >= LG_MAXCH || !wantsSubscribe(m_idx,idx)) continue;
+
+          int *mask=m_submask.Get()+idx;
+          if (!*mask) m_subtime.Get()[idx]=now;
+          if (a) *mask |= 1<<cid;
+          else *mask &= ~(1<<cid);
+          su.build_add_rec(un,*mask);
+          cnt++;
+        }
+        if (cnt)
+        {
+          Net_Message *m=su.build();
+          g_stats.bytes_sub+=m->get_size();
+          m_con.Send(m);
+        }
+      }
+    break;
+    case MESSAGE_SERVER_USERINFO_DELTA:
+      {
+        g_stats.bytes_userinfo+=msg->get_size();
+        g_stats.userinfo_msgs++;
+        mpb_server_userinfo_delta ud;
+        if (ud.parse(msg)) break;
+        mpb_client_set_usermask_id su;
+        int offs=0, cnt=0;
+        int t=0, id=0, cid=0, p=0, f=0;
+        short v=0;
+        const char *name=0;
+        while ((offs=ud.parse_get_rec(offs,&t,&id,&cid,&v,&p,&f,&name))>0)
+        {
+          if (id >= m_idmap.GetSize())
+          {
+            const int oldsz=m_idmap.GetSize();
+            if (!m_idmap.ResizeOK(id+1,false)) continue;
+            for (int x = oldsz; x <= id; x ++) m_idmap.Get()[x]=-1;
+          }
+          int *idx=m_idmap.Get()+id;
+          if (t == USERINFO_DELTA_ADD_USER)
+          {
+            *idx=userIndexFromName(name);
+            continue;
+          }
+          if (t == USERINFO_DELTA_REMOVE_USER)
+          {
+            if (*idx >= 0) m_submask.Get()[*idx]=0;
+            *idx=-1;
+            continue;
+          }
+          if (*idx < 0 || !wantsSubscribe(m_idx,*idx)) continue;
+
+          int *mask=m_submask.Get()+*idx;
+          if (cid < 0 || cid >= LG_MAXCH) continue;
+          if (!*mask) m_subtime.Get()[*idx]=now;
+          if (t == USERINFO_DELTA_SET_CHANNEL) *mask |= 1<<cid;
+          else *mask &= ~(1<<cid);
+          su.build_add_rec(id,*mask);
+          cnt++;
+        }
+        if (cnt)
+        {
+          Net_Message *m=su.build();
+          g_stats.bytes_sub+=m->get_size();
+          m_con.Send(m);
+        }
+      }
+    break;
+    case MESSAGE_SERVER_DOWNLOAD_INTERVAL_BEGIN:
+      {
+        mpb_server_download_interval_begin dib;
+        if (dib.parse(msg) || !dib.fourcc) break;
+        int uidx,ch,seq;
+        double t;
+        parseGuid(dib.guid,&uidx,&ch,&seq,&t);
+        if (seq < LG_WARMUP_SEQ) break;
+        g_stats.downloads_begun++;
+        g_stats.lat_begin.Add((float)(now-t));
+      }
+    break;
+    case MESSAGE_SERVER_DOWNLOAD_INTERVAL_WRITE:
+      {
+        mpb_server_download_interval_write diw;
+        if (diw.parse(msg) || !(diw.flags&1)) break;
+        int uidx,ch,seq;
+        double t;
+        parseGuid(diw.guid,&uidx,&ch,&seq,&t);
+        if (seq < LG_WARMUP_SEQ || uidx < 0 || uidx >= g_users.GetSize() || ch < 0 || ch >= LG_MAXCH) break;
+        g_stats.downloads_done++;
+        LoadUser *src=g_users.Get(uidx);
+        if (src->m_done_seq >= seq && src->m_done_seq < seq+LG_SEQ_HIST)
+          g_stats.lat_end.Add((float)(now-src->m_end_sent[ch][seq%LG_SEQ_HIST]));
+      }
+    break;
+  }
+}
+
+
+static int cmpfloat(const void *a, const void *b)
+{
+  const float fa=*(const float*)a, fb=*(const float*)b;
+  return fa < fb ? -1 : fa > fb ? 1 : 0;
+}
+
+static void latencyStr(WDL_TypedBuf<float> *lat, char *buf, int bufsz)
+{
+  const int n=lat->GetSize();
+  if (!n) { lstrcpyn_safe(buf,"n/a",bufsz); return; }
+  float *p=lat->Get();
+  qsort(p,n,sizeof(float),cmpfloat);
+  snprintf(buf,bufsz,"p50 %.1fms p95 %.1fms p99 %.1fms max %.1fms",p[n/2],p[(n*95)/100],p[(n*99)/100],p[n-1]);
+}
+
+static double getServerCPUTime() // seconds of user+system time, or -1
+{
+#ifdef __linux__
+  if (!g_serverpid) return -1.0;
+  char fn[64], buf[1024];
+  snprintf(fn,sizeof(fn),"/proc/%d/stat",g_serverpid);
+  FILE *fp=fopen(fn,"r");
+  if (!fp) return -1.0;
+  int l=(int)fread(buf,1,sizeof(buf)-1,fp);
+  fclose(fp);
+  if (l<1) return -1.0;
+  buf[l]=0;
+  const char *p=strrchr(buf,')'); // comm may contain spaces
+  if (!p) return -1.0;
+  // fields after ')': state(3) ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt utime(14) stime(15)
+  int field=2;
+  unsigned long long ut=0, st=0;
+  while (*p && field < 15)
+  {
+    if (*p++ == ' ')
+    {
+      field++;
+      if (field == 14) ut=strtoull(p,NULL,10);
+      else if (field == 15) st=strtoull(p,NULL,10);
+    }
+  }
+  return (double)(ut+st)/(double)sysconf(_SC_CLK_TCK);
+#else
+  return -1.0;
+#endif
+}
+
+static void report(double now, double *lasttime, double *lastcpu, int final)
+{
+  int connected=0;
+  for (int x = 0; x < g_users.GetSize(); x ++) if (g_users.Get(x)->m_state > 0) connected++;
+
+  const double elapsed=(now-g_start_time)/1000.0;
+  char lb[256], le[256];
+  latencyStr(&g_stats.lat_begin,lb,sizeof(lb));
+  latencyStr(&g_stats.lat_end,le,sizeof(le));
+
+  char cpubuf[64];
+  cpubuf[0]=0;
+  const double cpu=getServerCPUTime();
+  if (cpu >= 0.0)
+  {
+    if (*lastcpu >= 0.0 && now > *lasttime) snprintf(cpubuf,sizeof(cpubuf)," server cpu %.1f%%",(cpu-*lastcpu)*100000.0/(now-*lasttime));
+    *lastcpu=cpu;
+  }
+  *lasttime=now;
+
+  const double missing=g_stats.expected-g_stats.downloads_done;
+  printf("%s%.0fs: %d/%d users, up %.1fKB/s down %.1fKB/s, %d uploads (%d sends failed), %d/%.0f downloads done%s\n",
+    final?"final ":"",elapsed,connected,g_numusers,
+    g_stats.bytes_up/1024.0/(elapsed>0?elapsed:1),g_stats.bytes_down/1024.0/(elapsed>0?elapsed:1),
+    g_stats.uploads,g_stats.uploads_failed,g_stats.downloads_done,g_stats.expected,cpubuf);
+  printf("  begin latency: %s\n  end latency:   %s\n",lb,le);
+  printf("  userinfo: %.1fKB in %d messages, subscriptions %.1fKB\n",g_stats.bytes_userinfo/1024.0,g_stats.userinfo_msgs,g_stats.bytes_sub/1024.0);
+  if (final) printf("  dropped/incomplete transfers: %.0f\n",missing>0?missing:0);
+  fflush(stdout);
+}
+
+
+static int g_done;
+static void sigfunc(int sig)
+{
+  if (sig == SIGINT) g_done=1;
+}
+
+static void usage()
+{
+  printf("Usage: njloadgen hostname[:port] [options]\n"
+         "Options:\n"
+         "  -users <n>          number of users (default 8)\n"
+         "  -channels <n>       channels per user (default 1)\n"
+         "  -bitrate <kbps>     payload rate per channel, if no -file (default 64)\n"
+         "  -file <file.ogg>    upload this pre-encoded file each interval\n"
+         "  -subscribe all|none|<n> subscribe to everybody, nobody, or the next n users (default all)\n"
+         "  -chunkms <ms>       time between upload writes (default 100)\n"
+         "  -rampms <ms>        delay between user connects (default 10)\n"
+         "  -duration <s>       run time (default 60, 0=until ctrl+c)\n"
+         "  -report <s>         report interval (default 5)\n"
+         "  -serverpid <pid>    report CPU use of this (local) server process\n"
+         "  -user <prefix>      username prefix, index is appended (default anonymous:lg)\n"
+         "  -pass <password>\n"
+         "  -userinfo delta|legacy  userinfo protocol to ask for (default delta, if the server has it)\n"
+         "Exits nonzero if any expected transfer was not completed.\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) usage();
+  for (int p = 2; p < argc; p ++)
+  {
+    if (p+1 >= argc) usage();
+    const char *a=argv[p], *v=argv[++p];
+    if (!stricmp(a,"-users")) g_numusers=atoi(v);
+    else if (!stricmp(a,"-channels")) g_numch=atoi(v);
+    else if (!stricmp(a,"-bitrate")) g_bitrate=atoi(v);
+    else if (!stricmp(a,"-subscribe")) g_subscribe=!stricmp(v,"all")?-1:!stricmp(v,"none")?0:atoi(v);
+    else if (!stricmp(a,"-chunkms")) g_chunkms=atoi(v);
+    else if (!stricmp(a,"-rampms")) g_rampms=atoi(v);
+    else if (!stricmp(a,"-duration")) g_duration=atoi(v);
+    else if (!stricmp(a,"-report")) g_report=atoi(v);
+    else if (!stricmp(a,"-serverpid")) g_serverpid=atoi(v);
+    else if (!stricmp(a,"-user")) g_userpfx=v;
+    else if (!stricmp(a,"-pass")) g_pass=v;
+    else if (!stricmp(a,"-userinfo")) g_userinfo_delta=!stricmp(v,"delta");
+    else if (!stricmp(a,"-file"))
+    {
+      FILE *fp=fopen(v,"rb");
+      if (!fp) { printf("Error opening %s\n",v); return 1; }
+      fseek(fp,0,SEEK_END);
+      int l=(int)ftell(fp);
+      fseek(fp,0,SEEK_SET);
+      if (l < 1 || !g_filedata.Resize(l) || (int)fread(g_filedata.Get(),1,l,fp) != l) { printf("Error reading %s\n",v); fclose(fp); return 1; }
+      fclose(fp);
+    }
+    else usage();
+  }
+  if (g_numusers < 1 || g_numch < 1 || g_numch > LG_MAXCH || g_bitrate < 1 || g_chunkms < 1 || g_report < 1) usage();
+  setNamePrefix();
+
+  char host[512];
+  lstrcpyn_safe(host,argv[1],sizeof(host));
+  int port=2049;
+  char *pp=host[0]=='[' ? strstr(host,"]:") : strstr(host,":");
+  if (pp && host[0]=='[') pp++;
+  if (pp && (host[0]=='[' || !strstr(pp+1,":")))
+  {
+    *pp++=0;
+    port=atoi(pp);
+  }
+
+  signal(SIGINT,sigfunc);
+#ifndef _WIN32
+  signal(SIGPIPE,SIG_IGN);
+#endif
+  JNL::open_socketlib();
+  JNL_AsyncDNS dns;
+
+  g_start_time=getTimeMs();
+  double lasttime=g_start_time, lastcpu=-1.0, nextreport=g_start_time+g_report*1000.0;
+  lastcpu=getServerCPUTime();
+
+  printf("njloadgen: %d users x %d channels to %s port %d\n",g_numusers,g_numch,host,port);
+
+  while (!g_done)
+  {
+    const double now=getTimeMs();
+    if (g_duration > 0 && now >= g_start_time+g_duration*1000.0) break;
+
+    if (g_users.GetSize() < g_numusers && now >= g_start_time + g_users.GetSize()*(double)g_rampms)
+    {
+      LoadUser *u=new LoadUser(g_users.GetSize());
+      JNL_Connection *c=new JNL_Connection(&dns,65536,65536);
+      c->connect(host,port);
+      u->m_con.attach(c);
+      g_users.Add(u);
+    }
+
+    int wantsleep=1;
+    for (int x = 0; x < g_users.GetSize(); x ++)
+    {
+      LoadUser *u=g_users.Get(x);
+      if (u->m_state < 0) continue;
+
+      Net_Message *msg;
+      int cnt=0;
+      while (cnt++ < 64 && (msg=u->m_con.Run(&wantsleep)))
+      {
+        msg->addRef();
+        u->OnMessage(msg,now);
+        msg->releaseRef();
+      }
+      if (u->m_con.GetStatus())
+      {
+        printf("user %d: disconnected\n",x);
+        u->m_state=-1;
+        continue;
+      }
+      u->RunUpload(now);
+    }
+
+    if (now >= nextreport)
+    {
+      report(now,&lasttime,&lastcpu,0);
+      nextreport=now+g_report*1000.0;
+    }
+
+    if (wantsleep)
+    {
+#ifdef _WIN32
+      Sleep(1);
+#else
+      struct timespec ts={0,1000*1000};
+      nanosleep(&ts,NULL);
+#endif
+    }
+  }
+
+  // finish the intervals in progress and give the server a moment to relay them
+  for (int x = 0; x < g_users.GetSize(); x ++)
+  {
+    LoadUser *u=g_users.Get(x);
+    if (u->m_state != 1) continue;
+    u->FinishInterval(getTimeMs());
+    u->m_state=2;
+  }
+  const double drain_end=getTimeMs()+3000.0;
+  while (getTimeMs() < drain_end && g_stats.downloads_done < (int)g_stats.expected)
+  {
+    const double now=getTimeMs();
+    for (int x = 0; x < g_users.GetSize(); x ++)
+    {
+      LoadUser *u=g_users.Get(x);
+      Net_Message *msg;
+      while (u->m_state > 0 && (msg=u->m_con.Run()))
+      {
+        msg->addRef();
+        u->OnMessage(msg,now);
+        msg->releaseRef();
+      }
+    }
+#ifdef _WIN32
+    Sleep(1);
+#else
+    struct timespec ts={0,1000*1000};
+    nanosleep(&ts,NULL);
+#endif
+  }
+
+  report(getTimeMs(),&lasttime,&lastcpu,1);
+  const int failed = g_stats.downloads_done < (int)g_stats.expected;
+
+  for (int x = 0; x < g_users.GetSize(); x ++) delete g_users.Get(x);
+  g_users.Empty();
+
+  JNL::close_socketlib();
+  return failed;
+}
@@ -474,6 +474,163 @@ Net_Message *mpb_server_download_interval_write::build()
 }
 
 
+// MESSAGE_SERVER_USERINFO_DELTA
+int mpb_server_userinfo_delta::parse(Net_Message *msg) // return 0 on success
+{
+  if (msg->get_type() != MESSAGE_SERVER_USERINFO_DELTA) return -1;
+  if (msg->get_size() < 1) return 1;
+
+  m_intmsg = msg;
+  return 0;
+}
+
+Net_Message *mpb_server_userinfo_delta::build()
+{
+  if (m_intmsg) 
+  {
+    Net_Message *n=m_intmsg;
+    m_intmsg=0;
+    return n;
+  }
+
+  Net_Message *nm=new Net_Message;
+  nm->set_type(MESSAGE_SERVER_USERINFO_DELTA); 
+  nm->set_size(0);
+
+  return nm;
+}
+
+// appends a record of size bytes (after the type and user id), returns where its data goes
+unsigned char *mpb_server_userinfo_delta::add_rec(int type, int userid, int size)
+{
+  if (!m_intmsg) 
+  {
+    m_intmsg = new Net_Message;
+    m_intmsg->set_type(MESSAGE_SERVER_USERINFO_DELTA); 
+  }
+  const int oldsize=m_intmsg->get_size();
+  m_intmsg->set_size(oldsize+1+2+size);
+  unsigned char *p=(unsigned char *)m_intmsg->get_data();
+  if (!p) return NULL;
+
+  p+=oldsize;
+  *p++=type;
+  *p++=userid&0xff;
+  *p++=(userid>>8)&0xff;
+  return p;
+}
+
+void mpb_server_userinfo_delta::build_add_user(int userid, const char *username)
+{
+  const int username_len = username ? (int)strlen(username) : 0;
+  unsigned char *p=add_rec(USERINFO_DELTA_ADD_USER,userid,username_len+1);
+  if (p)
+  {
+    if (username_len) memcpy(p,username,username_len+1);
+    else *p = 0;
+  }
+}
+
+void mpb_server_userinfo_delta::build_remove_user(int userid)
+{
+  add_rec(USERINFO_DELTA_REMOVE_USER,userid,0);
+}
+
+void mpb_server_userinfo_delta::build_set_channel(int userid, int channelid, short volume, int pan, int flags, const char *chname)
+{
+  const int chname_len = chname ? (int)strlen(chname) : 0;
+  unsigned char *p=add_rec(USERINFO_DELTA_SET_CHANNEL,userid,1+2+1+1+chname_len+1);
+  if (p)
+  {
+    if (channelid < 0) channelid=0;
+    else if (channelid>255)channelid=255;
+    *p++=channelid;
+
+    *p++=volume&0xff;
+    *p++=(volume>>8)&0xff;
+
+    if (pan<-128) pan=-128;
+    else if (pan>127)pan=127;
+    *p++=(unsigned char)pan;
+
+    *p++=(unsigned char)flags;
+
+    if (chname_len) memcpy(p,chname,chname_len+1);
+    else *p = 0;
+  }
+}
+
+void mpb_server_userinfo_delta::build_remove_channel(int userid, int channelid)
+{
+  unsigned char *p=add_rec(USERINFO_DELTA_REMOVE_CHANNEL,userid,1);
+  if (p)
+  {
+    if (channelid < 0) channelid=0;
+    else if (channelid>255)channelid=255;
+    *p=channelid;
+  }
+}
+
+// returns offset of next item on success, or <= 0 if out of items
+int mpb_server_userinfo_delta::parse_get_rec(int offs, int *type, int *userid, int *channelid, short *volume, 
+                                             int *pan, int *flags, const char **name)
+{
+  if (!m_intmsg) return 0;
+  const unsigned char *p=(const unsigned char *)m_intmsg->get_data();
+  int len=m_intmsg->get_size()-offs;
+  if (!p || len < 3) return 0;
+  p+=offs;
+
+  const int t=*p++;
+  int id=*p++;
+  id |= ((int)*p++)<<8;
+  len -= 3;
+
+  int hdrsize;
+  bool hasname;
+  switch (t)
+  {
+    case USERINFO_DELTA_ADD_USER: hdrsize=0; hasname=true; break;
+    case USERINFO_DELTA_REMOVE_USER: hdrsize=0; hasname=false; break;
+    case USERINFO_DELTA_SET_CHANNEL: hdrsize=5; hasname=true; break;
+    case USERINFO_DELTA_REMOVE_CHANNEL: hdrsize=1; hasname=false; break;
+    default: return 0; // unknown record, can't skip it
+  }
+  if (len < hdrsize + (hasname?1:0)) return 0;
+
+  const unsigned char *hdrbuf=p;
+  p+=hdrsize;
+  len-=hdrsize;
+
+  if (hasname)
+  {
+    const char *np=(const char *)p;
+    while (*p)
+    {
+      p++;
+      if (!--len) return 0;
+    }
+    p++;
+    *name=np;
+  }
+
+  *type=t;
+  *userid=id;
+  if (hdrsize)
+  {
+    *channelid=(int)*hdrbuf++;
+    if (hdrsize > 1)
+    {
+      *volume=(int)*hdrbuf++;
+      *volume |= ((int)*hdrbuf++)<<8;  
+      *pan = (int) (char) *hdrbuf++;
+      *flags = (int) *hdrbuf++;
+    }
+  }
+
+  return (int) (p - (unsigned char *)m_intmsg->get_data());
+}
+
 
 
 
@@ -646,6 +803,79 @@ int mpb_client_set_usermask::parse_get_rec(int offs, const char **username, unsi
 }
 
 
+// MESSAGE_CLIENT_SET_USERMASK_ID
+int mpb_client_set_usermask_id::parse(Net_Message *msg) // return 0 on success
+{
+  if (msg->get_type() != MESSAGE_CLIENT_SET_USERMASK_ID) return -1;
+  if (msg->get_size() < 1) return 1;
+
+  m_intmsg = msg;
+  return 0;
+}
+
+Net_Message *mpb_client_set_usermask_id::build()
+{
+  if (m_intmsg) 
+  {
+    Net_Message *n=m_intmsg;
+    m_intmsg=0;
+    return n;
+  }
+
+  Net_Message *nm=new Net_Message;
+  nm->set_type(MESSAGE_CLIENT_SET_USERMASK_ID); 
+  nm->set_size(0);
+
+  return nm;
+}
+
+
+void mpb_client_set_usermask_id::build_add_rec(int userid, unsigned int chflags)
+{
+  if (!m_intmsg) 
+  {
+    m_intmsg = new Net_Message;
+    m_intmsg->set_type(MESSAGE_CLIENT_SET_USERMASK_ID); 
+  }
+  const int oldsize=m_intmsg->get_size();
+  m_intmsg->set_size(oldsize+2+4);
+  unsigned char *p=(unsigned char *)m_intmsg->get_data();
+  if (p)
+  {
+    p+=oldsize;
+
+    *p++=userid&0xff;
+    *p++=(userid>>8)&0xff;
+
+    *p++=chflags&0xff;
+    *p++=(chflags>>8)&0xff;
+    *p++=(chflags>>16)&0xff;
+    *p++=(chflags>>24)&0xff;
+  }
+}
+
+
+// returns offset of next item on success, or <= 0 if out of items
+int mpb_client_set_usermask_id::parse_get_rec(int offs, int *userid, unsigned int *chflags)
+{
+  if (!m_intmsg) return 0;
+  const unsigned char *p=(const unsigned char *)m_intmsg->get_data();
+  int len=m_intmsg->get_size()-offs;
+  if (!p || len < 6) return 0;
+  p+=offs;
+
+  *userid = ((int)*p++);
+  *userid |= ((int)*p++)<<8;
+
+  *chflags = ((int)*p++); 
+  *chflags |= ((int)*p++)<<8;
+  *chflags |= ((int)*p++)<<16;
+  *chflags |= ((int)*p++)<<24;
+
+  return (int) (p - (unsigned char *)m_intmsg->get_data());
+}
+
+
 // MESSAGE_CLIENT_SET_CHANNEL_INFO
 int mpb_client_set_channel_info::parse(Net_Message *msg) // return 0 on success
 {
@@ -904,7 +1134,7 @@ Net_Message *mpb_chat_message::build()
     return 0;
   }
 
-  for (x = 0; x < sizeof(parms)/sizeof(parms[0]); x ++)
+  for (x = 0; x < (int)(sizeof(parms)/sizeof(parms[0])); x ++)
   {
     const char *sp=parms[x];
     if (sp) 
@@ -36,6 +36,11 @@
 #define PROTO_VER_MAX 0x0002ffff
 #define PROTO_VER_CUR 0x00020000
 
+// capability bits, beyond the ones documented with server_caps/client_caps below
+#define SERVER_CAP_USERINFO_DELTA 2 // server can send MESSAGE_SERVER_USERINFO_DELTA
+#define CLIENT_CAP_USERINFO_DELTA 4 // client wants MESSAGE_SERVER_USERINFO_DELTA instead of MESSAGE_SERVER_USERINFO_CHANGE_NOTIFY
+                                    // (only set it if the server has SERVER_CAP_USERINFO_DELTA)
+
 
 #define MESSAGE_SERVER_AUTH_CHALLENGE 0x00
 
@@ -157,6 +162,43 @@ class mpb_server_download_interval_write
 };
 
 
+// sent instead of MESSAGE_SERVER_USERINFO_CHANGE_NOTIFY to clients with CLIENT_CAP_USERINFO_DELTA.
+// users get a numeric id (0..65535) with USERINFO_DELTA_ADD_USER, which later records and
+// MESSAGE_CLIENT_SET_USERMASK_ID use instead of the name. a user's id is valid until its
+// USERINFO_DELTA_REMOVE_USER, after which it may be given to another user.
+#define MESSAGE_SERVER_USERINFO_DELTA 0x06
+
+#define USERINFO_DELTA_ADD_USER 1       // userid, username
+#define USERINFO_DELTA_REMOVE_USER 2    // userid, all of its channels are gone
+#define USERINFO_DELTA_SET_CHANNEL 3    // userid, channelid, volume, pan, flags, chname: channel is active
+#define USERINFO_DELTA_REMOVE_CHANNEL 4 // userid, channelid
+
+class mpb_server_userinfo_delta
+{
+  public:
+    mpb_server_userinfo_delta() : m_intmsg(0) { }
+    ~mpb_server_userinfo_delta() { }
+
+    int parse(Net_Message *msg); // return 0 on success
+    Net_Message *build(); // if you call build_add_* at all, you must do delete x->build(); to avoid a mem leak.
+    bool has_recs() { return m_intmsg && m_intmsg->get_size() > 0; }
+
+    // pan, volume and flags are as in mpb_server_userinfo_change_notify
+    void build_add_user(int userid, const char *username);
+    void build_remove_user(int userid);
+    void build_set_channel(int userid, int channelid, short volume, int pan, int flags, const char *chname);
+    void build_remove_channel(int userid, int channelid);
+
+    // fields a record type doesn't have are left alone
+    int parse_get_rec(int offs, int *type, int *userid, int *channelid, short *volume, int *pan, int *flags, const char **name); // returns offset of next item on success, or <= 0 if out of items
+
+   private:
+     unsigned char *add_rec(int type, int userid, int size);
+
+     Net_Message *m_intmsg;
+};
+
+
 
 
 #define MESSAGE_CLIENT_AUTH_USER 0x80
@@ -199,6 +241,26 @@ class mpb_client_set_usermask
      Net_Message *m_intmsg;
 };
 
+// MESSAGE_CLIENT_SET_USERMASK by MESSAGE_SERVER_USERINFO_DELTA user id, for CLIENT_CAP_USERINFO_DELTA clients
+#define MESSAGE_CLIENT_SET_USERMASK_ID 0x85
+class mpb_client_set_usermask_id
+{
+  public:
+    mpb_client_set_usermask_id() : m_intmsg(0) { }
+    ~mpb_client_set_usermask_id() { }
+
+    int parse(Net_Message *msg); // return 0 on success
+    Net_Message *build();
+
+
+    void build_add_rec(int userid, unsigned int chflags);
+    int parse_get_rec(int offs, int *userid, unsigned int *chflags); // returns offset of next item on success, or <= 0 if out of items
+
+   private:
+
+     Net_Message *m_intmsg;
+};
+
 #define MESSAGE_CLIENT_SET_CHANNEL_INFO 0x82
 class mpb_client_set_channel_info
 {
@@ -0,0 +1,281 @@
+/*
+    NINJAM mixdown bot - ninjammix.cpp
+    Copyright (C) 2005-2017 Cockos Incorporated
+
+    NINJAM is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    NINJAM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NINJAM; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  ninjammix connects to a server as an ordinary user, subscribes to every
+  channel, decodes and mixes them, and publishes the stereo mix as a single
+  channel of its own. Listeners on constrained downlinks can subscribe to that
+  one channel instead of every upload. It runs next to (or anywhere near)
+  ninjamsrv, so the server does no decoding and relaying for everyone else is
+  unaffected.
+
+  The mix channel is flagged 1 (not subscribed to by default), so clients that
+  autosubscribe don't get the mix on top of the channels it contains, and
+  other mixdown bots don't mix it in again.
+
+  Network traffic (NJClient::Run()) is handled on the main thread, decoding
+  and mixing (NJClient::AudioProc()) on a separate mixer thread paced by the
+  wall clock.
+
+  Timing: NJClient plays interval N during interval N+1. A block's input is
+  taken before that block's output is mixed, so the mix is fed back into
+  the upload delayed by exactly one interval to keep it on the beat grid: the
+  mix of N is uploaded as interval N+2 and heard by its listeners during N+3,
+  two intervals later than subscribing to the channels directly (N+1).
+
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <stdlib.h>
+#include <memory.h>
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+#include <stdio.h>
+#include <math.h>
+#include <signal.h>
+
+#include "../njclient.h"
+#include "../njmisc.h"
+#include "../../WDL/wdlcstring.h"
+
+
+NJClient *g_client;
+
+int g_srate=44100;
+int g_blocksize=512;
+volatile int g_done;
+
+
+static int licensecallback(void *userData, const char *licensetext)
+{
+  return 1; // the mixdown bot does not play for anybody
+}
+
+#ifdef _WIN32
+#define INT64 __int64
+#else
+#define INT64 long long
+#endif
+
+static INT64 getTimeInMs()
+{
+#ifdef _WIN32
+  return GetTickCount();
+#else
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (INT64)now.tv_sec * 1000 + now.tv_usec / 1000;
+#endif
+}
+
+static void sleepMs(int ms)
+{
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  struct timespec ts={0,ms*1000*1000};
+  nanosleep(&ts,NULL);
+#endif
+}
+
+
+#ifdef _WIN32
+static unsigned WINAPI mixThread(void *p)
+#else
+static void *mixThread(void *p)
+#endif
+{
+  // one interval of the mix output per channel, played back as the input of
+  // the mix channel exactly one interval later (mix of N uploads as N+2)
+  WDL_TypedBuf<float> ring;
+  int ring_len=0, ring_pos=0;
+
+  WDL_TypedBuf<float> tmp;
+  float *out[2];
+  out[0]=tmp.Resize(g_blocksize*2);
+  out[1]=out[0]+g_blocksize;
+
+  const INT64 start_time=getTimeInMs();
+  INT64 samples_out=0;
+
+  while (!g_done)
+  {
+    const INT64 sample_pos=((getTimeInMs()-start_time) * g_srate) / 1000;
+    if (sample_pos < samples_out + g_blocksize)
+    {
+      sleepMs(1);
+      continue;
+    }
+    if (sample_pos > samples_out + g_srate)
+    {
+      printf("mixer fell behind, skipping %d samples\n",(int)(sample_pos-samples_out));
+      samples_out=sample_pos-g_blocksize;
+    }
+
+    int ilen=0;
+    g_client->GetPosition(NULL,&ilen);
+    if (ilen != ring_len) // tempo changed (or first interval), start over with silence
+    {
+      ring_len=ilen > 0 ? ilen : 0;
+      ring_pos=0;
+      float *r=ring.Resize(ring_len*2,false);
+      if (r) memset(r,0,ring_len*2*sizeof(float));
+    }
+
+    int len=g_blocksize;
+    if (ring_len > 0 && len > ring_len-ring_pos) len=ring_len-ring_pos;
+
+    float *in[2]={NULL,NULL};
+    if (ring_len > 0)
+    {
+      in[0]=ring.Get()+ring_pos;
+      in[1]=ring.Get()+ring_len+ring_pos;
+    }
+
+    g_client->AudioProc(in,ring_len>0?2:0,out,2,len,g_srate);
+
+    if (ring_len > 0)
+    {
+      memcpy(in[0],out[0],len*sizeof(float));
+      memcpy(in[1],out[1],len*sizeof(float));
+      ring_pos+=len;
+      if (ring_pos >= ring_len) ring_pos=0;
+    }
+
+    samples_out+=len;
+  }
+  return 0;
+}
+
+
+static void sigfunc(int sig)
+{
+  if (sig == SIGINT) g_done++;
+}
+
+
+static void usage()
+{
+  printf("Usage: ninjammix hostname[:port] [options]\n"
+         "Options:\n"
+         "  -user <username>     (default: anonymous:mixdown)\n"
+         "  -pass <password>\n"
+         "  -name <channelname>  (default: mix)\n"
+         "  -bitrate <kbps>      (default: 64)\n"
+         "  -srate <samplerate>  (default: 44100)\n"
+         "  -blocksize <samples> (default: 512)\n"
+         "  -volume <dB>         (master volume of the mix, default: 0)\n"
+         );
+  exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+  const char *user="anonymous:mixdown", *pass="", *chname="mix";
+  int bitrate=64;
+  double voldb=0.0;
+
+  printf("NINJAM mixdown bot, compiled " __DATE__ " at " __TIME__ "\nCopyright (C) 2005-2017 Cockos, Inc.\n\n");
+
+  if (argc < 2) usage();
+
+  int p;
+  for (p = 2; p < argc; p ++)
+  {
+    if (p+1 >= argc) usage();
+    if (!stricmp(argv[p],"-user")) user=argv[++p];
+    else if (!stricmp(argv[p],"-pass")) pass=argv[++p];
+    else if (!stricmp(argv[p],"-name")) chname=argv[++p];
+    else if (!stricmp(argv[p],"-bitrate")) bitrate=atoi(argv[++p]);
+    else if (!stricmp(argv[p],"-srate")) g_srate=atoi(argv[++p]);
+    else if (!stricmp(argv[p],"-blocksize")) g_blocksize=atoi(argv[++p]);
+    else if (!stricmp(argv[p],"-volume")) voldb=atof(argv[++p]);
+    else usage();
+  }
+  if (bitrate < 8 || g_srate < 8000 || g_blocksize < 16) usage();
+
+  signal(SIGINT,sigfunc);
+#ifndef _WIN32
+  signal(SIGPIPE,SIG_IGN);
+#endif
+
+  JNL::open_socketlib();
+
+  g_client=new NJClient;
+  g_client->LicenseAgreementCallback=licensecallback;
+  g_client->config_autosubscribe=1; // skips channels flagged 1, including other mixes
+  g_client->config_savelocalaudio=0;
+  g_client->config_metronome=0.0f;
+  g_client->config_metronome_mute=true;
+  g_client->config_mastervolume=(float)DB2VAL(voldb);
+
+  // stereo channel from inputs 0+1, flagged as not default-subscribed, and
+  // not monitored (otherwise the mix would feed back into itself)
+  g_client->SetLocalChannelInfo(0,chname,true,0|1024,true,bitrate,true,true,false,0,true,1);
+  g_client->SetLocalChannelMonitoring(0,false,0.0f,false,0.0f,true,true,false,false);
+
+  char hostbuf[512];
+  lstrcpyn_safe(hostbuf,argv[1],sizeof(hostbuf));
+  g_client->Connect(hostbuf,(char *)user,(char *)pass);
+
+#ifdef _WIN32
+  HANDLE hThread=(HANDLE)_beginthreadex(NULL,0,mixThread,NULL,0,NULL);
+#else
+  pthread_t hThread;
+  pthread_create(&hThread,NULL,mixThread,NULL);
+#endif
+
+  int laststatus=NJClient::NJC_STATUS_PRECONNECT;
+  while (!g_done)
+  {
+    int st=g_client->GetStatus();
+    if (st != laststatus)
+    {
+      laststatus=st;
+      if (st == NJClient::NJC_STATUS_OK) printf("Connected to %s, mixing as '%s'\n",g_client->GetHostName(),g_client->GetUser());
+      else if (st < 0)
+      {
+        printf("Disconnected: %s\n",g_client->GetErrorStr()[0]?g_client->GetErrorStr():"connection lost");
+        break;
+      }
+    }
+    if (g_client->Run()) sleepMs(1);
+  }
+
+  g_done=1;
+#ifdef _WIN32
+  WaitForSingleObject(hThread,INFINITE);
+  CloseHandle(hThread);
+#else
+  pthread_join(hThread,NULL);
+#endif
+
+  delete g_client;
+
+  JNL::close_socketlib();
+
+  return laststatus < 0;
+}
@@ -0,0 +1,561 @@
+/*
+    NINJAM offline client benchmark - njbench.cpp
+    Copyright (C) 2005-2017 Cockos Incorporated
+
+    NINJAM is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    NINJAM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NINJAM; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  njbench runs a roomful of NJClients against an in-process server (a
+  User_Group on a loopback port) on a virtual clock, as fast as the CPU
+  allows, from scripted input. Nothing is paced by wall time, so runs are
+  repeatable and can be compared against each other.
+
+  Everything runs on one thread, in lockstep. For each block of -blocksize
+  samples:
+    1) every client's AudioProc() is called with the next block of input
+       (mixing, decoding, metronome, and queueing audio for the encoder)
+    2) the server, the listener and every client's Run() (encoding and
+       network) are pumped until all of them have been idle twice in a row,
+       so everything sent during this block has been delivered.
+
+  Measured, after -warmup intervals:
+    AudioProc: CPU time per callback, heap allocations made inside it, and
+               the locks it takes (NJClient::AudioLockStats). In lockstep
+               nothing else holds those locks, so waits show the cost of
+               acquiring them, not contention.
+    Run:       CPU time per client per block.
+    overall:   realtime factor (audio seconds processed per wall second),
+               and a hash of all clients' output, which should not change
+               between runs of the same build and options.
+
+  -trace writes an NJTraceRing trace of the first client's AudioProc() calls
+  during the measured part, for the njtrace tool.
+
+  Input per client/channel is a sine at a different frequency, deterministic
+  noise, or silence. Clients autosubscribe, so each one decodes every other
+  client's channels.
+
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+
+#include "../njclient.h"
+#include "../njtrace.h"
+#include "../server/usercon.h"
+#include "../../WDL/heapbuf.h"
+#include "../../WDL/fnv64.h"
+#include "../../WDL/wdlcstring.h"
+
+
+#define NB_MAX_CLIENTS 64
+#define NB_MAX_SETTLE_PASSES 100000
+
+static int g_verbose;
+
+void logText(const char *s, ...) // needed by usercon.cpp
+{
+  if (g_verbose)
+  {
+    va_list ap;
+    va_start(ap,s);
+    vprintf(s,ap);
+    va_end(ap);
+  }
+}
+
+
+static double getWallTime() // seconds
+{
+#ifdef _WIN32
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec + tv.tv_usec*0.000001;
+#endif
+}
+
+static double getCPUTime() // seconds of CPU used by this thread, wall time where not available
+{
+#if !defined(_WIN32) && defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+  return ts.tv_sec + ts.tv_nsec*0.000000001;
+#else
+  return getWallTime();
+#endif
+}
+
+static void sleepMs(int ms)
+{
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  struct timespec ts={0,ms*1000*1000};
+  nanosleep(&ts,NULL);
+#endif
+}
+
+
+// allocation counting, enabled only around AudioProc() on this thread
+#ifdef _WIN32
+static __declspec(thread) int g_alloc_count_enabled;
+#else
+static __thread int g_alloc_count_enabled;
+#endif
+static int g_alloc_count;
+
+#ifdef __GLIBC__
+// glibc: catch malloc/calloc/realloc too (WDL_HeapBuf uses realloc)
+extern "C" {
+  void *__libc_malloc(size_t sz);
+  void *__libc_calloc(size_t n, size_t sz);
+  void *__libc_realloc(void *p, size_t sz);
+
+  void *malloc(size_t sz) { if (g_alloc_count_enabled) g_alloc_count++; return __libc_malloc(sz); }
+  void *calloc(size_t n, size_t sz) { if (g_alloc_count_enabled) g_alloc_count++; return __libc_calloc(n,sz); }
+  void *realloc(void *p, size_t sz) { if (g_alloc_count_enabled) g_alloc_count++; return __libc_realloc(p,sz); }
+};
+#else
+// elsewhere only C++ allocations are seen
+#include <new>
+void *operator new(size_t sz)
+{
+  if (g_alloc_count_enabled) g_alloc_count++;
+  void *p=malloc(sz ? sz : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void *operator new[](size_t sz) { return operator new(sz); }
+void operator delete(void *p) throw() { free(p); }
+void operator delete[](void *p) throw() { free(p); }
+#endif
+
+
+class BenchUserInfoLookup : public IUserInfoLookup
+{
+public:
+  BenchUserInfoLookup(char *name) { username.Set(name); }
+  ~BenchUserInfoLookup() { }
+
+  int Run()
+  {
+    user_valid=1;
+    reqpass=0;
+    privs=PRIV_CHATSEND;
+    max_channels=MAX_USER_CHANNELS;
+    return 1;
+  }
+};
+
+static IUserInfoLookup *myCreateUserLookup(char *username)
+{
+  return new BenchUserInfoLookup(username);
+}
+
+
+class TimingStats
+{
+public:
+  TimingStats() { }
+  ~TimingStats() { }
+
+  void Add(double v) { m_vals.Add(v); }
+  int GetSize() { return m_vals.GetSize(); }
+
+  void Print(const char *name)
+  {
+    const int n=m_vals.GetSize();
+    if (!n)
+    {
+      printf("  %-22s no samples\n",name);
+      return;
+    }
+    double *v=m_vals.Get();
+    qsort(v,n,sizeof(double),cmpfunc);
+    double sum=0.0;
+    for (int x = 0; x < n; x ++) sum+=v[x];
+    printf("  %-22s n=%-8d mean %8.2fus  p50 %8.2fus  p99 %8.2fus  max %8.2fus  total %.3fs\n",name,n,
+      sum*1000000.0/n,v[n/2]*1000000.0,v[(int)(n*0.99)]*1000000.0,v[n-1]*1000000.0,sum);
+  }
+
+private:
+  static int cmpfunc(const void *a, const void *b)
+  {
+    const double x=*(const double*)a, y=*(const double*)b;
+    return x<y ? -1 : x>y ? 1 : 0;
+  }
+  WDL_TypedBuf<double> m_vals;
+};
+
+
+class BenchClient
+{
+public:
+  BenchClient(int idx, int nch) : m_idx(idx), m_nch(nch), m_noise(0x12345u+idx*7919u)
+  {
+    memset(&m_lockstats,0,sizeof(m_lockstats));
+    memset(m_phase,0,sizeof(m_phase));
+    m_client=new NJClient;
+    m_client->config_savelocalaudio=0;
+    m_client->config_autosubscribe=1;
+  }
+  ~BenchClient() { delete m_client; }
+
+  // fills m_inbuf with the next len samples of every input channel
+  void GenerateInput(int mode, int len, int srate)
+  {
+    float *buf=m_inbuf.Resize(m_nch*len,false);
+    for (int ch = 0; ch < m_nch; ch ++)
+    {
+      float *p=buf+ch*len;
+      if (mode == 0)
+      {
+        const double dphase=2.0*3.14159265358979*110.0*(1+(m_idx*m_nch+ch)%24) / srate;
+        double ph=m_phase[ch];
+        for (int x = 0; x < len; x ++)
+        {
+          p[x]=(float)(0.25*sin(ph));
+          ph+=dphase;
+        }
+        m_phase[ch]=fmod(ph,2.0*3.14159265358979);
+      }
+      else if (mode == 1)
+      {
+        for (int x = 0; x < len; x ++)
+        {
+          m_noise=m_noise*1664525u+1013904223u;
+          p[x]=(float)((int)(m_noise>>8) - (1<<23)) * (0.25f/(1<<23));
+        }
+      }
+      else memset(p,0,len*sizeof(float));
+    }
+  }
+
+  int m_idx, m_nch;
+  unsigned int m_noise;
+  double m_phase[MAX_LOCAL_CHANNELS];
+  NJClient *m_client;
+  NJClient_AudioLockStats m_lockstats;
+  WDL_TypedBuf<float> m_inbuf;
+};
+
+
+WDL_PtrList<BenchClient> g_clients;
+User_Group *g_group;
+JNL_Listen *g_listener;
+bool g_measuring;
+TimingStats g_run_stats;
+
+static int pumpOnce()
+{
+  int busy=0;
+  JNL_IConnection *con=g_listener->get_connect(2*65536,65536);
+  if (con)
+  {
+    g_group->AddConnection(con);
+    busy=1;
+  }
+  if (!g_group->Run()) busy=1;
+
+  for (int x = 0; x < g_clients.GetSize(); x ++)
+  {
+    BenchClient *c=g_clients.Get(x);
+    const double t=getCPUTime();
+    if (!c->m_client->Run()) busy=1;
+    if (g_measuring) g_run_stats.Add(getCPUTime()-t);
+  }
+  return busy;
+}
+
+static void settle()
+{
+  int idle=0;
+  for (int x = 0; x < NB_MAX_SETTLE_PASSES && idle < 2; x ++)
+  {
+    if (pumpOnce()) idle=0;
+    else idle++;
+  }
+}
+
+
+static void usage()
+{
+  printf("Usage: njbench [options]\n"
+         "Options:\n"
+         "  -clients <n>         clients in the room (default: 4)\n"
+         "  -channels <n>        channels per client (default: 1)\n"
+         "  -seconds <s>         virtual seconds to run (default: 30)\n"
+         "  -warmup <intervals>  intervals not measured (default: 2)\n"
+         "  -srate <samplerate>  (default: 44100)\n"
+         "  -blocksize <samples> (default: 512)\n"
+         "  -bpm <bpm>           (default: 120)\n"
+         "  -bpi <bpi>           (default: 8)\n"
+         "  -bitrate <kbps>      (default: 64)\n"
+         "  -input <sine|noise|silence> (default: sine)\n"
+         "  -port <port>         loopback port of the in-process server (default: 22049)\n"
+         "  -trace <file>        write an audio thread trace of the first client\n"
+         "  -verbose             show server log\n"
+         );
+  exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+  int numclients=4, numch=1, srate=44100, blocksize=512, bpm=120, bpi=8, bitrate=64, port=22049;
+  int inputmode=0, warmup=2;
+  double seconds=30.0;
+  const char *tracefn=NULL;
+
+  printf("NINJAM offline client benchmark, compiled " __DATE__ " at " __TIME__ "\nCopyright (C) 2005-2017 Cockos, Inc.\n\n");
+
+  int p;
+  for (p = 1; p < argc; p ++)
+  {
+    if (!stricmp(argv[p],"-verbose")) { g_verbose=1; continue; }
+    if (p+1 >= argc) usage();
+    if (!stricmp(argv[p],"-clients")) numclients=atoi(argv[++p]);
+    else if (!stricmp(argv[p],"-channels")) numch=atoi(argv[++p]);
+    else if (!stricmp(argv[p],"-seconds")) seconds=atof(argv[++p]);
+    else if (!stricmp(argv[p],"-warmup")) warmup=atoi(argv[++p]);
+    else if (!stricmp(argv[p],"-srate")) srate=atoi(argv[++p]);
+    else if (!stricmp(argv[p],"-blocksize")) blocksize=atoi(argv[++p]);
+    else if (!stricmp(argv[p],"-bpm")) bpm=atoi(argv[++p]);
+    else if (!stricmp(argv[p],"-bpi")) bpi=atoi(argv[++p]);
+    else if (!stricmp(argv[p],"-bitrate")) bitrate=atoi(argv[++p]);
+    else if (!stricmp(argv[p],"-port")) port=atoi(argv[++p]);
+    else if (!stricmp(argv[p],"-trace")) tracefn=argv[++p];
+    else if (!stricmp(argv[p],"-input"))
+    {
+      p++;
+      if (!stricmp(argv[p],"sine")) inputmode=0;
+      else if (!stricmp(argv[p],"noise")) inputmode=1;
+      else if (!stricmp(argv[p],"silence")) inputmode=2;
+      else usage();
+    }
+    else usage();
+  }
+  if (numclients < 1 || numclients > NB_MAX_CLIENTS || numch < 1 || numch > MAX_LOCAL_CHANNELS ||
+      srate < 8000 || blocksize < 16 || bpm < MIN_BPM || bpm > MAX_BPM || bpi < MIN_BPI || bpi > MAX_BPI ||
+      bitrate < 8 || seconds <= 0.0 || warmup < 0 || port < 1 || port > 65535) usage();
+
+#ifndef _WIN32
+  signal(SIGPIPE,SIG_IGN);
+#endif
+
+  JNL::open_socketlib();
+
+  g_listener=new JNL_Listen((short)port,htonl(INADDR_LOOPBACK));
+  if (g_listener->is_error())
+  {
+    printf("Error listening on port %d\n",port);
+    return 1;
+  }
+  g_group=new User_Group;
+  g_group->CreateUserLookup=myCreateUserLookup;
+  g_group->m_max_users=NB_MAX_CLIENTS;
+  g_group->SetConfig(bpi,bpm);
+
+  // connect one at a time, so the user list order is the same every run
+  char hostbuf[64];
+  snprintf(hostbuf,sizeof(hostbuf),"127.0.0.1:%d",port);
+  int x;
+  for (x = 0; x < numclients; x ++)
+  {
+    BenchClient *c=new BenchClient(x,numch);
+    g_clients.Add(c);
+
+    for (int ch = 0; ch < numch; ch ++)
+    {
+      char name[32];
+      snprintf(name,sizeof(name),"ch%d",ch);
+      c->m_client->SetLocalChannelInfo(ch,name,true,ch,true,bitrate,true,true);
+    }
+
+    char user[32];
+    snprintf(user,sizeof(user),"bench%d",x);
+    c->m_client->Connect(hostbuf,user,(char*)"");
+
+    const double timeout=getWallTime()+10.0;
+    while (c->m_client->GetStatus() != NJClient::NJC_STATUS_OK || !c->m_client->IsAudioRunning())
+    {
+      if (c->m_client->GetStatus() < 0 || getWallTime() > timeout)
+      {
+        printf("Client %d could not connect: %s\n",x,c->m_client->GetErrorStr());
+        return 1;
+      }
+      if (!pumpOnce()) sleepMs(1);
+    }
+  }
+  // let everybody see everybody's channels (and subscribe) before starting the clock
+  {
+    const double endt=getWallTime()+0.25;
+    while (getWallTime() < endt) if (!pumpOnce()) sleepMs(1);
+  }
+
+  printf("%d clients x %d channels, %d Hz, %d samples/block, %d BPM %d BPI, %d kbps, %s input\n",
+    numclients,numch,srate,blocksize,bpm,bpi,bitrate,inputmode==0?"sine":inputmode==1?"noise":"silence");
+
+  const int interval_len=(int)((double)bpi * 60.0 / bpm * srate);
+  const int warmup_len=warmup*interval_len;
+  const int total_len=warmup_len+(int)(seconds*srate);
+
+  TimingStats audioproc_stats;
+  int audioproc_allocs=0, audioproc_alloc_calls=0;
+
+  WDL_TypedBuf<float> outbuf;
+  float *outs[2];
+  outs[0]=outbuf.Resize(blocksize*2);
+  outs[1]=outs[0]+blocksize;
+
+  WDL_UINT64 hash=WDL_FNV64_IV;
+
+  NJTraceRing *trace=NULL;
+  FILE *tracefp=NULL;
+  if (tracefn)
+  {
+    tracefp=fopen(tracefn,"wb");
+    if (!tracefp)
+    {
+      printf("Error opening trace file %s\n",tracefn);
+      return 1;
+    }
+    NJTraceRing::WriteFileHeader(tracefp);
+    trace=new NJTraceRing;
+  }
+
+  double wall_start=0.0;
+  int pos=0;
+  while (pos < total_len)
+  {
+    if (!g_measuring && pos >= warmup_len)
+    {
+      g_measuring=true;
+      wall_start=getWallTime();
+      for (x = 0; x < g_clients.GetSize(); x ++)
+      {
+        BenchClient *c=g_clients.Get(x);
+        memset(&c->m_lockstats,0,sizeof(c->m_lockstats));
+        c->m_client->AudioLockStats=&c->m_lockstats;
+      }
+      if (trace) g_clients.Get(0)->m_client->AudioTrace=trace;
+    }
+
+    for (x = 0; x < g_clients.GetSize(); x ++)
+    {
+      BenchClient *c=g_clients.Get(x);
+      c->GenerateInput(inputmode,blocksize,srate);
+      float *ins[MAX_LOCAL_CHANNELS];
+      for (int ch = 0; ch < numch; ch ++) ins[ch]=c->m_inbuf.Get()+ch*blocksize;
+
+      g_alloc_count=0;
+      g_alloc_count_enabled=g_measuring;
+      const double t=getCPUTime();
+
+      c->m_client->AudioProc(ins,numch,outs,2,blocksize,srate);
+
+      const double el=getCPUTime()-t;
+      g_alloc_count_enabled=0;
+
+      if (g_measuring)
+      {
+        audioproc_stats.Add(el);
+        if (g_alloc_count)
+        {
+          audioproc_allocs+=g_alloc_count;
+          audioproc_alloc_calls++;
+        }
+      }
+      hash=WDL_FNV64(hash,(const unsigned char *)outs[0],blocksize*2*(int)sizeof(float));
+    }
+
+    settle();
+
+    if (trace) trace->WriteToFile(tracefp);
+
+    pos+=blocksize;
+  }
+  const double wall_len=getWallTime()-wall_start;
+
+  if (trace)
+  {
+    g_clients.Get(0)->m_client->AudioTrace=NULL;
+    if (trace->GetDropped()) printf("audio trace dropped %d events\n",trace->GetDropped());
+    fclose(tracefp);
+    delete trace;
+  }
+
+  int disconnected=0;
+  for (x = 0; x < g_clients.GetSize(); x ++)
+    if (g_clients.Get(x)->m_client->GetStatus() != NJClient::NJC_STATUS_OK) disconnected++;
+
+  printf("\nmeasured %.1f audio seconds in %.2f wall seconds, realtime factor %.1fx%s\n",
+    (total_len-warmup_len)/(double)srate,wall_len,
+    wall_len > 0.0 ? (total_len-warmup_len)/(double)srate/wall_len : 0.0,
+    disconnected ? " (CLIENTS DISCONNECTED)" : "");
+
+  printf("\nCPU time:\n");
+  audioproc_stats.Print("AudioProc per call");
+  g_run_stats.Print("Run per call");
+
+  printf("\nAudioProc allocations: %d in %d of %d calls\n",audioproc_allocs,audioproc_alloc_calls,audioproc_stats.GetSize());
+
+  printf("\nAudioProc locks (lockstep, so no contention):\n");
+  static const char *lock_names[NJClient_AudioLockStats::NUM_LOCKS]={"bufferqueue"};
+  for (int l = 0; l < NJClient_AudioLockStats::NUM_LOCKS; l ++)
+  {
+    int cnt=0;
+    double w=0.0, mw=0.0;
+    for (x = 0; x < g_clients.GetSize(); x ++)
+    {
+      const NJClient_AudioLockStats *st=&g_clients.Get(x)->m_lockstats;
+      cnt+=st->count[l];
+      w+=st->wait[l];
+      if (st->maxwait[l] > mw) mw=st->maxwait[l];
+    }
+    printf("  %-22s n=%-8d mean %8.3fus  max %8.3fus\n",lock_names[l],cnt,cnt ? w*1000000.0/cnt : 0.0,mw*1000000.0);
+  }
+
+  printf("\noutput hash: %08x%08x\n",(unsigned int)(hash>>32),(unsigned int)hash);
+
+  for (x = 0; x < g_clients.GetSize(); x ++) g_clients.Get(x)->m_client->AudioLockStats=NULL;
+  for (x = 0; x < g_clients.GetSize(); x ++) delete g_clients.Get(x);
+  g_clients.Empty();
+  delete g_group;
+  delete g_listener;
+
+  JNL::close_socketlib();
+
+  return disconnected ? 1 : 0;
+}
@@ -26,14 +26,33 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <poll.h>
+#endif
+#endif
 #include "njclient.h"
 #include "mpb.h"
+#include "njtrace.h"
 #include "../WDL/pcmfmtcvt.h"
 #include "../WDL/wavwrite.h"
 #include "../WDL/wdlcstring.h"
+#include "../WDL/wdlatomic.h"
 
 #include "../WDL/win32_utf8.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NJCLIENT_MIX_SSE2
+#include <emmintrin.h>
+#endif
+
 #define NJ_ENCODER_FMT_TYPE MAKE_NJ_FOURCC('O','G','G','v')
 
 #ifdef REANINJAM
@@ -144,7 +163,8 @@ class DecodeState
 {
   public:
     DecodeState() : decode_fp(0), decode_buf(0), decode_codec(0), 
-                                           decode_samplesout(0), resample_state(0.0)
+                                           decode_samplesout(0), resample_state(0.0), retire_next(0),
+                                           session_start(0.0), session_length(0.0), session_offset(0.0)
     { 
       memset(guid,0,sizeof(guid));
     }
@@ -166,6 +186,10 @@ class DecodeState
     I_NJDecoder *decode_codec;
     int decode_samplesout;
     double resample_state;
+    DecodeState *retire_next; // see NJClient::retireDecodeState()
+
+    // session mode: the ChannelSessionInfo this was opened for, see NJClient::prepareSessionDecoders()
+    double session_start, session_length, session_offset;
 
     void applyOverlap(overlapFadeState *s)
     {
@@ -245,6 +269,7 @@ class DecodeState
 class ChannelSessionInfo
 {
 public:
+  ChannelSessionInfo() : start_time(0.0), length(0.0), offset(0.0) { memset(guid,0,sizeof(guid)); }
   ChannelSessionInfo(const unsigned char *_guid, double st, double len)
   {
     memcpy(guid,_guid,16);
@@ -279,14 +304,15 @@ class RemoteUser_Channel
     // decode/mixer state, used by mixer
     int dump_samples;
     DecodeState *ds;
-    DecodeState *next_ds[2]; // prepared by main thread, for audio thread
+    DecodeState *next_ds[2]; // prepared by main thread, for audio thread. in session mode, decoders for upcoming spans
 
     double decode_peak_vol[2];
+    double decode_rms[2]; // mean square, audio thread
 
     double curds_lenleft;
 
     void AddSessionInfo(const unsigned char *guid, double st, double len);
-    bool GetSessionInfo(double time, unsigned char *guid, double *offs, double *len, double mv);
+    int GetSessionSpans(double time, double mv, ChannelSessionInfo *spans, int maxspans); // the span at time (if any) and those after it
     double GetMaxLength()
     {
       ChannelSessionInfo *p=sessioninfo.Get(sessioninfo.GetSize()-1);
@@ -300,6 +326,19 @@ class RemoteUser_Channel
       sessionlist_mutex.Leave();
     }
 
+    // control side: the spans last sent with MIXCMD_SESSION_DS, see NJClient::prepareSessionDecoders()
+    ChannelSessionInfo session_queued[2];
+    bool IsSessionQueued(const ChannelSessionInfo *s) const
+    {
+      for (int x = 0; x < 2; x ++)
+      {
+        const ChannelSessionInfo *q=session_queued+x;
+        if (q->length > 0.0 && q->start_time == s->start_time && q->length == s->length && !memcmp(q->guid,s->guid,16)) return true;
+      }
+      return false;
+    }
+    void ClearSessionQueued() { session_queued[0].length=session_queued[1].length=0.0; }
+
   private:
     WDL_Mutex sessionlist_mutex;
     WDL_PtrList<ChannelSessionInfo> sessioninfo;
@@ -310,14 +349,16 @@ class RemoteUser_Channel
 class RemoteUser
 {
 public:
-  RemoteUser() : muted(0), volume(1.0f), pan(0.0f), submask(0), mutedmask(0), solomask(0), last_session_pos(-1.0), last_session_pos_updtime(0), chanpresentmask(0) { }
+  RemoteUser() : muted(0), volume(1.0f), pan(0.0f), id(-1), submask(0), submask_sent(0), mutedmask(0), solomask(0), last_session_pos(-1.0), last_session_pos_updtime(0), chanpresentmask(0) { }
   ~RemoteUser() { }
 
   bool muted;
   float volume;
   float pan;
   WDL_String name;
+  int id; // MESSAGE_SERVER_USERINFO_DELTA user id, -1 if the server uses names
   int submask;
+  int submask_sent; // submask as the server knows it, see sendSubscriptions()
   int chanpresentmask;
   int mutedmask;
   int solomask;
@@ -353,6 +394,274 @@ private:
 };
 
 
+// The audio thread never locks the remote user list. Instead the control side
+// (Run() and the SetUser*() calls, serialized by m_remotechannel_rd_mutex)
+// publishes an immutable RemoteMixGraph describing what to mix, and passes
+// decoders to the audio thread through a FIFO of commands. Each channel's ds
+// and next_ds[] belong to the audio thread; decoders it drops are handed back
+// through a second FIFO and freed by Run().
+//
+// A replaced graph (and any RemoteUser removed while it was current) is freed
+// once AudioProc() has finished a call using a newer graph and has run every
+// command issued before the graph was replaced.
+//
+// Local channels are published the same way, as a LocalMixGraph (written under
+// m_locchan_cs, which AudioProc() never takes). A deleted Local_Channel is
+// freed with the last graph that refers to it.
+//
+// If AudioProc() stops being called, commands and graphs pile up on the control
+// side. Once that has gone on for a while, Run() claims the audio state with
+// m_audio_claim (see drainIdleAudio()) and does the audio thread's share itself;
+// an AudioProc() call that finds the claim taken outputs silence and returns.
+
+#ifdef _WIN32
+#define NJ_BARRIER() MemoryBarrier()
+#else
+#define NJ_BARRIER() __sync_synchronize()
+#endif
+
+// single producer, single consumer. never blocks or allocates
+template<class T, int SIZE_LOG2> class NJ_SPSCFifo
+{
+public:
+  NJ_SPSCFifo() : m_wrpos(0), m_rdpos(0) { }
+
+  bool Push(const T &v) // producer only, false if full
+  {
+    const unsigned int wr=m_wrpos;
+    if (wr - m_rdpos >= (1u<<SIZE_LOG2)) return false;
+    m_buf[wr & ((1u<<SIZE_LOG2)-1)]=v;
+    NJ_BARRIER(); // item must be visible before the position that publishes it
+    m_wrpos=wr+1;
+    return true;
+  }
+  unsigned int Free() const { return (1u<<SIZE_LOG2) - (m_wrpos - m_rdpos); } // exact for the producer
+
+  bool Pop(T *v) // consumer only, false if empty
+  {
+    const unsigned int rd=m_rdpos;
+    if (rd == m_wrpos) return false;
+    NJ_BARRIER();
+    *v=m_buf[rd & ((1u<<SIZE_LOG2)-1)];
+    NJ_BARRIER(); // finish reading the slot before handing it back
+    m_rdpos=rd+1;
+    return true;
+  }
+
+private:
+  T m_buf[1<<SIZE_LOG2];
+  volatile unsigned int m_wrpos, m_rdpos;
+};
+
+enum
+{
+  MIXCMD_QUEUE_DS=0, // append ds (NULL for an interval of silence) to chan's next_ds queue
+  MIXCMD_FLUSH,      // free chan's ds and everything queued
+  MIXCMD_SESSION_DS, // session mode: keep ds (opened for ds->session_start) in chan's next_ds
+};
+
+struct NJMixCommand
+{
+  int cmd;
+  RemoteUser_Channel *chan;
+  DecodeState *ds;
+};
+
+class MixCommandFifo : public NJ_SPSCFifo<NJMixCommand,10> { };
+
+enum
+{
+  AUDIOMSG_DELETE_DS=0, // ds, and every DecodeState linked from it by retire_next
+  AUDIOMSG_LOG_INTERVAL, // a=interval count, f=bpm, c=bpi
+  AUDIOMSG_LOG_USER,     // user, a=channel, guid
+};
+
+struct NJAudioMessage
+{
+  int type;
+  DecodeState *ds;
+  RemoteUser *user;
+  int a, b, c;
+  float f;
+  unsigned char guid[16];
+};
+
+class AudioMessageFifo : public NJ_SPSCFifo<NJAudioMessage,10> { };
+
+// AUDIOMSG_DELETE_DS is only posted while this many slots are free, so that
+// log lines are not crowded out by decoders (which can wait for a later block)
+#define NJ_AUDIOMSG_LOG_RESERVE 256
+
+class RemoteMixGraph
+{
+public:
+  RemoteMixGraph() : version(0), free_after_cmd(0) { }
+  ~RemoteMixGraph() { retired_users.Empty(true); }
+
+  enum { ENTRY_SUBSCRIBED=1, ENTRY_MUTED=2, ENTRY_SOLO=4 };
+
+  struct Entry
+  {
+    RemoteUser *user;
+    RemoteUser_Channel *chan;
+    int user_idx, ch_idx;
+    int chflags; // RemoteUser_Channel::flags
+    int state; // ENTRY_*
+    float vol, pan; // user and channel combined
+    int out_chan;
+    int rec_stem; // NJRecorder stem if recording it, else -1
+  };
+
+  int version;
+  unsigned int free_after_cmd; // commands issued while this graph was current
+  WDL_TypedBuf<Entry> entries; // every present channel, in user/channel order
+  WDL_PtrList<RemoteUser> retired_users; // removed while this graph was current
+};
+
+
+// Meters for UIs (see NJClient::GetMeterSnapshot()) are published in two
+// parts, each with a single writer and guarded by a sequence count: the writer
+// makes the count odd while it changes the data and even again when done, a
+// reader copies the data and retries if the count was odd or has changed.
+// Writers never wait for readers.
+class NJ_SeqLock
+{
+public:
+  NJ_SeqLock() : m_seq(0) { }
+
+  void WriteBegin() { m_seq++; NJ_BARRIER(); }
+  void WriteEnd() { NJ_BARRIER(); m_seq++; }
+
+  unsigned int ReadBegin() const
+  {
+    unsigned int s;
+    int spins=0;
+    while ((s=m_seq)&1)
+    {
+      if (++spins > 64)
+      {
+#ifdef _WIN32
+        Sleep(0);
+#else
+        sched_yield();
+#endif
+      }
+    }
+    NJ_BARRIER();
+    return s;
+  }
+  bool ReadRetry(unsigned int s) const { NJ_BARRIER(); return m_seq != s; }
+
+private:
+  volatile unsigned int m_seq;
+};
+
+// where session mode channels are playing, written by AudioProc() every call,
+// read by Run() to open the decoders they will need next
+class NJSessionPlayPos
+{
+public:
+  NJSessionPlayPos() : pos(-1.0), restarts(0) { }
+
+  NJ_SeqLock lock;
+  double pos; // seconds, -1 if not playing
+  unsigned int restarts; // seeks and starts of playback
+};
+
+// names and settings, written by Run() when they change
+class NJMeterLayout
+{
+public:
+  NJMeterLayout() : serial(0), num_users(0), num_channels(0), num_local(0) { }
+
+  NJ_SeqLock lock;
+  unsigned int serial;
+  int graph_version; // RemoteMixGraph the channel list was made from
+  int num_users, num_channels, num_local;
+  NJClient_MeterUser users[NJCLIENT_METER_MAX_USERS];
+  NJClient_MeterChannel channels[NJCLIENT_METER_MAX_CHANNELS];
+  NJClient_MeterChannel local[MAX_LOCAL_CHANNELS];
+};
+
+// levels, written by AudioProc(). remote channels are in the order of the
+// RemoteMixGraph of graph_version
+class NJMeterLevels
+{
+public:
+  NJMeterLevels() : graph_version(0), num_remote(0), num_local(0), work_num_local(0) { memset(&output,0,sizeof(output)); }
+
+  NJ_SeqLock lock;
+  int graph_version;
+  int num_remote, num_local;
+  int remote_id[NJCLIENT_METER_MAX_CHANNELS]; // (user_idx<<8)|ch_idx
+  NJClient_MeterLevels remote[NJCLIENT_METER_MAX_CHANNELS];
+  int local_ch[MAX_LOCAL_CHANNELS];
+  NJClient_MeterLevels local[MAX_LOCAL_CHANNELS];
+  NJClient_MeterLevels output;
+
+  // audio thread only, filled by process_samples()
+  int work_num_local;
+  int work_local_ch[MAX_LOCAL_CHANNELS];
+  NJClient_MeterLevels work_local[MAX_LOCAL_CHANNELS];
+};
+
+static int meterCount(int n, int max) { return n < 0 ? 0 : n > max ? max : n; }
+
+static void meterLevelsFrom(NJClient_MeterLevels *lvl, const double *peak, const double *ms)
+{
+  lvl->peak[0]=(float)peak[0];
+  lvl->peak[1]=(float)peak[1];
+  lvl->rms[0]=(float)sqrt(ms[0]);
+  lvl->rms[1]=(float)sqrt(ms[1]);
+}
+
+// mixes weight * the mean square of frames of interleaved src (first two channels) into ms[0..1]
+static void addMeanSquare(const float *src, int frames, int nch, double weight, double *ms)
+{
+  if (frames < 1 || nch < 1) return;
+  double s1=0.0, s2=0.0;
+  int x;
+  if (nch > 1)
+  {
+    for (x = 0; x < frames; x ++, src += nch)
+    {
+      s1 += src[0]*(double)src[0];
+      s2 += src[1]*(double)src[1];
+    }
+  }
+  else
+  {
+    for (x = 0; x < frames; x ++) s1 += src[x]*(double)src[x];
+    s2=s1;
+  }
+  ms[0] += s1*weight/frames;
+  ms[1] += s2*weight/frames;
+}
+
+
+
+// times a lock taken on the audio thread, see NJClient::AudioLockStats
+static void audioLockEnter(WDL_Mutex *m, int which, NJClient_AudioLockStats *st, NJTraceRing *trace)
+{
+  if (!st && !trace)
+  {
+    m->Enter();
+    return;
+  }
+
+  if (trace) trace->Add(NJTRACE_LOCK,which);
+  const double t=st ? NJTrace_GetTime() : 0.0;
+  m->Enter();
+  if (trace) trace->Add(NJTRACE_LOCK|NJTRACE_END,which);
+
+  if (st)
+  {
+    const double w=NJTrace_GetTime()-t;
+    st->count[which]++;
+    st->wait[which]+=w;
+    if (w > st->maxwait[which]) st->maxwait[which]=w;
+  }
+}
 
 class BufferQueue
 {
@@ -363,7 +672,9 @@ class BufferQueue
       Clear();
     }
 
-    void AddBlock(int attr, double blockstart, float *samples, int len, float *samples2=NULL);
+    // st and trace are the caller's NJClient::AudioLockStats and AudioTrace, when on the audio thread
+    void AddBlock(int attr, double blockstart, float *samples, int len, float *samples2=NULL,
+                  NJClient_AudioLockStats *st=NULL, NJTraceRing *trace=NULL);
     int GetBlock(WDL_HeapBuf **b, int *attr=NULL, double *startpos=NULL); // return 0 if got one, 1 if none avail
     void DisposeBlock(WDL_HeapBuf *b);
 
@@ -420,6 +731,7 @@ public:
   BufferQueue m_bq;
 
   double decode_peak_vol[2];
+  double decode_rms[2]; // mean square, audio thread
   bool m_need_header;
   int out_chan_index;
   int flags;
@@ -441,139 +753,1135 @@ public:
   //DecodeState too, eventually
 };
 
+// the local channels as AudioProc() sees them, see the comment above RemoteMixGraph
+class LocalMixGraph
+{
+public:
+  LocalMixGraph() : version(0) { }
+  ~LocalMixGraph() { retired_channels.Empty(true); }
 
+  struct Entry
+  {
+    Local_Channel *lc; // only its audio thread state (bcast_active, meters, m_bq) is used
+    int channel_idx;
+    int src_channel;
+    int out_chan_index;
+    int flags;
+    float volume, pan;
+    bool muted, solo, broadcasting;
+    void (*cbf)(float *, int ns, void *);
+    void *cbf_inst;
+  };
+
+  int version;
+  WDL_TypedBuf<Entry> entries; // m_locchannels, in order
+  WDL_PtrList<Local_Channel> retired_channels; // deleted while this graph was current
+};
 
 
 
 
 
-#define MIN_ENC_BLOCKSIZE 2048
-#define MAX_ENC_BLOCKSIZE (8192+1024)
-#define DEFAULT_CONFIG_PREBUFFER  8192
-#define LIVE_PREBUFFER 1024
-#define LIVE_ENC_BLOCKSIZE1 2048
-#define LIVE_ENC_BLOCKSIZE2 64
 
+// the thread of NJClient::StartNetThread(). it sleeps until the connection's
+// socket is readable (or writable, when there's something left to send), Wake()
+// is called, or a timeout passes, whichever comes first. Wake() is called from
+// the audio thread, so it only sets a flag and signals an eventfd (a pipe
+// elsewhere, an event on Windows), and does that once per wait.
+#define NJ_NETTHREAD_IDLE_MS 50 // keepalives, download timeouts and the like
+#define NJ_NETTHREAD_CONNECT_MS 10 // no socket to wait on yet (resolving)
 
-#define NJ_PORT 2049
+class NJNetThread
+{
+public:
+  NJNetThread();
+  ~NJNetThread();
 
-static unsigned char zero_guid[16];
+  bool Init(); // false if the wakeup handle can't be created
+  void Wake() // any thread
+  {
+    if (m_wake_pending) return;
+    m_wake_pending=1;
+#ifdef _WIN32
+    SetEvent(m_wakeevent);
+#elif defined(__linux__)
+    const unsigned long long v=1;
+    if (write(m_wakefd,&v,sizeof(v))<0) { } // only fails if the counter is huge, in which case it's signalled anyway
+#else
+    const char c=0;
+    if (write(m_wakepipe[1],&c,1)<0) { } // pipe full: it's signalled anyway
+#endif
+  }
+  void BeginRun(); // network thread, before calling Run(): consumes wakeups up to this point
+  void Wait(SOCKET s, bool wantwrite, int timeout_ms); // network thread
 
+#ifdef _WIN32
+  static DWORD WINAPI ThreadProc(LPVOID p);
+#else
+  static void *ThreadProc(void *p);
+#endif
 
-static void guidtostr(const unsigned char *guid, char *str)
-{
-  int x;
-  for (x = 0; x < 16; x ++) sprintf(str+x*2,"%02x",guid[x]);
-}
-static bool strtoguid(const char *str, unsigned char *guid)
-{
-  int n=16;
-  while(n--)
-  {
-    unsigned char v=0;
-    if (str[0]>='0' && str[0]<='9') v+=str[0]-'0';
-    else if (str[0]>='a' && str[0]<='f') v+=10 + str[0]-'a';
-    else if (str[0]>='A' && str[0]<='F') v+=10 + str[0]-'A';
-    else return false;
-    v<<=4;
+  NJClient *m_client;
+  WDL_Mutex *m_runlock;
+  volatile int m_quit;
+  volatile int m_wake_pending;
 
-    str++;
-    if (str[0]>='0' && str[0]<='9') v+=str[0]-'0';
-    else if (str[0]>='a' && str[0]<='f') v+=10 + str[0]-'a';
-    else if (str[0]>='A' && str[0]<='F') v+=10 + str[0]-'A';
-    else return false;
+#ifdef _WIN32
+  HANDLE m_thread;
+  HANDLE m_wakeevent;
+  WSAEVENT m_sockevent;
+#else
+  pthread_t m_thread;
+#ifdef __linux__
+  int m_epfd, m_wakefd;
+  SOCKET m_epsock; // registered with m_epfd, INVALID_SOCKET if none
+#else
+  int m_wakepipe[2];
+#endif
+#endif
+};
 
-    str++;
-    *guid++=v;
-  }
-  return true;
+NJNetThread::NJNetThread() : m_client(0), m_runlock(0), m_quit(0), m_wake_pending(0)
+{
+#ifdef _WIN32
+  m_thread=NULL;
+  m_wakeevent=NULL;
+  m_sockevent=WSA_INVALID_EVENT;
+#elif defined(__linux__)
+  m_epfd=m_wakefd=-1;
+  m_epsock=INVALID_SOCKET;
+#else
+  m_wakepipe[0]=m_wakepipe[1]=-1;
+#endif
 }
 
-static char *guidtostr_tmp(unsigned char *guid)
+NJNetThread::~NJNetThread()
 {
-  static char tmp[64];
-  guidtostr(guid,tmp);
-  return tmp;
+#ifdef _WIN32
+  if (m_wakeevent) CloseHandle(m_wakeevent);
+  if (m_sockevent != WSA_INVALID_EVENT) WSACloseEvent(m_sockevent);
+#elif defined(__linux__)
+  if (m_epfd>=0) close(m_epfd);
+  if (m_wakefd>=0) close(m_wakefd);
+#else
+  if (m_wakepipe[0]>=0) close(m_wakepipe[0]);
+  if (m_wakepipe[1]>=0) close(m_wakepipe[1]);
+#endif
 }
 
-
-static int is_type_char_valid(int c)
+bool NJNetThread::Init()
 {
-  c&=0xff;
-  return (c >= 'a' && c <= 'z') ||
-         (c >= 'A' && c <= 'Z') ||
-         (c >= '0' && c <= '9') ||
-         c == ' ' || c == '-' || 
-         c == '.' || c == '_';
+#ifdef _WIN32
+  if (!m_wakeevent) m_wakeevent=CreateEvent(NULL,FALSE,FALSE,NULL);
+  if (m_sockevent == WSA_INVALID_EVENT) m_sockevent=WSACreateEvent();
+  return m_wakeevent && m_sockevent != WSA_INVALID_EVENT;
+#elif defined(__linux__)
+  if (m_wakefd<0) m_wakefd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+  if (m_epfd<0) m_epfd=epoll_create1(EPOLL_CLOEXEC);
+  if (m_wakefd<0 || m_epfd<0) return false;
+
+  struct epoll_event ev;
+  memset(&ev,0,sizeof(ev));
+  ev.events=EPOLLIN;
+  ev.data.fd=m_wakefd;
+  return !epoll_ctl(m_epfd,EPOLL_CTL_ADD,m_wakefd,&ev) || errno == EEXIST;
+#else
+  if (m_wakepipe[0]<0)
+  {
+    if (pipe(m_wakepipe)) return false;
+    int x;
+    for (x = 0; x < 2; x ++)
+    {
+      fcntl(m_wakepipe[x],F_SETFL,fcntl(m_wakepipe[x],F_GETFL)|O_NONBLOCK);
+      fcntl(m_wakepipe[x],F_SETFD,FD_CLOEXEC);
+    }
+  }
+  return true;
+#endif
 }
 
-static int is_type_valid(unsigned int t)
+void NJNetThread::BeginRun()
 {
-  return (t&0xff) != ' ' &&
-          is_type_char_valid(t>>24) &&
-          is_type_char_valid(t>>16) &&
-          is_type_char_valid(t>>8) &&
-          is_type_char_valid(t);
+  m_wake_pending=0;
+  NJ_BARRIER(); // a Wake() after this signals again
+#ifdef _WIN32
+  ResetEvent(m_wakeevent);
+#elif defined(__linux__)
+  unsigned long long v;
+  if (read(m_wakefd,&v,sizeof(v))<0) { } // EAGAIN if not signalled
+#else
+  char buf[64];
+  while (read(m_wakepipe[0],buf,sizeof(buf))>0);
+#endif
 }
 
-
-static void type_to_string(unsigned int t, char *out)
+void NJNetThread::Wait(SOCKET s, bool wantwrite, int timeout_ms)
 {
-  if (is_type_valid(t))
+#ifdef _WIN32
+  HANDLE h[2]={m_wakeevent,m_sockevent};
+  int nh=1;
+  // (re)selecting records events that are already pending, so FD_WRITE works like POLLOUT here
+  if (s != INVALID_SOCKET && !WSAEventSelect(s,m_sockevent,FD_READ|FD_CLOSE|(wantwrite ? FD_WRITE|FD_CONNECT : 0))) nh=2;
+  WaitForMultipleObjects(nh,h,FALSE,timeout_ms);
+  if (nh>1) 
   {
-    out[0]=(t)&0xff;
-    out[1]=(t>>8)&0xff;
-    out[2]=(t>>16)&0xff;
-    out[3]=' ';//(t>>24)&0xff;
-    out[4]=0;
-    int x=3;
-    while (out[x]==' ' && x > 0) out[x--]=0;
+    WSANETWORKEVENTS ne;
+    WSAEnumNetworkEvents(s,m_sockevent,&ne); // resets m_sockevent
   }
-  else *out=0;
+#elif defined(__linux__)
+  struct epoll_event ev;
+  memset(&ev,0,sizeof(ev));
+  ev.events=EPOLLIN|(wantwrite ? EPOLLOUT : 0);
+  ev.data.fd=s;
+  if (s != m_epsock)
+  {
+    // closing a socket removes it from the set, so this may fail
+    if (m_epsock != INVALID_SOCKET) epoll_ctl(m_epfd,EPOLL_CTL_DEL,m_epsock,&ev);
+    m_epsock=INVALID_SOCKET;
+    if (s != INVALID_SOCKET && !epoll_ctl(m_epfd,EPOLL_CTL_ADD,s,&ev)) m_epsock=s;
+  }
+  // modified every time: a new connection may have been given the same descriptor
+  else if (s != INVALID_SOCKET && epoll_ctl(m_epfd,EPOLL_CTL_MOD,s,&ev) && 
+           (errno != ENOENT || epoll_ctl(m_epfd,EPOLL_CTL_ADD,s,&ev))) m_epsock=INVALID_SOCKET;
+
+  struct epoll_event evs[2];
+  epoll_wait(m_epfd,evs,2,timeout_ms);
+#else
+  struct pollfd fds[2];
+  memset(fds,0,sizeof(fds));
+  fds[0].fd=m_wakepipe[0];
+  fds[0].events=POLLIN;
+  fds[1].fd=s;
+  fds[1].events=POLLIN|(wantwrite ? POLLOUT : 0);
+  poll(fds,s != INVALID_SOCKET ? 2 : 1,timeout_ms);
+#endif
 }
 
-static unsigned int string_to_type(char *in)
+#ifdef _WIN32
+DWORD WINAPI NJNetThread::ThreadProc(LPVOID p)
+#else
+void *NJNetThread::ThreadProc(void *p)
+#endif
 {
-  int n;
-  unsigned int ret=*in;
-  if (*in == ' ' || !is_type_char_valid(*in)) return 0;
-  in++;
-  for (n = 0; n < 3; n ++)
-  {
-    if (!is_type_char_valid(*in)) break;
-    ret|=(*in<<(8+8*n));
-    in++;
-  }
-  if (*in) return 0;
-  return ret;
+  ((NJNetThread *)p)->m_client->netThreadProc();
+  return 0;
 }
 
 
-void NJClient::makeFilenameFromGuid(WDL_String *s, unsigned char *guid)
+// Multitrack recording (NJClient::StartRecording()). AudioProc() copies the
+// stems of each process_samples() call into a byte ring as one segment, which
+// is published at once or, if it doesn't fit, dropped and counted (the
+// recorder writes silence in its place). It never waits for the recorder
+// thread, which converts segments to 24-bit PCM and writes them in large
+// blocks, aligned in memory and in the file.
+//
+// stem ids: 0 is the master, 1+channel_idx a local channel, and from
+// NJREC_REMOTE_STEM on remote channels, numbered by the control side as they
+// are subscribed to (see publishMixGraph()).
+#define NJREC_REMOTE_STEM (1+MAX_LOCAL_CHANNELS)
+#define NJREC_MAX_STEMS 1024
+#define NJREC_DEFAULT_RING (16<<20) // bytes, about 4 seconds of 10 stereo stems at 48kHz
+#define NJREC_DEFAULT_NCH 16
+#define NJREC_WRITE_BLOCK (3<<16) // bytes per write, a multiple of 3 (24-bit samples) and 4096
+#define NJREC_DATA_OFFSET 4096 // where audio starts in the file
+#define NJREC_SCRATCH_FRAMES 8192 // longest process_samples() call that records remote stems
+
+struct NJRecSegHdr
 {
-  char buf[256];
-  guidtostr(guid,buf);
+  int session; // NJRecorder::m_session when the segment was made
+  int srate;
+  int len; // frames
+  int pad;
+  WDL_INT64 pos; // frames since the start of the recording
+};
 
-  s->Set(m_workdir.Get());
-  //if (config_savelocalaudio>0)
+struct NJRecStemHdr // followed by nch*len floats, one channel after the other. stem -1 ends the segment
+{
+  int stem;
+  int nch;
+};
+
+// converts to little endian 24-bit, clipped. the SSE2 version rounds ties to even,
+// so it can differ from float_to_i24() by 1
+static void recFloatsToI24(const float *src, unsigned char *dest, int n)
+{
+#ifdef NJCLIENT_MIX_SSE2
+  const __m128 lo=_mm_set1_ps(-1.0f), hi=_mm_set1_ps(8388607.0f/8388608.0f), sc=_mm_set1_ps(8388608.0f);
+  // each 64-bit lane holds two 24-bit samples in 32-bit slots: move the upper one down next to the lower
+  const __m128i mlo=_mm_set_epi32(0,0x00ffffff,0,0x00ffffff), mhi=_mm_set_epi32(0x0000ffff,0xff000000,0x0000ffff,0xff000000);
+  while (n >= 8) // the second store of a group writes 2 bytes past it, into the next group
   {
-  #ifdef _WIN32
-    char tmp[3]={buf[0],'\\',0};
-  #else
-    char tmp[3]={buf[0],'/',0};
-  #endif
-    s->Append(tmp);
+    __m128i v=_mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src),lo),hi),sc));
+    v=_mm_or_si128(_mm_and_si128(v,mlo),_mm_and_si128(_mm_srli_epi64(v,8),mhi));
+    _mm_storel_epi64((__m128i *)dest,v);
+    _mm_storel_epi64((__m128i *)(dest+6),_mm_srli_si128(v,8));
+    src+=4;
+    dest+=12;
+    n-=4;
+  }
+#endif
+  while (n-- > 0)
+  {
+    float_to_i24((float *)src++,dest);
+    dest+=3;
   }
-  s->Append(buf);
 }
 
-
+// a 24-bit PCM WAV (WAVE_FORMAT_EXTENSIBLE) or Sony Wave64 file. the header is
+// padded with a junk chunk so that the audio starts at NJREC_DATA_OFFSET, and
+// audio is written NJREC_WRITE_BLOCK bytes at a time, unbuffered by stdio
+class NJRecFile
+{
+public:
+  NJRecFile() : m_fp(0), m_w64(false), m_nch(0), m_srate(0), m_frames(0), m_bytes(0), m_errors(0), m_buffill(0) { }
+  ~NJRecFile() { Close(); }
+
+  bool Open(const char *fn, bool w64, int nch, int srate);
+  void Write(const float *buf, int frames); // interleaved, m_nch channels
+  void WriteSilence(WDL_INT64 frames);
+  void Close(); // writes the rest and the header
+
+  int m_nch;
+  WDL_INT64 m_frames; // written so far
+  WDL_INT64 m_bytes;
+  int m_errors;
+
+private:
+  void flush();
+  void writeHeader(WDL_INT64 datalen);
+
+  FILE *m_fp;
+  bool m_w64;
+  int m_srate;
+  WDL_HeapBuf m_buf;
+  int m_buffill;
+};
+
+bool NJRecFile::Open(const char *fn, bool w64, int nch, int srate)
+{
+  Close();
+  m_fp=fopenUTF8(fn,"wb");
+  if (!m_fp) return false;
+  setvbuf(m_fp,NULL,_IONBF,0);
+  m_w64=w64;
+  m_nch=nch;
+  m_srate=srate;
+  m_frames=m_bytes=0;
+  m_buffill=0;
+  m_buf.Resize(NJREC_WRITE_BLOCK+4096);
+  writeHeader(0);
+  return true;
+}
+
+void NJRecFile::Write(const float *buf, int frames)
+{
+  if (!m_fp) return;
+  int n=frames*m_nch;
+  unsigned char *b=(unsigned char *)m_buf.GetAligned(4096);
+  while (n > 0)
+  {
+    int a=(NJREC_WRITE_BLOCK-m_buffill)/3;
+    if (a > n) a=n;
+    recFloatsToI24(buf,b+m_buffill,a);
+    buf+=a;
+    n-=a;
+    m_buffill+=a*3;
+    if (m_buffill >= NJREC_WRITE_BLOCK) flush();
+  }
+  m_frames+=frames;
+}
+
+void NJRecFile::WriteSilence(WDL_INT64 frames)
+{
+  if (!m_fp || frames<=0) return;
+  WDL_INT64 n=frames*m_nch*3;
+  unsigned char *b=(unsigned char *)m_buf.GetAligned(4096);
+  while (n > 0)
+  {
+    int a=NJREC_WRITE_BLOCK-m_buffill;
+    if (a > n) a=(int)n;
+    memset(b+m_buffill,0,a);
+    n-=a;
+    m_buffill+=a;
+    if (m_buffill >= NJREC_WRITE_BLOCK) flush();
+  }
+  m_frames+=frames;
+}
+
+void NJRecFile::flush()
+{
+  if (m_buffill>0 && fwrite(m_buf.GetAligned(4096),1,m_buffill,m_fp) != (size_t)m_buffill) m_errors++;
+  m_bytes+=m_buffill;
+  m_buffill=0;
+}
+
+void NJRecFile::Close()
+{
+  if (!m_fp) return;
+  flush();
+  const WDL_INT64 datalen=m_bytes;
+  const int padlen=m_w64 ? (int)((8-(datalen&7))&7) : (int)(datalen&1);
+  if (padlen)
+  {
+    const char pad[8]={0,};
+    fwrite(pad,1,padlen,m_fp);
+  }
+  fseek(m_fp,0,SEEK_SET);
+  writeHeader(datalen);
+  fclose(m_fp);
+  m_fp=0;
+}
+
+static unsigned char *recPut(unsigned char *p, WDL_INT64 v, int bytes)
+{
+  while (bytes--) { *p++=(unsigned char)v; v>>=8; }
+  return p;
+}
+
+static unsigned char *recPutW64Guid(unsigned char *p, const char *id) // id is one of the w64 chunk names, lowercase
+{
+  static const unsigned char riff[12]={0x2E,0x91,0xCF,0x11,0xA5,0xD6,0x28,0xDB,0x04,0xC1,0x00,0x00};
+  static const unsigned char other[12]={0xF3,0xAC,0xD3,0x11,0x8C,0xD1,0x00,0xC0,0x4F,0x8E,0xDB,0x8A};
+  memcpy(p,id,4);
+  memcpy(p+4,strcmp(id,"riff") ? other : riff,12);
+  return p+16;
+}
+
+void NJRecFile::writeHeader(WDL_INT64 datalen)
+{
+  unsigned char hdr[NJREC_DATA_OFFSET], *p=hdr;
+  memset(hdr,0,sizeof(hdr));
+  const int padlen=m_w64 ? (int)((8-(datalen&7))&7) : (int)(datalen&1);
+
+  // WAVE_FORMAT_EXTENSIBLE, 24-bit PCM
+  static const unsigned char pcm_guid[16]={0x01,0x00,0x00,0x00,0x00,0x00,0x10,0x00,0x80,0x00,0x00,0xAA,0x00,0x38,0x9B,0x71};
+  unsigned char fmt[40], *f=fmt;
+  f=recPut(f,0xFFFE,2);
+  f=recPut(f,m_nch,2);
+  f=recPut(f,m_srate,4);
+  f=recPut(f,m_srate*m_nch*3,4);
+  f=recPut(f,m_nch*3,2);
+  f=recPut(f,24,2);
+  f=recPut(f,22,2);
+  f=recPut(f,24,2);
+  f=recPut(f,m_nch==1 ? 4 : m_nch==2 ? 3 : 0,4); // mono is front center, stereo front left/right, more channels have no speaker assignment
+  memcpy(f,pcm_guid,16);
+
+  if (m_w64)
+  {
+    p=recPutW64Guid(p,"riff");
+    p=recPut(p,NJREC_DATA_OFFSET+datalen+padlen,8);
+    p=recPutW64Guid(p,"wave");
+    p=recPutW64Guid(p,"fmt ");
+    p=recPut(p,24+sizeof(fmt),8);
+    memcpy(p,fmt,sizeof(fmt));
+    p+=sizeof(fmt);
+    const int junklen=NJREC_DATA_OFFSET-24-(int)(p-hdr);
+    p=recPutW64Guid(p,"junk");
+    p=recPut(p,junklen,8);
+    p=hdr+NJREC_DATA_OFFSET-24;
+    p=recPutW64Guid(p,"data");
+    p=recPut(p,24+datalen,8);
+  }
+  else
+  {
+    // sizes past 4GB don't fit, use W64 for recordings that long
+    WDL_INT64 riffsize=NJREC_DATA_OFFSET-8+datalen+padlen;
+    if (riffsize > 0xffffffff) riffsize=0xffffffff;
+    memcpy(p,"RIFF",4);
+    p=recPut(p+4,riffsize,4);
+    memcpy(p,"WAVEfmt ",8);
+    p=recPut(p+8,sizeof(fmt),4);
+    memcpy(p,fmt,sizeof(fmt));
+    p+=sizeof(fmt);
+    const int junklen=NJREC_DATA_OFFSET-8-8-(int)(p-hdr);
+    memcpy(p,"JUNK",4);
+    p=recPut(p+4,junklen,4);
+    p=hdr+NJREC_DATA_OFFSET-8;
+    memcpy(p,"data",4);
+    recPut(p+4,datalen > 0xffffffff ? 0xffffffff : datalen,4);
+  }
+
+  if (fwrite(hdr,1,sizeof(hdr),m_fp) != sizeof(hdr)) m_errors++;
+}
+
+
+struct NJRecStem
+{
+  WDL_String key; // remote stems: username and channel index
+  WDL_String name;
+
+  // recorder thread
+  int nch; // 0 until it has audio
+  int first_ch; // NJC_REC_INTERLEAVED: its first channel in the file, -1 if it did not fit
+  NJRecFile *file; // one file per stem
+};
+
+class NJRecorder
+{
+public:
+  NJRecorder();
+  ~NJRecorder();
+
+  // control side
+  bool Start(const char *path, int sources, int flags, int nch, int ringsize);
+  void Stop();
+  void SetStemName(int stem, const char *name);
+  int GetRemoteStem(const char *username, int ch, const char *chname); // -1 if too many
+  void GetStats(NJClient_RecordingStats *st);
+
+  // audio thread, between BeginSegment() and EndSegment() of a process_samples() call
+  void BeginSegment(int srate, int len);
+  void AddStem(int stem, int nch, const float *ch0, const float *ch1); // ch1 is ignored if nch is 1
+  void EndSegment();
+
+  bool m_active; // control side: between Start() and Stop()
+  int m_sources; // NJC_REC_*
+  WDL_TypedBuf<float> m_scratch; // audio thread, for the remote stems, 2*NJREC_SCRATCH_FRAMES
+
+#ifdef _WIN32
+  static DWORD WINAPI ThreadProc(LPVOID p);
+#else
+  static void *ThreadProc(void *p);
+#endif
+
+private:
+  void threadProc();
+  void ringRead(void *buf, int len); // recorder thread, at m_rd
+  bool ringWrite(const void *buf, int len); // audio thread, at m_seg_wr
+  void writeStem(NJRecStem *st, int stem, int nch, WDL_INT64 pos, int len, const float *data);
+  void openStemFile(NJRecStem *st, int stem);
+  void finish();
+
+  WDL_Mutex m_cs; // m_stems (key and name), m_path, stats
+  WDL_PtrList<NJRecStem> m_stems; // by id, NULL for ids not used yet
+  WDL_String m_path;
+  int m_flags, m_nch;
+
+  WDL_HeapBuf m_ring;
+  unsigned int m_ringsize; // power of 2
+  volatile unsigned int m_wrpos, m_rdpos;
+  volatile int m_session;
+  volatile int m_quit;
+
+  // audio thread
+  int m_audio_session;
+  WDL_INT64 m_audio_pos;
+  unsigned int m_seg_wr;
+  bool m_seg_failed;
+  int m_seg_len;
+
+  // recorder thread
+  unsigned int m_rd;
+  WDL_INT64 m_pos; // frames written (or skipped) so far
+  int m_srate;
+  NJRecFile *m_file; // NJC_REC_INTERLEAVED
+  int m_nextch;
+  WDL_TypedBuf<float> m_stage, m_frames;
+
+  // stats
+  volatile int m_dropped_blocks, m_dropped_frames, m_peak;
+  int m_nstems, m_skipped;
+  WDL_INT64 m_bytes;
+  int m_errors;
+
+#ifdef _WIN32
+  HANDLE m_thread;
+#else
+  pthread_t m_thread;
+  bool m_thread_valid;
+#endif
+};
+
+NJRecorder::NJRecorder() : m_active(false), m_sources(0), m_flags(0), m_nch(0), m_ringsize(0), m_wrpos(0), m_rdpos(0),
+  m_session(0), m_quit(0), m_audio_session(0), m_audio_pos(0), m_seg_wr(0), m_seg_failed(false), m_seg_len(0),
+  m_rd(0), m_pos(0), m_srate(0), m_file(0), m_nextch(0), m_dropped_blocks(0), m_dropped_frames(0), m_peak(0),
+  m_nstems(0), m_skipped(0), m_bytes(0), m_errors(0)
+{
+#ifdef _WIN32
+  m_thread=NULL;
+#else
+  m_thread_valid=false;
+#endif
+}
+
+NJRecorder::~NJRecorder()
+{
+  Stop();
+  m_stems.Empty(true);
+}
+
+bool NJRecorder::Start(const char *path, int sources, int flags, int nch, int ringsize)
+{
+  if (m_active || !path || !*path) return false;
+
+  if (!m_ringsize) // the audio thread may still be finishing a segment of a previous recording, so this is never reallocated
+  {
+    if (ringsize <= 0) ringsize=NJREC_DEFAULT_RING;
+    m_ringsize=65536;
+    while (m_ringsize < (unsigned int)ringsize && m_ringsize < (1u<<30)) m_ringsize<<=1;
+    m_ring.Resize(m_ringsize);
+    if (m_ring.GetSize() != (int)m_ringsize) { m_ringsize=0; return false; }
+    m_scratch.Resize(2*NJREC_SCRATCH_FRAMES);
+  }
+
+  if (!(flags&NJClient::NJC_REC_INTERLEAVED))
+  {
+#ifdef _WIN32
+    CreateDirectory(path,NULL);
+#else
+    mkdir(path,0755);
+#endif
+  }
+
+  m_cs.Enter();
+  m_path.Set(path);
+  m_stems.Empty(true);
+  m_nstems=m_skipped=0;
+  m_bytes=0;
+  m_errors=0;
+  m_cs.Leave();
+  m_sources=sources;
+  m_flags=flags;
+  m_nch=nch>0 ? nch : NJREC_DEFAULT_NCH;
+  m_dropped_blocks=m_dropped_frames=m_peak=0;
+
+  m_rd=m_rdpos;
+  m_pos=0;
+  m_srate=0;
+  m_nextch=0;
+  m_quit=0;
+  NJ_BARRIER();
+  m_session++; // segments of an earlier recording still in the ring get skipped
+
+#ifdef _WIN32
+  DWORD tid;
+  m_thread=CreateThread(NULL,0,ThreadProc,this,0,&tid);
+  if (!m_thread) return false;
+#else
+  if (pthread_create(&m_thread,NULL,ThreadProc,this)) return false;
+  m_thread_valid=true;
+#endif
+  m_active=true;
+  return true;
+}
+
+void NJRecorder::Stop()
+{
+  if (!m_active) return;
+  m_quit=1;
+#ifdef _WIN32
+  WaitForSingleObject(m_thread,INFINITE);
+  CloseHandle(m_thread);
+  m_thread=NULL;
+#else
+  pthread_join(m_thread,NULL);
+  m_thread_valid=false;
+#endif
+  m_active=false;
+}
+
+void NJRecorder::SetStemName(int stem, const char *name)
+{
+  if (stem < 0 || stem >= NJREC_MAX_STEMS) return;
+  WDL_MutexLock lock(&m_cs);
+  NJRecStem *st=m_stems.Get(stem);
+  if (!st)
+  {
+    while (m_stems.GetSize() <= stem) m_stems.Add(NULL);
+    m_stems.Set(stem,st=new NJRecStem);
+    st->nch=0;
+    st->first_ch=-1;
+    st->file=NULL;
+  }
+  st->name.Set(name);
+}
+
+int NJRecorder::GetRemoteStem(const char *username, int ch, const char *chname)
+{
+  WDL_String key(username);
+  key.AppendFormatted(32,"\n%d",ch);
+
+  WDL_MutexLock lock(&m_cs);
+  int x;
+  for (x = NJREC_REMOTE_STEM; x < m_stems.GetSize(); x ++)
+  {
+    NJRecStem *st=m_stems.Get(x);
+    if (st && !strcmp(st->key.Get(),key.Get())) return x;
+  }
+  if (x < NJREC_REMOTE_STEM) x=NJREC_REMOTE_STEM;
+  if (x >= NJREC_MAX_STEMS) return -1;
+
+  WDL_String name(username);
+  name.Append(" - ");
+  name.Append(chname && *chname ? chname : "channel");
+  SetStemName(x,name.Get());
+  m_stems.Get(x)->key.Set(key.Get());
+  return x;
+}
+
+void NJRecorder::GetStats(NJClient_RecordingStats *st)
+{
+  memset(st,0,sizeof(*st));
+  WDL_MutexLock lock(&m_cs);
+  st->recording=m_active;
+  st->stems=m_nstems;
+  st->stems_skipped=m_skipped;
+  st->seconds=m_srate ? m_pos/(double)m_srate : 0.0;
+  st->bytes_written=m_bytes;
+  st->write_errors=m_errors;
+  st->dropped_blocks=m_dropped_blocks;
+  st->dropped_frames=m_dropped_frames;
+  st->buffer_size=m_ringsize;
+  st->buffer_peak=m_peak;
+}
+
+bool NJRecorder::ringWrite(const void *buf, int len)
+{
+  if (m_seg_failed) return false;
+  if (m_seg_wr + len - m_rdpos > m_ringsize)
+  {
+    m_seg_failed=true;
+    return false;
+  }
+  const unsigned int o=m_seg_wr & (m_ringsize-1);
+  int a=m_ringsize-o;
+  if (a > len) a=len;
+  memcpy((char *)m_ring.Get()+o,buf,a);
+  if (a < len) memcpy(m_ring.Get(),(const char *)buf+a,len-a);
+  m_seg_wr+=len;
+  return true;
+}
+
+void NJRecorder::ringRead(void *buf, int len)
+{
+  const unsigned int o=m_rd & (m_ringsize-1);
+  int a=m_ringsize-o;
+  if (a > len) a=len;
+  if (buf)
+  {
+    memcpy(buf,(const char *)m_ring.Get()+o,a);
+    if (a < len) memcpy((char *)buf+a,m_ring.Get(),len-a);
+  }
+  m_rd+=len;
+}
+
+void NJRecorder::BeginSegment(int srate, int len)
+{
+  const int session=m_session;
+  if (session != m_audio_session)
+  {
+    m_audio_session=session;
+    m_audio_pos=0;
+  }
+  m_seg_wr=m_wrpos;
+  m_seg_failed=false;
+  m_seg_len=len;
+
+  NJRecSegHdr h;
+  h.session=session;
+  h.srate=srate;
+  h.len=len;
+  h.pad=0;
+  h.pos=m_audio_pos;
+  ringWrite(&h,sizeof(h));
+}
+
+void NJRecorder::AddStem(int stem, int nch, const float *ch0, const float *ch1)
+{
+  if (m_seg_failed) return;
+  NJRecStemHdr h;
+  h.stem=stem;
+  h.nch=nch>1 ? 2 : 1;
+  if (ringWrite(&h,sizeof(h)) && ringWrite(ch0,m_seg_len*sizeof(float)) && h.nch>1) ringWrite(ch1,m_seg_len*sizeof(float));
+}
+
+void NJRecorder::EndSegment()
+{
+  NJRecStemHdr h;
+  h.stem=-1;
+  h.nch=0;
+  if (ringWrite(&h,sizeof(h)))
+  {
+    NJ_BARRIER(); // segment must be complete before the position that publishes it
+    m_wrpos=m_seg_wr;
+    const int used=(int)(m_seg_wr-m_rdpos);
+    if (used > m_peak) m_peak=used;
+  }
+  else
+  {
+    m_dropped_blocks++;
+    m_dropped_frames+=m_seg_len;
+  }
+  m_audio_pos+=m_seg_len;
+}
+
+#ifdef _WIN32
+DWORD WINAPI NJRecorder::ThreadProc(LPVOID p)
+#else
+void *NJRecorder::ThreadProc(void *p)
+#endif
+{
+  ((NJRecorder *)p)->threadProc();
+  return 0;
+}
+
+void NJRecorder::threadProc()
+{
+  for (;;)
+  {
+    if (m_rd == m_wrpos)
+    {
+      if (m_quit) break;
+#ifdef _WIN32
+      Sleep(20);
+#else
+      struct timespec ts={0,20*1000*1000};
+      nanosleep(&ts,NULL);
+#endif
+      continue;
+    }
+    NJ_BARRIER();
+
+    NJRecSegHdr h;
+    ringRead(&h,sizeof(h));
+    const bool skip=h.session != m_session;
+    if (!skip)
+    {
+      if (!m_srate) m_srate=h.srate;
+      if ((m_flags&NJClient::NJC_REC_INTERLEAVED) && !m_file)
+      {
+        m_file=new NJRecFile;
+        if (!m_file->Open(m_path.Get(),!!(m_flags&NJClient::NJC_REC_W64),m_nch,m_srate)) m_errors++;
+      }
+      if (m_file)
+      {
+        m_file->WriteSilence(h.pos-m_pos); // dropped segments
+        m_frames.Resize(h.len*m_nch,false);
+        memset(m_frames.Get(),0,h.len*m_nch*sizeof(float));
+      }
+    }
+
+    for (;;)
+    {
+      NJRecStemHdr sh;
+      ringRead(&sh,sizeof(sh));
+      if (sh.stem < 0) break;
+
+      const int sz=h.len*sh.nch;
+      if (skip || sh.stem >= NJREC_MAX_STEMS)
+      {
+        ringRead(NULL,sz*sizeof(float));
+        continue;
+      }
+      m_stage.Resize(sz,false);
+      ringRead(m_stage.Get(),sz*sizeof(float));
+
+      m_cs.Enter();
+      NJRecStem *st=m_stems.Get(sh.stem);
+      m_cs.Leave();
+      if (!st)
+      {
+        WDL_String name;
+        name.SetFormatted(64,"stem %d",sh.stem);
+        SetStemName(sh.stem,name.Get());
+        m_cs.Enter();
+        st=m_stems.Get(sh.stem);
+        m_cs.Leave();
+      }
+      writeStem(st,sh.stem,sh.nch,h.pos,h.len,m_stage.Get());
+    }
+
+    if (!skip)
+    {
+      WDL_INT64 bytes=0;
+      if (m_file)
+      {
+        m_file->Write(m_frames.Get(),h.len);
+        bytes=m_file->m_bytes;
+      }
+      m_cs.Enter(); // for GetStats()
+      int x;
+      for (x = 0; x < m_stems.GetSize(); x ++)
+      {
+        NJRecStem *st=m_stems.Get(x);
+        if (st && st->file) bytes+=st->file->m_bytes;
+      }
+      m_pos=h.pos+h.len;
+      m_bytes=bytes;
+      m_cs.Leave();
+    }
+    NJ_BARRIER(); // done with the segment before handing the space back
+    m_rdpos=m_rd;
+  }
+
+  finish();
+}
+
+void NJRecorder::openStemFile(NJRecStem *st, int stem)
+{
+  m_cs.Enter();
+  WDL_String fn(m_path.Get());
+#ifdef _WIN32
+  fn.Append("\\");
+#else
+  fn.Append("/");
+#endif
+  fn.AppendFormatted(32,"%02d ",++m_nstems);
+  const char *p=st->name.Get();
+  while (*p)
+  {
+    char c=*p++;
+    if (c == '/' || c == '\\' || c == ':' || c == '*' || c == '?' || c == '\"' || c == '<' || c == '>' || c == '|' || (unsigned char)c < ' ') c='_';
+    fn.Append(&c,1);
+  }
+  fn.Append(m_flags&NJClient::NJC_REC_W64 ? ".w64" : ".wav");
+  m_cs.Leave();
+
+  st->file=new NJRecFile;
+  if (!st->file->Open(fn.Get(),!!(m_flags&NJClient::NJC_REC_W64),st->nch,m_srate)) m_errors++;
+}
+
+void NJRecorder::writeStem(NJRecStem *st, int stem, int nch, WDL_INT64 pos, int len, const float *data)
+{
+  if (!st->nch)
+  {
+    st->nch=nch;
+    if (m_file)
+    {
+      m_cs.Enter();
+      if (m_nextch+nch <= m_nch)
+      {
+        st->first_ch=m_nextch;
+        m_nextch+=nch;
+        m_nstems++;
+      }
+      else m_skipped++;
+      m_cs.Leave();
+    }
+    else openStemFile(st,stem);
+  }
+
+  // to the stem's channel count, which is set when it first has audio
+  float *out;
+  int outnch, x;
+  if (m_file)
+  {
+    if (st->first_ch < 0) return;
+    out=m_frames.Get()+st->first_ch;
+    outnch=m_nch;
+  }
+  else
+  {
+    m_frames.Resize(len*st->nch,false);
+    out=m_frames.Get();
+    outnch=st->nch;
+    memset(out,0,len*st->nch*sizeof(float));
+  }
+
+  const float *ch0=data, *ch1=data+(nch>1 ? len : 0);
+  if (st->nch > 1)
+  {
+    for (x = 0; x < len; x ++) { out[0]=ch0[x]; out[1]=ch1[x]; out+=outnch; }
+  }
+  else if (nch > 1)
+  {
+    for (x = 0; x < len; x ++) { out[0]=(ch0[x]+ch1[x])*0.5f; out+=outnch; }
+  }
+  else
+  {
+    for (x = 0; x < len; x ++) { out[0]=ch0[x]; out+=outnch; }
+  }
+
+  if (!m_file && st->file)
+  {
+    st->file->WriteSilence(pos-st->file->m_frames); // until it first had audio, or when it had none
+    st->file->Write(m_frames.Get(),len);
+  }
+}
+
+void NJRecorder::finish()
+{
+  int x;
+  WDL_INT64 bytes=0;
+  int errors=0;
+  WDL_String map;
+  m_cs.Enter();
+  for (x = 0; x < m_stems.GetSize(); x ++)
+  {
+    NJRecStem *st=m_stems.Get(x);
+    if (!st) continue;
+    if (st->file)
+    {
+      st->file->WriteSilence(m_pos-st->file->m_frames); // all the same length
+      st->file->Close();
+      bytes+=st->file->m_bytes;
+      errors+=st->file->m_errors;
+      delete st->file;
+      st->file=NULL;
+    }
+    if (m_file && st->first_ch >= 0)
+    {
+      if (st->nch > 1) map.AppendFormatted(512,"%d-%d %s\n",st->first_ch+1,st->first_ch+2,st->name.Get());
+      else map.AppendFormatted(512,"%d %s\n",st->first_ch+1,st->name.Get());
+    }
+  }
+  m_cs.Leave();
+
+  if (m_file)
+  {
+    m_file->Close();
+    bytes+=m_file->m_bytes;
+    errors+=m_file->m_errors;
+    delete m_file;
+    m_file=NULL;
+
+    // which channels are which
+    WDL_String fn(m_path.Get());
+    fn.Append(".txt");
+    FILE *fp=fopenUTF8(fn.Get(),"wt");
+    if (fp)
+    {
+      fputs(map.Get(),fp);
+      fclose(fp);
+    }
+  }
+
+  m_cs.Enter();
+  m_bytes=bytes;
+  m_errors+=errors;
+  m_cs.Leave();
+}
+
+
+#define MIN_ENC_BLOCKSIZE 2048
+#define MAX_ENC_BLOCKSIZE (8192+1024)
+#define DEFAULT_CONFIG_PREBUFFER  8192
+#define LIVE_PREBUFFER 1024
+#define LIVE_ENC_BLOCKSIZE1 2048
+#define LIVE_ENC_BLOCKSIZE2 64
+
+
+#define NJ_PORT 2049
+
+static unsigned char zero_guid[16];
+
+
+static void guidtostr(const unsigned char *guid, char *str)
+{
+  int x;
+  for (x = 0; x < 16; x ++) sprintf(str+x*2,"%02x",guid[x]);
+}
+static bool strtoguid(const char *str, unsigned char *guid)
+{
+  int n=16;
+  while(n--)
+  {
+    unsigned char v=0;
+    if (str[0]>='0' && str[0]<='9') v+=str[0]-'0';
+    else if (str[0]>='a' && str[0]<='f') v+=10 + str[0]-'a';
+    else if (str[0]>='A' && str[0]<='F') v+=10 + str[0]-'A';
+    else return false;
+    v<<=4;
+
+    str++;
+    if (str[0]>='0' && str[0]<='9') v+=str[0]-'0';
+    else if (str[0]>='a' && str[0]<='f') v+=10 + str[0]-'a';
+    else if (str[0]>='A' && str[0]<='F') v+=10 + str[0]-'A';
+    else return false;
+
+    str++;
+    *guid++=v;
+  }
+  return true;
+}
+
+static char *guidtostr_tmp(unsigned char *guid)
+{
+  static char tmp[64];
+  guidtostr(guid,tmp);
+  return tmp;
+}
+
+
+static int is_type_char_valid(int c)
+{
+  c&=0xff;
+  return (c >= 'a' && c <= 'z') ||
+         (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') ||
+         c == ' ' || c == '-' || 
+         c == '.' || c == '_';
+}
+
+static int is_type_valid(unsigned int t)
+{
+  return (t&0xff) != ' ' &&
+          is_type_char_valid(t>>24) &&
+          is_type_char_valid(t>>16) &&
+          is_type_char_valid(t>>8) &&
+          is_type_char_valid(t);
+}
+
+
+static void type_to_string(unsigned int t, char *out)
+{
+  if (is_type_valid(t))
+  {
+    out[0]=(t)&0xff;
+    out[1]=(t>>8)&0xff;
+    out[2]=(t>>16)&0xff;
+    out[3]=' ';//(t>>24)&0xff;
+    out[4]=0;
+    int x=3;
+    while (out[x]==' ' && x > 0) out[x--]=0;
+  }
+  else *out=0;
+}
+
+static unsigned int string_to_type(char *in)
+{
+  int n;
+  unsigned int ret=*in;
+  if (*in == ' ' || !is_type_char_valid(*in)) return 0;
+  in++;
+  for (n = 0; n < 3; n ++)
+  {
+    if (!is_type_char_valid(*in)) break;
+    ret|=(*in<<(8+8*n));
+    in++;
+  }
+  if (*in) return 0;
+  return ret;
+}
+
+
+void NJClient::makeFilenameFromGuid(WDL_String *s, unsigned char *guid)
+{
+  char buf[256];
+  guidtostr(guid,buf);
+
+  s->Set(m_workdir.Get());
+  //if (config_savelocalaudio>0)
+  {
+  #ifdef _WIN32
+    char tmp[3]={buf[0],'\\',0};
+  #else
+    char tmp[3]={buf[0],'/',0};
+  #endif
+    s->Append(tmp);
+  }
+  s->Append(buf);
+}
+
+
 
 
 NJClient::NJClient()
 {
   m_wavebq=new BufferQueue;
   m_userinfochange=0;
+  m_submask_dirty=0;
   m_loopcnt=0;
   m_srate=48000;
 #ifdef _WIN32
@@ -604,6 +1912,9 @@ NJClient::NJClient()
   ChatMessage_User=0;
   ChannelMixer=0;
   ChannelMixer_User=0;
+  AudioLockStats=0;
+  AudioTrace=0;
+  m_trace=0;
 
   waveWrite=0;
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
@@ -615,6 +1926,43 @@ NJClient::NJClient()
   m_issoloactive=0;
   m_netcon=0;
 
+  m_mixgraph=new RemoteMixGraph;
+  m_audio_graph=0;
+  m_mixgraph_seen=0;
+  m_mixcmds=new MixCommandFifo;
+  m_mixcmd_seq=m_mixcmd_done=0;
+  m_audiomsgs=new AudioMessageFifo;
+  m_audio_retired_ds=0;
+  m_audiomsg_lost=m_audiomsg_lost_seen=0;
+  m_locgraph=new LocalMixGraph;
+  m_audio_locgraph=0;
+  m_locgraph_seen=0;
+  m_audio_claim=0;
+  m_audioproc_calls=m_audioproc_calls_seen=0;
+  m_audio_idle_since=0.0;
+  m_playpos=new NJSessionPlayPos;
+  m_audio_playrestarts=0;
+  m_audio_wasplaying=false;
+  m_playrestarts_seen=0;
+
+  m_meter_layout=new NJMeterLayout;
+  m_meter_levels=new NJMeterLevels;
+  m_meter_layout_dirty=1;
+
+  m_netthread=0;
+  m_netthread_running=0;
+  m_recorder=0;
+  m_recorder_running=0;
+  m_netwake_audio=0;
+  m_queue_ui_events=false;
+  m_uievents=0;
+  m_uievents_posted=false;
+  UIEventsPosted_Callback=0;
+  UIEventsPosted_User=0;
+
+  m_beatinfo_updated=m_beatinfo_seen=0;
+  m_metronome_click_srate=0;
+
   _reinit();
 
   m_session_pos_ms=m_session_pos_samples=0;
@@ -624,16 +1972,14 @@ void NJClient::_reinit()
 {
   m_max_localch=MAX_LOCAL_CHANNELS;
   output_peaklevel[0]=output_peaklevel[1]=0.0;
+  output_rmslevel[0]=output_rmslevel[1]=0.0;
 
   m_connection_keepalive=0;
   m_status=-1;
 
   m_in_auth=0;
 
-  m_bpm=120;
-  m_bpi=32;
-  
-  m_beatinfo_updated=1;
+  updateBPMinfo(120,32);
 
   m_audio_enable=0;
 
@@ -653,83 +1999,528 @@ void NJClient::_reinit()
   {
     m_locchannels.Get(x)->decode_peak_vol[0]=0.0f;
     m_locchannels.Get(x)->decode_peak_vol[1]=0.0f;
+    m_locchannels.Get(x)->decode_rms[0]=0.0;
+    m_locchannels.Get(x)->decode_rms[1]=0.0;
+  }
+  m_meter_layout_dirty=1;
+
+}
+
+
+void NJClient::writeLog(const char *fmt, ...)
+{
+  if (m_logFile)
+  {
+    va_list ap;
+    va_start(ap,fmt);
+
+    m_log_cs.Enter();
+    if (m_logFile) vfprintf(m_logFile,fmt,ap);
+    m_log_cs.Leave();
+
+    va_end(ap);
+
+  }
+
+
+}
+
+void NJClient::SetLogFile(char *name)
+{
+  m_log_cs.Enter();
+  if (m_logFile) fclose(m_logFile);
+  m_logFile=0;
+  if (name && *name)
+  {
+    if (!strstr(name,"\\") && !strstr(name,"/") && !strstr(name,":"))
+    {
+      WDL_String s(m_workdir.Get());
+      s.Append(name);
+      m_logFile=fopenUTF8(s.Get(),"a+t");
+    }
+    else
+      m_logFile=fopenUTF8(name,"a+t");
+  }
+  m_log_cs.Leave();
+}
+
+
+NJClient::~NJClient()
+{
+  StopNetThread();
+  delete m_netthread;
+  m_netthread=0;
+  StopRecording();
+  delete m_recorder;
+  m_recorder=0;
+  while (m_uievent_chat.GetSize()) // never dispatched
+  {
+    m_uievent_chat.Get(0)->releaseRef();
+    m_uievent_chat.Delete(0);
+  }
+
+  delete m_netcon;
+  m_netcon=0;
+
+  delete waveWrite;
+  SetOggOutFile(NULL,0,0);
+
+  // the audio thread is stopped: run what it has not, then free everything
+  do
+  {
+    reclaimMixGraphs();
+    runMixCommands();
+  }
+  while (m_mixcmd_done != m_mixcmd_seq);
+  m_mixgraph_seen=m_mixgraph->version+1;
+  m_locgraph_seen=m_locgraph->version+1;
+  reclaimMixGraphs();
+  while (m_audio_retired_ds)
+  {
+    DecodeState *ds=m_audio_retired_ds;
+    m_audio_retired_ds=ds->retire_next;
+    delete ds;
+  }
+  delete m_mixgraph;
+  delete m_locgraph;
+  delete m_playpos;
+  delete m_mixcmds;
+  delete m_audiomsgs;
+  delete m_meter_layout;
+  delete m_meter_levels;
+
+  if (m_logFile)
+  {
+    writeLog("end\n");
+    fclose(m_logFile);
+    m_logFile=0;
+  }
+
+  int x;
+  for (x = 0; x < m_remoteusers.GetSize(); x ++) delete m_remoteusers.Get(x);
+  m_remoteusers.Empty();
+  for (x = 0; x < m_downloads.GetSize(); x ++) delete m_downloads.Get(x);
+  m_downloads.Empty();
+  for (x = 0; x < m_locchannels.GetSize(); x ++) delete m_locchannels.Get(x);
+  m_locchannels.Empty();
+
+  delete m_wavebq;
+}
+
+
+void NJClient::updateBPMinfo(int bpm, int bpi)
+{
+  m_beatinfo=(bpm<<16)|(bpi&0xffff);
+  NJ_BARRIER(); // AudioProc() reads m_beatinfo after seeing the new count
+  m_beatinfo_updated++;
+}
+
+void NJClient::publishMixGraph()
+{
+  RemoteMixGraph *g=new RemoteMixGraph;
+  int u;
+  for (u = 0; u < m_remoteusers.GetSize(); u ++)
+  {
+    RemoteUser *user=m_remoteusers.Get(u);
+    int ch;
+    for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
+    {
+      if (!(user->chanpresentmask & (1<<ch))) continue;
+
+      RemoteUser_Channel *chan=&user->channels[ch];
+      RemoteMixGraph::Entry e;
+      e.user=user;
+      e.chan=chan;
+      e.user_idx=u;
+      e.ch_idx=ch;
+      e.chflags=chan->flags;
+      e.state=0;
+      if (user->submask & (1<<ch)) e.state|=RemoteMixGraph::ENTRY_SUBSCRIBED;
+      if ((user->mutedmask & (1<<ch)) || user->muted) e.state|=RemoteMixGraph::ENTRY_MUTED;
+      if (user->solomask & (1<<ch)) e.state|=RemoteMixGraph::ENTRY_SOLO;
+      e.vol=user->volume*chan->volume;
+      e.pan=user->pan+chan->pan;
+      if (e.pan<-1.0f) e.pan=-1.0f;
+      else if (e.pan>1.0f) e.pan=1.0f;
+      e.out_chan=chan->out_chan_index;
+      e.rec_stem=-1;
+      if (m_recorder && m_recorder->m_active && (m_recorder->m_sources&NJC_REC_REMOTE) && (e.state&RemoteMixGraph::ENTRY_SUBSCRIBED))
+        e.rec_stem=m_recorder->GetRemoteStem(user->name.Get(),ch,chan->name.Get());
+      g->entries.Add(&e,1);
+    }
+  }
+
+  m_mixgraph_cs.Enter();
+  RemoteMixGraph *old=m_mixgraph;
+  g->version=old->version+1;
+  old->free_after_cmd=m_mixcmd_seq;
+  NJ_BARRIER(); // graph must be complete before AudioProc() can see it
+  m_mixgraph=g;
+  m_mixgraph_retired.Add(old);
+  m_mixgraph_cs.Leave();
+
+  m_meter_layout_dirty=1;
+}
+
+void NJClient::publishLocalGraph()
+{
+  LocalMixGraph *g=new LocalMixGraph;
+  int x;
+  for (x = 0; x < m_locchannels.GetSize(); x ++)
+  {
+    Local_Channel *lc=m_locchannels.Get(x);
+    LocalMixGraph::Entry e;
+    e.lc=lc;
+    e.channel_idx=lc->channel_idx;
+    e.src_channel=lc->src_channel;
+    e.out_chan_index=lc->out_chan_index;
+    e.flags=lc->flags;
+    e.volume=lc->volume;
+    e.pan=lc->pan;
+    e.muted=lc->muted;
+    e.solo=lc->solo;
+    e.broadcasting=lc->broadcasting;
+    e.cbf=lc->cbf;
+    e.cbf_inst=lc->cbf_inst;
+    g->entries.Add(&e,1);
+  }
+
+  LocalMixGraph *old=m_locgraph;
+  g->version=old->version+1;
+  NJ_BARRIER(); // graph must be complete before AudioProc() can see it
+  m_locgraph=g;
+  m_locgraph_retired.Add(old);
+}
+
+void NJClient::retireRemoteUser(RemoteUser *user)
+{
+  int ch;
+  for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
+  {
+    if (user->chanpresentmask & (1<<ch)) sendMixCommand(MIXCMD_FLUSH,&user->channels[ch],NULL);
+  }
+
+  m_mixgraph_cs.Enter();
+  m_mixgraph->retired_users.Add(user);
+  m_mixgraph_cs.Leave();
+}
+
+void NJClient::updateRemoteChannel(int useridx, int active, int cid, int flags, const char *chname)
+{
+  RemoteUser *theuser=m_remoteusers.Get(useridx);
+  if (!chname) chname="";
+
+  if (active)
+  {
+    if ((theuser->channels[cid].flags^flags)&(2|4)) // if flags changed instamode, flush out the samples
+    {
+      sendMixCommand(MIXCMD_FLUSH,&theuser->channels[cid],NULL);
+//      OutputDebugString("channel flags changed, flushing sources\n");
+    }
+    theuser->channels[cid].flags = flags;
+
+    if (!(theuser->channels[cid].flags&4))
+    {
+      theuser->channels[cid].ClearSessionInfo();
+    }
+
+    theuser->channels[cid].name.Set(chname);
+    theuser->chanpresentmask |= 1<<cid;
+
+
+    if (config_autosubscribe && !(flags&1)) // channels flagged 1 are only subscribed to explicitly
+    {
+      theuser->submask |= 1<<cid;
+      m_submask_dirty=1;
+    }
+  }
+  else
+  {
+    theuser->channels[cid].ClearSessionInfo();
+
+    theuser->channels[cid].name.Set("");
+    theuser->chanpresentmask &= ~(1<<cid);
+    theuser->submask &= ~(1<<cid);
+    theuser->submask_sent &= ~(1<<cid); // the server drops it too
+
+    int chksolo=theuser->solomask == (1<<cid);
+    theuser->solomask &= ~(1<<cid);
+
+    sendMixCommand(MIXCMD_FLUSH,&theuser->channels[cid],NULL);
+//    OutputDebugString("channel flags changed, flushing sources2\n");
+
+    if (!theuser->chanpresentmask) // user no longer exists, it seems
+    {
+      chksolo=1;
+      m_remoteusers.Delete(useridx);
+      retireRemoteUser(theuser);
+    }
+
+    if (chksolo)
+    {
+      int i;
+      for (i = 0; i < m_remoteusers.GetSize() && !m_remoteusers.Get(i)->solomask; i ++);
+
+      if (i < m_remoteusers.GetSize()) m_issoloactive|=1;
+      else m_issoloactive&=~1;
+    }
+  }
+}
+
+void NJClient::sendSubscriptions()
+{
+  WDL_MutexLock lock(&m_remotechannel_rd_mutex);
+  m_submask_dirty=0;
+
+  // one message for all the changes since the last call
+  mpb_client_set_usermask su;
+  mpb_client_set_usermask_id sui;
+  int cnt=0, cnt_id=0;
+  int x;
+  for (x = 0; x < m_remoteusers.GetSize(); x ++)
+  {
+    RemoteUser *user=m_remoteusers.Get(x);
+    if (user->submask == user->submask_sent) continue;
+    user->submask_sent=user->submask;
+    if (user->id >= 0)
+    {
+      sui.build_add_rec(user->id,user->submask);
+      cnt_id++;
+    }
+    else
+    {
+      su.build_add_rec(user->name.Get(),user->submask);
+      cnt++;
+    }
   }
+  if (cnt) m_netcon->Send(su.build());
+  if (cnt_id) m_netcon->Send(sui.build());
+}
 
+// moves commands that did not fit in the FIFO earlier into it, in order. returns true if none are left over
+static bool pushMixOverflow(MixCommandFifo *fifo, WDL_TypedBuf<NJMixCommand> *overflow)
+{
+  const int sz=overflow->GetSize();
+  int x=0;
+  while (x < sz && fifo->Push(overflow->Get()[x])) x++;
+  if (x)
+  {
+    memmove(overflow->Get(),overflow->Get()+x,(sz-x)*sizeof(NJMixCommand));
+    overflow->Resize(sz-x,false);
+  }
+  return x == sz;
 }
 
+void NJClient::sendMixCommand(int cmd, RemoteUser_Channel *chan, DecodeState *ds)
+{
+  if (cmd == MIXCMD_FLUSH) chan->ClearSessionQueued();
+
+  NJMixCommand c;
+  c.cmd=cmd;
+  c.chan=chan;
+  c.ds=ds;
+
+  m_mixgraph_cs.Enter();
+  m_mixcmd_seq++;
+  if (!pushMixOverflow(m_mixcmds,&m_mixcmd_overflow) || !m_mixcmds->Push(c))
+    m_mixcmd_overflow.Add(c);
+  m_mixgraph_cs.Leave();
+}
 
-void NJClient::writeLog(const char *fmt, ...)
+void NJClient::reclaimMixGraphs()
 {
-  if (m_logFile)
-  {
-    va_list ap;
-    va_start(ap,fmt);
+  drainIdleAudio();
 
-    m_log_cs.Enter();
-    if (m_logFile) vfprintf(m_logFile,fmt,ap);
-    m_log_cs.Leave();
+  // read these before draining messages, so that any message that refers to a
+  // user is handled before that user can be freed below
+  const int seen=m_mixgraph_seen;
+  const int locseen=m_locgraph_seen;
+  const unsigned int done=m_mixcmd_done;
+  NJ_BARRIER();
 
-    va_end(ap);
+  NJAudioMessage msg;
+  while (m_audiomsgs->Pop(&msg))
+  {
+    switch (msg.type)
+    {
+      case AUDIOMSG_DELETE_DS:
+        while (msg.ds)
+        {
+          DecodeState *ds=msg.ds;
+          msg.ds=ds->retire_next;
+          delete ds;
+        }
+      break;
+      case AUDIOMSG_LOG_INTERVAL:
+        writeLog("interval %d %.2f %d\n",msg.a,msg.f,msg.c);
+      break;
+      case AUDIOMSG_LOG_USER:
+        {
+          char guidstr[64];
+          guidtostr(msg.guid,guidstr);
+          char tmp[1024],tmp2[1024],*p;
+          lstrcpyn_safe(p=tmp,msg.user->name.Get(),sizeof(tmp));
+          while (*p) { if (*p == '\"') *p = '\''; p++; }
+
+          lstrcpyn_safe(p=tmp2,msg.user->channels[msg.a].name.Get(),sizeof(tmp2));
+          while (*p) { if (*p == '\"') *p = '\''; p++; }
+          writeLog("user %s \"%s\" %d \"%s\"\n",guidstr,tmp,msg.a,tmp2);
+        }
+      break;
+    }
+  }
 
+  const unsigned int lost=m_audiomsg_lost;
+  if (lost != m_audiomsg_lost_seen)
+  {
+    if (config_debug_level>0) printf("audio thread dropped %u log lines\n",lost-m_audiomsg_lost_seen);
+    m_audiomsg_lost_seen=lost;
   }
 
+  m_mixgraph_cs.Enter();
+  pushMixOverflow(m_mixcmds,&m_mixcmd_overflow);
+  while (m_mixgraph_retired.GetSize())
+  {
+    RemoteMixGraph *g=m_mixgraph_retired.Get(0);
+    // still in use, or a command issued while it was current (possibly for a
+    // channel of one of its retired users) has not run yet
+    if (seen - g->version <= 0 || (int)(done - g->free_after_cmd) < 0) break;
+    m_mixgraph_retired.Delete(0);
+    delete g;
+  }
+  m_mixgraph_cs.Leave();
 
+  m_locchan_cs.Enter();
+  while (m_locgraph_retired.GetSize() && locseen - m_locgraph_retired.Get(0)->version > 0)
+  {
+    delete m_locgraph_retired.Get(0);
+    m_locgraph_retired.Delete(0);
+  }
+  m_locchan_cs.Leave();
 }
 
-void NJClient::SetLogFile(char *name)
+// once AudioProc() has not been called for this long, Run() does its share of
+// the work (commands, freeing graphs and decoders) so nothing piles up
+#define NJ_AUDIO_IDLE_SECONDS 0.5
+
+void NJClient::drainIdleAudio()
 {
-  m_log_cs.Enter();
-  if (m_logFile) fclose(m_logFile);
-  m_logFile=0;
-  if (name && *name)
+  const unsigned int calls=m_audioproc_calls;
+  const double now=NJTrace_GetTime();
+  if (calls != m_audioproc_calls_seen)
   {
-    if (!strstr(name,"\\") && !strstr(name,"/") && !strstr(name,":"))
+    m_audioproc_calls_seen=calls;
+    m_audio_idle_since=now;
+    return;
+  }
+  if (now - m_audio_idle_since < NJ_AUDIO_IDLE_SECONDS) return;
+  if (m_mixcmd_done == m_mixcmd_seq && m_mixgraph_retired.GetSize() < 1 && m_locgraph_retired.GetSize() < 1) return;
+
+  // an AudioProc() call made meanwhile sees the claim and returns silence
+  if (wdl_atomic_incr(&m_audio_claim) == 1)
+  {
+    m_mixgraph_cs.Enter();
+    do
     {
-      WDL_String s(m_workdir.Get());
-      s.Append(name);
-      m_logFile=fopenUTF8(s.Get(),"a+t");
+      pushMixOverflow(m_mixcmds,&m_mixcmd_overflow);
+      runMixCommands();
     }
-    else
-      m_logFile=fopenUTF8(name,"a+t");
+    while (m_mixcmd_overflow.GetSize());
+    m_audio_graph=m_mixgraph;
+    m_mixgraph_seen=m_audio_graph->version;
+    m_mixgraph_cs.Leave();
+
+    m_locchan_cs.Enter();
+    m_audio_locgraph=m_locgraph;
+    m_locgraph_seen=m_audio_locgraph->version;
+    m_locchan_cs.Leave();
+
+    while (m_audio_retired_ds)
+    {
+      DecodeState *ds=m_audio_retired_ds;
+      m_audio_retired_ds=ds->retire_next;
+      delete ds;
+    }
+    NJ_BARRIER();
   }
-  m_log_cs.Leave();
+  wdl_atomic_decr(&m_audio_claim);
 }
 
-
-NJClient::~NJClient()
+void NJClient::runMixCommands()
 {
-  delete m_netcon;
-  m_netcon=0;
-
-  delete waveWrite;
-  SetOggOutFile(NULL,0,0);
-
-  if (m_logFile)
+  NJMixCommand c;
+  unsigned int n=0;
+  while (m_mixcmds->Pop(&c))
   {
-    writeLog("end\n");
-    fclose(m_logFile);
-    m_logFile=0;
+    RemoteUser_Channel *chan=c.chan;
+    if (c.cmd == MIXCMD_QUEUE_DS)
+    {
+      int useidx=!!chan->next_ds[0];
+      retireDecodeState(chan->next_ds[useidx]);
+      chan->next_ds[useidx]=c.ds;
+    }
+    else if (c.cmd == MIXCMD_FLUSH)
+    {
+      retireDecodeState(chan->ds);
+      retireDecodeState(chan->next_ds[0]);
+      retireDecodeState(chan->next_ds[1]);
+      chan->ds=0;
+      chan->next_ds[0]=0;
+      chan->next_ds[1]=0;
+      chan->dump_samples=0;
+    }
+    else if (c.cmd == MIXCMD_SESSION_DS)
+    {
+      // replaces the decoder for the same span, else an empty slot, else the earlier span
+      int useidx;
+      for (useidx = 0; useidx < 2 && !(chan->next_ds[useidx] && chan->next_ds[useidx]->session_start == c.ds->session_start); useidx ++);
+      if (useidx == 2) useidx=!chan->next_ds[0] ? 0 : !chan->next_ds[1] ? 1 :
+                              chan->next_ds[0]->session_start < chan->next_ds[1]->session_start ? 0 : 1;
+      retireDecodeState(chan->next_ds[useidx]);
+      chan->next_ds[useidx]=c.ds;
+    }
+    n++;
   }
+  if (n)
+  {
+    NJ_BARRIER(); // done with the channels before saying so
+    m_mixcmd_done+=n;
+  }
+}
 
-  int x;
-  for (x = 0; x < m_remoteusers.GetSize(); x ++) delete m_remoteusers.Get(x);
-  m_remoteusers.Empty();
-  for (x = 0; x < m_downloads.GetSize(); x ++) delete m_downloads.Get(x);
-  m_downloads.Empty();
-  for (x = 0; x < m_locchannels.GetSize(); x ++) delete m_locchannels.Get(x);
-  m_locchannels.Empty();
-
-  delete m_wavebq;
+// decoders dropped by the audio thread are linked onto m_audio_retired_ds,
+// which needs no allocation, and the whole chain is handed to Run() in one
+// message at the start of the next block. if there is no room then, the chain
+// keeps growing until there is: the audio thread never frees a decoder itself
+void NJClient::retireDecodeState(DecodeState *ds)
+{
+  if (!ds) return;
+  ds->retire_next=m_audio_retired_ds;
+  m_audio_retired_ds=ds;
 }
 
+void NJClient::postRetiredDecodeStates()
+{
+  if (!m_audio_retired_ds || m_audiomsgs->Free() <= NJ_AUDIOMSG_LOG_RESERVE) return;
+  NJAudioMessage msg;
+  msg.type=AUDIOMSG_DELETE_DS;
+  msg.ds=m_audio_retired_ds;
+  msg.user=0;
+  if (m_audiomsgs->Push(msg)) m_audio_retired_ds=0;
+}
 
-void NJClient::updateBPMinfo(int bpm, int bpi)
+void NJClient::postAudioMessage(int type, RemoteUser *user, int a, int b, int c, float f, const unsigned char *guid)
 {
-  m_misc_cs.Enter();
-  m_bpm=bpm;
-  m_bpi=bpi;
-  m_beatinfo_updated=1;
-  m_misc_cs.Leave();
+  NJAudioMessage msg;
+  msg.type=type;
+  msg.ds=0;
+  msg.user=user;
+  msg.a=a;
+  msg.b=b;
+  msg.c=c;
+  msg.f=f;
+  if (guid) memcpy(msg.guid,guid,sizeof(msg.guid));
+  if (!m_audiomsgs->Push(msg)) m_audiomsg_lost++; // Run() has not drained the FIFO for a long time
 }
 
 
@@ -750,13 +2541,46 @@ unsigned int NJClient::GetSessionPosition()// returns milliseconds
 void NJClient::AudioProc(float **inbuf, int innch, float **outbuf, int outnch, int len, int srate, bool justmonitor, bool isPlaying, bool isSeek, double cursessionpos)
 {
   m_srate=srate;
+  m_trace=AudioTrace;
+  if (m_trace) m_trace->Add(NJTRACE_AUDIOPROC,len,srate);
+
   // zero output
   int x;
   for (x = 0; x < outnch; x ++) memset(outbuf[x],0,sizeof(float)*len);
 
+  if (wdl_atomic_incr(&m_audio_claim) != 1) // Run() is doing our share after a pause, see drainIdleAudio()
+  {
+    wdl_atomic_decr(&m_audio_claim);
+    if (m_trace) m_trace->Add(NJTRACE_AUDIOPROC|NJTRACE_END);
+    m_trace=0;
+    return;
+  }
+
+  m_audio_graph=m_mixgraph;
+  m_audio_locgraph=m_locgraph;
+  NJ_BARRIER();
+  postRetiredDecodeStates(); // from the previous block
+  runMixCommands();
+
+  {
+    // for prepareSessionDecoders()
+    NJSessionPlayPos *pp=m_playpos;
+    if (isPlaying && (isSeek || !m_audio_wasplaying))
+    {
+      m_audio_playrestarts++;
+      m_netwake_audio=1;
+    }
+    m_audio_wasplaying=isPlaying;
+    pp->lock.WriteBegin();
+    pp->pos=isPlaying && cursessionpos > -1.0 ? cursessionpos : -1.0;
+    pp->restarts=m_audio_playrestarts;
+    pp->lock.WriteEnd();
+  }
+
   if (!m_audio_enable||justmonitor)
   {
     process_samples(inbuf,innch,outbuf,outnch,len,srate,0,1,isPlaying,isSeek,cursessionpos);
+    endAudioProc();
     return;
   }
 
@@ -787,28 +2611,31 @@ void NJClient::AudioProc(float **inbuf, int innch, float **outbuf, int outnch, i
     int x=m_interval_length-m_interval_pos;
     if (!x || m_interval_pos < 0)
     {
-      m_misc_cs.Enter();
-      if (m_beatinfo_updated)
+      const int upd=m_beatinfo_updated;
+      if (upd != m_beatinfo_seen)
       {
-        double v=(double)m_bpm*(1.0/60.0);
+        NJ_BARRIER();
+        const int bi=m_beatinfo;
+        const int bpm=bi>>16, bpi=bi&0xffff;
+
+        double v=(double)bpm*(1.0/60.0);
         // beats per second
 
         // (beats/interval) / (beats/sec)
-        v = (double) m_bpi / v;
+        v = (double) bpi / v;
 
         // seconds/interval
 
         // samples/interval
         v *= (double) srate;
 
-        m_beatinfo_updated=0;
+        m_beatinfo_seen=upd;
         m_interval_length = (int)v;
         //m_interval_length-=m_interval_length%1152;//hack
-        m_active_bpm=m_bpm;
-        m_active_bpi=m_bpi;
+        m_active_bpm=bpm;
+        m_active_bpi=bpi;
         m_metronome_interval=(int) ((double)m_interval_length / (double)m_active_bpi);
       }
-      m_misc_cs.Leave();
 
       // new buffer time
       on_new_interval();
@@ -832,6 +2659,24 @@ void NJClient::AudioProc(float **inbuf, int innch, float **outbuf, int outnch, i
     }
   }  
 
+  endAudioProc();
+}
+
+void NJClient::endAudioProc()
+{
+  publishMeterLevels();
+  NJ_BARRIER(); // done with the graphs and the commands before saying so
+  m_mixgraph_seen=m_audio_graph->version;
+  m_locgraph_seen=m_audio_locgraph->version;
+  m_audioproc_calls++;
+  wdl_atomic_decr(&m_audio_claim);
+  if (m_netwake_audio) // Run() has audio to write or send
+  {
+    m_netwake_audio=0;
+    WakeNetThread();
+  }
+  if (m_trace) m_trace->Add(NJTRACE_AUDIOPROC|NJTRACE_END);
+  m_trace=0;
 }
 
 
@@ -845,8 +2690,11 @@ void NJClient::Disconnect()
   m_netcon=0;
 
   int x;
-  for (x=0;x<m_remoteusers.GetSize(); x++) delete m_remoteusers.Get(x);
+  m_remotechannel_rd_mutex.Enter();
+  for (x=0;x<m_remoteusers.GetSize(); x++) retireRemoteUser(m_remoteusers.Get(x));
   m_remoteusers.Empty();
+  publishMixGraph();
+  m_remotechannel_rd_mutex.Leave();
   if (x) m_userinfochange=1; // if we removed users, notify parent
 
   for (x = 0; x < m_downloads.GetSize(); x ++) delete m_downloads.Get(x);
@@ -887,7 +2735,19 @@ void NJClient::Connect(char *host, char *user, char *pass)
 
   WDL_String tmp(m_host.Get());
   int port=NJ_PORT;
-  char *p=strstr(tmp.Get(),":");
+  char *hostname=tmp.Get();
+  char *p;
+  if (*hostname == '[') // [IPv6 address]:port
+  {
+    p=strstr(++hostname,"]");
+    if (p) *p++=0;
+    if (p && *p != ':') p=NULL;
+  }
+  else
+  {
+    p=strstr(hostname,":");
+    if (p && strstr(p+1,":")) p=NULL; // bare IPv6 address, no port
+  }
   if (p)
   {
     *p=0;
@@ -895,11 +2755,12 @@ void NJClient::Connect(char *host, char *user, char *pass)
     if (!port) port=NJ_PORT;
   }
   JNL_Connection *c=new JNL_Connection(JNL_CONNECTION_AUTODNS,65536,65536);
-  c->connect(tmp.Get(),port);
+  c->connect(hostname,port);
   m_netcon = new Net_Connection;
   m_netcon->attach(c);
 
   m_status=0;
+  WakeNetThread();
 }
 
 int NJClient::GetStatus()
@@ -915,6 +2776,8 @@ int NJClient::GetStatus()
 
 int NJClient::Run() // nonzero if sleep ok
 {
+  if (m_meter_layout_dirty) publishMeterLayout();
+
   WDL_HeapBuf *p=0;
   while (!m_wavebq->GetBlock(&p))
   {
@@ -981,6 +2844,7 @@ int NJClient::Run() // nonzero if sleep ok
               mpb_client_auth_user repl;
               repl.username=m_user.Get();
               repl.client_version=PROTO_VER_CUR; // client version number
+              if (cha.server_caps & SERVER_CAP_USERINFO_DELTA) repl.client_caps|=CLIENT_CAP_USERINFO_DELTA;
 
               m_connection_keepalive=(cha.server_caps>>8)&0xff;
 
@@ -1063,7 +2927,6 @@ int NJClient::Run() // nonzero if sleep ok
               while ((offs=ucn.parse_get_rec(offs,&a,&cid,&v,&p,&f,&un,&chn))>0)
               {
                 if (!un) un="";
-                if (!chn) chn="";
 
                 m_userinfochange=1;
 
@@ -1072,94 +2935,78 @@ int NJClient::Run() // nonzero if sleep ok
                 // todo: have volume/pan settings here go into defaults for the channel. or not, kinda think it's pointless
                 if (cid >= 0 && cid < MAX_USER_CHANNELS)
                 {
-                  m_users_cs.Enter();
-                  RemoteUser *theuser;
-                  for (x = 0; x < m_remoteusers.GetSize() && strcmp((theuser=m_remoteusers.Get(x))->name.Get(),un); x ++);
+                  for (x = 0; x < m_remoteusers.GetSize() && strcmp(m_remoteusers.Get(x)->name.Get(),un); x ++);
 
     //              char buf[512];
   //                sprintf(buf,"user %s, channel %d \"%s\": %s v:%d.%ddB p:%d flag=%d\n",un,cid,chn,a?"active":"inactive",(int)v/10,abs((int)v)%10,p,f);
 //                  OutputDebugString(buf);
 
-
-                  if (a)
+                  if (a && x == m_remoteusers.GetSize())
                   {
-                    if (x == m_remoteusers.GetSize())
-                    {
-                      theuser=new RemoteUser;
-                      theuser->name.Set(un);
-                      m_remoteusers.Add(theuser);
-                    }
-
-                    if ((theuser->channels[cid].flags^f)&(2|4)) // if flags changed instamode, flush out the samples
-                    {
-                      delete theuser->channels[cid].ds;
-                      delete theuser->channels[cid].next_ds[0];
-                      delete theuser->channels[cid].next_ds[1];
-                      theuser->channels[cid].ds=0;
-                      theuser->channels[cid].next_ds[0]=0;
-                      theuser->channels[cid].next_ds[1]=0;
-//                      OutputDebugString("channel flags changed, flushing sources\n");
-                    }
-                    theuser->channels[cid].flags = f;
-
-                    if (!(theuser->channels[cid].flags&4))
-                    {
-                      theuser->channels[cid].ClearSessionInfo();
-                    }
-
-                    theuser->channels[cid].name.Set(chn);
-                    theuser->chanpresentmask |= 1<<cid;
+                    RemoteUser *theuser=new RemoteUser;
+                    theuser->name.Set(un);
+                    m_remoteusers.Add(theuser);
+                  }
+                  if (x < m_remoteusers.GetSize()) updateRemoteChannel(x,a,cid,f,chn);
+                }
+              }
+              publishMixGraph();
+            }
+          }
+        break;
+        case MESSAGE_SERVER_USERINFO_DELTA:
+          {
+            mpb_server_userinfo_delta ud;
+            if (!ud.parse(msg))
+            {
+              WDL_MutexLock lock(&m_remotechannel_rd_mutex);
+              int offs=0;
+              int t=0, id=0, cid=0, p=0, f=0;
+              short v=0;
+              const char *name=0;
+              while ((offs=ud.parse_get_rec(offs,&t,&id,&cid,&v,&p,&f,&name))>0)
+              {
+                m_userinfochange=1;
 
+                int x;
+                for (x = 0; x < m_remoteusers.GetSize() && m_remoteusers.Get(x)->id != id; x ++);
 
-                    if (config_autosubscribe)
+                switch (t)
+                {
+                  case USERINFO_DELTA_ADD_USER:
+                    if (x == m_remoteusers.GetSize())
                     {
-                      theuser->submask |= 1<<cid;
-                      mpb_client_set_usermask su;
-                      su.build_add_rec(un,theuser->submask);
-                      m_netcon->Send(su.build());
+                      RemoteUser *theuser=new RemoteUser;
+                      theuser->name.Set(name);
+                      theuser->id=id;
+                      m_remoteusers.Add(theuser);
                     }
-                  }
-                  else
-                  {
+                  break;
+                  case USERINFO_DELTA_REMOVE_USER:
                     if (x < m_remoteusers.GetSize())
                     {
-                      theuser->channels[cid].ClearSessionInfo();
-
-                      theuser->channels[cid].name.Set("");
-                      theuser->chanpresentmask &= ~(1<<cid);
-                      theuser->submask &= ~(1<<cid);
-
-                      int chksolo=theuser->solomask == (1<<cid);
-                      theuser->solomask &= ~(1<<cid);
-
-                      delete theuser->channels[cid].ds;
-                      delete theuser->channels[cid].next_ds[0];
-                      delete theuser->channels[cid].next_ds[1];
-                      theuser->channels[cid].ds=0;
-                      theuser->channels[cid].next_ds[0]=0;
-                      theuser->channels[cid].next_ds[1]=0;
-//                      OutputDebugString("channel flags changed, flushing sources2\n");
-
-                      if (!theuser->chanpresentmask) // user no longer exists, it seems
+                      RemoteUser *theuser=m_remoteusers.Get(x);
+                      if (!theuser->chanpresentmask)
                       {
-                        chksolo=1;
-                        delete theuser;
                         m_remoteusers.Delete(x);
+                        retireRemoteUser(theuser);
                       }
-
-                      if (chksolo)
+                      else
                       {
-                        int i;
-                        for (i = 0; i < m_remoteusers.GetSize() && !m_remoteusers.Get(i)->solomask; i ++);
-
-                        if (i < m_remoteusers.GetSize()) m_issoloactive|=1;
-                        else m_issoloactive&=~1;
+                        // removing the last channel removes the user
+                        for (cid = 0; cid < MAX_USER_CHANNELS && m_remoteusers.Get(x) == theuser; cid ++)
+                          if (theuser->chanpresentmask & (1<<cid)) updateRemoteChannel(x,0,cid,0,NULL);
                       }
                     }
-                  }
-                  m_users_cs.Leave();
+                  break;
+                  case USERINFO_DELTA_SET_CHANNEL:
+                  case USERINFO_DELTA_REMOVE_CHANNEL:
+                    if (x < m_remoteusers.GetSize() && cid >= 0 && cid < MAX_USER_CHANNELS)
+                      updateRemoteChannel(x,t == USERINFO_DELTA_SET_CHANNEL,cid,f,name);
+                  break;
                 }
               }
+              publishMixGraph();
             }
           }
         break;
@@ -1178,12 +3025,7 @@ int NJClient::Run() // nonzero if sleep ok
                 {
                   if (!(theuser->channels[dib.chidx].flags&4) && !(theuser->channels[dib.chidx].flags&2))
                   {
-                    m_users_cs.Enter();
-                    int useidx=!!theuser->channels[dib.chidx].next_ds[0];
-                    DecodeState *tmp=theuser->channels[dib.chidx].next_ds[useidx];
-                    theuser->channels[dib.chidx].next_ds[useidx]=0;
-                    m_users_cs.Leave();
-                    delete tmp;
+                    sendMixCommand(MIXCMD_QUEUE_DS,&theuser->channels[dib.chidx],NULL);
 //                    OutputDebugString("added silence to channel\n");
                   }
                   //else OutputDebugString("woulda added silence to channel\n");
@@ -1204,13 +3046,7 @@ int NJClient::Run() // nonzero if sleep ok
                 else if (!(theuser->channels[dib.chidx].flags&4))
                 {
 //                  OutputDebugString("added free-guid to channel\n");
-                  DecodeState *tmp=start_decode(dib.guid);
-                  m_users_cs.Enter();
-                  int useidx=!!theuser->channels[dib.chidx].next_ds[0];
-                  DecodeState *t2=theuser->channels[dib.chidx].next_ds[useidx];
-                  theuser->channels[dib.chidx].next_ds[useidx]=tmp;
-                  m_users_cs.Leave();
-                  delete t2;
+                  sendMixCommand(MIXCMD_QUEUE_DS,&theuser->channels[dib.chidx],start_decode(dib.guid));
                 }
 
               }
@@ -1295,6 +3131,7 @@ int NJClient::Run() // nonzero if sleep ok
                         theuser->channels[chanidx].AddSessionInfo(guid,st,len);
                         theuser->last_session_pos=st+len;
                         theuser->last_session_pos_updtime=time(NULL);
+                        m_meter_layout_dirty=1;
 
                         char guidstr[64];
                         guidtostr(guid,guidstr);
@@ -1304,6 +3141,14 @@ int NJClient::Run() // nonzero if sleep ok
                   }
                 }               
               }
+              else if (m_queue_ui_events)
+              {
+                msg->addRef(); // released by DispatchUIEvents()
+                m_uievent_cs.Enter();
+                m_uievent_chat.Add(msg);
+                m_uievents|=NJC_UIEVENT_CHAT;
+                m_uievent_cs.Leave();
+              }
               else ChatMessage_Callback(ChatMessage_User,this,foo.parms,sizeof(foo.parms)/sizeof(foo.parms[0]));
             }
           }
@@ -1317,6 +3162,13 @@ int NJClient::Run() // nonzero if sleep ok
     }
   }
 
+  if (m_submask_dirty && m_netcon) sendSubscriptions();
+
+  prepareSessionDecoders();
+
+  // before encoding, so "interval" log lines precede the "local" lines of that interval
+  reclaimMixGraphs();
+
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
   int u;
   for (u = 0; u < m_locchannels.GetSize(); u ++)
@@ -1628,46 +3480,365 @@ DecodeState *NJClient::start_decode(unsigned char *guid, unsigned int fourcc, De
         newstate->decode_codec->DecodeWrote(l);
         if (!l) break;
       }
-      else break;
+      else break;
+    }
+  }
+
+  return newstate;
+}
+
+float NJClient::GetOutputPeak(int ch)
+{
+  if (ch==0) return (float)output_peaklevel[0];
+  else if(ch==1) return (float)output_peaklevel[1];
+  return (float)(output_peaklevel[0]+output_peaklevel[1])*0.5f;
+}
+
+void NJClient::ChatMessage_Send(const char *parm1, const char *parm2, const char *parm3, const char *parm4, const char *parm5)
+{
+  if (m_netcon)
+  {
+    mpb_chat_message m;
+    m.parms[0]=parm1;
+    m.parms[1]=parm2;
+    m.parms[2]=parm3;
+    m.parms[3]=parm4;
+    m.parms[4]=parm5;
+    m_netcon->Send(m.build());
+    WakeNetThread();
+  }
+}
+
+
+int NJClient::StartNetThread(WDL_Mutex *runlock, bool queue_ui_events)
+{
+  if (m_netthread_running) return -1;
+  if (!m_netthread) m_netthread=new NJNetThread;
+
+  NJNetThread *t=m_netthread;
+  if (!t->Init()) return -1;
+  t->m_client=this;
+  t->m_runlock=runlock;
+  t->m_quit=0;
+  m_queue_ui_events=queue_ui_events;
+
+#ifdef _WIN32
+  DWORD tid;
+  t->m_thread=CreateThread(NULL,0,NJNetThread::ThreadProc,t,0,&tid);
+  if (!t->m_thread) return -1;
+#else
+  if (pthread_create(&t->m_thread,NULL,NJNetThread::ThreadProc,t)) return -1;
+#endif
+  NJ_BARRIER();
+  m_netthread_running=1;
+  return 0;
+}
+
+void NJClient::StopNetThread()
+{
+  if (!m_netthread_running) return;
+  NJNetThread *t=m_netthread;
+  t->m_quit=1;
+  t->Wake();
+#ifdef _WIN32
+  WaitForSingleObject(t->m_thread,INFINITE);
+  CloseHandle(t->m_thread);
+  t->m_thread=NULL;
+#else
+  pthread_join(t->m_thread,NULL);
+#endif
+  m_netthread_running=0;
+  m_queue_ui_events=false; // anything queued stays for DispatchUIEvents()
+}
+
+void NJClient::WakeNetThread()
+{
+  if (m_netthread_running) m_netthread->Wake();
+}
+
+SOCKET NJClient::getNetWaitSocket(bool *wantwrite)
+{
+  *wantwrite=false;
+  JNL_IConnection *con=m_netcon ? m_netcon->GetConnection() : NULL;
+  if (!con || m_netcon->GetStatus()) return INVALID_SOCKET;
+
+  const int st=con->get_state();
+  if (st == JNL_Connection::STATE_CONNECTING) *wantwrite=true; // writable once connected
+  else if (st == JNL_Connection::STATE_CONNECTED) *wantwrite=m_netcon->HasPendingSend();
+  else return INVALID_SOCKET;
+
+  return con->get_socket();
+}
+
+void NJClient::netThreadProc()
+{
+  NJNetThread *t=m_netthread;
+  int laststatus=NJC_STATUS_PRECONNECT;
+  while (!t->m_quit)
+  {
+    t->BeginRun();
+
+    if (t->m_runlock) t->m_runlock->Enter();
+    while (!Run() && !t->m_quit);
+
+    bool wantwrite;
+    const SOCKET s=getNetWaitSocket(&wantwrite);
+    const int timeout=(s == INVALID_SOCKET && m_netcon && !m_netcon->GetStatus()) ? NJ_NETTHREAD_CONNECT_MS : NJ_NETTHREAD_IDLE_MS;
+    const int status=GetStatus();
+    bool post=false;
+    if (m_queue_ui_events)
+    {
+      m_uievent_cs.Enter();
+      if (status != laststatus) m_uievents|=NJC_UIEVENT_STATUS;
+      if ((m_uievents || m_userinfochange) && !m_uievents_posted) post=m_uievents_posted=true;
+      m_uievent_cs.Leave();
+    }
+    laststatus=status;
+    if (t->m_runlock) t->m_runlock->Leave();
+
+    if (post && UIEventsPosted_Callback) UIEventsPosted_Callback(UIEventsPosted_User,this);
+
+    if (!t->m_quit) t->Wait(s,wantwrite,timeout);
+  }
+}
+
+int NJClient::DispatchUIEvents()
+{
+  m_uievent_cs.Enter();
+  int ev=m_uievents;
+  m_uievents=0;
+  m_uievents_posted=false; // before HasUserInfoChanged(), so a later change posts again
+  m_uievent_cs.Leave();
+
+  for (;;)
+  {
+    m_uievent_cs.Enter();
+    Net_Message *msg=m_uievent_chat.Get(0);
+    m_uievent_chat.Delete(0);
+    m_uievent_cs.Leave();
+    if (!msg) break;
+
+    mpb_chat_message foo;
+    if (ChatMessage_Callback && !foo.parse(msg))
+      ChatMessage_Callback(ChatMessage_User,this,foo.parms,sizeof(foo.parms)/sizeof(foo.parms[0]));
+    msg->releaseRef();
+  }
+
+  if (HasUserInfoChanged()) ev|=NJC_UIEVENT_USERINFO;
+  return ev;
+}
+
+void NJClient::makeMetronomeClick(int srate)
+{
+  // the metronome is 10ms of sine per beat: the first beat of the interval
+  // at 6000/2pi Hz, the others an octave higher and quieter
+  const int metrolen=srate / 100;
+  const double sc=6000.0/(double)srate;
+  double *p=m_metronome_click.Resize(metrolen*2,false);
+  if (m_metronome_click.GetSize() != metrolen*2) return;
+  int x;
+  for (x = 0; x < metrolen; x ++)
+  {
+    p[x] = sin((double)x*sc);
+    p[metrolen+x] = sin((double)x*sc*2.0) * 0.25;
+  }
+  m_metronome_click_srate=srate;
+}
+
+// The output mixing kernels below give bit-identical results to the plain
+// per-sample loops they replaced (the SSE2 paths use the same float and double
+// operations, only several at a time).
+
+// scales p by vol, tracking the peak, and adds click (if any) scaled by clickvol
+static void outputStage(float *p, int n, float vol, float *peak, const double *click, double clickvol)
+{
+  float maxf=*peak;
+  int x=0;
+#ifdef NJCLIENT_MIX_SSE2
+  if (n >= 4)
+  {
+    const __m128 absmask=_mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 v=_mm_set1_ps(vol);
+    const __m128d cv=_mm_set1_pd(clickvol);
+    __m128 pk=_mm_set1_ps(maxf);
+    for (; x+4 <= n; x += 4)
+    {
+      __m128 f=_mm_mul_ps(_mm_loadu_ps(p+x),v);
+      pk=_mm_max_ps(_mm_and_ps(f,absmask),pk);
+      if (click)
+      {
+        const __m128 c0=_mm_cvtpd_ps(_mm_mul_pd(_mm_loadu_pd(click+x),cv));
+        const __m128 c1=_mm_cvtpd_ps(_mm_mul_pd(_mm_loadu_pd(click+x+2),cv));
+        f=_mm_add_ps(f,_mm_movelh_ps(c0,c1));
+      }
+      _mm_storeu_ps(p+x,f);
+    }
+    pk=_mm_max_ps(pk,_mm_movehl_ps(pk,pk));
+    pk=_mm_max_ss(pk,_mm_shuffle_ps(pk,pk,1));
+    maxf=_mm_cvtss_f32(pk);
+  }
+#endif
+  for (; x < n; x ++)
+  {
+    float f = p[x] * vol;
+    const float af = f < 0.0f ? -f : f;
+    if (af > maxf) maxf=af;
+    if (click) f += (float)(click[x]*clickvol);
+    p[x] = f;
+  }
+  *peak=maxf;
+}
+
+// mixInChannel()'s VU meter/clipping pass and mixFloatsNIOutput() in a single
+// pass, for decoded mono or stereo audio at the output samplerate
+template<int SRC_NCH, int DEST_NCH> static void mixClippedFloatsNIOutputLoop(const float *src, float *dest1, float *dest2, int len,
+                                                                           double vol1, double vol2, float *peak1, float *peak2)
+{
+  float maxf=*peak1, maxf2=*peak2;
+  int x=0;
+#ifdef NJCLIENT_MIX_SSE2
+  if (SRC_NCH == 2 && DEST_NCH == 2 && dest1 != dest2 && len >= 2)
+  {
+    // two frames at a time, lanes are l0 r0 l1 r1
+    const __m128 absmask=_mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 one=_mm_set1_ps(1.0f), mone=_mm_set1_ps(-1.0f);
+    const __m128d oned=_mm_set1_pd(1.0), moned=_mm_set1_pd(-1.0);
+    const __m128d vols=_mm_set_pd(vol2,vol1);
+    __m128 pk=_mm_set_ps(maxf2,maxf,maxf2,maxf);
+    for (; x+2 <= len; x += 2)
+    {
+      __m128 s=_mm_loadu_ps(src);
+      src+=4;
+      s=_mm_min_ps(one,_mm_max_ps(mone,s));
+      pk=_mm_max_ps(_mm_and_ps(s,absmask),pk);
+
+      __m128d d0=_mm_mul_pd(_mm_cvtps_pd(s),vols);
+      __m128d d1=_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(s,s)),vols);
+      d0=_mm_max_pd(moned,_mm_min_pd(oned,d0));
+      d1=_mm_max_pd(moned,_mm_min_pd(oned,d1));
+
+      __m128 f=_mm_movelh_ps(_mm_cvtpd_ps(d0),_mm_cvtpd_ps(d1));
+      f=_mm_shuffle_ps(f,f,_MM_SHUFFLE(3,1,2,0)); // l0 l1 r0 r1
+
+      __m128 o=_mm_loadl_pi(_mm_setzero_ps(),(const __m64 *)(dest1+x));
+      o=_mm_loadh_pi(o,(const __m64 *)(dest2+x));
+      o=_mm_add_ps(o,f);
+      _mm_storel_pi((__m64 *)(dest1+x),o);
+      _mm_storeh_pi((__m64 *)(dest2+x),o);
+    }
+    pk=_mm_max_ps(pk,_mm_movehl_ps(pk,pk));
+    maxf=_mm_cvtss_f32(pk);
+    maxf2=_mm_cvtss_f32(_mm_shuffle_ps(pk,pk,1));
+  }
+  else if (SRC_NCH == 1 && dest1 != dest2 && len >= 4)
+  {
+    const __m128 absmask=_mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 one=_mm_set1_ps(1.0f), mone=_mm_set1_ps(-1.0f);
+    const __m128d oned=_mm_set1_pd(1.0), moned=_mm_set1_pd(-1.0);
+    const __m128d v1=_mm_set1_pd(vol1), v2=_mm_set1_pd(vol2);
+    __m128 pk=_mm_set1_ps(maxf);
+    for (; x+4 <= len; x += 4)
+    {
+      __m128 s=_mm_loadu_ps(src);
+      src+=4;
+      s=_mm_min_ps(one,_mm_max_ps(mone,s));
+      pk=_mm_max_ps(_mm_and_ps(s,absmask),pk);
+
+      const __m128d s0=_mm_cvtps_pd(s), s1=_mm_cvtps_pd(_mm_movehl_ps(s,s));
+      __m128d d0=_mm_max_pd(moned,_mm_min_pd(oned,_mm_mul_pd(s0,v1)));
+      __m128d d1=_mm_max_pd(moned,_mm_min_pd(oned,_mm_mul_pd(s1,v1)));
+      _mm_storeu_ps(dest1+x,_mm_add_ps(_mm_loadu_ps(dest1+x),_mm_movelh_ps(_mm_cvtpd_ps(d0),_mm_cvtpd_ps(d1))));
+      if (DEST_NCH > 1)
+      {
+        d0=_mm_max_pd(moned,_mm_min_pd(oned,_mm_mul_pd(s0,v2)));
+        d1=_mm_max_pd(moned,_mm_min_pd(oned,_mm_mul_pd(s1,v2)));
+        _mm_storeu_ps(dest2+x,_mm_add_ps(_mm_loadu_ps(dest2+x),_mm_movelh_ps(_mm_cvtpd_ps(d0),_mm_cvtpd_ps(d1))));
+      }
     }
+    pk=_mm_max_ps(pk,_mm_movehl_ps(pk,pk));
+    pk=_mm_max_ss(pk,_mm_shuffle_ps(pk,pk,1));
+    maxf=_mm_cvtss_f32(pk);
   }
+#endif
+  for (; x < len; x ++)
+  {
+    float l=src[0];
+    l = l < -1.0f ? -1.0f : l > 1.0f ? 1.0f : l;
+    const float al = l < 0.0f ? -l : l;
+    if (al > maxf) maxf=al;
 
-  return newstate;
-}
+    float r=l;
+    if (SRC_NCH == 2)
+    {
+      r=src[1];
+      r = r < -1.0f ? -1.0f : r > 1.0f ? 1.0f : r;
+      const float ar = r < 0.0f ? -r : r;
+      if (ar > maxf2) maxf2=ar;
+    }
+    src+=SRC_NCH;
 
-float NJClient::GetOutputPeak(int ch)
-{
-  if (ch==0) return (float)output_peaklevel[0];
-  else if(ch==1) return (float)output_peaklevel[1];
-  return (float)(output_peaklevel[0]+output_peaklevel[1])*0.5f;
+    double ls=l*vol1;
+    ls = ls > 1.0 ? 1.0 : ls < -1.0 ? -1.0 : ls;
+    dest1[x] += (float) ls;
+
+    if (DEST_NCH > 1)
+    {
+      double rs=r*vol2;
+      rs = rs > 1.0 ? 1.0 : rs < -1.0 ? -1.0 : rs;
+      dest2[x] += (float) rs;
+    }
+  }
+  *peak1=maxf;
+  *peak2=SRC_NCH == 2 ? maxf2 : maxf;
 }
 
-void NJClient::ChatMessage_Send(const char *parm1, const char *parm2, const char *parm3, const char *parm4, const char *parm5)
+static void mixClippedFloatsNIOutput(float *src, int src_nch, float **dest, int dest_nch, int len,
+                                     float vol, float pan, float *peak1, float *peak2)
 {
-  if (m_netcon)
+  if (pan < -1.0f) pan=-1.0f;
+  else if (pan > 1.0f) pan=1.0f;
+  if (vol > 4.0f) vol=4.0f;
+  if (vol < 0.0f) vol=0.0f;
+
+  double vol1=vol,vol2=vol;
+  if (dest_nch > 1)
   {
-    mpb_chat_message m;
-    m.parms[0]=parm1;
-    m.parms[1]=parm2;
-    m.parms[2]=parm3;
-    m.parms[3]=parm4;
-    m.parms[4]=parm5;
-    m_netcon->Send(m.build());
+    if (pan < 0.0f)  vol2 *= 1.0f+pan;
+    else if (pan > 0.0f) vol1 *= 1.0f-pan;
+  }
+
+  if (src_nch == 2)
+  {
+    if (dest_nch > 1) mixClippedFloatsNIOutputLoop<2,2>(src,dest[0],dest[1],len,vol1,vol2,peak1,peak2);
+    else mixClippedFloatsNIOutputLoop<2,1>(src,dest[0],NULL,len,vol1,vol2,peak1,peak2);
+  }
+  else
+  {
+    if (dest_nch > 1) mixClippedFloatsNIOutputLoop<1,2>(src,dest[0],dest[1],len,vol1,vol2,peak1,peak2);
+    else mixClippedFloatsNIOutputLoop<1,1>(src,dest[0],NULL,len,vol1,vol2,peak1,peak2);
   }
 }
 
 void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int outnch, int len, int srate, int offset, int justmonitor, bool isPlaying, bool isSeek, double cursessionpos)
 {
+  if (m_trace) m_trace->Add(NJTRACE_PROCESS_SAMPLES,len,justmonitor);
+
                    // -36dB/sec
   double decay=pow(.25*0.25*0.25,len/(double)srate);
+
+  NJRecorder *rec=!justmonitor && m_recorder_running ? m_recorder : NULL;
+  if (rec) rec->BeginSegment(srate,len);
+
   // encode my audio and send to server, if enabled
   int u;
-  m_locchan_cs.Enter();
-  for (u = 0; u < m_locchannels.GetSize() && u < m_max_localch; u ++)
+  const LocalMixGraph *lg=m_audio_locgraph;
+  const int nloc=lg->entries.GetSize();
+  for (u = 0; u < nloc && u < m_max_localch; u ++)
   {
-    Local_Channel *lc=m_locchannels.Get(u);
-    int sc=lc->src_channel&1023;
-    int sc_nch=(lc->src_channel&1024)?2:1;
+    const LocalMixGraph::Entry *le=lg->entries.Get()+u;
+    Local_Channel *lc=le->lc;
+    int sc=le->src_channel&1023;
+    int sc_nch=(le->src_channel&1024)?2:1;
 
     float *src=NULL,*src2=NULL;
     if (sc >= 0 && sc < innch) src=inbuf[sc]+offset;
@@ -1677,7 +3848,7 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
       if (!src2) src2=src;
     }
 
-    if (lc->cbf || !src || ChannelMixer)
+    if (le->cbf || !src || ChannelMixer)
     {
       // todo: support stereo on chanmixer, silent, and effect processing stuff
       int bytelen=len*(int)sizeof(float);
@@ -1693,9 +3864,9 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
       src2=src=(float* )tmpblock.Get();
 
       // processor
-      if (lc->cbf)
+      if (le->cbf)
       {
-        lc->cbf(src,len,lc->cbf_inst);
+        le->cbf(src,len,le->cbf_inst);
       }
     }
 
@@ -1703,23 +3874,25 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
 #ifndef NJCLIENT_NO_XMIT_SUPPORT
     if (!justmonitor)
     {
-      if (lc->flags&4)
+      if (le->flags&4)
       {
         if (isSeek|| // if seeked, too long, playing and not broadcasting, or not playing and broadcasting
             lc->m_curwritefile_curbuflen>=SESSION_CHUNK_SIZE*(double)srate || 
-            (isPlaying && !lc->bcast_active && lc->broadcasting) ||
+            (isPlaying && !lc->bcast_active && le->broadcasting) ||
             (!isPlaying && lc->bcast_active)
           )
         {
           if (lc->bcast_active)
           {
-            lc->m_bq.AddBlock(0,0.0,NULL,0);
+            lc->m_bq.AddBlock(0,0.0,NULL,0,NULL,AudioLockStats,m_trace);
+            m_netwake_audio=1;
           }
 
-          if (lc->broadcasting&&isPlaying)
+          if (le->broadcasting&&isPlaying)
           {
             lc->bcast_active=true;
-            lc->m_bq.AddBlock(0,cursessionpos,NULL,-1); 
+            lc->m_bq.AddBlock(0,cursessionpos,NULL,-1,NULL,AudioLockStats,m_trace); 
+            m_netwake_audio=1;
           }
           else
             lc->bcast_active=false;
@@ -1732,7 +3905,8 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
 
       if (lc->bcast_active) 
       {
-        lc->m_bq.AddBlock(sc_nch,0.0,src,len,src2);
+        lc->m_bq.AddBlock(sc_nch,0.0,src,len,src2,AudioLockStats,m_trace);
+        m_netwake_audio=1;
         lc->m_curwritefile_curbuflen += len;
       }
     }
@@ -1740,27 +3914,31 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
 
     if (!src2) src2=src;
 
+    if (rec && (rec->m_sources&NJC_REC_LOCAL) && le->channel_idx >= 0 && le->channel_idx < MAX_LOCAL_CHANNELS)
+      rec->AddStem(1+le->channel_idx,sc_nch,src,src2);
+
     // monitor this channel
-    if ((!m_issoloactive && !lc->muted) || lc->solo)
+    if ((!m_issoloactive && !le->muted) || le->solo)
     {
       int use_nch=2;
-      if (outnch < 2 || (lc->out_chan_index&1024)) use_nch=1;
-      int idx=(lc->out_chan_index&1023);
+      if (outnch < 2 || (le->out_chan_index&1024)) use_nch=1;
+      int idx=(le->out_chan_index&1023);
       if (idx+use_nch>outnch) idx=outnch-use_nch;
       if (idx< 0)idx=0;
 
       float *out1=outbuf[idx]+offset;
 
-      float vol1=lc->volume;
+      float vol1=le->volume;
       if (use_nch > 1)
       {
         float vol2=vol1;
         float *out2=outbuf[idx+1]+offset;
-        if (lc->pan > 0.0f) vol1 *= 1.0f-lc->pan;
-        else if (lc->pan < 0.0f) vol2 *= 1.0f+lc->pan;
+        if (le->pan > 0.0f) vol1 *= 1.0f-le->pan;
+        else if (le->pan < 0.0f) vol2 *= 1.0f+le->pan;
 
         float maxf=(float) (lc->decode_peak_vol[0]*decay);
         float maxf2=(float) (lc->decode_peak_vol[1]*decay);
+        double ms1=0.0, ms2=0.0;
 
         int x=len;
         while (x--) 
@@ -1769,6 +3947,7 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
 
           if (f > maxf) maxf=f;
           else if (f < -maxf) maxf=-f;
+          ms1 += f*(double)f;
 
 //          if (f > 1.0) f=1.0;
   //        else if (f < -1.0) f=-1.0;
@@ -1779,6 +3958,7 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
 
           if (f > maxf2) maxf2=f;
           else if (f < -maxf2) maxf2=-f;
+          ms2 += f*(double)f;
 
 //          if (f > 1.0) f=1.0;
   //        else if (f < -1.0) f=-1.0;
@@ -1789,16 +3969,23 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
         }
         lc->decode_peak_vol[0]=maxf;
         lc->decode_peak_vol[1]=maxf2;
+        if (len > 0)
+        {
+          lc->decode_rms[0]=lc->decode_rms[0]*decay + (1.0-decay)*ms1/len;
+          lc->decode_rms[1]=lc->decode_rms[1]*decay + (1.0-decay)*ms2/len;
+        }
       }
       else
       {
         float maxf=(float) (lc->decode_peak_vol[0]*decay);
+        double ms1=0.0;
         int x=len;
         while (x--) 
         {
           float f=(*src++ + *src2++)*0.5f * vol1;
           if (f > maxf) maxf=f;
           else if (f < -maxf) maxf=-f;
+          ms1 += f*(double)f;
 
           if (f > 1.0) f=1.0;
           else if (f < -1.0) f=-1.0;
@@ -1806,45 +3993,71 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
           *out1++ += f;
         }
         lc->decode_peak_vol[1]=lc->decode_peak_vol[0]=maxf;
+        if (len > 0) lc->decode_rms[1]=lc->decode_rms[0]=lc->decode_rms[0]*decay + (1.0-decay)*ms1/len;
       }
     }
-    else lc->decode_peak_vol[0]=lc->decode_peak_vol[1]=0.0;
+    else
+    {
+      lc->decode_peak_vol[0]=lc->decode_peak_vol[1]=0.0;
+      lc->decode_rms[0]=lc->decode_rms[1]=0.0;
+    }
   }
 
-  m_locchan_cs.Leave();
+  {
+    // picked up by publishMeterLevels()
+    NJMeterLevels *ml=m_meter_levels;
+    ml->work_num_local=0;
+    for (u = 0; u < nloc && u < MAX_LOCAL_CHANNELS; u ++)
+    {
+      const LocalMixGraph::Entry *le=lg->entries.Get()+u;
+      ml->work_local_ch[u]=le->channel_idx;
+      meterLevelsFrom(ml->work_local+u,le->lc->decode_peak_vol,le->lc->decode_rms);
+      ml->work_num_local=u+1;
+    }
+  }
 
 
   if (!justmonitor)
   {
     // mix in all active (subscribed) channels
-    m_users_cs.Enter();
-    for (u = 0; u < m_remoteusers.GetSize(); u ++)
+    RemoteMixGraph *g=m_audio_graph;
+    const int nent=g->entries.GetSize();
+    for (u = 0; u < nent; u ++)
     {
-      RemoteUser *user=m_remoteusers.Get(u);
-      int ch;
-      if (!user) continue;
+      const RemoteMixGraph::Entry *e=g->entries.Get()+u;
 
-      int a=user->chanpresentmask;
-      for (ch = 0; ch < MAX_USER_CHANNELS&&a; ch ++)
+      bool muteflag;
+      if (m_issoloactive) muteflag = !(e->state & RemoteMixGraph::ENTRY_SOLO);
+      else muteflag = !!(e->state & RemoteMixGraph::ENTRY_MUTED);
+
+      if (m_trace) m_trace->Add(NJTRACE_MIXIN,e->user_idx,e->ch_idx);
+      if (rec && e->rec_stem >= 0 && len <= NJREC_SCRATCH_FRAMES)
       {
-        if (a&1)
+        // mixed on its own to record it, then into the output where mixInChannel() would have
+        const int use_nch=(outnch < 2 || (e->out_chan&1024)) ? 1 : 2;
+        float *sc[2]={rec->m_scratch.Get(),rec->m_scratch.Get()+len};
+        memset(sc[0],0,use_nch*len*sizeof(float));
+        mixInChannel(e->chan,e->chflags,muteflag,e->vol,e->pan,
+            sc,use_nch > 1 ? 0 : 1024,len,srate,use_nch,0,decay,isPlaying,isSeek,cursessionpos);
+        rec->AddStem(e->rec_stem,use_nch,sc[0],sc[1]);
+
+        int idx=(e->out_chan&1023);
+        if (idx+use_nch>outnch) idx=outnch-use_nch;
+        if (idx< 0)idx=0;
+        int c;
+        for (c = 0; c < use_nch; c ++)
         {
-          float lpan=user->pan+user->channels[ch].pan;
-          if (lpan<-1.0)lpan=-1.0;
-          else if (lpan>1.0)lpan=1.0;
-
-          bool muteflag;
-          if (m_issoloactive) muteflag = !(user->solomask & (1<<ch));
-          else muteflag=(user->mutedmask & (1<<ch)) || user->muted;
-
-          mixInChannel(&user->channels[ch],muteflag,
-            user->volume*user->channels[ch].volume,lpan,
-              outbuf,user->channels[ch].out_chan_index,len,srate,outnch,offset,decay,isPlaying,isSeek,cursessionpos);
+          float *o=outbuf[idx+c]+offset;
+          const float *in=sc[c];
+          int x=len;
+          while (x--) *o++ += *in++;
         }
-        a>>=1;
       }
+      else
+        mixInChannel(e->chan,e->chflags,muteflag,e->vol,e->pan,
+            outbuf,e->out_chan,len,srate,outnch,offset,decay,isPlaying,isSeek,cursessionpos);
+      if (m_trace) m_trace->Add(NJTRACE_MIXIN|NJTRACE_END,e->user_idx,e->ch_idx);
     }
-    m_users_cs.Leave();
 
 
     // write out wave if necessary
@@ -1855,113 +4068,106 @@ void NJClient::process_samples(float **inbuf, int innch, float **outbuf, int out
 #endif
       )
     {
-      m_wavebq->AddBlock(2,0.0,outbuf[0]+offset,len,outbuf[outnch>1]+offset);
+      m_wavebq->AddBlock(2,0.0,outbuf[0]+offset,len,outbuf[outnch>1]+offset,AudioLockStats,m_trace);
+      m_netwake_audio=1;
+    }
+
+    if (rec)
+    {
+      if (rec->m_sources&NJC_REC_MASTER) rec->AddStem(0,outnch>1?2:1,outbuf[0]+offset,outbuf[outnch>1]+offset);
+      rec->EndSegment();
     }
   }
 
-  // apply master volume, then
+  // apply master volume and mix in the metronome, one pass over each output.
+  // the block is split where clicks start and stop
   {
-    int x=len;
     float *ptr1=outbuf[0]+offset;
+    float *ptr2=outnch >= 2 ? outbuf[1]+offset : NULL;
     float maxf1=(float)(output_peaklevel[0]*decay);
     float maxf2=(float)(output_peaklevel[1]*decay);
 
-    if (outnch >= 2)
+    float vol1=config_mastermute?0.0f:config_mastervolume, vol2=vol1;
+    if (ptr2)
     {
-      float *ptr2=outbuf[1]+offset;
-      float vol1=config_mastermute?0.0f:config_mastervolume;
-      float vol2=vol1;
       if (config_masterpan > 0.0f) vol1 *= 1.0f-config_masterpan;
       else if (config_masterpan< 0.0f) vol2 *= 1.0f+config_masterpan;
-
-      while (x--)
-      {
-        float f = *ptr1++ *= vol1;
-        if (f > maxf1) maxf1=f;
-        else if (f < -maxf1) maxf1=-f;
-
-        f = *ptr2++ *= vol2;
-        if (f > maxf2) maxf2=f;
-        else if (f < -maxf2) maxf2=-f;
-      }
-    }
-    else
-    {
-      float vol1=config_mastermute?0.0f:config_mastervolume;
-      while (x--)
-      {
-        float f = *ptr1++ *= vol1;
-        if (f > maxf1) maxf1=f;
-        else if (f < -maxf1) maxf1=-f;
-      }
-      maxf2=maxf1;
     }
-    output_peaklevel[0]=maxf1;
-    output_peaklevel[1]=maxf2;
-  }
 
-  // mix in (super shitty) metronome (fucko!!!!)
-  if (!justmonitor)
-  {
-    int metrolen=srate / 100;
-    double sc=6000.0/(double)srate;
-    int x;
-    int um=config_metronome>0.0001f;
-    double vol1=config_metronome_mute?0.0:config_metronome,vol2=vol1;
-    float *ptr1=outbuf[0]+offset;
-    float *ptr2=NULL;
-    if (outnch > 1)
+    const int metrolen=srate / 100;
+    const int um=config_metronome>0.0001f;
+    double mvol1=config_metronome_mute?0.0:config_metronome,mvol2=mvol1;
+    if (ptr2)
     {
-        ptr2=outbuf[1]+offset;
-        if (config_metronome_pan > 0.0f) vol1 *= 1.0f-config_metronome_pan;
-        else if (config_metronome_pan< 0.0f) vol2 *= 1.0f+config_metronome_pan;
+      if (config_metronome_pan > 0.0f) mvol1 *= 1.0f-config_metronome_pan;
+      else if (config_metronome_pan< 0.0f) mvol2 *= 1.0f+config_metronome_pan;
     }
-    for (x = 0; x < len; x ++)
-    {
-      if (m_metronome_pos <= 0.0)
-      {
-        m_metronome_state=1;
-        m_metronome_tmp=(m_interval_pos+x)<m_metronome_interval;
-        m_metronome_pos += (double)m_metronome_interval;
-      }
-      m_metronome_pos-=1.0;
+    if (!justmonitor && um && srate != m_metronome_click_srate) makeMetronomeClick(srate);
+    if (m_metronome_state >= metrolen) m_metronome_state=0;
 
-      if (m_metronome_state>0)
+    int x=0;
+    while (x < len)
+    {
+      int n=len-x;
+      const double *click=NULL;
+      if (!justmonitor)
       {
-        if (um)
+        if (m_metronome_pos <= 0.0)
         {
-          double val=0.0;
-          if (!m_metronome_tmp) val = sin((double)m_metronome_state*sc*2.0) * 0.25;
-          else val = sin((double)m_metronome_state*sc);
-
-          ptr1[x]+=(float)(val*vol1);
-          if (ptr2) ptr2[x]+=(float)(val*vol2);
+          m_metronome_state=1;
+          m_metronome_tmp=(m_interval_pos+x)<m_metronome_interval;
+          m_metronome_pos += (double)m_metronome_interval;
         }
-        if (++m_metronome_state >= metrolen) m_metronome_state=0;
+        const double tonext=ceil(m_metronome_pos); // samples until the next beat
+        if (tonext < n) n = tonext < 1.0 ? 1 : (int)tonext;
 
+        if (m_metronome_state>0)
+        {
+          if (n > metrolen-m_metronome_state) n=metrolen-m_metronome_state;
+          if (um && m_metronome_click_srate == srate) click=m_metronome_click.Get() + (m_metronome_tmp?0:metrolen) + m_metronome_state;
+          if ((m_metronome_state+=n) >= metrolen) m_metronome_state=0;
+        }
+        m_metronome_pos -= (double)n;
       }
-    }   
+
+      outputStage(ptr1+x,n,vol1,&maxf1,click,mvol1);
+      if (ptr2) outputStage(ptr2+x,n,vol2,&maxf2,click,mvol2);
+      x+=n;
+    }
+
+    if (!ptr2) maxf2=maxf1;
+    output_peaklevel[0]=maxf1;
+    output_peaklevel[1]=maxf2;
+
+    double ms1[2]={0.0,0.0}, ms2[2]={0.0,0.0};
+    addMeanSquare(ptr1,len,1,1.0-decay,ms1);
+    if (ptr2) addMeanSquare(ptr2,len,1,1.0-decay,ms2);
+    output_rmslevel[0]=output_rmslevel[0]*decay + ms1[0];
+    output_rmslevel[1]=ptr2 ? output_rmslevel[1]*decay + ms2[0] : output_rmslevel[0];
   }
 
+  if (m_trace) m_trace->Add(NJTRACE_PROCESS_SAMPLES|NJTRACE_END);
 }
 
-void NJClient::mixInChannel(RemoteUser_Channel *userchan, bool muted, float vol, float pan, float **outbuf, int out_channel, 
+void NJClient::mixInChannel(RemoteUser_Channel *userchan, int chflags, bool muted, float vol, float pan, float **outbuf, int out_channel, 
                             int len, int srate, int outnch, int offs, double vudecay,
                             bool isPlaying, bool isSeek, double playPos)
 {
   if (!userchan) return;
   userchan->decode_peak_vol[0]*=vudecay;
   userchan->decode_peak_vol[1]*=vudecay;
+  userchan->decode_rms[0]*=vudecay;
+  userchan->decode_rms[1]*=vudecay;
 
-  int llmode=(userchan->flags&2);
-  int sessionmode = !llmode && (userchan->flags&4);
+  int llmode=(chflags&2);
+  int sessionmode = !llmode && (chflags&4);
 
   overlapFadeState fade_state;
   if (sessionmode)
   {
     if (!isPlaying)
     {
-      delete userchan->ds;
+      retireDecodeState(userchan->ds);
       userchan->ds=0;
       return;
     }
@@ -1971,21 +4177,26 @@ void NJClient::mixInChannel(RemoteUser_Channel *userchan, bool muted, float vol,
       if (userchan->ds)
       {
         userchan->ds->calcOverlap(&fade_state);
-        delete userchan->ds;
+        retireDecodeState(userchan->ds);
         userchan->ds=0;
       }
       
-      unsigned char guid[16];
       double offs=0.0;
 
     //  char buf[512];
   //    sprintf(buf,"querying %f\n",playPos);
 //      OutputDebugString(buf);
       double mediasr=m_srate;
-      if (userchan->GetSessionInfo(playPos,guid,&offs,&userchan->curds_lenleft,1.0/srate) && userchan->curds_lenleft > 16.0/srate)
+      DecodeState *sds=takeSessionDecoder(userchan,playPos,1.0/srate,&offs);
+      if (sds && userchan->curds_lenleft <= 16.0/srate)
       {
-        userchan->ds=start_decode(guid);
-        if (userchan->ds&&userchan->ds->decode_codec)
+        retireDecodeState(sds);
+        sds=0;
+      }
+      if (sds)
+      {
+        userchan->ds=sds;
+        if (userchan->ds->decode_codec)
         {
           userchan->ds->applyOverlap(&fade_state);
           mediasr=userchan->ds->decode_codec->GetSampleRate();
@@ -2004,7 +4215,7 @@ void NJClient::mixInChannel(RemoteUser_Channel *userchan, bool muted, float vol,
         }
         else
         {
-          delete userchan->ds;
+          retireDecodeState(userchan->ds);
           userchan->ds=0;
         }
       }
@@ -2036,7 +4247,7 @@ void NJClient::mixInChannel(RemoteUser_Channel *userchan, bool muted, float vol,
     {
 //      OutputDebugString("advanced to next_ds (666)\n");
       if (userchan->ds) userchan->ds->calcOverlap(&fade_state);
-      delete userchan->ds;
+      retireDecodeState(userchan->ds);
       chan = userchan->ds = userchan->next_ds[0];
       userchan->next_ds[0]=userchan->next_ds[1]; // advance queue
       userchan->next_ds[1]=0;
@@ -2060,11 +4271,16 @@ void NJClient::mixInChannel(RemoteUser_Channel *userchan, bool muted, float vol,
     userchan->dump_samples-=av;
   }
 
-  int needed=0;
+  int needed=0, decoded_bytes=-1;
   int srcnch=chan->decode_codec->GetNumChannels();
   while (chan->decode_codec->Available() <= (needed=resampleLengthNeeded(chan->decode_codec->GetSampleRate(),srate,len,&chan->resample_state))*srcnch)
   {
     int l=0;
+    if (decoded_bytes<0)
+    {
+      if (m_trace) m_trace->Add(NJTRACE_DECODE);
+      decoded_bytes=0;
+    }
     
     if (chan->decode_fp)
     {
@@ -2077,6 +4293,7 @@ void NJClient::mixInChannel(RemoteUser_Channel *userchan, bool muted, float vol,
     else break;
 
     chan->decode_codec->DecodeWrote(l);
+    decoded_bytes+=l;
 
     if (userchan->dump_samples>mdump)
     {
@@ -2092,6 +4309,7 @@ void NJClient::mixInChannel(RemoteUser_Channel *userchan, bool muted, float vol,
       break;
     }
   }
+  if (decoded_bytes>=0 && m_trace) m_trace->Add(NJTRACE_DECODE|NJTRACE_END,decoded_bytes);
 
 
   int codecavail=chan->decode_codec->Available();
@@ -2147,8 +4365,33 @@ void NJClient::mixInChannel(RemoteUser_Channel *userchan, bool muted, float vol,
   {
     float *sptr=chan->decode_codec->Get();
 
+    if (!muted && vol > 0.0000001) addMeanSquare(sptr,needed,srcnch,vol*vol*(1.0-vudecay),userchan->decode_rms);
+
     // process VU meter, yay for powerful CPUs
-    if (!muted && vol > 0.0000001) 
+    if (!muted && vol > 0.0000001 && srcnch <= 2 && chan->decode_codec->GetSampleRate() == srate && len_out == needed)
+    {
+      int use_nch=2;
+      if (outnch < 2 || (out_channel&1024)) use_nch=1;
+      int idx=(out_channel&1023);
+      if (idx+use_nch>outnch) idx=outnch-use_nch;
+      if (idx< 0)idx=0;
+
+      float lvol=vol;
+      float *tmpbuf[2]={outbuf[idx]+offs,use_nch > 1 ? (outbuf[idx+1]+offs) : 0};
+      if (use_nch==1 && srcnch>1)
+      {
+        tmpbuf[1]=tmpbuf[0];
+        lvol*=0.5f;
+        use_nch=2;
+      }
+
+      float maxf=(float) (userchan->decode_peak_vol[0]/vol);
+      float maxf2=(float) (userchan->decode_peak_vol[1]/vol);
+      mixClippedFloatsNIOutput(sptr,srcnch,tmpbuf,use_nch,len_out,lvol,pan,&maxf,&maxf2);
+      userchan->decode_peak_vol[0]=maxf*vol;
+      userchan->decode_peak_vol[1]=maxf2*vol;
+    }
+    else if (!muted && vol > 0.0000001) 
     {
       float *p=sptr;
       int l=(needed)*srcnch;
@@ -2251,13 +4494,13 @@ void NJClient::mixInChannel(RemoteUser_Channel *userchan, bool muted, float vol,
 //    OutputDebugString("advanced to next_ds (200)\n");
     userchan->curds_lenleft=-10000.0;
     if (userchan->ds) userchan->ds->calcOverlap(&fade_state);
-    delete userchan->ds;
+    retireDecodeState(userchan->ds);
     chan = userchan->ds = userchan->next_ds[0];
     userchan->next_ds[0]=userchan->next_ds[1]; // advance queue
     userchan->next_ds[1]=0;
     if (userchan->ds) userchan->ds->applyOverlap(&fade_state);
     if (sessionmode || (chan && chan->decode_codec && (chan->decode_fp||chan->decode_buf))) 
-      mixInChannel(userchan,muted,vol,pan,outbuf,out_channel,len-len_out,srate,outnch,offs+len_out,vudecay,
+      mixInChannel(userchan,chflags,muted,vol,pan,outbuf,out_channel,len-len_out,srate,outnch,offs+len_out,vudecay,
         isPlaying,false,playPos + len_out/(double)srate);
   }
   else if (llmode && len_out < len)
@@ -2272,82 +4515,160 @@ void NJClient::mixInChannel(RemoteUser_Channel *userchan, bool muted, float vol,
 
 }
 
+// session mode, audio thread: takes the decoder prepareSessionDecoders() queued
+// in chan->next_ds for time, if any, and sets chan->curds_lenleft to the
+// seconds it plays for (or to the seconds until the next queued span starts)
+DecodeState *NJClient::takeSessionDecoder(RemoteUser_Channel *chan, double time, double mv, double *offs)
+{
+  mv *= 2.0; // allow one sample poot, as GetSessionSpans()
+  double wait=-1.0;
+  int x;
+  for (x = 0; x < 2; x ++)
+  {
+    DecodeState *ds=chan->next_ds[x];
+    if (!ds) continue;
+    const double end=ds->session_start+ds->session_length;
+    if (time >= end-mv) // passed it
+    {
+      retireDecodeState(ds);
+      chan->next_ds[x]=0;
+    }
+    else if (time < ds->session_start-mv)
+    {
+      if (wait < 0.0 || ds->session_start-time < wait) wait=ds->session_start-time;
+    }
+    else
+    {
+      chan->next_ds[x]=0;
+      *offs=ds->session_offset + (time > ds->session_start ? time-ds->session_start : 0.0);
+      chan->curds_lenleft=end-time;
+      return ds;
+    }
+  }
+  // nothing queued yet: look again next block
+  chan->curds_lenleft=wait > 1.0 ? 1.0 : wait > 0.0 ? wait : 0.0;
+  return NULL;
+}
+
+// Run(): opens the decoders session mode channels will need at the position
+// AudioProc() last reported, and queues them with MIXCMD_SESSION_DS
+void NJClient::prepareSessionDecoders()
+{
+  const NJSessionPlayPos *pp=m_playpos;
+  double pos;
+  unsigned int restarts;
+  for (;;)
+  {
+    const unsigned int seq=pp->lock.ReadBegin();
+    pos=pp->pos;
+    restarts=pp->restarts;
+    if (!pp->lock.ReadRetry(seq)) break;
+  }
+  const bool restarted=restarts != m_playrestarts_seen;
+  m_playrestarts_seen=restarts;
+  if (pos < 0.0) return;
+
+  WDL_MutexLock lock(&m_remotechannel_rd_mutex);
+  const double mv=m_srate > 0 ? 1.0/m_srate : 0.0;
+  int u, ch, x;
+  for (u = 0; u < m_remoteusers.GetSize(); u ++)
+  {
+    RemoteUser *user=m_remoteusers.Get(u);
+    for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
+    {
+      RemoteUser_Channel *chan=user->channels+ch;
+      if (!((user->chanpresentmask & user->submask) & (1<<ch)) || (chan->flags&2) || !(chan->flags&4)) continue;
+      if (restarted) chan->ClearSessionQueued(); // the audio thread may have dropped them
+
+      ChannelSessionInfo spans[2];
+      const int nspans=chan->GetSessionSpans(pos,mv,spans,2);
+      for (x = 0; x < nspans; x ++)
+      {
+        if (chan->IsSessionQueued(spans+x)) continue;
+
+        DecodeState *ds=start_decode(spans[x].guid);
+        if (!ds->decode_codec) // not downloaded yet, try again later
+        {
+          delete ds;
+          continue;
+        }
+        ds->session_start=spans[x].start_time;
+        ds->session_length=spans[x].length;
+        ds->session_offset=spans[x].offset;
+        sendMixCommand(MIXCMD_SESSION_DS,chan,ds);
+
+        chan->session_queued[0]=chan->session_queued[1];
+        chan->session_queued[1]=spans[x];
+      }
+    }
+  }
+}
+
 void NJClient::on_new_interval()
 {
   m_loopcnt++;
-  writeLog("interval %d %.2f %d\n",m_loopcnt,GetActualBPM(),m_active_bpi);
+  if (m_trace) m_trace->Add(NJTRACE_INTERVAL,m_loopcnt);
+
+  if (m_logFile) postAudioMessage(AUDIOMSG_LOG_INTERVAL,NULL,m_loopcnt,0,m_active_bpi,GetActualBPM(),NULL);
 
   m_metronome_pos=0.0;
 
   int u;
-  m_locchan_cs.Enter();
-  for (u = 0; u < m_locchannels.GetSize() && u < m_max_localch; u ++)
+  const LocalMixGraph *lg=m_audio_locgraph;
+  const int nloc=lg->entries.GetSize();
+  for (u = 0; u < nloc && u < m_max_localch; u ++)
   {
-    Local_Channel *lc=m_locchannels.Get(u);
+    const LocalMixGraph::Entry *le=lg->entries.Get()+u;
+    Local_Channel *lc=le->lc;
 
-    if (!(lc->flags&4)) 
+    if (!(le->flags&4)) 
     {
       if (lc->bcast_active) 
       {
-        lc->m_bq.AddBlock(0,0.0,NULL,0);
+        lc->m_bq.AddBlock(0,0.0,NULL,0,NULL,AudioLockStats,m_trace);
+        m_netwake_audio=1;
       }
 
       int wasact=lc->bcast_active;
 
-      lc->bcast_active = lc->broadcasting;
+      lc->bcast_active = le->broadcasting;
 
       if (wasact && !lc->bcast_active)
       {
-        lc->m_bq.AddBlock(0,-1.0,NULL,-1);
+        lc->m_bq.AddBlock(0,-1.0,NULL,-1,NULL,AudioLockStats,m_trace);
+        m_netwake_audio=1;
       }
     }
   }
-  m_locchan_cs.Leave();
 
-  m_users_cs.Enter();
-  for (u = 0; u < m_remoteusers.GetSize(); u ++)
+  RemoteMixGraph *g=m_audio_graph;
+  const int nent=g->entries.GetSize();
+  for (u = 0; u < nent; u ++)
   {
-    RemoteUser *user=m_remoteusers.Get(u);
-    int ch;
-//    printf("submask=%d,cpm=%d\n",user->submask , user->chanpresentmask);
-    for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
-    {
-      RemoteUser_Channel *chan=&user->channels[ch];
+    const RemoteMixGraph::Entry *e=g->entries.Get()+u;
+    RemoteUser_Channel *chan=e->chan;
 
-      if (!(chan->flags&2) && !(chan->flags&4))
+    if (!(e->chflags&2) && !(e->chflags&4))
+    {
+      chan->dump_samples=0;
+      overlapFadeState fade_state;
+      if (chan->ds) chan->ds->calcOverlap(&fade_state);
+      retireDecodeState(chan->ds);
+      chan->ds=0;
+      if (e->state & RemoteMixGraph::ENTRY_SUBSCRIBED) chan->ds = chan->next_ds[0];
+      else retireDecodeState(chan->next_ds[0]);
+      chan->next_ds[0]=chan->next_ds[1]; // advance queue
+      chan->next_ds[1]=0;
+
+      if (chan->ds)
       {
-/*        if (ch<2)
-        {
-          OutputDebugString("advanced to next_ds (intervalpoo)\n");
-        }
-        */
-        chan->dump_samples=0;
-        overlapFadeState fade_state;
-        if (chan->ds) chan->ds->calcOverlap(&fade_state);
-        delete chan->ds;
-        chan->ds=0;
-        if ((user->submask & user->chanpresentmask) & (1<<ch)) chan->ds = chan->next_ds[0];
-        else delete chan->next_ds[0];
-        chan->next_ds[0]=chan->next_ds[1]; // advance queue
-        chan->next_ds[1]=0;
-        
-        if (chan->ds)
-        {
-          chan->ds->applyOverlap(&fade_state);
-          char guidstr[64];
-          guidtostr(chan->ds->guid,guidstr);
-          char tmp[1024],tmp2[1024],*p;
-          lstrcpyn_safe(p=tmp,user->name.Get(),sizeof(tmp));
-          while (*p) { if (*p == '\"') *p = '\''; p++; }
-
-          lstrcpyn_safe(p=tmp2,chan->name.Get(),sizeof(tmp2));
-          while (*p) { if (*p == '\"') *p = '\''; p++; }
-          writeLog("user %s \"%s\" %d \"%s\"\n",guidstr,tmp,ch,tmp2);
-        }
+        chan->ds->applyOverlap(&fade_state);
+        if (m_logFile) postAudioMessage(AUDIOMSG_LOG_USER,e->user,e->ch_idx,0,0,0.0f,chan->ds->guid);
       }
     }
   }
-  m_users_cs.Leave();
+
+  if (m_trace) m_trace->Add(NJTRACE_INTERVAL|NJTRACE_END,m_loopcnt);
 }  //if (m_enc->isError()) printf("ERROR\n");
   //else printf("YAY\n");
 
@@ -2370,6 +4691,7 @@ void NJClient::SetUserState(int idx, bool setvol, float vol, bool setpan, float
   if (setvol) p->volume=vol;
   if (setpan) p->pan=pan;
   if (setmute) p->muted=mute;
+  publishMixGraph();
 }
 
 int NJClient::EnumUserChannels(int useridx, int i)
@@ -2418,34 +4740,20 @@ void NJClient::SetUserChannelState(int useridx, int channelidx,
 
   if (setsub && !!(user->submask&(1<<channelidx)) != sub) 
   {
-    // toggle subscription
+    // toggle subscription, Run() tells the server
     if (!sub)
     {     
-      mpb_client_set_usermask su;
-      su.build_add_rec(user->name.Get(),(user->submask&=~(1<<channelidx)));
-      m_netcon->Send(su.build());
+      user->submask&=~(1<<channelidx);
 
-      DecodeState *tmp,*tmp2,*tmp3;
-      m_users_cs.Enter();
 //      OutputDebugString("flushds (state)\n");
-      tmp=p->ds; p->ds=0;
-      tmp2=p->next_ds[0]; p->next_ds[0]=0;
-      tmp3=p->next_ds[1]; p->next_ds[1]=0;
-      m_users_cs.Leave();
-
-      p->dump_samples=0;
-
-      delete tmp;
-      delete tmp2;   
-      delete tmp3;   
+      sendMixCommand(MIXCMD_FLUSH,p,NULL);
     }
     else
     {
-      mpb_client_set_usermask su;
-      su.build_add_rec(user->name.Get(),(user->submask|=(1<<channelidx)));
-      m_netcon->Send(su.build());
+      user->submask|=(1<<channelidx);
     }
-
+    m_submask_dirty=1;
+    WakeNetThread();
   }
   if (setvol) p->volume=vol;
   if (setpan) p->pan=pan;
@@ -2474,6 +4782,7 @@ void NJClient::SetUserChannelState(int useridx, int channelidx,
       if (x == m_remoteusers.GetSize()) m_issoloactive&=~1;
     }
   }
+  publishMixGraph();
 }
 
 
@@ -2538,6 +4847,170 @@ float NJClient::GetLocalChannelPeak(int ch, int whichch)
   return (float) (c->decode_peak_vol[0]+c->decode_peak_vol[1])*0.5f;
 }
 
+void NJClient::publishMeterLayout()
+{
+  WDL_MutexLock lock(&m_remotechannel_rd_mutex);
+  m_locchan_cs.Enter();
+  m_meter_layout_dirty=0;
+
+  NJMeterLayout *ml=m_meter_layout;
+  ml->lock.WriteBegin();
+  ml->serial++;
+  ml->graph_version=m_mixgraph->version;
+
+  int u, ch, nu=0, nc=0;
+  for (u = 0; u < m_remoteusers.GetSize() && nu < NJCLIENT_METER_MAX_USERS; u ++)
+  {
+    RemoteUser *user=m_remoteusers.Get(u);
+    NJClient_MeterUser *mu=ml->users + nu++;
+    lstrcpyn_safe(mu->name,user->name.Get(),sizeof(mu->name));
+    mu->vol=user->volume;
+    mu->pan=user->pan;
+    mu->muted=user->muted;
+    mu->session_pos=user->last_session_pos;
+    mu->session_updtime=user->last_session_pos_updtime;
+    mu->session_maxlen=-1.0;
+
+    for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
+    {
+      if (!(user->chanpresentmask & (1<<ch))) continue;
+      RemoteUser_Channel *chan=user->channels+ch;
+
+      // same as GetUserSessionPos()
+      if ((user->submask & (1<<ch)) && (chan->flags&4))
+      {
+        const double v=chan->GetMaxLength();
+        if (v > mu->session_maxlen) mu->session_maxlen=v;
+      }
+
+      if (nc >= NJCLIENT_METER_MAX_CHANNELS) continue;
+      NJClient_MeterChannel *mc=ml->channels + nc++;
+      memset(mc,0,sizeof(*mc));
+      mc->user_idx=u;
+      mc->ch_idx=ch;
+      mc->flags=chan->flags;
+      if (user->submask & (1<<ch)) mc->state|=NJClient_MeterChannel::STATE_SUBSCRIBED;
+      if (user->mutedmask & (1<<ch)) mc->state|=NJClient_MeterChannel::STATE_MUTED;
+      if (user->solomask & (1<<ch)) mc->state|=NJClient_MeterChannel::STATE_SOLO;
+      mc->vol=chan->volume;
+      mc->pan=chan->pan;
+      mc->outch=chan->out_chan_index;
+      lstrcpyn_safe(mc->name,chan->name.Get(),sizeof(mc->name));
+    }
+  }
+  ml->num_users=nu;
+  ml->num_channels=nc;
+
+  for (u = 0; u < m_locchannels.GetSize() && u < MAX_LOCAL_CHANNELS; u ++)
+  {
+    Local_Channel *lc=m_locchannels.Get(u);
+    NJClient_MeterChannel *mc=ml->local + u;
+    memset(mc,0,sizeof(*mc));
+    mc->user_idx=-1;
+    mc->ch_idx=lc->channel_idx;
+    mc->flags=lc->flags;
+    if (lc->muted) mc->state|=NJClient_MeterChannel::STATE_MUTED;
+    if (lc->solo) mc->state|=NJClient_MeterChannel::STATE_SOLO;
+    if (lc->broadcasting) mc->state|=NJClient_MeterChannel::STATE_BROADCAST;
+    mc->vol=lc->volume;
+    mc->pan=lc->pan;
+    mc->outch=lc->out_chan_index;
+    lstrcpyn_safe(mc->name,lc->name.Get(),sizeof(mc->name));
+  }
+  ml->num_local=u;
+
+  ml->lock.WriteEnd();
+  m_locchan_cs.Leave();
+}
+
+void NJClient::publishMeterLevels()
+{
+  NJMeterLevels *ml=m_meter_levels;
+  const RemoteMixGraph *g=m_audio_graph;
+
+  ml->lock.WriteBegin();
+  ml->graph_version=g->version;
+
+  int x, n=0;
+  const int nent=g->entries.GetSize();
+  for (x = 0; x < nent && n < NJCLIENT_METER_MAX_CHANNELS; x ++)
+  {
+    const RemoteMixGraph::Entry *e=g->entries.Get()+x;
+    ml->remote_id[n]=(e->user_idx<<8)|e->ch_idx;
+    meterLevelsFrom(ml->remote+n,e->chan->decode_peak_vol,e->chan->decode_rms);
+    n++;
+  }
+  ml->num_remote=n;
+
+  ml->num_local=ml->work_num_local;
+  memcpy(ml->local_ch,ml->work_local_ch,ml->num_local*sizeof(int));
+  memcpy(ml->local,ml->work_local,ml->num_local*sizeof(NJClient_MeterLevels));
+
+  meterLevelsFrom(&ml->output,output_peaklevel,output_rmslevel);
+
+  ml->lock.WriteEnd();
+}
+
+void NJClient::GetMeterSnapshot(NJClient_MeterSnapshot *snap)
+{
+  const NJMeterLayout *lay=m_meter_layout;
+  int graph_version;
+  for (;;)
+  {
+    const unsigned int seq=lay->lock.ReadBegin();
+    snap->layout_serial=lay->serial;
+    graph_version=lay->graph_version;
+    snap->num_users=meterCount(lay->num_users,NJCLIENT_METER_MAX_USERS);
+    snap->num_channels=meterCount(lay->num_channels,NJCLIENT_METER_MAX_CHANNELS);
+    snap->num_local=meterCount(lay->num_local,MAX_LOCAL_CHANNELS);
+    memcpy(snap->users,lay->users,snap->num_users*sizeof(NJClient_MeterUser));
+    memcpy(snap->channels,lay->channels,snap->num_channels*sizeof(NJClient_MeterChannel));
+    memcpy(snap->local,lay->local,snap->num_local*sizeof(NJClient_MeterChannel));
+    if (!lay->lock.ReadRetry(seq)) break;
+  }
+
+  const NJMeterLevels *lv=m_meter_levels;
+  int num_remote, num_local, lv_graph_version;
+  int remote_id[NJCLIENT_METER_MAX_CHANNELS];
+  NJClient_MeterLevels remote[NJCLIENT_METER_MAX_CHANNELS];
+  int local_ch[MAX_LOCAL_CHANNELS];
+  NJClient_MeterLevels local[MAX_LOCAL_CHANNELS];
+  for (;;)
+  {
+    const unsigned int seq=lv->lock.ReadBegin();
+    lv_graph_version=lv->graph_version;
+    num_remote=meterCount(lv->num_remote,NJCLIENT_METER_MAX_CHANNELS);
+    num_local=meterCount(lv->num_local,MAX_LOCAL_CHANNELS);
+    memcpy(remote_id,lv->remote_id,num_remote*sizeof(int));
+    memcpy(remote,lv->remote,num_remote*sizeof(NJClient_MeterLevels));
+    memcpy(local_ch,lv->local_ch,num_local*sizeof(int));
+    memcpy(local,lv->local,num_local*sizeof(NJClient_MeterLevels));
+    snap->output=lv->output;
+    if (!lv->lock.ReadRetry(seq)) break;
+  }
+
+  // both come from the same graph nearly always, otherwise match channels up by index
+  int x, y;
+  const bool same=lv_graph_version == graph_version && num_remote == snap->num_channels;
+  for (x = 0; x < snap->num_channels; x ++)
+  {
+    NJClient_MeterChannel *mc=snap->channels+x;
+    const int id=(mc->user_idx<<8)|mc->ch_idx;
+    if (same) y=x;
+    else for (y = 0; y < num_remote && remote_id[y] != id; y ++);
+
+    if (y < num_remote) mc->lvl=remote[y];
+    else memset(&mc->lvl,0,sizeof(mc->lvl));
+  }
+  for (x = 0; x < snap->num_local; x ++)
+  {
+    NJClient_MeterChannel *mc=snap->local+x;
+    for (y = 0; y < num_local && local_ch[y] != mc->ch_idx; y ++);
+    if (y < num_local) mc->lvl=local[y];
+    else memset(&mc->lvl,0,sizeof(mc->lvl));
+  }
+}
+
 void NJClient::DeleteLocalChannel(int ch)
 {
   m_locchan_cs.Enter();
@@ -2547,7 +5020,7 @@ void NJClient::DeleteLocalChannel(int ch)
   if (x < m_locchannels.GetSize())
   {
     bool spoo=m_locchannels.Get(x)->solo;
-    delete m_locchannels.Get(x);
+    m_locgraph->retired_channels.Add(m_locchannels.Get(x)); // AudioProc() may still be using it
     m_locchannels.Delete(x);
 
     if (spoo)
@@ -2560,6 +5033,8 @@ void NJClient::DeleteLocalChannel(int ch)
         m_issoloactive&=~2;
     }
     turd++;
+    m_meter_layout_dirty=1;
+    publishLocalGraph();
   }
   m_locchan_cs.Leave();
 
@@ -2576,6 +5051,7 @@ void NJClient::SetLocalChannelProcessor(int ch, void (*cbf)(float *, int ns, voi
      Local_Channel *c=m_locchannels.Get(x);
      c->cbf=cbf;
      c->cbf_inst=inst;
+     publishLocalGraph();
      m_locchan_cs.Leave();
   }
 }
@@ -2609,12 +5085,18 @@ void NJClient::SetLocalChannelInfo(int ch, const char *name, bool setsrcch, int
 
   Local_Channel *c=m_locchannels.Get(x);
   c->channel_idx=ch;
-  if (name) c->name.Set(name);
+  if (name)
+  {
+    c->name.Set(name);
+    if (m_recorder && ch >= 0 && ch < MAX_LOCAL_CHANNELS) m_recorder->SetStemName(1+ch,name);
+  }
   if (setsrcch) c->src_channel=srcch;
   if (setbitrate) c->bitrate=bitrate;
   if (setbcast) c->broadcasting=broadcast;
   if (setoutch) c->out_chan_index=outch;
   if (setflags) c->flags=flags;
+  m_meter_layout_dirty=1;
+  publishLocalGraph();
   m_locchan_cs.Leave();
 }
 
@@ -2670,6 +5152,8 @@ void NJClient::SetLocalChannelMonitoring(int ch, bool setvol, float vol, bool se
         m_issoloactive&=~2;
     }
   }
+  m_meter_layout_dirty=1;
+  publishLocalGraph();
   m_locchan_cs.Leave();
 }
 
@@ -2716,6 +5200,7 @@ void NJClient::NotifyServerOfChannelChange()
         sci.build_add_rec("",0,0,0x80);
     }
     m_netcon->Send(sci.build());
+    WakeNetThread();
   }
 }
 
@@ -2755,6 +5240,7 @@ void NJClient::SetWorkDir(char *path)
 RemoteUser_Channel::RemoteUser_Channel() : volume(0.25f), pan(0.0f), out_chan_index(0), flags(0), dump_samples(0), ds(NULL)
 {
   decode_peak_vol[0]=decode_peak_vol[1]=0.0;
+  decode_rms[0]=decode_rms[1]=0.0;
   memset(next_ds,0,sizeof(next_ds));
   curds_lenleft=0.0;
 }
@@ -2770,40 +5256,19 @@ RemoteUser_Channel::~RemoteUser_Channel()
 }
 
 
-bool RemoteUser_Channel::GetSessionInfo(double time, unsigned char *guid, double *offs, double *len, double mv)
+int RemoteUser_Channel::GetSessionSpans(double time, double mv, ChannelSessionInfo *spans, int maxspans)
 {
   WDL_MutexLock lock(&sessionlist_mutex);
 
   mv *= 2.0; // allow one sample poot
   // todo: binary search
-  int x;
-  for (x = 0; x < sessioninfo.GetSize(); x ++)
+  int x, n=0;
+  for (x = 0; x < sessioninfo.GetSize() && n < maxspans; x ++)
   {
-    if (time < sessioninfo.Get(x)->start_time-mv) 
-    {
-      *len = sessioninfo.Get(x)->start_time-time;
-      if (*len > 1.0) *len=1.0;
-      return false;
-    }
-
-    if (time < sessioninfo.Get(x)->start_time+ sessioninfo.Get(x)->length-mv) 
-    {
-      memcpy(guid,sessioninfo.Get(x)->guid,16);
-      if (time < sessioninfo.Get(x)->start_time) 
-      {
-        *offs=sessioninfo.Get(x)->offset;
-        *len = sessioninfo.Get(x)->length + (sessioninfo.Get(x)->start_time-time);
-      }
-      else
-      {
-        *offs=(time - sessioninfo.Get(x)->start_time) + sessioninfo.Get(x)->offset;
-        *len = (sessioninfo.Get(x)->start_time+sessioninfo.Get(x)->length)-time;
-      }
-      return true;
-    }
+    const ChannelSessionInfo *s=sessioninfo.Get(x);
+    if (time < s->start_time+s->length-mv) spans[n++]=*s;
   }
-  *len = 1.0;
-  return false;
+  return n;
 }
 
 void RemoteUser_Channel::AddSessionInfo(const unsigned char *guid, double st, double len)
@@ -2955,13 +5420,7 @@ void RemoteDownload::startPlaying(int force)
 
 //        OutputDebugString(tmp?"started new decde\n":"tried to start new decode\n");
 
-        DecodeState *tmp2;
-        m_parent->m_users_cs.Enter();
-        int useidx=!!theuser->channels[chidx].next_ds[0];
-        tmp2=theuser->channels[chidx].next_ds[useidx];
-        theuser->channels[chidx].next_ds[useidx]=tmp;
-        m_parent->m_users_cs.Leave();
-        delete tmp2;
+        m_parent->sendMixCommand(MIXCMD_QUEUE_DS,&theuser->channels[chidx],tmp);
       }
     }
   //  else
@@ -3002,6 +5461,7 @@ Local_Channel::Local_Channel() : channel_idx(0), src_channel(0), volume(1.0f), p
                 m_wavewritefile(NULL)
 {
   decode_peak_vol[0]=decode_peak_vol[1]=0.0;
+  decode_rms[0]=decode_rms[1]=0.0;
 }
 
 
@@ -3042,12 +5502,13 @@ void BufferQueue::DisposeBlock(WDL_HeapBuf *b)
 }
 
 
-void BufferQueue::AddBlock(int attr, double startpos, float *samples, int len, float *samples2)
+void BufferQueue::AddBlock(int attr, double startpos, float *samples, int len, float *samples2,
+                           NJClient_AudioLockStats *st, NJTraceRing *trace)
 {
   WDL_HeapBuf *mybuf=0;
   if (len>0)
   {
-    m_cs.Enter();
+    audioLockEnter(&m_cs,NJClient_AudioLockStats::LOCK_BUFFERQUEUE,st,trace);
 
     if (m_samplequeue.GetSize() > 512*2)
     {
@@ -3077,7 +5538,7 @@ void BufferQueue::AddBlock(int attr, double startpos, float *samples, int len, f
   }
   else if (len == -1) mybuf=(WDL_HeapBuf *)-1;
 
-  m_cs.Enter();
+  audioLockEnter(&m_cs,NJClient_AudioLockStats::LOCK_BUFFERQUEUE,st,trace);
 
   WDL_HeapBuf *attrbuf=NULL;
   int esz=m_emptybufs_attr.GetSize();
@@ -3139,3 +5600,50 @@ void NJClient::SetOggOutFile(FILE *fp, int srate, int nch, int bitrate)
 #endif
 }
 
+int NJClient::StartRecording(const char *path, int sources, int flags, int nch, int bufsize)
+{
+  if (m_recorder_running) return -1;
+  if (!m_recorder) m_recorder=new NJRecorder;
+
+  m_remotechannel_rd_mutex.Enter();
+  if (!m_recorder->Start(path,sources,flags,nch,bufsize))
+  {
+    m_remotechannel_rd_mutex.Leave();
+    return -1;
+  }
+
+  m_locchan_cs.Enter();
+  int x;
+  for (x = 0; x < m_locchannels.GetSize(); x ++)
+  {
+    Local_Channel *lc=m_locchannels.Get(x);
+    if (lc->channel_idx >= 0 && lc->channel_idx < MAX_LOCAL_CHANNELS) m_recorder->SetStemName(1+lc->channel_idx,lc->name.Get());
+  }
+  m_locchan_cs.Leave();
+  m_recorder->SetStemName(0,"master");
+
+  publishMixGraph(); // numbers the remote stems
+  m_remotechannel_rd_mutex.Leave();
+
+  m_recorder_running=1;
+  return 0;
+}
+
+void NJClient::StopRecording()
+{
+  if (!m_recorder_running) return;
+  m_recorder_running=0;
+
+  // AudioProc() may still finish a segment, which the next recording skips
+  m_remotechannel_rd_mutex.Enter();
+  m_recorder->Stop();
+  publishMixGraph();
+  m_remotechannel_rd_mutex.Leave();
+}
+
+void NJClient::GetRecordingStats(NJClient_RecordingStats *st)
+{
+  if (m_recorder) m_recorder->GetStats(st);
+  else memset(st,0,sizeof(*st));
+}
+
@@ -43,6 +43,28 @@
   It is not necessary to do any sort of mutex protection around these calls, 
   though, as they are done internally.
 
+  The audio thread does not lock the remote user list. Run() and the
+  SetUser*() calls publish an immutable snapshot of what to mix (a
+  RemoteMixGraph) and hand decoders to the audio thread through a FIFO.
+  Snapshots, users and decoders the audio thread is done with are freed
+  later by Run(), never by AudioProc().
+
+  Instead of running Run() from a thread of your own, you can call
+  StartNetThread(), and NJClient will call it from its own network thread.
+  That thread sleeps on the connection's socket (epoll/poll, or
+  WSAEventSelect on Windows) rather than polling, and AudioProc() wakes it
+  when there is audio to encode and send. Pass it the mutex you would have
+  held around Run(). It can also queue what Run() would tell the UI, so the
+  UI thread picks it up with DispatchUIEvents() instead of taking callbacks
+  on the network thread.
+
+  Meters and channel state for display are best read with GetMeterSnapshot(),
+  which takes no locks: AudioProc() publishes the levels once per call, and
+  Run() publishes names and settings when they change (so a change made with
+  a Set*() call shows up there after the next Run()). The older per-item
+  calls (GetUserChannelPeak() etc.) still work, but take
+  m_remotechannel_rd_mutex each time.
+
 
   Some other notes:
 
@@ -86,6 +108,42 @@ class Local_Channel;
 class DecodeState;
 class BufferQueue;
 class DecodeMediaBuffer;
+class NJTraceRing;
+class RemoteMixGraph;
+class LocalMixGraph;
+class MixCommandFifo;
+class AudioMessageFifo;
+struct NJMixCommand;
+class NJMeterLayout;
+class NJMeterLevels;
+class NJSessionPlayPos;
+struct NJClient_MeterSnapshot;
+class NJNetThread;
+class NJRecorder;
+
+// see NJClient::GetRecordingStats()
+struct NJClient_RecordingStats
+{
+  int recording; // StartRecording() is in effect
+  int stems; // stems written so far
+  int stems_skipped; // NJC_REC_INTERLEAVED: stems that did not fit in its channels
+  double seconds; // recorded so far
+  WDL_INT64 bytes_written;
+  int write_errors;
+
+  // AudioProc() never waits for the recorder: audio that doesn't fit in its
+  // buffer is dropped, and written as silence
+  int dropped_blocks, dropped_frames;
+  int buffer_size, buffer_peak; // bytes
+};
+
+// lock accounting for the locks AudioProc() takes, see NJClient::AudioLockStats
+struct NJClient_AudioLockStats
+{
+  enum { LOCK_BUFFERQUEUE=0, NUM_LOCKS }; // the upload and wave queues. channels and tempo are lock-free
+  int count[NUM_LOCKS]; // acquisitions
+  double wait[NUM_LOCKS], maxwait[NUM_LOCKS]; // seconds spent waiting in Enter()
+};
 
 // #define NJCLIENT_NO_XMIT_SUPPORT // might want to do this for njcast :)
 //  it also removes mixed ogg writing support
@@ -93,6 +151,7 @@ class DecodeMediaBuffer;
 class NJClient
 {
   friend class RemoteDownload;
+  friend class NJNetThread;
 public:
   NJClient();
   ~NJClient();
@@ -103,6 +162,22 @@ public:
   // call Run() from your main (UI) thread
   int Run();// returns nonzero if sleep is OK
 
+  // or have NJClient call Run() from a thread of its own (see above). runlock, if set, is held
+  // while Run() is called. with queue_ui_events, ChatMessage_Callback and status/userinfo changes
+  // are queued for DispatchUIEvents() rather than delivered on the network thread.
+  int StartNetThread(WDL_Mutex *runlock=NULL, bool queue_ui_events=false); // returns 0 on success
+  void StopNetThread(); // without runlock held. call before deleting runlock (~NJClient() calls it too)
+  void WakeNetThread(); // makes the network thread call Run() soon. any thread, never blocks
+
+  enum { NJC_UIEVENT_CHAT=1, NJC_UIEVENT_STATUS=2, NJC_UIEVENT_USERINFO=4 };
+  // UI thread: calls ChatMessage_Callback for queued chat messages, returns the NJC_UIEVENT_*
+  // that happened since the last call (NJC_UIEVENT_USERINFO replaces HasUserInfoChanged())
+  int DispatchUIEvents();
+  // called from the network thread when events are queued and DispatchUIEvents() has not been
+  // called since the last time, i.e. post a message to your UI thread from it
+  void (*UIEventsPosted_Callback)(void *userData, NJClient *inst);
+  void *UIEventsPosted_User;
+
   char *GetErrorStr() { return m_errstr.Get(); }
 
   int IsAudioRunning() { return m_audio_enable; }
@@ -111,7 +186,7 @@ public:
 
 
   // basic configuration
-  int   config_autosubscribe;
+  int   config_autosubscribe; // subscribes to new remote channels, except ones flagged 1 (e.g. mixdown streams)
   int   config_savelocalaudio; // set 1 to save compressed files, set to 2 to save .wav files as well. 
                                 // -1 makes it try to delete the remote .oggs as soon as possible
 
@@ -165,11 +240,29 @@ public:
 
   int IsASoloActive() { return m_issoloactive; }
 
+  // copies a consistent view of all meters (peak and RMS), users, remote and
+  // local channels into snap. never blocks the audio thread or Run(), can be
+  // called from any thread
+  void GetMeterSnapshot(NJClient_MeterSnapshot *snap);
+
   void SetLogFile(char *name=NULL);
 
   void SetOggOutFile(FILE *fp, int srate, int nch, int bitrate=128);
   WaveWriter *waveWrite;
 
+  // multitrack recording to 24-bit WAV (or W64) on a thread of its own. the master mix (before
+  // master volume and the metronome, like waveWrite), each local channel (after its processor)
+  // and each subscribed remote channel (as mixed, i.e. with its volume and pan) is a stem.
+  // path is a directory that gets a file per stem, or with NJC_REC_INTERLEAVED the file that
+  // gets all stems, in order of appearance, in nch channels (16 if 0). stems
+  // start at the start of the recording (silence until they first have audio).
+  // bufsize is the audio thread's buffer in bytes (only the first StartRecording() uses it).
+  enum { NJC_REC_MASTER=1, NJC_REC_LOCAL=2, NJC_REC_REMOTE=4, NJC_REC_ALL=7 };
+  enum { NJC_REC_INTERLEAVED=1, NJC_REC_W64=2 };
+  int StartRecording(const char *path, int sources=NJC_REC_ALL, int flags=0, int nch=0, int bufsize=0); // 0 on success
+  void StopRecording(); // finishes writing, closes the files
+  void GetRecordingStats(NJClient_RecordingStats *st);
+
 
   void *LicenseAgreement_User;
   int (*LicenseAgreementCallback)(void *userData, const char *licensetext); // return TRUE if user accepts
@@ -196,20 +289,49 @@ public:
   int (*ChannelMixer)(void *userData, float **inbuf, int in_offset, int innch, int chidx, float *outbuf, int len);
   void *ChannelMixer_User;
 
+  // if set, AudioProc() times every lock it takes and adds the result here.
+  // NULL by default (no timing overhead). Only read it from the audio thread,
+  // or between AudioProc() calls.
+  NJClient_AudioLockStats *AudioLockStats;
+
+  // if set, AudioProc() records timestamped spans into it (see njtrace.h).
+  // NULL by default. Read it from another thread with NJTraceRing::Read().
+  NJTraceRing *AudioTrace;
+
   WDL_Mutex m_remotechannel_rd_mutex;
 
 protected:
   double output_peaklevel[2];
+  double output_rmslevel[2]; // mean square
 
   void _reinit();
 
   void makeFilenameFromGuid(WDL_String *s, unsigned char *guid);
 
   void updateBPMinfo(int bpm, int bpi);
+
+  // remote mix graph, see RemoteMixGraph in njclient.cpp
+  void publishMixGraph(); // call with m_remotechannel_rd_mutex held, after changing m_remoteusers
+  void publishLocalGraph(); // call with m_locchan_cs held, after changing m_locchannels
+  void retireRemoteUser(RemoteUser *user); // user must already be removed from m_remoteusers
+  void updateRemoteChannel(int useridx, int active, int cid, int flags, const char *chname); // from the server's userinfo, may remove the user
+  void sendSubscriptions(); // sends submask changes, called from Run()
+  void sendMixCommand(int cmd, RemoteUser_Channel *chan, DecodeState *ds);
+  void reclaimMixGraphs(); // frees what the audio thread is done with, called from Run()
+  void drainIdleAudio(); // from reclaimMixGraphs()
+  void prepareSessionDecoders(); // called from Run()
+  DecodeState *takeSessionDecoder(RemoteUser_Channel *chan, double time, double mv, double *offs); // audio thread
+  void endAudioProc(); // audio thread
+  void runMixCommands(); // audio thread
+  void retireDecodeState(DecodeState *ds); // audio thread
+  void postRetiredDecodeStates(); // audio thread
+  void postAudioMessage(int type, RemoteUser *user, int a, int b, int c, float f, const unsigned char *guid); // audio thread
+
   void process_samples(float **inbuf, int innch, float **outbuf, int outnch, int len, int srate, int offset, int justmonitor, bool isPlaying, bool isSeek, double cursessionpos);
   void on_new_interval();
 
   void writeLog(const char *fmt, ...);
+  NJTraceRing *m_trace; // AudioTrace for the duration of an AudioProc() call
 
   WDL_String m_errstr;
 
@@ -226,11 +348,10 @@ protected:
   WDL_String m_user, m_pass, m_host;
 
   int m_in_auth;
-  int m_bpm,m_bpi;
-  int m_beatinfo_updated;
   int m_audio_enable;
   int m_srate;
   int m_userinfochange;
+  int m_submask_dirty; // a RemoteUser's submask changed
   int m_issoloactive;
 
   unsigned int m_session_pos_ms,m_session_pos_samples; // samples just keeps track of any samples lost to precision errors
@@ -240,6 +361,8 @@ protected:
   int m_interval_length;
   int m_interval_pos, m_metronome_state, m_metronome_tmp,m_metronome_interval;
   double m_metronome_pos;
+  WDL_TypedBuf<double> m_metronome_click; // one click per beat type, see process_samples()
+  int m_metronome_click_srate;
 
   DecodeState *start_decode(unsigned char *guid, unsigned int fourcc=0, DecodeMediaBuffer *decbuf=NULL);
 
@@ -247,10 +370,65 @@ protected:
 
   WDL_PtrList<Local_Channel> m_locchannels;
 
-  void mixInChannel(RemoteUser_Channel *userchan, bool muted, float vol, float pan, float **outbuf, int out_channel, 
+  void makeMetronomeClick(int srate);
+  void mixInChannel(RemoteUser_Channel *userchan, int chflags, bool muted, float vol, float pan, float **outbuf, int out_channel, 
                     int len, int srate, int outnch, int offs, double vudecay, bool isPlaying, bool isSeek, double playPos);
 
-  WDL_Mutex m_users_cs, m_locchan_cs, m_log_cs, m_misc_cs;
+  WDL_Mutex m_locchan_cs, m_log_cs; // m_locchan_cs: control side only, never taken by AudioProc()
+
+  NJNetThread *m_netthread; // kept until ~NJClient() once created, so AudioProc() can always wake it
+  volatile int m_netthread_running;
+  int m_netwake_audio; // audio thread: queued something for Run() during this AudioProc()
+  void netThreadProc();
+  SOCKET getNetWaitSocket(bool *wantwrite); // with runlock held
+
+  NJRecorder *m_recorder; // kept until ~NJClient() once created, like m_netthread
+  volatile int m_recorder_running; // AudioProc() passes audio to m_recorder
+
+  bool m_queue_ui_events;
+  WDL_Mutex m_uievent_cs; // protects the following
+  int m_uievents; // NJC_UIEVENT_*
+  bool m_uievents_posted; // UIEventsPosted_Callback called since the last DispatchUIEvents()
+  WDL_PtrList<Net_Message> m_uievent_chat; // queued MESSAGE_CHAT_MESSAGEs
+
+  RemoteMixGraph * volatile m_mixgraph; // current snapshot, written by the control side only
+  RemoteMixGraph *m_audio_graph; // snapshot used for the duration of an AudioProc() call
+  WDL_PtrList<RemoteMixGraph> m_mixgraph_retired; // replaced snapshots, oldest first
+  volatile int m_mixgraph_seen; // version of the snapshot used by the last completed AudioProc()
+  MixCommandFifo *m_mixcmds; // control -> audio
+  WDL_TypedBuf<NJMixCommand> m_mixcmd_overflow; // commands that did not fit in m_mixcmds yet
+  unsigned int m_mixcmd_seq; // commands issued
+  volatile unsigned int m_mixcmd_done; // commands run by the audio thread
+  AudioMessageFifo *m_audiomsgs; // audio -> control (decoders to free, log lines)
+  DecodeState *m_audio_retired_ds; // audio thread only, decoders not yet posted to m_audiomsgs
+  volatile unsigned int m_audiomsg_lost; // log lines the audio thread could not post
+  unsigned int m_audiomsg_lost_seen; // control side only
+  WDL_Mutex m_mixgraph_cs; // control side only (Run() and UI threads), never taken by AudioProc()
+
+  LocalMixGraph * volatile m_locgraph; // current local channel snapshot, written under m_locchan_cs
+  LocalMixGraph *m_audio_locgraph; // snapshot used for the duration of an AudioProc() call
+  WDL_PtrList<LocalMixGraph> m_locgraph_retired; // under m_locchan_cs, oldest first
+  volatile int m_locgraph_seen; // version of the local snapshot used by the last completed AudioProc()
+
+  volatile int m_audio_claim; // held by AudioProc() for each call, or by Run() in drainIdleAudio()
+  volatile unsigned int m_audioproc_calls; // completed AudioProc() calls
+  unsigned int m_audioproc_calls_seen; // control side only
+  double m_audio_idle_since; // control side only, NJTrace_GetTime() when m_audioproc_calls last changed
+
+  NJSessionPlayPos *m_playpos; // written by AudioProc(), see prepareSessionDecoders()
+  unsigned int m_audio_playrestarts; // audio thread
+  bool m_audio_wasplaying; // audio thread
+  unsigned int m_playrestarts_seen; // control side only
+
+  NJMeterLayout *m_meter_layout; // written by Run(), see publishMeterLayout()
+  NJMeterLevels *m_meter_levels; // written by AudioProc(), see publishMeterLevels()
+  volatile int m_meter_layout_dirty; // set when anything in the layout changes
+  void publishMeterLayout();
+  void publishMeterLevels(); // audio thread
+
+  volatile int m_beatinfo; // (bpm<<16)|bpi
+  volatile int m_beatinfo_updated; // incremented after m_beatinfo changes
+  int m_beatinfo_seen; // audio thread
   Net_Connection *m_netcon;
   WDL_PtrList<RemoteUser> m_remoteusers;
   WDL_PtrList<RemoteDownload> m_downloads;
@@ -265,4 +443,58 @@ protected:
 #define DOWNLOAD_TIMEOUT 8
 
 
+// see NJClient::GetMeterSnapshot()
+#define NJCLIENT_METER_MAX_USERS 64
+#define NJCLIENT_METER_MAX_CHANNELS 256 // remote channels, over all users
+
+struct NJClient_MeterLevels
+{
+  float peak[2]; // left/right, same decay as Get*Peak()
+  float rms[2]; // left/right, averaged over about 250ms
+};
+
+struct NJClient_MeterChannel
+{
+  enum { STATE_SUBSCRIBED=1, STATE_MUTED=2, STATE_SOLO=4, STATE_BROADCAST=8 };
+
+  int user_idx; // index of the user (as in GetUserState()), -1 for a local channel
+  int ch_idx; // remote: channel index, local: channel as used by SetLocalChannelInfo()
+  int flags; // channel flags
+  int state; // STATE_*
+  float vol, pan; // channel only, not including the user's
+  int outch;
+  NJClient_MeterLevels lvl;
+  char name[64];
+};
+
+struct NJClient_MeterUser
+{
+  char name[64];
+  float vol, pan;
+  bool muted;
+  double session_pos, session_maxlen; // as GetUserSessionPos()
+  time_t session_updtime;
+};
+
+struct NJClient_MeterSnapshot
+{
+  unsigned int layout_serial; // changes whenever users, channels or their settings change
+
+  NJClient_MeterLevels output;
+
+  int num_users, num_channels, num_local;
+  NJClient_MeterUser users[NJCLIENT_METER_MAX_USERS];
+  NJClient_MeterChannel channels[NJCLIENT_METER_MAX_CHANNELS]; // present remote channels, in user/channel order
+  NJClient_MeterChannel local[MAX_LOCAL_CHANNELS];
+
+  const NJClient_MeterChannel *FindChannel(int user_idx, int ch_idx) const // NULL if not present
+  {
+    int x;
+    if (user_idx < 0) { for (x = 0; x < num_local; x ++) if (local[x].ch_idx == ch_idx) return local+x; }
+    else { for (x = 0; x < num_channels; x ++) if (channels[x].user_idx == user_idx && channels[x].ch_idx == ch_idx) return channels+x; }
+    return NULL;
+  }
+};
+
+
 #endif//_NJCLIENT_H_
@@ -0,0 +1,403 @@
+/*
+  njclient_test.cpp
+  checks the output kernels of process_samples() (outputStage(), mixClippedFloatsNIOutput(), the SSE2
+  paths where built) against the per-sample loops they replaced: master volume and peak followed by a
+  separate metronome pass, and mixInChannel()'s clip/VU pass followed by mixFloatsNIOutput(). samples
+  and peaks have to match bit for bit, for mono and stereo sources and outputs, mono-out (both
+  destinations the same buffer), clipping input and unaligned buffers.
+
+  also checks the multitrack recorder's file output: recFloatsToI24() against float_to_i24() (equal
+  except on exact ties, which the SSE2 path rounds to even, so those may differ by 1), and that
+  NJRecFile writes WAV and W64 files whose headers, sizes and padding are right and whose audio
+  (at NJREC_DATA_OFFSET) is what was written, including silence.
+
+  njclient.cpp is included, so link what njclient.o needs:
+  g++ -O2 -pthread -o njclient_test njclient_test.cpp mpb.cpp netmsg.cpp njmisc.cpp \
+    ../WDL/jnetlib/asyncdns.cpp ../WDL/jnetlib/connection.cpp ../WDL/jnetlib/listen.cpp \
+    ../WDL/jnetlib/util.cpp ../WDL/rng.cpp ../WDL/sha.cpp -lvorbis -lvorbisenc -logg -lm
+  ./njclient_test [iterations] [full]  (full: every float in -1..1 through recFloatsToI24() rather than 1 in 61)
+*/
+
+#include "njclient.cpp"
+
+static unsigned int g_rs=1;
+static unsigned int rnd() { g_rs=g_rs*1664525+1013904223; return g_rs>>8; }
+static double rndf() { return (rnd()&0xffffff) / (double)0x1000000; } // 0..1
+
+static int g_fails;
+
+static void check(bool ok, const char *what)
+{
+  if (!ok) { g_fails++; printf("FAIL %s\n",what); }
+}
+
+static bool sameBits(const float *a, const float *b, int n)
+{
+  return !memcmp(a,b,n*sizeof(float));
+}
+
+// audio-ish input: mostly in range, some past full scale, some exactly +-1, some tiny
+static float rndSample()
+{
+  switch (rnd()%8)
+  {
+    case 0: return (float)((rndf()*2.0-1.0)*4.0);
+    case 1: return (rnd()&1) ? 1.0f : -1.0f;
+    case 2: return (float)((rndf()*2.0-1.0)*1e-30);
+    default: return (float)(rndf()*2.0-1.0);
+  }
+}
+
+// the master volume/peak pass and the metronome pass that outputStage() replaced
+static void ref_outputStage(float *p, int n, float vol, float *peak, const double *click, double clickvol)
+{
+  float maxf=*peak;
+  int x;
+  for (x = 0; x < n; x ++)
+  {
+    float f = p[x] *= vol;
+    if (f > maxf) maxf=f;
+    else if (f < -maxf) maxf=-f;
+  }
+  if (click) for (x = 0; x < n; x ++) p[x]+=(float)(click[x]*clickvol);
+  *peak=maxf;
+}
+
+static void testOutputStage(int iters)
+{
+  const int fails0=g_fails;
+  WDL_TypedBuf<float> a, b;
+  WDL_TypedBuf<double> click;
+  int it;
+  for (it = 0; it < iters; it ++)
+  {
+    const int n=rnd()%300;
+    const int offs=rnd()%4; // alignment
+    float *pa=a.Resize(n+offs)+offs, *pb=b.Resize(n+offs)+offs;
+    double *pc=click.Resize(n+offs)+offs;
+    int x;
+    for (x = 0; x < n; x ++)
+    {
+      pa[x]=pb[x]=rndSample();
+      pc[x]=sin(x*0.1)*((rnd()&3) ? 1.0 : 0.25);
+    }
+    const float vol=(rnd()&7) ? (float)(rndf()*2.0) : 0.0f; // master mute is 0
+    const double clickvol=rndf()*(rnd()&1 ? 1.0f-(float)rndf() : 1.0);
+    const float peak0=(rnd()&1) ? (float)rndf() : 0.0f;
+    const bool useclick=!!(rnd()&1);
+
+    float peak_a=peak0, peak_b=peak0;
+    ref_outputStage(pa,n,vol,&peak_a,useclick ? pc : NULL,clickvol);
+    outputStage(pb,n,vol,&peak_b,useclick ? pc : NULL,clickvol);
+    if (!sameBits(pa,pb,n) || !sameBits(&peak_a,&peak_b,1))
+    {
+      if (g_fails++ < 10) printf("FAIL outputStage() differs: n=%d offs=%d vol=%g click=%d peak %.9g vs %.9g\n",n,offs,vol,useclick,peak_a,peak_b);
+    }
+  }
+  if (g_fails == fails0) printf("ok   outputStage() matches the old volume/peak and metronome passes (%d cases)\n",iters);
+}
+
+// mixInChannel() before: clip the decoded audio in place tracking the VU peaks, then mixFloatsNIOutput()
+static void ref_mixClipped(float *src, int srcnch, float **dest, int use_nch, int len, float vol, float pan, float *peak1, float *peak2)
+{
+  float *p=src;
+  int l=len*srcnch;
+  float maxf=*peak1, maxf2=*peak2;
+  if (srcnch>=2)
+  {
+    l/=2;
+    while (l--)
+    {
+      float f=*p;
+      if (f<-1.0f) f=*p=-1.0f;
+      else if (f>1.0f) f=*p=1.0f;
+      if (f > maxf) maxf=f;
+      else if (f < -maxf) maxf=-f;
+
+      f=*++p;
+      if (f<-1.0f) f=*p=-1.0f;
+      else if (f>1.0f) f=*p=1.0f;
+      if (f > maxf2) maxf2=f;
+      else if (f < -maxf2) maxf2=-f;
+      p++;
+    }
+  }
+  else
+  {
+    while (l--)
+    {
+      float f=*p;
+      if (f<-1.0f) f=*p=-1.0f;
+      else if (f>1.0f) f=*p=1.0f;
+      if (f > maxf) maxf=f;
+      else if (f < -maxf) maxf=-f;
+      p++;
+    }
+    maxf2=maxf;
+  }
+  *peak1=maxf;
+  *peak2=maxf2;
+
+  double state=0.0;
+  mixFloatsNIOutput(src,48000,srcnch,dest,48000,use_nch,len,vol,pan,&state);
+}
+
+static void testMixClipped(int iters)
+{
+  const int fails0=g_fails;
+  WDL_TypedBuf<float> srca, srcb, outa, outb;
+  int it, cnt[2][3]={{0,},};
+  for (it = 0; it < iters; it ++)
+  {
+    const int srcnch=1 + (rnd()&1);
+    const int outnch=1 + (rnd()&1);
+    const bool monoout=outnch > 1 && !(rnd()&3); // out_channel&1024
+    const int len=rnd()%300;
+    const int offs=rnd()%4;
+
+    float *sa=srca.Resize(len*srcnch+offs)+offs, *sb=srcb.Resize(len*srcnch+offs)+offs;
+    int x;
+    for (x = 0; x < len*srcnch; x ++) sa[x]=sb[x]=rndSample();
+    float *oa=outa.Resize(2*len+offs)+offs, *ob=outb.Resize(2*len+offs)+offs;
+    for (x = 0; x < 2*len; x ++) oa[x]=ob[x]=(float)(rndf()-0.5);
+
+    // as mixInChannel() sets it up
+    int use_nch=(outnch < 2 || monoout) ? 1 : 2;
+    float lvol=(rnd()&7) ? (float)(rndf()*5.0) : 1.0f; // vol is clamped to 4
+    float pan=(rnd()&3) ? (float)(rndf()*3.0-1.5) : 0.0f;
+    float *da[2]={oa,use_nch > 1 ? oa+len : NULL}, *db[2]={ob,use_nch > 1 ? ob+len : NULL};
+    const bool alias=use_nch == 1 && srcnch > 1;
+    if (alias)
+    {
+      da[1]=da[0];
+      db[1]=db[0];
+      lvol*=0.5f;
+      use_nch=2;
+    }
+    cnt[srcnch-1][alias ? 0 : use_nch]++;
+
+    const float p1=(float)rndf(), p2=(float)rndf();
+    float pa1=p1, pa2=p2, pb1=p1, pb2=p2;
+    ref_mixClipped(sa,srcnch,da,use_nch,len,lvol,pan,&pa1,&pa2);
+    mixClippedFloatsNIOutput(sb,srcnch,db,use_nch,len,lvol,pan,&pb1,&pb2);
+
+    if (!sameBits(oa,ob,2*len) || !sameBits(&pa1,&pb1,1) || !sameBits(&pa2,&pb2,1))
+    {
+      if (g_fails++ < 10)
+        printf("FAIL mixClippedFloatsNIOutput() differs: srcnch=%d use_nch=%d alias=%d len=%d offs=%d vol=%g pan=%g\n",
+               srcnch,use_nch,alias,len,offs,lvol,pan);
+    }
+  }
+  if (g_fails == fails0)
+    printf("ok   mixClippedFloatsNIOutput() matches the old clip pass and mixFloatsNIOutput() (%d cases: mono src %d/%d/%d, stereo src %d/%d/%d to mono/stereo/mono-out)\n",
+           iters,cnt[0][1],cnt[0][2],cnt[0][0],cnt[1][1],cnt[1][2],cnt[1][0]);
+}
+
+static int i24val(const unsigned char *p) { int v=p[0] | (p[1]<<8) | (p[2]<<16); return (v&0x800000) ? v-0x1000000 : v; }
+
+// compares f[0..n-1] through recFloatsToI24() and float_to_i24(), counting the exact ties
+static void checkI24(const float *f, int n, int *ties, int *tiediffs)
+{
+  unsigned char a[3*64], b[3*64];
+  recFloatsToI24(f,a,n);
+  for (int x = 0; x < n; x ++)
+  {
+    float v=f[x];
+    float_to_i24(&v,b+x*3);
+    const int va=i24val(a+x*3), vb=i24val(b+x*3);
+    if (va == vb) continue;
+
+    const double sc=v*8388608.0;
+    const bool tie=v > -1.0f && v < 1.0f && sc-floor(sc) == 0.5;
+    if (tie && (va == vb-1 || va == vb+1) && !(va&1)) { (*tiediffs)++; continue; }
+    if (g_fails++ < 10) printf("FAIL recFloatsToI24(%.9g) = %d, float_to_i24() = %d\n",v,va,vb);
+  }
+  for (int x = 0; x < n; x ++)
+  {
+    const double sc=f[x]*8388608.0;
+    if (f[x] > -1.0f && f[x] < 1.0f && sc-floor(sc) == 0.5) (*ties)++;
+  }
+}
+
+static void testI24(bool full)
+{
+  const int fails0=g_fails;
+  float f[64];
+  int n=0, ties=0, tiediffs=0;
+  unsigned int bits;
+  const unsigned int stride=full ? 1 : 61;
+  // every (or every 61st) float in 0..1, both signs, then a little past full scale
+  for (bits = 0; bits <= 0x3f900000; bits += stride)
+  {
+    union { unsigned int i; float f; } u;
+    u.i=bits;
+    f[n++]=u.f;
+    u.i=bits|0x80000000;
+    f[n++]=u.f;
+    if (n == 64) { checkI24(f,n,&ties,&tiediffs); n=0; }
+  }
+  // exact ties
+  for (int x = 0; x < 1000000; x ++)
+  {
+    f[n++]=(float)(((double)(int)(rnd()%16777216)-8388608.0+0.5)/8388608.0);
+    if (n == 64) { checkI24(f,n,&ties,&tiediffs); n=0; }
+  }
+  checkI24(f,n,&ties,&tiediffs);
+
+  // every length, and nothing is written past the end
+  unsigned char buf[3*40+16];
+  for (n = 0; n <= 40; n ++)
+  {
+    for (int x = 0; x < n; x ++) f[x]=(float)(rndf()*2.0-1.0);
+    memset(buf,0xcd,sizeof(buf));
+    recFloatsToI24(f,buf,n);
+    bool ok=true;
+    for (int x = 0; x < n; x ++)
+    {
+      unsigned char b[3];
+      float_to_i24(f+x,b);
+      if (abs(i24val(b)-i24val(buf+x*3)) > 1) ok=false;
+    }
+    for (int x = n*3; x < (int)sizeof(buf); x ++) if (buf[x] != 0xcd) ok=false;
+    if (!ok && g_fails++ < 10) printf("FAIL recFloatsToI24() of %d samples\n",n);
+  }
+
+  if (g_fails == fails0) printf("ok   recFloatsToI24() matches float_to_i24() except on ties (%d ties, %d rounded to even)\n",ties,tiediffs);
+}
+
+static unsigned int rd32(const unsigned char *p) { return p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned int)p[3]<<24); }
+static WDL_INT64 rd64(const unsigned char *p) { return (WDL_INT64)rd32(p) | ((WDL_INT64)rd32(p+4)<<32); }
+
+// writes frames (with a run of silence in the middle) through NJRecFile and reads the file back
+static void testRecFile(bool w64, int nch, int frames)
+{
+  const int fails0=g_fails;
+  const char *fn="njclient_test.tmp";
+  const int srate=44100;
+  const int silence_at=frames/3, silence_len=frames/5 + 1;
+  const int total=frames+silence_len;
+
+  WDL_TypedBuf<float> audio;
+  float *a=audio.Resize(frames*nch);
+  for (int x = 0; x < frames*nch; x ++) a[x]=rndSample();
+
+  NJRecFile *rf=new NJRecFile;
+  if (!rf->Open(fn,w64,nch,srate)) { printf("FAIL can't write %s\n",fn); g_fails++; delete rf; return; }
+  int pos=0;
+  while (pos < frames)
+  {
+    if (pos == silence_at) rf->WriteSilence(silence_len);
+    int n=1 + rnd()%5000;
+    if (pos < silence_at && pos+n > silence_at) n=silence_at-pos;
+    if (n > frames-pos) n=frames-pos;
+    rf->Write(a+pos*nch,n);
+    pos+=n;
+  }
+  const WDL_INT64 wframes=rf->m_frames;
+  const int errors=rf->m_errors;
+  rf->Close();
+  delete rf;
+
+  FILE *fp=fopen(fn,"rb");
+  WDL_HeapBuf file;
+  if (fp)
+  {
+    fseek(fp,0,SEEK_END);
+    file.Resize((int)ftell(fp));
+    fseek(fp,0,SEEK_SET);
+    if (fread(file.Get(),1,file.GetSize(),fp) != (size_t)file.GetSize()) file.Resize(0);
+    fclose(fp);
+  }
+  remove(fn);
+
+  const char *what=w64 ? "W64" : "WAV";
+  const WDL_INT64 datalen=(WDL_INT64)total*nch*3;
+  const int padlen=w64 ? (int)((8-(datalen&7))&7) : (int)(datalen&1);
+  const unsigned char *f=(const unsigned char *)file.Get();
+  char msg[256];
+#define RECCHECK(c,s) { snprintf(msg,sizeof(msg),"%s %dch %d frames: %s",what,nch,frames,s); check(c,msg); }
+
+  RECCHECK(wframes == total && !errors,"frames written");
+  RECCHECK(file.GetSize() == NJREC_DATA_OFFSET+datalen+padlen,"file size is header, audio and padding");
+  if (file.GetSize() != NJREC_DATA_OFFSET+datalen+padlen) return;
+
+  const unsigned char *fmt;
+  if (w64)
+  {
+    static const unsigned char riffg[16]={'r','i','f','f',0x2E,0x91,0xCF,0x11,0xA5,0xD6,0x28,0xDB,0x04,0xC1,0x00,0x00};
+    static const unsigned char waveg[16]={'w','a','v','e',0xF3,0xAC,0xD3,0x11,0x8C,0xD1,0x00,0xC0,0x4F,0x8E,0xDB,0x8A};
+    RECCHECK(!memcmp(f,riffg,16) && rd64(f+16) == file.GetSize() && !memcmp(f+24,waveg,16),"riff chunk covers the file");
+    // walk the chunks: each size includes its 24 byte header, chunks start 8-aligned
+    int offs=40;
+    WDL_INT64 datasize=-1;
+    fmt=NULL;
+    while (offs+24 <= file.GetSize())
+    {
+      const WDL_INT64 sz=rd64(f+offs+16);
+      if (sz < 24 || memcmp(f+offs+4,waveg+4,12)) break;
+      if (!memcmp(f+offs,"fmt ",4)) fmt=f+offs+24;
+      if (!memcmp(f+offs,"data",4)) { datasize=sz-24; RECCHECK(offs+24 == NJREC_DATA_OFFSET,"audio starts at NJREC_DATA_OFFSET"); break; }
+      offs+=(int)((sz+7)&~7);
+    }
+    RECCHECK(datasize == datalen,"data chunk size");
+  }
+  else
+  {
+    RECCHECK(!memcmp(f,"RIFF",4) && rd32(f+4) == (unsigned int)(file.GetSize()-8) && !memcmp(f+8,"WAVE",4),"RIFF chunk covers the file");
+    int offs=12;
+    WDL_INT64 datasize=-1;
+    fmt=NULL;
+    while (offs+8 <= file.GetSize())
+    {
+      const unsigned int sz=rd32(f+offs+4);
+      if (!memcmp(f+offs,"fmt ",4)) { fmt=f+offs+8; RECCHECK(sz == 40,"fmt chunk size"); }
+      if (!memcmp(f+offs,"data",4)) { datasize=sz; RECCHECK(offs+8 == NJREC_DATA_OFFSET,"audio starts at NJREC_DATA_OFFSET"); break; }
+      offs+=8+((sz+1)&~1);
+    }
+    RECCHECK(datasize == datalen,"data chunk size");
+  }
+
+  RECCHECK(fmt && (rd32(fmt)&0xffff) == 0xfffe && (rd32(fmt)>>16) == (unsigned int)nch && rd32(fmt+4) == (unsigned int)srate &&
+           rd32(fmt+8) == (unsigned int)(srate*nch*3) && (rd32(fmt+12)&0xffff) == (unsigned int)nch*3 && (rd32(fmt+12)>>16) == 24 &&
+           (rd32(fmt+16)&0xffff) == 22 && (rd32(fmt+16)>>16) == 24 && rd32(fmt+20) == (unsigned int)(nch == 1 ? 4 : nch == 2 ? 3 : 0) &&
+           fmt[24] == 1 && fmt[25] == 0,"WAVE_FORMAT_EXTENSIBLE 24-bit PCM");
+
+  // the audio, with silence where it was written
+  WDL_HeapBuf want;
+  unsigned char *w=(unsigned char *)want.Resize((int)datalen);
+  const int sbytes=silence_len*nch*3;
+  recFloatsToI24(a,w,silence_at*nch);
+  memset(w+silence_at*nch*3,0,sbytes);
+  recFloatsToI24(a+silence_at*nch,w+silence_at*nch*3+sbytes,(frames-silence_at)*nch);
+  RECCHECK(!memcmp(f+NJREC_DATA_OFFSET,w,(int)datalen),"audio is what was written");
+  bool padok=true;
+  for (int x = 0; x < padlen; x ++) if (f[NJREC_DATA_OFFSET+datalen+x]) padok=false;
+  RECCHECK(padok,"padding is zero");
+#undef RECCHECK
+
+  if (g_fails == fails0) printf("ok   %s, %d channels, %d frames + %d silent\n",what,nch,frames,silence_len);
+}
+
+int main(int argc, char **argv)
+{
+  const int iters=argc > 1 ? atoi(argv[1]) : 20000;
+  const bool full=argc > 2 && !strcmp(argv[2],"full");
+
+#ifdef NJCLIENT_MIX_SSE2
+  printf("SSE2 kernels\n");
+#else
+  printf("scalar kernels\n");
+#endif
+  testOutputStage(iters);
+  testMixClipped(iters);
+
+  testI24(full);
+  testRecFile(false,2,100003);
+  testRecFile(false,1,33335); // odd data size, pad byte
+  testRecFile(true,1,70001); // W64 pads to 8
+  testRecFile(true,2,65536);
+  testRecFile(true,3,1234);
+
+  printf("%s (%d failures)\n",g_fails ? "FAIL" : "OK",g_fails);
+  return g_fails ? 1 : 0;
+}
@@ -0,0 +1,180 @@
+/*
+    NINJAM - njtrace.h
+    Copyright (C) 2005-2017 Cockos Incorporated
+
+    NINJAM is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    NINJAM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NINJAM; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Audio thread trace ring. Set NJClient::AudioTrace to an NJTraceRing and
+  AudioProc() records timestamped spans into it: the whole callback,
+  process_samples(), each remote channel mixed in, decoder refills, lock
+  acquisitions and interval rollovers.
+
+  The ring is single producer (the audio thread) / single consumer (whoever
+  calls Read(), usually the UI or network thread). Add() never blocks or
+  allocates; if the reader falls behind, new events are dropped and counted.
+
+  Spans are recorded as a begin event (type) and an end event
+  (type|NJTRACE_END), properly nested. WriteToFile() drains the ring into a
+  file that the njtrace tool turns into histograms and deadline miss reports.
+
+*/
+
+#ifndef _NJTRACE_H_
+#define _NJTRACE_H_
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#include "../WDL/heapbuf.h"
+
+#ifdef _WIN32
+#define NJTRACE_BARRIER() MemoryBarrier()
+#else
+#define NJTRACE_BARRIER() __sync_synchronize()
+#endif
+
+enum
+{
+  NJTRACE_AUDIOPROC=1,    // a=length (samples), b=samplerate
+  NJTRACE_PROCESS_SAMPLES,// a=length, b=1 if only monitoring
+  NJTRACE_MIXIN,          // a=remote user index, b=channel index
+  NJTRACE_DECODE,         // decoder refill (nested in NJTRACE_MIXIN). end: a=bytes fed to the decoder
+  NJTRACE_LOCK,           // a=lock (NJClient_AudioLockStats::LOCK_*), the span is the wait
+  NJTRACE_INTERVAL,       // on_new_interval(), a=interval count
+
+  NJTRACE_NUM_TYPES,
+
+  NJTRACE_END=0x100, // or'd into the type of the event ending a span
+};
+
+struct NJTraceEvent
+{
+  double time; // seconds, NJTrace_GetTime()
+  int type;
+  int a, b;
+};
+
+#define NJTRACE_FILE_MAGIC "NJTR"
+#define NJTRACE_FILE_VERSION 1 // file: magic, version, sizeof(NJTraceEvent), then events (host byte order)
+
+
+static double NJTrace_GetTime() // seconds, monotonic where available
+{
+#ifdef _WIN32
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  return (double)now.QuadPart / (double)freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec*0.000000001;
+#else
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec + tv.tv_usec*0.000001;
+#endif
+}
+
+
+class NJTraceRing
+{
+public:
+  NJTraceRing(int size_log2=16)
+  {
+    if (size_log2 < 4) size_log2=4;
+    else if (size_log2 > 24) size_log2=24;
+    m_mask=(1u<<size_log2)-1;
+    m_buf.Resize(m_mask+1);
+    m_wrpos=m_rdpos=0;
+    m_dropped=0;
+  }
+  ~NJTraceRing() { }
+
+  // writer (audio thread) only
+  void Add(int type, int a=0, int b=0)
+  {
+    const unsigned int wr=m_wrpos;
+    if (wr - m_rdpos > m_mask)
+    {
+      m_dropped++;
+      return;
+    }
+    NJTraceEvent *ev=m_buf.Get()+(wr&m_mask);
+    ev->time=NJTrace_GetTime();
+    ev->type=type;
+    ev->a=a;
+    ev->b=b;
+    NJTRACE_BARRIER(); // event must be visible before the position that publishes it
+    m_wrpos=wr+1;
+  }
+
+  // reader only. returns the number of events copied to buf
+  int Read(NJTraceEvent *buf, int maxevents)
+  {
+    const unsigned int wr=m_wrpos;
+    NJTRACE_BARRIER();
+    unsigned int rd=m_rdpos;
+    int n=0;
+    while (rd != wr && n < maxevents)
+    {
+      buf[n++]=m_buf.Get()[rd&m_mask];
+      rd++;
+    }
+    NJTRACE_BARRIER(); // finish reading the slots before handing them back
+    m_rdpos=rd;
+    return n;
+  }
+
+  int GetDropped() { return m_dropped; } // events lost because the ring was full
+
+  static void WriteFileHeader(FILE *fp)
+  {
+    const int hdr[2]={NJTRACE_FILE_VERSION,(int)sizeof(NJTraceEvent)};
+    fwrite(NJTRACE_FILE_MAGIC,1,4,fp);
+    fwrite(hdr,1,sizeof(hdr),fp);
+  }
+
+  // reader only. drains the ring into fp (after WriteFileHeader()), returns the number of events written
+  int WriteToFile(FILE *fp)
+  {
+    NJTraceEvent tmp[256];
+    int tot=0, n;
+    while ((n=Read(tmp,256)) > 0)
+    {
+      fwrite(tmp,sizeof(NJTraceEvent),n,fp);
+      tot+=n;
+    }
+    return tot;
+  }
+
+private:
+  WDL_TypedBuf<NJTraceEvent> m_buf;
+  unsigned int m_mask;
+  volatile unsigned int m_wrpos, m_rdpos;
+  volatile int m_dropped;
+};
+
+#endif//_NJTRACE_H_
@@ -0,0 +1,356 @@
+/*
+    NINJAM audio trace reader - njtrace.cpp
+    Copyright (C) 2005-2017 Cockos Incorporated
+
+    NINJAM is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    NINJAM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NINJAM; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  njtrace reads a file written from an NJTraceRing (see ../njtrace.h, and
+  the -tracefile option of the clients) and prints:
+
+    - duration statistics and a log2 histogram for each kind of span
+    - per remote channel mix cost, and per lock wait
+    - deadline misses: AudioProc() calls that took longer than -deadline
+      times the buffer length, with what they spent their time on
+    - late callbacks: AudioProc() starting more than two buffer lengths
+      after the previous one (the audio thread was not scheduled in time)
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../njtrace.h"
+#include "../../WDL/ptrlist.h"
+#include "../../WDL/wdlcstring.h"
+
+
+#define NJTRACE_HIST_BUCKETS 24 // <1us .. >=4s
+#define NJTRACE_MAX_DEPTH 32
+
+static const char *g_type_names[NJTRACE_NUM_TYPES]={ "", "AudioProc", "process_samples", "mixInChannel", "decode", "lock", "interval" };
+static const char *g_lock_names[]={ "bufferqueue" }; // NJClient_AudioLockStats::LOCK_*
+#define NUM_LOCK_NAMES ((int)(sizeof(g_lock_names)/sizeof(g_lock_names[0])))
+
+
+class SpanStats
+{
+public:
+  SpanStats() { memset(m_hist,0,sizeof(m_hist)); }
+  ~SpanStats() { }
+
+  void Add(double dur)
+  {
+    m_vals.Add(dur);
+    int b=0;
+    double us=dur*1000000.0;
+    while (us >= 1.0 && b < NJTRACE_HIST_BUCKETS-1) { us*=0.5; b++; }
+    m_hist[b]++;
+  }
+  int GetSize() { return m_vals.GetSize(); }
+  double GetTotal()
+  {
+    double sum=0.0;
+    for (int x = 0; x < m_vals.GetSize(); x ++) sum+=m_vals.Get()[x];
+    return sum;
+  }
+
+  void PrintSummary(const char *name)
+  {
+    const int n=m_vals.GetSize();
+    if (!n) return;
+    double *v=m_vals.Get();
+    qsort(v,n,sizeof(double),cmpfunc);
+    printf("  %-20s n=%-9d mean %9.2fus  p50 %9.2fus  p99 %9.2fus  max %9.2fus\n",name,n,
+      GetTotal()*1000000.0/n,v[n/2]*1000000.0,v[(int)(n*0.99)]*1000000.0,v[n-1]*1000000.0);
+  }
+
+  void PrintHistogram()
+  {
+    int maxc=0, first=-1, last=-1;
+    for (int b = 0; b < NJTRACE_HIST_BUCKETS; b ++) if (m_hist[b])
+    {
+      if (m_hist[b] > maxc) maxc=m_hist[b];
+      if (first<0) first=b;
+      last=b;
+    }
+    for (int b = first; b >= 0 && b <= last; b ++)
+    {
+      char bar[64];
+      int l=maxc ? (int)((double)m_hist[b]*50.0/maxc + 0.5) : 0;
+      if (m_hist[b] && !l) l=1;
+      memset(bar,'#',l);
+      bar[l]=0;
+      char label[64];
+      if (!b) lstrcpyn_safe(label,"<1us",sizeof(label));
+      else snprintf(label,sizeof(label),"%.0f-%.0fus",(double)(1<<(b-1)),(double)(1<<b));
+      printf("    %18s %9d %s\n",label,m_hist[b],bar);
+    }
+  }
+
+private:
+  static int cmpfunc(const void *a, const void *b)
+  {
+    const double x=*(const double*)a, y=*(const double*)b;
+    return x<y ? -1 : x>y ? 1 : 0;
+  }
+  WDL_TypedBuf<double> m_vals;
+  int m_hist[NJTRACE_HIST_BUCKETS];
+};
+
+
+struct CallbackInfo
+{
+  double start, dur, budget;
+  double interval, decode, lockwait, worst_mix;
+  int worst_mix_user, worst_mix_ch, nmix, ndecode;
+};
+
+struct ChannelCost
+{
+  int user, ch, cnt;
+  double total, max;
+};
+
+
+static void usage()
+{
+  printf("Usage: njtrace tracefile [options]\n"
+         "Options:\n"
+         "  -deadline <fraction>  AudioProc time, as a fraction of the buffer length, that counts\n"
+         "                        as a miss (default: 1.0)\n"
+         "  -worst <n>            deadline misses to list (default: 20)\n"
+         "  -nohist               don't print histograms\n"
+         );
+  exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+  double deadline=1.0;
+  int nworst=20, nohist=0;
+
+  if (argc < 2) usage();
+  int p;
+  for (p = 2; p < argc; p ++)
+  {
+    if (!stricmp(argv[p],"-nohist")) { nohist=1; continue; }
+    if (p+1 >= argc) usage();
+    if (!stricmp(argv[p],"-deadline")) deadline=atof(argv[++p]);
+    else if (!stricmp(argv[p],"-worst")) nworst=atoi(argv[++p]);
+    else usage();
+  }
+  if (deadline <= 0.0 || nworst < 0) usage();
+
+  FILE *fp=fopen(argv[1],"rb");
+  if (!fp)
+  {
+    printf("Error opening %s\n",argv[1]);
+    return 1;
+  }
+  char magic[4];
+  int hdr[2];
+  if (fread(magic,1,4,fp) != 4 || memcmp(magic,NJTRACE_FILE_MAGIC,4) ||
+      fread(hdr,1,sizeof(hdr),fp) != sizeof(hdr) ||
+      hdr[0] != NJTRACE_FILE_VERSION || hdr[1] != (int)sizeof(NJTraceEvent))
+  {
+    printf("%s is not a trace file from this version/platform\n",argv[1]);
+    fclose(fp);
+    return 1;
+  }
+
+  WDL_TypedBuf<NJTraceEvent> events;
+  for (;;)
+  {
+    const int pos=events.GetSize();
+    NJTraceEvent *ev=events.ResizeOK(pos+4096,false);
+    if (!ev) break;
+    const int n=(int)fread(ev+pos,sizeof(NJTraceEvent),4096,fp);
+    events.Resize(pos+n,false);
+    if (n < 4096) break;
+  }
+  fclose(fp);
+
+  const int nevents=events.GetSize();
+  const NJTraceEvent *ev=events.Get();
+  printf("%s: %d events",argv[1],nevents);
+  if (nevents > 1) printf(", %.2f seconds",ev[nevents-1].time-ev[0].time);
+  printf("\n");
+
+  SpanStats type_stats[NJTRACE_NUM_TYPES];
+  SpanStats lock_stats[NUM_LOCK_NAMES];
+  SpanStats cb_gaps;
+  WDL_TypedBuf<CallbackInfo> callbacks;
+  WDL_TypedBuf<ChannelCost> chancost;
+
+  int stack[NJTRACE_MAX_DEPTH], depth=0, unmatched=0, late=0;
+  CallbackInfo *cur=NULL;
+  double last_cb_start=-1.0, last_budget=0.0;
+
+  for (int x = 0; x < nevents; x ++)
+  {
+    const NJTraceEvent *e=ev+x;
+    const int type=e->type&~NJTRACE_END;
+    if (type <= 0 || type >= NJTRACE_NUM_TYPES) { unmatched++; continue; }
+
+    if (!(e->type&NJTRACE_END))
+    {
+      if (type == NJTRACE_AUDIOPROC)
+      {
+        if (depth) unmatched+=depth; // events were dropped, start over
+        depth=0;
+
+        if (last_cb_start >= 0.0)
+        {
+          cb_gaps.Add(e->time-last_cb_start);
+          if (last_budget > 0.0 && e->time-last_cb_start > last_budget*2.0) late++;
+        }
+        last_cb_start=e->time;
+        last_budget=e->b > 0 ? (double)e->a/e->b : 0.0;
+
+        CallbackInfo *ci=callbacks.ResizeOK(callbacks.GetSize()+1);
+        cur=ci ? ci+callbacks.GetSize()-1 : NULL;
+        if (cur)
+        {
+          memset(cur,0,sizeof(*cur));
+          cur->start=e->time;
+          cur->budget=last_budget;
+          cur->worst_mix_user=cur->worst_mix_ch=-1;
+        }
+      }
+      if (depth < NJTRACE_MAX_DEPTH) stack[depth]=x;
+      depth++;
+      continue;
+    }
+
+    // end of span: find its begin
+    if (depth <= 0 || depth > NJTRACE_MAX_DEPTH || (ev[stack[depth-1]].type) != type)
+    {
+      unmatched++;
+      if (depth > 0) depth--;
+      continue;
+    }
+    const NJTraceEvent *b=ev+stack[--depth];
+    const double dur=e->time-b->time;
+    type_stats[type].Add(dur);
+
+    switch (type)
+    {
+      case NJTRACE_AUDIOPROC:
+        if (cur) cur->dur=dur;
+        cur=NULL;
+      break;
+      case NJTRACE_INTERVAL:
+        if (cur) cur->interval+=dur;
+      break;
+      case NJTRACE_DECODE:
+        if (cur) { cur->decode+=dur; cur->ndecode++; }
+      break;
+      case NJTRACE_LOCK:
+        if (b->a >= 0 && b->a < NUM_LOCK_NAMES) lock_stats[b->a].Add(dur);
+        if (cur) cur->lockwait+=dur;
+      break;
+      case NJTRACE_MIXIN:
+        if (cur)
+        {
+          cur->nmix++;
+          if (dur > cur->worst_mix)
+          {
+            cur->worst_mix=dur;
+            cur->worst_mix_user=b->a;
+            cur->worst_mix_ch=b->b;
+          }
+        }
+        {
+          int i;
+          ChannelCost *cc=chancost.Get();
+          for (i = 0; i < chancost.GetSize() && (cc[i].user != b->a || cc[i].ch != b->b); i ++);
+          if (i == chancost.GetSize())
+          {
+            cc=chancost.ResizeOK(i+1);
+            if (!cc) break;
+            memset(cc+i,0,sizeof(*cc));
+            cc[i].user=b->a;
+            cc[i].ch=b->b;
+          }
+          cc[i].cnt++;
+          cc[i].total+=dur;
+          if (dur > cc[i].max) cc[i].max=dur;
+        }
+      break;
+    }
+  }
+
+  printf("\nspans:\n");
+  for (int t = 1; t < NJTRACE_NUM_TYPES; t ++) type_stats[t].PrintSummary(g_type_names[t]);
+  if (unmatched) printf("  (%d events without a matching begin/end, from a full ring or a partial capture)\n",unmatched);
+
+  if (!nohist)
+  {
+    for (int t = 1; t < NJTRACE_NUM_TYPES; t ++) if (type_stats[t].GetSize())
+    {
+      printf("\n%s histogram:\n",g_type_names[t]);
+      type_stats[t].PrintHistogram();
+    }
+  }
+
+  printf("\nlock waits:\n");
+  for (int l = 0; l < NUM_LOCK_NAMES; l ++) lock_stats[l].PrintSummary(g_lock_names[l]);
+
+  if (chancost.GetSize())
+  {
+    printf("\nremote channels (user index/channel):\n");
+    for (int x = 0; x < chancost.GetSize(); x ++)
+    {
+      const ChannelCost *cc=chancost.Get()+x;
+      printf("  %3d/%-3d  n=%-9d mean %9.2fus  max %9.2fus  total %.3fs\n",cc->user,cc->ch,cc->cnt,
+        cc->total*1000000.0/cc->cnt,cc->max*1000000.0,cc->total);
+    }
+  }
+
+  printf("\ncallback spacing:\n");
+  cb_gaps.PrintSummary("start to start");
+  printf("  late callbacks (started more than 2 buffers after the previous one): %d\n",late);
+
+  // deadline misses, worst first
+  WDL_PtrList<CallbackInfo> misses;
+  for (int x = 0; x < callbacks.GetSize(); x ++)
+  {
+    CallbackInfo *ci=callbacks.Get()+x;
+    if (ci->budget > 0.0 && ci->dur > ci->budget*deadline)
+    {
+      int i;
+      for (i = 0; i < misses.GetSize() && misses.Get(i)->dur/misses.Get(i)->budget >= ci->dur/ci->budget; i ++);
+      misses.Insert(i,ci);
+    }
+  }
+  printf("\ndeadline misses (AudioProc > %.0f%% of buffer length): %d of %d callbacks\n",
+    deadline*100.0,misses.GetSize(),callbacks.GetSize());
+  for (int x = 0; x < misses.GetSize() && x < nworst; x ++)
+  {
+    const CallbackInfo *ci=misses.Get(x);
+    printf("  at %10.3fs: %8.0fus (%3.0f%%)  interval %6.0fus  decode %6.0fus (%d)  lockwait %6.0fus  mixes %d",
+      ci->start-ev[0].time,ci->dur*1000000.0,ci->dur*100.0/ci->budget,ci->interval*1000000.0,
+      ci->decode*1000000.0,ci->ndecode,ci->lockwait*1000000.0,ci->nmix);
+    if (ci->worst_mix_user >= 0) printf(", slowest %d/%d %.0fus",ci->worst_mix_user,ci->worst_mix_ch,ci->worst_mix*1000000.0);
+    printf("\n");
+  }
+
+  return 0;
+}
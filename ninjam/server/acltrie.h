@@ -0,0 +1,136 @@
+/*
+    NINJAM Server - acltrie.h
+    Copyright (C) 2005-2017 Cockos Incorporated
+
+    NINJAM is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    NINJAM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NINJAM; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Binary prefix trie for the server ACL. Keys are 128 bit (network byte order),
+  IPv4 addresses are stored IPv4-mapped (::ffff:a.b.c.d), so a.b.c.d/n is
+  prefix length 96+n.
+
+  Lookups cost at most one step per key bit, regardless of how many entries
+  there are. Entries keep the order in which they were added, and Get() returns
+  the earliest added entry that matches, so the config semantics of "first
+  matching ACL line wins" are preserved.
+
+*/
+
+#ifndef _ACLTRIE_H_
+#define _ACLTRIE_H_
+
+#include <string.h>
+#include "../../WDL/heapbuf.h"
+
+class ACL_Trie
+{
+public:
+  ACL_Trie() { Clear(); }
+  ~ACL_Trie() { }
+
+  void Clear()
+  {
+    m_nodes.Resize(1,false);
+    InitNode(m_nodes.Get());
+    m_cnt=0;
+  }
+
+  int GetSize() const { return m_cnt; } // number of distinct prefixes
+
+  // adds key/prefixlen, bits of key past prefixlen are ignored. if the prefix
+  // is already present the earlier definition is kept (it would match first).
+  void Add(const unsigned char *key, int prefixlen, int flags)
+  {
+    if (prefixlen < 0) prefixlen=0;
+    else if (prefixlen > 128) prefixlen=128;
+
+    int n=0;
+    for (int b = 0; b < prefixlen; b ++)
+    {
+      const int bit=GetBit(key,b);
+      int c=m_nodes.Get()[n].child[bit];
+      if (c < 0)
+      {
+        c=m_nodes.GetSize();
+        node *nn=m_nodes.ResizeOK(c+1,false);
+        if (!nn) return;
+        InitNode(nn+c);
+        nn[n].child[bit]=c;
+      }
+      n=c;
+    }
+    node *p=m_nodes.Get()+n;
+    if (p->order < 0)
+    {
+      p->order=m_cnt++;
+      p->flags=flags;
+    }
+  }
+
+  // returns flags of the first added entry containing key, or 0 if none.
+  // note this is first-match, not longest-prefix match: a /8 added before a /24
+  // inside it wins for addresses in the /24, as the ACL lines did before the trie.
+  int Get(const unsigned char *key) const
+  {
+    const node *nodes=m_nodes.Get();
+    int best_order=-1, best_flags=0;
+    int n=0, b=0;
+    for (;;)
+    {
+      const node *p=nodes+n;
+      if (p->order >= 0 && (best_order < 0 || p->order < best_order))
+      {
+        best_order=p->order;
+        best_flags=p->flags;
+      }
+      if (b >= 128) break;
+      n=p->child[GetBit(key,b++)];
+      if (n < 0) break;
+    }
+    return best_flags;
+  }
+
+  // true if both were built from the same entries in the same order
+  bool IsSame(const ACL_Trie *o) const
+  {
+    return m_cnt == o->m_cnt && m_nodes.GetSize() == o->m_nodes.GetSize() &&
+           !memcmp(m_nodes.Get(),o->m_nodes.Get(),m_nodes.GetSize()*sizeof(node));
+  }
+
+  static void MakeKeyV4(unsigned int addr, unsigned char *key) // addr is network byte order
+  {
+    memset(key,0,10);
+    key[10]=key[11]=0xff;
+    memcpy(key+12,&addr,4);
+  }
+
+private:
+  struct node
+  {
+    int child[2];
+    int order; // -1 if no entry ends here
+    int flags;
+  };
+
+  static void InitNode(node *p) { p->child[0]=p->child[1]=-1; p->order=-1; p->flags=0; }
+  static int GetBit(const unsigned char *key, int b) { return (key[b>>3] >> (7-(b&7)))&1; }
+
+  WDL_TypedBuf<node> m_nodes;
+  int m_cnt;
+};
+
+#endif // _ACLTRIE_H_
@@ -0,0 +1,226 @@
+/*
+  acltrie_test.cpp
+  checks ACL_Trie against a linear first-match scan of the same ACL lines (random IPv4 and IPv6
+  rules and addresses), that IPv4 rules match IPv4-mapped IPv6 addresses (::ffff:a.b.c.d, as a
+  dual stack listener sees them), that the earliest matching line wins over a longer prefix added
+  later, and IsSame()/Clear().
+
+  g++ -O2 -o acltrie_test acltrie_test.cpp
+  ./acltrie_test
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
+#include "acltrie.h"
+
+static unsigned int g_rs=1;
+static unsigned int rnd() { g_rs=g_rs*1664525+1013904223; return g_rs>>8; }
+
+static int g_fails;
+
+static void check(bool ok, const char *what)
+{
+  if (!ok) { g_fails++; printf("FAIL %s\n",what); }
+}
+
+static void v4key(const char *s, unsigned char *key)
+{
+  struct in_addr a;
+  if (inet_pton(AF_INET,s,&a) != 1) { printf("bad test address %s\n",s); exit(1); }
+  ACL_Trie::MakeKeyV4(a.s_addr,key);
+}
+
+static void v6key(const char *s, unsigned char *key)
+{
+  if (inet_pton(AF_INET6,s,key) != 1) { printf("bad test address %s\n",s); exit(1); }
+}
+
+// an ACL line as the config loader adds it: key and prefix length in the 128 bit key space
+struct rule
+{
+  unsigned char key[16];
+  int bits;
+  int flags;
+};
+
+static bool prefixMatch(const unsigned char *a, const unsigned char *b, int bits)
+{
+  int x;
+  for (x = 0; x < bits/8; x ++) if (a[x] != b[x]) return false;
+  if (bits&7)
+  {
+    const unsigned char m=(unsigned char)(0xff << (8-(bits&7)));
+    if ((a[x]&m) != (b[x]&m)) return false;
+  }
+  return true;
+}
+
+// what the ACL lines did before the trie: the first line that contains the address
+static int refGet(const rule *r, int n, const unsigned char *key)
+{
+  for (int x = 0; x < n; x ++) if (prefixMatch(r[x].key,key,r[x].bits)) return r[x].flags;
+  return 0;
+}
+
+// random key near one of a few bases, so that rules overlap and nest
+static void randKey(unsigned char *key, bool v4)
+{
+  static const char *v4base[]={ "10.0.0.0", "192.168.1.0", "172.16.0.0", "8.8.8.8" };
+  static const char *v6base[]={ "2001:db8::", "2001:db8:1::", "fe80::", "::1" };
+  if (v4) v4key(v4base[rnd()%4],key);
+  else v6key(v6base[rnd()%4],key);
+  // flip a few low bits
+  const int nflip=rnd()%4;
+  for (int x = 0; x < nflip; x ++)
+  {
+    const int b=v4 ? 96 + 16 + rnd()%16 : 32 + rnd()%96;
+    key[b>>3] ^= 1 << (7-(b&7));
+  }
+}
+
+static void testRandom()
+{
+  const int NR=64;
+  rule r[NR];
+  int iter, fails0=g_fails;
+  for (iter = 0; iter < 200; iter ++)
+  {
+    ACL_Trie t;
+    const int n=1 + rnd()%NR;
+    int x;
+    for (x = 0; x < n; x ++)
+    {
+      const bool v4=!(rnd()&1);
+      randKey(r[x].key,v4);
+      r[x].bits=v4 ? 96 + rnd()%33 : rnd()%129;
+      r[x].flags=1 + rnd()%3; // 0 is "no match"
+      t.Add(r[x].key,r[x].bits,r[x].flags);
+    }
+    for (x = 0; x < 500; x ++)
+    {
+      unsigned char key[16];
+      randKey(key,!(rnd()&1));
+      if (t.Get(key) != refGet(r,n,key))
+      {
+        if (g_fails++ < 10) printf("FAIL random: trie %d, linear scan %d (iteration %d)\n",t.Get(key),refGet(r,n,key),iter);
+      }
+    }
+  }
+  if (g_fails == fails0) printf("ok   200 random rule sets agree with a linear first-match scan\n");
+}
+
+static void testMapped()
+{
+  const int fails0=g_fails;
+  ACL_Trie t;
+  unsigned char k[16], k6[16];
+
+  v4key("192.168.1.0",k);
+  t.Add(k,96+24,2); // ACL 192.168.1.0/24 deny
+
+  v4key("192.168.1.77",k);
+  v6key("::ffff:192.168.1.77",k6);
+  check(!memcmp(k,k6,16),"MakeKeyV4() is the ::ffff: mapped form");
+  check(t.Get(k) == 2,"IPv4 address inside an IPv4 rule");
+  check(t.Get(k6) == 2,"IPv4-mapped IPv6 address inside an IPv4 rule");
+
+  v6key("::ffff:192.168.2.77",k6);
+  check(t.Get(k6) == 0,"IPv4-mapped address outside the rule");
+  v6key("::192.168.1.77",k6); // IPv4-compatible, not mapped
+  check(t.Get(k6) == 0,"IPv4-compatible (not mapped) address does not match an IPv4 rule");
+
+  v6key("2001:db8::",k);
+  t.Add(k,32,1); // ACL 2001:db8::/32 allow
+  v6key("2001:db8:ffff::1",k6);
+  check(t.Get(k6) == 1,"IPv6 address inside an IPv6 rule");
+  v6key("2001:db9::1",k6);
+  check(t.Get(k6) == 0,"IPv6 address outside every rule");
+
+  if (g_fails == fails0) printf("ok   IPv4 rules match ::ffff: mapped addresses\n");
+}
+
+static void testOrder()
+{
+  const int fails0=g_fails;
+  unsigned char k[16], a[16];
+  v4key("10.1.2.3",a);
+
+  ACL_Trie t;
+  v4key("10.0.0.0",k);
+  t.Add(k,96+8,1); // ACL 10.0.0.0/8 allow
+  v4key("10.1.2.0",k);
+  t.Add(k,96+24,2); // ACL 10.1.2.0/24 deny, never reached for 10.1.2.x
+  check(t.Get(a) == 1,"a /8 added before a /24 inside it wins");
+  check(t.GetSize() == 2,"two prefixes");
+
+  ACL_Trie t2;
+  v4key("10.1.2.0",k);
+  t2.Add(k,96+24,2);
+  v4key("10.0.0.0",k);
+  t2.Add(k,96+8,1);
+  check(t2.Get(a) == 2,"a /24 added before the /8 around it wins");
+  v4key("10.9.9.9",k);
+  check(t2.Get(k) == 1,"the /8 still matches outside the /24");
+
+  // a repeated prefix keeps its first definition
+  v4key("10.1.2.0",k);
+  t2.Add(k,96+24,3);
+  check(t2.Get(a) == 2 && t2.GetSize() == 2,"a repeated prefix keeps the first definition");
+
+  // bits past the prefix length are ignored
+  ACL_Trie t3;
+  v4key("10.1.2.99",k);
+  t3.Add(k,96+24,2);
+  check(t3.Get(a) == 2,"host bits past the prefix are ignored");
+
+  // /0 matches everything, including IPv6
+  ACL_Trie t4;
+  memset(k,0,16);
+  t4.Add(k,0,3);
+  v6key("2001:db8::1",k);
+  check(t4.Get(k) == 3 && t4.Get(a) == 3,"/0 matches every address");
+
+  if (g_fails == fails0) printf("ok   first matching line wins, repeats keep the first definition\n");
+}
+
+static void testSame()
+{
+  const int fails0=g_fails;
+  unsigned char k1[16], k2[16];
+  v4key("10.0.0.0",k1);
+  v6key("2001:db8::",k2);
+
+  ACL_Trie a, b, c;
+  a.Add(k1,104,1); a.Add(k2,32,2);
+  b.Add(k1,104,1); b.Add(k2,32,2);
+  c.Add(k2,32,2); c.Add(k1,104,1);
+  check(a.IsSame(&b),"same lines in the same order are the same");
+  check(!a.IsSame(&c),"same lines in another order are not the same");
+  b.Add(k1,96,1);
+  check(!a.IsSame(&b),"an extra line is not the same");
+
+  b.Clear();
+  check(b.GetSize() == 0 && b.Get(k1) == 0,"Clear() empties the trie");
+  ACL_Trie e;
+  check(b.IsSame(&e),"a cleared trie is the same as a new one");
+
+  if (g_fails == fails0) printf("ok   IsSame() and Clear()\n");
+}
+
+int main()
+{
+  testMapped();
+  testOrder();
+  testSame();
+  testRandom();
+
+  printf("%s (%d failures)\n",g_fails ? "FAIL" : "OK",g_fails);
+  return g_fails ? 1 : 0;
+}
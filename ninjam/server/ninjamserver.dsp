@@ -183,6 +183,10 @@ SOURCE=.\projectmode.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\relay.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\usercon.cpp
 # End Source File
 # End Group
@@ -239,6 +243,10 @@ SOURCE=.\projectmode.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\relay.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\usercon.h
 # End Source File
 # End Group
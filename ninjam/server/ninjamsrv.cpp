@@ -24,6 +24,13 @@
   includes a User_Connection class (manages a user) and a User_Group class 
   (manages a jam).
 
+  One process can host any number of rooms (a User_Group each). Rooms are
+  reached by port (Room <name> <port>) or by logging in as "room/username"
+  on any port. Rooms are spread over worker threads; the main thread owns
+  the listeners, the console, config reloads and moves between rooms, and
+  takes every worker's lock whenever it changes the set of rooms or their
+  settings.
+
 */
 
 
@@ -31,10 +38,14 @@
 #ifdef _WIN32
 #include <windows.h>
 #include <conio.h>
+#include <process.h>
 #else
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #endif
 #include <signal.h>
 #include <stdarg.h>
@@ -44,6 +55,9 @@
 #include "../netmsg.h"
 #include "../mpb.h"
 #include "usercon.h"
+#include "relay.h"
+#include "acltrie.h"
+#include "userdb.h"
 
 #include "../../WDL/rng.h"
 #include "../../WDL/sha.h"
@@ -51,72 +65,181 @@
 #include "../../WDL/ptrlist.h"
 #include "../../WDL/wdlstring.h"
 #include "../../WDL/wdlcstring.h"
+#include "../../WDL/mutex.h"
 
 #define VERSION "v0.071"
 
 const char *startupmessage="NINJAM Server " VERSION " built on " __DATE__ " at " __TIME__ " starting up...\n" "Copyright (C) 2005-2017, Cockos, Inc.\n";
 
 int g_set_uid=-1;
-int g_default_bpm,g_default_bpi;
 FILE *g_logfp;
+WDL_Mutex g_log_mutex;
 WDL_String g_pidfilename;
 WDL_String g_logfilename;
-WDL_String g_status_pass,g_status_user;
-User_Group *m_group;
-JNL_Listen *m_listener;
+WDL_String g_status_user;
+unsigned char g_status_passhash[WDL_SHA1SIZE]; // SHA1(user:pass)
 void onConfigChange(int argc, char **argv);
 void logText(const char *s, ...);
+static IUserInfoLookup *myCreateUserLookup(char *username);
+
 
-class UserPassEntry
+class ServerRoom
 {
 public:
-  UserPassEntry() {priv_flag=0;} 
-  ~UserPassEntry() {} 
-  WDL_String name, pass;
-  unsigned int priv_flag;
+  ServerRoom(const char *name) : m_name(name)
+  {
+    m_port=0;
+    m_worker=-1;
+    m_default_bpm=120;
+    m_default_bpi=8;
+    m_in_config=true;
+    m_is_new=true;
+    m_next_session_update_time=0;
+    m_stat_users=0;
+
+    m_group=new User_Group;
+    m_group->CreateUserLookup=myCreateUserLookup;
+  }
+  ~ServerRoom() { delete m_group; }
+
+  const char *GetDisplayName() { return m_name.Get()[0] ? m_name.Get() : "(default)"; }
+
+  WDL_String m_name; // empty for the default room
+  int m_port; // 0 if only reachable by name
+  User_Group *m_group;
+  int m_worker;
+
+  int m_default_bpm, m_default_bpi;
+  WDL_String m_license;
+  WDL_String m_relay_host, m_relay_user, m_relay_pass; // RelayOrigin, if set the room is an edge of that server
+  WDL_String m_relay_applied; // host/user/pass the running User_Relay was created with
+  bool m_in_config; // seen in the last config read
+  bool m_is_new;
+
+  time_t m_next_session_update_time; // owned by the worker
+  volatile int m_stat_users; // authorized users, updated by the worker
 };
 
+class ServerWorker
+{
+public:
+  ServerWorker() { m_wantlock=0; }
+  ~ServerWorker() { }
 
-#define ACL_FLAG_DENY 1
-#define ACL_FLAG_RESERVE 2
-typedef struct
+  WDL_Mutex m_mutex; // held by the worker while it runs its rooms
+  WDL_PtrList<ServerRoom> m_rooms;
+  volatile int m_wantlock; // main thread is waiting on m_mutex
+#ifdef _WIN32
+  HANDLE m_thread;
+#else
+  pthread_t m_thread;
+#endif
+};
+
+class ServerListener
+{
+public:
+  ServerListener(int port, bool ipv6, JNL_Listen *l) { m_port=port; m_ipv6=ipv6; m_listen=l; }
+  ~ServerListener() { delete m_listen; }
+  int m_port;
+  bool m_ipv6; // g_config_listen_ipv6 when it was created
+  JNL_Listen *m_listen;
+};
+
+struct ServerMove
 {
-  unsigned int addr;
-  unsigned int mask;
-  int flags;
-} ACLEntry;
+  User_Connection *con;
+  User_Group *to;
+};
 
+// g_rooms.Get(0) is the default room. only the main thread changes
+// g_rooms, and only while it holds every worker's mutex
+WDL_PtrList<ServerRoom> g_rooms;
+ServerRoom *g_cur_room; // room that room-level config lines apply to
+WDL_PtrList<ServerWorker> g_workers;
+WDL_PtrList<ServerListener> g_listeners;
+int g_config_workers;
+bool g_workers_running; // worker threads are started as soon as they are added
 
-WDL_HeapBuf g_acllist;
-void aclAdd(unsigned int addr, unsigned int mask, int flags)
+WDL_Mutex g_moves_mutex;
+WDL_TypedBuf<ServerMove> g_moves; // connections on their way to another room
+
+static void lockWorker(ServerWorker *w)
 {
-  addr=ntohl(addr);
-//  printf("adding acl entry for %08x + %08x\n",addr,mask);
-  ACLEntry f={addr,mask,flags};
-  int os=g_acllist.GetSize();
-  g_acllist.Resize(os+sizeof(f));
-  memcpy((char *)g_acllist.Get()+os,&f,sizeof(f));
+  w->m_wantlock++;
+  w->m_mutex.Enter();
+  w->m_wantlock--;
 }
 
-int aclGet(unsigned int addr)
+static void stopWorkers()
 {
-  addr=ntohl(addr);
+  int x;
+  for (x = 0; x < g_workers.GetSize(); x ++) lockWorker(g_workers.Get(x));
+}
+
+static void resumeWorkers()
+{
+  int x;
+  for (x = g_workers.GetSize()-1; x >= 0; x --) g_workers.Get(x)->m_mutex.Leave();
+}
 
-  ACLEntry *p=(ACLEntry *)g_acllist.Get();
-  int x=g_acllist.GetSize()/sizeof(ACLEntry);
-  while (x--)
+static ServerRoom *findRoom(const char *name)
+{
+  int x;
+  for (x = 0; x < g_rooms.GetSize(); x ++)
   {
-  //  printf("comparing %08x to %08x\n",addr,p->addr);
-    if ((addr & p->mask) == p->addr) return p->flags;
-    p++;
+    ServerRoom *r=g_rooms.Get(x);
+    if (!stricmp(r->m_name.Get(),name)) return r;
   }
-  return 0;
+  return NULL;
+}
+
+static ServerRoom *findRoomByPort(int port)
+{
+  int x;
+  for (x = 0; x < g_rooms.GetSize(); x ++)
+    if (g_rooms.Get(x)->m_port == port) return g_rooms.Get(x);
+  return g_rooms.Get(0);
+}
+
+static struct tm *getLocalTime(const time_t *t, struct tm *buf)
+{
+#ifdef _WIN32
+  if (localtime_s(buf,t)) memset(buf,0,sizeof(*buf));
+#else
+  if (!localtime_r(t,buf)) memset(buf,0,sizeof(*buf));
+#endif
+  return buf;
+}
+
+#define ACL_FLAG_DENY 1
+#define ACL_FLAG_RESERVE 2
+
+// the user database and ACL are built by a config load (see ServerConfigLoad)
+// and only replaced while every worker is stopped
+ACL_Trie *g_acl;
+UserDatabase *g_users;
+
+int aclGet(JNL_IConnection *con)
+{
+  unsigned char key[16];
+  struct sockaddr_storage sa;
+  if (!con->get_remote_addr(&sa)) return 0;
+
+  if (sa.ss_family == AF_INET6)
+    memcpy(key,((struct sockaddr_in6 *)&sa)->sin6_addr.s6_addr,16);
+  else if (sa.ss_family == AF_INET)
+    ACL_Trie::MakeKeyV4(((struct sockaddr_in *)&sa)->sin_addr.s_addr,key);
+  else
+    return 0;
+
+  return g_acl ? g_acl->Get(key) : 0;
 }
 
 
-WDL_PtrList<UserPassEntry> g_userlist;
 int g_config_allow_anonchat;
 int g_config_port;
+bool g_config_listen_ipv6;
 bool g_config_allowanonymous;
 bool g_config_allowanonymous_multi;
 bool g_config_anonymous_mask_ip;
@@ -125,16 +248,13 @@ int g_config_maxch_user;
 WDL_String g_config_logpath;
 int g_config_log_sessionlen;
 
-time_t next_session_update_time;
-
-WDL_String g_config_license;
-
 class localUserInfoLookup : public IUserInfoLookup
 {
 public:
   localUserInfoLookup(char *name)
   {
     username.Set(name);
+    m_done=false;
   }
   ~localUserInfoLookup()
   {
@@ -142,10 +262,28 @@ public:
 
   int Run()
   {
+    // a connection moved to another room runs the lookup again there
+    if (m_done) return 1;
+    m_done=true;
+
     // perform lookup here
 
     user_valid=0;
 
+    // "room/username" logs in to a room by name
+    const char *sep=strchr(username.Get(),'/');
+    if (sep)
+    {
+      WDL_String name;
+      name.Set(username.Get(),(int)(sep-username.Get()));
+      ServerRoom *room=findRoom(name.Get());
+      if (room)
+      {
+        username.Set(sep+1);
+        group=room->m_group;
+      }
+    }
+
     if (!strncmp(username.Get(),"anonymous",9) && (!username.Get()[9] || username.Get()[9] == ':'))
     {
       logText("got anonymous request (%s)\n",g_config_allowanonymous?"allowing":"denying");
@@ -156,7 +294,7 @@ public:
 
       WDL_String tmp(username.Get());
 
-      if (tmp.Get()[9] == ':' && tmp.Get()[10])
+      if (tmp.GetLength() > 10 && tmp.Get()[9] == ':')
       {
         username.Set(tmp.Get()+10);
 
@@ -188,6 +326,24 @@ public:
           p[1]='x';
           p[2]=0;
         }
+        else if (*p == '@' && strstr(p,":"))
+        {
+          // IPv6, keep the first 64 bits (or up to the first ::)
+          int cnt=4;
+          while (*++p)
+          {
+            if (*p == ':' && (!--cnt || p[1] == ':'))
+            {
+              if (p[1] == ':') p++;
+              if (p[1])
+              {
+                p[1]='x';
+                p[2]=0;
+              }
+              break;
+            }
+          }
+        }
       }
 
       privs=(g_config_allow_anonchat?PRIV_CHATSEND:0) | (g_config_allowanonymous_multi?PRIV_ALLOWMULTI:0) | PRIV_VOTE;
@@ -195,8 +351,8 @@ public:
     }
     else
     {
-      int x;
       logText("got login request for '%s'\n",username.Get());
+      UserPassEntry *e;
       if (g_status_user.Get()[0] && !strcmp(username.Get(),g_status_user.Get()))
       {
         user_valid=1;
@@ -204,39 +360,22 @@ public:
         is_status=1;
         privs=0; 
         max_channels=0;
-
-        WDL_SHA1 shatmp;
-        shatmp.add(username.Get(),strlen(username.Get()));
-        shatmp.add(":",1);
-        shatmp.add(g_status_pass.Get(),strlen(g_status_pass.Get()));
-
-        shatmp.result(sha1buf_user);
+        memcpy(sha1buf_user,g_status_passhash,sizeof(sha1buf_user));
       }
-      else for (x = 0; x < g_userlist.GetSize(); x ++)
+      else if (g_users && (e=g_users->Find(username.Get())))
       {
-        if (!strcmp(username.Get(),g_userlist.Get(x)->name.Get()))
-        {
-          user_valid=1;
-          reqpass=1;
-
-          char *pass=g_userlist.Get(x)->pass.Get();
-          WDL_SHA1 shatmp;
-          shatmp.add(username.Get(),strlen(username.Get()));
-          shatmp.add(":",1);
-          shatmp.add(pass,strlen(pass));
-
-          shatmp.result(sha1buf_user);
-
-          privs=g_userlist.Get(x)->priv_flag; 
-          max_channels=g_config_maxch_user;
-          break;
-        }
+        user_valid=1;
+        reqpass=1;
+        memcpy(sha1buf_user,e->passhash,sizeof(sha1buf_user));
+        privs=e->priv_flag; 
+        max_channels=g_config_maxch_user;
       }
     }
 
     return 1;
   }
 
+  bool m_done;
 };
 
 
@@ -245,6 +384,20 @@ static IUserInfoLookup *myCreateUserLookup(char *username)
   return new localUserInfoLookup(username);
 }
 
+// room names are also archive directory names (see updateSessionArchive), so
+// only letters, digits, '-', '_' and non-leading '.' are allowed
+static bool isValidRoomName(const char *name)
+{
+  if (!*name || *name == '.' || strlen(name) > 64) return false;
+  for (; *name; name ++)
+  {
+    const char c=*name;
+    if (!(c >= 'a' && c <= 'z') && !(c >= 'A' && c <= 'Z') && !(c >= '0' && c <= '9') &&
+        c != '-' && c != '_' && c != '.') return false;
+  }
+  return true;
+}
+
 static int ConfigOnToken(LineParser *lp)
 {
   const char *t=lp->gettoken_str(0);
@@ -255,17 +408,59 @@ static int ConfigOnToken(LineParser *lp)
     if (!p) return -2;
     g_config_port=p;
   }
+  else if (!stricmp(t,"Room"))
+  {
+    if (lp->getnumtokens() != 2 && lp->getnumtokens() != 3) return -1;
+    const char *name=lp->gettoken_str(1);
+    if (!isValidRoomName(name)) return -2;
+    int p=lp->getnumtokens()>2 ? lp->gettoken_int(2) : 0;
+    if (p < 0) return -2;
+
+    ServerRoom *room=findRoom(name);
+    if (!room) g_rooms.Add(room=new ServerRoom(name));
+    else if (room->m_in_config) return -2; // listed twice
+
+    room->m_in_config=true;
+    room->m_port=p;
+    room->m_default_bpi=8;
+    room->m_default_bpm=120;
+    room->m_group->m_max_users=0;
+    room->m_license.Set("");
+    room->m_relay_host.Set("");
+    g_cur_room=room;
+  }
+  else if (!stricmp(t,"RelayOrigin"))
+  {
+    if (lp->getnumtokens() != 4) return -1;
+    if (!*lp->gettoken_str(1)) return -2;
+    g_cur_room->m_relay_host.Set(lp->gettoken_str(1));
+    g_cur_room->m_relay_user.Set(lp->gettoken_str(2));
+    g_cur_room->m_relay_pass.Set(lp->gettoken_str(3));
+  }
+  else if (!stricmp(t,"WorkerThreads"))
+  {
+    if (lp->getnumtokens() != 2) return -1;
+    int p=lp->gettoken_int(1);
+    if (p < 0) return -2;
+    g_config_workers=p;
+  }
   else if (!stricmp(t,"StatusUserPass"))
   {
     if (lp->getnumtokens() != 3) return -1;
-    g_status_user.Set(lp->gettoken_str(1));
-    g_status_pass.Set(lp->gettoken_str(2));
+    const char *user=lp->gettoken_str(1), *pass=lp->gettoken_str(2);
+    g_status_user.Set(user);
+
+    WDL_SHA1 shatmp;
+    shatmp.add(user,strlen(user));
+    shatmp.add(":",1);
+    shatmp.add(pass,strlen(pass));
+    shatmp.result(g_status_passhash);
   }
   else if (!stricmp(t,"MaxUsers"))
   {
     if (lp->getnumtokens() != 2) return -1;
     int p=lp->gettoken_int(1);
-    m_group->m_max_users=p;
+    g_cur_room->m_group->m_max_users=p;
   }  
   else if (!stricmp(t,"PIDFile"))
   {
@@ -291,22 +486,22 @@ static int ConfigOnToken(LineParser *lp)
   else if (!stricmp(t,"DefaultBPI"))
   {
     if (lp->getnumtokens() != 2) return -1;
-    g_default_bpi=lp->gettoken_int(1);
-    if (g_default_bpi<MIN_BPI) g_default_bpi=MIN_BPI;
-    else if (g_default_bpi > MAX_BPI) g_default_bpi=MAX_BPI;
+    g_cur_room->m_default_bpi=lp->gettoken_int(1);
+    if (g_cur_room->m_default_bpi<MIN_BPI) g_cur_room->m_default_bpi=MIN_BPI;
+    else if (g_cur_room->m_default_bpi > MAX_BPI) g_cur_room->m_default_bpi=MAX_BPI;
   }
   else if (!stricmp(t,"DefaultBPM"))
   {
     if (lp->getnumtokens() != 2) return -1;
-    g_default_bpm=lp->gettoken_int(1);
-    if (g_default_bpm<MIN_BPM) g_default_bpm=MIN_BPM;
-    else if (g_default_bpm > MAX_BPM) g_default_bpm=MAX_BPM;
+    g_cur_room->m_default_bpm=lp->gettoken_int(1);
+    if (g_cur_room->m_default_bpm<MIN_BPM) g_cur_room->m_default_bpm=MIN_BPM;
+    else if (g_cur_room->m_default_bpm > MAX_BPM) g_cur_room->m_default_bpm=MAX_BPM;
   }
   else if (!stricmp(t,"DefaultTopic"))
   {
     if (lp->getnumtokens() != 2) return -1;
-    if (!m_group->m_topictext.Get()[0])
-      m_group->m_topictext.Set(lp->gettoken_str(1));    
+    if (!g_cur_room->m_group->m_topictext.Get()[0])
+      g_cur_room->m_group->m_topictext.Set(lp->gettoken_str(1));    
   }
   else if (!stricmp(t,"MaxChannels"))
   {
@@ -318,19 +513,19 @@ static int ConfigOnToken(LineParser *lp)
   else if (!stricmp(t,"SetKeepAlive"))
   {
     if (lp->getnumtokens() != 2) return -1;
-    m_group->m_keepalive=lp->gettoken_int(1);
-    if (m_group->m_keepalive < 0 || m_group->m_keepalive > 255)
-      m_group->m_keepalive=0;
+    g_cur_room->m_group->m_keepalive=lp->gettoken_int(1);
+    if (g_cur_room->m_group->m_keepalive < 0 || g_cur_room->m_group->m_keepalive > 255)
+      g_cur_room->m_group->m_keepalive=0;
   }
   else if (!stricmp(t,"SetVotingThreshold"))
   {
     if (lp->getnumtokens() != 2) return -1;
-    m_group->m_voting_threshold=lp->gettoken_int(1);
+    g_cur_room->m_group->m_voting_threshold=lp->gettoken_int(1);
   }
   else if (!stricmp(t,"SetVotingVoteTimeout"))
   {
     if (lp->getnumtokens() != 2) return -1;
-    m_group->m_voting_timeout=lp->gettoken_int(1);
+    g_cur_room->m_group->m_voting_timeout=lp->gettoken_int(1);
   }
   else if (!stricmp(t,"ServerLicense"))
   {
@@ -343,7 +538,7 @@ static int ConfigOnToken(LineParser *lp)
         logText("Error opening license file %s\n",lp->gettoken_str(1));
       return -2;
     }
-    g_config_license.Set("");
+    g_cur_room->m_license.Set("");
     for (;;)
     {
       char buf[1024];
@@ -351,82 +546,22 @@ static int ConfigOnToken(LineParser *lp)
       fgets(buf,sizeof(buf),fp);
       if (!buf[0]) break;
       WDL_remove_trailing_crlf(buf);
-      g_config_license.Append(buf);
-      g_config_license.Append("\n");
+      g_cur_room->m_license.Append(buf);
+      g_cur_room->m_license.Append("\n");
     }
 
     fclose(fp);
     
   }
-  else if (!stricmp(t,"ACL"))
+  else if (!stricmp(t,"ListenIPv6"))
   {
-    if (lp->getnumtokens() != 3) return -1;
-    int suc=0;
-    const char *v=lp->gettoken_str(1);
-    char buf[256];
-    int vlen = strlen(v)+1;
-    memcpy(buf,v,vlen < sizeof(buf) ? vlen : sizeof(buf));
-    buf[sizeof(buf)-1]=0;
-    char *t=strstr(buf,"/");
-    if (t)
-    {
-      *t++=0;
-      unsigned int addr=JNL::ipstr_to_addr(buf);
-      if (addr != INADDR_NONE)
-      {
-        int maskbits=atoi(t);
-        if (maskbits >= 0 && maskbits <= 32)
-        {
-          int flag=lp->gettoken_enum(2,"allow\0deny\0reserve\0");
-          if (flag >= 0)
-          {
-            suc=1;
-            unsigned int mask=~(0xffffffff>>maskbits);
-            aclAdd(addr,mask,flag);
-          }
-        }
-      }
-    }
-
-    if (!suc)
+    if (lp->getnumtokens() != 2) return -1;
+    int x=lp->gettoken_enum(1,"no\0yes\0");
+    if (x <0)
     {
-      if (g_logfp)
-        logText("Usage: ACL xx.xx.xx.xx/X [ban|allow|reserve]\n");
-      printf("Usage: ACL xx.xx.xx.xx/X [ban|allow|reserve]\n");
       return -2;
     }
-  }
-  else if (!stricmp(t,"User"))
-  {
-    if (lp->getnumtokens() != 3 && lp->getnumtokens() != 4) return -1;
-    UserPassEntry *p=new UserPassEntry;
-    p->name.Set(lp->gettoken_str(1));
-    p->pass.Set(lp->gettoken_str(2));
-    if (lp->getnumtokens()>3)
-    {
-      const char *ptr=lp->gettoken_str(3);
-      while (*ptr)
-      {
-        if (*ptr == '*') p->priv_flag|=~PRIV_HIDDEN; // everything but hidden if * used
-        else if (*ptr == 'T' || *ptr == 't') p->priv_flag |= PRIV_TOPIC;
-        else if (*ptr == 'B' || *ptr == 'b') p->priv_flag |= PRIV_BPM;
-        else if (*ptr == 'C' || *ptr == 'c') p->priv_flag |= PRIV_CHATSEND;
-        else if (*ptr == 'K' || *ptr == 'k') p->priv_flag |= PRIV_KICK;        
-        else if (*ptr == 'R' || *ptr == 'r') p->priv_flag |= PRIV_RESERVE;        
-        else if (*ptr == 'M' || *ptr == 'm') p->priv_flag |= PRIV_ALLOWMULTI;
-        else if (*ptr == 'H' || *ptr == 'h') p->priv_flag |= PRIV_HIDDEN;       
-        else if (*ptr == 'V' || *ptr == 'v') p->priv_flag |= PRIV_VOTE;               
-        else 
-        {
-          if (g_logfp)
-            logText("Warning: Unknown user priviledge flag '%c'\n",*ptr);
-          printf("Warning: Unknown user priviledge flag '%c'\n",*ptr);
-        }
-        ptr++;
-      }
-    }
-    else p->priv_flag=PRIV_CHATSEND|PRIV_VOTE;// default privs
-    g_userlist.Add(p);
+    g_config_listen_ipv6=!!x;
   }
   else if (!stricmp(t,"AllowHiddenUsers"))
   {
@@ -437,7 +572,7 @@ static int ConfigOnToken(LineParser *lp)
     {
       return -2;
     }
-    m_group->m_allow_hidden_users=!!x;
+    g_cur_room->m_group->m_allow_hidden_users=!!x;
   }
   else if (!stricmp(t,"AnonymousUsers"))
   {
@@ -490,41 +625,183 @@ static int ConfigOnToken(LineParser *lp)
 };
 
 
-static int ReadConfig(char *configfile)
+static void configWarning(const char *fmt, ...)
 {
-  int linecnt=0;
-  WDL_String linebuild;
-  if (g_logfp) logText("[config] reloading configuration file\n");
-  FILE *fp=strcmp(configfile,"-")?fopen(configfile,"rt"):stdin; 
-  if (!fp)
+  char buf[1024];
+  va_list ap;
+  va_start(ap,fmt);
+  vsnprintf(buf,sizeof(buf),fmt,ap);
+  va_end(ap);
+  buf[sizeof(buf)-1]=0;
+
+  if (g_logfp) logText("%s",buf);
+  printf("%s",buf);
+}
+
+static void configTokenWarning(int err, LineParser *lp, int linecnt, const char *configfile)
+{
+  if (err == -1)
+    configWarning("[config] warning: wrong number of tokens on line %d of %s\n",linecnt,configfile);
+  else if (err == -2)
+    configWarning("[config] warning: invalid parameter on line %d of %s\n",linecnt,configfile);
+  else if (err == -3)
+    configWarning("[config] warning: invalid config command \"%s\" on line %d of %s\n",lp->gettoken_str(0),linecnt,configfile);
+}
+
+
+/*
+  A config (re)load happens in two steps. Load() reads and parses the file and
+  builds the user database and ACL, which is the bulk of the work for large
+  configs (every account gets its SHA1(user:pass) computed once, here); on
+  reload it runs on a thread of its own while the rooms keep running. The
+  rest of the lines are kept, and ApplyConfig() replays them and swaps the
+  new database and ACL in, with the workers stopped.
+*/
+class ServerConfigLine
+{
+public:
+  ServerConfigLine(int line, const char *text) : m_text(text) { m_line=line; }
+  ~ServerConfigLine() { }
+  int m_line;
+  WDL_String m_text;
+};
+
+class ServerConfigLoad
+{
+public:
+  ServerConfigLoad(const char *configfile) : m_fn(configfile)
   {
-    printf("[config] error opening configfile '%s'\n",configfile);
-    if (g_logfp) logText("[config] error opening config file (console request)\n");
-    return -1;
+    m_users=new UserDatabase;
+    m_acl=new ACL_Trie;
+    m_error=0;
+    m_done=0;
+  }
+  ~ServerConfigLoad()
+  {
+    m_lines.Empty(true);
+    delete m_users; // after ApplyConfig(), the ones that were replaced
+    delete m_acl;
   }
 
-  // clear user list, etc
-  g_config_port=2049;
-  g_config_allow_anonchat=1;
-  g_config_allowanonymous=0;
-  g_config_allowanonymous_multi=0;
-  g_config_anonymous_mask_ip=0;
-  g_config_maxch_anon=2;
-  g_config_maxch_user=32;
-  g_default_bpi=8;
-  g_default_bpm=120;
+  int Load(); // returns nonzero if the file couldn't be opened
 
-  g_config_log_sessionlen=10; // ten minute default, tho the user will need to specify the path anyway
+  void StartThread();
+  void WaitThread();
 
-  m_group->m_max_users=0; // unlimited users
-  g_acllist.Resize(0);
-  g_config_license.Set("");
-  int x;
-  for(x=0;x<g_userlist.GetSize(); x++)
+  WDL_String m_fn;
+  WDL_PtrList<ServerConfigLine> m_lines; // everything but User and ACL
+  UserDatabase *m_users;
+  ACL_Trie *m_acl;
+  int m_error;
+  volatile int m_done; // set by the load thread when finished
+
+private:
+  int OnToken(LineParser *lp, int linecnt);
+
+#ifdef _WIN32
+  static unsigned WINAPI threadProc(void *p);
+  HANDLE m_thread;
+#else
+  static void *threadProc(void *p);
+  pthread_t m_thread;
+#endif
+};
+
+int ServerConfigLoad::OnToken(LineParser *lp, int linecnt)
+{
+  const char *t=lp->gettoken_str(0);
+  if (!stricmp(t,"ACL"))
   {
-    delete g_userlist.Get(x);
+    if (lp->getnumtokens() != 3) return -1;
+    int suc=0;
+    const char *v=lp->gettoken_str(1);
+    char buf[256];
+    lstrcpyn_safe(buf,v,sizeof(buf));
+    char *t=strstr(buf,"/");
+    if (t)
+    {
+      *t++=0;
+      struct sockaddr_storage sa;
+      if (JNL::ipstr_to_sockaddr(buf,&sa))
+      {
+        unsigned char key[16];
+        int maskbits=atoi(t), maxbits=128;
+        if (sa.ss_family == AF_INET6)
+        {
+          memcpy(key,((struct sockaddr_in6 *)&sa)->sin6_addr.s6_addr,16);
+        }
+        else
+        {
+          ACL_Trie::MakeKeyV4(((struct sockaddr_in *)&sa)->sin_addr.s_addr,key);
+          maxbits=32;
+        }
+        if (maskbits >= 0 && maskbits <= maxbits)
+        {
+          int flag=lp->gettoken_enum(2,"allow\0deny\0reserve\0");
+          if (flag >= 0)
+          {
+            suc=1;
+            m_acl->Add(key,maskbits + 128-maxbits,flag);
+          }
+        }
+      }
+    }
+
+    if (!suc)
+    {
+      configWarning("Usage: ACL xx.xx.xx.xx/X|xxxx:xxxx::/X [ban|allow|reserve]\n");
+      return -2;
+    }
+  }
+  else if (!stricmp(t,"User"))
+  {
+    if (lp->getnumtokens() != 3 && lp->getnumtokens() != 4) return -1;
+    unsigned int priv_flag=0;
+    if (lp->getnumtokens()>3)
+    {
+      const char *ptr=lp->gettoken_str(3);
+      while (*ptr)
+      {
+        if (*ptr == '*') priv_flag|=~(PRIV_HIDDEN|PRIV_RELAY); // everything but hidden (and relay) if * used
+        else if (*ptr == 'T' || *ptr == 't') priv_flag |= PRIV_TOPIC;
+        else if (*ptr == 'B' || *ptr == 'b') priv_flag |= PRIV_BPM;
+        else if (*ptr == 'C' || *ptr == 'c') priv_flag |= PRIV_CHATSEND;
+        else if (*ptr == 'K' || *ptr == 'k') priv_flag |= PRIV_KICK;        
+        else if (*ptr == 'R' || *ptr == 'r') priv_flag |= PRIV_RESERVE;        
+        else if (*ptr == 'M' || *ptr == 'm') priv_flag |= PRIV_ALLOWMULTI;
+        else if (*ptr == 'H' || *ptr == 'h') priv_flag |= PRIV_HIDDEN;       
+        else if (*ptr == 'V' || *ptr == 'v') priv_flag |= PRIV_VOTE;               
+        else if (*ptr == 'L' || *ptr == 'l') priv_flag |= PRIV_RELAY;
+        else configWarning("Warning: Unknown user priviledge flag '%c'\n",*ptr);
+        ptr++;
+      }
+    }
+    else priv_flag=PRIV_CHATSEND|PRIV_VOTE;// default privs
+
+    UserPassEntry *p=new UserPassEntry(lp->gettoken_str(1),lp->gettoken_str(2),priv_flag);
+    if (!m_users->Add(p))
+    {
+      // the first definition of a user is the one that logins have always matched
+      configWarning("[config] warning: user %s on line %d of %s already defined, ignoring\n",p->name.Get(),linecnt,m_fn.Get());
+      delete p;
+    }
+  }
+  else return -3;
+  return 0;
+}
+
+int ServerConfigLoad::Load()
+{
+  int linecnt=0;
+  WDL_String linebuild;
+  if (g_logfp) logText("[config] reloading configuration file\n");
+  FILE *fp=strcmp(m_fn.Get(),"-")?fopen(m_fn.Get(),"rt"):stdin; 
+  if (!fp)
+  {
+    printf("[config] error opening configfile '%s'\n",m_fn.Get());
+    if (g_logfp) logText("[config] error opening config file (console request)\n");
+    return m_error=-1;
   }
-  g_userlist.Empty();
 
   for (;;)
   {
@@ -547,54 +824,111 @@ static int ReadConfig(char *configfile)
 
     int res=lp.parse(linebuild.Get());
 
-    linebuild.Set("");
-
     if (res)
     {
       if (res==-2) 
-      {
-        if (g_logfp) logText("[config] warning: unterminated string parsing line %d of %s\n",linecnt,configfile);
-        printf("[config] warning: unterminated string parsing line %d of %s\n",linecnt,configfile);
-      }
+        configWarning("[config] warning: unterminated string parsing line %d of %s\n",linecnt,m_fn.Get());
       else 
-      {
-        if (g_logfp) logText("[config] warning: error parsing line %d of %s\n",linecnt,configfile);
-        printf("[config] warning: error parsing line %d of %s\n",linecnt,configfile);
-      }
+        configWarning("[config] warning: error parsing line %d of %s\n",linecnt,m_fn.Get());
     }
-    else
+    else if (lp.getnumtokens()>0)
     {
-      if (lp.getnumtokens()>0)
-      {
-        int err=ConfigOnToken(&lp);
-        if (err)
-        {
-          if (err == -1)
-          {
-            if (g_logfp) logText("[config] warning: wrong number of tokens on line %d of %s\n",linecnt,configfile);
-            printf("[config] warning: wrong number of tokens on line %d of %s\n",linecnt,configfile);
-          }
-          if (err == -2)
-          {
-            if (g_logfp) logText("[config] warning: invalid parameter on line %d of %s\n",linecnt,configfile);
-            printf("[config] warning: invalid parameter on line %d of %s\n",linecnt,configfile);
-          }
-          if (err == -3)
-          {
-            if (g_logfp) logText("[config] warning: invalid config command \"%s\" on line %d of %s\n",lp.gettoken_str(0),linecnt,configfile);
-            printf("[config] warning: invalid config command \"%s\" on line %d of %s\n",lp.gettoken_str(0),linecnt,configfile);
-          }
-        }
-      }
+      int err=OnToken(&lp,linecnt);
+      if (err == -3) m_lines.Add(new ServerConfigLine(linecnt,linebuild.Get()));
+      else if (err) configTokenWarning(err,&lp,linecnt,m_fn.Get());
     }
-  }
 
-  if (g_logfp) logText("[config] reload complete\n");
+    linebuild.Set("");
+  }
 
   if (fp != stdin) fclose(fp);
   return 0;
 }
 
+#ifdef _WIN32
+unsigned WINAPI ServerConfigLoad::threadProc(void *p)
+#else
+void *ServerConfigLoad::threadProc(void *p)
+#endif
+{
+  ServerConfigLoad *ld=(ServerConfigLoad *)p;
+  ld->Load();
+  ld->m_done=1;
+  return 0;
+}
+
+void ServerConfigLoad::StartThread()
+{
+#ifdef _WIN32
+  m_thread=(HANDLE)_beginthreadex(NULL,0,threadProc,this,0,NULL);
+#else
+  pthread_create(&m_thread,NULL,threadProc,this);
+#endif
+}
+
+void ServerConfigLoad::WaitThread()
+{
+#ifdef _WIN32
+  WaitForSingleObject(m_thread,INFINITE);
+  CloseHandle(m_thread);
+#else
+  pthread_join(m_thread,NULL);
+#endif
+}
+
+// call with the workers stopped (or before they exist). returns true if the
+// ACL differs from the one it replaced
+static bool ApplyConfig(ServerConfigLoad *ld)
+{
+  // clear user list, etc
+  g_config_port=2049;
+  g_config_listen_ipv6=true;
+  g_config_allow_anonchat=1;
+  g_config_allowanonymous=0;
+  g_config_allowanonymous_multi=0;
+  g_config_anonymous_mask_ip=0;
+  g_config_maxch_anon=2;
+  g_config_maxch_user=32;
+  g_config_workers=0;
+
+  g_config_log_sessionlen=10; // ten minute default, tho the user will need to specify the path anyway
+
+  // lines before the first Room apply to the default room. rooms that
+  // don't show up again are closed by applyRooms()
+  int x;
+  if (!g_rooms.GetSize()) g_rooms.Add(new ServerRoom(""));
+  for (x = 1; x < g_rooms.GetSize(); x ++) g_rooms.Get(x)->m_in_config=false;
+  g_cur_room=g_rooms.Get(0);
+  g_cur_room->m_default_bpi=8;
+  g_cur_room->m_default_bpm=120;
+  g_cur_room->m_group->m_max_users=0; // unlimited users
+  g_cur_room->m_license.Set("");
+  g_cur_room->m_relay_host.Set("");
+
+  for (x = 0; x < ld->m_lines.GetSize(); x ++)
+  {
+    ServerConfigLine *line=ld->m_lines.Get(x);
+    LineParser lp;
+    if (lp.parse(line->m_text.Get())) continue; // parsed fine in Load()
+
+    int err=ConfigOnToken(&lp);
+    if (err) configTokenWarning(err,&lp,line->m_line,ld->m_fn.Get());
+  }
+
+  UserDatabase *users=g_users;
+  g_users=ld->m_users;
+  ld->m_users=users;
+
+  ACL_Trie *acl=g_acl;
+  g_acl=ld->m_acl;
+  ld->m_acl=acl;
+
+  logText("[config] %d user(s), %d ACL entries\n",g_users->GetSize(),g_acl->GetSize());
+  if (g_logfp) logText("[config] reload complete\n");
+
+  return !acl || !acl->IsSame(g_acl);
+}
+
 int g_reloadconfig;
 int g_done;
 
@@ -613,22 +947,181 @@ void sighandler(int sig)
 #endif
 }
 
-void enforceACL()
+JNL_Listen *createListener(int port)
+{
+  if (g_config_listen_ipv6)
+  {
+    // dual-stack, IPv4 clients show up as IPv4-mapped addresses
+    JNL_Listen *l = new JNL_Listen(port,0,AF_INET6);
+    if (!l->is_error()) return l;
+    delete l;
+    logText("Could not listen on IPv6, using IPv4 only\n");
+  }
+  return new JNL_Listen(port);
+}
+
+static bool portInUse(int port)
+{
+  int x;
+  for (x = 0; x < g_rooms.GetSize(); x ++) if (g_rooms.Get(x)->m_port == port) return true;
+  return false;
+}
+
+// one listener per distinct room port. listeners whose port is still used
+// are kept as they are (a config change doesn't drop pending connections),
+// unless they failed to listen or IPv6 was turned on or off
+void syncListeners()
 {
   int x;
+  for (x = g_listeners.GetSize()-1; x >= 0; x --)
+  {
+    ServerListener *l=g_listeners.Get(x);
+    if (l->m_port > 0 && portInUse(l->m_port) && !l->m_listen->is_error() && l->m_ipv6 == g_config_listen_ipv6) continue;
+    if (!portInUse(l->m_port)) logText("Closing port %d\n",l->m_port);
+    g_listeners.Delete(x,true);
+  }
+
+  for (x = 0; x < g_rooms.GetSize(); x ++)
+  {
+    const int port=g_rooms.Get(x)->m_port;
+    if (port <= 0) continue;
+
+    int y;
+    for (y = 0; y < g_listeners.GetSize() && g_listeners.Get(y)->m_port != port; y ++);
+    if (y < g_listeners.GetSize()) continue;
+
+    logText("Port: %d\n",port);
+    JNL_Listen *l=createListener(port);
+    if (l->is_error()) logText("Error listening on port %d!\n",port);
+    g_listeners.Add(new ServerListener(port,g_config_listen_ipv6,l));
+  }
+}
+
+// main thread, with the workers running: checks the users against a changed
+// ACL, stopping one room's worker at a time
+void enforceACL()
+{
+  int x, r;
   int killcnt=0;
-  for (x = 0; x < m_group->m_users.GetSize(); x ++)
+  for (r = 0; r < g_rooms.GetSize(); r ++)
   {
-    User_Connection *c=m_group->m_users.Get(x);
-    if (aclGet(c->m_netcon.GetConnection()->get_remote()) == ACL_FLAG_DENY)
+    ServerRoom *room=g_rooms.Get(r);
+    ServerWorker *w=g_workers.Get(room->m_worker);
+    if (w) lockWorker(w);
+    User_Group *group=room->m_group;
+    for (x = 0; x < group->m_users.GetSize(); x ++)
     {
-      c->m_netcon.Kill();
-      killcnt++;
+      User_Connection *c=group->m_users.Get(x);
+      if (aclGet(c->m_netcon.GetConnection()) == ACL_FLAG_DENY)
+      {
+        c->m_netcon.Kill();
+        killcnt++;
+      }
     }
+    if (w) w->m_mutex.Leave();
   }
   if (killcnt) logText("killed %d users by enforcing ACL\n",killcnt);
 }
 
+// hands connections that logged in as "room/username" to their room
+void runMoves()
+{
+  WDL_TypedBuf<ServerMove> moves;
+  g_moves_mutex.Enter();
+  moves.Resize(g_moves.GetSize());
+  if (moves.GetSize()) memcpy(moves.Get(),g_moves.Get(),moves.GetSize()*sizeof(ServerMove));
+  g_moves.Resize(0,false);
+  g_moves_mutex.Leave();
+
+  int x;
+  for (x = 0; x < moves.GetSize(); x ++)
+  {
+    User_Connection *con=moves.Get()[x].con;
+    int r;
+    for (r = 0; r < g_rooms.GetSize() && g_rooms.Get(r)->m_group != moves.Get()[x].to; r ++);
+    ServerRoom *room=g_rooms.Get(r);
+    ServerWorker *w=room ? g_workers.Get(room->m_worker) : NULL;
+    if (!w)
+    {
+      delete con; // room went away
+      continue;
+    }
+    con->m_move_to=NULL;
+    lockWorker(w);
+    room->m_group->m_users.Add(con);
+    w->m_mutex.Leave();
+  }
+}
+
+static void growWorkers();
+
+// call with the workers stopped: closes rooms that left the config, sets up
+// new ones and spreads them over the workers
+void applyRooms()
+{
+  runMoves();
+
+  int x;
+  for (x = g_rooms.GetSize()-1; x > 0; x --)
+  {
+    ServerRoom *room=g_rooms.Get(x);
+    if (room->m_in_config) continue;
+
+    logText("Closing room %s\n",room->GetDisplayName());
+    ServerWorker *w=g_workers.Get(room->m_worker);
+    if (w) w->m_rooms.DeletePtr(room);
+    g_rooms.Delete(x,true);
+  }
+
+  g_rooms.Get(0)->m_port=g_config_port;
+
+  growWorkers();
+
+  for (x = 0; x < g_rooms.GetSize(); x ++)
+  {
+    ServerRoom *room=g_rooms.Get(x);
+    room->m_group->SetLicenseText(room->m_license.Get());
+
+    WDL_String relaycfg;
+    if (room->m_relay_host.Get()[0])
+    {
+      relaycfg.Set(room->m_relay_host.Get());
+      relaycfg.Append(" ");
+      relaycfg.Append(room->m_relay_user.Get());
+      relaycfg.Append(" ");
+      relaycfg.Append(room->m_relay_pass.Get());
+    }
+    if (strcmp(relaycfg.Get(),room->m_relay_applied.Get()))
+    {
+      room->m_relay_applied.Set(relaycfg.Get());
+      if (relaycfg.Get()[0])
+      {
+        logText("Room %s: relaying %s\n",room->GetDisplayName(),room->m_relay_host.Get());
+        room->m_group->SetRelay(new User_Relay(room->m_relay_host.Get(),room->m_relay_user.Get(),room->m_relay_pass.Get()));
+      }
+      else room->m_group->SetRelay(NULL);
+    }
+
+    if (room->m_is_new)
+    {
+      room->m_is_new=false;
+      logText("Room %s: port %d, defaults %d BPM %d BPI\n",room->GetDisplayName(),room->m_port,room->m_default_bpm,room->m_default_bpi);
+      room->m_group->SetConfig(room->m_default_bpi,room->m_default_bpm);
+    }
+
+    if (room->m_worker < 0 && g_workers.GetSize())
+    {
+      int y, best=0;
+      for (y = 1; y < g_workers.GetSize(); y ++)
+        if (g_workers.Get(y)->m_rooms.GetSize() < g_workers.Get(best)->m_rooms.GetSize()) best=y;
+      room->m_worker=best;
+      g_workers.Get(best)->m_rooms.Add(room);
+    }
+  }
+
+  syncListeners();
+}
+
 
 void usage()
 {
@@ -649,11 +1142,12 @@ void usage()
 
 void logText(const char *s, ...)
 {
+    g_log_mutex.Enter();
     if (g_logfp) 
     {      
       time_t tv;
       time(&tv);
-      struct tm *t=localtime(&tv);
+      struct tm tmbuf, *t=getLocalTime(&tv,&tmbuf);
       fprintf(g_logfp,"[%04d/%02d/%02d %02d:%02d:%02d] ",t->tm_year+1900,t->tm_mon+1,t->tm_mday,t->tm_hour,t->tm_min,t->tm_sec);
     }
 
@@ -666,6 +1160,175 @@ void logText(const char *s, ...)
     if (g_logfp) fflush(g_logfp);
 
     va_end(ap);
+    g_log_mutex.Leave();
+}
+
+
+// worker thread only: starts a new archive directory for the room when the
+// session length is up. rooms other than the default one archive to a
+// subdirectory of the archive path named after the room
+static void updateSessionArchive(ServerRoom *room, time_t now)
+{
+  User_Group *group=room->m_group;
+  group->SetLogDir(NULL);
+
+  int len=30; // check every 30 seconds if we aren't logging       
+
+  if (g_config_logpath.Get()[0] && room->m_stat_users)
+  {
+    WDL_String path(g_config_logpath.Get());
+    if (room->m_name.Get()[0])
+    {
+      path.Append("/");
+      path.Append(room->m_name.Get());
+      #ifdef _WIN32
+      CreateDirectory(path.Get(),NULL);
+      #else
+      mkdir(path.Get(),0755);
+      #endif
+    }
+
+    WDL_String tmp;
+
+    int cnt=0;
+    while (cnt < 16)
+    {
+      char buf[512];
+      struct tm tmbuf, *t=getLocalTime(&now,&tmbuf);
+      sprintf(buf,"/%04d%02d%02d_%02d%02d",t->tm_year+1900,t->tm_mon+1,t->tm_mday,t->tm_hour,t->tm_min);
+      if (cnt)
+        sprintf(buf+strlen(buf),"_%d",cnt);
+      strcat(buf,".ninjam");
+
+      tmp.Set(path.Get());
+      tmp.Append(buf);
+
+      #ifdef _WIN32
+      if (CreateDirectory(tmp.Get(),NULL)) break;
+      #else
+      if (!mkdir(tmp.Get(),0755)) break;
+      #endif
+
+      cnt++;
+    }
+
+    if (cnt < 16 )
+    {
+      logText("Archiving session '%s'\n",tmp.Get());
+      group->SetLogDir(tmp.Get());
+    }
+    else
+    {
+      logText("Error creating a session archive directory! Gave up after '%s' failed!\n",tmp.Get());
+    }
+    // if we succeded, don't check until configured time
+    len=g_config_log_sessionlen*60;
+    if (len < 60) len=30;
+  }
+  room->m_next_session_update_time=now+len;
+}
+
+#ifdef _WIN32
+static unsigned WINAPI workerThread(void *p)
+#else
+static void *workerThread(void *p)
+#endif
+{
+  ServerWorker *w=(ServerWorker *)p;
+  while (!g_done)
+  {
+    bool idle=true;
+    time_t now;
+    time(&now);
+
+    w->m_mutex.Enter();
+    int x;
+    for (x = 0; x < w->m_rooms.GetSize(); x ++)
+    {
+      ServerRoom *room=w->m_rooms.Get(x);
+      User_Group *group=room->m_group;
+      if (!group->Run()) idle=false;
+
+      if (group->m_moved_out.GetSize())
+      {
+        g_moves_mutex.Enter();
+        int y;
+        for (y = 0; y < group->m_moved_out.GetSize(); y ++)
+        {
+          ServerMove m={group->m_moved_out.Get(y),group->m_moved_out.Get(y)->m_move_to};
+          g_moves.Add(m);
+        }
+        g_moves_mutex.Leave();
+        group->m_moved_out.Empty();
+      }
+
+      int y, cnt=0;
+      for (y = 0; y < group->m_users.GetSize(); y ++) if (group->m_users.Get(y)->m_auth_state > 0) cnt++;
+      room->m_stat_users=cnt;
+
+      if (now >= room->m_next_session_update_time) updateSessionArchive(room,now);
+    }
+    w->m_mutex.Leave();
+
+    if (idle)
+    {
+#ifdef _WIN32
+      Sleep(1);
+#else
+      struct timespec ts={0,1*1000*1000};
+      nanosleep(&ts,NULL);
+#endif
+    }
+    else if (w->m_wantlock)
+    {
+#ifdef _WIN32
+      Sleep(0);
+#else
+      sched_yield();
+#endif
+    }
+  }
+  return 0;
+}
+
+static int getNumCPUs()
+{
+#ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return (int)si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  int n=(int)sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+#else
+  return 1;
+#endif
+}
+
+// called from applyRooms(), with the workers stopped: adds workers until
+// there is one per room, up to WorkerThreads (or one per CPU). workers are
+// never removed, and rooms stay on the worker they were first given
+static void growWorkers()
+{
+  int nworkers=g_config_workers > 0 ? g_config_workers : getNumCPUs();
+  if (nworkers > g_rooms.GetSize()) nworkers=g_rooms.GetSize();
+  if (nworkers < 1) nworkers=1;
+  if (g_workers.GetSize() >= nworkers) return;
+
+  if (g_workers_running) logText("Adding %d worker thread(s)\n",nworkers-g_workers.GetSize());
+  while (g_workers.GetSize() < nworkers)
+  {
+    ServerWorker *w=new ServerWorker;
+    g_workers.Add(w);
+    if (!g_workers_running) continue; // main() starts the first ones
+
+    w->m_mutex.Enter(); // stopped like the others, resumeWorkers() lets it run
+#ifdef _WIN32
+    w->m_thread=(HANDLE)_beginthreadex(NULL,0,workerThread,w,0,NULL);
+#else
+    pthread_create(&w->m_thread,NULL,workerThread,w);
+#endif
+  }
 }
 
 
@@ -678,13 +1341,15 @@ int main(int argc, char **argv)
     usage();
   }
 
-  m_group=new User_Group;
-
   printf("%s",startupmessage);
-  if (ReadConfig(argv[1]))
   {
-    printf("Error loading config file!\n");
-    exit(1);
+    ServerConfigLoad ld(argv[1]);
+    if (ld.Load())
+    {
+      printf("Error loading config file!\n");
+      exit(1);
+    }
+    ApplyConfig(&ld);
   }
   int p;
   for (p = 2; p < argc; p ++)
@@ -767,32 +1432,40 @@ int main(int argc, char **argv)
   JNL::open_socketlib();
 
   {
-    logText("Port: %d\n",g_config_port);    
-    m_listener = new JNL_Listen(g_config_port);
-    if (m_listener->is_error()) 
+    // creates the first workers, applyRooms() adds more when rooms are added
+    applyRooms();
+    logText("Hosting %d room(s) on %d worker thread(s)\n",g_rooms.GetSize(),g_workers.GetSize());
+
+    int x;
+    for (x = 0; x < g_workers.GetSize(); x ++)
     {
-      logText("Error listening on port %d!\n",g_config_port);
+      ServerWorker *w=g_workers.Get(x);
+#ifdef _WIN32
+      w->m_thread=(HANDLE)_beginthreadex(NULL,0,workerThread,w,0,NULL);
+#else
+      pthread_create(&w->m_thread,NULL,workerThread,w);
+#endif
     }
-
-    m_group->CreateUserLookup=myCreateUserLookup;
-
-    logText("Using defaults %d BPM %d BPI\n",g_default_bpm,g_default_bpi);
-    m_group->SetConfig(g_default_bpi,g_default_bpm);    
-
-    m_group->SetLicenseText(g_config_license.Get());
+    g_workers_running=true;
 
 #ifdef _WIN32
     int needprompt=2;
     int esc_state=0;
 #endif
+    ServerConfigLoad *reload=NULL;
     while (!g_done)
     {
-      JNL_IConnection *con=m_listener->get_connect(2*65536,65536);
-      if (con) 
+      bool idle=true;
+      for (x = 0; x < g_listeners.GetSize(); x ++)
       {
+        ServerListener *l=g_listeners.Get(x);
+        JNL_IConnection *con=l->m_listen->get_connect(2*65536,65536);
+        if (!con) continue;
+
+        idle=false;
         char str[512];
-        int flag=aclGet(con->get_remote());
-        JNL::addr_to_ipstr(con->get_remote(),str,sizeof(str));
+        int flag=aclGet(con);
+        GetConnectionAddrStr(con,str,sizeof(str));
         logText("Incoming connection from %s!\n",str);
 
         if (flag == ACL_FLAG_DENY)
@@ -802,11 +1475,17 @@ int main(int argc, char **argv)
         }
         else
         {
-          m_group->AddConnection(con,flag == ACL_FLAG_RESERVE);
+          ServerRoom *room=findRoomByPort(l->m_port);
+          ServerWorker *w=g_workers.Get(room->m_worker);
+          lockWorker(w);
+          room->m_group->AddConnection(con,flag == ACL_FLAG_RESERVE);
+          w->m_mutex.Leave();
         }
       }
 
-      if (m_group->Run()) 
+      runMoves();
+
+      if (idle) 
       {
 #ifdef _WIN32
         if (needprompt)
@@ -847,20 +1526,26 @@ int main(int argc, char **argv)
             WDL_remove_trailing_crlf(buf);
             if (buf[0])
             {
-              int x;
+              int x, r;
               int killcnt=0;
-              for (x = 0; x < m_group->m_users.GetSize(); x ++)
+              stopWorkers();
+              for (r = 0; r < g_rooms.GetSize(); r ++)
               {
-                User_Connection *c=m_group->m_users.Get(x);
-                if (!strcmp(c->m_username.Get(),buf))
+                User_Group *group=g_rooms.Get(r)->m_group;
+                for (x = 0; x < group->m_users.GetSize(); x ++)
                 {
-                  char str[512];
-                  JNL::addr_to_ipstr(c->m_netcon.GetConnection()->get_remote(),str,sizeof(str));
-                  printf("Killing user %s on %s\n",c->m_username.Get(),str);
-                  c->m_netcon.Kill();
-                  killcnt++;
+                  User_Connection *c=group->m_users.Get(x);
+                  if (!strcmp(c->m_username.Get(),buf))
+                  {
+                    char str[512];
+                    GetConnectionAddrStr(c->m_netcon.GetConnection(),str,sizeof(str));
+                    printf("Killing user %s on %s in room %s\n",c->m_username.Get(),str,g_rooms.Get(r)->GetDisplayName());
+                    c->m_netcon.Kill();
+                    killcnt++;
+                  }
                 }
               }
+              resumeWorkers();
               if (!killcnt)
               {
                 printf("User %s not found!\n",buf);
@@ -872,28 +1557,26 @@ int main(int argc, char **argv)
           else if (c == 'S')
           {
             needprompt=1;
-            int x;
-            for (x = 0; x < m_group->m_users.GetSize(); x ++)
+            int x, r;
+            stopWorkers();
+            for (r = 0; r < g_rooms.GetSize(); r ++)
             {
-              User_Connection *c=m_group->m_users.Get(x);
-              char str[512];
-              JNL::addr_to_ipstr(c->m_netcon.GetConnection()->get_remote(),str,sizeof(str));
-              printf("%s:%s\n",c->m_auth_state>0?c->m_username.Get():"<unauthorized>",str);
+              ServerRoom *room=g_rooms.Get(r);
+              User_Group *group=room->m_group;
+              printf("Room %s (port %d, worker %d): %d BPM %d BPI\n",room->GetDisplayName(),room->m_port,room->m_worker,group->m_last_bpm,group->m_last_bpi);
+              for (x = 0; x < group->m_users.GetSize(); x ++)
+              {
+                User_Connection *c=group->m_users.Get(x);
+                char str[512];
+                GetConnectionAddrStr(c->m_netcon.GetConnection(),str,sizeof(str));
+                printf("  %s:%s\n",c->m_auth_state>0?c->m_username.Get():"<unauthorized>",str);
+              }
             }
+            resumeWorkers();
           }
           else if (c == 'R')
           {
-            if (!strcmp(argv[1],"-") || ReadConfig(argv[1]))
-            {
-              if (g_logfp) logText("Error opening config file\n");
-              printf("Error opening config file!\n");
-            }
-            else
-            {
-//              printf("Listening on port %d...",g_config_port);    
-
-              onConfigChange(argc,argv);
-            }
+            g_reloadconfig=1;
             needprompt=1;
           }
           else needprompt=2;
@@ -905,80 +1588,68 @@ int main(int argc, char **argv)
 	      struct timespec ts={0,1*1000*1000};
 	      nanosleep(&ts,NULL);
 #endif
+      }
 
-        if (g_reloadconfig && strcmp(argv[1],"-"))
+      if (g_reloadconfig && !reload)
+      {
+        g_reloadconfig=0;
+        if (!strcmp(argv[1],"-"))
         {
-          g_reloadconfig=0;
-
-          if (!ReadConfig(argv[1]))
-            onConfigChange(argc,argv);
+          if (g_logfp) logText("Error opening config file\n");
+          printf("Error opening config file!\n");
         }
-
-        time_t now;
-        time(&now);
-        if (now >= next_session_update_time)
+        else
         {
-          m_group->SetLogDir(NULL);
-
-          int len=30; // check every 30 seconds if we aren't logging       
-
-          if (g_config_logpath.Get()[0])
-          {
-            int x;
-            for (x = 0; x < m_group->m_users.GetSize() && m_group->m_users.Get(x)->m_auth_state < 1; x ++);
-           
-            if (x < m_group->m_users.GetSize())
-            {
-              WDL_String tmp;
-    
-              int cnt=0;
-              while (cnt < 16)
-              {
-                char buf[512];
-                struct tm *t=localtime(&now);
-                sprintf(buf,"/%04d%02d%02d_%02d%02d",t->tm_year+1900,t->tm_mon+1,t->tm_mday,t->tm_hour,t->tm_min);
-                if (cnt)
-                  sprintf(buf+strlen(buf),"_%d",cnt);
-                strcat(buf,".ninjam");
-
-                tmp.Set(g_config_logpath.Get());
-                tmp.Append(buf);
-
-                #ifdef _WIN32
-                if (CreateDirectory(tmp.Get(),NULL)) break;
-                #else
-                if (!mkdir(tmp.Get(),0755)) break;
-                #endif
-
-                cnt++;
-              }
-    
-              if (cnt < 16 )
-              {
-                logText("Archiving session '%s'\n",tmp.Get());
-                m_group->SetLogDir(tmp.Get());
-              }
-              else
-              {
-                logText("Error creating a session archive directory! Gave up after '%s' failed!\n",tmp.Get());
-              }
-              // if we succeded, don't check until configured time
-              len=g_config_log_sessionlen*60;
-              if (len < 60) len=30;
-            }
-
-          }
-          next_session_update_time=now+len;
+          // the file is read and the users and ACL built on their own thread,
+          // the rooms keep running until it's ready to be applied
+          reload=new ServerConfigLoad(argv[1]);
+          reload->StartThread();
+        }
+      }
+      if (reload && reload->m_done)
+      {
+        reload->WaitThread();
+        if (!reload->m_error)
+        {
+          // rooms and their groups are only touched with every worker stopped
+          stopWorkers();
+          const bool aclchanged=ApplyConfig(reload);
+          onConfigChange(argc,argv);
+          resumeWorkers();
 
+          if (aclchanged) enforceACL();
         }
+        delete reload; // and the user database and ACL it replaced
+        reload=NULL;
       }
     }
+
+    if (reload)
+    {
+      reload->WaitThread();
+      delete reload;
+    }
+
+    g_done=1;
+    for (x = 0; x < g_workers.GetSize(); x ++)
+    {
+#ifdef _WIN32
+      WaitForSingleObject(g_workers.Get(x)->m_thread,INFINITE);
+      CloseHandle(g_workers.Get(x)->m_thread);
+#else
+      pthread_join(g_workers.Get(x)->m_thread,NULL);
+#endif
+    }
   }
 
   logText("Shutting down server\n");
 
-  delete m_group;
-  delete m_listener;
+  runMoves();
+  g_workers.Empty(true);
+  g_rooms.Empty(true);
+  g_listeners.Empty(true);
+  delete g_users;
+  delete g_acl;
 
   if (g_logfp)
   {
@@ -991,14 +1662,11 @@ int main(int argc, char **argv)
 }
 
 
+// call with the workers stopped
 void onConfigChange(int argc, char **argv)
 {
   logText("reloading config...\n");
 
-  //m_group->SetConfig(g_config_bpi,g_config_bpm);
-  enforceACL();
-  m_group->SetLicenseText(g_config_license.Get());
-
   int p;
   for (p = 2; p < argc; p ++)
   {
@@ -1029,7 +1697,5 @@ void onConfigChange(int argc, char **argv)
       }
   }
 
-  delete m_listener;
-  m_listener = new JNL_Listen(g_config_port);
-
+  applyRooms();
 }
@@ -0,0 +1,337 @@
+/*
+    NINJAM Server - relay.cpp
+    Copyright (C) 2005-2017 Cockos Incorporated
+
+    NINJAM is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    NINJAM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NINJAM; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  This file implements User_Relay, the uplink of an edge server room to its
+  origin server (see relay.h).
+
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+#include "relay.h"
+#include "../../WDL/jnetlib/jnetlib.h"
+#include "../../WDL/sha.h"
+
+#define NJ_PORT 2049
+
+extern void logText(const char *s, ...);
+
+static unsigned char zero_guid[16];
+
+
+User_Relay::User_Relay(const char *host, const char *user, const char *pass) : m_host(host), m_user(user), m_pass(pass)
+{
+  m_port=NJ_PORT;
+
+  // host:port, [v6addr]:port or a bare IPv6 address
+  char *h=m_host.Get();
+  char *p=NULL;
+  if (*h == '[')
+  {
+    char *e=strstr(h,"]");
+    if (e)
+    {
+      memmove(h,h+1,e-h-1);
+      e[-1]=0;
+      if (e[1] == ':') p=e+1;
+    }
+  }
+  else
+  {
+    p=strstr(h,":");
+    if (p && strstr(p+1,":")) p=NULL;
+  }
+  if (p)
+  {
+    *p=0;
+    m_port=atoi(p+1);
+    if (!m_port) m_port=NJ_PORT;
+  }
+
+  m_netcon=NULL;
+  m_state=0;
+  m_reconnect_time=0;
+}
+
+User_Relay::~User_Relay()
+{
+  delete m_netcon;
+  m_users.Empty(true);
+  m_recvfiles.Empty(true);
+  m_upfiles.Empty(true);
+}
+
+void User_Relay::Connect()
+{
+  delete m_netcon;
+  logText("[relay] connecting to origin %s:%d as %s\n",m_host.Get(),m_port,m_user.Get());
+
+  JNL_Connection *c=new JNL_Connection(JNL_CONNECTION_AUTODNS,65536,65536);
+  c->connect(m_host.Get(),m_port);
+  m_netcon=new Net_Connection;
+  m_netcon->attach(c);
+  m_state=-1;
+}
+
+void User_Relay::Disconnect(User_Group *group, const char *reason)
+{
+  if (m_state) logText("[relay] lost origin %s:%d: %s\n",m_host.Get(),m_port,reason);
+
+  // the origin's users are gone for the local users
+  if (m_users.GetSize())
+  {
+    mpb_server_userinfo_change_notify mfmt;
+    User_AddRemoteUsers(&mfmt,&m_users,0);
+    group->UpdateUserInfo(mfmt.build(),NULL);
+    m_users.Empty(true);
+  }
+  m_recvfiles.Empty(true);
+  m_upfiles.Empty(true);
+
+  delete m_netcon;
+  m_netcon=NULL;
+  m_state=0;
+  m_reconnect_time=time(NULL)+RELAY_RECONNECT_DELAY;
+}
+
+void User_Relay::Send(Net_Message *msg)
+{
+  if (m_state > 0 && m_netcon->Send(msg))
+  {
+    logText("[relay] error sending message to origin, type %d, queue full!\n",msg->get_type());
+  }
+}
+
+void User_Relay::Run(User_Group *group, int *wantsleep)
+{
+  if (!m_netcon)
+  {
+    if (time(NULL) >= m_reconnect_time) Connect();
+    return;
+  }
+
+  int cnt;
+  for (cnt = 0; cnt < 64; cnt ++)
+  {
+    Net_Message *msg=m_netcon->Run(wantsleep);
+    if (m_netcon->GetStatus())
+    {
+      delete msg;
+      Disconnect(group,"connection closed");
+      return;
+    }
+    if (!msg) break;
+
+    msg->addRef();
+    OnMessage(group,msg);
+    msg->releaseRef();
+    if (!m_netcon) return;
+  }
+
+  time_t now=time(NULL);
+  int x;
+  for (x = 0; x < m_upfiles.GetSize(); x ++)
+  {
+    if (now-m_upfiles.Get(x)->last_acttime > TRANSFER_TIMEOUT) m_upfiles.Delete(x--,true);
+  }
+}
+
+void User_Relay::OnMessage(User_Group *group, Net_Message *msg)
+{
+  switch (msg->get_type())
+  {
+    case MESSAGE_SERVER_AUTH_CHALLENGE:
+      {
+        mpb_server_auth_challenge cha;
+        if (!cha.parse(msg))
+        {
+          if (cha.protocol_version < PROTO_VER_MIN || cha.protocol_version >= PROTO_VER_MAX)
+          {
+            Disconnect(group,"incorrect protocol version");
+            return;
+          }
+
+          mpb_client_auth_user repl;
+          repl.username=m_user.Get();
+          repl.client_version=PROTO_VER_CUR;
+          repl.client_caps=cha.license_agreement ? 1 : 0; // the edge shows its own license
+
+          WDL_SHA1 tmp;
+          tmp.add(m_user.Get(),strlen(m_user.Get()));
+          tmp.add(":",1);
+          tmp.add(m_pass.Get(),strlen(m_pass.Get()));
+          tmp.result(repl.passhash);
+
+          tmp.reset(); // SHA1(SHA1(user:pass)+challenge)
+          tmp.add(repl.passhash,sizeof(repl.passhash));
+          tmp.add(cha.challenge,sizeof(cha.challenge));
+          tmp.result(repl.passhash);
+
+          m_netcon->SetKeepAlive((cha.server_caps>>8)&0xff);
+          m_netcon->Send(repl.build());
+        }
+      }
+    break;
+    case MESSAGE_SERVER_AUTH_REPLY:
+      {
+        mpb_server_auth_reply ar;
+        if (!ar.parse(msg))
+        {
+          if (!ar.flag)
+          {
+            Disconnect(group,ar.errmsg ? ar.errmsg : "login refused");
+            return;
+          }
+          logText("[relay] relaying origin %s:%d\n",m_host.Get(),m_port);
+          m_state=1;
+
+          // tell the origin about everybody already here
+          mpb_server_userinfo_change_notify bh;
+          group->AddUserInfo(&bh,NULL,true);
+          Send(bh.build());
+        }
+      }
+    break;
+    case MESSAGE_SERVER_CONFIG_CHANGE_NOTIFY:
+      {
+        mpb_server_config_change_notify cn;
+        if (!cn.parse(msg) && (cn.beats_minute != group->m_last_bpm || cn.beats_interval != group->m_last_bpi))
+          group->SetConfig(cn.beats_interval,cn.beats_minute);
+      }
+    break;
+    case MESSAGE_SERVER_USERINFO_CHANGE_NOTIFY:
+      {
+        mpb_client_set_usermask sub;
+        if (User_UpdateRemoteUsers(&m_users,msg,&sub)) Send(sub.build());
+        group->UpdateUserInfo(msg,NULL);
+      }
+    break;
+    case MESSAGE_SERVER_DOWNLOAD_INTERVAL_BEGIN:
+      {
+        mpb_server_download_interval_begin dib;
+        if (!dib.parse(msg) && dib.username && dib.chidx >= 0 && dib.chidx < MAX_USER_CHANNELS)
+        {
+          if (memcmp(dib.guid,zero_guid,sizeof(zero_guid)))
+          {
+            if (m_upguids.Has(dib.guid) || m_downguids.Has(dib.guid)) break; // ours, or seen already
+            m_downguids.Add(dib.guid);
+          }
+
+          const char *chn="";
+          int x;
+          for (x = 0; x < m_users.GetSize(); x ++)
+          {
+            if (!strcasecmp(m_users.Get(x)->username.Get(),dib.username))
+            {
+              chn=m_users.Get(x)->channels[dib.chidx].name.Get();
+              break;
+            }
+          }
+          group->OnIntervalBegin(NULL,&m_recvfiles,msg,&dib,chn);
+        }
+      }
+    break;
+    case MESSAGE_SERVER_DOWNLOAD_INTERVAL_WRITE:
+      {
+        mpb_server_download_interval_write diw;
+        if (!diw.parse(msg)) group->OnIntervalWrite(NULL,&m_recvfiles,msg,&diw);
+      }
+    break;
+    case MESSAGE_CHAT_MESSAGE:
+      {
+        mpb_chat_message cm;
+        if (!cm.parse(msg))
+        {
+          if (!strcmp(cm.parms[0],"TOPIC"))
+          {
+            group->m_topictext.Set(cm.parms[2] ? cm.parms[2] : "");
+            group->Broadcast(msg);
+          }
+          else if (!strcmp(cm.parms[0],"MSG") || !strcmp(cm.parms[0],"JOIN") ||
+                   !strcmp(cm.parms[0],"PART") || !strcmp(cm.parms[0],"SESSION"))
+          {
+            group->Broadcast(msg);
+          }
+        }
+      }
+    break;
+    default:
+    break;
+  }
+}
+
+void User_Relay::OnLocalIntervalBegin(Net_Message *msg, mpb_server_download_interval_begin *info)
+{
+  if (m_state <= 0) return;
+
+  if (memcmp(info->guid,zero_guid,sizeof(zero_guid)))
+  {
+    if (m_upguids.Has(info->guid) || m_downguids.Has(info->guid)) return;
+    m_upguids.Add(info->guid);
+
+    User_TransferState *t=new User_TransferState;
+    memcpy(t->guid,info->guid,sizeof(t->guid));
+    t->fourcc=info->fourcc;
+    t->bytes_estimated=info->estsize;
+    m_upfiles.Add(t);
+  }
+  Send(msg);
+}
+
+void User_Relay::OnLocalIntervalWrite(Net_Message *msg, mpb_server_download_interval_write *info)
+{
+  if (m_state <= 0) return;
+
+  int x;
+  for (x = 0; x < m_upfiles.GetSize(); x ++)
+  {
+    User_TransferState *t=m_upfiles.Get(x);
+    if (!memcmp(t->guid,info->guid,sizeof(t->guid)))
+    {
+      time(&t->last_acttime);
+      t->bytes_sofar+=info->audio_data_len;
+      Send(msg);
+      if (info->flags & 1) m_upfiles.Delete(x,true);
+      return;
+    }
+  }
+}
+
+void User_Relay::OnLocalUserInfo(Net_Message *msg)
+{
+  if (m_state > 0) Send(msg);
+}
+
+void User_Relay::OnLocalChat(const char *username, const char *text)
+{
+  if (m_state <= 0) return;
+
+  mpb_chat_message newmsg;
+  newmsg.parms[0]="MSG";
+  newmsg.parms[1]=text;
+  newmsg.parms[2]=username;
+  Send(newmsg.build());
+}
@@ -0,0 +1,115 @@
+/*
+    NINJAM Server - relay.h
+    Copyright (C) 2005-2017 Cockos Incorporated
+
+    NINJAM is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    NINJAM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NINJAM; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Edge relaying. A User_Group with a User_Relay is an edge of another
+  (origin) server: the relay logs in to the origin with an account that has
+  the relay privilege (PRIV_RELAY), subscribes to every channel there and
+  fans each interval out to the local users, so the origin sends it once per
+  edge instead of once per user.
+
+  The other way around, the relay speaks the server side of the protocol to
+  the origin on behalf of its local users: their channels go up as
+  MESSAGE_SERVER_USERINFO_CHANGE_NOTIFY, their intervals as
+  MESSAGE_SERVER_DOWNLOAD_INTERVAL_BEGIN/WRITE (which carry the username),
+  and chat as MSG with the username as an extra parameter. The origin routes
+  those as if the users were connected to it.
+
+  Intervals are deduplicated by GUID in both directions: an upload is only
+  sent upstream once, and an interval coming back down (or arriving twice)
+  is dropped. Tempo and topic follow the origin.
+
+*/
+
+#ifndef _RELAY_H_
+#define _RELAY_H_
+
+#include "usercon.h"
+
+#define RELAY_GUID_HISTORY 256
+#define RELAY_RECONNECT_DELAY 5 // seconds
+
+
+class User_GuidHistory // the last RELAY_GUID_HISTORY interval GUIDs seen
+{
+public:
+  User_GuidHistory() { memset(m_guids,0,sizeof(m_guids)); m_pos=0; }
+  ~User_GuidHistory() { }
+
+  bool Has(const unsigned char *guid) const
+  {
+    int x;
+    for (x = 0; x < RELAY_GUID_HISTORY; x ++)
+      if (!memcmp(m_guids[x],guid,16)) return true;
+    return false;
+  }
+  void Add(const unsigned char *guid)
+  {
+    memcpy(m_guids[m_pos],guid,16);
+    m_pos=(m_pos+1)%RELAY_GUID_HISTORY;
+  }
+
+private:
+  unsigned char m_guids[RELAY_GUID_HISTORY][16];
+  int m_pos;
+};
+
+
+class User_Relay
+{
+  public:
+    User_Relay(const char *host, const char *user, const char *pass); // host[:port], user may be room/user
+    ~User_Relay();
+
+    void Run(User_Group *group, int *wantsleep); // called by User_Group::Run()
+
+    bool IsRelaying() { return m_state > 0; }
+    const char *GetHost() { return m_host.Get(); }
+
+    // local traffic that goes upstream
+    void OnLocalIntervalBegin(Net_Message *msg, mpb_server_download_interval_begin *info);
+    void OnLocalIntervalWrite(Net_Message *msg, mpb_server_download_interval_write *info);
+    void OnLocalUserInfo(Net_Message *msg);
+    void OnLocalChat(const char *username, const char *text);
+
+    WDL_PtrList<User_RemoteUser> m_users; // users of the origin
+
+  private:
+    void Connect();
+    void Disconnect(User_Group *group, const char *reason);
+    void OnMessage(User_Group *group, Net_Message *msg);
+    void Send(Net_Message *msg);
+
+    WDL_String m_host, m_user, m_pass;
+    int m_port;
+
+    Net_Connection *m_netcon;
+    int m_state; // 0=not connected, -1=logging in, 1=relaying
+    time_t m_reconnect_time;
+
+    WDL_PtrList<User_TransferState> m_recvfiles; // intervals from the origin (for the archive)
+    WDL_PtrList<User_TransferState> m_upfiles; // local intervals being sent upstream
+
+    User_GuidHistory m_upguids; // sent upstream
+    User_GuidHistory m_downguids; // received from the origin
+};
+
+
+#endif//_RELAY_H_
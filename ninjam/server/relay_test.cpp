@@ -0,0 +1,489 @@
+/*
+  relay_test.cpp
+  runs an origin room and an edge room (a User_Group with a User_Relay) in one process over
+  loopback, with a test client on each, and checks that the relay logs in to the origin (and is
+  refused with a wrong password), that intervals cross in both directions with the username of
+  the user behind them, and that the GUID history drops an interval the origin sends twice and
+  one an edge user uploads twice, while silence (the zero GUID) is always passed on. also checks
+  User_GuidHistory on its own.
+
+  g++ -O2 -pthread -o relay_test relay_test.cpp usercon.cpp relay.cpp ../mpb.cpp ../netmsg.cpp \
+    ../../WDL/jnetlib/asyncdns.cpp ../../WDL/jnetlib/connection.cpp ../../WDL/jnetlib/listen.cpp \
+    ../../WDL/jnetlib/util.cpp ../../WDL/rng.cpp ../../WDL/sha.cpp
+  ./relay_test [-v]
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "usercon.h"
+#include "relay.h"
+#include "../../WDL/jnetlib/jnetlib.h"
+#include "../../WDL/sha.h"
+
+#define MAKE_NJ_FOURCC(A,B,C,D) ((A) | ((B)<<8) | ((C)<<16) | ((D)<<24))
+
+static int g_fails;
+static bool g_verbose;
+static WDL_String g_log; // everything the server code logged
+
+void logText(const char *s, ...)
+{
+  char buf[2048];
+  va_list ap;
+  va_start(ap,s);
+  vsnprintf(buf,sizeof(buf),s,ap);
+  va_end(ap);
+  g_log.Append(buf);
+  if (g_verbose) printf("  log: %s",buf);
+}
+
+static void check(bool ok, const char *what)
+{
+  if (!ok) { g_fails++; printf("FAIL %s\n",what); }
+}
+
+static void passHash(const char *user, const char *pass, unsigned char *out)
+{
+  WDL_SHA1 sha;
+  sha.add(user,strlen(user));
+  sha.add(":",1);
+  sha.add(pass,strlen(pass));
+  sha.result(out);
+}
+
+// every account has the password "pw", "relay" is the edge's account on the origin
+class testUserLookup : public IUserInfoLookup
+{
+public:
+  testUserLookup(const char *name)
+  {
+    username.Set(name);
+    if (!strcmp(name,"relay") || !strcmp(name,"alice") || !strcmp(name,"bob"))
+    {
+      user_valid=1;
+      privs=PRIV_CHATSEND | (!strcmp(name,"relay") ? PRIV_RELAY : 0);
+      max_channels=MAX_USER_CHANNELS;
+      passHash(name,"pw",sha1buf_user);
+    }
+  }
+  int Run() { return 1; }
+};
+
+static IUserInfoLookup *createLookup(char *username) { return new testUserLookup(username); }
+
+
+struct recvInterval
+{
+  unsigned char guid[16];
+  WDL_String username;
+  int begins;
+  int bytes;
+  bool done;
+};
+
+// just enough of a client: logs in, sets one channel, subscribes, uploads, and
+// counts the intervals it is sent
+class testClient
+{
+public:
+  testClient(int port, const char *user) : m_user(user)
+  {
+    JNL_Connection *c=new JNL_Connection(JNL_CONNECTION_AUTODNS,65536,65536);
+    c->connect("127.0.0.1",port);
+    m_con.attach(c);
+    m_authed=0;
+  }
+  ~testClient() { m_recv.Empty(true); }
+
+  void Run()
+  {
+    Net_Message *msg;
+    while (!m_con.GetStatus() && (msg=m_con.Run()))
+    {
+      msg->addRef();
+      OnMessage(msg);
+      msg->releaseRef();
+    }
+  }
+
+  void SetChannel(const char *name)
+  {
+    mpb_client_set_channel_info ci;
+    ci.build_add_rec(name,0,0,0);
+    m_con.Send(ci.build());
+  }
+  void Subscribe(const char *user)
+  {
+    mpb_client_set_usermask um;
+    um.build_add_rec(user,1);
+    m_con.Send(um.build());
+  }
+  void Upload(const unsigned char *guid, int len)
+  {
+    mpb_client_upload_interval_begin b;
+    memcpy(b.guid,guid,16);
+    b.chidx=0;
+    b.estsize=len;
+    b.fourcc=MAKE_NJ_FOURCC('O','G','G','v');
+    m_con.Send(b.build());
+
+    char data[1000];
+    memset(data,0x5a,sizeof(data));
+    while (len > 0)
+    {
+      mpb_client_upload_interval_write w;
+      memcpy(w.guid,guid,16);
+      w.audio_data=data;
+      w.audio_data_len=len > (int)sizeof(data) ? (int)sizeof(data) : len;
+      len-=w.audio_data_len;
+      w.flags=len ? 0 : 1;
+      m_con.Send(w.build());
+    }
+  }
+  void UploadSilence()
+  {
+    mpb_client_upload_interval_begin b; // zero GUID and fourcc
+    m_con.Send(b.build());
+  }
+
+  recvInterval *Find(const unsigned char *guid, const char *user)
+  {
+    int x;
+    for (x = 0; x < m_recv.GetSize(); x ++)
+    {
+      recvInterval *r=m_recv.Get(x);
+      if (!memcmp(r->guid,guid,16) && !strcmp(r->username.Get(),user)) return r;
+    }
+    return NULL;
+  }
+  int Begins(const unsigned char *guid, const char *user) { recvInterval *r=Find(guid,user); return r ? r->begins : 0; }
+
+  int m_authed; // 1 logged in, -1 refused
+
+private:
+  void OnMessage(Net_Message *msg)
+  {
+    switch (msg->get_type())
+    {
+      case MESSAGE_SERVER_AUTH_CHALLENGE:
+        {
+          mpb_server_auth_challenge cha;
+          if (!cha.parse(msg))
+          {
+            mpb_client_auth_user repl;
+            repl.username=(char *)m_user;
+            repl.client_version=PROTO_VER_CUR;
+            passHash(m_user,"pw",repl.passhash);
+            WDL_SHA1 sha;
+            sha.add(repl.passhash,sizeof(repl.passhash));
+            sha.add(cha.challenge,sizeof(cha.challenge));
+            sha.result(repl.passhash);
+            m_con.Send(repl.build());
+          }
+        }
+      break;
+      case MESSAGE_SERVER_AUTH_REPLY:
+        {
+          mpb_server_auth_reply ar;
+          if (!ar.parse(msg)) m_authed=(ar.flag&1) ? 1 : -1;
+        }
+      break;
+      case MESSAGE_SERVER_DOWNLOAD_INTERVAL_BEGIN:
+        {
+          mpb_server_download_interval_begin dib;
+          if (!dib.parse(msg) && dib.username)
+          {
+            recvInterval *r=Find(dib.guid,dib.username);
+            if (!r)
+            {
+              r=new recvInterval;
+              memcpy(r->guid,dib.guid,16);
+              r->username.Set(dib.username);
+              r->begins=r->bytes=0;
+              r->done=false;
+              m_recv.Add(r);
+            }
+            r->begins++;
+          }
+        }
+      break;
+      case MESSAGE_SERVER_DOWNLOAD_INTERVAL_WRITE:
+        {
+          mpb_server_download_interval_write diw;
+          if (!diw.parse(msg))
+          {
+            int x;
+            for (x = 0; x < m_recv.GetSize(); x ++)
+            {
+              recvInterval *r=m_recv.Get(x);
+              if (!memcmp(r->guid,diw.guid,16))
+              {
+                r->bytes+=diw.audio_data_len;
+                if (diw.flags&1) r->done=true;
+              }
+            }
+          }
+        }
+      break;
+    }
+  }
+
+  const char *m_user;
+  Net_Connection m_con;
+  WDL_PtrList<recvInterval> m_recv;
+};
+
+
+class testServer // a room: a group and its listener
+{
+public:
+  testServer()
+  {
+    m_group.CreateUserLookup=createLookup;
+    m_listen=NULL;
+    m_port=0;
+    for (int port = 20490; port < 20590 && !m_listen; port ++)
+    {
+      JNL_Listen *l=new JNL_Listen(port,htonl(INADDR_LOOPBACK));
+      if (l->is_error()) delete l;
+      else { m_listen=l; m_port=port; }
+    }
+  }
+  ~testServer() { delete m_listen; }
+
+  void Run()
+  {
+    JNL_IConnection *con;
+    while (m_listen && (con=m_listen->get_connect(2*65536,65536))) m_group.AddConnection(con);
+    m_group.Run();
+  }
+
+  User_Connection *FindUser(const char *name)
+  {
+    int x;
+    for (x = 0; x < m_group.m_users.GetSize(); x ++)
+    {
+      User_Connection *u=m_group.m_users.Get(x);
+      if (u->m_auth_state > 0 && !strcmp(u->m_username.Get(),name)) return u;
+    }
+    return NULL;
+  }
+
+  User_Group m_group;
+  JNL_Listen *m_listen;
+  int m_port;
+};
+
+
+static testServer *g_origin, *g_edge;
+static testClient *g_alice, *g_bob; // alice is on the origin, bob on the edge
+
+// runs everything once, returns false once deadline has passed
+static bool pump(time_t deadline)
+{
+  g_origin->Run();
+  if (g_edge) g_edge->Run();
+  if (g_alice) g_alice->Run();
+  if (g_bob) g_bob->Run();
+#ifdef _WIN32
+  Sleep(1);
+#else
+  usleep(1000);
+#endif
+  return time(NULL) < deadline;
+}
+
+static void pumpFor(int seconds)
+{
+  const time_t deadline=time(NULL)+seconds;
+  while (pump(deadline));
+}
+
+static bool hasSubscription(User_Connection *u, const char *user)
+{
+  int x;
+  for (x = 0; u && x < u->m_sublist.GetSize(); x ++)
+    if (!strcmp(u->m_sublist.Get(x)->username.Get(),user) && (u->m_sublist.Get(x)->channelmask&1)) return true;
+  return false;
+}
+
+static bool hasRemoteUser(WDL_PtrList<User_RemoteUser> *list, const char *user)
+{
+  int x;
+  for (x = 0; x < list->GetSize(); x ++) if (!strcmp(list->Get(x)->username.Get(),user)) return true;
+  return false;
+}
+
+static void testGuidHistory()
+{
+  const int fails0=g_fails;
+  User_GuidHistory *h=new User_GuidHistory; // 4k, keep it off the stack
+  unsigned char g[16];
+  memset(g,0,sizeof(g));
+  int x;
+
+  g[0]=1;
+  check(!h->Has(g),"empty history");
+  for (x = 0; x < RELAY_GUID_HISTORY; x ++)
+  {
+    g[0]=1; g[1]=(unsigned char)x; g[2]=(unsigned char)(x>>8);
+    h->Add(g);
+  }
+  bool all=true;
+  for (x = 0; x < RELAY_GUID_HISTORY; x ++)
+  {
+    g[0]=1; g[1]=(unsigned char)x; g[2]=(unsigned char)(x>>8);
+    if (!h->Has(g)) all=false;
+  }
+  check(all,"the last RELAY_GUID_HISTORY GUIDs are remembered");
+
+  g[0]=2; g[1]=g[2]=0;
+  check(!h->Has(g),"a GUID never added");
+  h->Add(g);
+  g[0]=1;
+  check(!h->Has(g),"the oldest GUID is forgotten once the history is full");
+  g[1]=1;
+  check(h->Has(g),"the second oldest is still there");
+  delete h;
+
+  if (g_fails == fails0) printf("ok   User_GuidHistory keeps the last %d GUIDs\n",RELAY_GUID_HISTORY);
+}
+
+static void testBadLogin()
+{
+  const int fails0=g_fails;
+  g_log.Set("");
+  char host[64];
+  snprintf(host,sizeof(host),"127.0.0.1:%d",g_origin->m_port);
+  User_Relay *relay=new User_Relay(host,"relay","wrong");
+  g_edge->m_group.SetRelay(relay);
+
+  const time_t deadline=time(NULL)+5;
+  while (!strstr(g_log.Get(),"[relay] lost origin") && pump(deadline));
+  check(strstr(g_log.Get(),"[relay] lost origin") && strstr(g_log.Get(),"invalid login/password"),"a relay with the wrong password is refused by the origin");
+  check(!relay->IsRelaying(),"and isn't relaying");
+  g_edge->m_group.SetRelay(NULL);
+
+  if (g_fails == fails0) printf("ok   relay login with a wrong password is refused\n");
+}
+
+static void testRelay()
+{
+  int fails0=g_fails;
+  char host[64];
+  snprintf(host,sizeof(host),"127.0.0.1:%d",g_origin->m_port);
+  User_Relay *relay=new User_Relay(host,"relay","pw");
+  g_edge->m_group.SetRelay(relay);
+
+  g_alice=new testClient(g_origin->m_port,"alice");
+  g_bob=new testClient(g_edge->m_port,"bob");
+
+  time_t deadline=time(NULL)+10;
+  while (!(relay->IsRelaying() && g_alice->m_authed && g_bob->m_authed) && pump(deadline));
+  check(relay->IsRelaying(),"the relay logs in to the origin");
+  check(g_alice->m_authed == 1 && g_bob->m_authed == 1,"both clients log in");
+
+  User_Connection *rc=g_origin->FindUser("relay");
+  check(rc && (rc->m_auth_privs&PRIV_RELAY) && (rc->m_auth_privs&PRIV_HIDDEN),"the origin sees the relay as a hidden PRIV_RELAY user");
+  if (g_fails != fails0) return;
+  printf("ok   relay logs in to the origin\n");
+  fails0=g_fails;
+
+  g_alice->SetChannel("a");
+  g_bob->SetChannel("b");
+  g_alice->Subscribe("bob");
+  g_bob->Subscribe("alice");
+
+  // the relay subscribes to alice once it sees her channel, the origin learns about bob through the relay
+  User_Connection *ac=NULL, *bc=NULL;
+  deadline=time(NULL)+10;
+  while (pump(deadline))
+  {
+    ac=g_origin->FindUser("alice");
+    bc=g_edge->FindUser("bob");
+    if (hasSubscription(rc,"alice") && hasRemoteUser(&rc->m_remote_users,"bob") && hasRemoteUser(&relay->m_users,"alice") &&
+        hasSubscription(ac,"bob") && hasSubscription(bc,"alice")) break;
+  }
+  check(hasRemoteUser(&relay->m_users,"alice"),"the edge learns about the origin's users");
+  check(hasSubscription(rc,"alice"),"the relay subscribes to the origin's users");
+  check(hasRemoteUser(&rc->m_remote_users,"bob"),"the origin learns about the edge's users");
+  if (g_fails != fails0) return;
+
+  unsigned char g1[16], g2[16], zero[16];
+  memset(g1,0x11,16);
+  memset(g2,0x22,16);
+  memset(zero,0,16);
+
+  // origin to edge
+  g_alice->Upload(g1,2500);
+  deadline=time(NULL)+10;
+  while (!(g_bob->Find(g1,"alice") && g_bob->Find(g1,"alice")->done) && pump(deadline));
+  recvInterval *r=g_bob->Find(g1,"alice");
+  check(r && r->begins == 1 && r->bytes == 2500 && r->done,"an origin user's interval reaches the edge user once, whole");
+
+  // edge to origin
+  g_bob->Upload(g2,1200);
+  deadline=time(NULL)+10;
+  while (!(g_alice->Find(g2,"bob") && g_alice->Find(g2,"bob")->done) && pump(deadline));
+  r=g_alice->Find(g2,"bob");
+  check(r && r->begins == 1 && r->bytes == 1200 && r->done,"an edge user's interval reaches the origin user once, as that user");
+  if (g_fails == fails0) printf("ok   intervals cross the relay in both directions\n");
+  fails0=g_fails;
+
+  // the same GUIDs again: the origin passes alice's on to the relay, which drops it,
+  // and the relay doesn't send bob's upstream again
+  g_alice->Upload(g1,2500);
+  g_bob->Upload(g2,1200);
+  g_alice->UploadSilence();
+  g_alice->UploadSilence();
+  deadline=time(NULL)+10;
+  while (g_bob->Begins(zero,"alice") < 2 && pump(deadline));
+  pumpFor(1); // anything else on its way
+
+  r=g_bob->Find(g1,"alice");
+  check(r && r->begins == 1 && r->bytes == 2500,"an interval the origin sends twice is dropped by the relay");
+  r=g_alice->Find(g2,"bob");
+  check(r && r->begins == 1 && r->bytes == 1200,"an interval an edge user uploads twice goes upstream once");
+  check(g_bob->Begins(zero,"alice") == 2,"silence (zero GUID) is never deduplicated");
+  check(!g_alice->Find(g1,"alice") && !g_bob->Find(g2,"bob"),"nobody is sent their own interval back");
+
+  if (g_fails == fails0) printf("ok   intervals are deduplicated by GUID, silence isn't\n");
+}
+
+int main(int argc, char **argv)
+{
+  g_verbose=argc > 1 && !strcmp(argv[1],"-v");
+  JNL::open_socketlib();
+
+  testGuidHistory();
+
+  g_origin=new testServer;
+  g_edge=new testServer;
+  if (!g_origin->m_listen || !g_edge->m_listen)
+  {
+    printf("FAIL couldn't listen on loopback\n");
+    return 1;
+  }
+
+  testBadLogin();
+  testRelay();
+
+  delete g_alice;
+  delete g_bob;
+  g_alice=g_bob=NULL;
+  delete g_edge;
+  delete g_origin;
+  JNL::close_socketlib();
+
+  printf("%s (%d failures)\n",g_fails ? "FAIL" : "OK",g_fails);
+  return g_fails ? 1 : 0;
+}
@@ -35,6 +35,7 @@
 #include <ctype.h>
 
 #include "usercon.h"
+#include "relay.h"
 #include "../mpb.h"
 
 #include "../../WDL/rng.h"
@@ -92,12 +93,76 @@ static void type_to_string(unsigned int t, char *out)
 
 extern void logText(const char *s, ...);
 
+void GetConnectionAddrStr(JNL_IConnection *con, char *buf, int buflen)
+{
+  struct sockaddr_storage sa;
+  if (con && con->get_remote_addr(&sa)) JNL::sockaddr_to_ipstr((struct sockaddr *)&sa,buf,buflen);
+  else if (buflen > 0) buf[0]=0;
+}
+
 #define MAX_NICK_LEN 128 // not including null term
 
-#define TRANSFER_TIMEOUT 8
+int User_UpdateRemoteUsers(WDL_PtrList<User_RemoteUser> *list, Net_Message *msg, mpb_client_set_usermask *subscribe)
+{
+  mpb_server_userinfo_change_notify ucn;
+  if (ucn.parse(msg)) return 0;
+
+  int added=0;
+  int offs=0;
+  int a=0, cid=0, p=0, f=0;
+  short v=0;
+  const char *un=0, *chn=0;
+  while ((offs=ucn.parse_get_rec(offs,&a,&cid,&v,&p,&f,&un,&chn))>0)
+  {
+    if (!un || cid < 0 || cid >= MAX_USER_CHANNELS) continue;
+
+    int x;
+    for (x = 0; x < list->GetSize() && strcasecmp(list->Get(x)->username.Get(),un); x ++);
+    User_RemoteUser *ru=list->Get(x);
+    if (!ru)
+    {
+      if (!a) continue;
+      ru=new User_RemoteUser;
+      ru->username.Set(un);
+      list->Add(ru);
+      if (subscribe) subscribe->build_add_rec(un,~0u);
+      added++;
+    }
+
+    User_Channel *ch=ru->channels+cid;
+    ch->active=a;
+    ch->name.Set(chn?chn:"");
+    ch->volume=v;
+    ch->panning=p;
+    ch->flags=f;
+
+    if (!a)
+    {
+      // gone once it has no channels left
+      for (cid = 0; cid < MAX_USER_CHANNELS && !ru->channels[cid].active; cid ++);
+      if (cid == MAX_USER_CHANNELS) list->Delete(x,true);
+    }
+  }
+  return added;
+}
+
+void User_AddRemoteUsers(mpb_server_userinfo_change_notify *bh, WDL_PtrList<User_RemoteUser> *list, int active)
+{
+  int x, ch;
+  for (x = 0; x < list->GetSize(); x ++)
+  {
+    User_RemoteUser *ru=list->Get(x);
+    for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
+    {
+      User_Channel *c=ru->channels+ch;
+      if (c->active)
+        bh->build_add_rec(active,ch,c->volume,c->panning,c->flags,ru->username.Get(),c->name.Get());
+    }
+  }
+}
 
 User_Connection::User_Connection(JNL_IConnection *con, User_Group *grp) : m_auth_state(0), m_clientcaps(0), m_auth_privs(0), m_reserved(0), m_max_channels(0),
-      m_vote_bpm(0), m_vote_bpm_lasttime(0), m_vote_bpi(0), m_vote_bpi_lasttime(0)
+      m_vote_bpm(0), m_vote_bpm_lasttime(0), m_vote_bpi(0), m_vote_bpi_lasttime(0), m_userinfo_delta(false)
 {
   m_netcon.attach(con);
 
@@ -112,7 +177,7 @@ User_Connection::User_Connection(JNL_IConnection *con, User_Group *grp) : m_auth
 
   if (ka < 0)ka=0;
   else if (ka > 255) ka=255;
-  ch.server_caps=ka<<8;
+  ch.server_caps=(ka<<8) | SERVER_CAP_USERINFO_DELTA;
 
   if (grp->m_licensetext.Get()[0])
   {
@@ -125,6 +190,7 @@ User_Connection::User_Connection(JNL_IConnection *con, User_Group *grp) : m_auth
   time(&m_connect_time);
 
   m_lookup=0;
+  m_move_to=0;
 }
 
 
@@ -148,6 +214,7 @@ User_Connection::~User_Connection()
   for (x = 0; x < m_sendfiles.GetSize(); x ++)
     delete m_sendfiles.Get(x);
   m_sendfiles.Empty();
+  m_remote_users.Empty(true);
 
   delete m_lookup;
   m_lookup=0;
@@ -168,7 +235,7 @@ void User_Connection::SendConfigChangeNotify(int bpm, int bpi)
 int User_Connection::OnRunAuth(User_Group *group)
 {
   char addrbuf[256];
-  JNL::addr_to_ipstr(m_netcon.GetConnection()->get_remote(),addrbuf,sizeof(addrbuf));
+  GetConnectionAddrStr(m_netcon.GetConnection(),addrbuf,sizeof(addrbuf));
  
   {
     WDL_SHA1 shatmp;
@@ -234,6 +301,7 @@ int User_Connection::OnRunAuth(User_Group *group)
 
   m_auth_privs=m_lookup->privs;
   m_max_channels = m_lookup->max_channels;
+  if (m_auth_privs & PRIV_RELAY) m_auth_privs |= PRIV_HIDDEN;
 
   {
     // fix any invalid characters in username
@@ -273,6 +341,7 @@ int User_Connection::OnRunAuth(User_Group *group)
         }
         else
         {
+          group->ForgetConnection(u);
           delete u;
           group->m_users.Delete(user);
           break;
@@ -322,6 +391,7 @@ int User_Connection::OnRunAuth(User_Group *group)
   }
 
   m_auth_state=1;
+  m_userinfo_delta=!!(m_clientcaps & CLIENT_CAP_USERINFO_DELTA);
 
   SendConfigChangeNotify(group->m_last_bpm,group->m_last_bpi);
 
@@ -336,6 +406,7 @@ int User_Connection::OnRunAuth(User_Group *group)
     newmsg.parms[2]=group->m_topictext.Get();
     Send(newmsg.build());
   }
+  if (!(m_auth_privs & PRIV_RELAY))
   {
     mpb_chat_message newmsg;
     newmsg.parms[0]="JOIN";
@@ -349,32 +420,46 @@ int User_Connection::OnRunAuth(User_Group *group)
 // send user list to user
 void User_Connection::SendUserList(User_Group *group)
 {
+  if (m_userinfo_delta)
+  {
+    // comes with the next delta
+    int x;
+    for (x = 0; x < group->m_roster.GetSize(); x ++)
+      if (group->m_roster.Get(x)) group->MarkUserInfoDelta(x,~0u,this);
+    return;
+  }
+
   mpb_server_userinfo_change_notify bh;
+  group->AddUserInfo(&bh,this,false);
+  Send(bh.build());
+}
 
-  int user;
-  for (user = 0; user < group->m_users.GetSize(); user++)
+void User_Connection::SetSubscription(const char *username, unsigned int chmask)
+{
+  int x;
+  for (x = 0; x < m_sublist.GetSize() && strcasecmp(username,m_sublist.Get(x)->username.Get()); x ++);
+  if (x == m_sublist.GetSize()) // add new
   {
-    User_Connection *u=group->m_users.Get(user);
-    int channel;
-    if (u && u->m_auth_state>0 && u != this) 
+    if (chmask) // only add if we need to subscribe
     {
-      int acnt=0;
-      for (channel = 0; channel < u->m_max_channels && channel < MAX_USER_CHANNELS; channel ++)
-      {
-        if (u->m_channels[channel].active)
-        {
-          bh.build_add_rec(1,channel,u->m_channels[channel].volume,u->m_channels[channel].panning,u->m_channels[channel].flags,
-                            u->m_username.Get(),u->m_channels[channel].name.Get());
-          acnt++;
-        }
-      }
-      if (!acnt && !group->m_allow_hidden_users && u->m_max_channels && !(u->m_auth_privs & PRIV_HIDDEN)) // give users at least one channel
-      {
-          bh.build_add_rec(1,0,0,0,0,u->m_username.Get(),"");
-      }
+      User_SubscribeMask *n=new User_SubscribeMask;
+      n->username.Set(username);
+      n->channelmask = chmask;
+      m_sublist.Add(n);
     }
-  }       
-  Send(bh.build());
+  }
+  else
+  {
+    if (chmask) // update flag
+    {
+      m_sublist.Get(x)->channelmask=chmask;
+    }
+    else // remove
+    {
+      delete m_sublist.Get(x);
+      m_sublist.Delete(x);
+    }
+  }
 }
 
 
@@ -393,6 +478,13 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
     {
       if (!m_lookup || m_lookup->Run())
       {
+        if (m_lookup && m_lookup->group && m_lookup->group != group)
+        {
+          // the other group finishes the login
+          m_move_to=m_lookup->group;
+          m_lookup->group=0;
+          return 0;
+        }
         if (!m_lookup || !OnRunAuth(group))
         {
           m_netcon.Run();
@@ -408,7 +500,7 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
                                         // the user time to potentially read the license agreement.
       {
         char buf[256];
-        JNL::addr_to_ipstr(m_netcon.GetConnection()->get_remote(),buf,sizeof(buf));
+        GetConnectionAddrStr(m_netcon.GetConnection(),buf,sizeof(buf));
         logText("%s: Got an authorization timeout\n",buf);
         m_connect_time=time(NULL)+120;
         mpb_server_auth_reply bh;
@@ -440,7 +532,7 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
       bh.errmsg=tab[err_st-1];
 
       char addrbuf[256];
-      JNL::addr_to_ipstr(m_netcon.GetConnection()->get_remote(),addrbuf,sizeof(addrbuf));
+      GetConnectionAddrStr(m_netcon.GetConnection(),addrbuf,sizeof(addrbuf));
 
       logText("%s: Refusing user, %s\n",addrbuf,bh.errmsg);
 
@@ -463,7 +555,7 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
     if (m_lookup)
     {
       char addrbuf[256];
-      JNL::addr_to_ipstr(m_netcon.GetConnection()->get_remote(),addrbuf,sizeof(addrbuf));
+      GetConnectionAddrStr(m_netcon.GetConnection(),addrbuf,sizeof(addrbuf));
       m_lookup->hostmask.Set(addrbuf);
       memcpy(m_lookup->sha1buf_request,authrep.passhash,sizeof(m_lookup->sha1buf_request));
     }
@@ -556,7 +648,7 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
             }
 
 
-            if (mfmt_changes) group->Broadcast(mfmt.build(),this);
+            if (mfmt_changes) group->BroadcastUserInfo(mfmt.build(),this);
           }         
         }
       break;
@@ -570,33 +662,24 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
             unsigned int fla=0;
             while ((offs=umi.parse_get_rec(offs,&unp,&fla))>0)
             {
-              if (unp)
-              {
-                int x;
-                for (x = 0; x < m_sublist.GetSize() && strcasecmp(unp,m_sublist.Get(x)->username.Get()); x ++);
-                if (x == m_sublist.GetSize()) // add new
-                {
-                  if (fla) // only add if we need to subscribe
-                  {
-                    User_SubscribeMask *n=new User_SubscribeMask;
-                    n->username.Set(unp);
-                    n->channelmask = fla;
-                    m_sublist.Add(n);
-                  }
-                }
-                else
-                {
-                  if (fla) // update flag
-                  {
-                    m_sublist.Get(x)->channelmask=fla;
-                  }
-                  else // remove
-                  {
-                    delete m_sublist.Get(x);
-                    m_sublist.Delete(x);
-                  }
-                }
-              }
+              if (unp) SetSubscription(unp,fla);
+            }
+          }
+        }
+      break;
+      case MESSAGE_CLIENT_SET_USERMASK_ID:
+        {
+          mpb_client_set_usermask_id umi;
+          if (m_userinfo_delta && !umi.parse(msg))
+          {
+            int offs=0;
+            int id=0;
+            unsigned int fla=0;
+            while ((offs=umi.parse_get_rec(offs,&id,&fla))>0)
+            {
+              // only for the user this client was told about, the id may have been given to somebody else since
+              User_RosterEntry *e=group->m_roster.Get(id);
+              if (e && id < m_delta.GetSize() && m_delta.Get()[id].serial == e->serial) SetSubscription(e->username.Get(),fla);
             }
           }
         }
@@ -606,163 +689,52 @@ int User_Connection::Run(User_Group *group, int *wantsleep)
           mpb_client_upload_interval_begin mp;
           if (!mp.parse(msg) && mp.chidx < m_max_channels)
           {
-            char *myusername=m_username.Get();
-
             mpb_server_download_interval_begin nmb;
             nmb.chidx=mp.chidx;
             nmb.estsize=mp.estsize;
             nmb.fourcc=mp.fourcc;
             memcpy(nmb.guid,mp.guid,sizeof(nmb.guid));
-            nmb.username = myusername;
+            nmb.username = m_username.Get();
 
             Net_Message *newmsg=nmb.build();
             newmsg->addRef();
-                    
-            static unsigned char zero_guid[16];
-
-
-            if (mp.fourcc && memcmp(mp.guid,zero_guid,sizeof(zero_guid))) // zero = silence, so simply rebroadcast
-            {
-              User_TransferState *newrecv=new User_TransferState;
-              newrecv->bytes_estimated=mp.estsize;
-              newrecv->fourcc=mp.fourcc;
-              memcpy(newrecv->guid,mp.guid,sizeof(newrecv->guid));
-
-              if (group->m_logdir.Get()[0])
-              {
-                char fn[512];
-                char guidstr[64];
-                guidtostr(mp.guid,guidstr);
-
-                char ext[8];
-                type_to_string(mp.fourcc,ext);
-                sprintf(fn,"%c/%s.%s",guidstr[0],guidstr,ext);
-
-                WDL_String tmp(group->m_logdir.Get());                
-                tmp.Append(fn);
-
-                newrecv->fp = fopen(tmp.Get(),"wb");
-
-                if (group->m_logfp)
-                {
-                  // decide when to write new interval
-                  const char *chn="?";
-                  if (mp.chidx >= 0 && mp.chidx < MAX_USER_CHANNELS) chn=m_channels[mp.chidx].name.Get();
-                  fprintf(group->m_logfp,"user %s \"%s\" %d \"%s\"\n",guidstr,myusername,mp.chidx,chn);
-                }
-              }
-            
-              m_recvfiles.Add(newrecv);
-            }
-
-
-            int user;
-            for (user=0;user<group->m_users.GetSize(); user++)
-            {
-              User_Connection *u=group->m_users.Get(user);
-              if (u && u != this)
-              {
-                int i;
-                for (i=0; i < u->m_sublist.GetSize(); i ++)
-                {
-                  User_SubscribeMask *sm=u->m_sublist.Get(i);
-                  if (!strcasecmp(sm->username.Get(),myusername))
-                  {
-                    if (sm->channelmask & (1<<mp.chidx))
-                    {
-                      if (memcmp(mp.guid,zero_guid,sizeof(zero_guid))) // zero = silence, so simply rebroadcast
-                      {
-                        // add entry in send list
-                        User_TransferState *nt=new User_TransferState;
-                        memcpy(nt->guid,mp.guid,sizeof(nt->guid));
-                        nt->bytes_estimated = mp.estsize;
-                        nt->fourcc = mp.fourcc;
-                        u->m_sendfiles.Add(nt);
-                      }
-
-                      u->Send(newmsg);
-                    }
-                    break;
-                  }
-                }
-              }
-            }
+            group->OnIntervalBegin(this,&m_recvfiles,newmsg,&nmb,
+                mp.chidx >= 0 && mp.chidx < MAX_USER_CHANNELS ? m_channels[mp.chidx].name.Get() : "?");
             newmsg->releaseRef();
           }
         }
         //m_recvfiles
       break;
-      case MESSAGE_CLIENT_UPLOAD_INTERVAL_WRITE:
+      case MESSAGE_SERVER_DOWNLOAD_INTERVAL_BEGIN: // from a relay, on behalf of one of its users
+        if (m_auth_privs & PRIV_RELAY)
         {
-          mpb_client_upload_interval_write mp;
-          if (!mp.parse(msg))
+          mpb_server_download_interval_begin mp;
+          if (!mp.parse(msg) && mp.username && mp.chidx >= 0 && mp.chidx < MAX_USER_CHANNELS)
           {
-            time_t now;
-            time(&now);
-            msg->set_type(MESSAGE_SERVER_DOWNLOAD_INTERVAL_WRITE); // we rely on the fact that the upload/download write messages are identical
-                                                                   // though we may need to update this at a later date if we change things.
-
-            int user,x;
-
-
-            for (x = 0; x < m_recvfiles.GetSize(); x ++)
-            {
-              User_TransferState *t=m_recvfiles.Get(x);
-              if (!memcmp(t->guid,mp.guid,sizeof(mp.guid)))
-              {
-                t->last_acttime=now;
-
-                if (t->fp) fwrite(mp.audio_data,1,mp.audio_data_len,t->fp);
-
-                t->bytes_sofar+=mp.audio_data_len;
-                if (mp.flags & 1)
-                {
-                  delete t;
-                  m_recvfiles.Delete(x);
-                }
-                break;
-              }
-              if (now-t->last_acttime > TRANSFER_TIMEOUT)
-              {
-                delete t;
-                m_recvfiles.Delete(x--);
-              }
-            }
-
-
-            for (user=0;user<group->m_users.GetSize(); user++)
-            {
-              User_Connection *u=group->m_users.Get(user);
-              if (u && u != this)
-              {
-                int i;
-                for (i=0; i < u->m_sendfiles.GetSize(); i ++)
-                {
-                  User_TransferState *t=u->m_sendfiles.Get(i);
-                  if (t && !memcmp(t->guid,mp.guid,sizeof(t->guid)))
-                  {
-                    t->last_acttime=now;
-                    t->bytes_sofar += mp.audio_data_len;
-                    u->Send(msg);
-                    if (mp.flags & 1)
-                    {
-                      delete t;
-                      u->m_sendfiles.Delete(i);
-                      // remove from transfer list
-                    }
-                    break;
-                  }
-                  if (now-t->last_acttime > TRANSFER_TIMEOUT)
-                  {
-                    delete t;
-                    u->m_sendfiles.Delete(i--);
-                  }
-                }
-              }
-            }
+            int x;
+            for (x = 0; x < m_remote_users.GetSize() && strcasecmp(m_remote_users.Get(x)->username.Get(),mp.username); x ++);
+            if (x < m_remote_users.GetSize())
+              group->OnIntervalBegin(this,&m_recvfiles,msg,&mp,m_remote_users.Get(x)->channels[mp.chidx].name.Get());
           }
         }
       break;
+      case MESSAGE_CLIENT_UPLOAD_INTERVAL_WRITE:
+      case MESSAGE_SERVER_DOWNLOAD_INTERVAL_WRITE: // relays send their users' intervals as server messages
+        if (msg->get_type() == MESSAGE_CLIENT_UPLOAD_INTERVAL_WRITE || (m_auth_privs & PRIV_RELAY))
+        {
+          msg->set_type(MESSAGE_SERVER_DOWNLOAD_INTERVAL_WRITE); // we rely on the fact that the upload/download write messages are identical
+                                                                 // though we may need to update this at a later date if we change things.
+          mpb_server_download_interval_write mp;
+          if (!mp.parse(msg)) group->OnIntervalWrite(this,&m_recvfiles,msg,&mp);
+        }
+      break;
+      case MESSAGE_SERVER_USERINFO_CHANGE_NOTIFY: // a relay's users changed their channels
+        if (m_auth_privs & PRIV_RELAY)
+        {
+          User_UpdateRemoteUsers(&m_remote_users,msg);
+          group->BroadcastUserInfo(msg,this);
+        }
+      break;
 
       case MESSAGE_CHAT_MESSAGE:
         {
@@ -790,8 +762,12 @@ User_Group::User_Group() : m_max_users(0), m_last_bpm(120), m_last_bpi(32), m_ke
 
 {
   m_logfp = NULL;
+  m_relay = NULL;
   CreateUserLookup=0;
   memset(&m_next_loop_time,0,sizeof(m_next_loop_time));
+  m_roster_serial=0;
+  m_delta_pending=false;
+  memset(&m_delta_flush_time,0,sizeof(m_delta_flush_time));
 }
 
 User_Group::~User_Group()
@@ -802,6 +778,10 @@ User_Group::~User_Group()
     delete m_users.Get(x);
   }
   m_users.Empty();
+  m_moved_out.Empty(true);
+  m_roster.Empty(true);
+  delete m_relay;
+  m_relay=0;
   if (m_logfp) fclose(m_logfp);
   m_logfp=0;
 }
@@ -911,15 +891,25 @@ int User_Group::Run()
       if (p)
       {
         int ret=p->Run(this,&wantsleep);
+        if (!ret && p->m_move_to)
+        {
+          m_users.Delete(thispos);
+          m_moved_out.Add(p);
+          x--;
+          continue;
+        }
         if (ret)
         {
           // broadcast to other users that this user is no longer present
           if (p->m_auth_state>0) 
           {
-            mpb_chat_message newmsg;
-            newmsg.parms[0]="PART";
-            newmsg.parms[1]=p->m_username.Get();
-            Broadcast(newmsg.build(),p);
+            if (!(p->m_auth_privs & PRIV_RELAY))
+            {
+              mpb_chat_message newmsg;
+              newmsg.parms[0]="PART";
+              newmsg.parms[1]=p->m_username.Get();
+              Broadcast(newmsg.build(),p);
+            }
 
             mpb_server_userinfo_change_notify mfmt;
             int mfmt_changes=0;
@@ -944,11 +934,19 @@ int User_Group::Run()
               whichch++;
             }
 
-            if (mfmt_changes) Broadcast(mfmt.build(),p);
+            // and the users behind it, if it was a relay
+            if (p->m_remote_users.GetSize())
+            {
+              User_AddRemoteUsers(&mfmt,&p->m_remote_users,0);
+              mfmt_changes++;
+            }
+
+            if (mfmt_changes) BroadcastUserInfo(mfmt.build(),p);
           }
+          ForgetConnection(p);
 
           char addrbuf[256];
-          JNL::addr_to_ipstr(p->m_netcon.GetConnection()->get_remote(),addrbuf,sizeof(addrbuf));
+          GetConnectionAddrStr(p->m_netcon.GetConnection(),addrbuf,sizeof(addrbuf));
 
           logText("%s: disconnected (username:'%s', code=%d)\n",addrbuf,p->m_auth_state>0?p->m_username.Get():"",ret);
 
@@ -960,9 +958,408 @@ int User_Group::Run()
     }
     m_run_robin++;
 
+    if (m_relay) m_relay->Run(this,&wantsleep);
+
+    if (m_delta_pending)
+    {
+#ifdef _WIN32
+      if ((int)(now - m_delta_flush_time) >= 0)
+#else
+      if (now.tv_sec > m_delta_flush_time.tv_sec || 
+          (now.tv_sec == m_delta_flush_time.tv_sec && now.tv_usec >= m_delta_flush_time.tv_usec))
+#endif
+        FlushUserInfoDelta();
+    }
+
     return wantsleep;
 }
 
+void User_Group::OnIntervalBegin(User_Connection *src, WDL_PtrList<User_TransferState> *recvlist, Net_Message *msg, mpb_server_download_interval_begin *info, const char *channame)
+{
+  static unsigned char zero_guid[16];
+
+  if (info->fourcc && memcmp(info->guid,zero_guid,sizeof(zero_guid))) // zero = silence, so simply rebroadcast
+  {
+    User_TransferState *newrecv=new User_TransferState;
+    newrecv->bytes_estimated=info->estsize;
+    newrecv->fourcc=info->fourcc;
+    memcpy(newrecv->guid,info->guid,sizeof(newrecv->guid));
+
+    if (m_logdir.Get()[0])
+    {
+      char fn[512];
+      char guidstr[64];
+      guidtostr(info->guid,guidstr);
+
+      char ext[8];
+      type_to_string(info->fourcc,ext);
+      sprintf(fn,"%c/%s.%s",guidstr[0],guidstr,ext);
+
+      WDL_String tmp(m_logdir.Get());                
+      tmp.Append(fn);
+
+      newrecv->fp = fopen(tmp.Get(),"wb");
+
+      if (m_logfp)
+      {
+        // decide when to write new interval
+        fprintf(m_logfp,"user %s \"%s\" %d \"%s\"\n",guidstr,info->username,info->chidx,channame?channame:"?");
+      }
+    }
+  
+    recvlist->Add(newrecv);
+  }
+
+  int user;
+  for (user=0;user<m_users.GetSize(); user++)
+  {
+    User_Connection *u=m_users.Get(user);
+    if (u && u != src)
+    {
+      int i;
+      for (i=0; i < u->m_sublist.GetSize(); i ++)
+      {
+        User_SubscribeMask *sm=u->m_sublist.Get(i);
+        if (!strcasecmp(sm->username.Get(),info->username))
+        {
+          if (sm->channelmask & (1<<info->chidx))
+          {
+            if (memcmp(info->guid,zero_guid,sizeof(zero_guid))) // zero = silence, so simply rebroadcast
+            {
+              // add entry in send list
+              User_TransferState *nt=new User_TransferState;
+              memcpy(nt->guid,info->guid,sizeof(nt->guid));
+              nt->bytes_estimated = info->estsize;
+              nt->fourcc = info->fourcc;
+              u->m_sendfiles.Add(nt);
+            }
+
+            u->Send(msg);
+          }
+          break;
+        }
+      }
+    }
+  }
+
+  if (m_relay && src) m_relay->OnLocalIntervalBegin(msg,info);
+}
+
+void User_Group::OnIntervalWrite(User_Connection *src, WDL_PtrList<User_TransferState> *recvlist, Net_Message *msg, mpb_server_download_interval_write *info)
+{
+  time_t now;
+  time(&now);
+
+  int user,x;
+
+  for (x = 0; x < recvlist->GetSize(); x ++)
+  {
+    User_TransferState *t=recvlist->Get(x);
+    if (!memcmp(t->guid,info->guid,sizeof(info->guid)))
+    {
+      t->last_acttime=now;
+
+      if (t->fp) fwrite(info->audio_data,1,info->audio_data_len,t->fp);
+
+      t->bytes_sofar+=info->audio_data_len;
+      if (info->flags & 1)
+      {
+        delete t;
+        recvlist->Delete(x);
+      }
+      break;
+    }
+    if (now-t->last_acttime > TRANSFER_TIMEOUT)
+    {
+      delete t;
+      recvlist->Delete(x--);
+    }
+  }
+
+
+  for (user=0;user<m_users.GetSize(); user++)
+  {
+    User_Connection *u=m_users.Get(user);
+    if (u && u != src)
+    {
+      int i;
+      for (i=0; i < u->m_sendfiles.GetSize(); i ++)
+      {
+        User_TransferState *t=u->m_sendfiles.Get(i);
+        if (t && !memcmp(t->guid,info->guid,sizeof(t->guid)))
+        {
+          t->last_acttime=now;
+          t->bytes_sofar += info->audio_data_len;
+          u->Send(msg);
+          if (info->flags & 1)
+          {
+            delete t;
+            u->m_sendfiles.Delete(i);
+            // remove from transfer list
+          }
+          break;
+        }
+        if (now-t->last_acttime > TRANSFER_TIMEOUT)
+        {
+          delete t;
+          u->m_sendfiles.Delete(i--);
+        }
+      }
+    }
+  }
+
+  if (m_relay && src) m_relay->OnLocalIntervalWrite(msg,info);
+}
+
+void User_Group::BroadcastUserInfo(Net_Message *msg, User_Connection *src)
+{
+  if (!msg) return;
+  msg->addRef();
+  UpdateUserInfo(msg,src);
+  if (m_relay) m_relay->OnLocalUserInfo(msg);
+  msg->releaseRef();
+}
+
+void User_Group::UpdateUserInfo(Net_Message *msg, User_Connection *src)
+{
+  if (!msg) return;
+  msg->addRef();
+
+  mpb_server_userinfo_change_notify ucn;
+  if (!ucn.parse(msg))
+  {
+    int offs=0;
+    int a=0, cid=0, p=0, f=0;
+    short v=0;
+    const char *un=0, *chn=0;
+    while ((offs=ucn.parse_get_rec(offs,&a,&cid,&v,&p,&f,&un,&chn))>0)
+    {
+      if (!un || cid < 0 || cid >= MAX_USER_CHANNELS) continue;
+
+      User_RosterEntry *e=FindRosterEntry(un);
+      if (!e)
+      {
+        if (!a) continue;
+
+        int id;
+        for (id = 0; id < m_roster.GetSize() && m_roster.Get(id); id ++);
+        if (id > 0xffff) continue;
+
+        e=new User_RosterEntry;
+        e->id=id;
+        if (!++m_roster_serial) ++m_roster_serial;
+        e->serial=m_roster_serial;
+        e->username.Set(un);
+        if (id < m_roster.GetSize()) m_roster.Set(id,e);
+        else m_roster.Add(e);
+      }
+      e->owner=src;
+
+      User_Channel *ch=e->channels+cid;
+      ch->active=a;
+      ch->name.Set(chn?chn:"");
+      ch->volume=v;
+      ch->panning=p;
+      ch->flags=f;
+      if (a) e->activemask |= 1u<<cid;
+      else e->activemask &= ~(1u<<cid);
+
+      MarkUserInfoDelta(e->id,1u<<cid);
+
+      if (!e->activemask) // gone once it has no channels left
+      {
+        m_roster.Set(e->id,NULL);
+        while (m_roster.GetSize() && !m_roster.Get(m_roster.GetSize()-1)) m_roster.Delete(m_roster.GetSize()-1);
+        delete e;
+      }
+    }
+  }
+
+  int x;
+  for (x = 0; x < m_users.GetSize(); x ++)
+  {
+    User_Connection *u=m_users.Get(x);
+    if (u && u->m_auth_state > 0 && u != src && !u->m_userinfo_delta) u->Send(msg);
+  }
+
+  msg->releaseRef();
+}
+
+User_RosterEntry *User_Group::FindRosterEntry(const char *username)
+{
+  int x;
+  for (x = 0; x < m_roster.GetSize(); x ++)
+  {
+    User_RosterEntry *e=m_roster.Get(x);
+    if (e && !strcasecmp(e->username.Get(),username)) return e;
+  }
+  return NULL;
+}
+
+void User_Group::MarkUserInfoDelta(int id, unsigned int chmask, User_Connection *only)
+{
+  int x;
+  for (x = 0; x < m_users.GetSize(); x ++)
+  {
+    User_Connection *u=m_users.Get(x);
+    if (!u || u->m_auth_state <= 0 || !u->m_userinfo_delta || (only && u != only)) continue;
+
+    const int oldsz=u->m_delta.GetSize();
+    if (id >= oldsz)
+    {
+      if (!u->m_delta.ResizeOK(id+1,false)) continue;
+      memset(u->m_delta.Get()+oldsz,0,(id+1-oldsz)*sizeof(User_DeltaState));
+    }
+    u->m_delta.Get()[id].dirty |= chmask;
+
+    if (!m_delta_pending)
+    {
+      // send USERINFO_DELTA_DELAY after the first change, so that a burst goes out as one message
+      m_delta_pending=true;
+#ifdef _WIN32
+      m_delta_flush_time=GetTickCount()+USERINFO_DELTA_DELAY;
+#else
+      gettimeofday(&m_delta_flush_time,NULL);
+      m_delta_flush_time.tv_usec += USERINFO_DELTA_DELAY*1000;
+      if (m_delta_flush_time.tv_usec >= 1000000)
+      {
+        m_delta_flush_time.tv_sec += 1;
+        m_delta_flush_time.tv_usec -= 1000000;
+      }
+#endif
+    }
+  }
+}
+
+void User_Group::FlushUserInfoDelta()
+{
+  m_delta_pending=false;
+
+  int x;
+  for (x = 0; x < m_users.GetSize(); x ++)
+  {
+    User_Connection *u=m_users.Get(x);
+    if (!u || u->m_auth_state <= 0 || !u->m_userinfo_delta) continue;
+
+    mpb_server_userinfo_delta bh;
+    User_DeltaState *s=u->m_delta.Get();
+    int id;
+    for (id = 0; id < u->m_delta.GetSize(); id ++, s ++)
+    {
+      if (!s->dirty) continue;
+
+      User_RosterEntry *e=m_roster.Get(id);
+      if (e && e->owner == u) e=NULL; // nobody is told about themselves
+
+      if (s->serial && (!e || e->serial != s->serial))
+      {
+        bh.build_remove_user(id);
+        s->serial=0;
+        s->activemask=0;
+      }
+      if (e)
+      {
+        unsigned int dirty=s->dirty;
+        if (!s->serial)
+        {
+          bh.build_add_user(id,e->username.Get());
+          s->serial=e->serial;
+          dirty=~0u;
+        }
+
+        int ch;
+        for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
+        {
+          const unsigned int bit=1u<<ch;
+          if (!(dirty & bit)) continue;
+
+          if (e->activemask & bit)
+          {
+            User_Channel *c=e->channels+ch;
+            bh.build_set_channel(id,ch,c->volume,c->panning,c->flags,c->name.Get());
+            s->activemask |= bit;
+          }
+          else if (s->activemask & bit)
+          {
+            bh.build_remove_channel(id,ch);
+            s->activemask &= ~bit;
+          }
+        }
+      }
+      s->dirty=0;
+    }
+
+    if (bh.has_recs()) u->Send(bh.build());
+  }
+}
+
+void User_Group::ForgetConnection(User_Connection *con)
+{
+  // users still announced on behalf of con (normally its disconnect removed them) are gone too
+  mpb_server_userinfo_change_notify mfmt;
+  int cnt=0;
+  int x, ch;
+  for (x = 0; x < m_roster.GetSize(); x ++)
+  {
+    User_RosterEntry *e=m_roster.Get(x);
+    if (e && e->owner == con)
+    {
+      for (ch = 0; ch < MAX_USER_CHANNELS; ch ++)
+      {
+        User_Channel *c=e->channels+ch;
+        if (c->active)
+        {
+          mfmt.build_add_rec(0,ch,c->volume,c->panning,c->flags,e->username.Get(),"");
+          cnt++;
+        }
+      }
+    }
+  }
+  if (cnt) BroadcastUserInfo(mfmt.build(),con);
+}
+
+void User_Group::AddUserInfo(mpb_server_userinfo_change_notify *bh, User_Connection *skip, bool local_only)
+{
+  int user;
+  for (user = 0; user < m_users.GetSize(); user++)
+  {
+    User_Connection *u=m_users.Get(user);
+    int channel;
+    if (u && u->m_auth_state>0 && u != skip) 
+    {
+      int acnt=0;
+      for (channel = 0; channel < u->m_max_channels && channel < MAX_USER_CHANNELS; channel ++)
+      {
+        if (u->m_channels[channel].active)
+        {
+          bh->build_add_rec(1,channel,u->m_channels[channel].volume,u->m_channels[channel].panning,u->m_channels[channel].flags,
+                            u->m_username.Get(),u->m_channels[channel].name.Get());
+          acnt++;
+        }
+      }
+      if (!acnt && !m_allow_hidden_users && u->m_max_channels && !(u->m_auth_privs & PRIV_HIDDEN)) // give users at least one channel
+      {
+          bh->build_add_rec(1,0,0,0,0,u->m_username.Get(),"");
+      }
+
+      User_AddRemoteUsers(bh,&u->m_remote_users,1);
+    }
+  }       
+  if (m_relay && !local_only) User_AddRemoteUsers(bh,&m_relay->m_users,1);
+}
+
+void User_Group::SetRelay(User_Relay *relay)
+{
+  if (m_relay && m_relay->m_users.GetSize())
+  {
+    mpb_server_userinfo_change_notify mfmt;
+    User_AddRemoteUsers(&mfmt,&m_relay->m_users,0);
+    UpdateUserInfo(mfmt.build(),NULL);
+  }
+  delete m_relay;
+  m_relay=relay;
+}
+
 void User_Group::SetConfig(int bpi, int bpm)
 {
   m_last_bpi=bpi;
@@ -984,9 +1381,32 @@ void User_Group::onChatMessage(User_Connection *con, mpb_chat_message *msg)
 {
   if (!strcmp(msg->parms[0],"MSG")) // chat message
   {
+    if (con->m_auth_privs & PRIV_RELAY) // from a user of the relay, MSG <text> <username>
+    {
+      if (msg->parms[1] && *msg->parms[1] && msg->parms[2] && *msg->parms[2])
+      {
+        mpb_chat_message newmsg;
+        newmsg.parms[0]="MSG";
+        newmsg.parms[1]=msg->parms[2];
+        newmsg.parms[2]=msg->parms[1];
+        Broadcast(newmsg.build(),con);
+        if (m_relay) m_relay->OnLocalChat(msg->parms[2],msg->parms[1]);
+      }
+      return;
+    }
+
     WDL_PtrList<Net_Message> need_bcast;
     if (msg->parms[1] && !strncmp(msg->parms[1],"!vote",5)) // chat message
     {
+      if (m_relay)
+      {
+        mpb_chat_message newmsg;
+        newmsg.parms[0]="MSG";
+        newmsg.parms[1]="";
+        newmsg.parms[2]="[voting system] Voting is done on the origin server";
+        con->Send(newmsg.build());
+        return;
+      }
       if (!(con->m_auth_privs & PRIV_VOTE) || m_voting_threshold > 100 || m_voting_threshold < 1)
       {
         mpb_chat_message newmsg;
@@ -1135,6 +1555,7 @@ void User_Group::onChatMessage(User_Connection *con, mpb_chat_message *msg)
       newmsg.parms[1]=con->m_username.Get();
       newmsg.parms[2]=msg->parms[1];
       Broadcast(newmsg.build());
+      if (m_relay) m_relay->OnLocalChat(con->m_username.Get(),msg->parms[1]);
     }
     int x;
     for (x = 0; x < need_bcast.GetSize(); x ++)
@@ -1194,7 +1615,15 @@ void User_Group::onChatMessage(User_Connection *con, mpb_chat_message *msg)
     const char *adminerr="ADMIN requires valid parameter, i.e. topic, kick, bpm, bpi";
     if (msg->parms[1] && *msg->parms[1])
     {
-      if (!strncasecmp(msg->parms[1],"topic ",6))
+      if (m_relay && strncasecmp(msg->parms[1],"kick ",5))
+      {
+        mpb_chat_message newmsg;
+        newmsg.parms[0]="MSG";
+        newmsg.parms[1]="";
+        newmsg.parms[2]="Topic and BPM/BPI are set on the origin server";
+        con->Send(newmsg.build());
+      }
+      else if (!strncasecmp(msg->parms[1],"topic ",6))
       {
         if (!(con->m_auth_privs & PRIV_TOPIC))
         {
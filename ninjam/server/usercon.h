@@ -37,6 +37,7 @@
 #include "../../WDL/wdlstring.h"
 #include "../../WDL/sha.h"
 #include "../../WDL/ptrlist.h"
+#include "../../WDL/heapbuf.h"
 #include "../mpb.h"
 
 #define MAX_USER_CHANNELS 32
@@ -52,16 +53,24 @@
 #define PRIV_ALLOWMULTI 32 // allows multiple users by the same name (subsequent users append -X to them)
 #define PRIV_HIDDEN 64   // hidden user, doesn't count for a slot, too
 #define PRIV_VOTE 128
+#define PRIV_RELAY 256   // edge server relaying its own users (see relay.h), hidden itself
 
 #define MAX_BPM 400
 #define MAX_BPI 64
 #define MIN_BPM 40
 #define MIN_BPI 2
 
+#define TRANSFER_TIMEOUT 8
+
+#define USERINFO_DELTA_DELAY 50 // ms, userinfo changes are collected this long for MESSAGE_SERVER_USERINFO_DELTA clients
+
+class User_Group;
+class User_Relay;
+
 class IUserInfoLookup // abstract base class, overridden by server
 {
 public:
-  IUserInfoLookup() { is_status=0; user_valid=0; reqpass=1; privs=0; max_channels=0; }
+  IUserInfoLookup() { is_status=0; user_valid=0; reqpass=1; privs=0; max_channels=0; group=0; }
   virtual ~IUserInfoLookup() { }
 
   virtual int Run()=0; // return 1 if run is complete, 0 if still needs to run more
@@ -76,12 +85,19 @@ public:
   WDL_String hostmask;
   WDL_String username; // can modify this to change the username
 
+  User_Group *group; // if set when Run() completes, the connection moves to this group, which runs the lookup again
+
 
   unsigned char sha1buf_request[WDL_SHA1SIZE]; // don't use, internal for User_Connection
 };
 
 
 class User_Connection;
+class User_RemoteUser;
+class User_TransferState;
+class User_RosterEntry;
+
+void GetConnectionAddrStr(JNL_IConnection *con, char *buf, int buflen); // numeric remote address of con (IPv4 or IPv6)
 
 class User_Group
 {
@@ -106,8 +122,36 @@ class User_Group
 
     void onChatMessage(User_Connection *con, mpb_chat_message *msg);
 
+    // routes an interval from username (src, a user behind src if it is a relay, or
+    // the origin if src is NULL) to its subscribers and the session archive.
+    // recvlist tracks the upload for OnIntervalWrite()
+    void OnIntervalBegin(User_Connection *src, WDL_PtrList<User_TransferState> *recvlist, Net_Message *msg, mpb_server_download_interval_begin *info, const char *channame);
+    void OnIntervalWrite(User_Connection *src, WDL_PtrList<User_TransferState> *recvlist, Net_Message *msg, mpb_server_download_interval_write *info);
+
+    // userinfo change of a local user, also passed on to the origin if relaying
+    void BroadcastUserInfo(Net_Message *msg, User_Connection *src);
+    // userinfo change from src (NULL for the origin's users): updates m_roster, sends msg to
+    // everybody but src and queues the change for MESSAGE_SERVER_USERINFO_DELTA clients
+    void UpdateUserInfo(Net_Message *msg, User_Connection *src);
+    // adds the channels of everybody but skip (and, if local_only, only users connected here)
+    void AddUserInfo(mpb_server_userinfo_change_notify *bh, User_Connection *skip, bool local_only);
+
+    void SetRelay(User_Relay *relay); // takes ownership, NULL to stop relaying
+
 
     WDL_PtrList<User_Connection> m_users;
+    WDL_PtrList<User_Connection> m_moved_out; // connections Run() handed to another group (User_Connection::m_move_to), for the owner to pass on
+
+    // every user announced to the group's users, indexed by MESSAGE_SERVER_USERINFO_DELTA id (NULL for unused ids)
+    WDL_PtrList<User_RosterEntry> m_roster;
+    unsigned int m_roster_serial;
+    User_RosterEntry *FindRosterEntry(const char *username);
+    void MarkUserInfoDelta(int id, unsigned int chmask, User_Connection *only=NULL); // queues a change for delta clients
+    void FlushUserInfoDelta();
+    void ForgetConnection(User_Connection *con); // con is going away
+    bool m_delta_pending;
+
+    User_Relay *m_relay; // set if this group is an edge of another server
 
     int m_max_users;
     int m_last_bpm, m_last_bpi;
@@ -131,8 +175,10 @@ class User_Group
 
 #ifdef _WIN32
     DWORD m_next_loop_time;
+    DWORD m_delta_flush_time;
 #else
     struct timeval m_next_loop_time;
+    struct timeval m_delta_flush_time;
 #endif
 };
 
@@ -160,6 +206,46 @@ public:
 };
 
 
+// a user connected to another server: on an origin, a user of an edge (behind a
+// PRIV_RELAY connection); on an edge, a user of the origin
+class User_RemoteUser
+{
+public:
+  User_RemoteUser() { }
+  ~User_RemoteUser() { }
+  WDL_String username;
+  User_Channel channels[MAX_USER_CHANNELS];
+};
+
+// a user as the group's users know it, see User_Group::m_roster
+class User_RosterEntry
+{
+public:
+  User_RosterEntry() : id(0), serial(0), activemask(0), owner(NULL) { }
+  ~User_RosterEntry() { }
+  int id;
+  unsigned int serial; // tells apart users that got the same id
+  WDL_String username;
+  User_Channel channels[MAX_USER_CHANNELS];
+  unsigned int activemask;
+  User_Connection *owner; // the connection the user is (or is behind), which isn't told about it. NULL for the origin's users
+};
+
+// what a MESSAGE_SERVER_USERINFO_DELTA client has been told about a roster id
+struct User_DeltaState
+{
+  unsigned int serial; // 0 if nothing
+  unsigned int activemask;
+  unsigned int dirty; // channels changed since
+};
+
+// applies a userinfo change notify to list. users not seen before are added to
+// subscribe (if set) with all channels, returns the number added
+int User_UpdateRemoteUsers(WDL_PtrList<User_RemoteUser> *list, Net_Message *msg, mpb_client_set_usermask *subscribe=NULL);
+// adds the active channels in list to bh, as active or (to remove them) inactive
+void User_AddRemoteUsers(mpb_server_userinfo_change_notify *bh, WDL_PtrList<User_RemoteUser> *list, int active);
+
+
 class User_TransferState
 {
 public:
@@ -199,6 +285,7 @@ class User_Connection
     int OnRunAuth(User_Group *group);
 
     void SendUserList(User_Group *group);
+    void SetSubscription(const char *username, unsigned int chmask);
 
     Net_Connection m_netcon;
     WDL_String m_username;
@@ -228,6 +315,13 @@ class User_Connection
     WDL_PtrList<User_TransferState> m_sendfiles;
 
     IUserInfoLookup *m_lookup;
+
+    WDL_PtrList<User_RemoteUser> m_remote_users; // PRIV_RELAY only: the users of the edge
+
+    User_Group *m_move_to; // set when the lookup wants the connection moved to another group
+
+    bool m_userinfo_delta; // gets MESSAGE_SERVER_USERINFO_DELTA (CLIENT_CAP_USERINFO_DELTA)
+    WDL_TypedBuf<User_DeltaState> m_delta; // indexed by roster id
 };
 
 
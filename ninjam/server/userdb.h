@@ -0,0 +1,122 @@
+/*
+    NINJAM Server - userdb.h
+    Copyright (C) 2005-2017 Cockos Incorporated
+
+    NINJAM is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    NINJAM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NINJAM; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+
+  Account database for the server (the User lines of the config). Accounts
+  are hashed by name (FNV-1a, chained, the table doubles as it fills), so a
+  login lookup doesn't depend on how many accounts there are, and each entry
+  keeps SHA1(name:pass), which is all the login check needs, so nothing is
+  hashed per login.
+
+  A database is built once and then only read; the server builds a new one on
+  config reload and swaps it in.
+
+*/
+
+#ifndef _USERDB_H_
+#define _USERDB_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include "../../WDL/heapbuf.h"
+#include "../../WDL/ptrlist.h"
+#include "../../WDL/wdlstring.h"
+#include "../../WDL/sha.h"
+#include "../../WDL/fnv64.h"
+
+class UserPassEntry
+{
+public:
+  UserPassEntry(const char *user, const char *pass, unsigned int privs) : name(user)
+  {
+    priv_flag=privs;
+    next=NULL;
+
+    WDL_SHA1 shatmp;
+    shatmp.add(user,strlen(user));
+    shatmp.add(":",1);
+    shatmp.add(pass,strlen(pass));
+    shatmp.result(passhash);
+  }
+  ~UserPassEntry() {}
+
+  WDL_String name;
+  unsigned char passhash[WDL_SHA1SIZE]; // SHA1(name:pass)
+  unsigned int priv_flag;
+
+  UserPassEntry *next; // hash chain
+};
+
+
+class UserDatabase
+{
+public:
+  UserDatabase() { }
+  ~UserDatabase() { m_list.Empty(true); }
+
+  // returns false (and doesn't take e) if the name is already present, the first definition wins
+  bool Add(UserPassEntry *e)
+  {
+    if (Find(e->name.Get())) return false;
+    if (m_list.GetSize() >= m_buckets.GetSize()) Rehash(m_buckets.GetSize() ? m_buckets.GetSize()*2 : 64);
+    m_list.Add(e);
+    Link(e);
+    return true;
+  }
+
+  UserPassEntry *Find(const char *name)
+  {
+    const int sz=m_buckets.GetSize();
+    if (!sz) return NULL;
+    UserPassEntry *e=m_buckets.Get()[Hash(name) & (sz-1)];
+    while (e && strcmp(e->name.Get(),name)) e=e->next;
+    return e;
+  }
+
+  int GetSize() { return m_list.GetSize(); }
+
+private:
+  static unsigned int Hash(const char *name)
+  {
+    const WDL_UINT64 h=WDL_FNV64(WDL_FNV64_IV,(const unsigned char *)name,(int)strlen(name));
+    return (unsigned int)(h ^ (h>>32));
+  }
+
+  void Link(UserPassEntry *e)
+  {
+    UserPassEntry **b=m_buckets.Get() + (Hash(e->name.Get()) & (m_buckets.GetSize()-1));
+    e->next=*b;
+    *b=e;
+  }
+
+  void Rehash(int sz) // sz is a power of two
+  {
+    if (!m_buckets.ResizeOK(sz,false)) return;
+    memset(m_buckets.Get(),0,sz*sizeof(UserPassEntry *));
+    // relink in reverse so chains keep the order entries were added in
+    int x;
+    for (x = m_list.GetSize()-1; x >= 0; x --) Link(m_list.Get(x));
+  }
+
+  WDL_PtrList<UserPassEntry> m_list; // in config order
+  WDL_TypedBuf<UserPassEntry *> m_buckets;
+};
+
+#endif // _USERDB_H_
@@ -0,0 +1,559 @@
+/*
+  userinfo_delta_test.cpp
+  checks MESSAGE_SERVER_USERINFO_DELTA: mpb_server_userinfo_delta records read back as written
+  (random records, field clamping, and truncated messages yield only whole records), then runs a
+  User_Group over loopback with one CLIENT_CAP_USERINFO_DELTA client that keeps the roster the
+  deltas describe and checks it against the other users' channels as they change, leave and have
+  their ids reused. MESSAGE_CLIENT_SET_USERMASK_ID is only honoured for the user the client was
+  told about under that id, and a user dropped by a login of the same name (ForgetConnection) is
+  removed from the roster and from the delta client's view.
+
+  g++ -O2 -pthread -o userinfo_delta_test userinfo_delta_test.cpp usercon.cpp relay.cpp ../mpb.cpp \
+    ../netmsg.cpp ../../WDL/jnetlib/asyncdns.cpp ../../WDL/jnetlib/connection.cpp \
+    ../../WDL/jnetlib/listen.cpp ../../WDL/jnetlib/util.cpp ../../WDL/rng.cpp ../../WDL/sha.cpp
+  ./userinfo_delta_test [-v]
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "usercon.h"
+#include "../../WDL/jnetlib/jnetlib.h"
+#include "../../WDL/sha.h"
+
+static int g_fails;
+static bool g_verbose;
+
+void logText(const char *s, ...)
+{
+  if (!g_verbose) return;
+  va_list ap;
+  va_start(ap,s);
+  printf("  log: ");
+  vprintf(s,ap);
+  va_end(ap);
+}
+
+static void check(bool ok, const char *what)
+{
+  if (!ok) { g_fails++; printf("FAIL %s\n",what); }
+}
+
+static unsigned int g_rs=1;
+static unsigned int rnd() { g_rs=g_rs*1664525+1013904223; return g_rs>>8; }
+
+
+//////// the message format
+
+struct deltaRec
+{
+  int type, userid, channelid;
+  short volume;
+  int pan, flags;
+  char name[64];
+};
+
+static void randRec(deltaRec *r)
+{
+  memset(r,0,sizeof(*r));
+  r->type=USERINFO_DELTA_ADD_USER + rnd()%4;
+  r->userid=rnd()&0xffff;
+  if (r->type == USERINFO_DELTA_SET_CHANNEL || r->type == USERINFO_DELTA_REMOVE_CHANNEL) r->channelid=rnd()&0xff;
+  if (r->type == USERINFO_DELTA_SET_CHANNEL)
+  {
+    r->volume=(short)(rnd()&0xffff);
+    r->pan=(int)(rnd()&0xff)-128;
+    r->flags=rnd()&0xff;
+  }
+  if (r->type == USERINFO_DELTA_ADD_USER || r->type == USERINFO_DELTA_SET_CHANNEL)
+  {
+    const int l=rnd()%(sizeof(r->name)-1);
+    for (int x = 0; x < l; x ++) r->name[x]='a' + rnd()%26;
+  }
+}
+
+static void buildRec(mpb_server_userinfo_delta *b, const deltaRec *r)
+{
+  switch (r->type)
+  {
+    case USERINFO_DELTA_ADD_USER: b->build_add_user(r->userid,r->name); break;
+    case USERINFO_DELTA_REMOVE_USER: b->build_remove_user(r->userid); break;
+    case USERINFO_DELTA_SET_CHANNEL: b->build_set_channel(r->userid,r->channelid,r->volume,r->pan,r->flags,r->name); break;
+    case USERINFO_DELTA_REMOVE_CHANNEL: b->build_remove_channel(r->userid,r->channelid); break;
+  }
+}
+
+// reads msg back, returns the number of records that match want[] in order (-1 on a mismatch)
+static int readRecs(Net_Message *msg, const deltaRec *want, int nwant)
+{
+  mpb_server_userinfo_delta ud;
+  if (ud.parse(msg)) return 0;
+  int offs=0, n=0;
+  int t, id, cid=-1, pan=-1000, flags=-1;
+  short vol=0;
+  const char *name=NULL;
+  while ((offs=ud.parse_get_rec(offs,&t,&id,&cid,&vol,&pan,&flags,&name))>0)
+  {
+    if (n >= nwant) return -1;
+    const deltaRec *r=want+n;
+    if (t != r->type || id != r->userid) return -1;
+    if ((t == USERINFO_DELTA_SET_CHANNEL || t == USERINFO_DELTA_REMOVE_CHANNEL) && cid != r->channelid) return -1;
+    if (t == USERINFO_DELTA_SET_CHANNEL && (vol != r->volume || pan != r->pan || flags != r->flags)) return -1;
+    if ((t == USERINFO_DELTA_ADD_USER || t == USERINFO_DELTA_SET_CHANNEL) && (!name || strcmp(name,r->name))) return -1;
+    n++;
+  }
+  return n;
+}
+
+static void testCodec()
+{
+  const int fails0=g_fails;
+  const int NR=40;
+  deltaRec recs[NR];
+  int iter;
+  for (iter = 0; iter < 500; iter ++)
+  {
+    const int n=1 + rnd()%NR;
+    mpb_server_userinfo_delta b;
+    int x;
+    for (x = 0; x < n; x ++)
+    {
+      randRec(recs+x);
+      buildRec(&b,recs+x);
+    }
+    check(b.has_recs(),"has_recs() after adding records");
+    Net_Message *msg=b.build();
+    msg->addRef();
+
+    if (readRecs(msg,recs,n) != n)
+    {
+      if (g_fails++ < 10) printf("FAIL %d records don't read back as written (iteration %d)\n",n,iter);
+    }
+
+    // every truncation reads back as the whole records before the cut, and nothing else
+    const int sz=msg->get_size();
+    Net_Message *tr=new Net_Message;
+    tr->addRef();
+    tr->set_type(MESSAGE_SERVER_USERINFO_DELTA);
+    int cut, whole=0, wholeend=0;
+    for (cut = 1; cut < sz; cut ++)
+    {
+      tr->set_size(cut);
+      memcpy(tr->get_data(),msg->get_data(),cut);
+      // the end of the records that fit
+      while (whole < n)
+      {
+        const deltaRec *r=recs+whole;
+        int len=3;
+        if (r->type == USERINFO_DELTA_ADD_USER) len+=(int)strlen(r->name)+1;
+        else if (r->type == USERINFO_DELTA_SET_CHANNEL) len+=5+(int)strlen(r->name)+1;
+        else if (r->type == USERINFO_DELTA_REMOVE_CHANNEL) len+=1;
+        if (wholeend+len > cut) break;
+        wholeend+=len;
+        whole++;
+      }
+      if (readRecs(tr,recs,n) != whole)
+      {
+        if (g_fails++ < 10) printf("FAIL truncated to %d of %d bytes: read %d records, want %d\n",cut,sz,readRecs(tr,recs,n),whole);
+      }
+    }
+    tr->releaseRef();
+    msg->releaseRef();
+  }
+
+  // clamping, and an empty name
+  {
+    mpb_server_userinfo_delta b;
+    b.build_set_channel(7,300,-32768,200,0x1ff,NULL);
+    b.build_set_channel(7,-5,32767,-200,0,"");
+    b.build_add_user(0xffff,NULL);
+    Net_Message *msg=b.build();
+    msg->addRef();
+    mpb_server_userinfo_delta ud;
+    int offs=0, t=0, id=0, cid=0, pan=0, flags=0;
+    short vol=0;
+    const char *name=NULL;
+    check(!ud.parse(msg),"parse");
+    offs=ud.parse_get_rec(offs,&t,&id,&cid,&vol,&pan,&flags,&name);
+    check(offs > 0 && t == USERINFO_DELTA_SET_CHANNEL && id == 7 && cid == 255 && vol == -32768 && pan == 127 && flags == 0xff && name && !*name,
+          "channel id, pan and flags clamp to a byte, volume keeps its sign");
+    offs=ud.parse_get_rec(offs,&t,&id,&cid,&vol,&pan,&flags,&name);
+    check(offs > 0 && cid == 0 && vol == 32767 && pan == -128,"negative channel id and pan clamp");
+    offs=ud.parse_get_rec(offs,&t,&id,&cid,&vol,&pan,&flags,&name);
+    check(offs > 0 && t == USERINFO_DELTA_ADD_USER && id == 0xffff && name && !*name,"user id 65535, no name");
+    check(ud.parse_get_rec(offs,&t,&id,&cid,&vol,&pan,&flags,&name) <= 0,"end of records");
+    msg->releaseRef();
+
+    // an unknown record type ends the message (records can't be skipped)
+    Net_Message *bad=new Net_Message;
+    bad->addRef();
+    bad->set_type(MESSAGE_SERVER_USERINFO_DELTA);
+    bad->set_size(4);
+    memcpy(bad->get_data(),"\x09\x01\x00\x00",4);
+    mpb_server_userinfo_delta ud2;
+    check(!ud2.parse(bad) && ud2.parse_get_rec(0,&t,&id,&cid,&vol,&pan,&flags,&name) <= 0,"an unknown record type isn't read");
+    bad->set_type(MESSAGE_SERVER_USERINFO_CHANGE_NOTIFY);
+    check(ud2.parse(bad) != 0,"another message type doesn't parse");
+    bad->releaseRef();
+  }
+
+  if (g_fails == fails0) printf("ok   500 random delta messages and their truncations read back as written\n");
+}
+
+
+//////// a group over loopback
+
+static void passHash(const char *user, const char *pass, unsigned char *out)
+{
+  WDL_SHA1 sha;
+  sha.add(user,strlen(user));
+  sha.add(":",1);
+  sha.add(pass,strlen(pass));
+  sha.result(out);
+}
+
+class testUserLookup : public IUserInfoLookup // anybody, password "pw"
+{
+public:
+  testUserLookup(const char *name)
+  {
+    username.Set(name);
+    user_valid=1;
+    privs=PRIV_CHATSEND;
+    max_channels=MAX_USER_CHANNELS;
+    passHash(name,"pw",sha1buf_user);
+  }
+  int Run() { return 1; }
+};
+
+static IUserInfoLookup *createLookup(char *username) { return new testUserLookup(username); }
+
+
+struct seenUser // a user as the delta client knows it
+{
+  WDL_String name;
+  unsigned int activemask;
+  WDL_String channels[MAX_USER_CHANNELS];
+};
+
+class testClient
+{
+public:
+  testClient(int port, const char *user, bool delta) : m_user(user), m_delta(delta)
+  {
+    JNL_Connection *c=new JNL_Connection(JNL_CONNECTION_AUTODNS,65536,65536);
+    c->connect("127.0.0.1",port);
+    m_con.attach(c);
+    m_authed=0;
+    m_errors=0;
+    m_change_notifies=0;
+  }
+  ~testClient() { m_seen.Empty(true); }
+
+  void Run()
+  {
+    Net_Message *msg;
+    while (!m_con.GetStatus() && (msg=m_con.Run()))
+    {
+      msg->addRef();
+      OnMessage(msg);
+      msg->releaseRef();
+    }
+  }
+
+  void SetChannels(int n, const char *prefix)
+  {
+    mpb_client_set_channel_info ci;
+    for (int x = 0; x < n; x ++)
+    {
+      char buf[64];
+      snprintf(buf,sizeof(buf),"%s%d",prefix,x);
+      ci.build_add_rec(buf,0,0,0);
+    }
+    m_con.Send(ci.build());
+  }
+  void SubscribeId(int id)
+  {
+    mpb_client_set_usermask_id um;
+    um.build_add_rec(id,1);
+    m_con.Send(um.build());
+  }
+
+  int FindSeen(const char *name) // id, or -1
+  {
+    for (int x = 0; x < m_seen.GetSize(); x ++)
+      if (m_seen.Get(x) && !strcmp(m_seen.Get(x)->name.Get(),name)) return x;
+    return -1;
+  }
+  unsigned int SeenMask(const char *name) { const int id=FindSeen(name); return id < 0 ? 0 : m_seen.Get(id)->activemask; }
+
+  int m_authed;
+  int m_errors; // deltas that don't fit what the client was told before
+  int m_change_notifies;
+  WDL_PtrList<seenUser> m_seen; // by id
+
+private:
+  void OnMessage(Net_Message *msg)
+  {
+    switch (msg->get_type())
+    {
+      case MESSAGE_SERVER_AUTH_CHALLENGE:
+        {
+          mpb_server_auth_challenge cha;
+          if (!cha.parse(msg))
+          {
+            mpb_client_auth_user repl;
+            repl.username=(char *)m_user;
+            repl.client_version=PROTO_VER_CUR;
+            if (m_delta && (cha.server_caps & SERVER_CAP_USERINFO_DELTA)) repl.client_caps|=CLIENT_CAP_USERINFO_DELTA;
+            passHash(m_user,"pw",repl.passhash);
+            WDL_SHA1 sha;
+            sha.add(repl.passhash,sizeof(repl.passhash));
+            sha.add(cha.challenge,sizeof(cha.challenge));
+            sha.result(repl.passhash);
+            m_con.Send(repl.build());
+          }
+        }
+      break;
+      case MESSAGE_SERVER_AUTH_REPLY:
+        {
+          mpb_server_auth_reply ar;
+          if (!ar.parse(msg)) m_authed=(ar.flag&1) ? 1 : -1;
+        }
+      break;
+      case MESSAGE_SERVER_USERINFO_CHANGE_NOTIFY:
+        m_change_notifies++;
+      break;
+      case MESSAGE_SERVER_USERINFO_DELTA:
+        {
+          mpb_server_userinfo_delta ud;
+          if (ud.parse(msg)) break;
+          int offs=0, t, id, cid=0, pan, flags;
+          short vol;
+          const char *name=NULL;
+          while ((offs=ud.parse_get_rec(offs,&t,&id,&cid,&vol,&pan,&flags,&name))>0)
+          {
+            while (m_seen.GetSize() <= id) m_seen.Add(NULL);
+            seenUser *u=m_seen.Get(id);
+            if (t == USERINFO_DELTA_ADD_USER)
+            {
+              if (u) m_errors++;
+              else
+              {
+                u=new seenUser;
+                u->name.Set(name);
+                u->activemask=0;
+                m_seen.Set(id,u);
+              }
+            }
+            else if (!u) m_errors++;
+            else if (t == USERINFO_DELTA_REMOVE_USER)
+            {
+              delete u;
+              m_seen.Set(id,NULL);
+            }
+            else if (cid >= MAX_USER_CHANNELS) m_errors++;
+            else if (t == USERINFO_DELTA_SET_CHANNEL)
+            {
+              u->activemask |= 1u<<cid;
+              u->channels[cid].Set(name);
+            }
+            else if (t == USERINFO_DELTA_REMOVE_CHANNEL)
+            {
+              if (!(u->activemask & (1u<<cid))) m_errors++;
+              u->activemask &= ~(1u<<cid);
+            }
+          }
+        }
+      break;
+    }
+  }
+
+  const char *m_user;
+  bool m_delta;
+  Net_Connection m_con;
+};
+
+
+static User_Group *g_group;
+static JNL_Listen *g_listen;
+static int g_port;
+static testClient *g_clients[8];
+
+static bool pump(time_t deadline)
+{
+  JNL_IConnection *con;
+  while ((con=g_listen->get_connect(2*65536,65536))) g_group->AddConnection(con);
+  g_group->Run();
+  for (int x = 0; x < 8; x ++) if (g_clients[x]) g_clients[x]->Run();
+#ifdef _WIN32
+  Sleep(1);
+#else
+  usleep(1000);
+#endif
+  return time(NULL) < deadline;
+}
+
+static void pumpMs(int ms)
+{
+  for (int x = 0; x < ms; x ++) pump(0);
+}
+
+static User_Connection *findConnection(const char *name)
+{
+  for (int x = 0; x < g_group->m_users.GetSize(); x ++)
+  {
+    User_Connection *u=g_group->m_users.Get(x);
+    if (u->m_auth_state > 0 && !strcmp(u->m_username.Get(),name)) return u;
+  }
+  return NULL;
+}
+
+static bool subscribed(User_Connection *u, const char *name)
+{
+  for (int x = 0; u && x < u->m_sublist.GetSize(); x ++)
+    if (!strcmp(u->m_sublist.Get(x)->username.Get(),name)) return true;
+  return false;
+}
+
+static bool rosterOwnersValid()
+{
+  for (int x = 0; x < g_group->m_roster.GetSize(); x ++)
+  {
+    User_RosterEntry *e=g_group->m_roster.Get(x);
+    if (e && e->owner && g_group->m_users.Find(e->owner) < 0) return false;
+  }
+  return true;
+}
+
+static testClient *login(int slot, const char *name, bool delta)
+{
+  testClient *c=new testClient(g_port,name,delta);
+  g_clients[slot]=c;
+  const time_t deadline=time(NULL)+10;
+  while (!c->m_authed && pump(deadline));
+  return c;
+}
+
+static void testGroup()
+{
+  int fails0=g_fails;
+
+  testClient *dave=login(0,"dave",true);
+  testClient *alice=login(1,"alice",false);
+  testClient *bob=login(2,"bob",false);
+  check(dave->m_authed == 1 && alice->m_authed == 1 && bob->m_authed == 1,"clients log in");
+  if (g_fails != fails0) return;
+
+  dave->SetChannels(1,"d");
+  alice->SetChannels(2,"a");
+  bob->SetChannels(1,"b");
+  time_t deadline=time(NULL)+10;
+  while (!(dave->SeenMask("alice") == 3 && dave->SeenMask("bob") == 1) && pump(deadline));
+  pumpMs(100);
+  check(dave->SeenMask("alice") == 3 && dave->SeenMask("bob") == 1,"the delta client sees the other users' channels");
+  check(dave->FindSeen("dave") < 0,"but not itself");
+  const int aid=dave->FindSeen("alice");
+  check(aid >= 0 && dave->m_seen.Get(aid)->channels[1].Get()[0] == 'a',"channel names");
+  check(dave->m_change_notifies == 0,"and is never sent MESSAGE_SERVER_USERINFO_CHANGE_NOTIFY");
+  check(alice->m_change_notifies > 0,"while the others are");
+
+  alice->SetChannels(1,"x");
+  deadline=time(NULL)+10;
+  while (dave->SeenMask("alice") != 1 && pump(deadline));
+  pumpMs(100);
+  check(dave->SeenMask("alice") == 1 && !strcmp(dave->m_seen.Get(aid)->channels[0].Get(),"x0"),"channel changes arrive as deltas");
+  check(dave->FindSeen("alice") == aid,"under the same id");
+
+  delete alice;
+  g_clients[1]=NULL;
+  deadline=time(NULL)+10;
+  while (dave->FindSeen("alice") >= 0 && pump(deadline));
+  check(dave->FindSeen("alice") < 0 && !g_group->FindRosterEntry("alice"),"a user who leaves is removed");
+  if (g_fails == fails0) printf("ok   the delta client's roster follows the users' channels\n");
+  fails0=g_fails;
+
+  // carol gets alice's id. hold the delta flush so dave hasn't been told yet when
+  // he subscribes by that id: it must not apply to carol
+  testClient *carol=login(1,"carol",false);
+  carol->SetChannels(1,"c");
+  deadline=time(NULL)+10;
+  User_RosterEntry *ce=NULL;
+  while (!(ce=g_group->FindRosterEntry("carol")) && pump(deadline));
+  check(ce && ce->id == aid,"the next user gets the free id");
+  check(g_group->m_delta_pending,"the change is waiting for the delta flush");
+  if (g_fails != fails0) return;
+#ifdef _WIN32
+  g_group->m_delta_flush_time=GetTickCount()+3600*1000;
+#else
+  g_group->m_delta_flush_time.tv_sec+=3600;
+#endif
+
+  User_Connection *dc=findConnection("dave");
+  dave->SubscribeId(aid);
+  pumpMs(300);
+  check(dave->FindSeen("carol") < 0,"(the flush is held)");
+  check(!subscribed(dc,"carol"),"a subscription by an id the client wasn't told about is ignored");
+
+#ifdef _WIN32
+  g_group->m_delta_flush_time=GetTickCount();
+#else
+  memset(&g_group->m_delta_flush_time,0,sizeof(g_group->m_delta_flush_time));
+#endif
+  deadline=time(NULL)+10;
+  while (dave->FindSeen("carol") != aid && pump(deadline));
+  check(dave->FindSeen("carol") == aid,"the delta client is told about the new user under the reused id");
+  dave->SubscribeId(aid);
+  deadline=time(NULL)+10;
+  while (!subscribed(dc,"carol") && pump(deadline));
+  check(subscribed(dc,"carol"),"and can then subscribe to it by id");
+  check(dave->m_errors == 0,"every delta fits what the client was told before");
+  if (g_fails == fails0) printf("ok   ids are reused, subscriptions by id check the serial\n");
+  fails0=g_fails;
+
+  // a second login as bob drops the first connection (ForgetConnection), whose user has to go
+  const int bid=dave->FindSeen("bob");
+  login(3,"bob",false);
+  deadline=time(NULL)+10;
+  while (dave->FindSeen("bob") >= 0 && pump(deadline));
+  check(bid >= 0 && dave->FindSeen("bob") < 0,"a user dropped by a login of the same name is removed for the delta client");
+  check(!g_group->FindRosterEntry("bob"),"and from the roster");
+  check(rosterOwnersValid(),"no roster entry refers to a deleted connection");
+  check(dave->m_errors == 0,"every delta fits what the client was told before");
+  if (g_fails == fails0) printf("ok   ForgetConnection removes a dropped connection's users\n");
+}
+
+int main(int argc, char **argv)
+{
+  g_verbose=argc > 1 && !strcmp(argv[1],"-v");
+
+  testCodec();
+
+  JNL::open_socketlib();
+  g_group=new User_Group;
+  g_group->CreateUserLookup=createLookup;
+  for (int port = 20590; port < 20690 && !g_listen; port ++)
+  {
+    JNL_Listen *l=new JNL_Listen(port,htonl(INADDR_LOOPBACK));
+    if (l->is_error()) delete l;
+    else { g_listen=l; g_port=port; }
+  }
+  if (!g_listen) check(false,"couldn't listen on loopback");
+  else testGroup();
+
+  for (int x = 0; x < 8; x ++) delete g_clients[x];
+  delete g_group;
+  delete g_listen;
+  JNL::close_socketlib();
+
+  printf("%s (%d failures)\n",g_fails ? "FAIL" : "OK",g_fails);
+  return g_fails ? 1 : 0;
+}